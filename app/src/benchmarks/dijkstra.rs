@@ -1,6 +1,5 @@
 use crate::*;
 use std::collections::{BTreeMap, HashMap};
-use std::path::PathBuf;
 use std::time::Instant;
 
 fn custom_split_nodes_text_file(
@@ -74,7 +73,7 @@ pub fn dijkstra_sec_0() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
 
-    let dir = PathBuf::from("/opt/data/ct_dij_CA");
+    let dir = super::data_dir("ct_dij_CA");
     let mut nodes = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -95,6 +94,7 @@ pub fn dijkstra_sec_0() -> Result<()> {
         .get_pt();
     let mut new = old.clone();
     let mut iterations = 0;
+    sc.enter_loop();
     while (iterations == 0 || old != new) && iterations < 5 {
         iterations += 1;
         old = new;
@@ -115,7 +115,7 @@ pub fn dijkstra_sec_0() -> Result<()> {
             }
             Box::new(res.into_iter()) as Box<dyn Iterator<Item = _>>
         }));
-        let reducer = mapper.reduce_by_key(Fn!(|(x, y)| min_distance(x, y)), NUM_PARTS);
+        let reducer = mapper.reduce_by_key(Fn!(|(x, y)| min_distance(x, y)), num_parts());
         nodes = reducer.map(Fn!(|node| custom_split_nodes_iterative(node)));
         nodes.cache();
         new = nodes
@@ -133,6 +133,7 @@ pub fn dijkstra_sec_0() -> Result<()> {
         let dur = now.elapsed().as_nanos() as f64 * 1e-9;
         println!("new = {:?}, elapsed time = {:?}", new, dur);
     }
+    sc.leave_loop();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!(
         "Finished after {:?} iterations, total time {:?}s",
@@ -151,7 +152,7 @@ pub fn dijkstra_unsec_0() -> Result<()> {
         //Item = (u32, u32)
     }));
 
-    let dir = PathBuf::from("/opt/data/pt_dij_CA");
+    let dir = super::data_dir("pt_dij_CA");
     let mut nodes = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -197,7 +198,7 @@ pub fn dijkstra_unsec_0() -> Result<()> {
             }
             Box::new(res.into_iter()) as Box<dyn Iterator<Item = _>>
         }));
-        let reducer = mapper.reduce_by_key(Fn!(|(x, y)| min_distance(x, y)), NUM_PARTS);
+        let reducer = mapper.reduce_by_key(Fn!(|(x, y)| min_distance(x, y)), num_parts());
         nodes = reducer.map(Fn!(|node| custom_split_nodes_iterative(node)));
         //result = nodes.collect().unwrap();
         //nodes = sc.parallelize(result.clone(), vec![], fe_mp.clone(), fd_mp.clone(), 1);
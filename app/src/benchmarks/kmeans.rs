@@ -1,7 +1,6 @@
 use crate::*;
 use rand::Rng;
 use serde_derive::{Deserialize, Serialize};
-use std::path::PathBuf;
 use std::time::Instant;
 use std::{collections::HashMap, env::temp_dir};
 
@@ -48,7 +47,7 @@ pub fn kmeans_sec_0() -> Result<()> {
     let now = Instant::now();
 
     // TODO: need to change dir
-    let dir = PathBuf::from("/opt/data/ct_km_41065");
+    let dir = super::data_dir("ct_km_41065");
     let deserializer = Box::new(Fn!(|file: Vec<u8>| {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
@@ -60,13 +59,13 @@ pub fn kmeans_sec_0() -> Result<()> {
             Some(deserializer),
         )
         .map(Fn!(|line: String| { parse_vector(line) }));
-    data_rdd.cache();
 
     let k = 10;
     let converge_dist = Text::new(Some(0.3f64), None::<Vec<u8>>);
     let mut k_points = data_rdd.secure_take(k).unwrap();
     let mut iter = 0;
     let mut temp_dist = Text::new(Some(100.0f64), None::<Vec<u8>>);
+    sc.enter_loop();
     while *temp_dist > *converge_dist && iter < 5 {
         //let k_points_ct = k_points.get_ct();
         let k_points_ = k_points.get_pt();
@@ -77,7 +76,7 @@ pub fn kmeans_sec_0() -> Result<()> {
             //    .collect::<Vec<_>>();
             (closest_point(&p, &k_points_), (p, 1))
         }));
-        let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), NUM_PARTS);
+        let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), num_parts());
         let new_points = point_stats
             .map(Fn!(|pair: (usize, (Vec<f64>, i32))| (
                 pair.0,
@@ -91,9 +90,12 @@ pub fn kmeans_sec_0() -> Result<()> {
             .unwrap();
 
         let mut tail_info = TailCompInfo::new();
-        tail_info.insert(&k_points);
+        //the enclave keeps k_points and temp_dist from the last iteration
+        if iter == 0 {
+            tail_info.insert(&k_points);
+            tail_info.insert(&temp_dist);
+        }
         tail_info.insert(&new_points);
-        tail_info.insert(&temp_dist);
         wrapper_tail_compute(&mut tail_info);
         k_points.update_from_tail_info(&tail_info);
         temp_dist.update_from_tail_info(&tail_info);
@@ -106,6 +108,8 @@ pub fn kmeans_sec_0() -> Result<()> {
 
         iter += 1;
     }
+    sc.leave_loop();
+    wrapper_free_tail_info();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("total time {:?} s, k_points = {:?}", dur, k_points.get_pt());
     Ok(())
@@ -121,7 +125,7 @@ pub fn kmeans_unsec_0() -> Result<()> {
     }));
 
     // TODO: need to change dir
-    let dir = PathBuf::from("/opt/data/pt_km_41065");
+    let dir = super::data_dir("pt_km_41065");
     let lines = sc.read_source(
         LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
         Some(deserializer),
@@ -140,7 +144,7 @@ pub fn kmeans_unsec_0() -> Result<()> {
     while temp_dist > converge_dist && iter < 5 {
         let k_points_c = k_points.clone();
         let closest = data_rdd.map(Fn!(move |p| { (closest_point(&p, &k_points_c), (p, 1)) }));
-        let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), NUM_PARTS);
+        let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), num_parts());
         let new_points = point_stats
             .map(Fn!(|pair: (usize, (Vec<f64>, i32))| (
                 pair.0,
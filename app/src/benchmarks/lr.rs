@@ -3,7 +3,6 @@ use deepsize::DeepSizeOf;
 use rand::Rng;
 use rand_distr::{Distribution, Normal};
 use serde_derive::{Deserialize, Serialize};
-use std::path::PathBuf;
 use std::time::Instant;
 
 #[derive(Serialize, Deserialize, DeepSizeOf, Default, Clone, Debug)]
@@ -20,9 +19,9 @@ pub fn lr_sec() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = (Vec<u8>, Vec<u8>)
     }));
 
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
     let dim = 2;
-    let dir = PathBuf::from("/opt/data/ct_lr_51072");
+    let dir = super::data_dir("ct_lr_51072");
     let points_rdd = sc.read_source(
         LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
         None,
@@ -30,6 +29,7 @@ pub fn lr_sec() -> Result<()> {
     );
     let mut w = (0..dim).map(|_| rng.gen::<f32>()).collect::<Vec<_>>(); //TODO: wrapper with Ciphertext?
     let now = Instant::now();
+    sc.enter_loop();
     for i in 0..3 {
         let w_c = w.clone();
         let g = points_rdd
@@ -56,6 +56,7 @@ pub fn lr_sec() -> Result<()> {
             .collect::<Vec<_>>();
         println!("{:?}: w = {:?}", i, w);
     }
+    sc.leave_loop();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("total time {:?} s", dur);
     println!("w = {:?}", w);
@@ -67,13 +68,13 @@ pub fn lr_sec() -> Result<()> {
 pub fn lr_unsec() -> Result<()> {
     let sc = Context::new()?;
 
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
     let dim = 2;
     let deserializer = Box::new(Fn!(|file: Vec<u8>| {
         bincode::deserialize::<Vec<Point>>(&file).unwrap() //Item = Point
     }));
 
-    let dir = PathBuf::from("/opt/data/pt_lr_51072");
+    let dir = super::data_dir("pt_lr_51072");
     let mut points_rdd = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -1,11 +1,10 @@
-use std::path::PathBuf;
 use vega::io::*;
 use vega::*;
 
 pub fn file_read_sec_0() -> Result<()> {
     let context = Context::new()?;
 
-    let dir = PathBuf::from("/opt/data/ct_lf");
+    let dir = super::data_dir("ct_lf");
     let deserializer = Box::new(Fn!(|file: Vec<u8>| {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
@@ -36,7 +35,7 @@ pub fn file_read_sec_0() -> Result<()> {
 pub fn file_read_unsec_0() -> Result<()> {
     let context = Context::new()?;
 
-    let dir = PathBuf::from("/opt/data/pt_lf");
+    let dir = super::data_dir("pt_lf");
     let deserializer = Box::new(Fn!(|file: Vec<u8>| {
         String::from_utf8(file)
             .unwrap()
@@ -31,9 +31,9 @@ pub fn group_by_sec_0() -> Result<()> {
 
 pub fn group_by_sec_1() -> Result<()> {
     let sc = Context::new()?;
-    let mut len = 1_000_000;
+    let mut len = 1_000_000 * super::bench_scale();
     let mut vec: Vec<(i32, i32)> = Vec::with_capacity(len);
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
     for _ in 0..len {
         vec.push((rng.gen(), rng.gen()));
     }
@@ -34,10 +34,10 @@ pub fn join_sec_0() -> Result<()> {
 //massive data
 pub fn join_sec_2() -> Result<()> {
     let sc = Context::new()?;
-    let len = 1_0000;
+    let len = 1_0000 * super::bench_scale();
     let mut vec0: Vec<(i32, i32)> = Vec::with_capacity(len);
     let mut vec1: Vec<(i32, i32)> = Vec::with_capacity(len);
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
     for _ in 0..len {
         vec0.push((rng.gen::<i32>() % 100, rng.gen()));
         vec1.push((rng.gen::<i32>() % 100, rng.gen()));
@@ -48,7 +48,7 @@ pub fn join_sec_2() -> Result<()> {
     let now = Instant::now();
     let rdd0 = sc.parallelize::<(i32, i32), _, _>(vec![], vec0_enc, 1);
     let rdd1 = sc.parallelize::<(i32, i32), _, _>(vec![], vec1_enc, 1);
-    let rdd2 = rdd1.join(rdd0.clone(), 1);
+    let rdd2 = rdd1.join(rdd0.clone(), num_parts());
     let _res = rdd2.secure_collect().unwrap();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("Total time {:?} s", dur);
@@ -58,10 +58,10 @@ pub fn join_sec_2() -> Result<()> {
 
 pub fn join_unsec_2() -> Result<()> {
     let sc = Context::new()?;
-    let len = 1_0000;
+    let len = 1_0000 * super::bench_scale();
     let mut vec0: Vec<(i32, i32)> = Vec::with_capacity(len);
     let mut vec1: Vec<(i32, i32)> = Vec::with_capacity(len);
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
     for _ in 0..len {
         vec0.push((rng.gen::<i32>() % 100, rng.gen()));
         vec1.push((rng.gen::<i32>() % 100, rng.gen()));
@@ -70,7 +70,7 @@ pub fn join_unsec_2() -> Result<()> {
     let now = Instant::now();
     let rdd0 = sc.parallelize(vec0, vec![], 1);
     let rdd1 = sc.parallelize(vec1, vec![], 1);
-    let rdd2 = rdd1.join(rdd0.clone(), 1);
+    let rdd2 = rdd1.join(rdd0.clone(), num_parts());
     let _res = rdd2.collect().unwrap();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("Total time {:?} s", dur);
@@ -1,8 +1,67 @@
 use crate::*;
+use deepsize::DeepSizeOf;
+use serde_derive::{Deserialize, Serialize};
 use std::collections::{BTreeMap, HashMap};
-use std::path::PathBuf;
 use std::time::Instant;
 
+//side of the square tiles the matrices are cut into, the inner dimension of
+//the data sets
+const TILE: u32 = 20;
+
+//a dense TILE x TILE block of a matrix, row-major. entries missing from the
+//input are zeros
+#[derive(Serialize, Deserialize, DeepSizeOf, Default, Clone, Debug)]
+pub struct Tile {
+    data: Vec<f64>,
+}
+
+impl Tile {
+    fn zeros() -> Self {
+        Tile {
+            data: vec![0.0; (TILE * TILE) as usize],
+        }
+    }
+
+    fn add(mut self, other: &Tile) -> Self {
+        if self.data.is_empty() {
+            return other.clone();
+        }
+        for (x, y) in self.data.iter_mut().zip(&other.data) {
+            *x += y;
+        }
+        self
+    }
+
+    fn mul(&self, other: &Tile) -> Self {
+        let n = TILE as usize;
+        let mut res = Tile::zeros();
+        for i in 0..n {
+            for p in 0..n {
+                let alpha = self.data[i * n + p];
+                if alpha != 0.0 {
+                    for j in 0..n {
+                        res.data[i * n + j] += alpha * other.data[p * n + j];
+                    }
+                }
+            }
+        }
+        res
+    }
+}
+
+//the entries ((row, col), v) of a partition gathered into the tiles they fall
+//in, keyed by the coordinates of the tile in the grid
+fn to_tiles(
+    entries: Box<dyn Iterator<Item = ((u32, u32), f64)>>,
+) -> Box<dyn Iterator<Item = ((u32, u32), Tile)>> {
+    let mut tiles = HashMap::new();
+    for ((i, j), v) in entries {
+        let tile = tiles.entry((i / TILE, j / TILE)).or_insert_with(Tile::zeros);
+        tile.data[((i % TILE) * TILE + j % TILE) as usize] = v;
+    }
+    Box::new(tiles.into_iter())
+}
+
 // secure mode
 pub fn mm_sec_0() -> Result<()> {
     let sc = Context::new()?;
@@ -12,8 +71,8 @@ pub fn mm_sec_0() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
 
-    let dir_a = PathBuf::from("/opt/data/ct_mm_a_2000_20");
-    let dir_b = PathBuf::from("/opt/data/ct_mm_b_20_2000");
+    let dir_a = super::data_dir("ct_mm_a_2000_20");
+    let dir_b = super::data_dir("ct_mm_b_20_2000");
     let ma = sc
         .read_source(
             LocalFsReaderConfig::new(dir_a).num_partitions_per_executor(1),
@@ -30,13 +89,13 @@ pub fn mm_sec_0() -> Result<()> {
         .map(Fn!(|b: ((u32, u32), f64)| (b.0 .0, (b.0 .1, b.1))));
 
     let temp = ma
-        .join(mb, NUM_PARTS)
+        .join(mb, num_parts())
         .map(Fn!(|n: (u32, ((u32, f64), (u32, f64)))| (
             (n.1 .0 .0, n.1 .1 .0),
             n.1 .0 .1 * n.1 .1 .1
         )));
 
-    let mc = temp.reduce_by_key(Fn!(|(x, y)| x + y), NUM_PARTS);
+    let mc = temp.reduce_by_key(Fn!(|(x, y)| x + y), num_parts());
 
     let output = mc.secure_count().unwrap();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
@@ -53,8 +112,8 @@ pub fn mm_unsec_0() -> Result<()> {
         bincode::deserialize::<Vec<((u32, u32), f64)>>(&file).unwrap() //Item = ((u32, u32), f64)
     }));
 
-    let dir_a = PathBuf::from("/opt/data/pt_mm_a_2000_20");
-    let dir_b = PathBuf::from("/opt/data/pt_mm_b_20_2000");
+    let dir_a = super::data_dir("pt_mm_a_2000_20");
+    let dir_b = super::data_dir("pt_mm_b_20_2000");
     let ma = sc
         .read_source(
             LocalFsReaderConfig::new(dir_a).num_partitions_per_executor(1),
@@ -75,13 +134,107 @@ pub fn mm_unsec_0() -> Result<()> {
         }));
 
     let temp = ma
-        .join(mb, NUM_PARTS)
+        .join(mb, num_parts())
         .map(Fn!(|n: (u32, ((u32, f64), (u32, f64)))| (
             (n.1 .0 .0, n.1 .1 .0),
             n.1 .0 .1 * n.1 .1 .1
         )));
 
-    let mc = temp.reduce_by_key(Fn!(|(x, y)| x + y), NUM_PARTS);
+    let mc = temp.reduce_by_key(Fn!(|(x, y)| x + y), num_parts());
+
+    let output = mc.count().unwrap();
+    let dur = now.elapsed().as_nanos() as f64 * 1e-9;
+    println!("count = {:?}, total time = {:?}", output, dur);
+    Ok(())
+}
+
+// secure mode, on tiles
+pub fn mm_sec_1() -> Result<()> {
+    let sc = Context::new()?;
+    let now = Instant::now();
+
+    let deserializer = Box::new(Fn!(|file: Vec<u8>| {
+        bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
+    }));
+
+    let dir_a = super::data_dir("ct_mm_a_2000_20");
+    let dir_b = super::data_dir("ct_mm_b_20_2000");
+    let ma = sc
+        .read_source(
+            LocalFsReaderConfig::new(dir_a).num_partitions_per_executor(1),
+            None,
+            Some(deserializer.clone()),
+        )
+        .map_partitions(Fn!(|a: Box<dyn Iterator<Item = ((u32, u32), f64)>>| to_tiles(a)))
+        .reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts())
+        .map(Fn!(|a: ((u32, u32), Tile)| (a.0 .1, (a.0 .0, a.1))));
+    let mb = sc
+        .read_source(
+            LocalFsReaderConfig::new(dir_b).num_partitions_per_executor(1),
+            None,
+            Some(deserializer),
+        )
+        .map_partitions(Fn!(|b: Box<dyn Iterator<Item = ((u32, u32), f64)>>| to_tiles(b)))
+        .reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts())
+        .map(Fn!(|b: ((u32, u32), Tile)| (b.0 .0, (b.0 .1, b.1))));
+
+    let temp = ma
+        .join(mb, num_parts())
+        .map(Fn!(|n: (u32, ((u32, Tile), (u32, Tile)))| (
+            (n.1 .0 .0, n.1 .1 .0),
+            n.1 .0 .1.mul(&n.1 .1 .1)
+        )));
+
+    let mc = temp.reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts());
+
+    let output = mc.secure_count().unwrap();
+    let dur = now.elapsed().as_nanos() as f64 * 1e-9;
+    println!("count = {:?}, total time = {:?}", output, dur);
+    Ok(())
+}
+
+// unsecure mode, on tiles
+pub fn mm_unsec_1() -> Result<()> {
+    let sc = Context::new()?;
+    let now = Instant::now();
+
+    let deserializer = Box::new(Fn!(|file: Vec<u8>| {
+        bincode::deserialize::<Vec<((u32, u32), f64)>>(&file).unwrap() //Item = ((u32, u32), f64)
+    }));
+
+    let dir_a = super::data_dir("pt_mm_a_2000_20");
+    let dir_b = super::data_dir("pt_mm_b_20_2000");
+    let ma = sc
+        .read_source(
+            LocalFsReaderConfig::new(dir_a).num_partitions_per_executor(1),
+            Some(deserializer.clone()),
+            None,
+        )
+        .map_partitions(Fn!(|va: Box<dyn Iterator<Item = Vec<((u32, u32), f64)>>>| {
+            to_tiles(Box::new(va.flatten()))
+        }))
+        .reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts())
+        .map(Fn!(|a: ((u32, u32), Tile)| (a.0 .1, (a.0 .0, a.1))));
+    let mb = sc
+        .read_source(
+            LocalFsReaderConfig::new(dir_b).num_partitions_per_executor(1),
+            Some(deserializer),
+            None,
+        )
+        .map_partitions(Fn!(|vb: Box<dyn Iterator<Item = Vec<((u32, u32), f64)>>>| {
+            to_tiles(Box::new(vb.flatten()))
+        }))
+        .reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts())
+        .map(Fn!(|b: ((u32, u32), Tile)| (b.0 .0, (b.0 .1, b.1))));
+
+    let temp = ma
+        .join(mb, num_parts())
+        .map(Fn!(|n: (u32, ((u32, Tile), (u32, Tile)))| (
+            (n.1 .0 .0, n.1 .1 .0),
+            n.1 .0 .1.mul(&n.1 .1 .1)
+        )));
+
+    let mc = temp.reduce_by_key(Fn!(|(x, y): (Tile, Tile)| x.add(&y)), num_parts());
 
     let output = mc.count().unwrap();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
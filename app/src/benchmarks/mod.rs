@@ -32,9 +32,100 @@ mod pagerank;
 pub use pagerank::*;
 mod pearson;
 pub use pearson::*;
+mod switchless;
+pub use switchless::*;
 mod tc;
 pub use tc::*;
 mod topk;
 pub use topk::*;
 mod tri;
 pub use tri::*;
+
+use rand::SeedableRng;
+use rand_pcg::Pcg64;
+use std::path::PathBuf;
+
+pub struct Benchmark {
+    pub name: &'static str,
+    //"micro" or "macro", the harness selects by it too
+    pub group: &'static str,
+    pub run: fn() -> vega::Result<()>,
+}
+
+macro_rules! benchmarks {
+    ($($group:literal: [$($name:ident),* $(,)?]),* $(,)?) => {
+        pub const BENCHMARKS: &[Benchmark] = &[
+            $($(Benchmark {
+                name: stringify!($name),
+                group: $group,
+                run: $name,
+            },)*)*
+        ];
+    };
+}
+
+benchmarks! {
+    "micro": [
+        count_sec_0, count_unsec_0,
+        distinct_sec_0, distinct_unsec_0,
+        file_read_sec_0, file_read_unsec_0,
+        filter_sec_0, filter_unsec_0,
+        group_by_sec_0, group_by_sec_1,
+        join_sec_0, join_sec_2, join_unsec_2,
+        map_sec_0, map_unsec_0,
+        part_wise_sample_sec_0, part_wise_sample_unsec_0,
+        reduce_sec_0,
+        take_sec_0, take_unsec_0,
+        zip_sec_0,
+        switchless_cmp_0,
+    ],
+    "macro": [
+        dijkstra_sec_0, dijkstra_unsec_0,
+        kmeans_sec_0, kmeans_unsec_0,
+        lr_sec, lr_unsec,
+        mm_sec_0, mm_unsec_0, mm_sec_1, mm_unsec_1,
+        pagerank_sec_0, pagerank_unsec_0,
+        pearson_sec_0, pearson_unsec_0,
+        transitive_closure_sec_0, transitive_closure_sec_1,
+        transitive_closure_unsec_0, transitive_closure_unsec_1,
+        triangle_counting_sec_0, triangle_counting_unsec_0,
+        topk_sec_0, topk_unsec_0,
+    ],
+}
+
+pub fn find(name: &str) -> Option<&'static Benchmark> {
+    BENCHMARKS.iter().find(|b| b.name == name)
+}
+
+//the generator of all synthetic data, seeded by BENCH_SEED so that every run
+//of a benchmark sees the same input
+pub fn bench_rng() -> Pcg64 {
+    let seed = std::env::var("BENCH_SEED")
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .unwrap_or(0);
+    Pcg64::seed_from_u64(seed)
+}
+
+//times its base input a benchmark runs on, BENCH_SCALE, for the weak scaling of
+//`app scaling`. the synthetic inputs grow by it, see data_dir for the datasets
+pub fn bench_scale() -> usize {
+    std::env::var("BENCH_SCALE")
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .unwrap_or(1)
+        .max(1)
+}
+
+//where the prepared datasets live, /opt/data unless BENCH_DATA_DIR says otherwise.
+//at a scale above 1 the dataset is read from <name>_x<scale>, which `app gen` writes
+pub fn data_dir(name: &str) -> PathBuf {
+    let name = match bench_scale() {
+        1 => name.to_string(),
+        scale => format!("{}_x{}", name, scale),
+    };
+    std::env::var_os("BENCH_DATA_DIR")
+        .map(PathBuf::from)
+        .unwrap_or_else(|| PathBuf::from("/opt/data"))
+        .join(name)
+}
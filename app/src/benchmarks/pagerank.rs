@@ -1,6 +1,5 @@
 use crate::*;
 use std::collections::{BTreeMap, HashMap};
-use std::path::PathBuf;
 use std::time::Instant;
 
 // secure mode
@@ -13,7 +12,7 @@ pub fn pagerank_sec_0() -> Result<()> {
     }));
 
     let iters = 1;
-    let dir = PathBuf::from("/opt/data/ct_pr_cit-Patents");
+    let dir = super::data_dir("ct_pr_cit-Patents");
     let links = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -24,14 +23,14 @@ pub fn pagerank_sec_0() -> Result<()> {
             let parts = line.split(" ").collect::<Vec<_>>();
             (parts[0].to_string(), parts[1].to_string())
         }))
-        .distinct_with_num_partitions(NUM_PARTS)
-        .group_by_key(NUM_PARTS);
-    links.cache();
+        .distinct_with_num_partitions(num_parts())
+        .group_by_key(num_parts());
     let mut ranks = links.map_values(Fn!(|_| 1.0));
 
+    sc.enter_loop();
     for _ in 0..iters {
         let contribs = links
-            .join(ranks, NUM_PARTS)
+            .join(ranks, num_parts())
             .values()
             .flat_map(Fn!(|(urls, rank): (Vec<String>, f64)| {
                 let size = urls.len() as f64;
@@ -39,9 +38,10 @@ pub fn pagerank_sec_0() -> Result<()> {
                     as Box<dyn Iterator<Item = _>>
             }));
         ranks = contribs
-            .reduce_by_key(Fn!(|(x, y)| x + y), NUM_PARTS)
+            .reduce_by_key(Fn!(|(x, y)| x + y), num_parts())
             .map_values(Fn!(|v| 0.15 + 0.85 * v));
     }
+    sc.leave_loop();
 
     let output = ranks
         .secure_reduce(Fn!(|x: (String, f64), y: (String, f64)| {
@@ -71,7 +71,7 @@ pub fn pagerank_unsec_0() -> Result<()> {
     }));
 
     let iters = 1; //7 causes core dump, why? some hints: converge when 6
-    let dir = PathBuf::from("/opt/data/pt_pr_cit-Patents");
+    let dir = super::data_dir("pt_pr_cit-Patents");
     let lines = sc.read_source(
         LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
         Some(deserializer),
@@ -84,14 +84,14 @@ pub fn pagerank_unsec_0() -> Result<()> {
                 (parts[0].to_string(), parts[1].to_string())
             })) as Box<dyn Iterator<Item = _>>
         }))
-        .distinct_with_num_partitions(NUM_PARTS)
-        .group_by_key(NUM_PARTS);
+        .distinct_with_num_partitions(num_parts())
+        .group_by_key(num_parts());
     links.cache();
     let mut ranks = links.map_values(Fn!(|_| 1.0));
 
     for _ in 0..iters {
         let contribs = links
-            .join(ranks, NUM_PARTS)
+            .join(ranks, num_parts())
             .values()
             .flat_map(Fn!(|(urls, rank): (Vec<String>, f64)| {
                 let size = urls.len() as f64;
@@ -99,7 +99,7 @@ pub fn pagerank_unsec_0() -> Result<()> {
                     as Box<dyn Iterator<Item = _>>
             }));
         ranks = contribs
-            .reduce_by_key(Fn!(|(x, y)| x + y), NUM_PARTS)
+            .reduce_by_key(Fn!(|(x, y)| x + y), num_parts())
             .map_values(Fn!(|v| 0.15 + 0.85 * v));
     }
 
@@ -1,6 +1,5 @@
 use crate::*;
 use rand::Rng;
-use std::path::PathBuf;
 use std::time::Instant;
 
 // secure mode
@@ -12,8 +11,8 @@ pub fn pearson_sec_0() -> Result<()> {
     }));
 
     let now = Instant::now();
-    let dir0 = PathBuf::from("/opt/data/ct_pe_a_108");
-    let dir1 = PathBuf::from("/opt/data/ct_pe_b_108");
+    let dir0 = super::data_dir("ct_pe_a_108");
+    let dir1 = super::data_dir("ct_pe_b_108");
     let x = sc.read_source(
         LocalFsReaderConfig::new(dir0).num_partitions_per_executor(1),
         None,
@@ -59,8 +58,8 @@ pub fn pearson_unsec_0() -> Result<()> {
     }));
 
     let now = Instant::now();
-    let dir0 = PathBuf::from("/opt/data/pt_pe_a_108");
-    let dir1 = PathBuf::from("/opt/data/pt_pe_b_108");
+    let dir0 = super::data_dir("pt_pe_a_108");
+    let dir1 = super::data_dir("pt_pe_b_108");
     let x = sc
         .read_source(
             LocalFsReaderConfig::new(dir0).num_partitions_per_executor(1),
@@ -0,0 +1,28 @@
+use crate::benchmarks::{group_by_sec_1, map_sec_0};
+use std::time::Instant;
+use vega::*;
+
+// The ocall mode is fixed when the enclave is created, so the on/off comparison
+// takes two runs of this benchmark, one with VEGA_SWITCHLESS_WORKERS unset and one
+// with it set. The ops are the ones of micro_map and micro_group_by, so map_sec_0 and
+// group_by_sec_1 should be enabled in the enclave as well.
+pub fn switchless_cmp_0() -> Result<()> {
+    let mode = match std::env::var("VEGA_SWITCHLESS_WORKERS") {
+        Ok(n) => format!("switchless, {} untrusted workers", n),
+        Err(_) => "ordinary ocalls".to_string(),
+    };
+    println!("ocall mode: {}", mode);
+
+    let now = Instant::now();
+    map_sec_0()?;
+    let dur_map = now.elapsed().as_nanos() as f64 * 1e-9;
+    let now = Instant::now();
+    group_by_sec_1()?;
+    let dur_group_by = now.elapsed().as_nanos() as f64 * 1e-9;
+    println!(
+        "[{}] micro_map {:?} s, micro_group_by {:?} s",
+        mode, dur_map, dur_group_by
+    );
+    println!("Total time {:?} s", dur_map + dur_group_by);
+    Ok(())
+}
@@ -1,7 +1,6 @@
 use crate::*;
 use rand::Rng;
 use std::collections::HashSet;
-use std::path::PathBuf;
 use std::time::Instant;
 
 pub fn transitive_closure_sec_0() -> Result<()> {
@@ -13,7 +12,7 @@ pub fn transitive_closure_sec_0() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = (Vec<u8>)
     }));
 
-    let dir = PathBuf::from("/opt/data/ct_tc_fb");
+    let dir = super::data_dir("ct_tc_fb");
     let mut tc = sc.read_source(
         LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
         None,
@@ -25,20 +24,22 @@ pub fn transitive_closure_sec_0() -> Result<()> {
     let mut old_count = 0;
     let mut next_count = tc.secure_count().unwrap();
     let mut iter = 0;
+    sc.enter_loop();
     while next_count != old_count && iter < 5 {
         old_count = next_count;
         tc = tc
             .union(
-                tc.join(edges.clone(), NUM_PARTS)
+                tc.join(edges.clone(), num_parts())
                     .map(Fn!(|x: (u32, (u32, u32))| (x.1 .1, x.1 .0)))
                     .into(),
             )
-            .distinct_with_num_partitions(NUM_PARTS);
+            .distinct_with_num_partitions(num_parts());
         tc.cache();
         next_count = tc.secure_count().unwrap();
         iter += 1;
         println!("next_count = {:?}", next_count);
     }
+    sc.leave_loop();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("total time {:?}s", dur);
     Ok(())
@@ -48,7 +49,7 @@ pub fn transitive_closure_sec_1() -> Result<()> {
     let sc = Context::new()?;
     let num_edges = 50;
     let num_vertices = 20;
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
 
     let mut hset = HashSet::new();
     let mut count_edges = 0;
@@ -63,24 +64,26 @@ pub fn transitive_closure_sec_1() -> Result<()> {
     let data_enc = batch_encrypt(&hset.into_iter().collect::<Vec<_>>());
 
     let now = Instant::now();
-    let mut tc = sc.parallelize(vec![], data_enc.clone(), NUM_PARTS);
+    let mut tc = sc.parallelize(vec![], data_enc.clone(), num_parts());
     let edges = tc.map(Fn!(|x: (u32, u32)| (x.1, x.0)));
 
     let mut old_count = 0;
     let mut next_count = tc.secure_count().unwrap();
+    sc.enter_loop();
     while next_count != old_count {
         old_count = next_count;
         tc = tc
             .union(
-                tc.join(edges.clone(), NUM_PARTS)
+                tc.join(edges.clone(), num_parts())
                     .map(Fn!(|x: (u32, (u32, u32))| (x.1 .1, x.1 .0)))
                     .into(),
             )
-            .distinct_with_num_partitions(NUM_PARTS);
+            .distinct_with_num_partitions(num_parts());
         tc.cache();
         next_count = tc.secure_count().unwrap();
         println!("next_count = {:?}", next_count);
     }
+    sc.leave_loop();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("total time {:?}s", dur);
     Ok(())
@@ -94,7 +97,7 @@ pub fn transitive_closure_unsec_0() -> Result<()> {
         bincode::deserialize::<Vec<(u32, u32)>>(&file).unwrap() //Item = (u32, u32)
     }));
 
-    let dir = PathBuf::from("/opt/data/pt_tc_fb");
+    let dir = super::data_dir("pt_tc_fb");
     let mut tc = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -115,11 +118,11 @@ pub fn transitive_closure_unsec_0() -> Result<()> {
         old_count = next_count;
         tc = tc
             .union(
-                tc.join(edges.clone(), NUM_PARTS)
+                tc.join(edges.clone(), num_parts())
                     .map(Fn!(|x: (u32, (u32, u32))| (x.1 .1, x.1 .0)))
                     .into(),
             )
-            .distinct_with_num_partitions(NUM_PARTS);
+            .distinct_with_num_partitions(num_parts());
         tc.cache();
         next_count = tc.count().unwrap();
         iter += 1;
@@ -134,7 +137,7 @@ pub fn transitive_closure_unsec_1() -> Result<()> {
     let sc = Context::new()?;
     let num_edges = 100;
     let num_vertices = 50;
-    let mut rng = rand::thread_rng();
+    let mut rng = super::bench_rng();
 
     let mut hset = HashSet::new();
     let mut count_edges = 0;
@@ -149,7 +152,7 @@ pub fn transitive_closure_unsec_1() -> Result<()> {
     let data = hset.into_iter().collect::<Vec<_>>();
 
     let now = Instant::now();
-    let mut tc = sc.parallelize(data, vec![], NUM_PARTS);
+    let mut tc = sc.parallelize(data, vec![], num_parts());
     // Linear transitive closure: each round grows paths by one edge,
     // by joining the graph's edges with the already-discovered paths.
     // e.g. join the path (y, z) from the TC with the edge (x, y) from
@@ -165,7 +168,7 @@ pub fn transitive_closure_unsec_1() -> Result<()> {
         old_count = next_count;
         tc = tc
             .union(
-                tc.join(edges.clone(), NUM_PARTS)
+                tc.join(edges.clone(), num_parts())
                     .map(Fn!(|x: (u32, (u32, u32))| (x.1 .1, x.1 .0)))
                     .into(),
             )
@@ -1,5 +1,4 @@
 use rand::Rng;
-use std::path::PathBuf;
 use std::time::Instant;
 use vega::*;
 
@@ -12,7 +11,7 @@ pub fn topk_sec_0() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
 
-    let dir = PathBuf::from("/opt/data/ct_topk");
+    let dir = super::data_dir("ct_topk");
     let rdd0 = sc.read_source(LocalFsReaderConfig::new(dir), None, Some(deserializer));
     let rdd1 = rdd0.map(Fn!(|i: String| {
         let s = i.split("::").collect::<Vec<_>>();
@@ -68,7 +67,7 @@ pub fn topk_unsec_0() -> Result<()> {
         bincode::deserialize::<Vec<String>>(&file).unwrap()
     }));
 
-    let dir = PathBuf::from("/opt/data/pt_topk");
+    let dir = super::data_dir("pt_topk");
     let rdd0 = sc.read_source(LocalFsReaderConfig::new(dir), Some(deserializer), None);
     let rdd1 = rdd0.flat_map(Fn!(|v: Vec<String>| {
         Box::new(v.into_iter().map(|i| {
@@ -1,7 +1,6 @@
 use crate::*;
 use rand::Rng;
 use std::collections::HashSet;
-use std::path::PathBuf;
 use std::time::Instant;
 
 pub fn triangle_counting_sec_0() -> Result<()> {
@@ -12,7 +11,7 @@ pub fn triangle_counting_sec_0() -> Result<()> {
         bincode::deserialize::<Vec<Vec<u8>>>(&file).unwrap() //ItemE = Vec<u8>
     }));
 
-    let dir = PathBuf::from("/opt/data/ct_tri_soc-Slashdot0811");
+    let dir = super::data_dir("ct_tri_soc-Slashdot0811");
     let graph = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -27,13 +26,13 @@ pub fn triangle_counting_sec_0() -> Result<()> {
         .distinct();
     graph.cache();
     let count = graph
-        .join(graph.clone(), NUM_PARTS) //8, 9
+        .join(graph.clone(), num_parts()) //8, 9
         .key_by(Fn!(|item: &(u32, (u32, u32))| item.1)) //10
         .join(
             graph
                 .clone() //12, 13
                 .map(Fn!(|edge| (edge, 1 as i32))), //11
-            NUM_PARTS,
+            num_parts(),
         )
         .secure_count()
         .unwrap();
@@ -51,7 +50,7 @@ pub fn triangle_counting_unsec_0() -> Result<()> {
         bincode::deserialize::<Vec<(u32, u32)>>(&file).unwrap() //Item = (u32, u32)
     }));
 
-    let dir = PathBuf::from("/opt/data/pt_tri_soc-Slashdot0811");
+    let dir = super::data_dir("pt_tri_soc-Slashdot0811");
     let graph = sc
         .read_source(
             LocalFsReaderConfig::new(dir).num_partitions_per_executor(1),
@@ -69,9 +68,9 @@ pub fn triangle_counting_unsec_0() -> Result<()> {
         .distinct();
     graph.cache();
     let count = graph
-        .join(graph.clone(), NUM_PARTS)
+        .join(graph.clone(), num_parts())
         .key_by(Fn!(|item: &(u32, (u32, u32))| item.1))
-        .join(graph.clone().map(Fn!(|edge| (edge, 1 as i32))), NUM_PARTS)
+        .join(graph.clone().map(Fn!(|edge| (edge, 1 as i32))), num_parts())
         .count()
         .unwrap();
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
@@ -0,0 +1,112 @@
+//! `app gen KIND DIR [options] [key=value]...` writes a synthetic dataset with
+//! `vega::datagen`, encrypted unless `--plain`.
+//!
+//! The kinds and their parameters, with their defaults:
+//!
+//! - `rmat`: scale=16 edges=1000000 a=0.57 b=0.19 c=0.19 lines=false, for tc and tri, or
+//!   pagerank with lines=true
+//! - `points`: points=1000000 dim=2 clusters=10 stddev=1 skew=0, for kmeans
+//! - `matrix`: rows=2000 cols=20, for mm
+//! - `text`: lines=1000000 words=10 vocabulary=100000 skew=1
+//!
+//! `--files N` cuts it into N part files, `--node K --nodes N` writes only the parts of node K
+//! of N, `--seed S` and `--threads T` as in `GenConfig`.
+
+use std::collections::HashMap;
+use std::str::FromStr;
+
+use vega::datagen::{self, Dataset, GenConfig};
+
+const USAGE: &str = "usage: app gen rmat|points|matrix|text DIR [--files N] [--plain] [--seed S] \
+                     [--threads T] [--node K --nodes N] [key=value]...";
+
+struct Params(HashMap<String, String>);
+
+impl Params {
+    fn get<T: FromStr>(&mut self, key: &str, default: T) -> Result<T, String> {
+        match self.0.remove(key) {
+            Some(v) => v.parse().map_err(|_| format!("bad value for {}: {}", key, v)),
+            None => Ok(default),
+        }
+    }
+}
+
+fn dataset(kind: &str, params: &mut Params) -> Result<Dataset, String> {
+    Ok(match kind {
+        "rmat" => Dataset::Rmat {
+            scale: params.get("scale", 16)?,
+            edges: params.get("edges", 1_000_000)?,
+            a: params.get("a", 0.57)?,
+            b: params.get("b", 0.19)?,
+            c: params.get("c", 0.19)?,
+            lines: params.get("lines", false)?,
+        },
+        "points" => Dataset::Points {
+            points: params.get("points", 1_000_000)?,
+            dim: params.get("dim", 2)?,
+            clusters: params.get("clusters", 10)?,
+            stddev: params.get("stddev", 1.0)?,
+            skew: params.get("skew", 0.0)?,
+        },
+        "matrix" => Dataset::Matrix {
+            rows: params.get("rows", 2000)?,
+            cols: params.get("cols", 20)?,
+        },
+        "text" => Dataset::Text {
+            lines: params.get("lines", 1_000_000)?,
+            words: params.get("words", 10)?,
+            vocabulary: params.get("vocabulary", 100_000)?,
+            skew: params.get("skew", 1.0)?,
+        },
+        _ => return Err(format!("unknown dataset {}\n{}", kind, USAGE)),
+    })
+}
+
+fn gen_main(args: &[String]) -> Result<(), String> {
+    let (kind, dir) = match args {
+        [kind, dir, ..] if !dir.starts_with("--") => (kind, dir),
+        _ => return Err(USAGE.to_string()),
+    };
+    let mut params = Params(HashMap::new());
+    let mut options = Params(HashMap::new());
+    let mut plain = false;
+    let mut rest = args[2..].iter();
+    while let Some(arg) = rest.next() {
+        if arg == "--plain" {
+            plain = true;
+        } else if arg.starts_with("--") {
+            let value = rest.next().ok_or_else(|| format!("{} needs a value", arg))?;
+            options.0.insert(arg[2..].to_string(), value.clone());
+        } else {
+            let mut kv = arg.splitn(2, '=');
+            match (kv.next(), kv.next()) {
+                (Some(k), Some(v)) => params.0.insert(k.to_string(), v.to_string()),
+                _ => return Err(format!("expected key=value, got {}\n{}", arg, USAGE)),
+            };
+        }
+    }
+    let mut config = GenConfig::new(dataset(kind, &mut params)?, dir);
+    config.encrypted = !plain;
+    config.files = options.get("files", config.files)?;
+    config.seed = options.get("seed", config.seed)?;
+    config.threads = options.get("threads", config.threads)?;
+    config.node = options.get("node", config.node)?;
+    config.nodes = options.get("nodes", config.nodes)?;
+    if let Some(key) = params.0.keys().chain(options.0.keys()).next() {
+        return Err(format!("unknown parameter {} for {}\n{}", key, kind, USAGE));
+    }
+    let written = datagen::generate(&config).map_err(|e| e.to_string())?;
+    eprintln!("wrote {} files to {}", written.len(), dir);
+    Ok(())
+}
+
+//the exit code of `app gen`
+pub fn gen(args: &[String]) -> i32 {
+    match gen_main(args) {
+        Ok(()) => 0,
+        Err(e) => {
+            eprintln!("{}", e);
+            2
+        }
+    }
+}
@@ -0,0 +1,683 @@
+//! Runs a selection of the benchmarks a number of times and reports the timings as JSON.
+//!
+//! `app bench [options] [NAME|micro|macro|all]...` picks benchmarks by name or group, from the
+//! command line or from a TOML file given with `--config`, with the command line taking
+//! precedence. Every run is a fresh `app run <name>` process: the Context is a singleton and the
+//! enclave builds the op graph of a job only once per process, so a second run of a benchmark in
+//! the same process would not measure the same work. A run is timed by the "total time" the
+//! benchmark prints, or the wall time of its process if it prints none. The warm-up runs are
+//! dropped, the others are summed up into percentiles. With `--baseline` the report is compared
+//! to an earlier one and the harness exits with 1 if a median got slower by more than the
+//! threshold.
+//!
+//! Synthetic inputs are drawn from `bench_rng`, seeded by `--seed`, and the prepared datasets
+//! are read from `--data-dir`, so two runs with the same options see the same data.
+//!
+//! With `--overhead` every selected workload runs both as its `_sec` and its `_unsec` variant,
+//! and the gap between their medians is split into crypto, enclave transitions, outside memory
+//! allocation, EPC paging and serialization, from the `vega::overhead::Breakdown` the secure run
+//! prints. A transition and a page fault are not timed one by one, they are counted and costed
+//! at `--transition-us` and `--fault-us`, and the page faults are those the secure run took on
+//! top of the unsecure one. The calls into the tcmalloc of the outside memory run inside the
+//! enclave, they are costed at `--alloc-ns`, which `app tcbench` measures. What the parts do not
+//! explain is reported as `other_s`.
+//!
+//! With `--memory` every run samples its memory every `--memory-ms`, see `vega::memory_watch`:
+//! the peaks of the trusted heap of the enclaves, of the outside heap and of the RSS of the host,
+//! and the paging events, with the samples of the run with the median time. A benchmark listed
+//! under `[budgets]` in the config, by name or by group, is always sampled, and a peak over its
+//! budget, the highest of all its runs, makes the harness exit with 1 as a slower median does.
+
+use std::collections::HashMap;
+use std::env;
+use std::fs;
+use std::process::{Command, Stdio};
+use std::time::Instant;
+
+use serde_derive::{Deserialize, Serialize};
+
+use crate::benchmarks::{self, Benchmark, BENCHMARKS};
+use vega::memory_watch::MemoryReport;
+use vega::overhead::Breakdown;
+
+const USAGE: &str = "usage: app bench [--config FILE] [--warmup N] [--reps N] [--seed N] \
+                     [--data-dir DIR] [--out FILE] [--baseline FILE] [--threshold FRACTION] \
+                     [--overhead] [--transition-us US] [--fault-us US] [--alloc-ns NS] \
+                     [--memory] [--memory-ms MS] [NAME|micro|macro|all]...";
+
+//the line of `app run` that carries the breakdown of the run
+const BREAKDOWN_PREFIX: &str = "overhead breakdown ";
+//the line of `app run` that carries the memory of the run
+const MEMORY_PREFIX: &str = "memory peaks ";
+const MB: f64 = 1048576.0;
+
+//the most a benchmark may use, unset for no limit
+#[derive(Debug, Default, Deserialize)]
+#[serde(default)]
+struct Budget {
+    trusted_heap_mb: Option<f64>,
+    outside_heap_mb: Option<f64>,
+    host_rss_mb: Option<f64>,
+    epc_faults: Option<u64>,
+}
+
+#[derive(Debug, Deserialize)]
+#[serde(default)]
+struct Config {
+    benchmarks: Vec<String>,
+    warmup: usize,
+    repetitions: usize,
+    seed: u64,
+    data_dir: Option<String>,
+    output: Option<String>,
+    baseline: Option<String>,
+    //allowed slowdown of a median against the baseline, 0.1 is 10%
+    threshold: f64,
+    overhead: bool,
+    //the cost of one enclave transition and of one page fault, in microseconds
+    transition_us: f64,
+    fault_us: f64,
+    //the cost of one malloc or free on the outside heap, in nanoseconds
+    alloc_ns: f64,
+    memory: bool,
+    //between two samples of the memory of a run
+    memory_ms: u64,
+    //by benchmark name or group, a name wins over its group
+    budgets: HashMap<String, Budget>,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            benchmarks: vec![],
+            warmup: 1,
+            repetitions: 5,
+            seed: 0,
+            data_dir: None,
+            output: None,
+            baseline: None,
+            threshold: 0.1,
+            overhead: false,
+            transition_us: 4.0,
+            fault_us: 12.0,
+            alloc_ns: 100.0,
+            memory: false,
+            memory_ms: 100,
+            budgets: HashMap::new(),
+        }
+    }
+}
+
+impl Config {
+    fn budget(&self, bench: &Benchmark) -> Option<&Budget> {
+        self.budgets
+            .get(bench.name)
+            .or_else(|| self.budgets.get(bench.group))
+    }
+
+    fn samples_memory(&self, bench: &Benchmark) -> bool {
+        self.memory || self.budget(bench).is_some()
+    }
+}
+
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct Stats {
+    min_s: f64,
+    mean_s: f64,
+    stddev_s: f64,
+    p50_s: f64,
+    p90_s: f64,
+    p99_s: f64,
+    max_s: f64,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct BenchResult {
+    name: String,
+    group: String,
+    samples_s: Vec<f64>,
+    #[serde(flatten)]
+    stats: Stats,
+    //of the run with the median time, when asked for
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    breakdown: Option<Breakdown>,
+    //the peaks of all runs, the samples of the run with the median time
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    memory: Option<MemoryReport>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    error: Option<String>,
+}
+
+//where the time a secure run takes over its unsecure twin goes
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct Overhead {
+    secure: String,
+    unsecure: String,
+    secure_p50_s: f64,
+    unsecure_p50_s: f64,
+    gap_s: f64,
+    crypto_s: f64,
+    transitions_s: f64,
+    outside_alloc_s: f64,
+    paging_s: f64,
+    serialization_s: f64,
+    other_s: f64,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct Report {
+    seed: u64,
+    warmup: usize,
+    repetitions: usize,
+    results: Vec<BenchResult>,
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    overhead: Vec<Overhead>,
+}
+
+fn parse_args(args: &[String]) -> Result<Config, String> {
+    let mut config = Config::default();
+    //the config file first, so that the other options override it wherever they appear
+    if let Some(i) = args.iter().position(|a| a == "--config") {
+        let path = args.get(i + 1).ok_or("--config needs a file")?;
+        let text = fs::read_to_string(path).map_err(|e| format!("{}: {}", path, e))?;
+        config = toml::from_str(&text).map_err(|e| format!("{}: {}", path, e))?;
+    }
+    let mut names = vec![];
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        let mut value = || {
+            args.next()
+                .cloned()
+                .ok_or_else(|| format!("{} needs a value", arg))
+        };
+        let number = |v: String| {
+            v.parse::<u64>()
+                .map_err(|_| format!("bad value for {}: {}", arg, v))
+        };
+        match arg.as_str() {
+            "--config" => {
+                value()?;
+            }
+            "--warmup" => config.warmup = number(value()?)? as usize,
+            "--reps" => config.repetitions = number(value()?)? as usize,
+            "--seed" => config.seed = number(value()?)?,
+            "--threshold" => {
+                let v = value()?;
+                config.threshold = v.parse().map_err(|_| format!("bad threshold {}", v))?;
+            }
+            "--data-dir" => config.data_dir = Some(value()?),
+            "--out" => config.output = Some(value()?),
+            "--baseline" => config.baseline = Some(value()?),
+            "--overhead" => config.overhead = true,
+            "--memory" => config.memory = true,
+            "--memory-ms" => config.memory_ms = number(value()?)?.max(1),
+            "--transition-us" | "--fault-us" | "--alloc-ns" => {
+                let v = value()?;
+                let cost = v.parse().map_err(|_| format!("bad value for {}: {}", arg, v))?;
+                match arg.as_str() {
+                    "--fault-us" => config.fault_us = cost,
+                    "--alloc-ns" => config.alloc_ns = cost,
+                    _ => config.transition_us = cost,
+                }
+            }
+            "-h" | "--help" => return Err(USAGE.to_string()),
+            a if a.starts_with("--") => return Err(format!("unknown option {}\n{}", a, USAGE)),
+            name => names.push(name.to_string()),
+        }
+    }
+    if !names.is_empty() {
+        config.benchmarks = names;
+    }
+    if config.repetitions == 0 {
+        return Err("at least one repetition is needed".to_string());
+    }
+    Ok(config)
+}
+
+fn select(names: &[String]) -> Result<Vec<&'static Benchmark>, String> {
+    if names.is_empty() {
+        return Err(format!("no benchmark selected\n{}", USAGE));
+    }
+    let mut selected: Vec<&'static Benchmark> = vec![];
+    for name in names {
+        let matched = BENCHMARKS
+            .iter()
+            .filter(|b| name == "all" || b.group == name || b.name == name)
+            .collect::<Vec<_>>();
+        if matched.is_empty() {
+            return Err(format!("unknown benchmark {}", name));
+        }
+        for b in matched {
+            if !selected.iter().any(|s| s.name == b.name) {
+                selected.push(b);
+            }
+        }
+    }
+    Ok(selected)
+}
+
+//the _sec and _unsec variants of a workload, if it has both
+fn twins(bench: &Benchmark) -> Option<(&'static Benchmark, &'static Benchmark)> {
+    let sec = bench.name.replacen("_unsec", "_sec", 1);
+    let unsec = sec.replacen("_sec", "_unsec", 1);
+    if sec == unsec {
+        return None;
+    }
+    Some((benchmarks::find(&sec)?, benchmarks::find(&unsec)?))
+}
+
+//every selected workload both ways, each pair next to each other
+fn with_twins(selected: Vec<&'static Benchmark>) -> Vec<&'static Benchmark> {
+    let mut all: Vec<&'static Benchmark> = vec![];
+    for bench in selected {
+        let pair = match twins(bench) {
+            Some((sec, unsec)) => vec![sec, unsec],
+            None => vec![bench],
+        };
+        for b in pair {
+            if !all.iter().any(|a| a.name == b.name) {
+                all.push(b);
+            }
+        }
+    }
+    all
+}
+
+//the seconds of the last "total time" line a benchmark printed
+pub(crate) fn reported_time(stdout: &str) -> Option<f64> {
+    stdout.lines().rev().find_map(|line| {
+        let lower = line.to_lowercase();
+        let rest = &lower[lower.find("total time")? + "total time".len()..];
+        let rest = rest.trim_start_matches(|c: char| c == ' ' || c == '=' || c == ':');
+        let end = rest
+            .find(|c: char| !(c.is_ascii_digit() || c == '.' || c == 'e' || c == '-'))
+            .unwrap_or(rest.len());
+        rest[..end].parse().ok()
+    })
+}
+
+//the run of a benchmark: its time, and what it printed of its overheads and its memory
+type RunOutput = (f64, Option<Breakdown>, Option<MemoryReport>);
+
+//the payload of the last line of stdout that starts with prefix
+pub(crate) fn find_line<T: serde::de::DeserializeOwned>(stdout: &str, prefix: &str) -> Option<T> {
+    stdout
+        .lines()
+        .rev()
+        .find(|line| line.starts_with(prefix))
+        .and_then(|line| serde_json::from_str(&line[prefix.len()..]).ok())
+}
+
+fn run_once(bench: &Benchmark, config: &Config) -> Result<RunOutput, String> {
+    let exe = env::current_exe().map_err(|e| e.to_string())?;
+    let mut cmd = Command::new(exe);
+    cmd.args(&["run", bench.name])
+        .env("BENCH_SEED", config.seed.to_string())
+        .stdin(Stdio::null())
+        .stdout(Stdio::piped())
+        .stderr(Stdio::inherit());
+    if let Some(dir) = &config.data_dir {
+        cmd.env("BENCH_DATA_DIR", dir);
+    }
+    if config.overhead {
+        cmd.env("BENCH_OVERHEAD", "1");
+    }
+    if config.samples_memory(bench) {
+        cmd.env("BENCH_MEMORY_MS", config.memory_ms.to_string());
+    }
+    let start = Instant::now();
+    let output = cmd.output().map_err(|e| e.to_string())?;
+    let wall = start.elapsed().as_secs_f64();
+    let stdout = String::from_utf8_lossy(&output.stdout);
+    if !output.status.success() {
+        eprint!("{}", stdout);
+        return Err(format!("exited with {}", output.status));
+    }
+    let breakdown = find_line(&stdout, BREAKDOWN_PREFIX);
+    let memory = find_line(&stdout, MEMORY_PREFIX);
+    Ok((reported_time(&stdout).unwrap_or(wall), breakdown, memory))
+}
+
+//what `app run` prints after the benchmark when the harness asks for the breakdown
+pub fn print_breakdown() {
+    if env::var_os("BENCH_OVERHEAD").is_some() {
+        let breakdown = vega::overhead::breakdown();
+        println!("{}{}", BREAKDOWN_PREFIX, serde_json::to_string(&breakdown).unwrap());
+    }
+}
+
+//what `app run` starts before the benchmark when the harness asks for its memory
+pub fn start_memory_watch() {
+    let ms = env::var("BENCH_MEMORY_MS")
+        .ok()
+        .and_then(|ms| ms.parse::<u64>().ok());
+    if let Some(ms) = ms {
+        vega::memory_watch::start(std::time::Duration::from_millis(ms.max(1)));
+    }
+}
+
+//what `app run` prints after the benchmark when the harness asks for its memory
+pub fn print_memory() {
+    if env::var_os("BENCH_MEMORY_MS").is_some() {
+        let memory = vega::memory_watch::report();
+        println!("{}{}", MEMORY_PREFIX, serde_json::to_string(&memory).unwrap());
+    }
+}
+
+//nearest rank, of sorted samples
+fn percentile(sorted: &[f64], q: f64) -> f64 {
+    let rank = (q * sorted.len() as f64).ceil() as usize;
+    sorted[rank.max(1).min(sorted.len()) - 1]
+}
+
+fn stats(samples: &[f64]) -> Stats {
+    if samples.is_empty() {
+        return Stats::default();
+    }
+    let mut sorted = samples.to_vec();
+    sorted.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let n = sorted.len() as f64;
+    let mean = sorted.iter().sum::<f64>() / n;
+    let var = sorted.iter().map(|s| (s - mean) * (s - mean)).sum::<f64>() / n;
+    Stats {
+        min_s: sorted[0],
+        mean_s: mean,
+        stddev_s: var.sqrt(),
+        p50_s: percentile(&sorted, 0.5),
+        p90_s: percentile(&sorted, 0.9),
+        p99_s: percentile(&sorted, 0.99),
+        max_s: sorted[sorted.len() - 1],
+    }
+}
+
+fn run(bench: &Benchmark, config: &Config) -> BenchResult {
+    let mut samples = vec![];
+    let mut breakdowns = vec![];
+    let mut memories = vec![];
+    let mut error = None;
+    for i in 0..config.warmup + config.repetitions {
+        let warm = i < config.warmup;
+        match run_once(bench, config) {
+            Ok((secs, breakdown, memory)) => {
+                eprintln!(
+                    "{} {} {}: {:.3} s",
+                    bench.name,
+                    if warm { "warm-up" } else { "run" },
+                    i + 1,
+                    secs
+                );
+                if !warm {
+                    samples.push(secs);
+                    breakdowns.push(breakdown);
+                    memories.push(memory);
+                }
+            }
+            Err(e) => {
+                eprintln!("{} failed: {}", bench.name, e);
+                error = Some(e);
+                break;
+            }
+        }
+    }
+    let stats = stats(&samples);
+    let median = samples.iter().position(|s| *s == stats.p50_s);
+    let breakdown = median.and_then(|i| breakdowns[i].take());
+    let memory = median
+        .and_then(|i| memories[i].clone())
+        .map(|median| peaks_of(median, memories.iter().flatten()));
+    BenchResult {
+        name: bench.name.to_string(),
+        group: bench.group.to_string(),
+        stats,
+        samples_s: samples,
+        breakdown,
+        memory,
+        error,
+    }
+}
+
+//the samples of one run with the highest peaks of all
+fn peaks_of<'a>(
+    mut memory: MemoryReport,
+    runs: impl Iterator<Item = &'a MemoryReport>,
+) -> MemoryReport {
+    for run in runs {
+        memory.peak_trusted_heap_bytes = memory
+            .peak_trusted_heap_bytes
+            .max(run.peak_trusted_heap_bytes);
+        memory.peak_outside_heap_bytes = memory
+            .peak_outside_heap_bytes
+            .max(run.peak_outside_heap_bytes);
+        memory.peak_host_rss_bytes = memory.peak_host_rss_bytes.max(run.peak_host_rss_bytes);
+        memory.epc_faults = memory.epc_faults.max(run.epc_faults);
+    }
+    memory
+}
+
+//the benchmarks that used more than their budget, or printed no memory to check it against
+fn over_budget(results: &[BenchResult], config: &Config) -> Vec<String> {
+    let mut over = vec![];
+    for r in results.iter().filter(|r| r.error.is_none()) {
+        let budget = match benchmarks::find(&r.name).and_then(|b| config.budget(b)) {
+            Some(budget) => budget,
+            None => continue,
+        };
+        let memory = match &r.memory {
+            Some(memory) => memory,
+            None => {
+                eprintln!("{}: no memory report to check the budget against", r.name);
+                over.push(r.name.clone());
+                continue;
+            }
+        };
+        let mb = |bytes: u64| bytes as f64 / MB;
+        let checks = [
+            (
+                "trusted heap",
+                mb(memory.peak_trusted_heap_bytes),
+                budget.trusted_heap_mb,
+            ),
+            (
+                "outside heap",
+                mb(memory.peak_outside_heap_bytes),
+                budget.outside_heap_mb,
+            ),
+            (
+                "host rss",
+                mb(memory.peak_host_rss_bytes),
+                budget.host_rss_mb,
+            ),
+        ];
+        let mut exceeded = false;
+        for (what, peak, limit) in checks.iter() {
+            if let Some(limit) = limit {
+                let bad = peak > limit;
+                eprintln!(
+                    "{}: {} peak {:.1} MB of {:.1} MB{}",
+                    r.name,
+                    what,
+                    peak,
+                    limit,
+                    if bad { ", OVER BUDGET" } else { "" }
+                );
+                exceeded |= bad;
+            }
+        }
+        if let Some(limit) = budget.epc_faults {
+            let bad = memory.epc_faults > limit;
+            eprintln!(
+                "{}: {} paging events of {}{}",
+                r.name,
+                memory.epc_faults,
+                limit,
+                if bad { ", OVER BUDGET" } else { "" }
+            );
+            exceeded |= bad;
+        }
+        if exceeded {
+            over.push(r.name.clone());
+        }
+    }
+    over
+}
+
+fn decompose(sec: &BenchResult, unsec: &BenchResult, config: &Config) -> Option<Overhead> {
+    if sec.error.is_some() || unsec.error.is_some() {
+        return None;
+    }
+    let b = sec.breakdown.as_ref()?;
+    let t = config.transition_us * 1e-6;
+    let faults = |b: &Breakdown| b.minor_faults + b.major_faults;
+    //the unsecure run makes no transitions, but it faults in its pages too
+    let extra_faults = match &unsec.breakdown {
+        Some(u) => faults(b).saturating_sub(faults(u)),
+        None => faults(b),
+    };
+    let mut o = Overhead {
+        secure: sec.name.clone(),
+        unsecure: unsec.name.clone(),
+        secure_p50_s: sec.stats.p50_s,
+        unsecure_p50_s: unsec.stats.p50_s,
+        gap_s: sec.stats.p50_s - unsec.stats.p50_s,
+        crypto_s: b.crypto_s,
+        transitions_s: (b.ecalls + b.host_ocalls) as f64 * t + b.host_ocall_s,
+        outside_alloc_s: b.outside_alloc_ocalls as f64 * config.alloc_ns * 1e-9,
+        paging_s: extra_faults as f64 * config.fault_us * 1e-6,
+        serialization_s: b.ser_s + b.de_s,
+        other_s: 0.0,
+    };
+    o.other_s = o.gap_s
+        - o.crypto_s
+        - o.transitions_s
+        - o.outside_alloc_s
+        - o.paging_s
+        - o.serialization_s;
+    Some(o)
+}
+
+fn overheads(results: &[BenchResult], config: &Config) -> Vec<Overhead> {
+    let mut overheads = vec![];
+    for sec in results {
+        let unsec = match benchmarks::find(&sec.name).and_then(twins) {
+            Some((s, u)) if s.name == sec.name => results.iter().find(|r| r.name == u.name),
+            _ => None,
+        };
+        if let Some(o) = unsec.and_then(|unsec| decompose(sec, unsec, config)) {
+            let share = |s: f64| if o.gap_s > 0.0 { s / o.gap_s * 100.0 } else { 0.0 };
+            eprintln!(
+                "{}: {:.3} s over {}, crypto {:.0}%, transitions {:.0}%, outside alloc {:.0}%, \
+                 paging {:.0}%, serialization {:.0}%, other {:.0}%",
+                o.secure,
+                o.gap_s,
+                o.unsecure,
+                share(o.crypto_s),
+                share(o.transitions_s),
+                share(o.outside_alloc_s),
+                share(o.paging_s),
+                share(o.serialization_s),
+                share(o.other_s),
+            );
+            overheads.push(o);
+        }
+    }
+    overheads
+}
+
+//the benchmarks whose median got slower than the baseline by more than the threshold
+fn compare(report: &Report, baseline: &Report, threshold: f64) -> Vec<String> {
+    let base = baseline
+        .results
+        .iter()
+        .filter(|r| r.error.is_none())
+        .map(|r| (r.name.as_str(), r))
+        .collect::<HashMap<_, _>>();
+    let mut regressions = vec![];
+    for r in report.results.iter().filter(|r| r.error.is_none()) {
+        let b = match base.get(r.name.as_str()) {
+            Some(b) if b.stats.p50_s > 0.0 => b,
+            _ => {
+                eprintln!("{}: not in the baseline", r.name);
+                continue;
+            }
+        };
+        let change = r.stats.p50_s / b.stats.p50_s - 1.0;
+        let regressed = change > threshold;
+        eprintln!(
+            "{}: p50 {:.3} s against {:.3} s ({:+.1}%){}",
+            r.name,
+            r.stats.p50_s,
+            b.stats.p50_s,
+            change * 100.0,
+            if regressed { ", REGRESSION" } else { "" }
+        );
+        if regressed {
+            regressions.push(r.name.clone());
+        }
+    }
+    regressions
+}
+
+fn bench_main(args: &[String]) -> Result<i32, String> {
+    let config = parse_args(args)?;
+    let mut selected = select(&config.benchmarks)?;
+    if config.overhead {
+        selected = with_twins(selected);
+    }
+    //read it before the runs, a bad path should not cost a whole session
+    let baseline = match &config.baseline {
+        Some(path) => {
+            let text = fs::read_to_string(path).map_err(|e| format!("{}: {}", path, e))?;
+            let report: Report =
+                serde_json::from_str(&text).map_err(|e| format!("{}: {}", path, e))?;
+            Some(report)
+        }
+        None => None,
+    };
+    let results = selected.iter().map(|b| run(b, &config)).collect::<Vec<_>>();
+    let overhead = if config.overhead {
+        overheads(&results, &config)
+    } else {
+        vec![]
+    };
+    let report = Report {
+        seed: config.seed,
+        warmup: config.warmup,
+        repetitions: config.repetitions,
+        results,
+        overhead,
+    };
+    let json = serde_json::to_string_pretty(&report).map_err(|e| e.to_string())?;
+    match &config.output {
+        Some(path) => fs::write(path, json + "\n").map_err(|e| format!("{}: {}", path, e))?,
+        None => println!("{}", json),
+    }
+    let mut code = 0;
+    if report.results.iter().any(|r| r.error.is_some()) {
+        code = 1;
+    }
+    if let Some(baseline) = baseline {
+        let regressions = compare(&report, &baseline, config.threshold);
+        if !regressions.is_empty() {
+            eprintln!("regressed: {}", regressions.join(", "));
+            code = 1;
+        }
+    }
+    let over = over_budget(&report.results, &config);
+    if !over.is_empty() {
+        eprintln!("over budget: {}", over.join(", "));
+        code = 1;
+    }
+    Ok(code)
+}
+
+//the exit code of `app bench`
+pub fn bench(args: &[String]) -> i32 {
+    match bench_main(args) {
+        Ok(code) => code,
+        Err(e) => {
+            eprintln!("{}", e);
+            2
+        }
+    }
+}
+
@@ -23,8 +23,10 @@ use vega::*;
 
 pub mod benchmarks;
 use benchmarks::*;
-
-const NUM_PARTS: usize = 1;
+mod gen;
+mod harness;
+mod scaling;
+mod tcbench;
 
 macro_rules! numin {
     () => {{
@@ -37,6 +39,39 @@ macro_rules! numin {
 }
 
 fn main() -> Result<()> {
+    //`app bench ...` runs the harness, `app run <name>` one benchmark, `app list` lists them,
+    //`app gen ...` writes a dataset, `app tcbench ...` measures the outside heap, `app scaling
+    //...` sweeps the deployment, without arguments the benchmark picked below runs, as on the
+    //workers
+    let args = std::env::args().skip(1).collect::<Vec<_>>();
+    match args.first().map(|a| a.as_str()) {
+        Some("bench") => std::process::exit(harness::bench(&args[1..])),
+        Some("gen") => std::process::exit(gen::gen(&args[1..])),
+        Some("tcbench") => std::process::exit(tcbench::tcbench(&args[1..])),
+        Some("scaling") => std::process::exit(scaling::scaling(&args[1..])),
+        Some("list") => {
+            for b in benchmarks::BENCHMARKS {
+                println!("{} {}", b.group, b.name);
+            }
+            return Ok(());
+        }
+        Some("run") => match args.get(1).and_then(|name| benchmarks::find(name)) {
+            Some(b) => {
+                harness::start_memory_watch();
+                (b.run)()?;
+                harness::print_breakdown();
+                harness::print_memory();
+                scaling::print_stages();
+                return Ok(());
+            }
+            None => {
+                eprintln!("unknown benchmark {:?}, see `app list`", args.get(1));
+                std::process::exit(2);
+            }
+        },
+        _ => {}
+    }
+
     //Fn! will make the closures serializable. It is necessary. use serde_closure version 0.1.3.
     /* dijkstra */
     //dijkstra_sec_0()?;
@@ -56,6 +91,9 @@ fn main() -> Result<()> {
     //group_by_sec_0()?;
     //group_by_sec_1()?;
 
+    /* switchless, run once with VEGA_SWITCHLESS_WORKERS unset and once with it set */
+    //switchless_cmp_0()?;
+
     /* join */
     //join_sec_0()?;
     //join_sec_1()?;
@@ -105,6 +143,8 @@ fn main() -> Result<()> {
     /* matrix multipilication */
     //mm_sec_0()?;
     //mm_unsec_0()?;
+    //mm_sec_1()?;
+    //mm_unsec_1()?;
 
     /* page rank */
     //pagerank_sec_0()?;
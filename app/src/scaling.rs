@@ -0,0 +1,506 @@
+//! `app scaling [options] [NAME]...` sweeps one knob of the deployment at a time and reports
+//! the strong and the weak scaling curves of a few benchmarks as JSON.
+//!
+//! The knobs and the variables they set, with their default values:
+//!
+//! - `--nodes 1,2,...` the executors, the first N slaves of the hosts file, `VEGA_HOSTS_FILE` or
+//!   `~/hosts.conf`, each count in a hosts file of its own. By default 1 to all of them in
+//!   distributed mode, and no sweep in local mode
+//! - `--threads 1,2,4,8` the threads a shuffle of the enclave merges with, `VEGA_MAX_THREAD`
+//! - `--holders 1,2,4,8` the tasks of a stage in every enclave at once, `VEGA_STAGE_HOLDERS`
+//! - `--parts 1,2,4,8,16` the partitions of the shuffles, `VEGA_NUM_PARTS`
+//!
+//! A sweep changes one knob, the others stay as the environment sets them, and a knob given a
+//! single value is not swept. Every point is a fresh `app run <name>`, `--reps` times, and its
+//! time is the median. Strong scaling keeps the input, its efficiency is the speedup over the
+//! first value divided by the growth of the knob. Weak scaling grows the input with the knob,
+//! `BENCH_SCALE` for the benchmarks, see `benchmarks::bench_scale`, and its efficiency is the
+//! time of the first value over that of the point. `--mode strong|weak|both` picks the curves,
+//! both by default.
+//!
+//! Every run prints the enclave metrics of its stages, `vega::overhead::stages`, and a point
+//! keeps those of its median run. They are summed over the tasks of a stage, so a stage that
+//! scales keeps its sum under strong scaling and grows it with the input under weak scaling.
+//! The first point below `--min-efficiency`, 0.5 by default, is the knee of its curve, and the
+//! stage whose enclave time grew the most over that ideal is named as the one responsible.
+//!
+//! The default benchmarks are pagerank_sec_0, kmeans_sec_0, group_by_sec_1 and join_sec_2. The
+//! prepared datasets of pagerank and kmeans must exist at every scale of a weak sweep, see
+//! `benchmarks::data_dir`. Shuffle push sends to all the slaves of `~/hosts.conf` on the
+//! executors, keep it off for a sweep of the nodes.
+
+use std::env;
+use std::fs;
+use std::path::PathBuf;
+use std::process::{Command, Stdio};
+use std::time::Instant;
+
+use serde_derive::{Deserialize, Serialize};
+
+use crate::benchmarks::{self, Benchmark};
+use crate::harness;
+use vega::overhead::StageBreakdown;
+
+const USAGE: &str = "usage: app scaling [--nodes N,N,...] [--threads N,N,...] [--holders N,N,...] \
+                     [--parts N,N,...] [--mode strong|weak|both] [--warmup N] [--reps N] \
+                     [--seed N] [--data-dir DIR] [--min-efficiency F] [--out FILE] [NAME]...";
+
+//the line of `app run` that carries the stages of the run
+const STAGES_PREFIX: &str = "stage breakdown ";
+
+const DEFAULT_BENCHMARKS: &[&str] = &[
+    "pagerank_sec_0",
+    "kmeans_sec_0",
+    "group_by_sec_1",
+    "join_sec_2",
+];
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Knob {
+    Nodes,
+    Threads,
+    Holders,
+    Parts,
+}
+
+impl Knob {
+    fn name(self) -> &'static str {
+        match self {
+            Knob::Nodes => "nodes",
+            Knob::Threads => "threads",
+            Knob::Holders => "holders",
+            Knob::Parts => "parts",
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Mode {
+    Strong,
+    Weak,
+}
+
+impl Mode {
+    fn name(self) -> &'static str {
+        match self {
+            Mode::Strong => "strong",
+            Mode::Weak => "weak",
+        }
+    }
+}
+
+struct Config {
+    sweeps: Vec<(Knob, Vec<usize>)>,
+    modes: Vec<Mode>,
+    warmup: usize,
+    repetitions: usize,
+    seed: u64,
+    data_dir: Option<String>,
+    min_efficiency: f64,
+    output: Option<String>,
+    benchmarks: Vec<&'static Benchmark>,
+    //the hosts file the node counts are cut from, and its slaves
+    hosts: Option<(toml::value::Table, usize)>,
+}
+
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct Point {
+    value: usize,
+    //times its base input the run had
+    scale: usize,
+    samples_s: Vec<f64>,
+    p50_s: f64,
+    speedup: f64,
+    efficiency: f64,
+    //of the run with the median time
+    stages: Vec<StageBreakdown>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    error: Option<String>,
+}
+
+//where a curve stops scaling
+#[derive(Debug, Serialize, Deserialize)]
+struct Knee {
+    value: usize,
+    efficiency: f64,
+    //the stage whose enclave time grew the most over the ideal, and by how much
+    stage: Option<String>,
+    excess_s: f64,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct Curve {
+    benchmark: String,
+    knob: String,
+    mode: String,
+    points: Vec<Point>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    knee: Option<Knee>,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct Report {
+    seed: u64,
+    warmup: usize,
+    repetitions: usize,
+    curves: Vec<Curve>,
+}
+
+fn hosts_path() -> Option<PathBuf> {
+    env::var_os("VEGA_HOSTS_FILE")
+        .map(PathBuf::from)
+        .or_else(|| env::var_os("HOME").map(|home| PathBuf::from(home).join("hosts.conf")))
+}
+
+//the hosts file and the number of its slaves, None in local mode
+fn load_hosts() -> Result<Option<(toml::value::Table, usize)>, String> {
+    let distributed = env::var("VEGA_DEPLOYMENT_MODE").map_or(false, |m| m == "distributed");
+    let path = match hosts_path() {
+        Some(path) if distributed => path,
+        _ => return Ok(None),
+    };
+    let text = fs::read_to_string(&path).map_err(|e| format!("{}: {}", path.display(), e))?;
+    let hosts: toml::value::Table =
+        toml::from_str(&text).map_err(|e| format!("{}: {}", path.display(), e))?;
+    let slaves = hosts
+        .get("slaves")
+        .and_then(|s| s.as_array())
+        .map_or(0, |s| s.len());
+    Ok(Some((hosts, slaves)))
+}
+
+//a hosts file with the first n slaves of the one the sweep started with
+fn write_hosts(hosts: &toml::value::Table, n: usize) -> Result<PathBuf, String> {
+    let mut subset = hosts.clone();
+    if let Some(slaves) = subset.get_mut("slaves").and_then(|s| s.as_array_mut()) {
+        slaves.truncate(n);
+    }
+    let text = toml::to_string(&subset).map_err(|e| e.to_string())?;
+    let path = env::temp_dir().join(format!("vega-scaling-hosts-{}.conf", n));
+    fs::write(&path, text).map_err(|e| format!("{}: {}", path.display(), e))?;
+    Ok(path)
+}
+
+fn list(arg: &str, value: &str) -> Result<Vec<usize>, String> {
+    let values = value
+        .split(',')
+        .map(|n| n.trim().parse::<usize>())
+        .collect::<Result<Vec<_>, _>>()
+        .map_err(|_| format!("bad value for {}: {}", arg, value))?;
+    if values.is_empty() || values.contains(&0) {
+        return Err(format!("bad value for {}: {}", arg, value));
+    }
+    Ok(values)
+}
+
+fn parse_args(args: &[String]) -> Result<Config, String> {
+    let hosts = load_hosts()?;
+    let nodes = match &hosts {
+        Some((_, slaves)) if *slaves > 0 => (1..=*slaves).collect(),
+        _ => vec![1],
+    };
+    let mut config = Config {
+        sweeps: vec![
+            (Knob::Nodes, nodes),
+            (Knob::Threads, vec![1, 2, 4, 8]),
+            (Knob::Holders, vec![1, 2, 4, 8]),
+            (Knob::Parts, vec![1, 2, 4, 8, 16]),
+        ],
+        modes: vec![Mode::Strong, Mode::Weak],
+        warmup: 0,
+        repetitions: 3,
+        seed: 0,
+        data_dir: None,
+        min_efficiency: 0.5,
+        output: None,
+        benchmarks: vec![],
+        hosts,
+    };
+    let mut names = vec![];
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        if !arg.starts_with("--") {
+            names.push(arg.clone());
+            continue;
+        }
+        if arg == "--help" {
+            return Err(USAGE.to_string());
+        }
+        let value = args
+            .next()
+            .ok_or_else(|| format!("{} needs a value\n{}", arg, USAGE))?;
+        let bad = || format!("bad value for {}: {}", arg, value);
+        let knob = match arg.as_str() {
+            "--nodes" => Some(Knob::Nodes),
+            "--threads" => Some(Knob::Threads),
+            "--holders" => Some(Knob::Holders),
+            "--parts" => Some(Knob::Parts),
+            _ => None,
+        };
+        if let Some(knob) = knob {
+            let values = list(arg, value)?;
+            let sweep = config.sweeps.iter_mut().find(|(k, _)| *k == knob);
+            sweep.unwrap().1 = values;
+            continue;
+        }
+        match arg.as_str() {
+            "--mode" => {
+                config.modes = match value.as_str() {
+                    "strong" => vec![Mode::Strong],
+                    "weak" => vec![Mode::Weak],
+                    "both" => vec![Mode::Strong, Mode::Weak],
+                    _ => return Err(bad()),
+                }
+            }
+            "--warmup" => config.warmup = value.parse().map_err(|_| bad())?,
+            "--reps" => config.repetitions = value.parse().map_err(|_| bad())?,
+            "--seed" => config.seed = value.parse().map_err(|_| bad())?,
+            "--data-dir" => config.data_dir = Some(value.clone()),
+            "--min-efficiency" => config.min_efficiency = value.parse().map_err(|_| bad())?,
+            "--out" => config.output = Some(value.clone()),
+            _ => return Err(format!("unknown option {}\n{}", arg, USAGE)),
+        }
+    }
+    if config.repetitions == 0 {
+        return Err("at least one repetition is needed".to_string());
+    }
+    let nodes = &config.sweeps[0].1;
+    match &config.hosts {
+        Some((_, slaves)) if nodes.iter().all(|n| n <= slaves) => {}
+        _ if nodes.len() > 1 => {
+            return Err("--nodes needs distributed mode and that many slaves".to_string())
+        }
+        _ => {}
+    }
+    if names.is_empty() {
+        names = DEFAULT_BENCHMARKS.iter().map(|n| n.to_string()).collect();
+    }
+    for name in names {
+        let bench = benchmarks::find(&name).ok_or_else(|| format!("unknown benchmark {}", name))?;
+        config.benchmarks.push(bench);
+    }
+    Ok(config)
+}
+
+//the seconds of one run, and its stages
+fn run_once(
+    bench: &Benchmark,
+    config: &Config,
+    knob: Knob,
+    value: usize,
+    scale: usize,
+) -> Result<(f64, Vec<StageBreakdown>), String> {
+    let exe = env::current_exe().map_err(|e| e.to_string())?;
+    let mut cmd = Command::new(exe);
+    cmd.args(&["run", bench.name])
+        .env("BENCH_SEED", config.seed.to_string())
+        .env("BENCH_SCALE", scale.to_string())
+        .env("BENCH_STAGES", "1")
+        .stdin(Stdio::null())
+        .stdout(Stdio::piped())
+        .stderr(Stdio::inherit());
+    if let Some(dir) = &config.data_dir {
+        cmd.env("BENCH_DATA_DIR", dir);
+    }
+    match knob {
+        Knob::Nodes => {
+            let (hosts, _) = config.hosts.as_ref().ok_or("no hosts file")?;
+            cmd.env("VEGA_HOSTS_FILE", write_hosts(hosts, value)?);
+        }
+        Knob::Threads => {
+            cmd.env("VEGA_MAX_THREAD", value.to_string());
+        }
+        Knob::Holders => {
+            cmd.env("VEGA_STAGE_HOLDERS", value.to_string());
+        }
+        Knob::Parts => {
+            cmd.env("VEGA_NUM_PARTS", value.to_string());
+        }
+    }
+    let start = Instant::now();
+    let output = cmd.output().map_err(|e| e.to_string())?;
+    let wall = start.elapsed().as_secs_f64();
+    let stdout = String::from_utf8_lossy(&output.stdout);
+    if !output.status.success() {
+        eprint!("{}", stdout);
+        return Err(format!("exited with {}", output.status));
+    }
+    let stages = harness::find_line(&stdout, STAGES_PREFIX).unwrap_or_default();
+    Ok((harness::reported_time(&stdout).unwrap_or(wall), stages))
+}
+
+fn run_point(bench: &Benchmark, config: &Config, knob: Knob, value: usize, scale: usize) -> Point {
+    let mut point = Point {
+        value,
+        scale,
+        ..Default::default()
+    };
+    let mut runs = vec![];
+    for i in 0..config.warmup + config.repetitions {
+        eprintln!(
+            "{}: {} {} at scale {}, run {}",
+            bench.name,
+            knob.name(),
+            value,
+            scale,
+            i + 1
+        );
+        match run_once(bench, config, knob, value, scale) {
+            Ok(run) if i >= config.warmup => runs.push(run),
+            Ok(_) => {}
+            Err(e) => {
+                eprintln!("{}: {}", bench.name, e);
+                point.error = Some(e);
+                return point;
+            }
+        }
+    }
+    runs.sort_by(|a, b| a.0.partial_cmp(&b.0).unwrap());
+    point.samples_s = runs.iter().map(|run| run.0).collect();
+    let (p50_s, stages) = runs.swap_remove((runs.len() - 1) / 2);
+    point.p50_s = p50_s;
+    point.stages = stages;
+    point
+}
+
+//the stage whose enclave time at point grew the most over what it would be if it scaled,
+//the same sum over its tasks under strong scaling and that sum times the growth of the input
+//under weak scaling
+fn responsible(base: &Point, point: &Point, mode: Mode) -> (Option<String>, f64) {
+    let growth = match mode {
+        Mode::Strong => 1.0,
+        Mode::Weak => (point.scale / base.scale) as f64,
+    };
+    point
+        .stages
+        .iter()
+        .map(|stage| {
+            let before = base
+                .stages
+                .iter()
+                .find(|b| b.stage == stage.stage)
+                .map_or(0.0, |b| b.ecall_s);
+            (stage.stage.clone(), stage.ecall_s - before * growth)
+        })
+        .max_by(|a, b| a.1.partial_cmp(&b.1).unwrap())
+        .map_or((None, 0.0), |(stage, excess_s)| (Some(stage), excess_s))
+}
+
+fn curve(bench: &Benchmark, config: &Config, knob: Knob, values: &[usize], mode: Mode) -> Curve {
+    let first = values[0];
+    let mut points = vec![];
+    for &value in values {
+        let scale = match mode {
+            Mode::Strong => 1,
+            Mode::Weak if value % first == 0 => value / first,
+            Mode::Weak => {
+                eprintln!(
+                    "{}: {} {} is no multiple of {}, not in the weak curve",
+                    bench.name,
+                    knob.name(),
+                    value,
+                    first
+                );
+                continue;
+            }
+        };
+        points.push(run_point(bench, config, knob, value, scale));
+    }
+    let mut knee = None;
+    if let Some((base, rest)) = points.split_first_mut() {
+        base.speedup = 1.0;
+        base.efficiency = 1.0;
+        for point in rest.iter_mut() {
+            if base.error.is_some() || point.error.is_some() || point.p50_s <= 0.0 {
+                continue;
+            }
+            let ratio = base.p50_s / point.p50_s;
+            let growth = point.value as f64 / base.value as f64;
+            let (speedup, efficiency) = match mode {
+                Mode::Strong => (ratio, ratio / growth),
+                Mode::Weak => (ratio * point.scale as f64, ratio),
+            };
+            point.speedup = speedup;
+            point.efficiency = efficiency;
+            if knee.is_none() && efficiency < config.min_efficiency {
+                let (stage, excess_s) = responsible(base, point, mode);
+                knee = Some(Knee {
+                    value: point.value,
+                    efficiency,
+                    stage,
+                    excess_s,
+                });
+            }
+        }
+    }
+    Curve {
+        benchmark: bench.name.to_string(),
+        knob: knob.name().to_string(),
+        mode: mode.name().to_string(),
+        points,
+        knee,
+    }
+}
+
+//what `app run` prints after the benchmark when `app scaling` asks for its stages
+pub fn print_stages() {
+    if env::var_os("BENCH_STAGES").is_some() {
+        let stages = vega::overhead::stages();
+        println!("{}{}", STAGES_PREFIX, serde_json::to_string(&stages).unwrap());
+    }
+}
+
+fn scaling_main(args: &[String]) -> Result<i32, String> {
+    let config = parse_args(args)?;
+    let mut curves = vec![];
+    for bench in &config.benchmarks {
+        for (knob, values) in config.sweeps.iter().filter(|(_, values)| values.len() > 1) {
+            for &mode in &config.modes {
+                curves.push(curve(bench, &config, *knob, values, mode));
+            }
+        }
+    }
+    for c in &curves {
+        match &c.knee {
+            Some(knee) => eprintln!(
+                "{}: {} scaling over {} stops at {} ({:.0}% efficient), stage {} took {:.3} s more \
+                 in the enclave than it would if it scaled",
+                c.benchmark,
+                c.mode,
+                c.knob,
+                knee.value,
+                knee.efficiency * 100.0,
+                knee.stage.as_deref().unwrap_or("?"),
+                knee.excess_s
+            ),
+            None => eprintln!("{}: {} scaling over {} holds", c.benchmark, c.mode, c.knob),
+        }
+    }
+    let report = Report {
+        seed: config.seed,
+        warmup: config.warmup,
+        repetitions: config.repetitions,
+        curves,
+    };
+    let json = serde_json::to_string_pretty(&report).map_err(|e| e.to_string())?;
+    match &config.output {
+        Some(path) => fs::write(path, json + "\n").map_err(|e| format!("{}: {}", path, e))?,
+        None => println!("{}", json),
+    }
+    let failed = report
+        .curves
+        .iter()
+        .any(|c| c.points.iter().any(|p| p.error.is_some()));
+    Ok(failed as i32)
+}
+
+//the exit code of `app scaling`
+pub fn scaling(args: &[String]) -> i32 {
+    match scaling_main(args) {
+        Ok(code) => code,
+        Err(e) => {
+            eprintln!("{}", e);
+            2
+        }
+    }
+}
@@ -0,0 +1,65 @@
+//! `app tcbench [options]` runs the microbenchmark of the tcmalloc that manages the outside
+//! memory of the enclave, `vega::tcmalloc_bench`, once per thread count, and prints the results
+//! as JSON.
+//!
+//! `--threads 1,2,4` the thread counts, by default 1 to 64 in powers of two, clamped to the TCSs
+//! the enclave has left; `--ops N` malloc/free pairs per thread; `--dist ciphertext|small|large`
+//! the sizes; `--block-bytes N` the encryption block the ciphertexts are drawn around; `--shared`
+//! to have the threads free each other's objects; `--seed S`; `--out FILE` to write the JSON to
+//! a file. Half the time of a pair on one thread, `500 / mops` ns, is the cost of an
+//! allocation `app bench --alloc-ns` wants.
+
+use vega::tcmalloc_bench::{self, TcBenchConfig};
+
+const USAGE: &str = "usage: app tcbench [--threads N,N,...] [--ops N] \
+                     [--dist ciphertext|small|large] [--block-bytes N] [--shared] [--seed S] \
+                     [--out FILE]";
+
+fn tcbench_main(args: &[String]) -> Result<(), String> {
+    let mut config = TcBenchConfig::new();
+    let mut output = None;
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        if arg == "--shared" {
+            config.shared = true;
+            continue;
+        }
+        let value = args
+            .next()
+            .ok_or_else(|| format!("{} needs a value\n{}", arg, USAGE))?;
+        let bad = || format!("bad value for {}: {}", arg, value);
+        match arg.as_str() {
+            "--threads" => {
+                config.threads = value
+                    .split(',')
+                    .map(|n| n.trim().parse())
+                    .collect::<Result<_, _>>()
+                    .map_err(|_| bad())?
+            }
+            "--ops" => config.ops = value.parse().map_err(|_| bad())?,
+            "--dist" => config.dist = value.parse()?,
+            "--block-bytes" => config.block_bytes = value.parse().map_err(|_| bad())?,
+            "--seed" => config.seed = value.parse().map_err(|_| bad())?,
+            "--out" => output = Some(value.clone()),
+            _ => return Err(format!("unknown option {}\n{}", arg, USAGE)),
+        }
+    }
+    let results = tcmalloc_bench::run(&config);
+    let json = serde_json::to_string_pretty(&results).map_err(|e| e.to_string())?;
+    match output {
+        Some(path) => std::fs::write(&path, json).map_err(|e| format!("{}: {}", path, e))?,
+        None => println!("{}", json),
+    }
+    Ok(())
+}
+
+//the exit code of `app tcbench`
+pub fn tcbench(args: &[String]) -> i32 {
+    match tcbench_main(args) {
+        Ok(()) => 0,
+        Err(e) => {
+            eprintln!("{}", e);
+            2
+        }
+    }
+}
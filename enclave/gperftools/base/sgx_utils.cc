@@ -31,13 +31,17 @@
 #include <string.h>                     // for NULL, memset
 #include "base/commandlineflags.h"
 
-#define ENCLAVE_CPU_COUNT 4
+// Used until the host passes in the number of threads that may enter the
+// enclave, see SetSystemCPUsCount_ocall.
+#define ENCLAVE_DEFAULT_CPU_COUNT 4
+#define ENCLAVE_PAGE_SIZE 4096
 
 //From base/logging.cc 
 DEFINE_int32(verbose, EnvToInt("PERFTOOLS_VERBOSE", 0),
              "Set to numbers >0 for more verbose output, or <0 for less.  "
              "--verbose == -4 means we log fatal errors only.");
 
+static int enclave_cpu_count = ENCLAVE_DEFAULT_CPU_COUNT;
 
 extern "C" 
 {
@@ -46,7 +50,16 @@ const char* TCMallocGetenvSafe_ocall(const char* name) {
 }
 
 int GetSystemCPUsCount_ocall() {
-    return ENCLAVE_CPU_COUNT;
+    return enclave_cpu_count;
+}
+
+void SetSystemCPUsCount_ocall(int cpu_count) {
+    if (cpu_count > 0)
+        enclave_cpu_count = cpu_count;
+}
+
+int getpagesize_ocall() {
+    return ENCLAVE_PAGE_SIZE;
 }
 
 size_t write_ocall(int fd, const void *buf, size_t count) {
@@ -34,8 +34,8 @@
 
 #include <config.h>
 #include "base/spinlock.h"
-#ifndef TCMALLOC_SGX
 #include "base/spinlock_internal.h"
+#ifndef TCMALLOC_SGX
 #include "base/sysinfo.h"   /* for GetSystemCPUsCount() */
 #endif
 
@@ -88,10 +88,8 @@ Atomic32 SpinLock_ocall::SpinLoop() {
 
 void SpinLock_ocall::SlowLock() {
   Atomic32 lock_value = SpinLoop();
-  
-#ifndef TCMALLOC_SGX
+
   int lock_wait_call_count = 0;
-#endif
   while (lock_value != kSpinLockFree) {
     // If the lock is currently held, but not marked as having a sleeper, mark
     // it as having a sleeper.
@@ -118,11 +116,10 @@ void SpinLock_ocall::SlowLock() {
       }
     }
 
-#ifndef TCMALLOC_SGX  /*disable beacuse inside SGX can't do sleep*/
-    // Wait for an OS specific delay.
+    // Wait for an OS specific delay.  Inside SGX it parks the thread outside
+    // the enclave, see spinlock_sgx-inl.h.
     base_ocall::internal::SpinLockDelay(&lockword_, lock_value,
                                   ++lock_wait_call_count);
-#endif
     // Spin again after returning from the wait routine to give this thread
     // some chance of obtaining the lock.
     lock_value = SpinLoop();
@@ -130,8 +127,6 @@ void SpinLock_ocall::SlowLock() {
 }
 
 void SpinLock_ocall::SlowUnlock() {
-#ifndef TCMALLOC_SGX
   // wake waiter if necessary
   base_ocall::internal::SpinLockWake(&lockword_, false);
-#endif
 }
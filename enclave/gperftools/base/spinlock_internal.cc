@@ -45,9 +45,13 @@
 
 // forward declaration for use by spinlock_*-inl.h
 //namespace base { namespace internal { static int SuggestedDelayNS(int loop); }}
+#ifndef TCMALLOC_SGX
 namespace base_ocall { namespace internal { static int SuggestedDelayNS(int loop); }}
+#endif
 
-#if defined(_WIN32)
+#if defined(TCMALLOC_SGX)
+#include "base/spinlock_sgx-inl.h"
+#elif defined(_WIN32)
 #include "base/spinlock_win32-inl.h"
 #elif defined(__linux__)
 #include "base/spinlock_linux-inl.h"
@@ -55,6 +59,7 @@ namespace base_ocall { namespace internal { static int SuggestedDelayNS(int loop
 #include "base/spinlock_posix-inl.h"
 #endif
 
+#ifndef TCMALLOC_SGX
 //namespace base {
 namespace base_ocall {
 namespace internal {
@@ -102,3 +107,4 @@ static int SuggestedDelayNS(int loop) {
 
 } // namespace internal
 } // namespace base
+#endif  // TCMALLOC_SGX
@@ -0,0 +1,88 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// The SGX-specific part of spinlock_internal.cc.
+//
+// The enclave cannot make the futex and nanosleep syscalls the Linux and
+// Posix versions use, so a waiter used to spin until the lock was free,
+// burning its CPU for as long as a holder sat in an OCALL (pageheap_lock
+// across the sbrk_o of GrowHeap, for one).  Here a waiter spins for
+// kSpinLoopsBeforePark rounds of SpinLoop() and then parks on the
+// sgx_thread_cond of a bucket the lock word hashes to, which sleeps outside
+// the enclave on the untrusted event of its thread.  SpinLockWake()
+// broadcasts to the bucket, the waiters of other locks hashed there wake
+// up and park again.
+//
+// Unlike the futex wait there is no timeout: SpinLock_ocall::Unlock() calls
+// SpinLockWake() whenever the lock word it releases is kSpinLockSleeper,
+// and a waiter only parks after seeing that value with its bucket mutex
+// held, so it cannot miss the wakeup.
+
+#include <sgx_thread.h>                 // for sgx_thread_cond_wait
+
+//namespace base {
+namespace base_ocall {
+namespace internal {
+
+namespace {
+
+// SpinLoop() rounds a waiter spins before it parks, about 40us each with
+// the adaptive_spin_count of a multi-cpu machine.
+const int kSpinLoopsBeforePark = 2;
+
+const int kParkBuckets = 64;
+
+struct ParkBucket {
+  sgx_thread_mutex_t mutex;
+  sgx_thread_cond_t cond;
+  // Parked threads, so that an Unlock() without any skips the mutex.
+  volatile Atomic32 waiters;
+};
+
+#define PARK_BUCKET_INITIALIZER \
+  { SGX_THREAD_MUTEX_INITIALIZER, SGX_THREAD_COND_INITIALIZER, 0 }
+#define PARK_BUCKETS_8 \
+  PARK_BUCKET_INITIALIZER, PARK_BUCKET_INITIALIZER, PARK_BUCKET_INITIALIZER, \
+  PARK_BUCKET_INITIALIZER, PARK_BUCKET_INITIALIZER, PARK_BUCKET_INITIALIZER, \
+  PARK_BUCKET_INITIALIZER, PARK_BUCKET_INITIALIZER
+
+// Statically initialized, the locks are taken before any constructor runs.
+ParkBucket park_buckets[kParkBuckets] = {
+  PARK_BUCKETS_8, PARK_BUCKETS_8, PARK_BUCKETS_8, PARK_BUCKETS_8,
+  PARK_BUCKETS_8, PARK_BUCKETS_8, PARK_BUCKETS_8, PARK_BUCKETS_8,
+};
+
+#undef PARK_BUCKETS_8
+#undef PARK_BUCKET_INITIALIZER
+
+inline ParkBucket* BucketOf(volatile Atomic32 *w) {
+  uintptr_t addr = reinterpret_cast<uintptr_t>(w);
+  return &park_buckets[((addr >> 2) ^ (addr >> 9)) % kParkBuckets];
+}
+
+}  // namespace
+
+void SpinLockDelay(volatile Atomic32 *w, int32 value, int loop) {
+  if (loop < kSpinLoopsBeforePark) return;
+  ParkBucket* bucket = BucketOf(w);
+  sgx_thread_mutex_lock(&bucket->mutex);
+  // Counted before the lock word is read again, so that an Unlock() that
+  // frees it in between sees the waiter.
+  __sync_fetch_and_add(&bucket->waiters, 1);
+  if (__atomic_load_n(w, __ATOMIC_SEQ_CST) == value) {
+    sgx_thread_cond_wait(&bucket->cond, &bucket->mutex);
+  }
+  __sync_fetch_and_sub(&bucket->waiters, 1);
+  sgx_thread_mutex_unlock(&bucket->mutex);
+}
+
+void SpinLockWake(volatile Atomic32 *w, bool all) {
+  ParkBucket* bucket = BucketOf(w);
+  // The exchange of Unlock() that freed the lock word is a full barrier.
+  if (__atomic_load_n(&bucket->waiters, __ATOMIC_SEQ_CST) == 0) return;
+  sgx_thread_mutex_lock(&bucket->mutex);
+  sgx_thread_cond_broadcast(&bucket->cond);
+  sgx_thread_mutex_unlock(&bucket->mutex);
+}
+
+} // namespace internal
+} // namespace base
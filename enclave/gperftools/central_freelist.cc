@@ -52,32 +52,128 @@ void CentralFreeList::Init(size_t cl) {
   num_spans_ = 0;
   counter_ = 0;
 
-  max_cache_size_ = kMaxNumTransferEntries;
+  max_cache_size_ = MaxCacheSizeForCPUs(GetSystemCPUsCount_ocall());
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   // Disable the transfer cache for the small footprint case.
   cache_size_ = 0;
 #else
   cache_size_ = 16;
 #endif
-  if (cl > 0) {
+  cache_size_ = (min)(cache_size_, max_cache_size_);
+  used_slots_ = 0;
+  ASSERT(cache_size_ <= max_cache_size_);
+
+  shard_slots_ = (min)(kMaxSlotsPerShard,
+                       max_cache_size_ / kNumTransferShards);
+  lock_contentions_ = 0;
+  for (int i = 0; i < kNumTransferShards; ++i) {
+    shards_[i].used = 0;
+    shards_[i].contentions = 0;
+    shards_[i].hits = 0;
+  }
+}
+
+// The 1MB per size class budget below is sized for this many threads.
+static const int kTransferCacheBudgetCPUs = 4;
+
+int32_t CentralFreeList::MaxCacheSizeForCPUs(int num_cpus) {
+  int32_t max_cache_size = kMaxNumTransferEntries;
+  if (size_class_ > 0) {
     // Limit the maximum size of the cache based on the size class.  If this
     // is not done, large size class objects will consume a lot of memory if
     // they just sit in the transfer cache.
-    int32_t bytes = Static::sizemap()->ByteSizeForClass(cl);
-    int32_t objs_to_move = Static::sizemap()->num_objects_to_move(cl);
+    int32_t bytes = Static::sizemap()->ByteSizeForClass(size_class_);
+    int32_t objs_to_move = Static::sizemap()->num_objects_to_move(size_class_);
 
     ASSERT(objs_to_move > 0 && bytes > 0);
-    // Limit each size class cache to at most 1MB of objects or one entry,
-    // whichever is greater. Total transfer cache memory used across all
-    // size classes then can't be greater than approximately
-    // 1MB * kMaxNumTransferEntries.
+    // Limit each size class cache to at most 1MB of objects per
+    // kTransferCacheBudgetCPUs threads or one entry, whichever is greater.
+    // Total transfer cache memory used across all size classes then can't
+    // be greater than approximately 1MB * kMaxNumTransferEntries times the
+    // thread factor.
     // min and max are in parens to avoid macro-expansion on windows.
-    max_cache_size_ = (min)(max_cache_size_,
-                          (max)(1, (1024 * 1024) / (bytes * objs_to_move)));
-    cache_size_ = (min)(cache_size_, max_cache_size_);
+    int32_t budget = (1024 * 1024) *
+        (max)(1, num_cpus / kTransferCacheBudgetCPUs);
+    max_cache_size = (min)(max_cache_size,
+                         (max)(1, budget / (bytes * objs_to_move)));
   }
-  used_slots_ = 0;
+  return max_cache_size;
+}
+
+void CentralFreeList::ScaleCacheLimit(int num_cpus) {
+  SpinLockHolder h(&lock_);
+  max_cache_size_ = (max)(max_cache_size_, MaxCacheSizeForCPUs(num_cpus));
   ASSERT(cache_size_ <= max_cache_size_);
+  // Only grows, so batches already parked in the shards stay in bounds.
+  shard_slots_ = (max)(shard_slots_,
+                       (min)(kMaxSlotsPerShard,
+                             max_cache_size_ / kNumTransferShards));
+}
+
+CentralFreeList::TransferShard* CentralFreeList::CurrentShard() {
+  // sgx_thread_self() is derived from the TCS of the calling thread, so it
+  // is stable for a thread and distinct between threads.
+  uint64_t id = static_cast<uint64_t>(pthread_self());
+  id *= 0x9E3779B97F4A7C15ULL;
+  return &shards_[(id >> 32) % kNumTransferShards];
+}
+
+bool CentralFreeList::InsertToShard(void *start, void *end) {
+  if (shard_slots_ == 0) return false;
+  TransferShard* shard = CurrentShard();
+  if (!shard->lock.TryLock()) {
+    shard->lock.Lock();
+    shard->contentions++;
+  }
+  bool inserted = false;
+  if (shard->used < shard_slots_) {
+    TCEntry *entry = &shard->slots[shard->used++];
+    entry->head = start;
+    entry->tail = end;
+    shard->hits++;
+    inserted = true;
+  }
+  shard->lock.Unlock();
+  return inserted;
+}
+
+bool CentralFreeList::RemoveFromShard(void **start, void **end) {
+  if (shard_slots_ == 0) return false;
+  TransferShard* shard = CurrentShard();
+  // Quick check without taking the lock.
+  if (shard->used == 0) return false;
+  if (!shard->lock.TryLock()) {
+    shard->lock.Lock();
+    shard->contentions++;
+  }
+  bool removed = false;
+  if (shard->used > 0) {
+    TCEntry *entry = &shard->slots[--shard->used];
+    *start = entry->head;
+    *end = entry->tail;
+    shard->hits++;
+    removed = true;
+  }
+  shard->lock.Unlock();
+  return removed;
+}
+
+void CentralFreeList::LockCounted() {
+  if (!lock_.TryLock()) {
+    lock_.Lock();
+    lock_contentions_++;
+  }
+}
+
+void CentralFreeList::GetContentionStats(uint64_t* central_contentions,
+                                         uint64_t* shard_contentions,
+                                         uint64_t* shard_hits) {
+  // Read without the locks, the counters only ever grow.
+  *central_contentions += lock_contentions_;
+  for (int i = 0; i < kNumTransferShards; ++i) {
+    *shard_contentions += shards_[i].contentions;
+    *shard_hits += shards_[i].hits;
+  }
 }
 
 void CentralFreeList::ReleaseListToSpans(void* start) {
@@ -230,25 +326,29 @@ bool CentralFreeList::ShrinkCache(int locked_size_class, bool force)
 }
 
 void CentralFreeList::InsertRange(void *start, void *end, int N) {
-  SpinLockHolder h(&lock_);
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-    MakeCacheSpace()) {
+  const bool full_batch = (N == Static::sizemap()->num_objects_to_move(size_class_));
+  if (full_batch && InsertToShard(start, end)) return;
+  LockCounted();
+  if (full_batch && MakeCacheSpace()) {
     int slot = used_slots_++;
     ASSERT(slot >=0);
     ASSERT(slot < max_cache_size_);
     TCEntry *entry = &ocall_tc_slots_[slot];
     entry->head = start;
     entry->tail = end;
+    lock_.Unlock();
     return;
   }
   ReleaseListToSpans(start);
+  lock_.Unlock();
 }
 
 int CentralFreeList::RemoveRange(void **start, void **end, int N) {
   ASSERT(N > 0);
-  lock_.Lock();
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-      used_slots_ > 0) {
+  const bool full_batch = (N == Static::sizemap()->num_objects_to_move(size_class_));
+  if (full_batch && RemoveFromShard(start, end)) return N;
+  LockCounted();
+  if (full_batch && used_slots_ > 0) {
     int slot = --used_slots_;
     ASSERT(slot >= 0);
     TCEntry *entry = &ocall_tc_slots_[slot];
@@ -371,8 +471,16 @@ void CentralFreeList::Populate() {
 }
 
 int CentralFreeList::ocall_tc_length() {
-  SpinLockHolder h(&lock_);
-  return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_);
+  int32_t slots;
+  {
+    SpinLockHolder h(&lock_);
+    slots = used_slots_;
+  }
+  for (int i = 0; i < kNumTransferShards; ++i) {
+    SpinLockHolder h(&shards_[i].lock);
+    slots += shards_[i].used;
+  }
+  return slots * Static::sizemap()->num_objects_to_move(size_class_);
 }
 
 size_t CentralFreeList::OverheadBytes() {
@@ -57,6 +57,11 @@ class CentralFreeList {
 
   void Init(size_t cl);
 
+  // Raises the transfer cache limit of this size class for num_cpus
+  // threads contending on it.  The limit is never lowered, so slots that
+  // are already in use stay valid.
+  void ScaleCacheLimit(int num_cpus);
+
   // These methods all do internal locking.
 
   // Insert the specified range into the central freelist.  N is the number of
@@ -72,9 +77,18 @@ class CentralFreeList {
     return counter_;
   }
 
-  // Returns the number of free objects in the transfer cache.
+  // Returns the number of free objects in the transfer cache, including
+  // the batches parked in the transfer shards.
   int ocall_tc_length();
 
+  // Adds the contention counters of this size class to the arguments:
+  // how often lock_ and the shard locks were found held by another thread,
+  // and how many batches were handed over through a shard without taking
+  // lock_ at all.
+  void GetContentionStats(uint64_t* central_contentions,
+                          uint64_t* shard_contentions,
+                          uint64_t* shard_hits);
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
@@ -100,6 +114,36 @@ class CentralFreeList {
     void *tail;  // Tail of chain of objects.
   };
 
+  // Full batches are first exchanged through a few shards, each with its
+  // own lock, in front of the transfer cache.  Threads pick a shard by
+  // their thread id, so threads moving the same size class mostly take
+  // different locks and only fall back to lock_ when their shard is full
+  // (insert) or empty (remove).
+  static const int kNumTransferShards = 8;
+  static const int kMaxSlotsPerShard = 2;
+
+  struct TransferShard {
+    // Shards may be used before their constructor runs, like lock_.
+    TransferShard() : lock(base_ocall::LINKER_INITIALIZED) { }
+
+    SpinLock_ocall lock;
+    int32_t used;             // Number of used entries in slots
+    uint64_t contentions;     // Times lock was found held, under lock
+    uint64_t hits;            // Batches inserted or removed, under lock
+    TCEntry slots[kMaxSlotsPerShard];
+  };
+
+  // Returns the shard of the calling thread.
+  TransferShard* CurrentShard();
+
+  // Park/take a full batch in/from the shard of the calling thread.
+  // Return false if the shard is full/empty or disabled for this class.
+  bool InsertToShard(void *start, void *end);
+  bool RemoveFromShard(void **start, void **end);
+
+  // Acquires lock_, counting the acquisitions that had to wait.
+  void LockCounted() EXCLUSIVE_LOCK_FUNCTION(lock_);
+
   // A central cache freelist can have anywhere from 0 to kMaxNumTransferEntries
   // slots to put link list chains into.
 #ifdef TCMALLOC_SMALL_BUT_SLOW
@@ -112,6 +156,10 @@ class CentralFreeList {
   static const int kMaxNumTransferEntries = 64;
 #endif
 
+  // Maximum number of transfer cache slots for this size class when
+  // num_cpus threads may use it concurrently.
+  int32_t MaxCacheSizeForCPUs(int num_cpus);
+
   // REQUIRES: lock_ is held
   // Remove object from cache and return.
   // Return NULL if no free entries in cache.
@@ -187,6 +235,14 @@ class CentralFreeList {
   int32_t cache_size_;
   // Maximum size of the cache for a given size class.
   int32_t max_cache_size_;
+
+  // Number of usable slots per shard for this size class, 0 disables the
+  // shards.  Bounded so that the shards never hold more than the transfer
+  // cache is allowed to.
+  int32_t shard_slots_;
+  // Times lock_ was found held by another thread.  Updated under lock_.
+  uint64_t lock_contentions_;
+  TransferShard shards_[kNumTransferShards];
 };
 
 // Pads each CentralCache object to multiple of 64 bytes.  Since some
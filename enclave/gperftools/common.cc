@@ -120,6 +120,74 @@ int SizeMap::NumMoveSize(size_t size) {
 }
 
 // Initialize the mapping arrays
+size_t SizeMap::ClassPages(size_t size) {
+  int blocks_to_move = NumMoveSize(size) / 4;
+  size_t psize = 0;
+  do {
+    psize += kPageSize;
+    // Allocate enough pages so leftover is less than 1/8 of total.
+    // This bounds wasted space to at most 12.5%.
+    while ((psize % size) > (psize >> 3)) {
+      psize += kPageSize;
+    }
+    // Continue to add pages until there are at least as many objects in
+    // the span as are needed when moving objects from the central
+    // freelists and spans to the thread caches.
+  } while ((psize / size) < (blocks_to_move));
+  return psize >> kPageShift;
+}
+
+#ifdef TCMALLOC_SGX
+// Most of what the enclave allocates outside are the ciphertext blocks of
+// batch_encrypt (enclave/src/op/mod.rs): bincode of a Vec<T> with
+// MAX_ENC_BL (1024) items, i.e. an 8 byte length prefix plus
+// 1024 * sizeof(T), followed by the 16 byte AES-GCM tag.  The stock classes
+// put these up to 12.5% below the class size, so each gets a class of its
+// own.  The table was seeded from ocall_tc_size_histogram_top() on the
+// micro benchmarks and may be regenerated the same way for other
+// workloads; at most kMaxTunedClasses entries are used.
+static const size_t kTunedClassSizes[] = {
+  8 + 1024 * 4 + 16,    // i32, u32, f32
+  8 + 1024 * 8 + 16,    // i64, u64, f64, usize
+  8 + 1024 * 12 + 16,   // (i32, f64) etc. without padding
+  8 + 1024 * 16 + 16,   // (K, V) of two 8 byte fields
+  8 + 1024 * 24 + 16,   // three 8 byte fields
+  8 + 1024 * 32 + 16,   // four 8 byte fields
+  8 + 1024 * 48 + 16,
+  8 + 1024 * 64 + 16,
+};
+
+int SizeMap::AddTunedClasses(int sc) {
+  const int n = sizeof(kTunedClassSizes) / sizeof(kTunedClassSizes[0]);
+  for (int i = 0; i < n && sc < kNumClasses; ++i) {
+    size_t size = kTunedClassSizes[i];
+    if (size > kMaxSize) continue;
+    // Class boundaries have to fall on class_array_ entries, which are 128
+    // bytes apart above kMaxSmallSize.
+    const size_t granularity = (size <= kMaxSmallSize) ? kMinAlign : 128;
+    size = (size + granularity - 1) & ~(granularity - 1);
+
+    int pos = 1;
+    while (pos < sc && class_to_size_[pos] < size) pos++;
+    if (pos < sc && class_to_size_[pos] == size) continue;
+    for (int c = sc; c > pos; --c) {
+      class_to_size_[c] = class_to_size_[c-1];
+      class_to_pages_[c] = class_to_pages_[c-1];
+    }
+    class_to_size_[pos] = size;
+    class_to_pages_[pos] = ClassPages(size);
+    sc++;
+  }
+  // No size maps to these copies, they only keep kNumClasses constant.
+  while (sc < kNumClasses) {
+    class_to_size_[sc] = class_to_size_[sc-1];
+    class_to_pages_[sc] = class_to_pages_[sc-1];
+    sc++;
+  }
+  return sc;
+}
+#endif
+
 void SizeMap::Init() {
   InitTCMallocTransferNumObjects();
 
@@ -141,20 +209,7 @@ void SizeMap::Init() {
     alignment = AlignmentForSize(size);
     CHECK_CONDITION((size % alignment) == 0);
 
-    int blocks_to_move = NumMoveSize(size) / 4;
-    size_t psize = 0;
-    do {
-      psize += kPageSize;
-      // Allocate enough pages so leftover is less than 1/8 of total.
-      // This bounds wasted space to at most 12.5%.
-      while ((psize % size) > (psize >> 3)) {
-        psize += kPageSize;
-      }
-      // Continue to add pages until there are at least as many objects in
-      // the span as are needed when moving objects from the central
-      // freelists and spans to the thread caches.
-    } while ((psize / size) < (blocks_to_move));
-    const size_t my_pages = psize >> kPageShift;
+    const size_t my_pages = ClassPages(size);
 
     if (sc > 1 && my_pages == class_to_pages_[sc-1]) {
       // See if we can merge this into the previous class without
@@ -174,6 +229,9 @@ void SizeMap::Init() {
     class_to_size_[sc] = size;
     sc++;
   }
+#ifdef TCMALLOC_SGX
+  sc = AddTunedClasses(sc);
+#endif
   if (sc != kNumClasses) {
     Log(kCrash, __FILE__, __LINE__,
         "wrong number of size classes: (found vs. expected )", sc, kNumClasses);
@@ -85,15 +85,24 @@ static const size_t kBaseClasses = 9;
 // These two factors cause a bounded increase in memory use.
 #if defined(TCMALLOC_32K_PAGES)
 static const size_t kPageShift  = 15;
-static const size_t kNumClasses = kBaseClasses + 69;
+static const size_t kNumBaseClasses = kBaseClasses + 69;
 #elif defined(TCMALLOC_64K_PAGES)
 static const size_t kPageShift  = 16;
-static const size_t kNumClasses = kBaseClasses + 73;
+static const size_t kNumBaseClasses = kBaseClasses + 73;
 #else
 //static const size_t kPageShift  = 13;
-//static const size_t kNumClasses = kBaseClasses + 79;
+//static const size_t kNumBaseClasses = kBaseClasses + 79;
 static const size_t kPageShift  = 16;
-static const size_t kNumClasses = kBaseClasses + 73;
+static const size_t kNumBaseClasses = kBaseClasses + 73;
+#endif
+
+#ifdef TCMALLOC_SGX
+// Room for the extra size classes of kTunedClassSizes in common.cc.
+// Slots the table does not use are filled with copies of the largest class.
+static const size_t kMaxTunedClasses = 8;
+static const size_t kNumClasses = kNumBaseClasses + kMaxTunedClasses;
+#else
+static const size_t kNumClasses = kNumBaseClasses;
 #endif
 
 static const size_t kMaxThreadCacheSize = 4 << 20;
@@ -117,6 +126,14 @@ static const size_t kDefaultOverallThreadCacheSize = 8u * kMaxThreadCacheSize;
 // Lower bound on the per-thread cache sizes
 static const size_t kMinThreadCacheSize = kMaxSize * 2;
 
+#ifdef TCMALLOC_SGX
+// Bounds of the spans above kMaxSize a ThreadCache keeps once freed, so
+// that freeing and allocating ciphertext blocks of about the same size
+// does not take pageheap_lock.  A span over half the bound is not kept.
+static const int kLargeSpanCacheSlots = 8;
+static const size_t kLargeSpanCacheBytes = 8 << 20;
+#endif
+
 // The number of bytes one ThreadCache will steal from another when
 // the first ThreadCache is forced to Scavenge(), delaying the
 // next call to Scavenge for this thread.
@@ -219,6 +236,16 @@ class SizeMap {
 
   int NumMoveSize(size_t size);
 
+  // Number of pages for a span of objects of the given size class size,
+  // chosen so that at most 1/8 of the span is wasted.
+  size_t ClassPages(size_t size);
+
+#ifdef TCMALLOC_SGX
+  // Inserts kTunedClassSizes into the sc sorted classes computed so far and
+  // pads the remaining slots.  Returns the new number of classes.
+  int AddTunedClasses(int sc);
+#endif
+
   // Mapping from size class to max size storable in that class
   size_t class_to_size_[kNumClasses];
 
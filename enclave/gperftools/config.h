@@ -318,6 +318,7 @@ enum {PTHREAD_ONCE_INIT = 0};
 /*SGX special, implemented in sgx_utils.cc*/
 extern "C" char *getenv_ocall(const char *name);
 extern "C" int GetSystemCPUsCount_ocall();
+extern "C" void SetSystemCPUsCount_ocall(int cpu_count);
 enum { STDIN_FILENO = 0, STDOUT_FILENO = 1, STDERR_FILENO = 2 };
 extern "C" size_t write_ocall(int fd, const void *buf, size_t count);
 extern "C" int getpagesize_ocall();  //it didn't delare include enclave's <unistd.h>
@@ -0,0 +1,176 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// Sampling CPU profiler for in-enclave code.  See cpu-profiler-sgx.h for
+// an overview.
+
+#include <config.h>
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t, uintptr_t
+#endif
+#include <stdlib.h>                     // for calloc
+#include "base/basictypes.h"
+#include "base/spinlock.h"              // for SpinLockHolder, SpinLock
+#include "cpu-profiler-sgx.h"
+#include "heap-profiler-sgx.h"          // for the thread tag
+
+#ifdef TCMALLOC_SGX_AEX_NOTIFY
+#include <sgx_trts.h>                   // for sgx_is_within_enclave
+#include <sgx_trts_aex.h>               // for sgx_register_aex_handler
+#endif
+
+extern "C" {
+// Provided by the trts.
+void* get_enclave_base(void);
+}
+
+namespace {
+
+struct CpuSample {
+  uint64_t depth;
+  uint64_t frames[kCpuProfileMaxDepth];
+};
+
+// Written by the handler of its thread, read by the drain, so head and
+// tail each have a single writer.
+struct SampleRing {
+  volatile uint64_t head;
+  volatile uint64_t tail;
+  CpuSample samples[kCpuProfileRingSamples];
+};
+
+}  // namespace
+
+static volatile int profiler_enabled = 0;
+static volatile uint64_t samples_dropped = 0;
+
+static SampleRing* volatile rings[kCpuProfileMaxThreads];
+static volatile int32 num_rings = 0;
+// Serializes the drains.
+static SpinLock_ocall drain_lock(base_ocall::LINKER_INITIALIZED);
+
+static __thread SampleRing* thread_ring = NULL;
+static __thread int thread_depth = 0;
+static __thread bool thread_armed = false;
+
+#ifdef TCMALLOC_SGX_AEX_NOTIFY
+
+static __thread sgx_aex_mitigation_node_t thread_aex_node;
+
+namespace {
+
+// Walks the frame pointer chain from "fp", which must stay inside the
+// enclave and grow towards the stack bottom.
+int WalkFrames(uintptr_t fp, uint64_t* frames, uintptr_t base, int depth,
+               int limit) {
+  while (depth < limit) {
+    if (fp == 0 || (fp & 7) != 0 ||
+        !sgx_is_within_enclave(reinterpret_cast<void*>(fp),
+                               2 * sizeof(uintptr_t))) {
+      break;
+    }
+    uintptr_t* frame = reinterpret_cast<uintptr_t*>(fp);
+    uintptr_t ret = frame[1];
+    if (ret < base) break;
+    frames[depth++] = ret - base;
+    if (frame[0] <= fp) break;
+    fp = frame[0];
+  }
+  return depth;
+}
+
+// Runs inside the enclave after every AEX of an armed thread, before it
+// resumes where it was interrupted.
+void CpuSampleHandler(const sgx_exception_info_t* info, const void* args) {
+  SampleRing* ring = thread_ring;
+  if (!profiler_enabled || ring == NULL) return;
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+      kCpuProfileRingSamples) {
+    __sync_fetch_and_add(&samples_dropped, 1);
+    return;
+  }
+  CpuSample* sample = &ring->samples[head % kCpuProfileRingSamples];
+  uintptr_t base = reinterpret_cast<uintptr_t>(get_enclave_base());
+  int depth = 0;
+  sample->frames[depth++] = info->cpu_context.rip - base;
+  depth = WalkFrames(info->cpu_context.rbp, sample->frames, base, depth,
+                     kCpuProfileMaxDepth - 1);
+  sample->frames[depth++] = ocall_tc_heap_profiler_get_tag();
+  sample->depth = depth;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+}  // namespace
+
+#endif  // TCMALLOC_SGX_AEX_NOTIFY
+
+extern "C" PERFTOOLS_DLL_DECL int ocall_tc_cpu_profiler_set_enabled(
+    int enabled) {
+#ifdef TCMALLOC_SGX_AEX_NOTIFY
+  profiler_enabled = enabled;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_cpu_profiler_enter_thread() {
+  if (thread_depth++ > 0 || !profiler_enabled) return;
+#ifdef TCMALLOC_SGX_AEX_NOTIFY
+  if (thread_ring == NULL) {
+    int32 slot = __sync_fetch_and_add(&num_rings, 1);
+    if (slot >= kCpuProfileMaxThreads) return;
+    SampleRing* ring =
+        reinterpret_cast<SampleRing*>(calloc(1, sizeof(SampleRing)));
+    if (ring == NULL) return;
+    rings[slot] = ring;
+    thread_ring = ring;
+  }
+  // Armed at every outermost entry and disarmed at its leave, rather than
+  // relying on the registration outliving the ECALL.
+  if (sgx_register_aex_handler(&thread_aex_node, CpuSampleHandler, NULL) !=
+      SGX_SUCCESS) {
+    return;
+  }
+  sgx_set_ssa_aexnotify(1);
+  thread_armed = true;
+#endif
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_cpu_profiler_leave_thread() {
+  if (--thread_depth > 0 || !thread_armed) return;
+#ifdef TCMALLOC_SGX_AEX_NOTIFY
+  sgx_set_ssa_aexnotify(0);
+  sgx_unregister_aex_handler(CpuSampleHandler);
+#endif
+  thread_armed = false;
+}
+
+extern "C" PERFTOOLS_DLL_DECL size_t ocall_tc_cpu_profiler_drain(
+    uint64_t* out, size_t cap) {
+  SpinLockHolder h(&drain_lock);
+  size_t written = 0;
+  int32 n = num_rings;
+  if (n > kCpuProfileMaxThreads) n = kCpuProfileMaxThreads;
+  for (int32 i = 0; i < n; i++) {
+    SampleRing* ring = rings[i];
+    if (ring == NULL) continue;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    for (; tail != head; tail++) {
+      const CpuSample& sample = ring->samples[tail % kCpuProfileRingSamples];
+      if (written + 1 + sample.depth > cap) break;
+      out[written++] = sample.depth;
+      for (uint64_t d = 0; d < sample.depth; d++) {
+        out[written++] = sample.frames[d];
+      }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+  return written;
+}
+
+extern "C" PERFTOOLS_DLL_DECL uint64_t ocall_tc_cpu_profiler_dropped() {
+  return samples_dropped;
+}
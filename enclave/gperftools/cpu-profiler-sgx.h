@@ -0,0 +1,65 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// Sampling CPU profiler for the code running inside the enclave.
+//
+// profiler.cc and profile-handler.cc sample from a SIGPROF handler, which
+// runs outside the enclave after an AEX and only sees the AEP, so they are
+// not built.  Instead the host interrupts the threads it has inside the
+// enclave at the profiling rate, and with AEX-Notify the trts calls
+// CpuSampleHandler() inside the enclave before it resumes there.  The
+// handler reads the interrupted RIP out of the SSA, walks the frame
+// pointer chain from its RBP and appends the sample to a ring buffer of the
+// thread, one per TCS, which ocall_tc_cpu_profiler_drain() empties.
+//
+// A sample has the layout of those of heap-profiler-sgx.h: frames as
+// offsets from the enclave base, so the profile can be symbolized against
+// the enclave image, the calling thread's tag last.  Frames beyond the
+// first need the enclave built with frame pointers; without them the walk
+// stops at the first frame that does not point into the enclave stack.
+//
+// AEX-Notify needs SGX SDK 2.19 or later and is only compiled in with
+// TCMALLOC_SGX_AEX_NOTIFY; otherwise the profiler cannot be started.
+
+#ifndef TCMALLOC_CPU_PROFILER_SGX_H_
+#define TCMALLOC_CPU_PROFILER_SGX_H_
+
+#include <config.h>
+#include <stddef.h>                     // for size_t
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t
+#endif
+#include "base/basictypes.h"
+
+// Maximum number of frames captured per sample, including the tag.
+static const int kCpuProfileMaxDepth = 32;
+
+// Threads that can hold a sample ring, the TCSNum of the enclave.
+static const int kCpuProfileMaxThreads = 64;
+
+// Samples a ring holds between two drains; more are dropped and counted.
+static const int kCpuProfileRingSamples = 1024;
+
+extern "C" {
+
+// Start or stop taking samples.  Returns 0 if the profiler was not compiled
+// in, 1 otherwise.
+PERFTOOLS_DLL_DECL int ocall_tc_cpu_profiler_set_enabled(int enabled);
+
+// Bracket code the calling thread runs inside the enclave that should be
+// profiled.  They nest; the outermost pair arms the AEX handler of the
+// thread, which is what samples it.
+PERFTOOLS_DLL_DECL void ocall_tc_cpu_profiler_enter_thread();
+PERFTOOLS_DLL_DECL void ocall_tc_cpu_profiler_leave_thread();
+
+// Move the samples of all threads into "out", "cap" words at most, each as
+// its depth followed by that many frames.  Returns the words written.
+// Samples that do not fit stay in their ring.
+PERFTOOLS_DLL_DECL size_t ocall_tc_cpu_profiler_drain(uint64_t* out,
+                                                      size_t cap);
+
+// Samples dropped so far because a ring was full.
+PERFTOOLS_DLL_DECL uint64_t ocall_tc_cpu_profiler_dropped();
+
+}
+
+#endif  // TCMALLOC_CPU_PROFILER_SGX_H_
@@ -189,6 +189,20 @@ class PERFTOOLS_DLL_DECL MallocExtension_ocall {
   //      is swapped out by the OS, they also count towards physical
   //      memory usage. This property is not writable.
   //
+  // "tcmalloc.central_cache_lock_contentions"
+  //      Number of times a thread found a central freelist lock held
+  //      by another thread and had to wait.  This property is not
+  //      writable.
+  //
+  // "tcmalloc.transfer_shard_lock_contentions"
+  //      Number of times a thread had to wait for a transfer shard
+  //      lock.  This property is not writable.
+  //
+  // "tcmalloc.transfer_shard_hits"
+  //      Number of batches handed between thread caches through the
+  //      transfer shards without taking the central freelist lock.
+  //      This property is not writable.
+  //
   // "tcmalloc.thread_cache_free_bytes"
   //      Number of free bytes in thread caches. They always count
   //      towards virtual memory usage, and unless the underlying memory
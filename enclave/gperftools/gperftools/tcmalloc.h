@@ -87,6 +87,8 @@ extern "C" {
   PERFTOOLS_DLL_DECL void* ocall_tc_malloc_skip_new_handler(size_t size) PERFTOOLS_THROW;
   PERFTOOLS_DLL_DECL void ocall_tc_free(void* ptr) PERFTOOLS_THROW;
   PERFTOOLS_DLL_DECL void ocall_tc_free_sized(void *ptr, size_t size) PERFTOOLS_THROW;
+  PERFTOOLS_DLL_DECL void ocall_tc_free_batch(void** ptrs, size_t n) PERFTOOLS_THROW;
+  PERFTOOLS_DLL_DECL size_t ocall_tc_nallocx(size_t size, int flags) PERFTOOLS_THROW;
   PERFTOOLS_DLL_DECL void* ocall_tc_realloc(void* ptr, size_t size) PERFTOOLS_THROW;
   PERFTOOLS_DLL_DECL void* ocall_tc_calloc(size_t nmemb, size_t size) PERFTOOLS_THROW;
   PERFTOOLS_DLL_DECL void ocall_tc_cfree(void* ptr) PERFTOOLS_THROW;
@@ -0,0 +1,129 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// Sampling heap profiler for outside-enclave allocations.  See
+// heap-profiler-sgx.h for an overview.
+
+#include <config.h>
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t, uintptr_t
+#endif
+#include <gperftools/malloc_hook.h>
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+#include "base/logging.h"               // for RAW_CHECK
+#include "base/spinlock.h"              // for SpinLockHolder, SpinLock
+#include "heap-profiler-sgx.h"
+#include "sampler.h"                    // for Sampler
+
+// OCALL is needed to ship samples out
+#include "Enclave_t.h"
+
+// The Sampler reads its mean step from this flag.  Nothing else looks at
+// it since the library is compiled with NO_TCMALLOC_SAMPLES.
+DECLARE_int64(tcmalloc_sample_parameter);
+
+// We only need the unwinder entry points, and <unwind.h> is not on the
+// enclave include path, so declare them here.
+extern "C" {
+struct _Unwind_Context;
+typedef int _Unwind_Reason_Code_sgx;
+typedef _Unwind_Reason_Code_sgx (*_Unwind_Trace_Fn_sgx)(struct _Unwind_Context*,
+                                                        void*);
+_Unwind_Reason_Code_sgx _Unwind_Backtrace(_Unwind_Trace_Fn_sgx, void*);
+uintptr_t _Unwind_GetIP(struct _Unwind_Context*);
+// Provided by the trts.
+void* get_enclave_base(void);
+}
+
+using tcmalloc_ocall::Sampler;
+
+static const _Unwind_Reason_Code_sgx kUnwindNoReason = 0;
+static const _Unwind_Reason_Code_sgx kUnwindEndOfStack = 5;
+
+static SpinLock_ocall profiler_lock(base_ocall::LINKER_INITIALIZED);
+static bool profiler_running = false;     // Protected by profiler_lock
+// Bumped on every period change so threads re-seed their samplers.
+static volatile int32 profiler_generation = 0;
+
+static __thread Sampler thread_sampler;
+static __thread int32 thread_sampler_generation = -1;
+static __thread uint64_t thread_tag = 0;
+static __thread bool thread_in_hook = false;
+
+namespace {
+
+struct UnwindState {
+  uint64_t* frames;
+  uintptr_t base;
+  int skip;
+  int depth;
+  int limit;
+};
+
+_Unwind_Reason_Code_sgx UnwindHelper(struct _Unwind_Context* ctx, void* arg) {
+  UnwindState* state = reinterpret_cast<UnwindState*>(arg);
+  if (state->skip > 0) {
+    state->skip--;
+    return kUnwindNoReason;
+  }
+  if (state->depth >= state->limit) {
+    return kUnwindEndOfStack;
+  }
+  uintptr_t ip = _Unwind_GetIP(ctx);
+  if (ip == 0) {
+    return kUnwindEndOfStack;
+  }
+  state->frames[state->depth++] = ip - state->base;
+  return kUnwindNoReason;
+}
+
+void SampleNewHook(const void* ptr, size_t size) {
+  if (ptr == NULL || thread_in_hook) return;
+  if (UNLIKELY(thread_sampler_generation != profiler_generation)) {
+    thread_sampler_generation = profiler_generation;
+    thread_sampler.Init(0);
+  }
+  if (LIKELY(!thread_sampler.SampleAllocation(size))) return;
+
+  thread_in_hook = true;
+  uint64_t frames[kHeapProfileMaxDepth];
+  UnwindState state;
+  state.frames = frames;
+  state.base = reinterpret_cast<uintptr_t>(get_enclave_base());
+  // Skip UnwindHelper's caller, this hook and the MallocHook trampoline
+  state.skip = 2;
+  state.depth = 0;
+  state.limit = kHeapProfileMaxDepth - 1;
+  _Unwind_Backtrace(UnwindHelper, &state);
+  frames[state.depth++] = thread_tag;
+  ocall_heap_profile_sample(frames, state.depth, size);
+  thread_in_hook = false;
+}
+
+}  // namespace
+
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_heap_profiler_set_period(uint64_t period) {
+  SpinLockHolder h(&profiler_lock);
+  if (period == 0) {
+    if (profiler_running) {
+      RAW_CHECK(MallocHook_ocall::RemoveNewHook(&SampleNewHook), "");
+      profiler_running = false;
+    }
+    return;
+  }
+  ocall_FLAGS_tcmalloc_sample_parameter = period;
+  __sync_fetch_and_add(&profiler_generation, 1);
+  if (!profiler_running) {
+    RAW_CHECK(MallocHook_ocall::AddNewHook(&SampleNewHook), "");
+    profiler_running = true;
+  }
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_heap_profiler_set_tag(uint64_t tag) {
+  thread_tag = tag;
+}
+
+extern "C" PERFTOOLS_DLL_DECL uint64_t ocall_tc_heap_profiler_get_tag() {
+  return thread_tag;
+}
@@ -0,0 +1,45 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// Sampling heap profiler for the memory tcmalloc hands out from
+// outside the enclave.
+//
+// heap-profiler.cc depends on files, signals and getenv(), none of which
+// exist inside the enclave, so it is not built.  Instead, when enabled, a
+// NewHook picks allocations with the same Poisson sampler tcmalloc uses
+// (one sample every "period" bytes on average), unwinds the enclave stack
+// and ships the frames to the untrusted side through
+// ocall_heap_profile_sample(), where they are aggregated and written out
+// in the legacy pprof heap format.
+//
+// Frames are reported as offsets from the enclave base so the profile can
+// be symbolized against the unsigned enclave image.  Each sample carries
+// the calling thread's tag (the enclave uses the OpId hash of the operator
+// being executed) as its outermost frame, so samples can be grouped per
+// operator without symbolizing.
+
+#ifndef TCMALLOC_HEAP_PROFILER_SGX_H_
+#define TCMALLOC_HEAP_PROFILER_SGX_H_
+
+#include <config.h>
+#include <stddef.h>                     // for size_t
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t
+#endif
+#include "base/basictypes.h"
+
+// Maximum number of frames captured per sample, including the tag.
+static const int kHeapProfileMaxDepth = 32;
+
+extern "C" {
+
+// Start sampling on average once every "period" bytes of outside
+// allocation.  A period of zero stops the profiler.
+PERFTOOLS_DLL_DECL void ocall_tc_heap_profiler_set_period(uint64_t period);
+
+// Set/get the tag attached to samples taken by the calling thread.
+PERFTOOLS_DLL_DECL void ocall_tc_heap_profiler_set_tag(uint64_t tag);
+PERFTOOLS_DLL_DECL uint64_t ocall_tc_heap_profiler_get_tag();
+
+}
+
+#endif  // TCMALLOC_HEAP_PROFILER_SGX_H_
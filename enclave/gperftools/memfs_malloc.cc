@@ -35,8 +35,119 @@
 // tmpfs or hugetlbfs
 //
 // Since these only exist on linux, we only register this allocator there.
+//
+// In SGX, the enclave can neither open the file nor mmap it, so the host
+// keeps the file on the mount of VEGA_MEMFS_PATH and maps the ranges of it
+// the allocator asks for with memfs_mmap_o (framework/src/memfs.rs).  The
+// allocator is not registered at startup either, module initializers do
+// not run before the first malloc of the enclave; InitSystemAllocators_ocall
+// places it between the arena reservation and the mmap_o/sbrk_o allocators
+// when the host has a mount.
+
+#ifdef TCMALLOC_SGX
+
+#include <config.h>
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uintptr_t
+#endif
+#include <new>                          // for operator new
+
+#include <gperftools/malloc_extension.h>
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+#include "internal_logging.h"
+#include "system-alloc.h"
+
+#include "Enclave_t.h"
+
+using tcmalloc_ocall::kLog;
+using tcmalloc_ocall::Log;
+
+// Defined in system-alloc.cc, the ranges of the file are placed on the
+// node like the mmap_o regions
+DECLARE_int32(malloc_numa_node);
+
+// Hugetlbfs based allocator for tcmalloc, the mapping is done outside
+class HugetlbSysAllocator_ocall: public SysAllocator_ocall {
+public:
+  HugetlbSysAllocator_ocall(SysAllocator_ocall* fallback, size_t big_page_size)
+    : failed_(false),
+      big_page_size_(big_page_size),
+      fallback_(fallback) {
+  }
+
+  void* Alloc(size_t size, size_t *actual_size, size_t alignment);
+
+private:
+  bool failed_;          // Whether the host failed to map the file.
+  size_t big_page_size_;
+
+  SysAllocator_ocall* fallback_;  // Default system allocator to fall back to.
+};
+static union {
+  char buf[sizeof(HugetlbSysAllocator_ocall)];
+  void *ptr;
+} hugetlb_space;
+
+// No locking needed here since we assume that tcmalloc calls
+// us with an internal lock held (see tcmalloc/system-alloc.cc).
+void* HugetlbSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
+                                       size_t alignment) {
+  if (failed_) {
+    return fallback_->Alloc(size, actual_size, alignment);
+  }
+
+  // We don't respond to allocation requests smaller than big_page_size_ unless
+  // the caller is ok to take more than they asked for. Used by MetaDataAlloc.
+  if (actual_size == NULL && size < big_page_size_) {
+    return fallback_->Alloc(size, actual_size, alignment);
+  }
+
+  // Enforce huge page alignment.  Be careful to deal with overflow.
+  size_t new_alignment = alignment;
+  if (new_alignment < big_page_size_) new_alignment = big_page_size_;
+  size_t aligned_size = ((size + new_alignment - 1) /
+                         new_alignment) * new_alignment;
+  if (aligned_size < size) {
+    return fallback_->Alloc(size, actual_size, alignment);
+  }
+
+  // The host fails the ranges past VEGA_MEMFS_LIMIT_MB, and those the
+  // reserved huge pages of the mount cannot back when it maps them.  Either
+  // way later ones fail too, so the heap grows with mmap_o from here on.
+  void* result = NULL;
+  if (memfs_mmap_o(&result, aligned_size, new_alignment,
+                   ocall_FLAGS_malloc_numa_node) != SGX_SUCCESS ||
+      result == NULL || result == reinterpret_cast<void*>(-1)) {
+    Log(kLog, __FILE__, __LINE__,
+        "HugetlbSysAllocator_ocall: memfs_mmap_o failed (size)", aligned_size);
+    failed_ = true;
+    return fallback_->Alloc(size, actual_size, alignment);
+  }
+  // The region must not overlap the enclave range
+  if (!sgx_is_outside_enclave(result, aligned_size)) {
+    failed_ = true;
+    return fallback_->Alloc(size, actual_size, alignment);
+  }
+
+  if (actual_size) {
+    *actual_size = aligned_size;
+  }
+  return result;
+}
+
+SysAllocator_ocall* NewHugetlbSysAllocator_ocall(SysAllocator_ocall* fallback) {
+  size_t big_page_size = 0;
+  if (memfs_page_size_o(&big_page_size) != SGX_SUCCESS ||
+      big_page_size == 0 || (big_page_size & (big_page_size - 1)) != 0) {
+    return NULL;
+  }
+  return new (hugetlb_space.buf)
+      HugetlbSysAllocator_ocall(fallback, big_page_size);
+}
 
-#ifdef __linux
+#elif defined(__linux)
 
 #include <config.h>
 #include <errno.h>                      // for errno, EINVAL
@@ -269,4 +380,4 @@ REGISTER_MODULE_INITIALIZER(memfs_malloc, {
   }
 });
 
-#endif   /* ifdef __linux */
+#endif   /* ifdef TCMALLOC_SGX, __linux */
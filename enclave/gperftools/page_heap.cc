@@ -69,7 +69,12 @@ PageHeap::PageHeap()
       scavenge_counter_(0),
       // Start scavenging at kMaxPages list
       release_index_(kMaxPages),
-      aggressive_decommit_(false) {
+      aggressive_decommit_(false),
+      free_low_water_(0)
+#ifdef TCMALLOC_SGX
+      , grow_epoch_(0)
+#endif
+      {
   COMPILE_ASSERT(kNumClasses <= (1 << PageMapCache::kValuebits), valuebits);
   DLL_Init(&large_.normal);
   DLL_Init(&large_.returned);
@@ -114,6 +119,13 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n) {
 
 static const size_t kForcedCoalesceInterval = 128*1024*1024;
 
+#ifdef TCMALLOC_SGX
+// Growths New() attempts, the ones that raced with other threads included.
+static const int kMaxGrowAttempts = 8;
+#else
+static const int kMaxGrowAttempts = 1;
+#endif
+
 Span* PageHeap::New(Length n) {
   ASSERT(Check());
   ASSERT(n > 0);
@@ -154,19 +166,27 @@ Span* PageHeap::New(Length n) {
     if (result != NULL) return result;
   }
 
-  // Grow the heap and try again.
-  if (!GrowHeap(n)) {
-    ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
-    ASSERT(Check());
-    // underlying SysAllocator likely set ENOMEM but we can get here
-    // due to EnsureLimit so we set it here too.
-    //
-    // Setting errno to ENOMEM here allows us to avoid dealing with it
-    // in fast-path.
-    errno = ENOMEM;
-    return NULL;
+  // Grow the heap and try again.  In SGX the lock is released while the
+  // heap grows, so the new pages may be gone to another thread by the time
+  // it is taken again, or another thread grew the heap instead; try again
+  // a few times then.
+  for (int attempt = 0; attempt < kMaxGrowAttempts; attempt++) {
+    if (!GrowHeap(n)) {
+      ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
+      ASSERT(Check());
+      // underlying SysAllocator likely set ENOMEM but we can get here
+      // due to EnsureLimit so we set it here too.
+      //
+      // Setting errno to ENOMEM here allows us to avoid dealing with it
+      // in fast-path.
+      errno = ENOMEM;
+      return NULL;
+    }
+    result = SearchFreeAndLargeLists(n);
+    if (result != NULL) return result;
   }
-  return SearchFreeAndLargeLists(n);
+  errno = ENOMEM;
+  return NULL;
 }
 
 Span* PageHeap::AllocLarge(Length n) {
@@ -245,6 +265,31 @@ Span* PageHeap::Split(Span* span, Length n) {
   return leftover;
 }
 
+bool PageHeap::GrowInPlace(Span* span, Length n) {
+  ASSERT(n > span->length);
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->sizeclass == 0);
+  const Length extra = n - span->length;
+  Span* next = GetDescriptor(span->start + span->length);
+  if (next == NULL || next->location == Span::IN_USE || next->length < extra) {
+    return false;
+  }
+  ASSERT(next->start == span->start + span->length);
+  Event(span, 'G', extra);
+
+  // Carve leaves the tail of |next| on its free list and recommits the
+  // head if it had been returned to the system.
+  next = Carve(next, extra);
+  span->length = n;
+  // Interior entries are never looked up for a large span, but do not
+  // leave the head of |next| pointing at a deleted descriptor.
+  pagemap_.set(next->start, span);
+  pagemap_.set(span->start + span->length - 1, span);
+  DeleteSpan(next);
+  ASSERT(Check());
+  return true;
+}
+
 void PageHeap::CommitSpan(Span* span) {
   TCMalloc_SystemCommit_ocall(reinterpret_cast<void*>(span->start << kPageShift),
                         static_cast<size_t>(span->length << kPageShift));
@@ -424,6 +469,9 @@ void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(span->location != Span::IN_USE);
   if (span->location == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= (span->length << kPageShift);
+    if (stats_.free_bytes < free_low_water_) {
+      free_low_water_ = stats_.free_bytes;
+    }
   } else {
     stats_.unmapped_bytes -= (span->length << kPageShift);
   }
@@ -499,6 +547,14 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
   return released_pages;
 }
 
+Length PageHeap::ReleaseIdlePages() {
+  const Length idle_pages = free_low_water_ >> kPageShift;
+  const Length released_pages =
+      idle_pages > 0 ? ReleaseAtLeastNPages(idle_pages) : 0;
+  free_low_water_ = stats_.free_bytes;
+  return released_pages;
+}
+
 bool PageHeap::EnsureLimit(Length n, bool withRelease)
 {
   Length limit = (ocall_FLAGS_tcmalloc_heap_limit_mb*1024*1024) >> kPageShift;
@@ -595,12 +651,65 @@ static void RecordGrowth(size_t growth) {
   Static::set_growth_stacks(t);
 }
 
+#ifdef TCMALLOC_SGX
+// The system allocation may leave the enclave for sbrk_o or mmap_o, which
+// takes as long as thousands of span allocations, so it runs without
+// pageheap_lock and the other threads keep allocating from the free lists
+// meanwhile.  grow_lock_ is the reservation: one thread grows at a time,
+// and a thread that waited on it while another one grew returns true
+// without growing, for New() to search the free lists again.
+// The first growth from the outside range, which the system allocator
+// reserves on its first call, switches its pages to the flat index.  Pages
+// the metadata took from it before are copied over.
+void PageHeap::IndexOutsideRange() {
+  uintptr_t start;
+  size_t size;
+  if (!TCMalloc_SystemRange_ocall(&start, &size)) return;
+  if (!pagemap_.SetRange(start >> kPageShift, size >> kPageShift)) {
+    Log(kLog, __FILE__, __LINE__,
+        "could not index the outside range flat, bytes", size);
+  }
+}
+
+void* PageHeap::SystemAllocUnlocked(Length ask, size_t* actual_size) {
+  SpinLock_ocall* lock = Static::pageheap_lock();
+  lock->Unlock();
+  void* ptr = TCMalloc_SystemAlloc_ocall(ask << kPageShift, actual_size,
+                                         kPageSize);
+  lock->Lock();
+  return ptr;
+}
+#endif
+
 bool PageHeap::GrowHeap(Length n) {
   ASSERT(kMaxPages >= kMinSystemAlloc);
   if (n > kMaxValidPages) return false;
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
   size_t actual_size;
   void* ptr = NULL;
+#ifdef TCMALLOC_SGX
+  const uint64_t epoch = grow_epoch_;
+  SpinLock_ocall* lock = Static::pageheap_lock();
+  lock->Unlock();
+  SpinLockHolder grow_holder(&grow_lock_);
+  lock->Lock();
+  if (grow_epoch_ != epoch) return true;
+  if (EnsureLimit(ask)) {
+    ptr = SystemAllocUnlocked(ask, &actual_size);
+  }
+  if (ptr == NULL) {
+    if (n < ask) {
+      // Try growing just "n" pages
+      ask = n;
+      if (EnsureLimit(ask)) {
+        ptr = SystemAllocUnlocked(ask, &actual_size);
+      }
+    }
+    if (ptr == NULL) return false;
+  }
+  grow_epoch_++;
+  if (!pagemap_.HasRange()) IndexOutsideRange();
+#else
   if (EnsureLimit(ask)) {
       ptr = TCMalloc_SystemAlloc_ocall(ask << kPageShift, &actual_size, kPageSize);
   }
@@ -614,6 +723,7 @@ bool PageHeap::GrowHeap(Length n) {
     }
     if (ptr == NULL) return false;
   }
+#endif
   ask = actual_size >> kPageShift;
   RecordGrowth(ask << kPageShift);
 
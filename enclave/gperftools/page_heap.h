@@ -41,6 +41,7 @@
 #endif
 #include <gperftools/malloc_extension.h>
 #include "base/basictypes.h"
+#include "base/spinlock.h"              // for SpinLock_ocall
 #include "common.h"
 #include "packed-cache-inl.h"
 #include "pagemap.h"
@@ -84,7 +85,12 @@ namespace tcmalloc_ocall {
 // Selector class -- general selector uses 3-level map
 template <int BITS> class MapSelector {
  public:
+#ifdef TCMALLOC_SGX
+  // Plus the flat index of the outside range, see SetRange()
+  typedef TCMalloc_PageMapRange<TCMalloc_PageMap3<BITS-kPageShift> > Type;
+#else
   typedef TCMalloc_PageMap3<BITS-kPageShift> Type;
+#endif
   typedef PackedCache<BITS-kPageShift, uint64_t> CacheType;
 };
 
@@ -133,6 +139,15 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // REQUIRES: span->sizeclass == 0
   Span* Split(Span* span, Length n);
 
+  // Try to extend an allocated span to "n" pages by taking the pages
+  // that directly follow it from the free span there.  Returns true and
+  // updates "*span" on success; leaves everything untouched otherwise.
+  //
+  // REQUIRES: "n > span->length"
+  // REQUIRES: span->location == IN_USE
+  // REQUIRES: span->sizeclass == 0
+  bool GrowInPlace(Span* span, Length n);
+
   // Return the descriptor for the specified page.  Returns NULL if
   // this PageID was not allocated previously.
   inline Span* GetDescriptor(PageID p) const {
@@ -184,6 +199,12 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // smaller released and unreleased ranges.
   Length ReleaseAtLeastNPages(Length num_pages);
 
+  // Release the pages that stayed on the normal free lists since the
+  // previous call, i.e. the lowest free_bytes in between.  Returns the
+  // number of pages released.  Called periodically rather than from the
+  // free path, see ocall_tc_scavenge_idle().
+  Length ReleaseIdlePages();
+
   // Return 0 if we have no information, or else the correct sizeclass for p.
   // Reads and writes to pagemap_cache_ do not require locking.
   // The entries are 64 bits on 64-bit hardware and 16 bits on
@@ -247,8 +268,17 @@ class PERFTOOLS_DLL_DECL PageHeap {
 
   Span* SearchFreeAndLargeLists(Length n);
 
+  // REQUIRES: pageheap_lock is held, it is released and taken again in SGX
   bool GrowHeap(Length n);
 
+#ifdef TCMALLOC_SGX
+  // TCMalloc_SystemAlloc_ocall() of "ask" pages with pageheap_lock released.
+  void* SystemAllocUnlocked(Length ask, size_t* actual_size);
+
+  // REQUIRES: pageheap_lock is held
+  void IndexOutsideRange();
+#endif
+
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
   // Remove span from its free list, and move any leftover part of
@@ -307,6 +337,18 @@ class PERFTOOLS_DLL_DECL PageHeap {
   int release_index_;
 
   bool aggressive_decommit_;
+
+  // Lowest stats_.free_bytes since the last ReleaseIdlePages().
+  uint64_t free_low_water_;
+
+#ifdef TCMALLOC_SGX
+  // Serializes the growths, whose system allocation runs without
+  // pageheap_lock, see GrowHeap().  Taken before pageheap_lock.
+  SpinLock_ocall grow_lock_;
+
+  // Growths that added memory so far.  Protected by pageheap_lock.
+  uint64_t grow_epoch_;
+#endif
 };
 
 }  // namespace tcmalloc
@@ -321,4 +321,80 @@ class TCMalloc_PageMap3 {
   }
 };
 
+#ifdef TCMALLOC_SGX
+// A radix tree plus a flat array over one contiguous range of pages, the
+// outside range ReservedSysAllocator_ocall carves the heap from.  Lookups
+// of pages in the range are a single index, the frees of tens of GB of
+// outside memory miss the PackedCache often and used to walk the three
+// levels of the tree each time.  The tree keeps every entry as before, so
+// Ensure() and Next() are left to it, and set() writes both.
+template <class Tree>
+class TCMalloc_PageMapRange {
+ public:
+  typedef uintptr_t Number;
+
+ private:
+  Tree tree_;
+  void* (*allocator_)(size_t);          // Memory allocator
+  void** array_;                        // Entries of [base_, base_+length_)
+  Number base_;
+  // Zero until the array is filled, it is published by the store of length_
+  size_t length_;
+
+ public:
+  explicit TCMalloc_PageMapRange(void* (*allocator)(size_t))
+      : tree_(allocator), allocator_(allocator), array_(NULL), base_(0),
+        length_(0) {
+  }
+
+  bool HasRange() const { return length_ != 0; }
+
+  // Index the "n" pages from "start" flat from now on.  Called once, with
+  // the lock that serializes set() held.  Returns false if the array
+  // could not be allocated, the tree serves them all then.
+  bool SetRange(Number start, size_t n) {
+    ASSERT(length_ == 0);
+    void** array = reinterpret_cast<void**>(
+        (*allocator_)(n * sizeof(void*)));
+    if (array == NULL) return false;
+    // Pages of the range may have been recorded before it was known
+    for (size_t i = 0; i < n; i++) {
+      array[i] = tree_.get(start + i);
+    }
+    array_ = array;
+    base_ = start;
+    __atomic_store_n(&length_, n, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void* get(Number k) const {
+    const Number i = k - base_;
+    if (i < __atomic_load_n(&length_, __ATOMIC_ACQUIRE)) {
+      return array_[i];
+    }
+    return tree_.get(k);
+  }
+
+  void set(Number k, void* v) {
+    tree_.set(k, v);
+    const Number i = k - base_;
+    if (i < length_) {
+      array_[i] = v;
+    }
+  }
+
+  bool Ensure(Number start, size_t n) {
+    return tree_.Ensure(start, n);
+  }
+
+  void PreallocateMoreMemory() {
+    tree_.PreallocateMoreMemory();
+  }
+
+  void* Next(Number k) const {
+    return tree_.Next(k);
+  }
+};
+#endif
+
 #endif  // TCMALLOC_PAGEMAP_H_
@@ -57,6 +57,7 @@
 #include "base/spinlock.h"              // for SpinLockHolder, SpinLock, etc
 #include "common.h"
 #include "internal_logging.h"
+#include "system-alloc.h"              // for NewHugetlbSysAllocator_ocall
 
 #include "Enclave_t.h"
 
@@ -112,11 +113,16 @@ COMPILE_ASSERT(kAddressBits <= 8 * sizeof(void*),
 
 static SpinLock_ocall spinlock(SpinLock_ocall::LINKER_INITIALIZED);
 
-#if defined(HAVE_MMAP) || defined(MADV_FREE)
+#if defined(HAVE_MMAP) || defined(MADV_FREE) || defined(TCMALLOC_SGX)
 // Page size is initialized on demand (only needed for mmap-based allocators)
 static size_t pagesize = 0;
 #endif
 
+#ifdef TCMALLOC_SGX
+// Granularity of the untrusted mappings when huge pages are requested
+static const size_t kHugePageSize = 2 << 20;
+#endif
+
 // The current system allocator
 SysAllocator_ocall* sys_alloc_ocall = NULL;
 
@@ -142,6 +148,27 @@ DEFINE_bool(malloc_disable_memory_release,
             EnvToBool("TCMALLOC_DISABLE_MEMORY_RELEASE", false),
             "Whether MADV_FREE/MADV_DONTNEED should be used"
             " to return unused memory to the system.");
+#ifdef TCMALLOC_SGX
+DEFINE_int64(malloc_reserve_arena_mb,
+             EnvToInt64("TCMALLOC_RESERVE_ARENA_MB", 256),
+             "Size in MB of the untrusted arenas reserved with a single ocall"
+             " and carved locally for heap growth. Setting this to 0"
+             " forwards every request to the system allocators.");
+DEFINE_int64(malloc_reserve_range_gb,
+             EnvToInt64("TCMALLOC_RESERVE_RANGE_GB", 0),
+             "Size in GB of the contiguous untrusted range reserved with"
+             " the first ocall, which the arenas are carved from until it"
+             " is used up and the page heap indexes flat. Setting this to 0"
+             " reserves every arena on its own.");
+DEFINE_bool(malloc_hugepage_mmap,
+            EnvToBool("TCMALLOC_HUGEPAGE_MMAP", false),
+            "Whether the untrusted mmap regions backing the heap should"
+            " be requested with huge pages.");
+DEFINE_int32(malloc_numa_node,
+             EnvToInt("TCMALLOC_NUMA_NODE", -1),
+             "NUMA node the host places the untrusted mmap regions backing"
+             " the heap on. Setting this to -1 leaves them to first touch.");
+#endif
 
 // static allocators
 class SbrkSysAllocator_ocall : public SysAllocator_ocall {
@@ -161,12 +188,10 @@ public:
   }
   void* Alloc(size_t size, size_t *actual_size, size_t alignment);
 };
-#ifndef TCMALLOC_SGX
 static union {
   char buf[sizeof(MmapSysAllocator_ocall)];
   void *ptr;
 } mmap_space;
-#endif
 
 class DevMemSysAllocator_ocall : public SysAllocator_ocall {
 public:
@@ -204,6 +229,41 @@ static union {
   char buf[sizeof(DefaultSysAllocator_ocall)];
   void *ptr;
 } default_space;
+// Every call into the child allocators is an enclave exit. This layer
+// reserves large arenas from its child and carves the (typically small)
+// GrowHeap requests out of them without leaving the enclave.
+class ReservedSysAllocator_ocall : public SysAllocator_ocall {
+ public:
+  explicit ReservedSysAllocator_ocall(SysAllocator_ocall* child)
+      : SysAllocator_ocall(), child_(child), cur_(0), end_(0),
+        range_tried_(false), range_start_(0), range_size_(0) {
+  }
+  void* Alloc(size_t size, size_t *actual_size, size_t alignment);
+
+  // The range, if it was reserved.
+  bool Range(uintptr_t* start, size_t* size) const {
+    if (range_size_ == 0) return false;
+    *start = range_start_;
+    *size = range_size_;
+    return true;
+  }
+
+ private:
+  SysAllocator_ocall* child_;
+  uintptr_t cur_;   // next free byte of the current arena
+  uintptr_t end_;   // one past the last byte of the current arena
+  bool range_tried_;
+  uintptr_t range_start_;
+  size_t range_size_;
+
+  // Make the arena the whole range, on the first call.
+  void ReserveRange();
+};
+static union {
+  char buf[sizeof(ReservedSysAllocator_ocall)];
+  void *ptr;
+} reserved_space;
+
 static const char sbrk_name[] = "SbrkSysAllocator_ocall";
 static const char mmap_name[] = "MmapSysAllocator_ocall";
 
@@ -245,22 +305,19 @@ void* SbrkSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
   // Without this check, sbrk may succeed when it ought to fail.)
 
 
-  //thkim
-  //if (reinterpret_cast<intptr_t>(sbrk(0)) + size < size) {
-  void* temp = NULL;
-  sbrk_o(&temp, 0);
-  if (reinterpret_cast<intptr_t>(temp) + size < size) {
-    return NULL;
-  }
-
   //thkim
   //void* result = sbrk(size);
+  // The sbrk(0) probe of upstream is folded into the check on the
+  // result below, which saves one enclave exit per growth.
   size_t size_for_ocall = (size_t)size;
   void* result = NULL;
   sbrk_o(&result, size_for_ocall);
   if (result == reinterpret_cast<void*>(-1)) {
     return NULL;
   }
+  if (reinterpret_cast<uintptr_t>(result) + size < size) {
+    return NULL;
+  }
   // Is it aligned?
   uintptr_t ptr = reinterpret_cast<uintptr_t>(result);
   if ((ptr & (alignment-1)) == 0)  return result;
@@ -295,7 +352,44 @@ void* SbrkSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
 
 void* MmapSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
                               size_t alignment) {
-#ifndef HAVE_MMAP
+#ifdef TCMALLOC_SGX
+  // Inside the enclave, mmap is not available. The region is reserved
+  // outside with a single mmap_o ocall, which also trims the mapping
+  // so that the returned pointer is aligned.
+  if (ocall_FLAGS_malloc_skip_mmap) {
+    return NULL;
+  }
+
+  // Enforce page alignment
+  if (pagesize == 0) pagesize = getpagesize_ocall();
+  if (alignment < pagesize) alignment = pagesize;
+  const bool huge_page = ocall_FLAGS_malloc_hugepage_mmap;
+  size_t granularity = huge_page ? kHugePageSize : alignment;
+  if (granularity < alignment) granularity = alignment;
+  size_t aligned_size = ((size + granularity - 1) / granularity) * granularity;
+  if (aligned_size < size) {
+    return NULL;
+  }
+  size = aligned_size;
+
+  void* result = NULL;
+  if (mmap_o(&result, size, alignment, huge_page ? 1 : 0,
+             ocall_FLAGS_malloc_numa_node) != SGX_SUCCESS ||
+      result == NULL || result == reinterpret_cast<void*>(-1)) {
+    return NULL;
+  }
+  // The region must not overlap the enclave range
+  if (!sgx_is_outside_enclave(result, size)) {
+    return NULL;
+  }
+
+  // "actual_size" indicates that the bytes from the returned pointer
+  // p up to and including (p + actual_size - 1) have been allocated.
+  if (actual_size) {
+    *actual_size = size;
+  }
+  return result;
+#elif !defined(HAVE_MMAP)
   return NULL;
 #else
   // Check if we should use mmap allocation.
@@ -469,6 +563,79 @@ void* DefaultSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
   return NULL;
 }
 
+// The host maps the range with MAP_NORESERVE, its pages only cost once the
+// page heap touches them.  With the heap in one range, PageHeap indexes its
+// pages with a flat array instead of the radix tree, see
+// TCMalloc_PageMapRange.
+void ReservedSysAllocator_ocall::ReserveRange() {
+  range_tried_ = true;
+  const size_t range_size =
+      static_cast<size_t>(ocall_FLAGS_malloc_reserve_range_gb) << 30;
+  if (range_size == 0) return;
+  size_t reserved = 0;
+  void* range = child_->Alloc(range_size, &reserved, kPageSize);
+  if (range == NULL) {
+    Log(kLog, __FILE__, __LINE__,
+        "could not reserve the outside range, bytes", range_size);
+    return;
+  }
+  range_start_ = reinterpret_cast<uintptr_t>(range);
+  range_size_ = reserved;
+  cur_ = range_start_;
+  end_ = range_start_ + reserved;
+}
+
+void* ReservedSysAllocator_ocall::Alloc(size_t size, size_t *actual_size,
+                                        size_t alignment) {
+  if (!range_tried_) ReserveRange();
+  const size_t arena_size =
+      static_cast<size_t>(ocall_FLAGS_malloc_reserve_arena_mb) << 20;
+  uintptr_t ptr = (cur_ + alignment - 1) & ~(alignment - 1);
+  const bool fits = cur_ != 0 && ptr >= cur_ && ptr + size >= ptr &&
+                    ptr + size <= end_;
+  // Requests at least as large as an arena are not worth carving, unless
+  // the range still holds them
+  if (!fits && (arena_size == 0 || size >= arena_size)) {
+    return child_->Alloc(size, actual_size, alignment);
+  }
+
+  if (!fits) {
+    // Refill. The tail of the old arena is abandoned; it is at most
+    // one GrowHeap request in size.
+    size_t reserved = 0;
+    void* arena = child_->Alloc(arena_size, &reserved, alignment);
+    if (arena == NULL) {
+      // Could not get a whole arena, try the exact size instead
+      return child_->Alloc(size, actual_size, alignment);
+    }
+    cur_ = reinterpret_cast<uintptr_t>(arena);
+    end_ = cur_ + reserved;
+    ptr = cur_;
+  }
+
+  cur_ = ptr + size;
+  if (actual_size) {
+    *actual_size = size;
+  }
+  return reinterpret_cast<void*>(ptr);
+}
+
+#ifdef TCMALLOC_SGX
+// Called by the host at enclave init, before anything grows the heap, with
+// the NUMA node of the tasks of this enclave.  The sbrk_o fallback is left
+// to first touch, the brk segment is shared by all the enclaves.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_set_numa_node(int node) {
+  ocall_FLAGS_malloc_numa_node = node;
+}
+
+// Called by the host at enclave init, before anything grows the heap, with
+// the GB of the outside range, 0 for none.  It is 0 when the host maps the
+// heap from hugetlbfs, whose pages are reserved for all of a mapping.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_set_reserve_range(size_t gb) {
+  ocall_FLAGS_malloc_reserve_range_gb = gb;
+}
+#endif
+
 ATTRIBUTE_WEAK ATTRIBUTE_NOINLINE
 SysAllocator_ocall *ocall_tc_get_sysalloc_override(SysAllocator_ocall *def)
 {
@@ -477,9 +644,7 @@ SysAllocator_ocall *ocall_tc_get_sysalloc_override(SysAllocator_ocall *def)
 
 static bool system_alloc_inited = false;
 void InitSystemAllocators_ocall(void) {
-#ifndef TCMALLOC_SGX
   MmapSysAllocator_ocall *mmap = new (mmap_space.buf) MmapSysAllocator_ocall();
-#endif
   SbrkSysAllocator_ocall *sbrk = new (sbrk_space.buf) SbrkSysAllocator_ocall();
 
   // In 64-bit debug mode, place the mmap allocator first since it
@@ -489,21 +654,103 @@ void InitSystemAllocators_ocall(void) {
   // likely to look like pointers and therefore the conservative gc in
   // the heap-checker is less likely to misinterpret a number as a
   // pointer).
+  //
+  // In SGX, the mmap allocator is always placed first. The brk segment of
+  // the untrusted process can never shrink, while mmap regions can be
+  // handed back with madvise_o, so sbrk_o is only kept as a fallback.
   DefaultSysAllocator_ocall *sdef = new (default_space.buf) DefaultSysAllocator_ocall();
+#ifdef TCMALLOC_SGX
+  sdef->SetChildAllocator(mmap, 0, mmap_name);
+  sdef->SetChildAllocator(sbrk, 1, sbrk_name);
+#else
   if (kDebugMode && sizeof(void*) > 4) {
-#ifndef TCMALLOC_SGX    
     sdef->SetChildAllocator(mmap, 0, mmap_name);
-#endif
     sdef->SetChildAllocator(sbrk, 1, sbrk_name);
   } else {
     sdef->SetChildAllocator(sbrk, 0, sbrk_name);
-#ifndef TCMALLOC_SGX    
     sdef->SetChildAllocator(mmap, 1, mmap_name);
-#endif
   }
+#endif
 
+#ifdef TCMALLOC_SGX
+  // The arenas come from the hugetlbfs file of the host if it has one, see
+  // memfs_malloc.cc, and from mmap_o once that fails
+  SysAllocator_ocall *child = NewHugetlbSysAllocator_ocall(sdef);
+  if (child == NULL) child = sdef;
+  ReservedSysAllocator_ocall *reserved =
+      new (reserved_space.buf) ReservedSysAllocator_ocall(child);
+  sys_alloc_ocall = ocall_tc_get_sysalloc_override(reserved);
+#else
   sys_alloc_ocall = ocall_tc_get_sysalloc_override(sdef);
+#endif
+}
+
+#ifdef TCMALLOC_SGX
+// Outside memory taken from the system allocators ahead of time and kept
+// out of the page heap, for when they fail.  A heap growth the host cannot
+// serve gets all of it instead, tells the host with memory_pressure_o
+// so that it evicts cached partitions of this enclave, and the task goes
+// on.  It is taken again at the next growth the host serves.  Without it a
+// NULL reaches the Rust allocator, which aborts the enclave with every
+// task inside.
+static void* oom_reserve = NULL;
+static size_t oom_reserve_size = 0;
+static size_t oom_reserve_target = 0;
+static uint64_t oom_reserve_uses = 0;
+
+// REQUIRES: spinlock held
+static void FillOOMReserve() {
+  if (oom_reserve != NULL || oom_reserve_target == 0) return;
+  size_t actual = 0;
+  void* reserve = sys_alloc_ocall->Alloc(oom_reserve_target, &actual,
+                                         kPageSize);
+  if (reserve != NULL) {
+    oom_reserve = reserve;
+    oom_reserve_size = actual;
+  }
+}
+
+// REQUIRES: spinlock held
+static void* TakeOOMReserve(size_t size, size_t *actual_size,
+                            size_t alignment) {
+  void* result = NULL;
+  if (oom_reserve != NULL && size <= oom_reserve_size &&
+      (reinterpret_cast<uintptr_t>(oom_reserve) & (alignment - 1)) == 0) {
+    result = oom_reserve;
+    *actual_size = oom_reserve_size;
+    oom_reserve = NULL;
+    oom_reserve_size = 0;
+    oom_reserve_uses++;
+  }
+  Log(kLog, __FILE__, __LINE__,
+      "outside heap growth failed, reserve used (size, uses)",
+      size, result != NULL ? oom_reserve_uses : 0);
+  // The host evicts after this returns, the spinlock is held here.
+  memory_pressure_o(size);
+  return result;
+}
+
+// Called by the host at enclave init with the bytes to hold back, 0 for
+// none.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_set_oom_reserve(size_t bytes) {
+  SpinLockHolder lock_holder(&spinlock);
+  if (!system_alloc_inited) {
+    InitSystemAllocators_ocall();
+    system_alloc_inited = true;
+  }
+  oom_reserve_target = bytes;
+  FillOOMReserve();
+}
+#endif
+
+#ifdef TCMALLOC_SGX
+bool TCMalloc_SystemRange_ocall(uintptr_t* start, size_t* size) {
+  SpinLockHolder lock_holder(&spinlock);
+  if (!system_alloc_inited) return false;
+  return reinterpret_cast<ReservedSysAllocator_ocall*>(
+      reserved_space.buf)->Range(start, size);
 }
+#endif
 
 void* TCMalloc_SystemAlloc_ocall(size_t size, size_t *actual_size,
                            size_t alignment) {
@@ -527,6 +774,13 @@ void* TCMalloc_SystemAlloc_ocall(size_t size, size_t *actual_size,
   }
 
   void* result = sys_alloc_ocall->Alloc(size, actual_size, alignment);
+#ifdef TCMALLOC_SGX
+  if (result == NULL) {
+    result = TakeOOMReserve(size, actual_size, alignment);
+  } else {
+    FillOOMReserve();
+  }
+#endif
   if (result != NULL) {
     CHECK_CONDITION(
       CheckAddressBits<kAddressBits>(
@@ -538,7 +792,38 @@ void* TCMalloc_SystemAlloc_ocall(size_t size, size_t *actual_size,
 }
 
 bool TCMalloc_SystemRelease_ocall(void* start, size_t length) {
-#ifdef MADV_FREE
+#ifdef TCMALLOC_SGX
+  // Both the mmap_o regions and the sbrk_o segment are anonymous memory
+  // of the untrusted process, so MADV_DONTNEED is applied outside.  The
+  // host punches the ranges of its hugetlbfs file out of the file instead.
+  if (ocall_FLAGS_malloc_disable_memory_release) return false;
+  if (pagesize == 0) pagesize = getpagesize_ocall();
+  const size_t pagemask = pagesize - 1;
+
+  size_t new_start = reinterpret_cast<size_t>(start);
+  size_t end = new_start + length;
+  size_t new_end = end;
+
+  // Round up the starting address and round down the ending address
+  // to be page aligned:
+  new_start = (new_start + pagesize - 1) & ~pagemask;
+  new_end = new_end & ~pagemask;
+
+  ASSERT((new_start & pagemask) == 0);
+  ASSERT((new_end & pagemask) == 0);
+  ASSERT(new_start >= reinterpret_cast<size_t>(start));
+  ASSERT(new_end <= end);
+
+  if (new_end > new_start) {
+    int32_t result = -1;
+    if (madvise_o(&result, reinterpret_cast<void*>(new_start),
+                  new_end - new_start) != SGX_SUCCESS) {
+      return false;
+    }
+    return result != -1;
+  }
+  return false;
+#elif defined MADV_FREE
   if (ocall_FLAGS_malloc_devmem_start) {
     // It's not safe to use MADV_FREE/MADV_DONTNEED if we've been
     // mapping /dev/mem for heap memory.
@@ -39,6 +39,7 @@
 
 #include <config.h>
 #include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uintptr_t
 
 class SysAllocator_ocall;
 
@@ -89,4 +90,15 @@ extern PERFTOOLS_DLL_DECL SysAllocator_ocall* sys_alloc_ocall;
 // Number of bytes taken from system.
 extern PERFTOOLS_DLL_DECL size_t TCMalloc_SystemTaken_ocall;
 
+#ifdef TCMALLOC_SGX
+// The allocator of memfs_malloc.cc, over "fallback", if the host maps the
+// heap from a hugetlbfs mount.  Returns NULL otherwise.
+SysAllocator_ocall* NewHugetlbSysAllocator_ocall(SysAllocator_ocall* fallback);
+
+// The contiguous range the heap is carved from, see
+// TCMALLOC_RESERVE_RANGE_GB.  Returns false if none was reserved (yet).
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemRange_ocall(uintptr_t* start, size_t* size);
+#endif
+
 #endif /* TCMALLOC_SYSTEM_ALLOC_H_ */
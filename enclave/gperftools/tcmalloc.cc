@@ -308,6 +308,9 @@ struct TCMallocStats {
   uint64_t transfer_bytes;    // Bytes in central transfer cache
   uint64_t metadata_bytes;    // Bytes alloced for metadata
   PageHeap::Stats pageheap;   // Stats from page heap
+  uint64_t central_contentions;  // Waits on central freelist locks
+  uint64_t shard_contentions;    // Waits on transfer shard locks
+  uint64_t shard_hits;           // Batches moved through transfer shards
 };
 
 // Get stats into "r".  Also, if class_count != NULL, class_count[k]
@@ -319,7 +322,13 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
                          PageHeap::LargeSpanStats* large_spans) {
   r->central_bytes = 0;
   r->transfer_bytes = 0;
+  r->central_contentions = 0;
+  r->shard_contentions = 0;
+  r->shard_hits = 0;
   for (int cl = 0; cl < kNumClasses; ++cl) {
+    Static::central_cache()[cl].GetContentionStats(&r->central_contentions,
+                                                   &r->shard_contentions,
+                                                   &r->shard_hits);
     const int length = Static::central_cache()[cl].length();
     const int ocall_tc_length = Static::central_cache()[cl].ocall_tc_length();
     const size_t cache_overhead = Static::central_cache()[cl].OverheadBytes();
@@ -401,6 +410,9 @@ static void DumpStats(TCMalloc_Printer_ocall* out, int level) {
       "MALLOC:   %12" PRIu64 "              Spans in use\n"
       "MALLOC:   %12" PRIu64 "              Thread heaps in use\n"
       "MALLOC:   %12" PRIu64 "              Tcmalloc page size\n"
+      "MALLOC:   %12" PRIu64 "              Central freelist lock waits\n"
+      "MALLOC:   %12" PRIu64 "              Transfer shard lock waits\n"
+      "MALLOC:   %12" PRIu64 "              Batches moved through transfer shards\n"
       "------------------------------------------------\n"
       "Call ReleaseFreeMemory() to release freelist memory to the OS"
       " (via madvise()).\n"
@@ -417,7 +429,10 @@ static void DumpStats(TCMalloc_Printer_ocall* out, int level) {
       virtual_memory_used, virtual_memory_used / MiB,
       uint64_t(Static::span_allocator()->inuse()),
       uint64_t(ThreadCache::HeapsInUse()),
-      uint64_t(kPageSize));
+      uint64_t(kPageSize),
+      stats.central_contentions,
+      stats.shard_contentions,
+      stats.shard_hits);
 
   if (level >= 2) {
     out->printf("------------------------------------------------\n");
@@ -689,6 +704,27 @@ class TCMallocImplementation_ocall : public MallocExtension_ocall {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.central_cache_lock_contentions") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL, NULL, NULL);
+      *value = stats.central_contentions;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.transfer_shard_lock_contentions") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL, NULL, NULL);
+      *value = stats.shard_contentions;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.transfer_shard_hits") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL, NULL, NULL);
+      *value = stats.shard_hits;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.thread_cache_free_bytes") == 0) {
       TCMallocStats stats;
       ExtractStats(&stats, NULL, NULL, NULL);
@@ -1175,6 +1211,14 @@ inline void* do_malloc_ocall_pages(ThreadCache* heap, size_t size) {
     SpinLockHolder h(Static::pageheap_lock());
     report_large = should_report_large(num_pages);
   } else {
+#ifdef TCMALLOC_SGX
+    // A span of about this size this thread freed before is still
+    // allocated in the page heap, so it is handed out without the lock.
+    Span* cached = heap->TakeLargeSpan(num_pages);
+    if (cached != NULL) {
+      return SpanToMallocResult(cached);
+    }
+#endif
     SpinLockHolder h(Static::pageheap_lock());
     Span* span = Static::pageheap()->New(num_pages);
     result = (UNLIKELY(span == NULL) ? NULL : SpanToMallocResult(span));
@@ -1354,9 +1398,15 @@ ALWAYS_INLINE void do_free_helper(void* ptr,
       Static::central_cache()[cl].InsertRange(ptr, ptr, 1);
     }
   } else {
+    ASSERT(span != NULL && span->start == p);
+#ifdef TCMALLOC_SGX
+    if ((heap_must_be_valid || heap != NULL) && !span->sample &&
+        heap->PutLargeSpan(span)) {
+      return;
+    }
+#endif
     SpinLockHolder h(Static::pageheap_lock());
     ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
-    ASSERT(span != NULL && span->start == p);
     if (span->sample) {
       StackTrace* st = reinterpret_cast<StackTrace*>(span->objects);
       tcmalloc_ocall::DLL_Remove(span);
@@ -1415,6 +1465,23 @@ inline size_t GetSizeWithCallback(const void* ptr,
 
 // This lets you call back to a given function pointer if ptr is invalid.
 // It is used primarily by windows code which wants a specialized callback.
+// Extends the large object at ptr to new_size bytes by taking the free
+// pages right behind its span.  Outside vectors that keep growing
+// (combine_enc and friends) then avoid an allocate-and-copy per doubling.
+static bool GrowLargeInPlace(void* ptr, size_t new_size) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  SpinLockHolder h(Static::pageheap_lock());
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  if (span == NULL || span->start != p || span->sizeclass != 0 || span->sample) {
+    return false;
+  }
+  const Length num_pages = tcmalloc_ocall::pages(new_size);
+  if (num_pages <= span->length) {
+    return true;
+  }
+  return Static::pageheap()->GrowInPlace(span, num_pages);
+}
+
 ALWAYS_INLINE void* do_realloc_with_callback(
     void* old_ptr, size_t new_size,
     void (*invalid_free_fn)(void*),
@@ -1430,6 +1497,12 @@ ALWAYS_INLINE void* do_realloc_with_callback(
   // X and Y trade-off time for wasted space.  For now we do 1.25 and 0.5.
   const size_t lower_bound_to_grow = old_size + old_size / 4ul;
   const size_t upper_bound_to_shrink = old_size / 2ul;
+  if (new_size > old_size && old_size > kMaxSize &&
+      GrowLargeInPlace(old_ptr, new_size)) {
+    MallocHook_ocall::InvokeDeleteHook(old_ptr);
+    MallocHook_ocall::InvokeNewHook(old_ptr, new_size);
+    return old_ptr;
+  }
   if ((new_size > old_size) || (new_size < upper_bound_to_shrink)) {
     // Need to reallocate.
     void* new_ptr = NULL;
@@ -1477,6 +1550,19 @@ void* do_memalign(size_t align, size_t size) {
   ASSERT(align > 0);
   if (size + align < size) return NULL;         // Overflow
 
+#ifdef TCMALLOC_SGX
+  // The tuned size classes are only 128 byte aligned, so ask the size map
+  // what alignment the class of this size really gives.
+  if (UNLIKELY(Static::pageheap() == NULL)) ThreadCache::InitModule();
+  if (align <= AlignmentForSize(size) &&
+      (size > kMaxSize ||
+       (Static::sizemap()->class_to_size(
+            Static::sizemap()->SizeClass(size)) & (align - 1)) == 0)) {
+    void* p = do_malloc_ocall(size);
+    ASSERT((reinterpret_cast<uintptr_t>(p) % align) == 0);
+    return p;
+  }
+#else
   // Fall back to malloc if we would already align this memory access properly.
   if (align <= AlignmentForSize(size)) {
     void* p = do_malloc_ocall(size);
@@ -1485,6 +1571,7 @@ void* do_memalign(size_t align, size_t size) {
   }
 
   if (UNLIKELY(Static::pageheap() == NULL)) ThreadCache::InitModule();
+#endif
 
   // Allocate at least one byte to avoid boundary conditions below
   if (size == 0) size = 1;
@@ -1633,6 +1720,29 @@ extern "C" PERFTOOLS_DLL_DECL int ocall_tc_set_new_mode(int flag) PERFTOOLS_THRO
   return old_mode;
 }
 
+#ifdef TCMALLOC_SGX
+// Called once by the host at enclave init with the number of threads that
+// may enter the enclave.  The thread cache budget and the transfer cache
+// limits were sized for the default CPU count of sgx_utils.cc and are scaled
+// up accordingly.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_set_num_cpus(int num_cpus) PERFTOOLS_THROW {
+  if (num_cpus <= 0) return;
+  const int old_cpus = GetSystemCPUsCount_ocall();
+  SetSystemCPUsCount_ocall(num_cpus);
+  if (UNLIKELY(Static::pageheap() == NULL)) ThreadCache::InitModule();
+
+  for (int cl = 1; cl < kNumClasses; ++cl) {
+    Static::central_cache()[cl].ScaleCacheLimit(num_cpus);
+  }
+
+  SpinLockHolder h(Static::pageheap_lock());
+  const size_t per_cpu = ThreadCache::overall_thread_cache_size() / old_cpus;
+  if (num_cpus > old_cpus) {
+    ThreadCache::set_overall_thread_cache_size(per_cpu * num_cpus);
+  }
+}
+#endif
+
 #ifndef TCMALLOC_USING_DEBUGALLOCATION  // debugallocation.cc defines its own
 
 #if defined(__GNUC__) && defined(__ELF__) && !defined(TCMALLOC_NO_ALIASES)
@@ -1645,7 +1755,115 @@ extern "C" PERFTOOLS_DLL_DECL int ocall_tc_set_new_mode(int flag) PERFTOOLS_THRO
 //         heap-checker.cc depends on this to start a stack trace from
 //         the call to the (de)allocation function.
 
+#ifdef TCMALLOC_SGX
+// Mirrors tc_stats_t in enclave/Enclave.edl; keep the two in sync.
+static const int kStatsMaxClasses = 128;
+struct TCMallocSgxStats {
+  uint64_t system_bytes;
+  uint64_t pageheap_free_bytes;
+  uint64_t pageheap_unmapped_bytes;
+  uint64_t central_bytes;
+  uint64_t transfer_bytes;
+  uint64_t thread_bytes;
+  uint64_t metadata_bytes;
+  uint64_t central_contentions;
+  uint64_t shard_contentions;
+  uint64_t shard_hits;
+  uint64_t num_classes;
+  uint64_t class_size[kStatsMaxClasses];
+  uint64_t class_count[kStatsMaxClasses];
+};
+COMPILE_ASSERT(kNumClasses <= kStatsMaxClasses, too_many_size_classes);
+
+// Fills "out", a tc_stats_t, with a snapshot of the allocator.  class_count
+// holds the free objects of each class across the thread, transfer and
+// central caches.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_get_stats(void* out) PERFTOOLS_THROW {
+  TCMallocSgxStats* r = reinterpret_cast<TCMallocSgxStats*>(out);
+  memset(r, 0, sizeof(*r));
+  if (UNLIKELY(Static::pageheap() == NULL)) ThreadCache::InitModule();
+
+  TCMallocStats stats;
+  uint64_t class_count[kNumClasses];
+  ExtractStats(&stats, class_count, NULL, NULL);
+  r->system_bytes = stats.pageheap.system_bytes;
+  r->pageheap_free_bytes = stats.pageheap.free_bytes;
+  r->pageheap_unmapped_bytes = stats.pageheap.unmapped_bytes;
+  r->central_bytes = stats.central_bytes;
+  r->transfer_bytes = stats.transfer_bytes;
+  r->thread_bytes = stats.thread_bytes;
+  r->metadata_bytes = stats.metadata_bytes;
+  r->central_contentions = stats.central_contentions;
+  r->shard_contentions = stats.shard_contentions;
+  r->shard_hits = stats.shard_hits;
+  r->num_classes = kNumClasses;
+  for (int cl = 0; cl < kNumClasses; ++cl) {
+    r->class_size[cl] = Static::sizemap()->ByteSizeForClass(cl);
+    r->class_count[cl] = class_count[cl];
+  }
+}
+
+// Returns the free page heap memory that was not reused since the previous
+// call to the host, with madvise_o.  Called every interval by the
+// scavenger thread of the enclave, which keeps the free path from paying
+// for releases.  Returns the bytes released.
+extern "C" PERFTOOLS_DLL_DECL size_t ocall_tc_scavenge_idle() PERFTOOLS_THROW {
+  if (UNLIKELY(Static::pageheap() == NULL)) return 0;
+  SpinLockHolder h(Static::pageheap_lock());
+  return Static::pageheap()->ReleaseIdlePages() << kPageShift;
+}
+
+// Histogram of the requested sizes between kSizeHistogramMin and kMaxSize,
+// in the 128 byte steps size classes can have there.  Off by default; it
+// is what kTunedClassSizes in common.cc is seeded from.
+static const size_t kSizeHistogramMin = 1024;
+static const size_t kSizeHistogramStep = 128;
+static const int kSizeHistogramBuckets =
+    (kMaxSize - kSizeHistogramMin) / kSizeHistogramStep + 1;
+static bool size_histogram_enabled = false;
+static uint32_t size_histogram[kSizeHistogramBuckets];
+
+static inline void RecordAllocationSize(size_t size) {
+  if (size <= kSizeHistogramMin || size > kMaxSize) return;
+  const int b = (size - kSizeHistogramMin - 1) / kSizeHistogramStep;
+  __sync_fetch_and_add(&size_histogram[b], 1);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_size_histogram_enable(int enable) PERFTOOLS_THROW {
+  if (enable) memset(size_histogram, 0, sizeof(size_histogram));
+  size_histogram_enabled = (enable != 0);
+}
+
+// Fills sizes/counts with up to n of the most requested sizes, each sizes[i]
+// being the upper bound of its bucket, most requested first.  Returns the
+// number of entries filled.
+extern "C" PERFTOOLS_DLL_DECL int ocall_tc_size_histogram_top(
+    size_t* sizes, uint64_t* counts, int n) PERFTOOLS_THROW {
+  int filled = 0;
+  for (int b = 0; b < kSizeHistogramBuckets; ++b) {
+    const uint64_t c = size_histogram[b];
+    if (c == 0) continue;
+    int i = filled < n ? filled++ : n;  // Insertion point, n drops it
+    while (i > 0 && counts[i-1] < c) {
+      if (i < n) {
+        sizes[i] = sizes[i-1];
+        counts[i] = counts[i-1];
+      }
+      i--;
+    }
+    if (i < n) {
+      sizes[i] = kSizeHistogramMin + (b + 1) * kSizeHistogramStep;
+      counts[i] = c;
+    }
+  }
+  return filled;
+}
+#endif
+
 extern "C" PERFTOOLS_DLL_DECL void* ocall_tc_malloc(size_t size) PERFTOOLS_THROW {
+#ifdef TCMALLOC_SGX
+  if (UNLIKELY(size_histogram_enabled)) RecordAllocationSize(size);
+#endif
 
   void* result = do_malloc_ocall_or_cpp_alloc(size);
   MallocHook_ocall::InvokeNewHook(result, size);
@@ -1677,6 +1895,69 @@ extern "C" PERFTOOLS_DLL_DECL void ocall_tc_free_sized(void *ptr, size_t size) P
   do_free_with_callback(ptr, &InvalidFree, true, size);
 }
 
+// Returns the number of bytes ocall_tc_malloc(size) would really allocate.
+// Two sizes with the same result share a size class (or a page count), so
+// callers that free with ocall_tc_free_sized can tell whether a resize has
+// to move the object.  No flags are supported.
+extern "C" PERFTOOLS_DLL_DECL size_t ocall_tc_nallocx(size_t size, int flags) PERFTOOLS_THROW {
+  if (UNLIKELY(flags != 0)) return 0;
+  if (UNLIKELY(Static::pageheap() == NULL)) ThreadCache::InitModule();
+  size_t cl;
+  if (Static::sizemap()->MaybeSizeClass(size, &cl)) {
+    return Static::sizemap()->ByteSizeForClass(cl);
+  }
+  return tcmalloc_ocall::pages(size) << kPageShift;
+}
+
+// Frees n objects at once.  Small objects are grouped by size class and
+// handed to the central cache in batches of num_objects_to_move, bypassing
+// the thread cache, so tearing down a list of ciphertext blocks costs one
+// InsertRange per batch instead of a Deallocate (and possibly a Scavenge)
+// per block.  Large objects and NULLs go through the normal free path.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_free_batch(void** ptrs, size_t n) PERFTOOLS_THROW {
+  if (n == 0) return;
+  if (UNLIKELY(!Static::IsInited())) {
+    for (size_t i = 0; i < n; i++) ocall_tc_free(ptrs[i]);
+    return;
+  }
+  void* heads[kNumClasses];
+  void* tails[kNumClasses];
+  int counts[kNumClasses];
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < n; i++) {
+    void* ptr = ptrs[i];
+    if (ptr == NULL) continue;
+    const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+    size_t cl = Static::pageheap()->GetSizeClassIfCached(p);
+    if (cl == 0) {
+      const Span* span = Static::pageheap()->GetDescriptor(p);
+      if (span == NULL || span->sizeclass == 0) {
+        ocall_tc_free(ptr);
+        continue;
+      }
+      cl = span->sizeclass;
+      Static::pageheap()->CacheSizeClass(p, cl);
+    }
+    MallocHook_ocall::InvokeDeleteHook(ptr);
+    if (counts[cl] == 0) {
+      tails[cl] = ptr;
+      tcmalloc_ocall::SLL_SetNext(ptr, NULL);
+    } else {
+      tcmalloc_ocall::SLL_SetNext(ptr, heads[cl]);
+    }
+    heads[cl] = ptr;
+    if (++counts[cl] == Static::sizemap()->num_objects_to_move(cl)) {
+      Static::central_cache()[cl].InsertRange(heads[cl], tails[cl], counts[cl]);
+      counts[cl] = 0;
+    }
+  }
+  for (size_t cl = 1; cl < kNumClasses; cl++) {
+    if (counts[cl] != 0) {
+      Static::central_cache()[cl].InsertRange(heads[cl], tails[cl], counts[cl]);
+    }
+  }
+}
+
 #ifdef TC_ALIAS
 
 extern "C" PERFTOOLS_DLL_DECL void ocall_tc_delete_sized(void *p, size_t size) throw()
@@ -0,0 +1,131 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// ---
+// A malloc/free loop over the allocator of the outside memory, run by the
+// bench_tcmalloc ECALL on as many enclave threads as the host enters it
+// with.  The sizes follow what the enclave asks the outside heap for: the
+// ciphertext of an encryption block, cut at an item boundary so somewhere
+// around enc_block_bytes, plus the small buffers around it.  The host reads
+// the throughput, the sbrk_o rate and the central freelist contention off
+// its own counters and ocall_tc_get_stats.
+
+#include <config.h>
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t, uint32_t
+#endif
+#include <gperftools/tcmalloc.h>        // for ocall_tc_malloc, etc
+
+namespace {
+
+enum SizeDistribution {
+  kCiphertext = 0,    // blocks of about block_bytes, one in eight small
+  kSmall = 1,         // 16 bytes to 1 KiB, the small size classes
+  kLarge = 2,         // 64 KiB to 1 MiB, spans of the page heap
+};
+
+// The AES-GCM tag and nonce appended to every ciphertext.
+static const size_t kCiphertextOverhead = 28;
+
+// Objects each thread keeps alive, so frees do not just undo the last
+// malloc and the thread cache sees a working set.
+static const int kLiveObjects = 512;
+
+// Slots the threads of a shared run swap their objects through, so most
+// objects are freed by another thread than the one that allocated them, as
+// the blocks handed between the pool workers are.
+static const int kSharedSlots = 4096;
+static void* shared_slots[kSharedSlots];
+
+// xorshift64*, enough to scatter sizes and slots.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed | 1) { }
+
+  uint64_t Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ULL;
+  }
+
+  // Uniform in [lo, hi).
+  size_t Range(size_t lo, size_t hi) {
+    return lo + Next() % (hi - lo);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+static size_t NextSize(Random* rng, uint32_t dist, size_t block_bytes) {
+  switch (dist) {
+    case kSmall:
+      return rng->Range(16, 1024);
+    case kLarge:
+      return rng->Range(64 << 10, 1 << 20);
+    default:
+      if (rng->Next() % 8 == 0) return rng->Range(16, 256);
+      return rng->Range(block_bytes / 2, block_bytes + block_bytes / 2) +
+          kCiphertextOverhead;
+  }
+}
+
+}  // namespace
+
+// Runs "ops" malloc/free pairs on the calling thread and frees what is left
+// at the end, except the objects parked in the shared slots.  Returns a
+// checksum of the bytes written so the loop is not optimized out.
+extern "C" PERFTOOLS_DLL_DECL uint64_t ocall_tc_bench(
+    uint64_t ops, uint64_t seed, uint32_t dist, uint64_t block_bytes,
+    int shared) PERFTOOLS_THROW {
+  Random rng(seed);
+  if (block_bytes < 64) block_bytes = 64;
+  void* live[kLiveObjects] = { NULL };
+  size_t sizes[kLiveObjects] = { 0 };
+  uint64_t checksum = 0;
+  for (uint64_t i = 0; i < ops; i++) {
+    size_t size = NextSize(&rng, dist, block_bytes);
+    char* p = static_cast<char*>(ocall_tc_malloc(size));
+    if (p == NULL) break;
+    // One byte per page the way the enclave writes ciphertext, first and
+    // last included.
+    for (size_t off = 0; off < size; off += 4096) {
+      p[off] = static_cast<char>(i);
+    }
+    p[size - 1] = static_cast<char>(i);
+    checksum += static_cast<unsigned char>(p[0]);
+
+    void* old;
+    size_t old_size;
+    if (shared) {
+      int slot = rng.Range(0, kSharedSlots);
+      // The slot keeps no size, the object may come from any thread.
+      old = __atomic_exchange_n(&shared_slots[slot], p, __ATOMIC_ACQ_REL);
+      old_size = 0;
+    } else {
+      int slot = rng.Range(0, kLiveObjects);
+      old = live[slot];
+      old_size = sizes[slot];
+      live[slot] = p;
+      sizes[slot] = size;
+    }
+    if (old == NULL) continue;
+    if (old_size != 0) {
+      ocall_tc_free_sized(old, old_size);
+    } else {
+      ocall_tc_free(old);
+    }
+  }
+  for (int i = 0; i < kLiveObjects; i++) {
+    if (live[i] != NULL) ocall_tc_free_sized(live[i], sizes[i]);
+  }
+  return checksum;
+}
+
+// Frees the objects parked in the shared slots by the last shared run.
+extern "C" PERFTOOLS_DLL_DECL void ocall_tc_bench_drain() PERFTOOLS_THROW {
+  for (int i = 0; i < kSharedSlots; i++) {
+    void* p = __atomic_exchange_n(&shared_slots[i], NULL, __ATOMIC_ACQ_REL);
+    if (p != NULL) ocall_tc_free(p);
+  }
+}
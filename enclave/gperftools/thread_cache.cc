@@ -76,6 +76,9 @@ __thread ThreadCache::ThreadLocalData ThreadCache::threadlocal_data_
 #endif
 bool ThreadCache::tsd_inited_ = false;
 pthread_key_t ThreadCache::heap_key_;
+#ifdef TCMALLOC_PER_TCS_CACHES
+ThreadCache::TCSHeapSlot ThreadCache::tcs_heaps_[kMaxTCSHeaps];
+#endif
 
 void ThreadCache::Init(pthread_t tid) {
   size_ = 0;
@@ -99,6 +102,10 @@ void ThreadCache::Init(pthread_t tid) {
   for (size_t cl = 0; cl < kNumClasses; ++cl) {
     list_[cl].Init();
   }
+#ifdef TCMALLOC_SGX
+  large_count_ = 0;
+  large_pages_ = 0;
+#endif
 
   uint32_t sampler_seed;
   memcpy(&sampler_seed, &tid, sizeof(sampler_seed));
@@ -112,8 +119,64 @@ void ThreadCache::Cleanup() {
       ReleaseToCentralCache(&list_[cl], cl, list_[cl].length());
     }
   }
+#ifdef TCMALLOC_SGX
+  if (large_count_ > 0) {
+    SpinLockHolder h(Static::pageheap_lock());
+    ReleaseLargeSpansLocked();
+  }
+#endif
 }
 
+#ifdef TCMALLOC_SGX
+Span* ThreadCache::TakeLargeSpan(Length num_pages) {
+  for (int i = 0; i < large_count_; ++i) {
+    Span* span = large_[i];
+    if (span->length >= num_pages && span->length <= num_pages + num_pages / 8) {
+      memmove(&large_[i], &large_[i + 1],
+              (large_count_ - i - 1) * sizeof(large_[0]));
+      --large_count_;
+      large_pages_ -= span->length;
+      return span;
+    }
+  }
+  return NULL;
+}
+
+bool ThreadCache::PutLargeSpan(Span* span) {
+  ASSERT(span->sizeclass == 0 && !span->sample);
+  const Length limit = kLargeSpanCacheBytes >> kPageShift;
+  // Spans of a memalign at or below kMaxSize are never asked for again.
+  if (span->length <= (kMaxSize >> kPageShift) || span->length > limit / 2) {
+    return false;
+  }
+  if (large_count_ == kLargeSpanCacheSlots ||
+      large_pages_ + span->length > limit) {
+    // Make room by handing back the spans kept longest, so the cache
+    // follows the sizes freed last.
+    SpinLockHolder h(Static::pageheap_lock());
+    int drop = 0;
+    while (drop < large_count_ &&
+           (large_count_ - drop == kLargeSpanCacheSlots ||
+            large_pages_ + span->length > limit)) {
+      large_pages_ -= large_[drop]->length;
+      Static::pageheap()->Delete(large_[drop++]);
+    }
+    large_count_ -= drop;
+    memmove(&large_[0], &large_[drop], large_count_ * sizeof(large_[0]));
+  }
+  large_[large_count_++] = span;
+  large_pages_ += span->length;
+  return true;
+}
+
+void ThreadCache::ReleaseLargeSpansLocked() {
+  while (large_count_ > 0) {
+    Static::pageheap()->Delete(large_[--large_count_]);
+  }
+  large_pages_ = 0;
+}
+#endif
+
 // Remove some objects of class "cl" from central cache and add to thread heap.
 // On success, return the first object for immediate use; otherwise return NULL.
 void* ThreadCache::FetchFromCentralCache(size_t cl, size_t byte_size) {
@@ -325,6 +388,20 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
     const pthread_t me = pthread_self();
 #endif
 
+#ifdef TCMALLOC_PER_TCS_CACHES
+    // A previous thread on this TCS may have left its heap behind.
+    heap = FindTCSHeapLocked(me);
+    if (heap == NULL) {
+      heap = NewHeap(me);
+      AddTCSHeapLocked(heap);
+    }
+  }
+
+  // Only the __thread copy is set; the heap outlives the thread.
+  threadlocal_data_.heap = heap;
+  SetMinSizeForSlowPath(kMaxSize + 1);
+  return heap;
+#else
     // This may be a recursive malloc call from pthread_setspecific()
     // In that case, the heap for this thread has already been created
     // and added to the linked list.  So we search for that first.
@@ -353,8 +430,62 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
     heap->in_setspecific_ = false;
   }
   return heap;
+#endif
+}
+
+#ifdef TCMALLOC_PER_TCS_CACHES
+static inline int TCSHeapHash(pthread_t tcs) {
+  uint64_t h = static_cast<uint64_t>(tcs) * 0x9E3779B97F4A7C15ULL;
+  return static_cast<int>(h >> 57);  // log2(kMaxTCSHeaps) top bits
 }
 
+ThreadCache* ThreadCache::FindTCSHeapLocked(pthread_t tcs) {
+  int i = TCSHeapHash(tcs);
+  for (int probe = 0; probe < kMaxTCSHeaps; ++probe) {
+    TCSHeapSlot* slot = &tcs_heaps_[(i + probe) & (kMaxTCSHeaps - 1)];
+    if (slot->heap == NULL) return NULL;
+    if (slot->tcs == tcs) return slot->heap;
+  }
+  return NULL;
+}
+
+void ThreadCache::AddTCSHeapLocked(ThreadCache* heap) {
+  int i = TCSHeapHash(heap->tid_);
+  for (int probe = 0; probe < kMaxTCSHeaps; ++probe) {
+    TCSHeapSlot* slot = &tcs_heaps_[(i + probe) & (kMaxTCSHeaps - 1)];
+    if (slot->heap == NULL) {
+      slot->tcs = heap->tid_;
+      slot->heap = heap;
+      return;
+    }
+  }
+  // More TCS slots than the table holds.  The heap still works, it is just
+  // recreated by the next thread on this TCS.
+  Log(kLog, __FILE__, __LINE__, "tcs heap table is full");
+}
+
+void ThreadCache::RemoveTCSHeapLocked(ThreadCache* heap) {
+  int i = TCSHeapHash(heap->tid_);
+  int probe = 0;
+  for (; probe < kMaxTCSHeaps; ++probe) {
+    TCSHeapSlot* slot = &tcs_heaps_[(i + probe) & (kMaxTCSHeaps - 1)];
+    if (slot->heap == NULL) return;
+    if (slot->heap == heap) break;
+  }
+  if (probe == kMaxTCSHeaps) return;
+  // Remove and reinsert the rest of the probe run so that lookups do not
+  // stop at the hole.
+  int hole = (i + probe) & (kMaxTCSHeaps - 1);
+  tcs_heaps_[hole].heap = NULL;
+  for (int j = (hole + 1) & (kMaxTCSHeaps - 1); tcs_heaps_[j].heap != NULL;
+       j = (j + 1) & (kMaxTCSHeaps - 1)) {
+    ThreadCache* moved = tcs_heaps_[j].heap;
+    tcs_heaps_[j].heap = NULL;
+    AddTCSHeapLocked(moved);
+  }
+}
+#endif
+
 ThreadCache* ThreadCache::NewHeap(pthread_t tid) {
   // Create the heap and add it to the linked list
   ThreadCache *heap = threadcache_allocator.New();
@@ -374,6 +505,11 @@ ThreadCache* ThreadCache::NewHeap(pthread_t tid) {
 }
 
 void ThreadCache::BecomeIdle() {
+#ifdef TCMALLOC_PER_TCS_CACHES
+  // The heap belongs to the TCS, not to this thread, so keep it and only
+  // hand its memory back.
+  BecomeTemporarilyIdle();
+#else
   if (!tsd_inited_) return;              // No caches yet
   ThreadCache* heap = GetThreadHeap();
   if (heap == NULL) return;             // No thread cache to remove
@@ -395,6 +531,7 @@ void ThreadCache::BecomeIdle() {
 
   // We can now get rid of the heap
   DeleteCache(heap);
+#endif
 }
 
 void ThreadCache::BecomeTemporarilyIdle() {
@@ -422,6 +559,9 @@ void ThreadCache::DeleteCache(ThreadCache* heap) {
 
   // Remove from linked list
   SpinLockHolder h(Static::pageheap_lock());
+#ifdef TCMALLOC_PER_TCS_CACHES
+  RemoveTCSHeapLocked(heap);
+#endif
   if (heap->next_ != NULL) heap->next_->prev_ = heap->prev_;
   if (heap->prev_ != NULL) heap->prev_->next_ = heap->next_;
   if (thread_heaps_ == heap) thread_heaps_ = heap->next_;
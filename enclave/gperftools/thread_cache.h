@@ -62,6 +62,8 @@ DECLARE_int64(tcmalloc_sample_parameter);
 
 namespace tcmalloc_ocall {
 
+struct Span;
+
 //-------------------------------------------------------------------
 // Data kept per thread
 //-------------------------------------------------------------------
@@ -85,13 +87,25 @@ class ThreadCache {
   int freelist_length(size_t cl) const { return list_[cl].length(); }
 
   // Total byte size in cache
+#ifdef TCMALLOC_SGX
+  size_t Size() const { return size_ + (large_pages_ << kPageShift); }
+#else
   size_t Size() const { return size_; }
+#endif
 
   // Allocate an object of the given size and class. The size given
   // must be the same as the size of the class in the size map.
   void* Allocate(size_t size, size_t cl);
   void Deallocate(void* ptr, size_t size_class);
 
+#ifdef TCMALLOC_SGX
+  // A kept span of at least num_pages pages and at most 1/8 more, or NULL.
+  Span* TakeLargeSpan(Length num_pages);
+  // Keeps a freed span of more than kMaxSize for TakeLargeSpan, unless the
+  // cache is full.  The span stays IN_USE in the page heap meanwhile.
+  bool PutLargeSpan(Span* span);
+#endif
+
   void Scavenge();
 
   int GetSamplePeriod();
@@ -290,6 +304,29 @@ class ThreadCache {
   static bool tsd_inited_;
   static pthread_key_t heap_key_;
 
+#ifdef TCMALLOC_PER_TCS_CACHES
+#ifndef HAVE_TLS
+#error "TCMALLOC_PER_TCS_CACHES keeps the heap pointer in __thread data"
+#endif
+  // In the enclave a thread runs on a TCS slot and pthread_self() is
+  // derived from that slot.  In this mode heaps are bound to the TCS
+  // instead of the thread: they are not registered with heap_key_, so no
+  // destructor drains them when a thread exits, and the next thread that
+  // enters on the same TCS picks the heap up again from this table.
+  // Protected by Static::pageheap_lock.
+  static const int kMaxTCSHeaps = 128;  // Power of two, > TCSNum
+  struct TCSHeapSlot {
+    pthread_t   tcs;
+    ThreadCache* heap;
+  };
+  static TCSHeapSlot tcs_heaps_[kMaxTCSHeaps];
+
+  // REQUIRES: Static::pageheap_lock is held.
+  static ThreadCache* FindTCSHeapLocked(pthread_t tcs);
+  static void AddTCSHeapLocked(ThreadCache* heap);
+  static void RemoveTCSHeapLocked(ThreadCache* heap);
+#endif
+
   // Linked list of heap objects.  Protected by Static::pageheap_lock.
   static ThreadCache* thread_heaps_;
   static int thread_heap_count_;
@@ -324,6 +361,17 @@ class ThreadCache {
 
   FreeList      list_[kNumClasses];     // Array indexed by size-class
 
+#ifdef TCMALLOC_SGX
+  // Freed large spans, see PutLargeSpan.  Only the owner touches them.
+  Span*         large_[kLargeSpanCacheSlots];
+  int           large_count_;
+  Length        large_pages_;           // Pages of the spans in large_
+
+  // Returns the kept spans to the page heap.
+  // REQUIRES: Static::pageheap_lock is held.
+  void ReleaseLargeSpansLocked();
+#endif
+
   pthread_t     tid_;                   // Which thread owns it
   bool          in_setspecific_;        // In call to pthread_setspecific?
 
@@ -0,0 +1,59 @@
+//! Checks that every block is freed by the heap that made it.
+//!
+//! The switch picks the heap of every allocation of a thread, so a missed
+//! set_switch(false), or one skipped by a panic, puts plaintext in outside
+//! memory without any error, and a missed set_switch(true) hands an inside
+//! block to the outside tcmalloc on free, or the other way round. Built with
+//! the alloc_guard feature (make SGX_ALLOC_GUARD=1) the allocator checks
+//! every block against the switch it is allocated and freed under, the
+//! address tells which heap made it, and stops at the first free under the
+//! wrong switch with the size of the block and where it lives. Without the
+//! feature the checks are empty and compile away, the code switches with
+//! the scoped `Allocator::outside` guard, which unwinding restores.
+use core::alloc::Layout;
+
+#[inline(always)]
+pub fn allocated(ptr: *mut u8, layout: &Layout, outside: bool) {
+    #[cfg(feature = "alloc_guard")]
+    check(ptr, layout, outside, "allocated");
+    #[cfg(not(feature = "alloc_guard"))]
+    let _ = (ptr, layout, outside);
+}
+
+#[inline(always)]
+pub fn freed(ptr: *mut u8, layout: &Layout, outside: bool) {
+    #[cfg(feature = "alloc_guard")]
+    check(ptr, layout, outside, "freed");
+    #[cfg(not(feature = "alloc_guard"))]
+    let _ = (ptr, layout, outside);
+}
+
+#[cfg(feature = "alloc_guard")]
+#[inline(always)]
+fn check(ptr: *mut u8, layout: &Layout, outside: bool, what: &str) {
+    if ptr.is_null() || layout.size() == 0 {
+        return;
+    }
+    //a block never straddles the enclave boundary, its first byte tells
+    let is_outside = sgx_trts::trts::rsgx_raw_is_outside_enclave(ptr, 1);
+    if is_outside != outside {
+        mismatch(ptr, layout, outside, what);
+    }
+}
+
+#[cfg(feature = "alloc_guard")]
+#[cold]
+#[inline(never)]
+fn mismatch(ptr: *mut u8, layout: &Layout, outside: bool, what: &str) -> ! {
+    //the message is allocated inside
+    crate::ALLOCATOR.set_switch(false);
+    panic!(
+        "block {:p} of {} bytes (align {}) {} with the switch {}, but it is {} the enclave",
+        ptr,
+        layout.size(),
+        layout.align(),
+        what,
+        if outside { "on" } else { "off" },
+        if outside { "inside" } else { "outside" },
+    );
+}
@@ -1,17 +1,127 @@
 use core::alloc::{
+    AllocError,
     GlobalAlloc,
     Layout,
 };
 use core::cell::Cell;
+use core::ptr::NonNull;
+use crate::alloc_guard;
+use crate::inside_cache;
 use sgx_alloc::System;
 use sgx_types::*;
 use std::cmp;
 use std::ptr;
 use std::sync::atomic::{AtomicUsize, Ordering};
+use std::vec::Vec;
 
-thread_local! {
-    static SWITCH: Cell<bool> = Cell::new(false);
-    static ALLOC_CNT: Cell<usize> = Cell::new(0);
+//read on every allocation, so use plain #[thread_local] statics rather than
+//thread_local!, which adds a lazy-init check to each access
+#[thread_local]
+static SWITCH: Cell<bool> = Cell::new(false);
+#[thread_local]
+static ALLOC_CNT: Cell<usize> = Cell::new(0);
+#[thread_local]
+static OCALL_CNT: Cell<usize> = Cell::new(0);
+//set when the outside heap returned null to this thread, see oom.rs
+#[thread_local]
+static OUTSIDE_FAILED: Cell<bool> = Cell::new(false);
+//probes alive, see op/planner.rs, inside allocations are only counted while
+//a step samples its first block, so that the steady state reads a global
+//instead of the thread data for it
+static SAMPLING: AtomicUsize = AtomicUsize::new(0);
+//bytes dlmalloc has handed out, the blocks the inside cache holds among them,
+//and the most it ever had, see TrustedHeap
+static TRUSTED_BYTES: AtomicUsize = AtomicUsize::new(0);
+static TRUSTED_PEAK: AtomicUsize = AtomicUsize::new(0);
+
+#[inline(always)]
+fn trusted_allocated(size: usize) {
+    let cur = TRUSTED_BYTES.fetch_add(size, Ordering::Relaxed) + size;
+    //a peak is rarely beaten, the load keeps the line shared
+    if cur > TRUSTED_PEAK.load(Ordering::Relaxed) {
+        TRUSTED_PEAK.fetch_max(cur, Ordering::Relaxed);
+    }
+}
+
+#[inline(always)]
+fn trusted_freed(size: usize) {
+    TRUSTED_BYTES.fetch_sub(size, Ordering::Relaxed);
+}
+
+//(bytes in use, peak bytes) of the trusted heap, by the sizes asked of it
+pub fn trusted_heap_usage() -> (usize, usize) {
+    (TRUSTED_BYTES.load(Ordering::Relaxed), TRUSTED_PEAK.load(Ordering::Relaxed))
+}
+
+//sgx_alloc::System, counted. dlmalloc takes its lock on every call anyway, so
+//the counters cost little next to it
+pub struct TrustedHeap;
+
+impl TrustedHeap {
+    #[inline(always)]
+    pub unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let ptr = System.alloc(layout);
+        if !ptr.is_null() {
+            trusted_allocated(layout.size());
+        }
+        ptr
+    }
+
+    #[inline(always)]
+    pub unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        let ptr = System.alloc_zeroed(layout);
+        if !ptr.is_null() {
+            trusted_allocated(layout.size());
+        }
+        ptr
+    }
+
+    #[inline(always)]
+    pub unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout);
+        trusted_freed(layout.size());
+    }
+
+    #[inline(always)]
+    pub unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_ptr = System.realloc(ptr, layout, new_size);
+        if !new_ptr.is_null() {
+            trusted_allocated(new_size);
+            trusted_freed(layout.size());
+        }
+        new_ptr
+    }
+}
+
+//the outside heap is tcmalloc on the host, each of its calls is an ocall
+#[inline(always)]
+fn count_ocall() {
+    OCALL_CNT.update(|x| x + 1);
+}
+
+#[inline(always)]
+fn count_alloc() {
+    if SAMPLING.load(Ordering::Relaxed) != 0 {
+        ALLOC_CNT.update(|x| x + 1);
+    }
+}
+
+#[inline(always)]
+fn checked(ptr: *mut u8) -> *mut u8 {
+    if ptr.is_null() {
+        outside_failed();
+    }
+    ptr
+}
+
+#[cold]
+fn outside_failed() {
+    OUTSIDE_FAILED.set(true);
+}
+
+//whether the last allocation failure of this thread was the outside heap's
+pub fn take_outside_failed() -> bool {
+    OUTSIDE_FAILED.replace(false)
 }
 
 extern "C" {
@@ -19,7 +129,28 @@ extern "C" {
     pub fn ocall_tc_malloc(size: size_t) -> *mut c_void;
     pub fn ocall_tc_realloc(p: *mut c_void, size: size_t) -> *mut c_void;
     pub fn ocall_tc_free(p: *mut c_void);
+    pub fn ocall_tc_free_sized(p: *mut c_void, size: size_t);
+    pub fn ocall_tc_free_batch(ptrs: *mut *mut c_void, n: size_t);
+    pub fn ocall_tc_nallocx(size: size_t, flags: c_int) -> size_t;
     pub fn ocall_tc_memalign(align: size_t, size: size_t) -> *mut c_void;
+    pub fn ocall_tc_set_num_cpus(num_cpus: c_int);
+    pub fn ocall_tc_set_numa_node(node: c_int);
+    pub fn ocall_tc_set_reserve_range(gb: size_t);
+    pub fn ocall_tc_set_oom_reserve(bytes: size_t);
+    pub fn ocall_tc_get_stats(stats: *mut c_void);
+    pub fn ocall_tc_bench(
+        ops: uint64_t,
+        seed: uint64_t,
+        dist: uint32_t,
+        block_bytes: uint64_t,
+        shared: c_int,
+    ) -> uint64_t;
+    pub fn ocall_tc_bench_drain();
+    pub fn ocall_tc_size_histogram_enable(enable: c_int);
+    pub fn ocall_tc_size_histogram_top(sizes: *mut size_t, counts: *mut uint64_t, n: c_int) -> c_int;
+    pub fn ocall_tc_heap_profiler_set_period(period: uint64_t);
+    pub fn ocall_tc_heap_profiler_set_tag(tag: uint64_t);
+    pub fn ocall_tc_heap_profiler_get_tag() -> uint64_t;
 }
 
 // The minimum alignment guaranteed by the architecture. This value is used to
@@ -33,25 +164,84 @@ const MIN_ALIGN: usize = 8;
 #[cfg(target_arch = "x86_64")]
 const MIN_ALIGN: usize = 16;
 
+// kMaxSize of gperftools/common.h, larger objects get whole page spans
+const TC_MAX_SMALL_SIZE: usize = 256 * 1024;
+
 pub struct Allocator;
 
 impl Allocator {
     pub fn set_switch(&self, switch: bool) {
-        SWITCH.with(|f| f.set(switch));
+        SWITCH.set(switch);
     }
     
     pub fn get_switch(&self) -> bool {
-        SWITCH.with(|f| f.get())
+        SWITCH.get()
+    }
+
+    //allocations of the current thread go outside until the guard is dropped,
+    //prefer this over set_switch(true)/set_switch(false) pairs, the previous
+    //state is restored even on early return or unwinding
+    pub fn outside(&self) -> OutsideGuard {
+        OutsideGuard { prev: SWITCH.replace(true) }
     }
 
+    //inside allocations of this thread made while some probe was alive,
+    //never reset
     pub fn get_alloc_cnt(&self) -> usize {
-        ALLOC_CNT.with(|f| f.get())
+        ALLOC_CNT.get()
+    }
+
+    pub fn begin_sampling(&self) {
+        SAMPLING.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn end_sampling(&self) {
+        SAMPLING.fetch_sub(1, Ordering::Relaxed);
+    }
+
+    //ocalls of this thread to the outside heap, and others counted with
+    //count_ocall, never reset
+    pub fn get_ocall_cnt(&self) -> usize {
+        OCALL_CNT.get()
+    }
+
+    pub fn count_ocall(&self) {
+        count_ocall();
+    }
+
+    //return a list of outside blocks to tcmalloc in one call, the switch is not consulted
+    pub fn free_batch(&self, ptrs: &mut [*mut u8]) {
+        unsafe { ocall_tc_free_batch(ptrs.as_mut_ptr() as *mut *mut c_void, ptrs.len()) };
+    }
+
+    //record the sizes requested from the outside allocator, used to seed
+    //the tuned size classes of gperftools/common.cc
+    pub fn enable_size_histogram(&self, enable: bool) {
+        unsafe { ocall_tc_size_histogram_enable(enable as c_int) };
+    }
+
+    //the n most requested (size, count) since the histogram was enabled
+    pub fn size_histogram_top(&self, n: usize) -> Vec<(usize, u64)> {
+        let mut sizes = vec![0usize; n];
+        let mut counts = vec![0u64; n];
+        let filled = unsafe {
+            ocall_tc_size_histogram_top(sizes.as_mut_ptr(), counts.as_mut_ptr(), n as c_int)
+        } as usize;
+        sizes.into_iter().zip(counts.into_iter()).take(filled).collect()
     }
 
-    pub fn reset_alloc_cnt(&self) {
-        ALLOC_CNT.with(|f| {
-            f.set(0);
-        });
+    //sample one outside allocation every `period` bytes on average, 0 stops
+    pub fn set_heap_profiler(&self, period: u64) {
+        unsafe { ocall_tc_heap_profiler_set_period(period) };
+    }
+
+    //samples taken by the current thread are attributed to `tag`
+    pub fn set_profile_tag(&self, tag: u64) {
+        unsafe { ocall_tc_heap_profiler_set_tag(tag) };
+    }
+
+    pub fn get_profile_tag(&self) -> u64 {
+        unsafe { ocall_tc_heap_profiler_get_tag() }
     }
 
 }
@@ -81,26 +271,73 @@ unsafe impl GlobalAlloc for Allocator {
     #[inline]
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
         let switch = self.get_switch();
+        let ptr = self.alloc_switched(layout, switch);
+        alloc_guard::allocated(ptr, &layout, switch);
+        ptr
+    }
+
+    #[inline]
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        let switch = self.get_switch();
+        let ptr = self.alloc_zeroed_switched(layout, switch);
+        alloc_guard::allocated(ptr, &layout, switch);
+        ptr
+    }
+
+    #[inline]
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        let switch = self.get_switch();
+        alloc_guard::freed(ptr, &layout, switch);
+        self.dealloc_switched(ptr, layout, switch);
+    }
+
+    #[inline]
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let switch = self.get_switch();
+        alloc_guard::freed(ptr, &layout, switch);
+        let new_ptr = self.realloc_switched(ptr, layout, new_size, switch);
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        alloc_guard::allocated(new_ptr, &new_layout, switch);
+        new_ptr
+    }
+
+}
+
+//the heap of each call is picked by the switch, read once by the caller
+impl Allocator {
+    #[inline(always)]
+    unsafe fn alloc_switched(&self, layout: Layout, switch: bool) -> *mut u8 {
         if switch {
-            if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
-                ocall_tc_malloc(layout.size()) as *mut u8
+            if let Some(ptr) = crate::region::alloc(&layout) {
+                ptr
+            } else if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
+                count_ocall();
+                checked(ocall_tc_malloc(layout.size()) as *mut u8)
             } else {
                 aligned_malloc(&layout)
             }
         } else {
-            ALLOC_CNT.with(|f| {
-                f.update(|x| x + 1);
-            });
-            System.alloc(layout)
+            count_alloc();
+            if inside_cache::is_cached(&layout) {
+                inside_cache::alloc(layout.size(), false)
+            } else {
+                TrustedHeap.alloc(layout)
+            }
         }
     }
 
-    #[inline]
-    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-        let switch = self.get_switch();
+    #[inline(always)]
+    unsafe fn alloc_zeroed_switched(&self, layout: Layout, switch: bool) -> *mut u8 {
         if switch {
-            if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
-                ocall_tc_calloc(layout.size(), 1) as *mut u8
+            if let Some(ptr) = crate::region::alloc(&layout) {
+                //region chunks are recycled without being cleared
+                if !ptr.is_null() {
+                    ptr::write_bytes(ptr, 0, layout.size());
+                }
+                ptr
+            } else if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
+                count_ocall();
+                checked(ocall_tc_calloc(layout.size(), 1) as *mut u8)
             } else {
                 let ptr = GlobalAlloc::alloc(self, layout);
                 if !ptr.is_null() {
@@ -109,43 +346,150 @@ unsafe impl GlobalAlloc for Allocator {
                 ptr
             }
         } else {
-            ALLOC_CNT.with(|f| {
-                f.update(|x| x + 1);
-            });
-            System.alloc_zeroed(layout)
+            count_alloc();
+            if inside_cache::is_cached(&layout) {
+                inside_cache::alloc(layout.size(), true)
+            } else {
+                TrustedHeap.alloc_zeroed(layout)
+            }
         }
     }
 
-    #[inline]
-    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
-        let switch = self.get_switch();
+    #[inline(always)]
+    unsafe fn dealloc_switched(&self, ptr: *mut u8, layout: Layout, switch: bool) {
         if switch {
-            ocall_tc_free(ptr as *mut c_void);
+            //region memory is given back when its region is released
+            if crate::region::contains(ptr) {
+                return;
+            }
+            //objects from the ocall_tc_malloc fast path are in the size class of
+            //layout.size() (realloc keeps it that way), so skip the pagemap lookup
+            if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
+                count_ocall();
+                ocall_tc_free_sized(ptr as *mut c_void, layout.size());
+            } else {
+                count_ocall();
+                ocall_tc_free(ptr as *mut c_void);
+            }
+        } else if inside_cache::is_cached(&layout) {
+            inside_cache::dealloc(ptr, layout.size());
         } else {
-            System.dealloc(ptr, layout);
+            TrustedHeap.dealloc(ptr, layout);
         }
     }
 
-    #[inline]
-    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
-        let switch = self.get_switch();
+    #[inline(always)]
+    unsafe fn realloc_switched(
+        &self,
+        ptr: *mut u8,
+        layout: Layout,
+        new_size: usize,
+        switch: bool,
+    ) -> *mut u8 {
         if switch {
-            if layout.align() <= MIN_ALIGN && layout.align() <= new_size {
-                ocall_tc_realloc(ptr as *mut c_void, new_size) as *mut u8
+            if crate::region::contains(ptr) {
+                let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+                let new_ptr = GlobalAlloc::alloc(self, new_layout);
+                if !new_ptr.is_null() {
+                    ptr::copy_nonoverlapping(ptr, new_ptr, cmp::min(layout.size(), new_size));
+                }
+                return new_ptr;
+            }
+            //ocall_tc_realloc may keep an object in a size class that does not match
+            //new_size, which dealloc relies on, so only resize in place when
+            //tcmalloc would hand out the same block for both sizes
+            if layout.align() <= MIN_ALIGN
+                && layout.align() <= new_size
+                && layout.align() <= layout.size()
+                && ocall_tc_nallocx(new_size, 0) == ocall_tc_nallocx(layout.size(), 0)
+            {
+                ptr
+            } else if layout.align() <= MIN_ALIGN
+                && layout.size() > TC_MAX_SMALL_SIZE
+                && new_size > layout.size()
+            {
+                //page spans may be extended in place, and stay page aligned,
+                //so dealloc falls back to the unsized free for them
+                count_ocall();
+                checked(ocall_tc_realloc(ptr as *mut c_void, new_size) as *mut u8)
             } else {
                 self.realloc_fallback(ptr, layout, new_size)
             }
         } else {
-            ALLOC_CNT.with(|f| {
-                f.update(|x| x + 1);
-            });
-            System.realloc(ptr, layout, new_size)
+            count_alloc();
+            let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+            if inside_cache::is_cached(&layout) && inside_cache::is_cached(&new_layout) {
+                if inside_cache::same_class(layout.size(), new_size) {
+                    ptr
+                } else {
+                    self.realloc_fallback(ptr, layout, new_size)
+                }
+            } else if inside_cache::is_cached(&layout) || inside_cache::is_cached(&new_layout) {
+                //cached blocks are exactly one size class, never resize them in dlmalloc
+                self.realloc_fallback(ptr, layout, new_size)
+            } else {
+                TrustedHeap.realloc(ptr, layout, new_size)
+            }
         }
     }
 
 }
 
+pub struct OutsideGuard {
+    prev: bool,
+}
+
+impl Drop for OutsideGuard {
+    fn drop(&mut self) {
+        SWITCH.set(self.prev);
+    }
+}
+
+//handle to the outside tcmalloc arena, for containers that should always
+//live outside (ciphertext) no matter what the switch says, e.g.
+//Vec::new_in(OutsideAlloc) or OutsideVec
+#[derive(Clone, Copy, Debug, Default)]
+pub struct OutsideAlloc;
+
+pub type OutsideVec<T> = Vec<T, OutsideAlloc>;
+
+unsafe impl core::alloc::Allocator for OutsideAlloc {
+    #[inline]
+    fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        if layout.size() == 0 {
+            let dangling = unsafe { NonNull::new_unchecked(layout.align() as *mut u8) };
+            return Ok(NonNull::slice_from_raw_parts(dangling, 0));
+        }
+        let ptr = unsafe {
+            if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
+                count_ocall();
+                checked(ocall_tc_malloc(layout.size()) as *mut u8)
+            } else {
+                aligned_malloc(&layout)
+            }
+        };
+        NonNull::new(ptr)
+            .map(|ptr| NonNull::slice_from_raw_parts(ptr, layout.size()))
+            .ok_or(AllocError)
+    }
+
+    #[inline]
+    unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        if layout.size() == 0 {
+            return;
+        }
+        if layout.align() <= MIN_ALIGN && layout.align() <= layout.size() {
+            count_ocall();
+            ocall_tc_free_sized(ptr.as_ptr() as *mut c_void, layout.size());
+        } else {
+            count_ocall();
+            ocall_tc_free(ptr.as_ptr() as *mut c_void);
+        }
+    }
+}
+
 #[inline]
 unsafe fn aligned_malloc(layout: &Layout) -> *mut u8 {
-    ocall_tc_memalign(layout.align(), layout.size()) as *mut u8
+    count_ocall();
+    checked(ocall_tc_memalign(layout.align(), layout.size()) as *mut u8)
 }
\ No newline at end of file
@@ -2,6 +2,7 @@ use std::collections::HashMap;
 use std::path::PathBuf;
 use std::time::Instant;
 use crate::*;
+use crate::utils::kernels;
 
 use serde_derive::{Deserialize, Serialize};
 
@@ -12,34 +13,16 @@ fn parse_vector(line: String) -> Vec<f64> {
 }
 
 fn squared_distance(p: &Vec<f64>, center: &Vec<f64>) -> f64 {
-    assert_eq!(p.len(), center.len());
-    let sum = p.iter().zip(center.iter()).fold(0 as f64, |acc, (x, y)| {
-        let delta = *y - *x;
-        acc + delta * delta
-    });
-    sum.sqrt()
+    kernels::squared_distance(p, center).sqrt()
 }
 
 fn closest_point(p: &Vec<f64>, centers: &Vec<Vec<f64>>) -> usize {
-    let mut best_index = 0;
-    let mut closest = f64::MAX;
-
-    for (index, center) in centers.iter().enumerate() {
-        let temp_dist = squared_distance(p, center);
-        if temp_dist < closest {
-            closest = temp_dist;
-            best_index = index
-        }
-    }
-
-    best_index
+    kernels::argmin_distance(p, centers)
 }
 
-fn merge_results(a: (Vec<f64>, i32), b: (Vec<f64>, i32)) -> (Vec<f64>, i32) {
-    (
-        a.0.iter().zip(b.0.iter()).map(|(x, y)| x + y).collect(),
-        a.1 + b.1,
-    )
+fn merge_results(mut a: (Vec<f64>, i32), b: (Vec<f64>, i32)) -> (Vec<f64>, i32) {
+    kernels::axpy(1.0, &b.0, &mut a.0);
+    (a.0, a.1 + b.1)
 }
 
 // secure mode
@@ -77,7 +60,7 @@ pub fn kmeans_sec_0_(tail_info: &mut TailCompInfo) -> Result<()> {
         //    .collect::<Vec<_>>();
         (closest_point(&p, &k_points_), (p, 1))
     }));
-    let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), NUM_PARTS);
+    let point_stats = closest.reduce_by_key(Fn!(|(a, b)| merge_results(a, b)), num_parts());
     let new_points = point_stats
         .map(Fn!(|pair: (usize, (Vec<f64>, i32))| (
             pair.0,
@@ -48,7 +48,7 @@ pub fn join_sec_2() -> Result<()> {
 
     let rdd0 = sc.make_op::<(i32, i32)>(1);
     let rdd1 = sc.make_op::<(i32, i32)>(1);
-    let rdd2 = rdd1.join(rdd0.clone(), 1);
+    let rdd2 = rdd1.join(rdd0.clone(), num_parts());
     let _res = rdd2.collect().unwrap();
     
     
@@ -0,0 +1,73 @@
+//! Sealing the tags of the partitions cached outside, for a restarted executor.
+//!
+//! The blocks of a cached partition are encrypted under the job key already,
+//! so the host may keep them on disk as they are, but a partition read back
+//! is only checked against the tags in CACHE.index, see cached_blocks in
+//! op/mod.rs, and a restarted enclave has none. With VEGA_CACHE_PERSIST the
+//! host persists every cached partition with the tags of its blocks, sealed
+//! with sgx_seal_data to MRENCLAVE, so only this enclave on this machine opens
+//! them. The key of the partition is the additional text, so the tags of one
+//! partition are never taken for another's. A restarted enclave unseals the
+//! tags of every partition the host reloads into the index, and the blocks are
+//! checked as if it had cached them itself.
+use std::vec::Vec;
+
+use sgx_tseal::SgxSealedData;
+use sgx_types::*;
+
+use crate::op::Tag;
+use crate::CACHE;
+
+fn aad(key: (usize, usize)) -> Vec<u8> {
+    let mut aad = b"cache index\0".to_vec();
+    aad.extend_from_slice(&(key.0 as u64).to_le_bytes());
+    aad.extend_from_slice(&(key.1 as u64).to_le_bytes());
+    aad
+}
+
+//the tags of a partition handed out, sealed. None if this enclave did not
+//cache it
+pub fn seal(key: (usize, usize)) -> Option<Vec<u8>> {
+    let tags = CACHE.tags(key)?;
+    //the length in front, so that no payload is empty
+    let payload = bincode::serialize(&*tags).unwrap();
+    let aad = aad(key);
+    let attribute_mask = sgx_attributes_t {
+        flags: TSEAL_DEFAULT_FLAGSMASK,
+        xfrm: 0,
+    };
+    let sealed = SgxSealedData::<[u8]>::seal_data_ex(
+        SGX_KEYPOLICY_MRENCLAVE,
+        attribute_mask,
+        TSEAL_DEFAULT_MISCMASK,
+        &aad,
+        &payload,
+    )
+    .ok()?;
+    let len = SgxSealedData::<[u8]>::calc_raw_sealed_data_size(aad.len() as u32, payload.len() as u32);
+    let mut raw = vec![0u8; len as usize];
+    unsafe { sealed.to_raw_sealed_data_t(raw.as_mut_ptr() as *mut sgx_sealed_data_t, len) }?;
+    Some(raw)
+}
+
+//put the tags of a reloaded partition into the index, false if they do not
+//unseal or are sealed for another partition
+pub fn unseal(key: (usize, usize), raw: &mut [u8]) -> bool {
+    let sealed = unsafe {
+        SgxSealedData::<[u8]>::from_raw_sealed_data_t(raw.as_mut_ptr() as *mut sgx_sealed_data_t, raw.len() as u32)
+    };
+    let unsealed = match sealed.and_then(|sealed| sealed.unseal_data().ok()) {
+        Some(unsealed) => unsealed,
+        None => return false,
+    };
+    if unsealed.get_additional_txt() != &aad(key)[..] {
+        return false;
+    }
+    match bincode::deserialize::<Vec<Tag>>(unsealed.get_decrypt_txt()) {
+        Ok(tags) => {
+            CACHE.restore_tags(key, tags);
+            true
+        }
+        Err(_) => false,
+    }
+}
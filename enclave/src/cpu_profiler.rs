@@ -0,0 +1,46 @@
+//! Enclave side of the CPU profiler, see gperftools/cpu-profiler-sgx.h.
+//!
+//! The host interrupts the threads it has inside at the profiling rate and
+//! the AEX handler of each armed thread appends the interrupted stack to a
+//! ring buffer of its TCS, tagged like the heap profiler samples with the
+//! final op of the stage. A thread is armed while it holds a `ThreadScope`,
+//! which the stage ECALLs and the pool jobs take, so the ECALLs that only
+//! move data are not sampled.
+use sgx_types::*;
+
+extern "C" {
+    fn ocall_tc_cpu_profiler_set_enabled(enabled: c_int) -> c_int;
+    fn ocall_tc_cpu_profiler_enter_thread();
+    fn ocall_tc_cpu_profiler_leave_thread();
+    fn ocall_tc_cpu_profiler_drain(out: *mut uint64_t, cap: size_t) -> size_t;
+    fn ocall_tc_cpu_profiler_dropped() -> uint64_t;
+}
+
+//false if the enclave was built without SGX_AEX_NOTIFY
+pub fn set_enabled(enabled: bool) -> bool {
+    unsafe { ocall_tc_cpu_profiler_set_enabled(enabled as c_int) != 0 }
+}
+
+pub struct ThreadScope(());
+
+impl Drop for ThreadScope {
+    fn drop(&mut self) {
+        unsafe { ocall_tc_cpu_profiler_leave_thread() };
+    }
+}
+
+//the current thread is sampled until the scope is dropped, if profiling
+pub fn enter() -> ThreadScope {
+    unsafe { ocall_tc_cpu_profiler_enter_thread() };
+    ThreadScope(())
+}
+
+//moves the samples taken since the last drain into out as [depth, frames..]
+//words, after the count of samples dropped so far. returns the words written
+pub fn drain(out: &mut [u64]) -> usize {
+    if out.is_empty() {
+        return 0;
+    }
+    out[0] = unsafe { ocall_tc_cpu_profiler_dropped() };
+    1 + unsafe { ocall_tc_cpu_profiler_drain(out[1..].as_mut_ptr(), out.len() - 1) }
+}
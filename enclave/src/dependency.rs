@@ -1,8 +1,7 @@
 use std::any::Any;
 use std::boxed::Box;
-use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::collections::{BTreeMap, HashMap, HashSet, VecDeque, hash_map::Entry};
 use std::hash::Hash;
-use std::mem::forget;
 use std::sync::{Arc, Barrier, SgxMutex as Mutex, SgxRwLock as RwLock, atomic::{self, AtomicBool}};
 use std::time::Instant;
 use std::thread::{self, ThreadId, SgxThread};
@@ -11,11 +10,21 @@ use std::vec::Vec;
 use crate::aggregator::Aggregator;
 use crate::basic::{AnyData, Data, Func};
 use crate::op::*;
-use crate::partitioner::Partitioner;
-use crate::serialization_free::{Construct, Idx, SizeBuf};
+use crate::region::{self, OutsideRegion};
+use crate::thread_pool;
+use crate::partitioner::{HashPartitioner, Partitioner, RangePartitioner, TypedPartitioner};
 use deepsize::DeepSizeOf;
 use downcast_rs::DowncastSync;
-use itertools::Itertools;
+use itertools::{EitherOrBoth, Itertools};
+
+//a sub-part whose sampled rows have at most this share of distinct keys is
+//combined in a hash table, so only its combiners are sorted, not all its rows
+const HASH_AGG_RATIO: f64 = 0.5;
+//rows of the sample counted for the ratio
+const HASH_AGG_PROBE: usize = 4096;
+//a key of a salted shuffle is hot if the sampled rows hold more of it than this
+//share of what one reducer gets
+const HOT_KEY_SHARE: f64 = 0.5;
 
 #[derive(Clone)]
 pub enum Dependency {
@@ -108,8 +117,7 @@ impl NarrowDependencyTrait for RangeDependency {
 pub trait ShuffleDependencyTrait: DowncastSync + Send + Sync  { 
     fn change_partitioner(&self, reduce_num: usize);
     fn do_shuffle_task(&self, tid: u64, opb: Arc<dyn OpBase>, call_seq: NextOpId, input: Input) -> *mut u8;
-    fn send_sketch(&self, buf: &mut SizeBuf, p_data_enc: *mut u8);
-    fn send_enc_data(&self, p_out: usize, p_data_enc: *mut u8);
+    fn flush_node_combine(&self) -> *mut u8;
     fn free_res_enc(&self, res_ptr: *mut u8, is_enc: bool);
     fn get_parent(&self) -> OpId;
     fn get_child(&self) -> OpId;
@@ -132,6 +140,20 @@ where
     pub identifier: usize,
     pub parent: OpId,
     pub child: OpId,
+    //spread hot keys over all reducers, see reduce_by_key_skewed
+    pub salt_hot_keys: bool,
+    //only the keys matter, see dedup_keys
+    pub dedup_keys: bool,
+    //the last combiners of the map tasks of the stage, see deposit
+    node_acc: Mutex<NodeCombine<K, C>>,
+}
+
+//the sets the map tasks of a stage leave with node combine on, merged into
+//one the last task of the executor encrypts, see flush_node_combine
+struct NodeCombine<K, C> {
+    buckets: Vec<Vec<(K, C)>>,
+    //deep size of buckets
+    size: usize,
 }
 
 impl<K, V, C> ShuffleDependency<K, V, C> 
@@ -156,7 +178,54 @@ where
             identifier,
             parent,
             child,
+            salt_hot_keys: false,
+            dedup_keys: false,
+            node_acc: Mutex::new(NodeCombine { buckets: Vec::new(), size: 0 }),
+        }
+    }
+
+    //the partial combiners of a hot key land on several reducers, so the op
+    //after a salted shuffle must combine by key again
+    pub fn salted(mut self) -> Self {
+        assert!(!self.aggregator.is_default);
+        self.salt_hot_keys = true;
+        self
+    }
+
+    //the keys of a map task go through a hash set whatever their cardinality,
+    //as for distinct, whose duplicates are gone before they are bucketed
+    pub fn dedup_keys(mut self) -> Self {
+        assert!(!self.aggregator.is_default);
+        self.dedup_keys = true;
+        self
+    }
+
+    //folds the tails of a map task into the set of the stage instead of
+    //encrypting them, so a key all the tasks of the executor hold goes to its
+    //reducer once. past the cache limit, or if the tails are split otherwise
+    //than the set, the task keeps them and they are merged by merge_tails
+    fn deposit(&self, tails: Vec<Vec<Vec<(K, C)>>>, num_output_splits: usize, width: usize, region: &OutsideRegion) -> Option<Vec<Vec<ItemE>>> {
+        let aggregator = &self.aggregator;
+        let tail = match tails.into_iter().reduce(|a, b| merge_sets(a, b, aggregator)) {
+            Some(tail) => tail,
+            None => return None,
+        };
+        let size = tail.deep_size_of();
+        let mut acc = self.node_acc.lock().unwrap();
+        let fits = acc.buckets.is_empty() || acc.buckets.len() == tail.len();
+        if !fits || acc.size + size > cache_limit() {
+            drop(acc);
+            return merge_tails(vec![tail], aggregator, num_output_splits, width, region);
+        }
+        if acc.buckets.is_empty() {
+            acc.buckets = tail;
+            acc.size = size;
+        } else {
+            let buckets = std::mem::take(&mut acc.buckets);
+            acc.buckets = merge_sets(buckets, tail, aggregator);
+            acc.size = acc.buckets.deep_size_of();
         }
+        None
     }
 
 }
@@ -179,12 +248,13 @@ where
         let op = opb.to_arc_op::<dyn Op<Item = (K, V)>>().unwrap();
         let mut sub_parts: Vec<Vec<(K, V)>> = Vec::new();
         let mut sub_part_size = 0;
+        let sub_part_limit = cache_limit()/max_thread()/input.get_parallel();
         let results = *unsafe{ Box::from_raw(op.narrow(call_seq, input, false) as *mut Vec<Vec<(K, V)>>) };
         for mut block in results {
             let block_size = block.deep_size_of();
             let mut should_create_new = true;
             if let Some(sub_part) = sub_parts.last_mut() {
-                if sub_part_size + block_size <= CACHE_LIMIT/MAX_THREAD/input.get_parallel() {
+                if sub_part_size + block_size <= sub_part_limit {
                     sub_part.append(&mut block);
                     sub_part_size += block_size;
                     should_create_new = false;
@@ -196,17 +266,37 @@ where
             }
         }
 
-        let mut handlers = Vec::with_capacity(MAX_THREAD);
-        let r = sub_parts.len().saturating_sub(1) / MAX_THREAD + 1;
-        for _ in 0..MAX_THREAD {
+        let num_sub_parts = sub_parts.len();
+        //the last sub-part is the planner sample below, it is a fair guess at the key
+        //cardinality of the others. group_by_key stays on sort-then-scan
+        //the hash map of hash aggregation is not oblivious
+        let is_hash_agg = !cfg!(feature = "oblivious")
+            && !self.aggregator.is_default
+            && (self.dedup_keys || sub_parts.last().map_or(false, |sample| is_low_cardinality(sample)));
+        let hot_keys = match sub_parts.last() {
+            Some(sample) if self.salt_hot_keys => {
+                let reduce_num = self.partitioner.read().unwrap().get_num_of_partitions();
+                find_hot_keys(sample, reduce_num)
+            },
+            _ => HashSet::new(),
+        };
+        let hot_keys = Arc::new(hot_keys);
+        let width = thread_pool::width();
+        let mut handlers = Vec::with_capacity(width);
+        let r = sub_parts.len().saturating_sub(1) / width + 1;
+        for _ in 0..width {
             let mut sub_parts = sub_parts.split_off(sub_parts.len().saturating_sub(r));
-            let handler = thread::Builder::new()
-                .spawn(move || {
+            let handler = thread_pool::spawn(move || {
+                if !is_hash_agg {
                     for sub_part in sub_parts.iter_mut() {
+                        #[cfg(feature = "oblivious")]
+                        crate::utils::oblivious::sort_by(sub_part, |a, b| a.0 < b.0);
+                        #[cfg(not(feature = "oblivious"))]
                         sub_part.sort_unstable_by(|a, b| a.0.cmp(&b.0));
                     }
-                    sub_parts
-                }).unwrap();
+                }
+                sub_parts
+            });
             handlers.push(handler);
         }
         assert!(sub_parts.is_empty());
@@ -214,92 +304,138 @@ where
         let aggregator = self.aggregator.clone();
         let mut partitioner = self.partitioner.read().unwrap().clone();
         let mut num_output_splits = partitioner.get_num_of_partitions();
-        num_output_splits *= MAX_THREAD + 1;
+        num_output_splits *= max_thread() + 1;
         partitioner.set_num_of_partitions(num_output_splits);
 
         let mut is_para_shuf = true;
-        let mut handlers_res = Vec::with_capacity(MAX_THREAD);
+        let mut handlers_res = Vec::with_capacity(width);
+        //the encrypted buckets all die in free_res_enc, so bump allocate them
+        let region = OutsideRegion::new();
         for (i, handler) in handlers.into_iter().enumerate() {
             let mut buckets_col = Vec::new();
             let mut sub_parts = handler.join().unwrap();
+            //sub-parts are salted by their position, so a hot key goes to a
+            //different reducer from each of them
+            let first_salt = i * r;
             if i == 0 {
                 //sample
                 let sample_data = sub_parts.pop().unwrap();
                 let sample_len = sample_data.len();
                 //shuffle specific
-                crate::ALLOCATOR.reset_alloc_cnt();
-                buckets_col.push(do_shuffle_task_core(sample_data, &aggregator, &partitioner, num_output_splits));
-                let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
-                let alloc_cnt_ratio = alloc_cnt as f64/(sample_len as f64);
-                println!("for shuffle processing, alloc_cnt per len = {:?}", alloc_cnt_ratio);
-                is_para_shuf = alloc_cnt_ratio < PARA_THRESHOLD;
+                let probe = planner::Probe::start();
+                let salt = Salt { hot_keys: &hot_keys, salt: first_salt + sub_parts.len() };
+                buckets_col.push(do_shuffle_task_core(sample_data, &aggregator, &partitioner, num_output_splits, is_hash_agg, salt));
+                let sample = probe.stop(sample_len, 0);
+                let remaining = num_sub_parts.saturating_sub(1) as f64;
+                is_para_shuf = planner::plan(op.get_op_id(), planner::ParaStep::Shuffle, &sample, remaining) > 0;
             };
             if is_para_shuf {
                 //launch enc
                 let aggregator = aggregator.clone();
                 let partitioner = partitioner.clone();
-                let handler = thread::Builder::new()
-                    .spawn(move || {
-                        let mut acc = create_enc();
-                        if let Some(buckets) = buckets_col.pop() {
-                            let buckets_enc = buckets.into_iter().map(|bucket| batch_encrypt(&bucket, false)).collect::<Vec<_>>();
-                            merge_enc(&mut acc, &buckets_enc);
+                let region = region.clone();
+                let hot_keys = hot_keys.clone();
+                let handler = thread_pool::spawn(move || {
+                    let _region = region.enter();
+                    let mut acc = create_enc_with_capacity(sub_parts.len() + buckets_col.len());
+                    let mut combiner = BucketCombiner::new(aggregator.clone(), sub_part_limit);
+                    if let Some(buckets) = buckets_col.pop() {
+                        if let Some(buckets) = combiner.push(buckets) {
+                            push_enc(&mut acc, batch_encrypt_buckets(buckets));
                         }
-                        for sub_part in sub_parts {
-                            let buckets = do_shuffle_task_core(sub_part, &aggregator, &partitioner, num_output_splits);
-                            let buckets_enc = buckets.into_iter().map(|bucket| batch_encrypt(&bucket, false)).collect::<Vec<_>>();
-                            merge_enc(&mut acc, &buckets_enc);
+                    }
+                    for (j, sub_part) in sub_parts.into_iter().enumerate() {
+                        let salt = Salt { hot_keys: &hot_keys, salt: first_salt + j };
+                        let buckets = do_shuffle_task_core(sub_part, &aggregator, &partitioner, num_output_splits, is_hash_agg, salt);
+                        if let Some(buckets) = combiner.push(buckets) {
+                            push_enc(&mut acc, batch_encrypt_buckets(buckets));
                         }
-                        acc
-                    }).unwrap();
+                    }
+                    //the last set is merged with those of the other threads
+                    (acc, combiner.finish())
+                });
                 handlers_res.push(handler);
             } else {
-                for sub_part in sub_parts {
-                    buckets_col.push(do_shuffle_task_core(sub_part, &aggregator, &partitioner, num_output_splits));
+                for (j, sub_part) in sub_parts.into_iter().enumerate() {
+                    let salt = Salt { hot_keys: &hot_keys, salt: first_salt + j };
+                    buckets_col.push(do_shuffle_task_core(sub_part, &aggregator, &partitioner, num_output_splits, is_hash_agg, salt));
                 }
                 //launch enc
-                let handler = thread::Builder::new()
-                    .spawn(move || {
-                        //acc stays outside enclave
-                        let mut acc = create_enc();
-                        for buckets in buckets_col {
-                            let buckets_enc = buckets.into_iter().map(|bucket| batch_encrypt(&bucket, false)).collect::<Vec<_>>();
-                            merge_enc(&mut acc, &buckets_enc);
+                let aggregator = aggregator.clone();
+                let region = region.clone();
+                let handler = thread_pool::spawn(move || {
+                    let _region = region.enter();
+                    //acc stays outside enclave
+                    let mut acc = create_enc_with_capacity(buckets_col.len());
+                    let mut combiner = BucketCombiner::new(aggregator, sub_part_limit);
+                    for buckets in buckets_col {
+                        if let Some(buckets) = combiner.push(buckets) {
+                            push_enc(&mut acc, batch_encrypt_buckets(buckets));
                         }
-                        acc
-                    }).unwrap();
+                    }
+                    //the last set is merged with those of the other threads
+                    (acc, combiner.finish())
+                });
                 handlers_res.push(handler);
             }
         }
 
-        let mut acc = create_enc();
+        let mut results = Vec::with_capacity(handlers_res.len());
+        let mut tails = Vec::with_capacity(handlers_res.len());
         for handler in handlers_res {
-            combine_enc(&mut acc, handler.join().unwrap());
+            let (acc, tail) = handler.join().unwrap();
+            results.push(acc);
+            tails.extend(tail);
         }
-        to_ptr(acc)
+        //group_by_key leaves no tails, and a cogroup keeps its own
+        let merged = if node_combine() && !self.is_cogroup {
+            self.deposit(tails, num_output_splits, width, &region)
+        } else {
+            merge_tails(tails, &aggregator, num_output_splits, width, &region)
+        };
+        let res_ptr = {
+            let _region = region.enter();
+            let mut acc = create_enc_with_capacity(results.iter().map(|res| res.len()).sum::<usize>() + 1);
+            for res in results {
+                combine_enc(&mut acc, res);
+            }
+            if let Some(merged) = merged {
+                push_enc(&mut acc, merged);
+            }
+            to_ptr(acc)
+        };
+        region.seal(res_ptr);
+        res_ptr
     }
 
-    fn send_sketch(&self, buf: &mut SizeBuf, p_data_enc: *mut u8){
-        let mut idx = Idx::new();
-        let buckets_enc = unsafe { Box::from_raw(p_data_enc as *mut Vec<Vec<ItemE>>) };
-        buckets_enc.send(buf, &mut idx);
-        forget(buckets_enc);
-    }
-    
-    fn send_enc_data(&self, p_out: usize, p_data_enc: *mut u8) {
-        let mut v_out = unsafe { Box::from_raw(p_out as *mut u8 as *mut Vec<Vec<ItemE>>) };
-        let buckets_enc = unsafe { Box::from_raw(p_data_enc as *mut Vec<Vec<ItemE>>) };
-        v_out.clone_in_place(&buckets_enc);
-        forget(v_out);
-        //and free encrypted buckets
+    //the set of deposit as one of the sets of a map task, null if the tasks
+    //left none. it is freed by free_res_enc
+    fn flush_node_combine(&self) -> *mut u8 {
+        let buckets = {
+            let mut acc = self.node_acc.lock().unwrap();
+            acc.size = 0;
+            std::mem::take(&mut acc.buckets)
+        };
+        if buckets.is_empty() {
+            return std::ptr::null_mut();
+        }
+        let mut res = create_enc_with_capacity(1);
+        push_enc(&mut res, batch_encrypt_buckets(buckets));
+        to_ptr(res)
     }
 
     fn free_res_enc(&self, res_ptr: *mut u8, is_enc: bool) {
         assert!(is_enc);
-        crate::ALLOCATOR.set_switch(true);
-        let res = unsafe { Box::from_raw(res_ptr as *mut Vec<Vec<Vec<ItemE>>>) };
-        drop(res);
-        crate::ALLOCATOR.set_switch(false);
+        if region::release(res_ptr) {
+            return;
+        }
+        //the box is freed before the guard is dropped
+        let res = {
+            let _outside = crate::ALLOCATOR.outside();
+            let res = unsafe { Box::from_raw(res_ptr as *mut Vec<Vec<Vec<ItemE>>>) };
+            *res
+        };
+        free_enc_buckets(res);
     }
 
     fn get_parent(&self) -> OpId {
@@ -315,31 +451,265 @@ where
     }
 
     fn set_parent_and_child(&self, parent_op_id: OpId, child_op_id: OpId) -> Arc<dyn ShuffleDependencyTrait> {
-        Arc::new(ShuffleDependency::new(
+        let mut dep = ShuffleDependency::new(
             self.is_cogroup,
             self.aggregator.clone(),
             self.partitioner.read().unwrap().clone(),
             self.identifier,
             parent_op_id,
             child_op_id,
-        )) as Arc<dyn ShuffleDependencyTrait>
+        );
+        dep.salt_hot_keys = self.salt_hot_keys;
+        dep.dedup_keys = self.dedup_keys;
+        Arc::new(dep) as Arc<dyn ShuffleDependencyTrait>
+    }
+
+}
+
+fn is_low_cardinality<K: Eq + Hash, V>(sample: &[(K, V)]) -> bool {
+    let probe = &sample[..sample.len().min(HASH_AGG_PROBE)];
+    if probe.is_empty() {
+        return false;
+    }
+    let distinct = probe.iter().map(|(k, _)| k).collect::<HashSet<_>>().len();
+    distinct as f64 <= probe.len() as f64 * HASH_AGG_RATIO
+}
+
+fn find_hot_keys<K: Data + Eq + Hash, V>(sample: &[(K, V)], reduce_num: usize) -> HashSet<K> {
+    let probe = &sample[..sample.len().min(HASH_AGG_PROBE)];
+    if reduce_num < 2 {
+        return HashSet::new();
+    }
+    let mut counts = HashMap::new();
+    for (k, _) in probe {
+        *counts.entry(k).or_insert(0usize) += 1;
     }
+    let threshold = probe.len() as f64 / reduce_num as f64 * HOT_KEY_SHARE;
+    counts.into_iter()
+        .filter(|(_, count)| *count as f64 > threshold)
+        .map(|(k, _)| k.clone())
+        .collect()
+}
+
+//the hot keys of a salted shuffle, and how many reducers a sub-part moves them by
+pub struct Salt<'a, K> {
+    pub hot_keys: &'a HashSet<K>,
+    pub salt: usize,
+}
 
+impl<'a, K: Eq + Hash> Salt<'a, K> {
+    //moves whole runs of max_thread + 1 buckets, so a salted key keeps its
+    //sub-bucket and lands on reducer (reducer + salt) % reduce_num
+    #[inline(always)]
+    fn apply(&self, k: &K, bucket_id: usize, num_output_splits: usize) -> usize {
+        if !self.hot_keys.is_empty() && self.hot_keys.contains(k) {
+            (bucket_id + self.salt * (max_thread() + 1)) % num_output_splits
+        } else {
+            bucket_id
+        }
+    }
 }
 
-pub fn do_shuffle_task_core<K, V, C>(mut data: Vec<(K, V)>, aggregator: &Arc<Aggregator<K, V, C>>, partitioner: &Box<dyn Partitioner>, num_output_splits: usize) -> Vec<Vec<(K, C)>>
+//folds the buckets of the sub-parts one thread shuffles into one set, with
+//the combiners of a key merged, so a key that shows up in several sub-parts
+//of a map task goes to its reducer once. a set is handed back for encryption
+//before it would grow past limit. buckets are merged index by index, so the
+//salted copies of a hot key stay apart. group_by_key has nothing to combine
+//and passes through
+struct BucketCombiner<K: Data, V: Data, C: Data> {
+    aggregator: Arc<Aggregator<K, V, C>>,
+    limit: usize,
+    acc: Vec<Vec<(K, C)>>,
+    //upper bound, the sizes of the sets folded in
+    size: usize,
+}
+
+impl<K: Data + Ord, V: Data, C: Data> BucketCombiner<K, V, C> {
+    fn new(aggregator: Arc<Aggregator<K, V, C>>, limit: usize) -> Self {
+        BucketCombiner {
+            aggregator,
+            limit,
+            acc: Vec::new(),
+            size: 0,
+        }
+    }
+
+    //the buckets to encrypt now, if any
+    fn push(&mut self, buckets: Vec<Vec<(K, C)>>) -> Option<Vec<Vec<(K, C)>>> {
+        if self.aggregator.is_default {
+            return Some(buckets);
+        }
+        let size = buckets.deep_size_of();
+        let full = if !self.acc.is_empty() && self.size + size > self.limit {
+            self.size = 0;
+            Some(std::mem::take(&mut self.acc))
+        } else {
+            None
+        };
+        if self.acc.is_empty() {
+            self.acc = buckets;
+        } else {
+            assert_eq!(self.acc.len(), buckets.len());
+            for (acc, bucket) in self.acc.iter_mut().zip(buckets) {
+                *acc = merge_sorted_combiners(std::mem::take(acc), bucket, &self.aggregator);
+            }
+        }
+        self.size += size;
+        full
+    }
+
+    fn finish(self) -> Option<Vec<Vec<(K, C)>>> {
+        if self.acc.is_empty() {
+            None
+        } else {
+            Some(self.acc)
+        }
+    }
+}
+
+//merges the last set of buckets of every thread into one, so a map task hands
+//each sub-bucket to its reducer as one run instead of one per thread. the
+//threads take contiguous ranges of sub-buckets, whose encrypted buckets are
+//stitched back in order. None if no thread has a set left, as for
+//group_by_key whose sets all pass through
+fn merge_tails<K, V, C>(mut tails: Vec<Vec<Vec<(K, C)>>>, aggregator: &Arc<Aggregator<K, V, C>>, num_output_splits: usize, width: usize, region: &OutsideRegion) -> Option<Vec<Vec<ItemE>>>
+where
+    K: Data + Ord,
+    V: Data,
+    C: Data,
+{
+    if tails.is_empty() {
+        return None;
+    }
+    if tails.len() == 1 {
+        let _region = region.enter();
+        return Some(batch_encrypt_buckets(tails.pop().unwrap()));
+    }
+    let per_thread = ((num_output_splits + width - 1) / width).max(1);
+    let mut handlers = Vec::with_capacity(width);
+    for start in (0..num_output_splits).step_by(per_thread) {
+        let len = per_thread.min(num_output_splits - start);
+        let ranges = tails.iter_mut()
+            .map(|tail| tail.drain(..len).collect::<Vec<_>>())
+            .collect::<Vec<_>>();
+        let aggregator = aggregator.clone();
+        let region = region.clone();
+        handlers.push(thread_pool::spawn(move || {
+            let mut ranges = ranges.into_iter().map(|range| range.into_iter()).collect::<Vec<_>>();
+            let merged = (0..len).map(|_| {
+                ranges.iter_mut()
+                    .map(|range| range.next().unwrap())
+                    .fold(Vec::new(), |acc, bucket| merge_sorted_combiners(acc, bucket, &aggregator))
+            }).collect::<Vec<_>>();
+            let _region = region.enter();
+            batch_encrypt_buckets(merged)
+        }));
+    }
+    let _region = region.enter();
+    let mut set = create_enc_with_capacity(num_output_splits);
+    for handler in handlers {
+        combine_enc(&mut set, handler.join().unwrap());
+    }
+    Some(set)
+}
+
+//two sets of buckets, index by index
+fn merge_sets<K, V, C>(a: Vec<Vec<(K, C)>>, b: Vec<Vec<(K, C)>>, aggregator: &Aggregator<K, V, C>) -> Vec<Vec<(K, C)>>
+where
+    K: Data + Ord,
+    V: Data,
+    C: Data,
+{
+    assert_eq!(a.len(), b.len());
+    a.into_iter()
+        .zip(b)
+        .map(|(a, b)| merge_sorted_combiners(a, b, aggregator))
+        .collect()
+}
+
+//both sorted by key with distinct keys, as shuffle_core leaves its buckets
+fn merge_sorted_combiners<K, V, C>(a: Vec<(K, C)>, b: Vec<(K, C)>, aggregator: &Aggregator<K, V, C>) -> Vec<(K, C)>
+where
+    K: Data + Ord,
+    V: Data,
+    C: Data,
+{
+    if a.is_empty() {
+        return b;
+    } else if b.is_empty() {
+        return a;
+    }
+    a.into_iter()
+        .merge_join_by(b, |x, y| x.0.cmp(&y.0))
+        .map(|pair| match pair {
+            EitherOrBoth::Both((k, c0), (_, c1)) => (k, (aggregator.merge_combiners)((c0, c1))),
+            EitherOrBoth::Left(pair) | EitherOrBoth::Right(pair) => pair,
+        })
+        .collect()
+}
+
+//data must be sorted by key unless is_hash_agg, the buckets come out sorted
+//by key either way, as merge_core on the reduce side expects
+pub fn do_shuffle_task_core<K, V, C>(data: Vec<(K, V)>, aggregator: &Arc<Aggregator<K, V, C>>, partitioner: &Box<dyn Partitioner>, num_output_splits: usize, is_hash_agg: bool, salt: Salt<K>) -> Vec<Vec<(K, C)>>
+where 
+    K: Ord + Hash + Data,
+    V: Data,
+    C: Data,
+{
+    //the partitioner is resolved once here instead of once per record
+    let any = (**partitioner).as_any();
+    if let Some(partitioner) = any.downcast_ref::<HashPartitioner<K>>() {
+        shuffle_core(data, aggregator, partitioner, num_output_splits, is_hash_agg, salt)
+    } else if let Some(partitioner) = any.downcast_ref::<RangePartitioner<K>>() {
+        shuffle_core(data, aggregator, partitioner, num_output_splits, is_hash_agg, salt)
+    } else {
+        shuffle_core(data, aggregator, &**partitioner, num_output_splits, is_hash_agg, salt)
+    }
+}
+
+fn shuffle_core<K, V, C, P>(data: Vec<(K, V)>, aggregator: &Arc<Aggregator<K, V, C>>, partitioner: &P, num_output_splits: usize, is_hash_agg: bool, salt: Salt<K>) -> Vec<Vec<(K, C)>>
 where 
-    K: Ord + Data,
+    K: Ord + Hash + Data,
     V: Data,
     C: Data,
+    P: TypedPartitioner<K> + ?Sized,
 {
-    if aggregator.is_default {
+    if is_hash_agg {
+        assert!(!aggregator.is_default);
+        let mut combiners: HashMap<K, C> = HashMap::new();
+        for (k, v) in data.into_iter() {
+            match combiners.entry(k) {
+                Entry::Occupied(mut e) => {
+                    let old_v = e.get_mut();
+                    let input = ((std::mem::take(old_v), v),);
+                    *old_v = aggregator.merge_value.call(input);
+                },
+                Entry::Vacant(e) => {
+                    e.insert(aggregator.create_combiner.call((v,)));
+                },
+            }
+        }
+        let mut buckets: Vec<Vec<(K, C)>> = (0..num_output_splits)
+            .map(|_| Vec::new())
+            .collect::<Vec<_>>();
+        let (keys, combiners): (Vec<K>, Vec<C>) = combiners.into_iter().unzip();
+        let bucket_ids = partitioner.partition_many(&keys);
+        for ((k, c), bucket_id) in keys.into_iter().zip(combiners).zip(bucket_ids) {
+            let bucket_id = salt.apply(&k, bucket_id as usize, num_output_splits);
+            buckets[bucket_id].push((k, c));
+        }
+        for bucket in buckets.iter_mut() {
+            bucket.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+        }
+        buckets
+    } else if aggregator.is_default {
+        assert!(salt.hot_keys.is_empty());
         let mut buckets: Vec<Vec<(K, Vec<V>)>> = (0..num_output_splits)
             .map(|_| Vec::new())
             .collect::<Vec<_>>();
         let mut iter = data.into_iter();
         if let Some((k, v)) = iter.next() {
-            let mut bucket_id = partitioner.get_partition(&k);
+            let mut bucket_id = partitioner.partition_of(&k);
             buckets[bucket_id].push((k, vec![v]));
             let mut last_k = &buckets[bucket_id][0].0;
             for (k, v) in iter {
@@ -349,7 +719,7 @@ where
                     last_k = &buckets[bucket_id].last().unwrap().0;
                 } else {
                     drop(last_k);
-                    bucket_id = partitioner.get_partition(&k);
+                    bucket_id = partitioner.partition_of(&k);
                     buckets[bucket_id].push((k, vec![v]));
                     last_k = &buckets[bucket_id].last().unwrap().0;
                 }
@@ -360,15 +730,19 @@ where
         let mut buckets: Vec<Vec<(K, C)>> = (0..num_output_splits)
             .map(|_| Vec::new())
             .collect::<Vec<_>>();
+        //data is sorted, so the last pair pushed is the last of buckets[bucket_id]
+        //and a key is only partitioned when it changes
+        let mut bucket_id = 0;
         for (k, v) in data.into_iter() {
-            let bucket_id = partitioner.get_partition(&k);
-            let bucket = &mut buckets[bucket_id];
-            if bucket.last().map_or(false, |(last_k, _)| &k == last_k) {
-                let old_v = &mut bucket.last_mut().unwrap().1;
-                let input = ((std::mem::take(old_v), v),);
-                *old_v = aggregator.merge_value.call(input);
-            } else {
-                bucket.push((k, aggregator.create_combiner.call((v,))));
+            match buckets[bucket_id].last_mut() {
+                Some((last_k, old_v)) if *last_k == k => {
+                    let input = ((std::mem::take(old_v), v),);
+                    *old_v = aggregator.merge_value.call(input);
+                },
+                _ => {
+                    bucket_id = salt.apply(&k, partitioner.partition_of(&k), num_output_splits);
+                    buckets[bucket_id].push((k, aggregator.create_combiner.call((v,))));
+                },
             }
         }
         buckets
@@ -0,0 +1,154 @@
+//! Per-thread cache of small inside (EPC) blocks in front of the trusted heap.
+//!
+//! The trusted heap is a single dlmalloc behind one lock, and plaintext decode
+//! buffers are allocated and freed at a high rate by every task thread. Small
+//! requests are rounded up to a size class and freed blocks are kept on
+//! thread-local LIFO lists, so the next request of that class reuses the block
+//! that was touched last and is most likely still resident in the EPC.
+//!
+//! The cache is bounded: the total budget is split between the task threads
+//! (see set_num_threads), and a thread over its share hands the list being
+//! pushed to back to dlmalloc. What a thread still holds when it exits is
+//! returned as well.
+use core::alloc::Layout;
+use core::cmp;
+use core::ptr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use crate::allocator::TrustedHeap;
+
+//largest request served from the cache, bigger ones go to dlmalloc directly
+pub const MAX_CACHED_SIZE: usize = 32 * 1024;
+//all cached blocks have this alignment, it is what dlmalloc returns anyway
+pub const CACHE_ALIGN: usize = 16;
+//bytes all threads together may keep cached, well below the usable EPC
+const CACHE_BUDGET: usize = 64 << 20;
+const NUM_CLASSES: usize = 22;
+
+static CLASS_SIZE: [usize; NUM_CLASSES] = [
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+    12288, 16384, 24576, 32768,
+];
+
+static THREAD_LIMIT: AtomicUsize = AtomicUsize::new(CACHE_BUDGET / 8);
+
+struct ThreadCache {
+    heads: [*mut u8; NUM_CLASSES],
+    bytes: usize,
+    registered: bool,
+    //set once the thread is exiting, later frees go straight to dlmalloc
+    disabled: bool,
+}
+
+#[thread_local]
+static mut CACHE: ThreadCache = ThreadCache {
+    heads: [ptr::null_mut(); NUM_CLASSES],
+    bytes: 0,
+    registered: false,
+    disabled: false,
+};
+
+struct FlushOnExit;
+
+impl Drop for FlushOnExit {
+    fn drop(&mut self) {
+        unsafe {
+            CACHE.disabled = true;
+            for cl in 0..NUM_CLASSES {
+                release_list(cl);
+            }
+        }
+    }
+}
+
+thread_local! {
+    static FLUSH: FlushOnExit = FlushOnExit;
+}
+
+//16, 32, 48, 64, then two classes (3/4 and 1) per power of two
+#[inline]
+fn size_class(size: usize) -> usize {
+    if size <= 64 {
+        return (cmp::max(size, 1) + 15) / 16 - 1;
+    }
+    let pow = size.next_power_of_two();
+    let log = pow.trailing_zeros() as usize;
+    if size <= pow / 4 * 3 {
+        4 + 2 * (log - 7)
+    } else {
+        5 + 2 * (log - 7)
+    }
+}
+
+#[inline]
+unsafe fn class_layout(cl: usize) -> Layout {
+    Layout::from_size_align_unchecked(CLASS_SIZE[cl], CACHE_ALIGN)
+}
+
+//whether a request is served by the cache, alloc and dealloc must agree on it
+#[inline]
+pub fn is_cached(layout: &Layout) -> bool {
+    layout.align() <= CACHE_ALIGN && layout.size() <= MAX_CACHED_SIZE
+}
+
+//both sizes give the same block, so a realloc between them can keep ptr
+#[inline]
+pub fn same_class(old_size: usize, new_size: usize) -> bool {
+    size_class(old_size) == size_class(new_size)
+}
+
+//split the budget between the threads that allocate concurrently
+pub fn set_num_threads(num_threads: usize) {
+    THREAD_LIMIT.store(CACHE_BUDGET / cmp::max(num_threads, 1), Ordering::Relaxed);
+}
+
+unsafe fn release_list(cl: usize) {
+    let layout = class_layout(cl);
+    let mut p = CACHE.heads[cl];
+    while !p.is_null() {
+        let next = *(p as *mut *mut u8);
+        TrustedHeap.dealloc(p, layout);
+        CACHE.bytes -= layout.size();
+        p = next;
+    }
+    CACHE.heads[cl] = ptr::null_mut();
+}
+
+#[inline]
+pub unsafe fn alloc(size: usize, zeroed: bool) -> *mut u8 {
+    let cl = size_class(size);
+    let p = CACHE.heads[cl];
+    if !p.is_null() {
+        CACHE.heads[cl] = *(p as *mut *mut u8);
+        CACHE.bytes -= CLASS_SIZE[cl];
+        if zeroed {
+            ptr::write_bytes(p, 0, size);
+        }
+        return p;
+    }
+    if zeroed {
+        TrustedHeap.alloc_zeroed(class_layout(cl))
+    } else {
+        TrustedHeap.alloc(class_layout(cl))
+    }
+}
+
+#[inline]
+pub unsafe fn dealloc(p: *mut u8, size: usize) {
+    let cl = size_class(size);
+    if CACHE.disabled {
+        TrustedHeap.dealloc(p, class_layout(cl));
+        return;
+    }
+    if !CACHE.registered {
+        //registering the destructor may allocate, do it before touching the lists
+        CACHE.registered = true;
+        let _ = FLUSH.try_with(|_| {});
+    }
+    if CACHE.bytes + CLASS_SIZE[cl] > THREAD_LIMIT.load(Ordering::Relaxed) {
+        release_list(cl);
+    }
+    *(p as *mut *mut u8) = CACHE.heads[cl];
+    CACHE.heads[cl] = p;
+    CACHE.bytes += CLASS_SIZE[cl];
+}
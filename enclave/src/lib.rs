@@ -31,6 +31,9 @@
 #![feature(vec_into_raw_parts)]
 #![feature(cell_update)]
 #![feature(slice_group_by)]
+#![feature(allocator_api)]
+#![feature(nonnull_slice_from_raw_parts)]
+#![feature(thread_local)]
 
 #![feature(
     arbitrary_self_types,
@@ -61,110 +64,122 @@ use std::mem::forget;
 use std::string::{String, ToString};
 use std::sync::{atomic::Ordering, Arc, SgxRwLock as RwLock, SgxMutex as Mutex};
 use std::thread;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 use std::untrusted::time::InstantEx;
 use std::vec::Vec;
 
 mod allocator;
 use allocator::Allocator;
 mod aggregator;
+mod alloc_guard;
 mod atomicptr_wrapper;
-use atomicptr_wrapper::AtomicPtrWrapper;
 mod basic;
 mod benchmarks;
+mod cache_seal;
+mod cpu_profiler;
 use benchmarks::*;
 mod custom_thread;
 mod dependency;
+mod inside_cache;
+mod metrics;
+mod oom;
 mod partitioner;
 mod op;
+mod provision;
+mod region;
+mod scavenger;
 use op::*;
-mod serialization_free;
-use serialization_free::{Construct, Idx, SizeBuf};
+mod thread_pool;
+mod tuning;
 mod utils;
 
 #[global_allocator]
 static ALLOCATOR: Allocator = Allocator;
-static immediate_cout: bool = true;
-const NUM_PARTS: usize = 1;
+use tuning::num_parts;
 
-lazy_static! {
-    static ref CACHE: OpCache = OpCache::new();
-    static ref OP_MAP: AtomicPtrWrapper<BTreeMap<OpId, Arc<dyn OpBase>>> = AtomicPtrWrapper::new(Box::into_raw(Box::new(BTreeMap::new()))); 
-    static ref init: Result<()> = {
-        /* dijkstra */
-        //dijkstra_sec_0()?;
-
-        /* map */
-        //map_sec_0()?;
-        //map_sec_1()?;
+//the job graphs, each built the first time an op of it is looked up
+static JOBS: &[fn() -> Result<()>] = &[
+    /* dijkstra */
+    //dijkstra_sec_0,
 
-        /* filter */
-        //filter_sec_0()?;
-        
-        /* group_by */
-        //group_by_sec_0()?;
-        //group_by_sec_1()?;
+    /* map */
+    //map_sec_0,
+    //map_sec_1,
 
-        /* join */
-        //join_sec_0()?;
-        //join_sec_1()?;
-        //join_sec_2()?;
-        
-        /* distinct */
-        //distinct_sec_0()?;
-        //distinct_unsec_0()?;
+    /* filter */
+    //filter_sec_0,
+    
+    /* group_by */
+    //group_by_sec_0,
+    //group_by_sec_1,
+
+    /* join */
+    //join_sec_0,
+    //join_sec_1,
+    //join_sec_2,
+    
+    /* distinct */
+    //distinct_sec_0,
+    //distinct_unsec_0,
 
-        /* local file reader */
-        //file_read_sec_0()?;
+    /* local file reader */
+    //file_read_sec_0,
 
-        /* partition_wise_sample */
-        //part_wise_sample_sec_0()?;
+    /* partition_wise_sample */
+    //part_wise_sample_sec_0,
 
-        /* take */
-        //take_sec_0()?;
+    /* take */
+    //take_sec_0,
 
-        /* reduce */
-        //reduce_sec_0()?;
+    /* reduce */
+    //reduce_sec_0,
 
-        /* count */
-        //count_sec_0()?;
+    /* count */
+    //count_sec_0,
 
-        /* union */
-        //union_sec_0()?;
+    /* union */
+    //union_sec_0,
 
-        /* zip */
-        //zip_sec_0()?;
+    /* zip */
+    //zip_sec_0,
 
-        /* kmeans */
-        //kmeans_sec_0()?;
+    /* kmeans */
+    //kmeans_sec_0,
 
-        /* linear regression */
-        //lr_sec()?;
+    /* linear regression */
+    //lr_sec,
 
-        /* matrix multipilication */
-        //mm_sec_0()?;
+    /* matrix multipilication */
+    //mm_sec_0,
+    //mm_sec_1,
 
-        /* page rank */
-        //pagerank_sec_0()?;
+    /* page rank */
+    //pagerank_sec_0,
 
-        /* pearson correlation algorithm */
-        pearson_sec_0()?;
+    /* pearson correlation algorithm */
+    pearson_sec_0,
 
-        /* transitive_closure */
-        //transitive_closure_sec_0()?;
-        //transitive_closure_sec_1()?;
+    /* transitive_closure */
+    //transitive_closure_sec_0,
+    //transitive_closure_sec_1,
 
-        /* triangle counting */
-        //triangle_counting_sec_0()?;
+    /* triangle counting */
+    //triangle_counting_sec_0,
 
-        // test the speculative execution in loop
-        //test0_sec_0()?;
+    // test the speculative execution in loop
+    //test0_sec_0,
 
-        // topk
-        //topk_sec_0()?;
+    // topk
+    //topk_sec_0,
+];
 
-        Ok(())
-    };
+lazy_static! {
+    static ref CACHE: OpCache = OpCache::new();
+    static ref PLAIN_CACHE: plain_cache::PlainCache = plain_cache::PlainCache::new();
+    static ref OP_MAP: op_table::OpTable = op_table::OpTable::new(JOBS);
+    //the loop-carried values of tail_compute, resident between iterations,
+    //and the copy of them the last call handed out
+    static ref TAIL_INFO: Mutex<(TailCompInfo, usize)> = Mutex::new((TailCompInfo::new(), 0));
 }
 
 #[no_mangle]
@@ -173,16 +188,18 @@ pub extern "C" fn secure_execute_pre(tid: u64,
     part_nums: *const u8,
     dep_info: DepInfo,
 ) { 
-    let _init = *init; //this is necessary to let it accually execute
+    prepare_stage(op_ids, part_nums, &dep_info);
+}
+
+fn prepare_stage(op_ids: *const u8, part_nums: *const u8, dep_info: &DepInfo) {
     let mut op_ids = unsafe { (op_ids as *const Vec<OpId>).as_ref() }.unwrap().clone();
     let mut part_nums = unsafe { (part_nums as *const Vec<usize>).as_ref() }.unwrap().clone();
-    println!("in secure_execute_pre, op_ids = {:?}, part_nums = {:?}", op_ids, part_nums);
     if dep_info.dep_type() == 1 {
         assert!(part_nums.len() == op_ids.len()+1);
         let reduce_num = part_nums.remove(0);
         let (parent_id, _) = dep_info.get_op_key();
         let parent = load_opmap().get(&parent_id).unwrap();
-        parent.sup_next_shuf_dep(&dep_info, reduce_num);  //set shuf dep if missing when in loop
+        parent.sup_next_shuf_dep(dep_info, reduce_num);  //set shuf dep if missing when in loop
     }
     //The header is action id
     if part_nums[0] == usize::MAX {
@@ -215,57 +232,126 @@ pub extern "C" fn secure_execute(tid: u64,
     input: Input, 
     captured_vars: *const u8,
 ) -> usize {
-    let _init = *init; //this is necessary to let it accually execute
-    println!("tid: {:?}, at the begining of secure execution", tid);
+    execute_stage(tid, rdd_ids, op_ids, part_ids, cache_meta, dep_info, input, captured_vars)
+}
+
+//secure_execute_pre and secure_execute in one enclave transition
+#[no_mangle]
+pub extern "C" fn secure_execute_with_pre(tid: u64,
+    rdd_ids: *const u8,
+    op_ids: *const u8,
+    part_ids: *const u8,
+    part_nums: *const u8,
+    cache_meta: CacheMeta,
+    dep_info: DepInfo,
+    input: Input,
+    captured_vars: *const u8,
+) -> usize {
+    prepare_stage(op_ids, part_nums, &dep_info);
+    execute_stage(tid, rdd_ids, op_ids, part_ids, cache_meta, dep_info, input, captured_vars)
+}
+
+//one partition of secure_execute_batch, laid out by the host (see
+//framework/src/rdd/exec_batch.rs). result is written in place
+#[repr(C)]
+struct BatchEntry {
+    part_ids: *const u8,
+    cache_meta: CacheMeta,
+    input: Input,
+    result: usize,
+}
+
+//secure_execute_with_pre for len partitions of the same stage in one enclave
+//transition. the stage is prepared once, then the partitions run side by side
+//on the worker pool and each gets the result secure_execute would return
+#[no_mangle]
+pub extern "C" fn secure_execute_batch(tid: u64,
+    rdd_ids: *const u8,
+    op_ids: *const u8,
+    part_nums: *const u8,
+    dep_info: DepInfo,
+    entries: *mut u8,
+    len: usize,
+    captured_vars: *const u8,
+) {
+    assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(entries, len * std::mem::size_of::<BatchEntry>()), "invalid batch");
+    let entries = unsafe { std::slice::from_raw_parts_mut(entries as *mut BatchEntry, len) };
+    prepare_stage(op_ids, part_nums, &dep_info);
+    let (rdd_ids, op_ids, captured_vars) = (rdd_ids as usize, op_ids as usize, captured_vars as usize);
+    let handles = entries.iter()
+        .map(|entry| {
+            let (part_ids, cache_meta, input) = (entry.part_ids as usize, entry.cache_meta, entry.input);
+            thread_pool::spawn(move || execute_stage(tid,
+                rdd_ids as *const u8,
+                op_ids as *const u8,
+                part_ids as *const u8,
+                cache_meta,
+                dep_info,
+                input,
+                captured_vars as *const u8,
+            ))
+        })
+        .collect::<Vec<_>>();
+    for (entry, handle) in entries.iter_mut().zip(handles) {
+        entry.result = handle.join().unwrap_or_else(|payload| std::panic::resume_unwind(payload));
+    }
+}
+
+fn execute_stage(tid: u64,
+    rdd_ids: *const u8,
+    op_ids: *const u8,
+    part_ids: *const u8,
+    cache_meta: CacheMeta,
+    dep_info: DepInfo,
+    input: Input,
+    captured_vars: *const u8,
+) -> usize {
     let rdd_ids = unsafe { (rdd_ids as *const Vec<usize>).as_ref() }.unwrap().clone();
     let op_ids = unsafe { (op_ids as *const Vec<OpId>).as_ref() }.unwrap().clone();
     let part_ids = unsafe { (part_ids as *const Vec<usize>).as_ref() }.unwrap().clone();
-    let captured_vars = unsafe { (captured_vars as *const HashMap<usize, Vec<Vec<u8>>>).as_ref() }.unwrap().clone();
-    println!("tid: {:?}, rdd ids = {:?}, op ids = {:?}, dep_info = {:?}, cache_meta = {:?}", tid, rdd_ids, op_ids, dep_info, cache_meta);
-    
+    let captured_vars = load_captured_vars(captured_vars);
+
     let now = Instant::now();
-    let mut call_seq = NextOpId::new(tid, rdd_ids, op_ids, part_ids, cache_meta.clone(), captured_vars, &dep_info);
-    let final_op = call_seq.get_cur_op();
-    let result_ptr = final_op.iterator_start(call_seq, input, &dep_info); //shuffle need dep_info
-    let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-    println!("tid: {:?}, secure_execute {:?} s", tid, dur);
-    return result_ptr as usize
+    //the work of the stage is counted under its final op until drain_metrics
+    metrics::enter_stage(op_ids[0].get_hash());
+    //attribute sampled outside allocations and cpu time to the final op of this stage
+    ALLOCATOR.set_profile_tag(op_ids[0].get_hash());
+    let _profiled = cpu_profiler::enter();
+    //a stage that runs the outside heap out returns 0, the enclave goes on
+    let result_ptr = oom::catch(|| {
+        let mut call_seq = NextOpId::new(tid, rdd_ids, op_ids, part_ids, cache_meta.clone(), captured_vars, &dep_info);
+        let final_op = call_seq.get_cur_op();
+        final_op.iterator_start(call_seq, input, &dep_info) as usize //shuffle need dep_info
+    });
+    ALLOCATOR.set_profile_tag(0);
+    metrics::record_ecall(now.elapsed().as_nanos() as u64);
+    metrics::leave_stage();
+    return result_ptr
 }
 
 #[no_mangle]
 pub extern "C" fn free_res_enc(op_id: OpId, dep_info: DepInfo, input: *mut u8) {
-    let _init = *init;
-    let op = load_opmap().get(&op_id).unwrap();
-    op.call_free_res_enc(input, true, &dep_info);
-}
-
-#[no_mangle]
-pub extern "C" fn priv_free_res_enc(op_id: OpId, dep_info: DepInfo, input: *mut u8) {
-    let _init = *init;
     let op = load_opmap().get(&op_id).unwrap();
     op.call_free_res_enc(input, true, &dep_info);
+    scavenger::stage_ended();
 }
 
+//the combiners the map tasks of a stage left in the dep of their shuffle, see
+//ShuffleDependency::deposit. the host of the last map task adds them to its
+//output and frees them with free_res_enc
 #[no_mangle]
-pub extern "C" fn get_sketch(op_id: OpId, 
-    dep_info: DepInfo, 
-    p_buf: *mut u8, 
-    p_data_enc: *mut u8)
-{
-    let _init = *init;
+pub extern "C" fn flush_node_combine(op_id: OpId, dep_info: DepInfo) -> usize {
     let op = load_opmap().get(&op_id).unwrap();
-    op.build_enc_data_sketch(p_buf, p_data_enc, &dep_info);
+    match op.get_next_shuf_dep(&dep_info) {
+        Some(shuf_dep) => shuf_dep.flush_node_combine() as usize,
+        None => 0,
+    }
 }
 
 #[no_mangle]
-pub extern "C" fn clone_out(op_id: OpId, 
-    dep_info: DepInfo,
-    p_out: usize, 
-    p_data_enc: *mut u8)
-{
-    let _init = *init;
+pub extern "C" fn priv_free_res_enc(op_id: OpId, dep_info: DepInfo, input: *mut u8) {
     let op = load_opmap().get(&op_id).unwrap();
-    op.clone_enc_data_out(p_out, p_data_enc, &dep_info);
+    op.call_free_res_enc(input, true, &dep_info);
 }
 
 #[no_mangle]
@@ -276,7 +362,6 @@ pub extern "C" fn randomize_in_place(
     is_some: u8,
     num: u64,
 ) -> usize {
-    let _init = *init;
     let sample_op = load_opmap().get(&op_id).unwrap();
     let seed = match is_some {
         0 => None,
@@ -294,20 +379,30 @@ pub extern "C" fn etake(
     should_take: usize,
     have_take: *mut usize,
 ) -> usize {
-    let _init = *init;
     let take_op = load_opmap().get(&op_id).unwrap();
     let have_take = unsafe { have_take.as_mut() }.unwrap();
     let ptr = take_op.etake(input, should_take, have_take);
     ptr as usize
 }
 
+#[no_mangle]
+pub extern "C" fn elookup(
+    op_id: OpId,
+    rdd_id: usize,
+    part_id: usize,
+    input: *const u8,
+    key: *const u8,
+) -> usize {
+    let ptr = key_index::lookup_start(op_id, (rdd_id, part_id), input, key);
+    ptr as usize
+}
+
 #[no_mangle]
 pub extern "C" fn set_sampler(
     op_id: OpId,
     with_replacement: u8,
     fraction: f64,
 ) {
-    let _init = *init;
     let sample_op = load_opmap().get(&op_id).unwrap();
     let with_replacement = match with_replacement {
         0 => false,
@@ -319,45 +414,308 @@ pub extern "C" fn set_sampler(
 
 #[no_mangle]
 pub extern "C" fn tail_compute(input: *mut u8) -> usize {
-    let tail_info = unsafe{ (input as *const TailCompInfo).as_ref() }.unwrap();
-    let mut tail_info = tail_info.clone();
-    kmeans_sec_0_(&mut tail_info).unwrap();
-    ALLOCATOR.set_switch(true);
-    let ptr = Box::into_raw(Box::new(tail_info.clone()));
-    ALLOCATOR.set_switch(false);
+    let input = unsafe{ (input as *const TailCompInfo).as_ref() }.unwrap();
+    let mut resident = TAIL_INFO.lock().unwrap();
+    let (tail_info, last_out) = &mut *resident;
+    //the host only sends the values that changed on its side
+    tail_info.merge(input);
+    kmeans_sec_0_(tail_info).unwrap();
+    //the host has read the last copy by now
+    free_tail_out(last_out);
+    let ptr = {
+        let _outside = ALLOCATOR.outside();
+        Box::into_raw(Box::new(tail_info.clone()))
+    };
+    *last_out = ptr as usize;
     ptr as *mut u8 as usize
 }
 
+//ends the loop, the resident values are dropped with the last copy handed out
 #[no_mangle]
-pub extern "C" fn free_tail_info(input: *mut u8) {
+pub extern "C" fn free_tail_info(_input: *mut u8) {
+    let mut resident = TAIL_INFO.lock().unwrap();
+    let (tail_info, last_out) = &mut *resident;
+    tail_info.clear();
+    free_tail_out(last_out);
+}
+
+fn free_tail_out(out: &mut usize) {
+    if *out == 0 {
+        return;
+    }
     let tail_info = unsafe {
-        Box::from_raw(input as *mut TailCompInfo)
+        Box::from_raw(*out as *mut TailCompInfo)
     };
-    ALLOCATOR.set_switch(true);
-    drop(tail_info);
-    ALLOCATOR.set_switch(false);
+    {
+        let _outside = ALLOCATOR.outside();
+        drop(tail_info);
+    }
+    *out = 0;
 }
 
+//called at the end of the job. an executor daemon keeps the enclave for the
+//next job, which reuses the rdd ids, so nothing of this one may be found
+//under them
 #[no_mangle]
 pub extern "C" fn clear_cache() {
     CACHE.clear();
+    CACHE.forget();
+    let mut resident = TAIL_INFO.lock().unwrap();
+    let (tail_info, last_out) = &mut *resident;
+    tail_info.clear();
+    free_tail_out(last_out);
 }
 
 #[no_mangle]
-pub extern "C" fn pre_touching(zero: u8) -> usize 
-{
-    println!("thread_id = {:?}", thread::rsgx_thread_self());
-    let base = std::enclave::get_heap_base();
-    let mut p = base as *mut u8;
-    unsafe{ *p += zero; }
+pub extern "C" fn set_cpu_count(cpu_count: usize) {
+    inside_cache::set_num_threads(cpu_count);
+    unsafe { allocator::ocall_tc_set_num_cpus(cpu_count as libc::c_int) };
+}
 
-    for _i in 0..1<<10 {
-        unsafe {
-            p = p.offset(4*1024);
-            *p += zero;
+//the numa node the host places the outside memory of this enclave on, called
+//before the first ECALL that may grow the heap
+#[no_mangle]
+pub extern "C" fn set_numa_node(node: i32) {
+    unsafe { allocator::ocall_tc_set_numa_node(node as libc::c_int) };
+    region::set_node(node);
+}
+
+//the GB of the contiguous range the outside heap is carved from, whose pages
+//the page heap indexes flat, 0 for none. called before the first ECALL that
+//may grow the heap
+#[no_mangle]
+pub extern "C" fn set_reserve_range(gb: usize) {
+    unsafe { allocator::ocall_tc_set_reserve_range(gb) };
+}
+
+//the outside memory tcmalloc holds back for a growth the host cannot serve,
+//0 for none, and failing the task rather than the enclave once it is used
+//up, see oom.rs
+#[no_mangle]
+pub extern "C" fn set_oom_reserve(bytes: usize) {
+    oom::set_reserve(bytes);
+}
+
+//selects the job key, see op/keys.rs
+#[no_mangle]
+pub extern "C" fn set_key_id(key_id: u64) {
+    op::keys::set_key_id(key_id);
+}
+
+//start an attestation for the quoting enclave of target_info, see
+//provision.rs. 1 if the report and the public key were written
+#[no_mangle]
+pub extern "C" fn provision_begin(target_info: *const sgx_types::sgx_target_info_t, report: *mut sgx_types::sgx_report_t, public: *mut sgx_types::sgx_ec256_public_t) -> i32 {
+    match provision::begin(unsafe { &*target_info }) {
+        Some((r, p)) => {
+            unsafe {
+                *report = r;
+                *public = p;
+            }
+            1
         }
+        None => 0,
+    }
+}
+
+//take the master key the key service wrapped for the attestation under way,
+//before set_key_id. 1 if it opened
+#[no_mangle]
+pub extern "C" fn provision_finish(peer: *const sgx_types::sgx_ec256_public_t, wrapped: *const u8, len: usize) -> i32 {
+    let wrapped = unsafe { std::slice::from_raw_parts(wrapped, len) };
+    provision::finish(unsafe { &*peer }, wrapped) as i32
+}
+
+//seal the master key into buf, returns the size needed, nothing is written
+//if it is more than cap
+#[no_mangle]
+pub extern "C" fn seal_master_key(buf: *mut u8, cap: usize) -> usize {
+    let sealed = match provision::seal() {
+        Some(sealed) => sealed,
+        None => return 0,
+    };
+    if sealed.len() <= cap {
+        unsafe { std::ptr::copy_nonoverlapping(sealed.as_ptr(), buf, sealed.len()) };
+    }
+    sealed.len()
+}
+
+//take a master key sealed by an enclave of this build, before set_key_id.
+//0 if it was, 1 if the TCB changed since, 2 if it does not open
+#[no_mangle]
+pub extern "C" fn unseal_master_key(sealed: *mut u8, len: usize) -> i32 {
+    let sealed = unsafe { std::slice::from_raw_parts_mut(sealed, len) };
+    provision::unseal(sealed)
+}
+
+//the knobs of the ops, sealed by the host under the job key, so set_key_id
+//comes first. 1 if they were applied, see tuning.rs
+#[no_mangle]
+pub extern "C" fn set_tuning(sealed: *const u8, len: usize) -> i32 {
+    let sealed = unsafe { std::slice::from_raw_parts(sealed, len) };
+    tuning::set(sealed) as i32
+}
+
+//the generation of the host cache, which the enclave reads in place to keep
+//the pointers to cached partitions it was handed, see OpCache::outside
+#[no_mangle]
+pub extern "C" fn set_cache_generation(generation: *const u64) {
+    op::set_cache_generation(generation);
+}
+
+//target plaintext size of the blocks batch_encrypt produces
+#[no_mangle]
+pub extern "C" fn set_enc_block_bytes(bytes: usize) {
+    op::set_enc_block_bytes(bytes);
+}
+
+//start the worker threads the ops hand their decrypt/compute/encrypt jobs to
+#[no_mangle]
+pub extern "C" fn init_thread_pool(num_workers: usize) {
+    thread_pool::init(num_workers);
+}
+
+//release the free outside memory from a thread of its own every interval_ms,
+//0 leaves it to the free path, see scavenger.rs
+#[no_mangle]
+pub extern "C" fn start_scavenger(interval_ms: u64) {
+    scavenger::start(Duration::from_millis(interval_ms));
+}
+
+//called before the enclave is destroyed, the workers and the scavenger must
+//not be inside by then
+#[no_mangle]
+pub extern "C" fn stop_thread_pool() {
+    thread_pool::stop();
+    scavenger::stop();
+}
+
+//stats is a tc_stats_t, filled in by the tcmalloc itself
+#[no_mangle]
+pub extern "C" fn get_tc_stats(stats: *mut u8) {
+    unsafe { allocator::ocall_tc_get_stats(stats as *mut libc::c_void) };
+}
+
+//bytes in use and peak bytes of the trusted heap, see allocator::TrustedHeap
+#[no_mangle]
+pub extern "C" fn get_heap_usage(in_use: *mut u64, peak: *mut u64) {
+    let (cur, max) = allocator::trusted_heap_usage();
+    unsafe {
+        *in_use = cur as u64;
+        *peak = max as u64;
+    }
+}
+
+//ops malloc/free pairs on the outside heap from this thread, see
+//gperftools/tcmalloc_bench.cc. returns a checksum of the bytes written
+#[no_mangle]
+pub extern "C" fn bench_tcmalloc(
+    ops: u64,
+    seed: u64,
+    dist: u32,
+    block_bytes: u64,
+    shared: i32,
+) -> u64 {
+    unsafe { allocator::ocall_tc_bench(ops, seed, dist, block_bytes, shared) }
+}
+
+//free what the threads of a shared bench_tcmalloc run left in its slots
+#[no_mangle]
+pub extern "C" fn bench_tcmalloc_drain() {
+    unsafe { allocator::ocall_tc_bench_drain() };
+}
+
+//serialize the metrics this thread counted since the last call into buf and
+//clear them. if they take more than cap bytes nothing is written, they are
+//kept and the size needed is returned
+#[no_mangle]
+pub extern "C" fn drain_metrics(buf: *mut u8, cap: usize) -> usize {
+    let table = metrics::take();
+    let bytes = bincode::serialize(&table).unwrap();
+    if bytes.len() > cap {
+        metrics::merge(table);
+        return bytes.len();
+    }
+    unsafe { std::ptr::copy_nonoverlapping(bytes.as_ptr(), buf, bytes.len()) };
+    bytes.len()
+}
+
+//seal the tags of cached partition part_id of rdd_id into buf, see
+//cache_seal.rs. returns the size needed, nothing is written if it is more
+//than cap, and 0 if this enclave did not cache the partition
+#[no_mangle]
+pub extern "C" fn seal_cache_index(rdd_id: usize, part_id: usize, buf: *mut u8, cap: usize) -> usize {
+    let sealed = match cache_seal::seal((rdd_id, part_id)) {
+        Some(sealed) => sealed,
+        None => return 0,
+    };
+    if sealed.len() <= cap {
+        unsafe { std::ptr::copy_nonoverlapping(sealed.as_ptr(), buf, sealed.len()) };
+    }
+    sealed.len()
+}
+
+//take the sealed tags of a partition the host reloaded, 0 if they do not open
+#[no_mangle]
+pub extern "C" fn unseal_cache_index(rdd_id: usize, part_id: usize, sealed: *mut u8, len: usize) -> i32 {
+    let sealed = unsafe { std::slice::from_raw_parts_mut(sealed, len) };
+    cache_seal::unseal((rdd_id, part_id), sealed) as i32
+}
+
+//sample outside allocations once every `period` bytes, 0 turns it off
+#[no_mangle]
+pub extern "C" fn set_heap_profiler(period: u64) {
+    ALLOCATOR.set_heap_profiler(period);
+}
+
+//start or stop sampling the threads running stages and pool jobs, returns 0
+//if the enclave cannot profile, see cpu_profiler.rs
+#[no_mangle]
+pub extern "C" fn set_cpu_profiler(enabled: i32) -> i32 {
+    cpu_profiler::set_enabled(enabled != 0) as i32
+}
+
+//move the cpu profile samples into buf as u64 words, the samples dropped so
+//far first. returns the bytes written
+#[no_mangle]
+pub extern "C" fn drain_cpu_profile(buf: *mut u8, cap: usize) -> usize {
+    let words = unsafe { std::slice::from_raw_parts_mut(buf as *mut u64, cap / 8) };
+    cpu_profiler::drain(words) * 8
+}
+
+//touch the pages of [offset, offset + len) of the heap, clamped to it, so the
+//tasks do not take their first faults. it is a lock add of zero, which keeps
+//the bytes others write meanwhile. returns the bytes touched
+#[cfg(not(feature = "edmm"))]
+#[no_mangle]
+pub extern "C" fn pre_touching(zero: u8, offset: usize, len: usize) -> usize {
+    const PAGE: usize = 4 * 1024;
+    let base = std::enclave::get_heap_base() as usize;
+    let size = std::enclave::get_heap_size();
+    let start = std::cmp::min(offset, size) / PAGE * PAGE;
+    let end = std::cmp::min(offset.saturating_add(len), size);
+    let mut p = start;
+    while p < end {
+        let byte = unsafe { &*((base + p) as *const std::sync::atomic::AtomicU8) };
+        byte.fetch_add(zero, Ordering::Relaxed);
+        p += PAGE;
+    }
+    end.saturating_sub(start)
+}
+
+//with edmm the heap past its initial size is only committed as the allocator
+//grows it, a page touched before faults. so len bytes are allocated instead,
+//which commits them, and freed again, the allocator keeps the pages
+#[cfg(feature = "edmm")]
+#[no_mangle]
+pub extern "C" fn pre_touching(zero: u8, offset: usize, len: usize) -> usize {
+    const PAGE: usize = 4 * 1024;
+    let len = std::cmp::min(len, std::enclave::get_heap_size().saturating_sub(offset));
+    let mut buf = Vec::<u8>::with_capacity(len);
+    let p = buf.as_mut_ptr();
+    for i in (0..len).step_by(PAGE) {
+        unsafe { std::ptr::write_volatile(p.add(i), zero) };
     }
-    println!("finish pre_touching");
-    return 0;
+    len
 }
 
@@ -0,0 +1,261 @@
+//! Per-op counters of the work done inside the enclave, drained once a task.
+//!
+//! Every thread keeps a small table of OpMetrics, keyed by the hash of the op
+//! its work is attributed to, and only ever updates its own, so counting takes
+//! no lock and no atomic. A job handed to the thread pool counts into a table
+//! of its own under the op of the thread that spawned it, which join merges
+//! into the table of the joining thread, so the work of a stage ends up on the
+//! thread of its ECALL, where drain_metrics serializes and clears it. A clock
+//! read is an ocall, so only one block in SAMPLE_PERIOD is timed, the others
+//! are only counted.
+use core::cell::{Cell, RefCell};
+use std::time::Instant;
+use std::untrusted::time::InstantEx;
+use std::vec::Vec;
+
+pub const HIST_BUCKETS: usize = 32;
+const SAMPLE_PERIOD: usize = 64;
+
+//the TaskMetrics of the host mirrors it field by field
+#[derive(Clone, Copy, Debug, Default, Serialize, Deserialize)]
+pub struct OpMetrics {
+    pub ecall_ns: u64,
+    pub shuffle_write_ns: u64,
+    //decrypt_ns and encrypt_ns sum the timed blocks only
+    pub decrypt_ns: u64,
+    pub decrypt_timed: u64,
+    pub encrypt_ns: u64,
+    pub encrypt_timed: u64,
+    pub bytes_decrypted: u64,
+    pub blocks_decrypted: u64,
+    pub bytes_encrypted: u64,
+    pub blocks_encrypted: u64,
+    pub ocalls: u64,
+    //inside allocations of the sample blocks only, see op/planner.rs
+    pub allocs: u64,
+    //serializations and deserializations of blocks sealed or opened in the
+    //scratch buffer, the *_ns sum the timed ones only
+    pub ser_ns: u64,
+    pub ser_timed: u64,
+    pub serialized: u64,
+    pub de_ns: u64,
+    pub de_timed: u64,
+    pub deserialized: u64,
+    //timed block decryptions, bucket i counts those of [2^i, 2^(i+1)) ns
+    pub decrypt_hist: [u64; HIST_BUCKETS],
+}
+
+impl OpMetrics {
+    fn merge(&mut self, other: &OpMetrics) {
+        self.ecall_ns += other.ecall_ns;
+        self.shuffle_write_ns += other.shuffle_write_ns;
+        self.decrypt_ns += other.decrypt_ns;
+        self.decrypt_timed += other.decrypt_timed;
+        self.encrypt_ns += other.encrypt_ns;
+        self.encrypt_timed += other.encrypt_timed;
+        self.bytes_decrypted += other.bytes_decrypted;
+        self.blocks_decrypted += other.blocks_decrypted;
+        self.bytes_encrypted += other.bytes_encrypted;
+        self.blocks_encrypted += other.blocks_encrypted;
+        self.ocalls += other.ocalls;
+        self.allocs += other.allocs;
+        self.ser_ns += other.ser_ns;
+        self.ser_timed += other.ser_timed;
+        self.serialized += other.serialized;
+        self.de_ns += other.de_ns;
+        self.de_timed += other.de_timed;
+        self.deserialized += other.deserialized;
+        for (a, b) in self.decrypt_hist.iter_mut().zip(other.decrypt_hist.iter()) {
+            *a += *b;
+        }
+    }
+}
+
+pub type Table = Vec<(u64, OpMetrics)>;
+
+//hash of the op the work of this thread goes to, 0 for none
+#[thread_local]
+static CUR_OP: Cell<u64> = Cell::new(0);
+#[thread_local]
+static TABLE: RefCell<Table> = RefCell::new(Vec::new());
+//allocator counters already attributed to an op
+#[thread_local]
+static SEEN: Cell<(usize, usize)> = Cell::new((0, 0));
+#[thread_local]
+static BLOCKS: Cell<usize> = Cell::new(0);
+#[thread_local]
+static CODINGS: Cell<usize> = Cell::new(0);
+
+fn with_cur<F: FnOnce(&mut OpMetrics)>(f: F) {
+    let op = CUR_OP.get();
+    if op == 0 {
+        return;
+    }
+    //the table lives inside, whatever the switch says
+    let switch = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    {
+        let mut table = TABLE.borrow_mut();
+        let idx = match table.iter().rposition(|(id, _)| *id == op) {
+            Some(idx) => idx,
+            None => {
+                table.push((op, OpMetrics::default()));
+                table.len() - 1
+            }
+        };
+        f(&mut table[idx].1);
+    }
+    crate::ALLOCATOR.set_switch(switch);
+}
+
+//charge the allocations and ocalls since the last call to the current op
+fn settle() {
+    let now = (crate::ALLOCATOR.get_alloc_cnt(), crate::ALLOCATOR.get_ocall_cnt());
+    let (allocs, ocalls) = SEEN.replace(now);
+    with_cur(|m| {
+        m.allocs += now.0.wrapping_sub(allocs) as u64;
+        m.ocalls += now.1.wrapping_sub(ocalls) as u64;
+    });
+}
+
+pub fn cur_op() -> u64 {
+    CUR_OP.get()
+}
+
+//count the work of this thread under op, into the table drained by take
+pub fn enter_stage(op: u64) {
+    settle();
+    CUR_OP.set(op);
+}
+
+pub fn leave_stage() {
+    settle();
+    CUR_OP.set(0);
+}
+
+//what the thread counted into before a scope began
+pub struct Scope {
+    op: u64,
+    table: Table,
+}
+
+//count into an empty table under op until leave
+pub fn enter(op: u64) -> Scope {
+    settle();
+    let table = std::mem::take(&mut *TABLE.borrow_mut());
+    Scope {
+        op: CUR_OP.replace(op),
+        table,
+    }
+}
+
+//the table of the scope, the one before it is restored
+pub fn leave(scope: Scope) -> Table {
+    settle();
+    CUR_OP.set(scope.op);
+    std::mem::replace(&mut *TABLE.borrow_mut(), scope.table)
+}
+
+pub fn take() -> Table {
+    settle();
+    std::mem::take(&mut *TABLE.borrow_mut())
+}
+
+pub fn merge(other: Table) {
+    let cur = CUR_OP.get();
+    for (op, m) in other.iter() {
+        CUR_OP.set(*op);
+        with_cur(|cur| cur.merge(m));
+    }
+    CUR_OP.set(cur);
+    let switch = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    drop(other);
+    crate::ALLOCATOR.set_switch(switch);
+}
+
+pub fn record_ecall(ns: u64) {
+    with_cur(|m| m.ecall_ns += ns);
+}
+
+pub fn record_shuffle_write(ns: u64) {
+    with_cur(|m| m.shuffle_write_ns += ns);
+}
+
+#[inline]
+fn sample(cnt: &Cell<usize>) -> Option<Instant> {
+    if CUR_OP.get() == 0 {
+        return None;
+    }
+    let n = cnt.get();
+    cnt.set(n.wrapping_add(1));
+    if n % SAMPLE_PERIOD == 0 {
+        Some(Instant::now())
+    } else {
+        None
+    }
+}
+
+//the clock to time a block with, one block in SAMPLE_PERIOD gets one
+#[inline]
+pub fn block_timer() -> Option<Instant> {
+    sample(&BLOCKS)
+}
+
+//same for a serialization or deserialization, counted apart from the blocks
+//so that the two samples do not fall on the same calls
+#[inline]
+pub fn coding_timer() -> Option<Instant> {
+    sample(&CODINGS)
+}
+
+fn hist_bucket(ns: u64) -> usize {
+    std::cmp::min(64 - ns.max(1).leading_zeros() as usize - 1, HIST_BUCKETS - 1)
+}
+
+pub fn record_decrypt(bytes: usize, timer: Option<Instant>) {
+    let ns = timer.map(|t| t.elapsed().as_nanos() as u64);
+    with_cur(|m| {
+        m.bytes_decrypted += bytes as u64;
+        m.blocks_decrypted += 1;
+        if let Some(ns) = ns {
+            m.decrypt_ns += ns;
+            m.decrypt_timed += 1;
+            m.decrypt_hist[hist_bucket(ns)] += 1;
+        }
+    });
+}
+
+pub fn record_encrypt(bytes: usize, timer: Option<Instant>) {
+    let ns = timer.map(|t| t.elapsed().as_nanos() as u64);
+    with_cur(|m| {
+        m.bytes_encrypted += bytes as u64;
+        m.blocks_encrypted += 1;
+        if let Some(ns) = ns {
+            m.encrypt_ns += ns;
+            m.encrypt_timed += 1;
+        }
+    });
+}
+
+pub fn record_ser(timer: Option<Instant>) {
+    let ns = timer.map(|t| t.elapsed().as_nanos() as u64);
+    with_cur(|m| {
+        m.serialized += 1;
+        if let Some(ns) = ns {
+            m.ser_ns += ns;
+            m.ser_timed += 1;
+        }
+    });
+}
+
+pub fn record_de(timer: Option<Instant>) {
+    let ns = timer.map(|t| t.elapsed().as_nanos() as u64);
+    with_cur(|m| {
+        m.deserialized += 1;
+        if let Some(ns) = ns {
+            m.de_ns += ns;
+            m.de_timed += 1;
+        }
+    });
+}
@@ -0,0 +1,60 @@
+//! Failing the task, not the enclave, when the outside heap runs out.
+//!
+//! A null from the outside heap reaches handle_alloc_error, which aborts the
+//! enclave and every task inside with it. The tcmalloc of the host keeps a
+//! reserve for the growth the host cannot serve, see TakeOOMReserve in
+//! gperftools/system-alloc.cc, and tells the host to evict cached partitions
+//! of this enclave. When even the reserve is gone the hook set here unwinds
+//! the task instead of returning into the abort, and `catch` around the
+//! stage turns that into a 0 result, which the host fails the task with.
+//! Failures of the inside heap still abort, the enclave is corrupt by then.
+use std::alloc::{self, Layout};
+use std::any::Any;
+use std::boxed::Box;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::allocator;
+
+//the panic payload, zero sized so that neither raising nor dropping it
+//allocates
+pub struct OutsideOom;
+
+//unwinds of any thread so far, a job that ran out on a pool worker reaches
+//its stage as the panic of the join instead
+static UNWOUND: AtomicU64 = AtomicU64::new(0);
+
+//keep `bytes` of the outside heap back for when the host cannot grow it
+pub fn set_reserve(bytes: usize) {
+    alloc::set_alloc_error_hook(hook);
+    unsafe { allocator::ocall_tc_set_oom_reserve(bytes) };
+}
+
+fn hook(layout: Layout) {
+    if !allocator::take_outside_failed() {
+        println!("memory allocation of {} bytes failed", layout.size());
+        return;
+    }
+    //the unwind allocates its exception, which must not go outside again
+    crate::ALLOCATOR.set_switch(false);
+    UNWOUND.fetch_add(1, Ordering::AcqRel);
+    println!("outside allocation of {} bytes failed, failing the task", layout.size());
+    panic::resume_unwind(Box::new(OutsideOom));
+}
+
+fn ran_out(payload: &Box<dyn Any + Send>, before: u64) -> bool {
+    payload.is::<OutsideOom>() || UNWOUND.load(Ordering::Acquire) != before
+}
+
+//the result of f, 0 if the outside heap ran out under it
+pub fn catch<F: FnOnce() -> usize>(f: F) -> usize {
+    let before = UNWOUND.load(Ordering::Acquire);
+    match panic::catch_unwind(AssertUnwindSafe(f)) {
+        Ok(res) => res,
+        Err(payload) if ran_out(&payload, before) => {
+            crate::ALLOCATOR.set_switch(false);
+            0
+        }
+        Err(payload) => panic::resume_unwind(payload),
+    }
+}
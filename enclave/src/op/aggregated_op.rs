@@ -63,20 +63,6 @@ where
     SF: SerFunc(Box<dyn Iterator<Item = T>>) -> U,
     CF: SerFunc(Box<dyn Iterator<Item = U>>) -> U,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step0_of_clone(p_buf, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             3 | 4 => self.free_res_enc(res_ptr, is_enc),
@@ -128,14 +114,13 @@ where
             let ue = vec![ser_encrypt(&u)];
             res_enc_to_ptr(ue)
         } else if dep_info.dep_type() == 4 {
-            let data_enc = input.get_enc_data::<Vec<ItemE>>();
-            let len = data_enc.len();
-            let mut reduced = Vec::new();
-            for i in 0..len {
-                let block = ser_decrypt::<Vec<T>>(&data_enc[i].clone());
-                reduced.push((self.sf)(Box::new(block.into_iter())));  
-            }
-            let u = (self.cf)(Box::new(reduced.into_iter()));
+            let (sf, cf) = (self.sf.clone(), self.cf.clone());
+            let u = fold_blocks(
+                self.get_op_id(),
+                input,
+                move |block: Vec<T>| (sf)(Box::new(block.into_iter())),
+                move |partials: Vec<U>| (cf)(Box::new(partials.into_iter())),
+            );
             let ue = vec![ser_encrypt(&u)];
             res_enc_to_ptr(ue) 
         } else {
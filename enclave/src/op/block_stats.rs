@@ -0,0 +1,155 @@
+//! Statistics the writer of an encrypted file kept of the items of each block.
+//!
+//! A block read from such a file (the EncFile of the host) comes framed with
+//! its statistics:
+//!
+//!   mark: [0xff; 12] | stats_len: u32 | stats | block
+//!
+//! The mark is a nonce no block is sealed under, as its counter is u32::MAX
+//! (see keys::next_nonce), so a framed block is never taken for a plain one.
+//! The stats are sealed with the tag of the block as associated data, so the
+//! host cannot move them to another block. A filter right above the op that
+//! decrypts the blocks registers a predicate on the stats, and a block whose
+//! stats fail it is skipped without being decrypted, see BlockPred. A sampler
+//! there skips the counted blocks it keeps nothing of the same way.
+use std::fmt;
+use std::sync::Arc;
+
+use serde_derive::{Deserialize, Serialize};
+
+use crate::basic::Data;
+use crate::op::{compress, decrypt_bound, enc_writer, Tag};
+use crate::op::keys::{NONCE_LEN, TAG_LEN};
+use crate::utils::random::{CounterRng, GapSampler};
+
+const MARK: [u8; NONCE_LEN] = [0xff; NONCE_LEN];
+const HEADER_LEN: usize = NONCE_LEN + 4;
+
+//the stats of a framed block, and the block
+pub fn split(ct: &[u8]) -> (Option<&[u8]>, &[u8]) {
+    if ct.len() < HEADER_LEN || ct[..NONCE_LEN] != MARK[..] {
+        return (None, ct);
+    }
+    let mut len = [0; 4];
+    len.copy_from_slice(&ct[NONCE_LEN..HEADER_LEN]);
+    let len = u32::from_le_bytes(len) as usize;
+    assert!(ct.len() - HEADER_LEN >= len, "malformed block stats");
+    let (stats, block) = ct[HEADER_LEN..].split_at(len);
+    (Some(stats), block)
+}
+
+//the block itself, with or without stats in front
+#[inline(always)]
+pub fn body(ct: &[u8]) -> &[u8] {
+    split(ct).1
+}
+
+//a predicate on the stats of a block, true unless none of its items can pass
+//the filter that registered it. a sampler above the op that decrypts the
+//blocks registers one too, which skips a counted block none of whose items it
+//keeps and picks the kept items of the others, see sampled
+#[derive(Clone)]
+pub struct BlockPred {
+    stats: Option<Arc<dyn Fn(&[u8]) -> bool + Send + Sync>>,
+    sample: Option<(GapSampler, u64)>,
+}
+
+impl BlockPred {
+    pub fn new<S, P>(may_match: P) -> Self
+    where
+        S: Data,
+        P: Fn(&S) -> bool + Send + Sync + 'static,
+    {
+        BlockPred {
+            stats: Some(Arc::new(move |stats: &[u8]| may_match(&compress::decode::<S>(stats)))),
+            sample: None,
+        }
+    }
+
+    //bernoulli sampling at fraction, the gaps of a block drawn from its tag so
+    //the skip before decryption and the pick after it agree
+    pub fn sampled(fraction: f64) -> Self {
+        BlockPred {
+            stats: None,
+            sample: Some((GapSampler::new(fraction), rand::random::<u64>())),
+        }
+    }
+
+    pub fn is_sampled(&self) -> bool {
+        self.sample.is_some()
+    }
+
+    fn rng_of(key: u64, block: &[u8]) -> CounterRng {
+        let mut tag = [0; 8];
+        if block.len() >= TAG_LEN {
+            tag.copy_from_slice(&block[block.len() - TAG_LEN..block.len() - TAG_LEN + 8]);
+        }
+        CounterRng::new(key ^ u64::from_le_bytes(tag))
+    }
+
+    //blocks without stats always may match. expected_tag is the tag cached for
+    //the block, checked here as the block itself may never be decrypted
+    pub fn may_match(&self, ct: &[u8], expected_tag: Option<&Tag>) -> bool {
+        let (stats, block) = split(ct);
+        if block.len() < TAG_LEN {
+            return true;
+        }
+        let tag = &block[block.len() - TAG_LEN..];
+        if let Some(expected_tag) = expected_tag {
+            assert!(tag == &expected_tag[..], "cached block was replaced");
+        }
+        if let (Some(may_match), Some(stats)) = (&self.stats, stats) {
+            if !may_match(&decrypt_bound(stats, tag)) {
+                return false;
+            }
+        }
+        match (&self.sample, enc_writer::count_items(block)) {
+            (Some((gaps, key)), Some(len)) => gaps.positions(len, Self::rng_of(*key, block)).next().is_some(),
+            _ => true,
+        }
+    }
+
+    //the items of a decrypted block the sampler keeps
+    pub fn pick<T>(&self, ct: &[u8], items: Vec<T>) -> Vec<T> {
+        let (gaps, key) = match &self.sample {
+            Some(sample) => sample,
+            None => return items,
+        };
+        let mut positions = gaps.positions(items.len(), Self::rng_of(*key, body(ct))).peekable();
+        items.into_iter()
+            .enumerate()
+            .filter(|(i, _)| {
+                let kept = positions.peek() == Some(i);
+                if kept {
+                    positions.next();
+                }
+                kept
+            })
+            .map(|(_, item)| item)
+            .collect()
+    }
+}
+
+impl fmt::Debug for BlockPred {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str("BlockPred")
+    }
+}
+
+//min and max of a key over the items of a block, the MinMax the host writes
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct MinMax<K> {
+    pub min: K,
+    pub max: K,
+}
+
+impl<K: PartialOrd> MinMax<K> {
+    pub fn may_contain(&self, key: &K) -> bool {
+        self.min <= *key && *key <= self.max
+    }
+
+    //whether the block may hold keys in [lo, hi]
+    pub fn overlaps(&self, lo: &K, hi: &K) -> bool {
+        self.min <= *hi && *lo <= self.max
+    }
+}
@@ -0,0 +1,239 @@
+//! Values shared with all tasks.
+//!
+//! Broadcast is the small side of a broadcast join, see Pair::broadcast_join.
+//! It is captured by the flat_map that probes it, so it reaches the enclave
+//! as a captured var of that op, copied in once per version (see
+//! load_captured_vars). Only the encrypted blocks of the small side and its
+//! rows that were never encrypted travel. Deserializing them, once per task
+//! when the captured vars are swapped into the closure, decrypts the blocks
+//! and builds the hash table the task probes.
+//!
+//! BroadcastVar is the handle of a value from Context::broadcast on the host.
+//! Closures capture only the handle. The first task of the enclave to read
+//! the value asks the host for it with an OCALL, the host fetches it once per
+//! executor, and the decrypted value stays in BROADCASTS for all later tasks.
+//!
+//! SemiJoinFilter is a KeyFilter of the keys of one side of a join, captured
+//! by the op Pair::join_pruned puts before the shuffle of the other side, to
+//! drop the items whose keys the first side cannot have before they are
+//! bucketed and encrypted. Only its ciphertext travels, it is decrypted once
+//! per task like a Broadcast.
+//!
+//! The host side is framework/src/rdd/broadcast.rs, with the same encoding.
+use std::any::Any;
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::marker::PhantomData;
+use std::sync::{Arc, SgxRwLock as RwLock};
+use std::vec::Vec;
+
+use serde::{Deserialize, Deserializer, Serialize, Serializer};
+use serde_derive::{Deserialize as DeserializeDerive, Serialize as SerializeDerive};
+use sgx_types::*;
+
+use crate::basic::{Data, DeepSizeOf};
+use crate::op::{ocall_get_broadcast, ser_decrypt, ser_decrypt_outside, ItemE, Text};
+
+lazy_static! {
+    //decrypted broadcast values by id
+    static ref BROADCASTS: RwLock<HashMap<u64, Arc<dyn Any + Send + Sync>>> = RwLock::new(HashMap::new());
+}
+
+#[derive(Clone, Default)]
+pub struct Broadcast<K, W> {
+    blocks: Vec<ItemE>,
+    rows: Vec<(K, W)>,
+    table: HashMap<K, Vec<W>>,
+}
+
+impl<K: Data + Eq + Hash, W: Data> Broadcast<K, W> {
+    pub fn new(small: &Text<Vec<(K, W)>, Vec<ItemE>>) -> Self {
+        let blocks = small.data_enc.clone().unwrap_or_default();
+        let rows = small.data.clone().unwrap_or_default();
+        Broadcast::from_parts(blocks, rows)
+    }
+
+    fn from_parts(blocks: Vec<ItemE>, rows: Vec<(K, W)>) -> Self {
+        let mut table: HashMap<K, Vec<W>> = HashMap::new();
+        let decrypted = blocks.iter().flat_map(|block| ser_decrypt::<Vec<(K, W)>>(block));
+        for (k, w) in decrypted.chain(rows.iter().cloned()) {
+            table.entry(k).or_default().push(w);
+        }
+        Broadcast { blocks, rows, table }
+    }
+
+    pub fn get(&self, k: &K) -> &[W] {
+        self.table.get(k).map_or(&[], |ws| ws.as_slice())
+    }
+}
+
+impl<K: Serialize, W: Serialize> Serialize for Broadcast<K, W> {
+    fn serialize<S: Serializer>(&self, serializer: S) -> std::result::Result<S::Ok, S::Error> {
+        (&self.blocks, &self.rows).serialize(serializer)
+    }
+}
+
+impl<'de, K: Data + Eq + Hash, W: Data> Deserialize<'de> for Broadcast<K, W> {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> std::result::Result<Self, D::Error> {
+        let (blocks, rows) = <(Vec<ItemE>, Vec<(K, W)>)>::deserialize(deserializer)?;
+        Ok(Broadcast::from_parts(blocks, rows))
+    }
+}
+
+//bloom filter of keys, see the host side. the default one is empty and rules
+//nothing out
+#[derive(Clone, Debug, DeepSizeOf, SerializeDerive, DeserializeDerive)]
+#[serde(bound = "")]
+pub struct KeyFilter<K> {
+    bits: Vec<u64>,
+    hashes: u32,
+    _marker: PhantomData<K>,
+}
+
+impl<K> Default for KeyFilter<K> {
+    fn default() -> Self {
+        KeyFilter { bits: Vec::new(), hashes: 0, _marker: PhantomData }
+    }
+}
+
+impl<K: Hash> KeyFilter<K> {
+    pub fn new(expected_keys: usize, fpp: f64) -> Self {
+        let n = expected_keys.max(1) as f64;
+        let ln2 = std::f64::consts::LN_2;
+        let m = (-n * fpp.max(f64::MIN_POSITIVE).min(0.5).ln() / (ln2 * ln2)).ceil() as usize;
+        let words = (m.max(64) + 63) / 64;
+        let hashes = ((words * 64) as f64 / n * ln2).round().max(1.0) as u32;
+        KeyFilter { bits: vec![0; words], hashes, _marker: PhantomData }
+    }
+
+    //double hashing of the two halves of one hash
+    fn positions(&self, key: &K) -> impl Iterator<Item = usize> {
+        let mut hasher = DefaultHasher::new();
+        key.hash(&mut hasher);
+        let hash = hasher.finish();
+        let (h1, h2) = (hash as u32 as u64, (hash >> 32) | 1);
+        let m = self.bits.len() as u64 * 64;
+        (0..self.hashes as u64).map(move |i| (h1.wrapping_add(i.wrapping_mul(h2)) % m) as usize)
+    }
+
+    pub fn insert(&mut self, key: &K) {
+        if self.bits.is_empty() {
+            return;
+        }
+        for i in self.positions(key).collect::<Vec<_>>() {
+            self.bits[i / 64] |= 1 << (i % 64);
+        }
+    }
+
+    pub fn union(mut self, other: Self) -> Self {
+        if self.bits.is_empty() {
+            return other;
+        }
+        if !other.bits.is_empty() {
+            assert_eq!(self.bits.len(), other.bits.len(), "filters of different sizes");
+            for (a, b) in self.bits.iter_mut().zip(other.bits) {
+                *a |= b;
+            }
+        }
+        self
+    }
+
+    pub fn may_contain(&self, key: &K) -> bool {
+        self.bits.is_empty() || self.positions(key).all(|i| self.bits[i / 64] & (1 << (i % 64)) != 0)
+    }
+}
+
+#[derive(Clone, Default)]
+pub struct SemiJoinFilter<K> {
+    filter_enc: Option<ItemE>,
+    plain: Option<KeyFilter<K>>,
+    //the decrypted filter, or the plain one
+    filter: Arc<KeyFilter<K>>,
+}
+
+impl<K: Data + Hash> SemiJoinFilter<K> {
+    pub fn new(filter: &Text<KeyFilter<K>, ItemE>) -> Self {
+        SemiJoinFilter::from_parts(filter.data_enc.clone(), filter.data.clone())
+    }
+
+    fn from_parts(filter_enc: Option<ItemE>, plain: Option<KeyFilter<K>>) -> Self {
+        let filter = match (&filter_enc, &plain) {
+            (Some(ct), _) => ser_decrypt::<KeyFilter<K>>(ct),
+            (None, Some(filter)) => filter.clone(),
+            (None, None) => KeyFilter::default(),
+        };
+        SemiJoinFilter { filter_enc, plain, filter: Arc::new(filter) }
+    }
+
+    pub fn may_contain(&self, key: &K) -> bool {
+        self.filter.may_contain(key)
+    }
+}
+
+impl<K> Serialize for SemiJoinFilter<K> {
+    fn serialize<S: Serializer>(&self, serializer: S) -> std::result::Result<S::Ok, S::Error> {
+        (&self.filter_enc, &self.plain).serialize(serializer)
+    }
+}
+
+impl<'de, K: Data + Hash> Deserialize<'de> for SemiJoinFilter<K> {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> std::result::Result<Self, D::Error> {
+        let (filter_enc, plain) = <(Option<ItemE>, Option<KeyFilter<K>>)>::deserialize(deserializer)?;
+        Ok(SemiJoinFilter::from_parts(filter_enc, plain))
+    }
+}
+
+#[derive(SerializeDerive, DeserializeDerive)]
+#[serde(bound = "")]
+pub struct BroadcastVar<T> {
+    id: u64,
+    _marker: PhantomData<T>,
+}
+
+impl<T> Clone for BroadcastVar<T> {
+    fn clone(&self) -> Self {
+        *self
+    }
+}
+
+impl<T> Copy for BroadcastVar<T> {}
+
+impl<T> Default for BroadcastVar<T> {
+    fn default() -> Self {
+        BroadcastVar { id: 0, _marker: PhantomData }
+    }
+}
+
+impl<T: Data> BroadcastVar<T> {
+    pub fn id(&self) -> u64 {
+        self.id
+    }
+
+    pub fn value(&self) -> Arc<T> {
+        assert!(self.id != 0, "broadcast handle used before the host's replaced it");
+        if let Some(value) = BROADCASTS.read().unwrap().get(&self.id) {
+            return value.clone().downcast::<T>().unwrap();
+        }
+        let mut ptr: usize = 0;
+        crate::ALLOCATOR.count_ocall();
+        let sgx_status = unsafe { ocall_get_broadcast(&mut ptr, self.id) };
+        match sgx_status {
+            sgx_status_t::SGX_SUCCESS => {},
+            _ => {
+                panic!("[-] OCALL Enclave Failed {}!", sgx_status.as_str());
+            }
+        }
+        assert!(ptr != 0, "broadcast not found");
+        assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(ptr as *const u8, std::mem::size_of::<ItemE>()), "invalid broadcast");
+        let ct = unsafe { &*(ptr as *const ItemE) };
+        assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(ct.as_ptr(), ct.len()), "invalid broadcast");
+        let value = Arc::new(ser_decrypt_outside::<T>(ct));
+        //another task may have decrypted it meanwhile, keep the first
+        let value = BROADCASTS.write().unwrap()
+            .entry(self.id)
+            .or_insert(value as Arc<dyn Any + Send + Sync>)
+            .clone();
+        value.downcast::<T>().unwrap()
+    }
+}
@@ -0,0 +1,209 @@
+//! Cartesian product of two ops, as a block nested loop.
+//!
+//! Holding both partitions of a pair decrypted would take twice the EPC of
+//! the larger one, and the product of two big partitions pages. Instead the
+//! blocks of the first partition are decrypted into a tile of at most
+//! CARTESIAN_TILE_BYTES by deep size, the blocks of the second are decrypted
+//! one at a time and paired with the whole tile, and the pairs are encrypted
+//! as they come. The second partition is decrypted once per tile, so the tile
+//! is as large as the EPC left to an ECALL allows.
+use crate::dependency::OneToOneDependency;
+use crate::op::*;
+
+//part of the EPC a tile of the first partition may take, in line with the
+//runs ext_merge keeps resident
+pub const CARTESIAN_TILE_BYTES: usize = 32 << 20;
+
+#[derive(Clone)]
+pub struct Cartesian<T, U> 
+where
+    T: Data, 
+    U: Data, 
+{
+    pub(crate) vals: Arc<OpVals>,
+    pub(crate) next_deps: Arc<RwLock<HashMap<(OpId, OpId), Dependency>>>,
+    pub(crate) first: Arc<dyn Op<Item = T>>,
+    pub(crate) second: Arc<dyn Op<Item = U>>,
+    pub(crate) cache_space: Arc<Mutex<HashMap<(usize, usize), Vec<Vec<(T, U)>>>>>,
+}
+
+impl<T, U> Cartesian<T, U> 
+where
+    T: Data, 
+    U: Data, 
+{
+    #[track_caller]
+    pub fn new(first: Arc<dyn Op<Item = T>>, 
+        second: Arc<dyn Op<Item = U>>) -> Self 
+    {
+        let mut vals = OpVals::new(first.get_context(), first.number_of_splits() * second.number_of_splits());
+        let cur_id = vals.id;
+        let first_id = first.get_op_id();
+        let second_id = second.get_op_id();
+             
+        vals.deps
+            .push(Dependency::NarrowDependency(Arc::new(
+                OneToOneDependency::new(first_id, cur_id)
+            )));
+        vals.deps
+            .push(Dependency::NarrowDependency(Arc::new(
+                OneToOneDependency::new(second_id, cur_id)
+            )));
+        first.get_next_deps().write().unwrap().insert(
+            (first_id, cur_id),
+            Dependency::NarrowDependency(
+                Arc::new(OneToOneDependency::new(first_id, cur_id))
+            )
+        );
+        second.get_next_deps().write().unwrap().insert(
+            (second_id, cur_id),
+            Dependency::NarrowDependency(
+                Arc::new(OneToOneDependency::new(second_id, cur_id))
+            )
+        );
+        
+        let vals = Arc::new(vals);
+        Cartesian {
+            vals,
+            next_deps: Arc::new(RwLock::new(HashMap::new())),
+            first,
+            second,
+            cache_space: Arc::new(Mutex::new(HashMap::new()))
+        }
+    }
+
+    pub fn compute_inner(&self, first: &[ItemE], second: &[ItemE]) -> Vec<ItemE> {
+        let mut writer = BlockWriter::new();
+        let mut cur = 0;
+        while cur < first.len() {
+            let mut tile = Vec::new();
+            let mut bytes = 0;
+            while cur < first.len() && (tile.is_empty() || bytes < CARTESIAN_TILE_BYTES) {
+                let block = ser_decrypt_outside::<Vec<T>>(&first[cur]);
+                bytes += block.deep_size_of();
+                tile.extend(block);
+                cur += 1;
+            }
+            for block_enc in second {
+                let block = ser_decrypt_outside::<Vec<U>>(block_enc);
+                for t in &tile {
+                    for u in &block {
+                        writer.push((t.clone(), u.clone()));
+                    }
+                }
+            }
+        }
+        writer.finish()
+    }
+}
+
+impl<T, U> OpBase for Cartesian<T, U> 
+where 
+    T: Data, 
+    U: Data, 
+{
+    fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
+        match dep_info.dep_type() {
+            0 | 2 => self.free_res_enc(res_ptr, is_enc),
+            1 => {
+                let shuf_dep = self.get_next_shuf_dep(dep_info).unwrap();
+                shuf_dep.free_res_enc(res_ptr, is_enc);
+            },
+            _ => panic!("invalid is_shuffle"),
+        }
+    }
+
+    fn fix_split_num(&self, split_num: usize) {
+        self.vals.split_num.store(split_num, atomic::Ordering::SeqCst);
+    }
+
+    fn get_op_id(&self) -> OpId {
+        self.vals.id
+    }
+
+    fn get_context(&self) -> Arc<Context> {
+        self.vals.context.upgrade().unwrap()
+    }
+
+    fn get_deps(&self) -> Vec<Dependency> {
+        self.vals.deps.clone()
+    }
+
+    fn get_next_deps(&self) -> Arc<RwLock<HashMap<(OpId, OpId), Dependency>>> {
+        self.next_deps.clone()
+    }
+    
+    fn number_of_splits(&self) -> usize {
+        self.vals.split_num.load(atomic::Ordering::SeqCst)
+    }
+
+    fn is_in_loop(&self) -> bool {
+        self.vals.in_loop
+    }
+    
+    fn iterator_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8{
+        
+		self.compute_start(call_seq, input, dep_info)
+    }
+    
+    fn randomize_in_place(&self, input: *const u8, seed: Option<u64>, num: u64) -> *mut u8 {
+        self.randomize_in_place_(input, seed, num)
+    }
+
+    fn etake(&self, input: *const u8, should_take: usize, have_take: &mut usize) -> *mut u8 {
+        self.take_(input ,should_take, have_take)
+    }
+
+    fn __to_arc_op(self: Arc<Self>, id: TypeId) -> Option<TraitObject> {
+        if id == TypeId::of::<dyn Op<Item = (T, U)>>() {
+            let x = std::ptr::null::<Self>() as *const dyn Op<Item = (T, U)>;
+            let vtable = unsafe {
+                std::mem::transmute::<_, TraitObject>(x).vtable
+            };
+            let data = Arc::into_raw(self);
+            Some(TraitObject {
+                data: data as *mut (),
+                vtable: vtable,
+            })
+        } else {
+            None
+        }
+    }
+
+}
+
+impl<T, U> Op for Cartesian<T, U> 
+where 
+    T: Data, 
+    U: Data, 
+{
+    type Item = (T, U);  
+    
+    fn get_op(&self) -> Arc<dyn Op<Item = Self::Item>> {
+        Arc::new(self.clone())
+    }
+    
+    fn get_op_base(&self) -> Arc<dyn OpBase> {
+        Arc::new(self.clone()) as Arc<dyn OpBase>
+    }
+
+    fn get_cache_space(&self) -> Arc<Mutex<HashMap<(usize, usize), Vec<Vec<Self::Item>>>>> {
+        self.cache_space.clone()
+    }
+
+    fn compute_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
+        match dep_info.dep_type() {
+            0 => {       //narrow
+                self.narrow(call_seq, input, true)
+            },
+            1 => {       //shuffle write
+                self.shuffle(call_seq, input, dep_info)
+            },
+            2 => {       //pair the two partitions
+                let (first, second) = input.get_enc_data::<(Vec<ItemE>, Vec<ItemE>)>();
+                to_ptr(self.compute_inner(first, second))
+            }
+            _ => panic!("Invalid is_shuffle")
+        }
+    }
+}
@@ -1,5 +1,6 @@
 use std::collections::BTreeSet;
 use std::hash::{Hash, Hasher};
+use std::iter::Peekable;
 
 use crate::aggregator::Aggregator;
 use crate::dependency::{
@@ -47,7 +48,7 @@ W: Data,
              
         if op0
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             deps.push(Dependency::NarrowDependency(
                 Arc::new(OneToOneDependency::new(op0_id, cur_id)) as Arc<dyn NarrowDependencyTrait>,
@@ -79,7 +80,7 @@ W: Data,
 
         if op1
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             deps.push(Dependency::NarrowDependency(
                 Arc::new(OneToOneDependency::new(op1_id, cur_id)) as Arc<dyn NarrowDependencyTrait>,
@@ -123,185 +124,254 @@ W: Data,
     }
 
     pub fn compute_inner(&self, tid: u64, input: Input) -> Vec<ItemE> {
-        fn decrypt_buckets<K: Ord + Data, T: Data>(data_enc: &Vec<Vec<ItemE>>) -> Vec<Vec<(K, T)>> {
-            data_enc.iter().map(|bucket| batch_decrypt(bucket, true)).collect::<Vec<_>>()
-        }
-        fn merge_core<K: Ord + Data, V: Data, W: Data>(a1: Vec<Vec<(K, Vec<V>)>>, b1: Vec<Vec<(K, Vec<W>)>>) -> Vec<(K, (Vec<V>, Vec<W>))> {
-            let mut agg: Vec<(K, (Vec<V>, Vec<W>))> = Vec::new();
-            let mut iter_a = a1.into_iter().kmerge_by(|a, b| a.0 < b.0);
-            let mut iter_b = b1.into_iter().kmerge_by(|a, b| a.0 < b.0);
-
-            let mut cur_a = iter_a.next();
-            let mut cur_b = iter_b.next();
-
-            while cur_a.is_some() || cur_b.is_some() {
-                let should_puta = cur_b.is_none()
-                    || cur_a.is_some() 
-                        &&  cur_a.as_ref().unwrap().0 < cur_b.as_ref().unwrap().0;
-                if should_puta {
-                    let (k, mut v) = cur_a.unwrap();
-                    cur_a = iter_a.next();
-                    if agg.last().map_or(false, |(last_k, _)| last_k == &k) {
-                        let (_, (last_v, _)) = agg.last_mut().unwrap();
-                        last_v.append(&mut v);
-                    } else if agg.last().map_or(false, |(_, (last_v, last_w))| last_v.is_empty() || last_w.is_empty()) {
-                        *agg.last_mut().unwrap() = (k, (v, Vec::new()));
-                    } else {
-                        agg.push((k, (v, Vec::new())));
-                    }
-                } else {
-                    let (k, mut w) = cur_b.unwrap();
-                    cur_b = iter_b.next();
-                    if agg.last().map_or(false, |(last_k, _)| last_k == &k) {
-                        let (_, (_, last_w)) = agg.last_mut().unwrap();
-                        last_w.append(&mut w);
-                    } else if agg.last().map_or(false, |(_, (last_v, last_w))| last_v.is_empty() || last_w.is_empty()) {
-                        *agg.last_mut().unwrap() = (k, (Vec::new(), w));
-                    } else {
-                        agg.push((k, (Vec::new(), w)));
-                    }
-                }
+        //the runs of both sides are read block by block, so a sub-bucket is
+        //never decrypted as a whole
+        fn cogroup_core<K: Ord + Data, V: Data, W: Data>(a1: &[Vec<ItemE>], b1: &[Vec<ItemE>], is_for_join: bool) -> (Vec<ItemE>, usize) {
+            let iter_a = a1.iter().map(|run| ext_merge::RunReader::<K, Vec<V>>::new(run)).kmerge_by(|a, b| a.0 < b.0);
+            let iter_b = b1.iter().map(|run| ext_merge::RunReader::<K, Vec<W>>::new(run)).kmerge_by(|a, b| a.0 < b.0);
+            let mut writer = GroupWriter::new(is_for_join);
+            let mut num_groups = 0;
+            for group in CoGroupIter::new(iter_a, iter_b) {
+                writer.push(group);
+                num_groups += 1;
             }
-            agg
+            (writer.finish(), num_groups)
         }
 
-        let data_enc = input.get_enc_data::<(
-            Vec<Vec<ItemE>>,
-            Vec<Vec<Vec<ItemE>>>, 
-            Vec<Vec<ItemE>>, 
-            Vec<Vec<Vec<ItemE>>>
-        )>();
-
-        let (mut a0, mut a1, mut b0, mut b1): (
-            Vec<Vec<(K, V)>>,
-            Vec<Vec<Vec<(K, Vec<V>)>>>,
-            Vec<Vec<(K, W)>>,
-            Vec<Vec<Vec<(K, Vec<W>)>>>,
-        ) = (
-            decrypt_buckets(&data_enc.0),
-            data_enc.1.iter().map(|buckets| decrypt_buckets(buckets)).collect::<Vec<_>>(),
-            decrypt_buckets(&data_enc.2),
-            data_enc.3.iter().map(|buckets| decrypt_buckets(buckets)).collect::<Vec<_>>(),
-        );
-        assert_eq!(data_enc.1.len(), MAX_THREAD + 1);
-        assert_eq!(data_enc.3.len(), MAX_THREAD + 1);
-
-        //currently only support that both children are shuffle dep
-    
-        let (is_para_mer, agg) = {
-            crate::ALLOCATOR.reset_alloc_cnt();
-            let sample_a1 = a1.pop().unwrap();
-            let sample_b1 = b1.pop().unwrap();
-            let sample_len = sample_a1.iter().map(|v| v.len()).sum::<usize>() 
-                + sample_b1.iter().map(|v| v.len()).sum::<usize>();
-            let agg = merge_core(sample_a1, sample_b1);
-            let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
-            let alloc_cnt_ratio = (alloc_cnt as f64)/(sample_len as f64);
-            println!("for merge, alloc_cnt per len = {:?}", alloc_cnt_ratio);
-            (alloc_cnt_ratio < PARA_THRESHOLD, agg)
+        self.merge_buckets(input, cogroup_core::<K, V, W>)
+    }
+
+    //runs core over the sub-buckets of both sides, pairwise, and concatenates
+    //what it encrypted in the order of the sub-buckets
+    fn merge_buckets(&self, input: Input, core: fn(&[Vec<ItemE>], &[Vec<ItemE>], bool) -> (Vec<ItemE>, usize)) -> Vec<ItemE> {
+        type Enc = (Vec<Vec<ItemE>>, Vec<Vec<Vec<ItemE>>>, Vec<Vec<ItemE>>, Vec<Vec<Vec<ItemE>>>);
+        let data_enc = input.get_enc_data::<Enc>();
+        if !data_enc.0.is_empty() || !data_enc.2.is_empty() {
+            return self.merge_narrow(data_enc, core);
+        }
+        assert_eq!(data_enc.1.len(), max_thread() + 1);
+        assert_eq!(data_enc.3.len(), max_thread() + 1);
+
+        let (is_para_mer, res_enc) = {
+            let probe = planner::Probe::start();
+            let (res_enc, sample_len) = core(&data_enc.1[max_thread()], &data_enc.3[max_thread()], self.is_for_join);
+            let sample = probe.stop(sample_len, 0);
+            let threads = planner::plan(self.get_op_id(), planner::ParaStep::Merge, &sample, max_thread() as f64);
+            (threads > 0, res_enc)
         };
 
-        let mut handlers = Vec::with_capacity(MAX_THREAD);
+        let mut handlers = Vec::with_capacity(max_thread());
         if is_para_mer {
-            for i in 0..MAX_THREAD {
-                let a1 = a1.pop().unwrap();
-                let b1 = b1.pop().unwrap();
-                let builder = thread::Builder::new();
-                let handler = builder
-                    .spawn(move || {
-                        merge_core(a1, b1)
-                    }).unwrap();
+            let tag = self.get_op_id().get_hash();
+            let is_for_join = self.is_for_join;
+            for i in 0..max_thread() {
+                let handler = thread_pool::spawn(move || {
+                    crate::ALLOCATOR.set_profile_tag(tag);
+                    let data_enc = input.get_enc_data::<Enc>();
+                    core(&data_enc.1[i], &data_enc.3[i], is_for_join).0
+                });
                 handlers.push(handler);
             }
-        } 
+        }
 
+        //the sample is the last sub-bucket, its groups go last to keep the
+        //partition in the order of the sub-buckets
         let mut acc = create_enc();
-        for agg in vec![agg].into_iter()
-            .chain(handlers.into_iter().map(|handler| handler.join().unwrap()))
-            .chain(a1.into_iter().zip(b1.into_iter()).map(|(a1, b1)| merge_core(a1, b1))) 
-        {
-            //block reshape
-            let res = if self.is_for_join {
-                let mut len = 0;
-                let agg = agg.split_inclusive(|(k, (v, w))| {
-                        len += v.deep_size_of() * w.deep_size_of();
-                        let res = len > MAX_ENC_BL * MAX_ENC_BL;
-                        len = (!res as usize) * len;
-                        res
-                    }).flat_map(|x| {
-                        let mut x = x.to_vec();
-                        let mut y = x.drain_filter(|(k, (v, w))| v.len() * w.len() > MAX_ENC_BL * 128)
-                            .flat_map(|(k, (v, w))| {
-                                let vlen = v.len();
-                                let wlen = w.len();
-                                {
-                                    if vlen > wlen {
-                                        let chunk_size = (MAX_ENC_BL*128-1)/wlen+1;
-                                        let chunk_num =  (vlen-1)/chunk_size+1;
-                                        let kk = vec![k; chunk_num].into_iter();
-                                        let vv = v.chunks(chunk_size).map(|x| x.to_vec()).collect::<Vec<_>>().into_iter();
-                                        let ww = vec![w; chunk_num].into_iter();
-                                        kk.zip(vv.zip(ww))
-                                    } else {
-                                        let chunk_size = (MAX_ENC_BL*128-1)/vlen+1;
-                                        let chunk_num =  (wlen-1)/chunk_size+1;
-                                        let kk = vec![k; chunk_num].into_iter();
-                                        let ww = w.chunks(chunk_size).map(|x| x.to_vec()).collect::<Vec<_>>().into_iter();
-                                        let vv = vec![v; chunk_num].into_iter();
-                                        kk.zip(vv.zip(ww))
-                                    }
-                                }
-                            }).map(|x| vec![x])
-                            .collect::<Vec<_>>();
-                        y.push(x);
-                        y
-                    }).collect::<Vec<_>>();
-                agg
-            } else {
-                let mut len = 0;
-                let agg = agg.into_iter()
-                    .filter(|(k, (v, w))| v.len() != 0 && w.len() != 0)
-                    .collect::<Vec<_>>()
-                    .split_inclusive(|(k, (v, w))| {
-                        len += v.len() * w.len();
-                        let res = len > MAX_ENC_BL;
-                        len = (!res as usize) * len;
-                        res
-                    }).map(|x| x.to_vec())
-                    .collect::<Vec<_>>();
-                agg
-            };
-            let mut res_enc = create_enc();
-            for res_bl in res {
-                let block_enc = batch_encrypt(&res_bl, true);
-                combine_enc(&mut res_enc, block_enc);
+        if is_para_mer {
+            for handler in handlers {
+                combine_enc(&mut acc, handler.join().unwrap());
+            }
+        } else {
+            for i in 0..max_thread() {
+                let (res_enc, _) = core(&data_enc.1[i], &data_enc.3[i], self.is_for_join);
+                combine_enc(&mut acc, res_enc);
+            }
+        }
+        combine_enc(&mut acc, res_enc);
+        acc
+    }
+
+    //a side already partitioned like self is not shuffled, it comes as the
+    //blocks its op computed for this partition, which are cut into sorted runs
+    //here. only the keys both sides have are kept, so the runs are merged with
+    //each sub-bucket of a shuffled side in turn
+    fn merge_narrow(&self, 
+        data_enc: &(Vec<Vec<ItemE>>, Vec<Vec<Vec<ItemE>>>, Vec<Vec<ItemE>>, Vec<Vec<Vec<ItemE>>>),
+        core: fn(&[Vec<ItemE>], &[Vec<ItemE>], bool) -> (Vec<ItemE>, usize),
+    ) -> Vec<ItemE> {
+        let runs_a = if data_enc.0.is_empty() { Vec::new() } else { narrow_runs::<K, V>(&data_enc.0) };
+        let runs_b = if data_enc.2.is_empty() { Vec::new() } else { narrow_runs::<K, W>(&data_enc.2) };
+        let buckets_a = if data_enc.0.is_empty() {
+            data_enc.1.iter().map(|runs| runs.as_slice()).collect::<Vec<_>>()
+        } else {
+            vec![runs_a.as_slice()]
+        };
+        let buckets_b = if data_enc.2.is_empty() {
+            data_enc.3.iter().map(|runs| runs.as_slice()).collect::<Vec<_>>()
+        } else {
+            vec![runs_b.as_slice()]
+        };
+        let mut acc = create_enc();
+        for a1 in &buckets_a {
+            for b1 in &buckets_b {
+                combine_enc(&mut acc, core(a1, b1, self.is_for_join).0);
             }
-            combine_enc(&mut acc, res_enc);
+        }
+        for run in runs_a.into_iter().chain(runs_b) {
+            free_enc(run);
         }
         acc
     }
 }
 
-impl<K, V, W> OpBase for CoGrouped<K, V, W> 
-where 
-    K: Data + Eq + Hash + Ord,
-    V: Data,
-    W: Data,
+//every block of a partition as a run of its own, sorted and grouped by key
+fn narrow_runs<K: Ord + Data, V: Data>(parts: &[Vec<ItemE>]) -> Vec<Vec<ItemE>> {
+    parts.iter().flatten().map(|block| {
+        let mut items = ser_decrypt_outside::<Vec<(K, V)>>(block);
+        items.sort_by(|a, b| a.0.cmp(&b.0));
+        let mut groups: Vec<(K, Vec<V>)> = Vec::new();
+        for (k, v) in items {
+            match groups.last_mut() {
+                Some((last, vs)) if *last == k => vs.push(v),
+                _ => groups.push((k, vec![v])),
+            }
+        }
+        batch_encrypt(&groups, true)
+    }).collect()
+}
+
+//groups two streams sorted by key, yielding only the keys both have
+struct CoGroupIter<K, V, W, IA, IB>
+where
+    IA: Iterator<Item = (K, Vec<V>)>,
+    IB: Iterator<Item = (K, Vec<W>)>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
+    iter_a: Peekable<IA>,
+    iter_b: Peekable<IB>,
+}
+
+impl<K, V, W, IA, IB> CoGroupIter<K, V, W, IA, IB>
+where
+    K: Ord + Clone,
+    IA: Iterator<Item = (K, Vec<V>)>,
+    IB: Iterator<Item = (K, Vec<W>)>,
+{
+    fn new(iter_a: IA, iter_b: IB) -> Self {
+        CoGroupIter {
+            iter_a: iter_a.peekable(),
+            iter_b: iter_b.peekable(),
         }
     }
+}
 
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }   
+impl<K, V, W, IA, IB> Iterator for CoGroupIter<K, V, W, IA, IB>
+where
+    K: Ord + Clone,
+    IA: Iterator<Item = (K, Vec<V>)>,
+    IB: Iterator<Item = (K, Vec<W>)>,
+{
+    type Item = (K, (Vec<V>, Vec<W>));
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            let (k, has_a, has_b) = match (self.iter_a.peek(), self.iter_b.peek()) {
+                (Some((ka, _)), Some((kb, _))) if ka == kb => (ka.clone(), true, true),
+                (Some((ka, _)), Some((kb, _))) if ka < kb => (ka.clone(), true, false),
+                (_, Some((kb, _))) => (kb.clone(), false, true),
+                (Some((ka, _)), None) => (ka.clone(), true, false),
+                (None, None) => return None,
+            };
+            let mut v = Vec::new();
+            while let Some((_, mut vs)) = self.iter_a.next_if(|(ka, _)| ka == &k) {
+                v.append(&mut vs);
+            }
+            let mut w = Vec::new();
+            while let Some((_, mut ws)) = self.iter_b.next_if(|(kb, _)| kb == &k) {
+                w.append(&mut ws);
+            }
+            if has_a && has_b {
+                return Some((k, (v, w)));
+            }
+        }
     }
+}
 
+//cuts the groups into encryption blocks as they come. a join block holds about
+//max_enc_bl^2 of the cross product by deep size, and a group whose cross
+//product is larger than max_enc_bl * 128 pairs is split over blocks of its
+//own. a cogroup block holds about max_enc_bl pairs of the cross product
+struct GroupWriter<K, V, W> {
+    is_for_join: bool,
+    out: Vec<ItemE>,
+    buf: Vec<(K, (Vec<V>, Vec<W>))>,
+    len: usize,
+}
+
+impl<K: Data, V: Data, W: Data> GroupWriter<K, V, W> {
+    fn new(is_for_join: bool) -> Self {
+        GroupWriter {
+            is_for_join,
+            out: create_enc(),
+            buf: Vec::new(),
+            len: 0,
+        }
+    }
+
+    fn push(&mut self, group: (K, (Vec<V>, Vec<W>))) {
+        let (k, (v, w)) = group;
+        let (vlen, wlen) = (v.len(), w.len());
+        if self.is_for_join && vlen * wlen > max_enc_bl() * 128 {
+            if vlen > wlen {
+                let chunk_size = (max_enc_bl()*128-1)/wlen+1;
+                for vv in v.chunks(chunk_size) {
+                    self.encrypt(&[(k.clone(), (vv.to_vec(), w.clone()))]);
+                }
+            } else {
+                let chunk_size = (max_enc_bl()*128-1)/vlen+1;
+                for ww in w.chunks(chunk_size) {
+                    self.encrypt(&[(k.clone(), (v.clone(), ww.to_vec()))]);
+                }
+            }
+            return;
+        }
+        let limit = if self.is_for_join {
+            self.len += v.deep_size_of() * w.deep_size_of();
+            max_enc_bl() * max_enc_bl()
+        } else {
+            self.len += vlen * wlen;
+            max_enc_bl()
+        };
+        self.buf.push((k, (v, w)));
+        if self.len > limit {
+            self.flush();
+        }
+    }
+
+    fn encrypt(&mut self, block: &[(K, (Vec<V>, Vec<W>))]) {
+        let block_enc = batch_encrypt(block, true);
+        combine_enc(&mut self.out, block_enc);
+    }
+
+    fn flush(&mut self) {
+        if !self.buf.is_empty() {
+            let buf = std::mem::take(&mut self.buf);
+            self.encrypt(&buf);
+        }
+        self.len = 0;
+    }
+
+    fn finish(mut self) -> Vec<ItemE> {
+        self.flush();
+        self.out
+    }
+}
+
+impl<K, V, W> OpBase for CoGrouped<K, V, W> 
+where 
+    K: Data + Eq + Hash + Ord,
+    V: Data,
+    W: Data,
+{
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 | 2 => self.free_res_enc(res_ptr, is_enc),
@@ -412,4 +482,195 @@ where
             _ => panic!("Invalid is_shuffle")
         }
     }
-}
\ No newline at end of file
+}
+//the join of two pair ops straight from the sorted runs of the cogroup, with
+//no group of the left side and no cogroup block in between. for each key
+//only the values of the right side are held, the left side is streamed
+//against them and the pairs are cut into encryption blocks as they come, so
+//a skewed key spreads over as many blocks as its cross product needs
+#[derive(Clone)]
+pub struct MergeJoined<K, V, W>
+where
+    K: Data + Eq + Hash + Ord,
+    V: Data,
+    W: Data,
+{
+    pub(crate) cogrouped: CoGrouped<K, V, W>,
+    pub(crate) cache_space: Arc<Mutex<HashMap<(usize, usize), Vec<Vec<(K, (V, W))>>>>>
+}
+
+impl<K, V, W> MergeJoined<K, V, W>
+where
+    K: Data + Eq + Hash + Ord,
+    V: Data,
+    W: Data,
+{
+    #[track_caller]
+    pub fn new(op0: Arc<dyn Op<Item = (K, V)>>,
+               op1: Arc<dyn Op<Item = (K, W)>>,
+               part: Box<dyn Partitioner>) -> Self 
+    {
+        MergeJoined {
+            cogrouped: CoGrouped::new(op0, op1, part),
+            cache_space: Arc::new(Mutex::new(HashMap::new()))
+        }
+    }
+
+    pub fn compute_inner(&self, tid: u64, input: Input) -> Vec<ItemE> {
+        fn join_core<K: Ord + Data, V: Data, W: Data>(a1: &[Vec<ItemE>], b1: &[Vec<ItemE>], _is_for_join: bool) -> (Vec<ItemE>, usize) {
+            let mut iter_a = a1.iter().map(|run| ext_merge::RunReader::<K, Vec<V>>::new(run)).kmerge_by(|a, b| a.0 < b.0).peekable();
+            let mut iter_b = b1.iter().map(|run| ext_merge::RunReader::<K, Vec<W>>::new(run)).kmerge_by(|a, b| a.0 < b.0).peekable();
+            let mut writer = BlockWriter::new();
+            let mut num_keys = 0;
+            loop {
+                let ord = match (iter_a.peek(), iter_b.peek()) {
+                    (Some((ka, _)), Some((kb, _))) => ka.cmp(kb),
+                    _ => break,
+                };
+                match ord {
+                    Ordering::Less => {
+                        iter_a.next();
+                    },
+                    Ordering::Greater => {
+                        iter_b.next();
+                    },
+                    Ordering::Equal => {
+                        let k = iter_b.peek().unwrap().0.clone();
+                        let mut ws = Vec::new();
+                        while let Some((_, mut w)) = iter_b.next_if(|(kb, _)| kb == &k) {
+                            ws.append(&mut w);
+                        }
+                        while let Some((_, vs)) = iter_a.next_if(|(ka, _)| ka == &k) {
+                            for v in vs {
+                                for w in &ws {
+                                    writer.push((k.clone(), (v.clone(), w.clone())));
+                                }
+                            }
+                        }
+                        num_keys += 1;
+                    },
+                }
+            }
+            (writer.finish(), num_keys)
+        }
+
+        self.cogrouped.merge_buckets(input, join_core::<K, V, W>)
+    }
+}
+
+impl<K, V, W> OpBase for MergeJoined<K, V, W> 
+where 
+    K: Data + Eq + Hash + Ord,
+    V: Data,
+    W: Data,
+{
+    fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
+        match dep_info.dep_type() {
+            0 | 2 => self.free_res_enc(res_ptr, is_enc),
+            1 => {
+                let shuf_dep = self.get_next_shuf_dep(dep_info).unwrap();
+                shuf_dep.free_res_enc(res_ptr, is_enc);
+            },
+            _ => panic!("invalid is_shuffle"),
+        }
+    }
+
+    fn fix_split_num(&self, split_num: usize) {
+        self.cogrouped.fix_split_num(split_num)
+    }
+
+    fn get_op_id(&self) -> OpId {
+        self.cogrouped.get_op_id()
+    }
+
+    fn get_context(&self) -> Arc<Context> {
+        self.cogrouped.get_context()
+    }
+
+    fn get_deps(&self) -> Vec<Dependency> {
+        self.cogrouped.get_deps()
+    }
+
+    fn get_next_deps(&self) -> Arc<RwLock<HashMap<(OpId, OpId), Dependency>>> {
+        self.cogrouped.get_next_deps()
+    }
+    
+    fn number_of_splits(&self) -> usize {
+        self.cogrouped.number_of_splits()
+    }
+
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.cogrouped.partitioner()
+    }
+
+    fn is_in_loop(&self) -> bool {
+        self.cogrouped.is_in_loop()
+    }
+    
+    fn iterator_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8{
+        
+		self.compute_start(call_seq, input, dep_info)
+    }
+    
+    fn randomize_in_place(&self, input: *const u8, seed: Option<u64>, num: u64) -> *mut u8 {
+        self.randomize_in_place_(input, seed, num)
+    }
+
+    fn etake(&self, input: *const u8, should_take: usize, have_take: &mut usize) -> *mut u8 {
+        self.take_(input ,should_take, have_take)
+    }
+
+    fn __to_arc_op(self: Arc<Self>, id: TypeId) -> Option<TraitObject> {
+        if id == TypeId::of::<dyn Op<Item = (K, (V, W))>>() {
+            let x = std::ptr::null::<Self>() as *const dyn Op<Item = (K, (V, W))>;
+            let vtable = unsafe {
+                std::mem::transmute::<_, TraitObject>(x).vtable
+            };
+            let data = Arc::into_raw(self);
+            Some(TraitObject {
+                data: data as *mut (),
+                vtable: vtable,
+            })
+        } else {
+            None
+        }
+    }
+
+}
+
+impl<K, V, W> Op for MergeJoined<K, V, W>
+where 
+    K: Data + Eq + Hash + Ord,
+    V: Data,
+    W: Data,
+{
+    type Item = (K, (V, W));  
+    
+    fn get_op(&self) -> Arc<dyn Op<Item = Self::Item>> {
+        Arc::new(self.clone())
+    }
+    
+    fn get_op_base(&self) -> Arc<dyn OpBase> {
+        Arc::new(self.clone()) as Arc<dyn OpBase>
+    }
+
+    fn get_cache_space(&self) -> Arc<Mutex<HashMap<(usize, usize), Vec<Vec<Self::Item>>>>> {
+        self.cache_space.clone()
+    }
+
+    fn compute_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
+        match dep_info.dep_type() {
+            0 => {       //narrow
+                self.narrow(call_seq, input, true)
+            },
+            1 => {       //shuffle write
+                self.shuffle(call_seq, input, dep_info)
+            },
+            2 => {       //shuffle read
+                let res = self.compute_inner(call_seq.tid, input);
+                to_ptr(res)
+            }
+            _ => panic!("Invalid is_shuffle")
+        }
+    }
+}
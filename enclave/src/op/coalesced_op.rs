@@ -0,0 +1,183 @@
+//! Coalesce without a shuffle, the CoalescedRdd of the host.
+//!
+//! A coalesced partition is its parent partitions back to back, so the op
+//! changes no item: the host runs the ops above it once per parent partition
+//! and hands the results on one after another. A parent at the head passes its
+//! blocks through without being decrypted, see forward_head_blocks.
+use crate::op::*;
+
+pub struct Coalesced<T: Data>
+{
+    vals: Arc<OpVals>,
+    next_deps: Arc<RwLock<HashMap<(OpId, OpId), Dependency>>>,
+    prev: Arc<dyn Op<Item = T>>,
+    cache_space: Arc<Mutex<HashMap<(usize, usize), Vec<Vec<T>>>>>,
+}
+
+impl<T: Data> Clone for Coalesced<T>
+{
+    fn clone(&self) -> Self {
+        Coalesced {
+            vals: self.vals.clone(),
+            next_deps: self.next_deps.clone(),
+            prev: self.prev.clone(),
+            cache_space: self.cache_space.clone(),
+        }
+    }
+}
+
+impl<T: Data> Coalesced<T>
+{
+    #[track_caller]
+    pub(crate) fn new(prev: Arc<dyn Op<Item = T>>, max_partitions: usize) -> Self {
+        //the host never makes more partitions than the parent has
+        let split_num = std::cmp::min(max_partitions, prev.number_of_splits());
+        let mut vals = OpVals::new(prev.get_context(), split_num);
+        let cur_id = vals.id;
+        let prev_id = prev.get_op_id();
+        vals.deps
+            .push(Dependency::NarrowDependency(Arc::new(
+                OneToOneDependency::new(prev_id, cur_id)
+            )));
+        let vals = Arc::new(vals);
+        prev.get_next_deps().write().unwrap().insert(
+            (prev_id, cur_id),
+            Dependency::NarrowDependency(
+                Arc::new(OneToOneDependency::new(prev_id, cur_id))
+            )
+        );
+        Coalesced {
+            vals,
+            next_deps: Arc::new(RwLock::new(HashMap::new())),
+            prev,
+            cache_space: Arc::new(Mutex::new(HashMap::new())),
+        }
+    }
+}
+
+impl<T: Data> OpBase for Coalesced<T>
+{
+    fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
+        match dep_info.dep_type() {
+            0 => self.free_res_enc(res_ptr, is_enc),
+            1 => {
+                let shuf_dep = self.get_next_shuf_dep(dep_info).unwrap();
+                shuf_dep.free_res_enc(res_ptr, is_enc);
+            },
+            _ => panic!("invalid is_shuffle"),
+        }
+    }
+
+    fn fix_split_num(&self, split_num: usize) {
+        self.vals.split_num.store(split_num, atomic::Ordering::SeqCst);
+    }
+
+    fn get_op_id(&self) -> OpId {
+        self.vals.id
+    }
+
+    fn get_context(&self) -> Arc<Context> {
+        self.vals.context.upgrade().unwrap()
+    }
+
+    fn get_deps(&self) -> Vec<Dependency> {
+        self.vals.deps.clone()
+    }
+
+    fn get_next_deps(&self) -> Arc<RwLock<HashMap<(OpId, OpId), Dependency>>> {
+        self.next_deps.clone()
+    }
+
+    fn is_in_loop(&self) -> bool {
+        self.vals.in_loop
+    }
+
+    fn number_of_splits(&self) -> usize {
+        self.vals.split_num.load(atomic::Ordering::SeqCst)
+    }
+
+    fn iterator_start(&self, call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
+        self.compute_start(call_seq, input, dep_info)
+    }
+
+    fn randomize_in_place(&self, input: *const u8, seed: Option<u64>, num: u64) -> *mut u8 {
+        self.randomize_in_place_(input, seed, num)
+    }
+
+    fn etake(&self, input: *const u8, should_take: usize, have_take: &mut usize) -> *mut u8 {
+        self.take_(input ,should_take, have_take)
+    }
+
+    fn __to_arc_op(self: Arc<Self>, id: TypeId) -> Option<TraitObject> {
+        if id == TypeId::of::<dyn Op<Item = T>>() {
+            let x = std::ptr::null::<Self>() as *const dyn Op<Item = T>;
+            let vtable = unsafe {
+                std::mem::transmute::<_, TraitObject>(x).vtable
+            };
+            let data = Arc::into_raw(self);
+            Some(TraitObject {
+                data: data as *mut (),
+                vtable: vtable,
+            })
+        } else {
+            None
+        }
+    }
+}
+
+impl<T: Data> Op for Coalesced<T>
+{
+    type Item = T;
+
+    fn get_op(&self) -> Arc<dyn Op<Item = Self::Item>> {
+        Arc::new(self.clone())
+    }
+
+    fn get_op_base(&self) -> Arc<dyn OpBase> {
+        Arc::new(self.clone()) as Arc<dyn OpBase>
+    }
+
+    fn get_cache_space(&self) -> Arc<Mutex<HashMap<(usize, usize), Vec<Vec<Self::Item>>>>> {
+        self.cache_space.clone()
+    }
+
+    fn compute_start(&self, call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
+        match dep_info.dep_type() {
+            0 => {
+                match forward_head_blocks::<T>(&call_seq, &input) {
+                    Some(res_ptr) => res_ptr,
+                    None => self.narrow(call_seq, input, true),
+                }
+            },
+            1 => {
+                self.shuffle(call_seq, input, dep_info)
+            },
+            _ => panic!("Invalid is_shuffle"),
+        }
+    }
+
+    fn compute(&self, call_seq: &mut NextOpId, input: Input) -> ResIter<Self::Item> {
+        let data_ptr = input.data;
+        let have_cache = call_seq.have_cache();
+        let need_cache = call_seq.need_cache();
+        let is_caching_final_rdd = call_seq.is_caching_final_rdd();
+
+        if have_cache {
+            assert_eq!(data_ptr as usize, 0 as usize);
+            return self.get_and_remove_cached_data(call_seq);
+        }
+
+        let opb = call_seq.get_next_op().clone();
+        let op = opb.to_arc_op::<dyn Op<Item = T>>().unwrap();
+        let res_iter = op.compute(call_seq, input);
+
+        if need_cache {
+            return self.set_cached_data(
+                call_seq,
+                res_iter,
+                is_caching_final_rdd,
+            )
+        }
+        res_iter
+    }
+}
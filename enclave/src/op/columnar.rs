@@ -0,0 +1,179 @@
+//! Columnar layout of encryption blocks, enabled with the `columnar` feature.
+//!
+//! A block of rows that are primitives or tuples of up to four primitives
+//! (`Row`) is laid out as the row count followed by one contiguous
+//! little-endian array per field, instead of bincode's row after row. A block
+//! of a single primitive is encoded and decoded with one copy, a block of
+//! tuples with one pass per column. Every other type keeps the bincode
+//! encoding, so the choice is made per type at compile time and blocks carry no
+//! marker.
+//!
+//! The host encodes its blocks in the same way (framework/src/rdd/columnar.rs),
+//! so the enclave and the host must be built with the same features.
+use std::convert::TryInto;
+use std::io::{self, Write};
+use std::mem::size_of;
+use std::ptr;
+use std::slice;
+use std::vec::Vec;
+
+use serde::{de::DeserializeOwned, Serialize};
+
+const COUNT_LEN: usize = 8;
+//fields of tuple rows are gathered into this much stack before they are written
+const GATHER_LEN: usize = 4096;
+
+//a field of a columnar row
+pub trait Prim: Copy + Default + Serialize + DeserializeOwned + 'static {
+    fn put(self, out: &mut [u8]);
+    fn get(bytes: &[u8]) -> Self;
+}
+
+pub trait Row: Copy + Serialize + DeserializeOwned + 'static {
+    const ROW_BYTES: usize;
+    fn write_columns<W: Write>(rows: &[Self], w: &mut W) -> io::Result<()>;
+    //cols holds exactly n rows
+    fn read_columns(cols: &[u8], n: usize) -> Vec<Self>;
+}
+
+macro_rules! impl_prim {
+    ($($t:ty),*) => {$(
+        impl Prim for $t {
+            #[inline(always)]
+            fn put(self, out: &mut [u8]) {
+                out.copy_from_slice(&self.to_le_bytes());
+            }
+
+            #[inline(always)]
+            fn get(bytes: &[u8]) -> Self {
+                <$t>::from_le_bytes(bytes.try_into().unwrap())
+            }
+        }
+
+        //the enclave is always little-endian, so a column of primitives is
+        //the memory of the slice as it is
+        impl Row for $t {
+            const ROW_BYTES: usize = size_of::<$t>();
+
+            fn write_columns<W: Write>(rows: &[Self], w: &mut W) -> io::Result<()> {
+                let bytes = unsafe {
+                    slice::from_raw_parts(rows.as_ptr() as *const u8, rows.len() * Self::ROW_BYTES)
+                };
+                w.write_all(bytes)
+            }
+
+            fn read_columns(cols: &[u8], n: usize) -> Vec<Self> {
+                let mut rows = Vec::<$t>::with_capacity(n);
+                unsafe {
+                    ptr::copy_nonoverlapping(cols.as_ptr(), rows.as_mut_ptr() as *mut u8, n * Self::ROW_BYTES);
+                    rows.set_len(n);
+                }
+                rows
+            }
+        }
+    )*};
+}
+
+impl_prim!(u8, u16, u32, u64, i8, i16, i32, i64, f32, f64);
+
+fn write_field<R, P: Prim, W: Write>(rows: &[R], field: impl Fn(&R) -> P, w: &mut W) -> io::Result<()> {
+    let width = size_of::<P>();
+    let mut buf = [0u8; GATHER_LEN];
+    for chunk in rows.chunks(GATHER_LEN / width) {
+        for (row, out) in chunk.iter().zip(buf.chunks_exact_mut(width)) {
+            field(row).put(out);
+        }
+        w.write_all(&buf[..chunk.len() * width])?;
+    }
+    Ok(())
+}
+
+fn take<'a>(rest: &mut &'a [u8], len: usize) -> &'a [u8] {
+    let (col, tail) = rest.split_at(len);
+    *rest = tail;
+    col
+}
+
+macro_rules! impl_row_tuple {
+    ($(($($t:ident $i:tt),+)),*) => {$(
+        impl<$($t: Prim),+> Row for ($($t,)+) {
+            const ROW_BYTES: usize = 0 $(+ size_of::<$t>())+;
+
+            fn write_columns<W: Write>(rows: &[Self], w: &mut W) -> io::Result<()> {
+                $(write_field(rows, |row| row.$i, w)?;)+
+                Ok(())
+            }
+
+            fn read_columns(cols: &[u8], n: usize) -> Vec<Self> {
+                let mut rest = cols;
+                let cols = ($(take(&mut rest, n * size_of::<$t>()),)+);
+                (0..n)
+                    .map(|k| ($($t::get(&cols.$i[k * size_of::<$t>()..(k + 1) * size_of::<$t>()]),)+))
+                    .collect()
+            }
+        }
+    )*};
+}
+
+impl_row_tuple!((A 0, B 1), (A 0, B 1, C 2), (A 0, B 1, C 2, D 3));
+
+//how a plaintext block is turned into bytes before it is encrypted
+pub trait BlockCodec {
+    fn encoded_size(&self) -> usize;
+    fn encode_to<W: Write>(&self, w: &mut W);
+}
+
+impl<T: ?Sized + Serialize> BlockCodec for T {
+    default fn encoded_size(&self) -> usize {
+        bincode::serialized_size(self).unwrap() as usize
+    }
+
+    default fn encode_to<W: Write>(&self, w: &mut W) {
+        bincode::serialize_into(w, self).unwrap();
+    }
+}
+
+#[cfg(feature = "columnar")]
+impl<R: Row> BlockCodec for [R] {
+    fn encoded_size(&self) -> usize {
+        COUNT_LEN + self.len() * R::ROW_BYTES
+    }
+
+    fn encode_to<W: Write>(&self, w: &mut W) {
+        w.write_all(&(self.len() as u64).to_le_bytes()).unwrap();
+        R::write_columns(self, w).unwrap();
+    }
+}
+
+#[cfg(feature = "columnar")]
+impl<R: Row> BlockCodec for Vec<R> {
+    fn encoded_size(&self) -> usize {
+        self.as_slice().encoded_size()
+    }
+
+    fn encode_to<W: Write>(&self, w: &mut W) {
+        self.as_slice().encode_to(w)
+    }
+}
+
+//the reverse of BlockCodec, after decryption
+pub trait BlockDecode: Sized {
+    fn decode(bytes: &[u8]) -> Self;
+}
+
+impl<T: DeserializeOwned> BlockDecode for T {
+    default fn decode(bytes: &[u8]) -> Self {
+        bincode::deserialize(bytes).unwrap()
+    }
+}
+
+#[cfg(feature = "columnar")]
+impl<R: Row> BlockDecode for Vec<R> {
+    fn decode(bytes: &[u8]) -> Self {
+        assert!(bytes.len() >= COUNT_LEN, "invalid columnar block");
+        let (count, cols) = bytes.split_at(COUNT_LEN);
+        let n = u64::from_le_bytes(count.try_into().unwrap()) as usize;
+        assert!(cols.len() == n * R::ROW_BYTES, "invalid columnar block");
+        R::read_columns(cols, n)
+    }
+}
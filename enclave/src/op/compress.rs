@@ -0,0 +1,85 @@
+//! LZ4 compression of encryption blocks, enabled with the `compress` feature.
+//!
+//! With the feature, the plaintext of a block is a 5 byte header, the codec and
+//! the length of the block's BlockCodec encoding as a little-endian u32,
+//! followed by that encoding compressed with LZ4, or stored as it is when it
+//! does not shrink. The header is part of the plaintext, so it is encrypted and
+//! authenticated with the block. bincode of string-heavy rows shrinks a few
+//! times, which the outside memory, the shuffle store and the network all see.
+//!
+//! The host compresses its blocks in the same way (framework/src/rdd/compress.rs),
+//! so the enclave and the host must be built with the same features.
+use std::io::Write;
+#[cfg(feature = "compress")]
+use std::vec::Vec;
+
+use serde::{de::DeserializeOwned, Serialize};
+
+use crate::op::columnar::{BlockCodec, BlockDecode};
+
+#[cfg(feature = "compress")]
+const HEADER_LEN: usize = 5;
+#[cfg(feature = "compress")]
+const STORED: u8 = 0;
+#[cfg(feature = "compress")]
+const LZ4: u8 = 1;
+
+//room to reserve for the plaintext of pt, exact without compression and an
+//upper bound with it
+#[cfg(not(feature = "compress"))]
+#[inline(always)]
+pub fn encoded_size<T: ?Sized + Serialize>(pt: &T) -> usize {
+    pt.encoded_size()
+}
+
+#[cfg(not(feature = "compress"))]
+#[inline(always)]
+pub fn encode_to<T: ?Sized + Serialize, W: Write>(pt: &T, w: &mut W) {
+    pt.encode_to(w)
+}
+
+#[cfg(not(feature = "compress"))]
+#[inline(always)]
+pub fn decode<T: DeserializeOwned>(bytes: &[u8]) -> T {
+    T::decode(bytes)
+}
+
+#[cfg(feature = "compress")]
+pub fn encoded_size<T: ?Sized + Serialize>(pt: &T) -> usize {
+    HEADER_LEN + pt.encoded_size()
+}
+
+//the encoding and its compressed copy are temporaries inside enclave, only
+//what is written to w may leave it
+#[cfg(feature = "compress")]
+pub fn encode_to<T: ?Sized + Serialize, W: Write>(pt: &T, w: &mut W) {
+    let mut raw = Vec::with_capacity(pt.encoded_size());
+    pt.encode_to(&mut raw);
+    assert!(raw.len() <= u32::MAX as usize, "block too large to compress");
+    let compressed = lz4_flex::block::compress(&raw);
+    let (codec, body) = if compressed.len() < raw.len() {
+        (LZ4, &compressed)
+    } else {
+        (STORED, &raw)
+    };
+    w.write_all(&[codec]).unwrap();
+    w.write_all(&(raw.len() as u32).to_le_bytes()).unwrap();
+    w.write_all(body).unwrap();
+}
+
+#[cfg(feature = "compress")]
+pub fn decode<T: DeserializeOwned>(bytes: &[u8]) -> T {
+    assert!(bytes.len() >= HEADER_LEN, "invalid compressed block");
+    let mut len = [0; 4];
+    len.copy_from_slice(&bytes[1..HEADER_LEN]);
+    let len = u32::from_le_bytes(len) as usize;
+    let body = &bytes[HEADER_LEN..];
+    match bytes[0] {
+        STORED => T::decode(body),
+        LZ4 => {
+            let raw = lz4_flex::block::decompress(body, len).expect("invalid compressed block");
+            T::decode(&raw)
+        }
+        _ => panic!("invalid compressed block"),
+    }
+}
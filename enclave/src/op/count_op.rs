@@ -45,27 +45,12 @@ impl<T> OpBase for Count<T>
 where
     T: Data, 
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            4 => self.step0_of_clone(p_buf, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            4 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             4 => {
-                crate::ALLOCATOR.set_switch(true);
+                let _outside = crate::ALLOCATOR.outside();
                 let res = unsafe { Box::from_raw(res_ptr as *mut Vec<u64>) };
                 drop(res);
-                crate::ALLOCATOR.set_switch(false);
             },
             _ => unreachable!(),
         };
@@ -107,11 +92,11 @@ where
             unreachable!()
         } else if dep_info.dep_type() == 4 {
             let data_enc = input.get_enc_data::<Vec<ItemE>>();
-            let len = data_enc.len();
+            //counted blocks are only authenticated, the others decrypted
             let mut count = 0;
-            for i in 0..len {
-                let block = ser_decrypt::<Vec<T>>(&data_enc[i].clone());
-                count += block.len(); 
+            for block_enc in data_enc {
+                count += count_items(block_enc)
+                    .unwrap_or_else(|| ser_decrypt_outside::<Vec<T>>(block_enc).len());
             }
             let res = vec![count as u64];
             res_enc_to_ptr(res)
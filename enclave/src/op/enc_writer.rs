@@ -0,0 +1,309 @@
+//! AES-GCM encryption fused with serialization.
+//!
+//! A block is encoded into an `EncWriter`, which stages the plaintext
+//! in a small buffer inside the enclave, encrypts each full stage with
+//! AES-CTR, folds the ciphertext into GHASH and appends it to one outside
+//! buffer sized up front with encoded_size. The plaintext block is never
+//! materialized as a whole, unless it is compressed first (see compress.rs),
+//! and the ciphertext is written exactly once.
+//!
+//! The output is the same nonce || ciphertext || tag that encrypt produces
+//! (see keys.rs), so decrypt on either side reads it as is. The plaintext is
+//! laid out by BlockCodec (see columnar.rs), which is bincode for most types.
+//!
+//! decrypt_untrusted_into is the reverse for ciphertext in outside memory: it
+//! copies a stage at a time into a trusted buffer and authenticates and
+//! decrypts it there while it is still in cache.
+//!
+//! The blocks of items batch_encrypt writes are counted: the number of items
+//! is put in front of the block and sealed as its associated data,
+//!
+//!   COUNT_MARK | count: u64 | nonce || ciphertext || tag
+//!
+//! so count_items learns it by checking the tag alone, without running the
+//! keystream or decoding a single item.
+use std::io;
+
+use aes_gcm::aead::generic_array::{
+    typenum::{U16, U8},
+    GenericArray,
+};
+use aes_gcm::aes::{Aes128, BlockCipher, NewBlockCipher};
+use ghash::{
+    universal_hash::{NewUniversalHash, UniversalHash},
+    GHash,
+};
+
+use crate::basic::Data;
+use crate::op::{block_stats, compress};
+use crate::op::{create_enc_with_capacity, keys, ItemE};
+use crate::op::keys::{NONCE_LEN, TAG_LEN};
+
+type Block = GenericArray<u8, U16>;
+type Aad = Option<[u8; COUNT_LEN]>;
+type ParBlocks = GenericArray<Block, U8>;
+
+//multiple of the 8 AES blocks AES-NI works on at once
+const STAGE_SIZE: usize = 4096;
+//a nonce no block is sealed under, as its counter is u32::MAX (see
+//keys::next_nonce), told apart from the mark of block_stats by its stream
+pub const COUNT_MARK: [u8; NONCE_LEN] = [b'c', b'o', b'u', b'n', b't', 0, 0, 0, 0xff, 0xff, 0xff, 0xff];
+const COUNT_LEN: usize = 8;
+const COUNT_HEADER_LEN: usize = NONCE_LEN + COUNT_LEN;
+
+struct Gcm {
+    cipher: Aes128,
+    //GHASH key, E_K(0)
+    h: Block,
+}
+
+thread_local! {
+    static GCM: Gcm = {
+        let cipher = Aes128::new(GenericArray::from_slice(&keys::job_key()));
+        let mut h = Block::default();
+        cipher.encrypt_block(&mut h);
+        Gcm { cipher, h }
+    };
+}
+
+fn counter_block(nonce: &[u8; NONCE_LEN], ctr: u32) -> Block {
+    let mut block = Block::default();
+    block[..12].copy_from_slice(nonce);
+    block[12..].copy_from_slice(&ctr.to_be_bytes());
+    block
+}
+
+//AES-CTR over buf, ctr is the counter of the next keystream block
+fn apply_keystream(cipher: &Aes128, nonce: &[u8; NONCE_LEN], ctr: &mut u32, buf: &mut [u8]) {
+    for chunk in buf.chunks_mut(16 * 8) {
+        let n = (chunk.len() + 15) / 16;
+        let mut blocks = ParBlocks::default();
+        for block in blocks.iter_mut().take(n) {
+            *block = counter_block(nonce, *ctr);
+            *ctr = ctr.wrapping_add(1);
+        }
+        if n == 8 {
+            cipher.encrypt_blocks(&mut blocks);
+        } else {
+            for block in blocks.iter_mut().take(n) {
+                cipher.encrypt_block(block);
+            }
+        }
+        for (c, k) in chunk.iter_mut().zip(blocks.iter().flatten()) {
+            *c ^= *k;
+        }
+    }
+}
+
+//the count of a counted block as its associated data, and the block
+pub fn split_count(ct: &[u8]) -> (Aad, &[u8]) {
+    if ct.len() < COUNT_HEADER_LEN || ct[..NONCE_LEN] != COUNT_MARK[..] {
+        return (None, ct);
+    }
+    let mut count = [0; COUNT_LEN];
+    count.copy_from_slice(&ct[NONCE_LEN..COUNT_HEADER_LEN]);
+    (Some(count), &ct[COUNT_HEADER_LEN..])
+}
+
+//GHASH over the associated data, which goes before the ciphertext
+fn start_ghash(gcm: &Gcm, aad: &Aad) -> GHash {
+    let mut ghash = GHash::new(&gcm.h);
+    if let Some(aad) = aad {
+        ghash.update_padded(aad);
+    }
+    ghash
+}
+
+//close GHASH over ct_len bytes of ciphertext and the associated data
+fn compute_tag(gcm: &Gcm, nonce: &[u8; NONCE_LEN], mut ghash: GHash, aad: &Aad, ct_len: u64) -> Block {
+    let aad_len = aad.map_or(0, |aad| aad.len() as u64);
+    let mut lengths = Block::default();
+    lengths[..8].copy_from_slice(&(aad_len * 8).to_be_bytes());
+    lengths[8..].copy_from_slice(&(ct_len * 8).to_be_bytes());
+    ghash.update(&lengths);
+    let mut tag = ghash.finalize().into_bytes();
+    let mut mask = counter_block(nonce, 1);
+    gcm.cipher.encrypt_block(&mut mask);
+    for (t, m) in tag.iter_mut().zip(mask.iter()) {
+        *t ^= *m;
+    }
+    tag
+}
+
+pub struct EncWriter<'a> {
+    gcm: &'a Gcm,
+    ghash: GHash,
+    nonce: [u8; NONCE_LEN],
+    aad: Aad,
+    //counter of the next keystream block, 1 is reserved for the tag
+    ctr: u32,
+    ct_len: u64,
+    staged: [u8; STAGE_SIZE],
+    staged_len: usize,
+    out: ItemE,
+}
+
+impl<'a> EncWriter<'a> {
+    //a block counted with count items if there is a count
+    fn new(gcm: &'a Gcm, cap: usize, count: Option<usize>) -> Self {
+        let nonce = keys::next_nonce();
+        let aad = count.map(|count| (count as u64).to_le_bytes());
+        let mut out = create_enc_with_capacity(cap + aad.map_or(0, |_| COUNT_HEADER_LEN));
+        {
+            let _outside = crate::ALLOCATOR.outside();
+            if let Some(aad) = &aad {
+                out.extend_from_slice(&COUNT_MARK);
+                out.extend_from_slice(aad);
+            }
+            out.extend_from_slice(&nonce);
+        }
+        EncWriter {
+            gcm,
+            ghash: start_ghash(gcm, &aad),
+            nonce,
+            aad,
+            ctr: 2,
+            ct_len: 0,
+            staged: [0; STAGE_SIZE],
+            staged_len: 0,
+            out,
+        }
+    }
+
+    //only the last stage may be shorter than STAGE_SIZE, so the padding of
+    //update_padded never kicks in before the end
+    fn flush_stage(&mut self) {
+        let len = self.staged_len;
+        if len == 0 {
+            return;
+        }
+        apply_keystream(&self.gcm.cipher, &self.nonce, &mut self.ctr, &mut self.staged[..len]);
+        self.ghash.update_padded(&self.staged[..len]);
+        {
+            let _outside = crate::ALLOCATOR.outside();
+            self.out.extend_from_slice(&self.staged[..len]);
+        }
+        self.ct_len += len as u64;
+        self.staged_len = 0;
+    }
+
+    fn finish(mut self) -> ItemE {
+        self.flush_stage();
+        let tag = compute_tag(self.gcm, &self.nonce, self.ghash, &self.aad, self.ct_len);
+        {
+            let _outside = crate::ALLOCATOR.outside();
+            self.out.extend_from_slice(&tag);
+        }
+        self.out
+    }
+}
+
+impl<'a> io::Write for EncWriter<'a> {
+    fn write(&mut self, mut buf: &[u8]) -> io::Result<usize> {
+        let len = buf.len();
+        while !buf.is_empty() {
+            let n = std::cmp::min(STAGE_SIZE - self.staged_len, buf.len());
+            self.staged[self.staged_len..self.staged_len + n].copy_from_slice(&buf[..n]);
+            self.staged_len += n;
+            buf = &buf[n..];
+            if self.staged_len == STAGE_SIZE {
+                self.flush_stage();
+            }
+        }
+        Ok(len)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+//serialize and encrypt pt straight into a new outside block
+pub fn ser_encrypt_outside<T>(pt: &T) -> ItemE
+where
+    T: ?Sized + serde::Serialize,
+{
+    let size = compress::encoded_size(pt);
+    let timer = crate::metrics::block_timer();
+    let ct = GCM.with(|gcm| {
+        let mut writer = EncWriter::new(gcm, size + keys::CT_OVERHEAD, None);
+        compress::encode_to(pt, &mut writer);
+        writer.finish()
+    });
+    crate::metrics::record_encrypt(size, timer);
+    ct
+}
+
+//same for a block of items, counted
+pub fn ser_encrypt_outside_counted<T: Data>(block: &[T]) -> ItemE {
+    let size = compress::encoded_size(block);
+    let timer = crate::metrics::block_timer();
+    let ct = GCM.with(|gcm| {
+        let mut writer = EncWriter::new(gcm, size + keys::CT_OVERHEAD, Some(block.len()));
+        compress::encode_to(block, &mut writer);
+        writer.finish()
+    });
+    crate::metrics::record_encrypt(size, timer);
+    ct
+}
+
+//the number of items of a counted block, None for other blocks. the tag is
+//checked over the ciphertext staged inside, nothing is decrypted
+pub fn count_items(ct: &[u8]) -> Option<usize> {
+    let (aad, ct) = split_count(block_stats::body(ct));
+    let count = aad?;
+    assert!(ct.len() >= keys::CT_OVERHEAD, "decryption failure");
+    let mut nonce = [0; NONCE_LEN];
+    nonce.copy_from_slice(&ct[..NONCE_LEN]);
+    let (body, tag) = ct[NONCE_LEN..].split_at(ct.len() - NONCE_LEN - TAG_LEN);
+    let tag = Block::clone_from_slice(tag);
+    GCM.with(|gcm| {
+        let mut ghash = start_ghash(gcm, &aad);
+        let mut staged = [0; STAGE_SIZE];
+        for chunk in body.chunks(STAGE_SIZE) {
+            let staged = &mut staged[..chunk.len()];
+            staged.copy_from_slice(chunk);
+            ghash.update_padded(staged);
+        }
+        check_tag(&compute_tag(gcm, &nonce, ghash, &aad, body.len() as u64), &tag);
+    });
+    Some(u64::from_le_bytes(count) as usize)
+}
+
+//compare without an early exit
+fn check_tag(expected: &Block, tag: &Block) {
+    let diff = expected.iter().zip(tag.iter()).fold(0, |acc, (a, b)| acc | (a ^ b));
+    assert!(diff == 0, "decryption failure");
+}
+
+//decrypt nonce || ciphertext || tag that lives outside enclave into buf, which
+//must be inside. each stage is copied in before it is authenticated or
+//decrypted, so the host cannot change it in between. panics like decrypt if
+//the tag is wrong, or if it is not expected_tag (see OpCache). a counted block
+//is read with its count as the associated data
+pub fn decrypt_untrusted_into(ct: &[u8], buf: &mut Vec<u8>, expected_tag: Option<&[u8; TAG_LEN]>) {
+    let (aad, ct) = split_count(ct);
+    assert!(ct.len() >= keys::CT_OVERHEAD, "decryption failure");
+    let mut nonce = [0; NONCE_LEN];
+    nonce.copy_from_slice(&ct[..NONCE_LEN]);
+    let (body, tag) = ct[NONCE_LEN..].split_at(ct.len() - NONCE_LEN - TAG_LEN);
+    let tag = Block::clone_from_slice(tag);
+    if let Some(expected_tag) = expected_tag {
+        assert!(tag.as_slice() == expected_tag, "cached block was replaced");
+    }
+    let timer = crate::metrics::block_timer();
+    GCM.with(|gcm| {
+        let mut ghash = start_ghash(gcm, &aad);
+        let mut ctr = 2;
+        buf.reserve(body.len());
+        for chunk in body.chunks(STAGE_SIZE) {
+            let start = buf.len();
+            buf.extend_from_slice(chunk);
+            let staged = &mut buf[start..];
+            ghash.update_padded(staged);
+            apply_keystream(&gcm.cipher, &nonce, &mut ctr, staged);
+        }
+        check_tag(&compute_tag(gcm, &nonce, ghash, &aad, body.len() as u64), &tag);
+    });
+    crate::metrics::record_decrypt(body.len(), timer);
+}
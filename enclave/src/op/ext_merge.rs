@@ -0,0 +1,170 @@
+//! External k-way merge of the sorted runs a reducer receives.
+//!
+//! Shuffled::compute_inner normally decrypts all runs of a reducer and merges
+//! them in enclave memory. Past EXT_MERGE_BYTES of ciphertext that no longer
+//! fits in EPC, so the runs are merged here instead: a run is read one block
+//! at a time from outside memory, only the block being merged is decrypted,
+//! and the combiners are encrypted back out as each block fills. More than
+//! MAX_FAN_IN runs are first merged in groups into intermediate runs, which
+//! are encrypted into outside memory (the tcmalloc arena, like every other
+//! block) and freed once the next pass has read them.
+use std::vec::Vec;
+
+use itertools::Itertools;
+
+use crate::aggregator::Aggregator;
+use crate::basic::{Data, DeepSizeOf};
+use crate::op::{block_stats, create_enc, enc_block_bytes, free_enc, push_enc, ser_decrypt_outside, ser_encrypt_outside, ItemE};
+
+//encrypted input of a reducer above which it is merged externally
+pub const EXT_MERGE_BYTES: usize = 32 << 20;
+//runs merged at once, so at most this many decrypted blocks are resident
+const MAX_FAN_IN: usize = 16;
+
+//the pairs of a run in outside memory, decrypted a block at a time
+pub struct RunReader<'a, K, C> {
+    blocks: &'a [ItemE],
+    cur: std::vec::IntoIter<(K, C)>,
+}
+
+impl<'a, K, C> RunReader<'a, K, C> {
+    pub fn new(blocks: &'a [ItemE]) -> Self {
+        RunReader { blocks, cur: Vec::new().into_iter() }
+    }
+}
+
+impl<'a, K: Data, C: Data> Iterator for RunReader<'a, K, C> {
+    type Item = (K, C);
+
+    fn next(&mut self) -> Option<(K, C)> {
+        loop {
+            if let Some(pair) = self.cur.next() {
+                return Some(pair);
+            }
+            let (block, rest) = self.blocks.split_first()?;
+            self.blocks = rest;
+            self.cur = ser_decrypt_outside::<Vec<(K, C)>>(block).into_iter();
+        }
+    }
+}
+
+//encrypts pairs into outside blocks of about enc_block_bytes, as batch_encrypt does
+struct RunWriter<K, C> {
+    out: Vec<ItemE>,
+    buf: Vec<(K, C)>,
+    bytes: usize,
+    target: usize,
+}
+
+impl<K: Data, C: Data> RunWriter<K, C> {
+    fn new() -> Self {
+        RunWriter {
+            out: create_enc(),
+            buf: Vec::new(),
+            bytes: 0,
+            target: enc_block_bytes(),
+        }
+    }
+
+    fn push(&mut self, pair: (K, C)) {
+        self.bytes += pair.deep_size_of();
+        self.buf.push(pair);
+        if self.bytes >= self.target {
+            self.flush();
+        }
+    }
+
+    fn flush(&mut self) {
+        if !self.buf.is_empty() {
+            let block_enc = ser_encrypt_outside(&self.buf);
+            push_enc(&mut self.out, block_enc);
+            self.buf.clear();
+        }
+        self.bytes = 0;
+    }
+
+    fn finish(mut self) -> Vec<ItemE> {
+        self.flush();
+        self.out
+    }
+}
+
+//merge sorted runs into one, combining the pairs of equal keys
+fn merge_group<'a, K, V, C>(runs: impl Iterator<Item = &'a Vec<ItemE>>, aggregator: &Aggregator<K, V, C>) -> Vec<ItemE>
+where
+    K: Data + Ord,
+    V: Data,
+    C: Data,
+{
+    let mut writer = RunWriter::new();
+    let mut last: Option<(K, C)> = None;
+    let readers = runs.map(|blocks| RunReader::new(blocks));
+    for (k, c) in readers.kmerge_by(|a, b| a.0 < b.0) {
+        match last.as_mut() {
+            Some(pair) if pair.0 == k => {
+                pair.1 = (aggregator.merge_combiners)((std::mem::take(&mut pair.1), c));
+            },
+            _ => {
+                if let Some(pair) = last.replace((k, c)) {
+                    writer.push(pair);
+                }
+            },
+        }
+    }
+    if let Some(pair) = last {
+        writer.push(pair);
+    }
+    writer.finish()
+}
+
+//the only run of a sub-bucket that has blocks. its combiners are sorted with
+//one per key already (see shuffle_core), so merging it is the identity
+pub fn only_run(runs: &[Vec<ItemE>]) -> Option<&Vec<ItemE>> {
+    let mut runs = runs.iter().filter(|run| !run.is_empty());
+    match (runs.next(), runs.next()) {
+        (Some(run), None) => Some(run),
+        _ => None,
+    }
+}
+
+//the blocks of a run copied out as they are, without being decrypted and
+//encrypted again. they are sealed under the job key with their count as
+//associated data, so the next op reads them like any merged block
+pub fn forward_run(run: &[ItemE]) -> Vec<ItemE> {
+    let _outside = crate::ALLOCATOR.outside();
+    run.iter()
+        .map(|block| block_stats::body(block).to_vec())
+        .collect()
+}
+
+//the same result as decrypting runs and calling merge_core, encrypted
+pub fn merge_runs<K, V, C>(runs: &[Vec<ItemE>], aggregator: &Aggregator<K, V, C>) -> Vec<ItemE>
+where
+    K: Data + Ord,
+    V: Data,
+    C: Data,
+{
+    if let Some(run) = only_run(runs) {
+        return forward_run(run);
+    }
+    if runs.len() <= MAX_FAN_IN {
+        return merge_group(runs.iter(), aggregator);
+    }
+    let mut level = runs.chunks(MAX_FAN_IN)
+        .map(|group| merge_group(group.iter(), aggregator))
+        .collect::<Vec<_>>();
+    while level.len() > MAX_FAN_IN {
+        let next = level.chunks(MAX_FAN_IN)
+            .map(|group| merge_group(group.iter(), aggregator))
+            .collect::<Vec<_>>();
+        for run in level {
+            free_enc(run);
+        }
+        level = next;
+    }
+    let merged = merge_group(level.iter(), aggregator);
+    for run in level {
+        free_enc(run);
+    }
+    merged
+}
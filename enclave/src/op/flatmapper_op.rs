@@ -60,20 +60,6 @@ impl<T: Data, U: Data, F> OpBase for FlatMapper<T, U, F>
 where
     F: SerFunc(T) -> Box<dyn Iterator<Item = U>>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -182,6 +168,9 @@ where
             assert_eq!(data_ptr as usize, 0 as usize);
             return self.get_and_remove_cached_data(call_seq);
         }
+        if !need_cache {
+            return into_res_iter(self.map_blocks(call_seq, input));
+        }
 
         let mut f = self.f.clone();
         match call_seq.get_ser_captured_var() {
@@ -211,4 +200,75 @@ where
         res_iter
     }
 
-}
\ No newline at end of file
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        if call_seq.have_cache() || call_seq.need_cache() {
+            return Box::new(self.compute(call_seq, input).map(|block| block.collect::<Vec<_>>()));
+        }
+        self.map_blocks(call_seq, input)
+    }
+
+}
+
+impl<T: Data, U: Data, F> FlatMapper<T, U, F>
+where
+    F: SerFunc(T) -> Box<dyn Iterator<Item = U>>,
+{
+    fn map_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<U> {
+        let mut f = self.f.clone();
+        if let Some(ser) = call_seq.get_ser_captured_var() {
+            f.deser_captured_var(ser);
+        }
+        Box::new(Expansion {
+            blocks: prev_blocks(&self.prev, call_seq, input),
+            f,
+            cur: None,
+            target: enc_block_bytes(),
+        })
+    }
+}
+
+//the output of f over the blocks of prev, cut into blocks of about
+//ENC_BLOCK_BYTES as it is produced. an input block may expand many times over,
+//so its expansion is never held as a whole, every block handed on is
+//encrypted before the next one fills
+struct Expansion<T: Data, U: Data, F> {
+    blocks: BlockIter<T>,
+    f: F,
+    cur: Option<std::iter::FlatMap<std::vec::IntoIter<T>, Box<dyn Iterator<Item = U>>, F>>,
+    target: usize,
+}
+
+impl<T: Data, U: Data, F> Iterator for Expansion<T, U, F>
+where
+    F: SerFunc(T) -> Box<dyn Iterator<Item = U>>,
+{
+    type Item = Vec<U>;
+
+    fn next(&mut self) -> Option<Vec<U>> {
+        let mut block = Vec::new();
+        let mut bytes = 0;
+        loop {
+            if let Some(cur) = self.cur.as_mut() {
+                while bytes < self.target {
+                    match cur.next() {
+                        Some(item) => {
+                            bytes += item.deep_size_of();
+                            block.push(item);
+                        },
+                        None => break,
+                    }
+                }
+                if bytes >= self.target {
+                    return Some(block);
+                }
+            }
+            match self.blocks.next() {
+                Some(next) => self.cur = Some(next.into_iter().flat_map(self.f.clone())),
+                None => {
+                    self.cur = None;
+                    return if block.is_empty() { None } else { Some(block) };
+                },
+            }
+        }
+    }
+}
@@ -52,20 +52,6 @@ where
     T: Data,
     F: SerFunc(Box<dyn Iterator<Item = T>>) -> T,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step0_of_clone(p_buf, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             3 | 4 => self.free_res_enc(res_ptr, is_enc),
@@ -107,17 +93,20 @@ where
         //4 is only for local reduce & fold (sf + cf)
         if dep_info.dep_type() == 3 {
             let data_enc = input.get_enc_data::<Vec<ItemE>>();
-            let t = (self.f)(Box::new(data_enc.clone()
-                .into_iter()
-                .map(|x| ser_decrypt::<T>(&x))
+            let t = (self.f)(Box::new(data_enc
+                .iter()
+                .map(|x| ser_decrypt_outside::<T>(x))
                 .collect::<Vec<_>>()
                 .into_iter()));
             let ue = vec![ser_encrypt(&t)];
             res_enc_to_ptr(ue)
         } else if dep_info.dep_type() == 4 {
             let data_enc = input.get_enc_data::<Vec<ItemE>>();
-            let data = batch_decrypt(data_enc, true);
-            let t = (self.f)(Box::new(data.into_iter()));
+            //folded as the blocks are decrypted ahead, a block of primitives is
+            //decoded column by column (see columnar.rs) and the partition is
+            //never gathered into one vector
+            let data = DecryptAhead::<T>::new(data_enc, 0, data_enc.len(), None, None);
+            let t = (self.f)(Box::new(data.flatten()));
             let ue = vec![ser_encrypt(&t)];
             res_enc_to_ptr(ue)
         } else {
@@ -144,10 +133,12 @@ where
 
     fn compute(&self, call_seq: &mut NextOpId, input: Input) -> ResIter<Self::Item> {
         //move some parts in compute start to this part
-        let res_iter = self.prev.compute(call_seq, input);
+        let blocks = self.prev.compute_blocks(call_seq, input);
         let f = self.f.clone();
-        Box::new(res_iter.map(move |res_iter|
-            Box::new(vec![(f)(res_iter)].into_iter()) as Box<dyn Iterator<Item = _>>))
+        Box::new(blocks.map(move |block| {
+            let block = Box::new(block.into_iter()) as Box<dyn Iterator<Item = _>>;
+            Box::new(vec![(f)(block)].into_iter()) as Box<dyn Iterator<Item = _>>
+        }))
     }
 
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+//! Index of the keys of cached pair partitions, for lookup.
+//!
+//! An op with a partitioner that caches a partition outside records, as each
+//! block is encrypted, the hash of the key of every item with the tag of its
+//! block and its offset in it. Once the partition is handed to the host the
+//! entries are resolved against the tags of the partition (see
+//! OpCache::commit_tags) into (hash, block, offset), sorted by hash. The index
+//! stays in the enclave next to the tags instead of being sealed outside with
+//! the blocks: it is a few words per item and every lookup reads it.
+//!
+//! secure_lookup of the host sends a key to the one partition the partitioner
+//! puts it in. When the blocks it hands in are the cached ones, with the tags
+//! the index was built against, only the blocks the index lists for the hash
+//! of the key are decrypted. Other blocks, e.g. a partition computed again or
+//! cached before a restart, are scanned whole.
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::sync::SgxRwLock as RwLock;
+use std::vec::Vec;
+
+use crate::CACHE;
+use crate::basic::Data;
+use crate::op::{batch_encrypt, block_stats, block_tag, create_enc_with_capacity, decrypt_block, enc_blocks,
+    push_enc, ser_decrypt, ser_encrypt_outside_counted, to_ptr, ItemE, OpId, Tag};
+
+//hash of the key of an item, tag of its block and offset in the block
+pub type Entry = (u64, Tag, u32);
+
+//(hash, block, offset) of every item of a partition, by hash
+pub struct KeyIndex {
+    entries: Vec<(u64, u32, u32)>,
+}
+
+impl KeyIndex {
+    //None if an entry is of a block the partition was not cached with
+    pub fn new(staged: Vec<Entry>, tags: &[Tag]) -> Option<Self> {
+        let blocks = tags.iter()
+            .enumerate()
+            .map(|(i, tag)| (*tag, i as u32))
+            .collect::<HashMap<_, _>>();
+        let mut entries = staged.into_iter()
+            .map(|(hash, tag, offset)| blocks.get(&tag).map(|&block| (hash, block, offset)))
+            .collect::<Option<Vec<_>>>()?;
+        entries.sort_unstable();
+        Some(KeyIndex { entries })
+    }
+
+    //the entries of hash, by block and offset
+    fn positions(&self, hash: u64) -> &[(u64, u32, u32)] {
+        let start = self.entries.partition_point(|entry| entry.0 < hash);
+        let end = self.entries.partition_point(|entry| entry.0 <= hash);
+        &self.entries[start..end]
+    }
+}
+
+fn hash_of<K: Hash>(key: &K) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    key.hash(&mut hasher);
+    hasher.finish()
+}
+
+//the hash the index keeps of an item, for pairs of a hashable key only
+pub trait KeyHash {
+    fn is_keyed() -> bool;
+    fn key_hash(&self) -> u64;
+}
+
+impl<T> KeyHash for T {
+    default fn is_keyed() -> bool {
+        false
+    }
+
+    default fn key_hash(&self) -> u64 {
+        unreachable!()
+    }
+}
+
+impl<K: Hash, V> KeyHash for (K, V) {
+    fn is_keyed() -> bool {
+        true
+    }
+
+    fn key_hash(&self) -> u64 {
+        hash_of(&self.0)
+    }
+}
+
+//batch_encrypt into outside memory, and the entries of the blocks staged for
+//the index of key
+pub fn batch_encrypt_indexed<T: Data>(key: (usize, usize), data: &[T]) -> Vec<ItemE> {
+    if !T::is_keyed() {
+        return batch_encrypt(data, true);
+    }
+    let blocks = enc_blocks(data).collect::<Vec<_>>();
+    let mut acc = create_enc_with_capacity(blocks.len());
+    let mut entries = Vec::with_capacity(data.len());
+    for x in blocks {
+        let block_enc = ser_encrypt_outside_counted(x);
+        let tag = block_tag(&block_enc);
+        entries.extend(x.iter().enumerate().map(|(i, item)| (item.key_hash(), tag, i as u32)));
+        push_enc(&mut acc, block_enc);
+    }
+    CACHE.stage_keys(key, entries);
+    acc
+}
+
+//the values of key in the blocks of partition part
+fn lookup<K: Data + Eq + Hash, V: Data>(part: (usize, usize), blocks: &Vec<ItemE>, key: &K) -> Vec<V> {
+    let tags = CACHE.tags(part).filter(|tags| tags.len() == blocks.len()
+        && blocks.iter().zip(tags.iter()).all(|(block, tag)| block_tag(block_stats::body(block)) == *tag));
+    let index = tags.as_ref().and_then(|_| CACHE.key_index(part));
+    let (tags, index) = match (tags, index) {
+        (Some(tags), Some(index)) => (tags, index),
+        _ => {
+            return blocks.iter()
+                .flat_map(|block| decrypt_block::<(K, V)>(block, None, None))
+                .filter(|(k, _)| k == key)
+                .map(|(_, v)| v)
+                .collect();
+        },
+    };
+    let mut values = Vec::new();
+    //the entries of a block are next to each other, it is decrypted once
+    let mut items: Option<(u32, Vec<(K, V)>)> = None;
+    for &(_, block, offset) in index.positions(hash_of(key)) {
+        if items.as_ref().map_or(true, |(cur, _)| *cur != block) {
+            let b = block as usize;
+            items = Some((block, decrypt_block::<(K, V)>(&blocks[b], Some(&tags[b]), None)));
+        }
+        match items.as_ref().and_then(|(_, items)| items.get(offset as usize)) {
+            Some((k, v)) if k == key => values.push(v.clone()),
+            _ => (),
+        }
+    }
+    values
+}
+
+fn lookup_enc<K: Data + Eq + Hash, V: Data>(part: (usize, usize), blocks: &Vec<ItemE>, key_enc: &[u8]) -> Vec<ItemE> {
+    let key = ser_decrypt::<K>(&key_enc.to_vec());
+    batch_encrypt(&lookup::<K, V>(part, blocks, &key), true)
+}
+
+type LookupFn = fn((usize, usize), &Vec<ItemE>, &[u8]) -> Vec<ItemE>;
+
+lazy_static! {
+    //the lookup of each Pair::lookup, by the op id secure_lookup of the host
+    //has at the same call site
+    static ref LOOKUPS: RwLock<HashMap<OpId, LookupFn>> = RwLock::new(HashMap::new());
+}
+
+pub fn register<K: Data + Eq + Hash, V: Data>(op_id: OpId) {
+    LOOKUPS.write().unwrap().insert(op_id, lookup_enc::<K, V>);
+}
+
+//input is the outside Vec<ItemE> of partition part, key the encrypted key.
+//the values found are encrypted outside, and freed as a result of the op
+//looked up in
+pub fn lookup_start(op_id: OpId, part: (usize, usize), input: *const u8, key: *const u8) -> *mut u8 {
+    let f = *LOOKUPS.read().unwrap().get(&op_id).expect("lookup not registered");
+    assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(input, std::mem::size_of::<Vec<ItemE>>())
+        && sgx_trts::trts::rsgx_raw_is_outside_enclave(key, std::mem::size_of::<ItemE>()), "invalid lookup input");
+    let blocks = unsafe { (input as *const Vec<ItemE>).as_ref() }.unwrap();
+    let key_enc = unsafe { (key as *const ItemE).as_ref() }.unwrap();
+    to_ptr(f(part, blocks, key_enc))
+}
@@ -0,0 +1,91 @@
+//! Key and nonce schedule of the block cipher.
+//!
+//! Blocks are encrypted with AES-128-GCM under a job key, derived from the
+//! master key and the key id the host sets with the set_key_id ECALL
+//! (VEGA_KEY_ID), so runs with different ids never share a key. The master
+//! key is the development one until a key service provisions the real one,
+//! see provision.rs. Every block
+//! carries its nonce in front of the ciphertext, so a block can be decrypted
+//! or verified on its own, on any thread and in any order, without knowing
+//! which partition or position it came from.
+//!
+//! A nonce is a 64-bit stream id drawn at random by the encrypting thread
+//! followed by the 32-bit counter of the block in that stream, and a thread
+//! draws a new stream before its counter wraps. Streams are random rather than
+//! numbered because blocks from the enclaves of all executors and from the
+//! host meet in one job, and there is no counter they could share.
+use core::cell::Cell;
+use std::sync::SgxRwLock as RwLock;
+
+use aes_gcm::aead::generic_array::GenericArray;
+use aes_gcm::aes::{Aes128, BlockCipher, NewBlockCipher};
+use sgx_trts::trts::rsgx_read_rand;
+
+pub const KEY_LEN: usize = 16;
+pub const NONCE_LEN: usize = 12;
+pub const TAG_LEN: usize = 16;
+//what a block of ciphertext adds to its plaintext, nonce in front and tag behind
+pub const CT_OVERHEAD: usize = NONCE_LEN + TAG_LEN;
+
+//known to the enclave and the host alike, only used to derive job keys of
+//deployments without a key service
+const DEV_MASTER_KEY: &[u8; KEY_LEN] = b"abcdefg hijklmn ";
+
+lazy_static! {
+    static ref MASTER_KEY: RwLock<[u8; KEY_LEN]> = RwLock::new(*DEV_MASTER_KEY);
+    static ref JOB_KEY: RwLock<[u8; KEY_LEN]> = RwLock::new(derive_job_key(0));
+}
+
+//(stream id, counter of the next block), None until the first block
+#[thread_local]
+static STREAM: Cell<Option<(u64, u32)>> = Cell::new(None);
+
+//E_master(b"job key\0" || key_id), the host derives it the same way
+fn derive_job_key(key_id: u64) -> [u8; KEY_LEN] {
+    let cipher = Aes128::new(GenericArray::from_slice(&*MASTER_KEY.read().unwrap()));
+    let mut block = GenericArray::default();
+    block[..8].copy_from_slice(b"job key\0");
+    block[8..].copy_from_slice(&key_id.to_le_bytes());
+    cipher.encrypt_block(&mut block);
+    let mut key = [0; KEY_LEN];
+    key.copy_from_slice(&block);
+    key
+}
+
+//threads expand the job key once, so this must run before the first block is
+//encrypted, init_enclave calls it right after the enclave is created
+pub fn set_key_id(key_id: u64) {
+    *JOB_KEY.write().unwrap() = derive_job_key(key_id);
+}
+
+//the job keys are derived from it, so this runs before set_key_id
+pub fn set_master_key(key: [u8; KEY_LEN]) {
+    *MASTER_KEY.write().unwrap() = key;
+}
+
+pub fn master_key() -> [u8; KEY_LEN] {
+    *MASTER_KEY.read().unwrap()
+}
+
+pub fn job_key() -> [u8; KEY_LEN] {
+    *JOB_KEY.read().unwrap()
+}
+
+fn random_stream() -> u64 {
+    let mut id = [0; 8];
+    rsgx_read_rand(&mut id).expect("rdrand failure");
+    u64::from_le_bytes(id)
+}
+
+//a nonce never handed out before under the job key
+pub fn next_nonce() -> [u8; NONCE_LEN] {
+    let (id, ctr) = match STREAM.get() {
+        Some((id, ctr)) if ctr != u32::MAX => (id, ctr),
+        _ => (random_stream(), 0),
+    };
+    STREAM.set(Some((id, ctr + 1)));
+    let mut nonce = [0; NONCE_LEN];
+    nonce[..8].copy_from_slice(&id.to_le_bytes());
+    nonce[8..].copy_from_slice(&ctr.to_le_bytes());
+    nonce
+}
@@ -105,20 +105,6 @@ where
     U: Data,
     F0: SerFunc(I) -> Vec<ItemE>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        } 
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        } 
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
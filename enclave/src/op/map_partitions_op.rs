@@ -10,6 +10,10 @@ where
     next_deps: Arc<RwLock<HashMap<(OpId, OpId), Dependency>>>,
     prev: Arc<dyn Op<Item = T>>,
     f: F,
+    //f over a whole block, for the ops (filter) that can run it block by block
+    block_f: Option<Arc<dyn Fn(Vec<T>) -> Vec<U> + Send + Sync>>,
+    //stats a block of the input must pass not to be dropped whole, see block_stats
+    block_pred: Option<block_stats::BlockPred>,
     cache_space: Arc<Mutex<HashMap<(usize, usize), Vec<Vec<U>>>>>
 }
 
@@ -25,6 +29,8 @@ where
             next_deps: self.next_deps.clone(),
             prev: self.prev.clone(),
             f: self.f.clone(),
+            block_f: self.block_f.clone(),
+            block_pred: self.block_pred.clone(),
             cache_space: self.cache_space.clone(),
         }
     }
@@ -57,9 +63,43 @@ where
             next_deps: Arc::new(RwLock::new(HashMap::new())),
             prev,
             f,
+            block_f: None,
+            block_pred: None,
             cache_space: Arc::new(Mutex::new(HashMap::new())),
         }
     }
+
+    pub(crate) fn with_block_fn(mut self, block_f: Arc<dyn Fn(Vec<T>) -> Vec<U> + Send + Sync>) -> Self {
+        self.block_f = Some(block_f);
+        self
+    }
+
+    pub(crate) fn with_block_pred(mut self, block_pred: block_stats::BlockPred) -> Self {
+        self.block_pred = Some(block_pred);
+        self
+    }
+
+    //only the head decrypts the blocks the stats are of
+    fn pass_block_pred(&self, call_seq: &mut NextOpId) {
+        if self.block_pred.is_some() && call_seq.next_is_head() {
+            call_seq.block_pred = self.block_pred.clone();
+        }
+    }
+
+    //the captured vars of f are only known to f, so it is not run by block
+    //when the host sent some
+    fn runs_by_block(&self, call_seq: &NextOpId) -> bool {
+        self.block_f.is_some()
+            && !call_seq.have_cache()
+            && !call_seq.need_cache()
+            && call_seq.get_ser_captured_var().is_none()
+    }
+
+    fn map_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<U> {
+        let block_f = self.block_f.clone().unwrap();
+        self.pass_block_pred(call_seq);
+        Box::new(prev_blocks(&self.prev, call_seq, input).map(move |block| block_f(block)))
+    }
 }
 
 impl<T, U, F> OpBase for MapPartitions<T, U, F>
@@ -68,20 +108,6 @@ where
     U: Data,
     F: SerFunc(usize, Box<dyn Iterator<Item = T>>) -> Box<dyn Iterator<Item = U>>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        } 
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -194,12 +220,16 @@ where
             assert_eq!(data_ptr as usize, 0 as usize);
             return self.get_and_remove_cached_data(call_seq);
         }
+        if self.runs_by_block(call_seq) {
+            return into_res_iter(self.map_blocks(call_seq, input));
+        }
         
         let mut f = self.f.clone();
         match call_seq.get_ser_captured_var() {
             Some(ser) => f.deser_captured_var(ser),
             None  => (),
         }
+        self.pass_block_pred(call_seq);
         let opb = call_seq.get_next_op().clone();
         let res_iter = if opb.get_op_id() == self.prev.get_op_id() {
             self.prev.compute(call_seq, input)
@@ -223,4 +253,11 @@ where
         res_iter
     }
 
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        if !self.runs_by_block(call_seq) {
+            return Box::new(self.compute(call_seq, input).map(|block| block.collect::<Vec<_>>()));
+        }
+        self.map_blocks(call_seq, input)
+    }
+
 }
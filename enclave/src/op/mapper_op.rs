@@ -60,20 +60,6 @@ impl<T: Data, U: Data, F> OpBase for Mapper<T, U, F>
 where
     F: SerFunc(T) -> U,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        } 
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -184,6 +170,9 @@ where
             assert_eq!(data_ptr as usize, 0usize);
             return self.get_and_remove_cached_data(call_seq);
         }
+        if !need_cache {
+            return into_res_iter(self.map_blocks(call_seq, input));
+        }
         
         let mut f = self.f.clone();
         match call_seq.get_ser_captured_var() {
@@ -216,5 +205,26 @@ where
         res_iter
     }
 
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        if call_seq.have_cache() || call_seq.need_cache() {
+            return Box::new(self.compute(call_seq, input).map(|block| block.collect::<Vec<_>>()));
+        }
+        self.map_blocks(call_seq, input)
+    }
+
 }
 
+impl<T: Data, U: Data, F> Mapper<T, U, F>
+where
+    F: SerFunc(T) -> U,
+{
+    fn map_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<U> {
+        let mut f = self.f.clone();
+        if let Some(ser) = call_seq.get_ser_captured_var() {
+            f.deser_captured_var(ser);
+        }
+        Box::new(prev_blocks(&self.prev, call_seq, input).map(move |block| {
+            block.into_iter().map(f.clone()).collect::<Vec<_>>()
+        }))
+    }
+}
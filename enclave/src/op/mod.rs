@@ -1,6 +1,7 @@
 use core::panic::Location;
 use std::any::{Any, TypeId};
 use std::boxed::Box;
+use std::cell::RefCell;
 use std::collections::{btree_map::BTreeMap, hash_map::DefaultHasher, HashMap, VecDeque};
 use std::cmp::{min, Ordering, Reverse};
 use std::hash::{Hash, Hasher};
@@ -9,34 +10,51 @@ use std::ops::{Deref, DerefMut};
 use std::raw::TraitObject;
 use std::string::ToString;
 use std::sync::{
-    atomic::{self, AtomicBool, AtomicU32, AtomicUsize},
+    atomic::{self, AtomicBool, AtomicU64, AtomicUsize},
     Arc, SgxMutex as Mutex, SgxRwLock as RwLock, Weak,
 };
 use std::time::Instant;
-use std::thread::{self, JoinHandle};
 use std::untrusted::time::InstantEx;
 use std::vec::Vec;
 
 use aes_gcm::Aes128Gcm;
-use aes_gcm::aead::{Aead, NewAead, generic_array::GenericArray};
+use aes_gcm::aead::{AeadInPlace, NewAead, generic_array::GenericArray};
 use sgx_types::*;
 use rand::{Rng, SeedableRng};
 
-use crate::{CACHE, Fn, OP_MAP};
-use crate::basic::{AnyData, Arc as SerArc, Data, Func, SerFunc};
-use crate::custom_thread::PThread;
+use crate::{CACHE, Fn, OP_MAP, PLAIN_CACHE};
+use crate::basic::{AnyData, Arc as SerArc, Data, DeepSizeOf, Func, SerFunc};
 use crate::dependency::{Dependency, OneToOneDependency, ShuffleDependencyTrait};
 use crate::partitioner::Partitioner;
-use crate::serialization_free::{Construct, Idx, SizeBuf};
+use crate::thread_pool::{self, TaskHandle};
 use crate::utils;
-use crate::utils::random::{BernoulliCellSampler, BernoulliSampler, PoissonSampler, RandomSampler};
+use crate::utils::bounded_priority_queue::{merge_smallest, BoundedPriorityQueue};
+use crate::utils::random::{
+    bottom_k, get_partition_rng, BernoulliCellSampler, BernoulliSampler, Keyed, PoissonSampler, RandomSampler,
+};
 
 mod aggregated_op;
 pub use aggregated_op::*;
+pub mod block_stats;
+mod broadcast;
+pub use broadcast::*;
+pub mod columnar;
+pub mod compress;
 mod count_op;
 pub use count_op::*;
+mod enc_writer;
+pub use enc_writer::*;
+pub mod ext_merge;
+pub mod key_index;
+pub mod keys;
+pub mod op_table;
+pub mod plain_cache;
+mod cartesian_op;
+pub use cartesian_op::*;
 mod co_grouped_op;
 pub use co_grouped_op::*;
+mod coalesced_op;
+pub use coalesced_op::*;
 mod flatmapper_op;
 pub use flatmapper_op::*;
 mod fold_op;
@@ -49,6 +67,7 @@ mod map_partitions_op;
 pub use map_partitions_op::*;
 mod pair_op;
 pub use pair_op::*;
+pub mod planner;
 mod parallel_collection_op;
 pub use parallel_collection_op::*;
 mod partitionwise_sampled_op;
@@ -64,12 +83,31 @@ pub use zip_op::*;
 
 pub type ItemE = Vec<u8>;
 type ResIter<T> = Box<dyn Iterator<Item = Box<dyn Iterator<Item = T>>>>;
+//the blocks of an op as vectors, see Op::compute_blocks
+type BlockIter<T> = Box<dyn Iterator<Item = Vec<T>>>;
+
+//the blocks of the op the call sequence goes to next, prev unless a cache
+//cut the lineage short
+fn prev_blocks<T: Data>(prev: &Arc<dyn Op<Item = T>>, call_seq: &mut NextOpId, input: Input) -> BlockIter<T> {
+    let opb = call_seq.get_next_op().clone();
+    if opb.get_op_id() == prev.get_op_id() {
+        prev.compute_blocks(call_seq, input)
+    } else {
+        let op = opb.to_arc_op::<dyn Op<Item = T>>().unwrap();
+        op.compute_blocks(call_seq, input)
+    }
+}
 
-pub const MAX_ENC_BL: usize = 1024;
-pub const CACHE_LIMIT: usize = 4_000_000;
-pub const ENABLE_CACHE_INSIDE: bool = false;
-pub const MAX_THREAD: usize = 1;
-pub const PARA_THRESHOLD: f64 = 3.0;
+fn into_res_iter<T: Data>(blocks: BlockIter<T>) -> ResIter<T> {
+    Box::new(blocks.map(|block| Box::new(block.into_iter()) as Box<dyn Iterator<Item = _>>))
+}
+
+pub use crate::tuning::{cache_inside, cache_limit, max_enc_bl, max_thread, node_combine};
+//plaintext bytes (by deep size) an encryption block aims for, set by the host
+pub const DEFAULT_ENC_BLOCK_BYTES: usize = 256 * 1024;
+static ENC_BLOCK_BYTES: AtomicUsize = AtomicUsize::new(DEFAULT_ENC_BLOCK_BYTES);
+//blocks a narrow stage keeps in flight between decryption, computation and encryption
+pub const PIPELINE_DEPTH: usize = 2;
 pub type Result<T> = std::result::Result<T, &'static str>;
 
 extern "C" {
@@ -82,6 +120,18 @@ extern "C" {
     pub fn ocall_cache_from_outside(ret_val: *mut usize,  //ptr outside enclave
         rdd_id: usize,
         part_id: usize,
+        generation: *mut u64,   //u64::MAX if the ptr must not be mirrored
+    ) -> sgx_status_t;
+
+    pub fn ocall_cache_invalidations(ret_val: *mut u64,  //generation covered
+        since: u64,
+        keys: *mut usize,
+        cap: usize,
+        num_keys: *mut usize,   //usize::MAX to drop all
+    ) -> sgx_status_t;
+
+    pub fn ocall_get_broadcast(ret_val: *mut usize,  //ptr to the ItemE outside enclave
+        id: u64,
     ) -> sgx_status_t;
 }
 
@@ -91,24 +141,85 @@ pub fn default_hash<T: Hash>(t: &T) -> u64 {
     s.finish()
 }
 
-pub fn load_opmap() -> &'static mut BTreeMap<OpId, Arc<dyn OpBase>> {
-    unsafe { 
-        OP_MAP.load(atomic::Ordering::Relaxed)
-            .as_mut()
-    }.unwrap()
+pub fn load_opmap() -> &'static op_table::OpTable {
+    &OP_MAP
 }
 
 pub fn insert_opmap(op_id: OpId, op_base: Arc<dyn OpBase>) {
-    let op_map = load_opmap();
-    op_map.insert(op_id, op_base);
+    load_opmap().insert(op_id, op_base);
+}
+
+//serialization buffers this large are given back after use instead of being
+//kept as the scratch space of the thread
+const SCRATCH_KEEP: usize = 1 << 20;
+
+thread_local! {
+    //the key schedule and the GHASH key are expanded once per thread, not per block
+    static CIPHER: Aes128Gcm = Aes128Gcm::new(GenericArray::from_slice(&keys::job_key()));
+    //plaintext of the block being encrypted or decrypted by this thread
+    static SCRATCH: RefCell<Vec<u8>> = RefCell::new(Vec::new());
+}
+
+//buf holds nonce || plaintext, seal it in place into nonce || ciphertext || tag
+fn seal_in_place(buf: &mut Vec<u8>) {
+    seal_in_place_bound(buf, 0, b"")
+}
+
+//same for the nonce and plaintext at start of buf, with aad as the associated data
+fn seal_in_place_bound(buf: &mut Vec<u8>, start: usize, aad: &[u8]) {
+    let timer = crate::metrics::block_timer();
+    let (nonce, pt) = buf[start..].split_at_mut(keys::NONCE_LEN);
+    let len = pt.len();
+    let tag = CIPHER
+        .with(|cipher| cipher.encrypt_in_place_detached(GenericArray::from_slice(nonce), aad, pt))
+        .expect("encryption failure");
+    buf.extend_from_slice(&tag);
+    crate::metrics::record_encrypt(len, timer);
+}
+
+//run f on the scratch buffer of the thread, which always lives inside
+fn with_scratch<R>(f: impl FnOnce(&mut Vec<u8>) -> R) -> R {
+    let switch = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    let res = SCRATCH.with(|scratch| {
+        let mut scratch = scratch.borrow_mut();
+        scratch.clear();
+        let res = f(&mut scratch);
+        if scratch.capacity() > SCRATCH_KEEP {
+            scratch.clear();
+            scratch.shrink_to(SCRATCH_KEEP);
+        }
+        res
+    });
+    crate::ALLOCATOR.set_switch(switch);
+    res
 }
 
 #[inline(always)]
 pub fn encrypt(pt: &[u8]) -> Vec<u8> {
-    let key = GenericArray::from_slice(b"abcdefg hijklmn ");
-    let cipher = Aes128Gcm::new(key);
-    let nonce = GenericArray::from_slice(b"unique nonce");
-    cipher.encrypt(nonce, pt).expect("encryption failure")
+    let mut ct = Vec::with_capacity(pt.len() + keys::CT_OVERHEAD);
+    ct.extend_from_slice(&keys::next_nonce());
+    ct.extend_from_slice(pt);
+    seal_in_place(&mut ct);
+    ct
+}
+
+//serialize and encrypt in place in the scratch buffer, then let `out` copy the
+//ciphertext to where it should live. blocks bound for outside memory should use
+//ser_encrypt_outside instead
+#[inline(always)]
+pub fn ser_encrypt_with<T, R>(pt: &T, out: impl FnOnce(&[u8]) -> R) -> R
+where
+    T: ?Sized + serde::Serialize,
+{
+    with_scratch(|buf| {
+        buf.extend_from_slice(&keys::next_nonce());
+        let timer = crate::metrics::coding_timer();
+        compress::encode_to(pt, buf);
+        crate::metrics::record_ser(timer);
+        seal_in_place(buf);
+        out(buf)
+    })
 }
 
 #[inline(always)]
@@ -116,15 +227,54 @@ pub fn ser_encrypt<T>(pt: &T) -> Vec<u8>
 where
     T: ?Sized + serde::Serialize,
 {
-    encrypt(bincode::serialize(pt).unwrap().as_ref())
+    ser_encrypt_with(pt, |ct| ct.to_vec())
+}
+
+//a block of items, counted, see enc_writer.rs
+pub fn ser_encrypt_counted<T: Data>(block: &[T]) -> Vec<u8> {
+    let count = (block.len() as u64).to_le_bytes();
+    with_scratch(|buf| {
+        buf.extend_from_slice(&COUNT_MARK);
+        buf.extend_from_slice(&count);
+        let start = buf.len();
+        buf.extend_from_slice(&keys::next_nonce());
+        let timer = crate::metrics::coding_timer();
+        compress::encode_to(block, buf);
+        crate::metrics::record_ser(timer);
+        seal_in_place_bound(buf, start, &count);
+        buf.to_vec()
+    })
 }
 
 #[inline(always)]
 pub fn decrypt(ct: &[u8]) -> Vec<u8> {
-    let key = GenericArray::from_slice(b"abcdefg hijklmn ");
-    let cipher = Aes128Gcm::new(key);
-    let nonce = GenericArray::from_slice(b"unique nonce");
-    cipher.decrypt(nonce, ct).expect("decryption failure")
+    match split_count(block_stats::body(ct)) {
+        (Some(count), ct) => decrypt_bound(ct, &count),
+        (None, ct) => decrypt_bound(ct, b""),
+    }
+}
+
+//decrypt ct sealed with aad as its associated data
+pub fn decrypt_bound(ct: &[u8], aad: &[u8]) -> Vec<u8> {
+    open_bound(ct, aad).expect("decryption failure")
+}
+
+//same, None if ct is not sealed under the job key with aad
+pub fn open_bound(ct: &[u8], aad: &[u8]) -> Option<Vec<u8>> {
+    if ct.len() < keys::CT_OVERHEAD {
+        return None;
+    }
+    let timer = crate::metrics::block_timer();
+    //nonce and tag are copied as well, ct may be outside
+    let nonce = GenericArray::clone_from_slice(&ct[..keys::NONCE_LEN]);
+    let (body, tag) = ct[keys::NONCE_LEN..].split_at(ct.len() - keys::CT_OVERHEAD);
+    let tag = GenericArray::clone_from_slice(tag);
+    let mut pt = body.to_vec();
+    CIPHER
+        .with(|cipher| cipher.decrypt_in_place_detached(&nonce, aad, &mut pt, &tag))
+        .ok()?;
+    crate::metrics::record_decrypt(pt.len(), timer);
+    Some(pt)
 }
 
 #[inline(always)]
@@ -132,88 +282,411 @@ pub fn ser_decrypt<T>(ct: &[u8]) -> T
 where
     T: serde::de::DeserializeOwned,
 {
-    bincode::deserialize(decrypt(ct).as_ref()).unwrap()
+    let pt = decrypt(ct);
+    let timer = crate::metrics::coding_timer();
+    let res = compress::decode(pt.as_ref());
+    crate::metrics::record_de(timer);
+    res
+}
+
+//for ciphertext outside enclave: it is streamed into the scratch buffer of the
+//thread and decrypted there, no per-block copy is allocated
+#[inline(always)]
+pub fn ser_decrypt_outside<T>(ct: &[u8]) -> T
+where
+    T: serde::de::DeserializeOwned,
+{
+    ser_decrypt_outside_checked(ct, None)
+}
+
+//same, and the block must be the one whose tag was recorded when it was cached
+#[inline(always)]
+pub fn ser_decrypt_outside_checked<T>(ct: &[u8], expected_tag: Option<&Tag>) -> T
+where
+    T: serde::de::DeserializeOwned,
+{
+    with_scratch(|buf| {
+        decrypt_untrusted_into(block_stats::body(ct), buf, expected_tag);
+        let timer = crate::metrics::coding_timer();
+        let res = compress::decode(buf.as_ref());
+        crate::metrics::record_de(timer);
+        res
+    })
+}
+
+//the generation of the cache of the host, in the host's memory, see
+//OpCache::outside
+static CACHE_GENERATION: AtomicUsize = AtomicUsize::new(0);
+
+pub fn set_cache_generation(generation: *const u64) {
+    assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(generation as *const u8, std::mem::size_of::<u64>()), "invalid cache generation");
+    CACHE_GENERATION.store(generation as usize, atomic::Ordering::Release);
+}
+
+//None until the host set it, nothing is mirrored then
+fn host_cache_generation() -> Option<u64> {
+    let ptr = CACHE_GENERATION.load(atomic::Ordering::Acquire) as *const u64;
+    if ptr.is_null() {
+        return None;
+    }
+    Some(unsafe { std::ptr::read_volatile(ptr) })
+}
+
+pub fn set_enc_block_bytes(bytes: usize) {
+    ENC_BLOCK_BYTES.store(std::cmp::max(bytes, 1), atomic::Ordering::Relaxed);
+}
+
+pub fn enc_block_bytes() -> usize {
+    ENC_BLOCK_BYTES.load(atomic::Ordering::Relaxed)
+}
+
+//cuts a slice into encryption blocks of about ENC_BLOCK_BYTES each, a block
+//has at least one item and ends with the item that reaches the target
+pub struct EncBlocks<'a, T> {
+    rest: &'a [T],
+    target: usize,
+}
+
+impl<'a, T: DeepSizeOf> Iterator for EncBlocks<'a, T> {
+    type Item = &'a [T];
+
+    fn next(&mut self) -> Option<&'a [T]> {
+        if self.rest.is_empty() {
+            return None;
+        }
+        let mut bytes = 0;
+        let mut len = 0;
+        while len < self.rest.len() && (len == 0 || bytes < self.target) {
+            bytes += self.rest[len].deep_size_of();
+            len += 1;
+        }
+        let (block, rest) = self.rest.split_at(len);
+        self.rest = rest;
+        Some(block)
+    }
+}
+
+pub fn enc_blocks<T: DeepSizeOf>(data: &[T]) -> EncBlocks<'_, T> {
+    EncBlocks {
+        rest: data,
+        target: enc_block_bytes(),
+    }
+}
+
+//cuts items into encryption blocks of about ENC_BLOCK_BYTES as they come, for
+//ops whose output is never held as a whole
+pub struct BlockWriter<T> {
+    out: Vec<ItemE>,
+    buf: Vec<T>,
+    bytes: usize,
+}
+
+impl<T: Data> BlockWriter<T> {
+    pub fn new() -> Self {
+        BlockWriter {
+            out: create_enc(),
+            buf: Vec::new(),
+            bytes: 0,
+        }
+    }
+
+    pub fn push(&mut self, item: T) {
+        self.bytes += item.deep_size_of();
+        self.buf.push(item);
+        if self.bytes >= enc_block_bytes() {
+            self.flush();
+        }
+    }
+
+    fn flush(&mut self) {
+        if !self.buf.is_empty() {
+            let block_enc = batch_encrypt(&self.buf, true);
+            combine_enc(&mut self.out, block_enc);
+            self.buf.clear();
+        }
+        self.bytes = 0;
+    }
+
+    pub fn finish(mut self) -> Vec<ItemE> {
+        self.flush();
+        self.out
+    }
 }
 
 pub fn batch_encrypt<T: Data>(data: &[T], is_enc_outside: bool) -> Vec<ItemE> 
 {
     if is_enc_outside {
-        let acc = create_enc();
-        data.chunks(MAX_ENC_BL).map(|x| ser_encrypt(x)).fold(acc, |mut acc, x| {
-            crate::ALLOCATOR.set_switch(true);
-            acc.push(x.clone());
-            crate::ALLOCATOR.set_switch(false);
-            acc
-        })
+        let blocks = enc_blocks(data).collect::<Vec<_>>();
+        let mut acc = create_enc_with_capacity(blocks.len());
+        for x in blocks {
+            let block_enc = ser_encrypt_outside_counted(x);
+            push_enc(&mut acc, block_enc);
+        }
+        acc
     } else {
-        data.chunks(MAX_ENC_BL).map(|x| ser_encrypt(x)).collect::<Vec<_>>()
+        enc_blocks(data).map(|x| ser_encrypt_counted(x)).collect::<Vec<_>>()
     }
 }
 
+//encrypt the buckets of a shuffle task straight into outside memory
+pub fn batch_encrypt_buckets<T: Data>(buckets: Vec<Vec<T>>) -> Vec<Vec<ItemE>> {
+    let mut buckets_enc = create_enc_with_capacity(buckets.len());
+    for bucket in buckets {
+        let bucket_enc = batch_encrypt(&bucket, true);
+        push_enc(&mut buckets_enc, bucket_enc);
+    }
+    buckets_enc
+}
+
 pub fn batch_decrypt<T: Data>(data_enc: &[ItemE], is_enc_outside: bool) -> Vec<T> 
 {
     if is_enc_outside {
-        data_enc.iter().map(|x| ser_decrypt::<Vec<T>>(&x.clone())).flatten().collect::<Vec<_>>()
+        data_enc.iter().map(|x| ser_decrypt_outside::<Vec<T>>(x)).flatten().collect::<Vec<_>>()
     } else {
         data_enc.iter().map(|x| ser_decrypt::<Vec<T>>(x)).flatten().collect::<Vec<_>>()
     }
 }
 
-//The result_enc stays inside
-pub fn res_enc_to_ptr<T: Clone>(result_enc: T) -> *mut u8 {
-    let result_ptr;
-    if crate::immediate_cout {
-        crate::ALLOCATOR.set_switch(true);
-        result_ptr = Box::into_raw(Box::new(result_enc.clone())) as *mut u8;
-        crate::ALLOCATOR.set_switch(false);
-    } else {
-        result_ptr = Box::into_raw(Box::new(result_enc)) as *mut u8;
+//folds every block of the partition in input with g and the partials with h,
+//which must be associative, as for reduce and aggregate. the first block is the
+//planner sample, the rest are split into contiguous ranges over the workers it
+//picks, and the partials of the ranges are combined pairwise in a tree
+pub fn fold_blocks<T, P, G, H>(op_id: OpId, input: Input, g: G, h: H) -> P
+where
+    T: Data,
+    P: Send + 'static,
+    G: Fn(Vec<T>) -> P + Clone + Send + 'static,
+    H: Fn(Vec<P>) -> P + Clone + Send + 'static,
+{
+    let data_enc = input.get_enc_data::<Vec<ItemE>>();
+    if data_enc.is_empty() {
+        return h(Vec::new());
+    }
+    let probe = planner::Probe::start();
+    let block = ser_decrypt_outside::<Vec<T>>(&data_enc[0]);
+    let len = block.len();
+    let first = g(block);
+    let sample = probe.stop(len, data_enc[0].len());
+    let rest = data_enc.len() - 1;
+    let threads = match rest {
+        0 => 0,
+        _ => {
+            let remaining = sample.remaining(rest, data_enc[1..].iter().map(|block| block.len()).sum());
+            min(planner::plan(op_id, planner::ParaStep::Aggregate, &sample, remaining), rest)
+        },
+    };
+    let mut partials = vec![first];
+    if threads == 0 {
+        for block in &data_enc[1..] {
+            partials.push(g(ser_decrypt_outside::<Vec<T>>(block)));
+        }
+        return h(partials);
+    }
+    let per_thread = (rest + threads - 1) / threads;
+    let mut handlers = Vec::with_capacity(threads);
+    for start in (1..data_enc.len()).step_by(per_thread) {
+        let end = min(start + per_thread, data_enc.len());
+        let (g, h) = (g.clone(), h.clone());
+        handlers.push(thread_pool::spawn(move || {
+            let data_enc = input.get_enc_data::<Vec<ItemE>>();
+            h(data_enc[start..end].iter().map(|block| g(ser_decrypt_outside::<Vec<T>>(block))).collect())
+        }));
+    }
+    partials.extend(handlers.into_iter().map(|handler| handler.join().unwrap()));
+    tree_combine(partials, h)
+}
+
+//combines the partials pairwise on the thread pool until one is left, in order
+fn tree_combine<P, H>(mut partials: Vec<P>, h: H) -> P
+where
+    P: Send + 'static,
+    H: Fn(Vec<P>) -> P + Clone + Send + 'static,
+{
+    while partials.len() > 1 {
+        let mut handlers = Vec::with_capacity(partials.len() / 2);
+        let mut iter = partials.into_iter();
+        let mut odd = None;
+        while let Some(a) = iter.next() {
+            match iter.next() {
+                Some(b) => {
+                    let h = h.clone();
+                    handlers.push(thread_pool::spawn(move || h(vec![a, b])));
+                },
+                None => odd = Some(a),
+            }
+        }
+        partials = handlers.into_iter().map(|handler| handler.join().unwrap()).collect();
+        partials.extend(odd);
+    }
+    partials.pop().unwrap()
+}
+
+//decrypts up to PIPELINE_DEPTH blocks ahead of the consumer on the thread pool,
+//so that AES overlaps with the closures applied to the previous block
+pub struct DecryptAhead<T: Data> {
+    //the blocks live outside enclave for the whole task, see Input
+    data_enc: usize,
+    next: usize,
+    end: usize,
+    tags: Option<Arc<Vec<Tag>>>,
+    pred: Option<block_stats::BlockPred>,
+    pending: VecDeque<TaskHandle<Vec<T>>>,
+}
+
+impl<T: Data> DecryptAhead<T> {
+    pub fn new(
+        data_enc: &Vec<ItemE>,
+        b: usize,
+        e: usize,
+        tags: Option<Arc<Vec<Tag>>>,
+        pred: Option<block_stats::BlockPred>,
+    ) -> Self {
+        DecryptAhead {
+            data_enc: data_enc as *const Vec<ItemE> as usize,
+            next: b,
+            end: std::cmp::min(e, data_enc.len()),
+            tags,
+            pred,
+            pending: VecDeque::with_capacity(PIPELINE_DEPTH),
+        }
     }
-    result_ptr
+}
+
+impl<T: Data> Iterator for DecryptAhead<T> {
+    type Item = Vec<T>;
+
+    fn next(&mut self) -> Option<Vec<T>> {
+        while self.pending.len() < PIPELINE_DEPTH && self.next < self.end {
+            let (data_enc, i, tags, pred) = (self.data_enc, self.next, self.tags.clone(), self.pred.clone());
+            self.pending.push_back(thread_pool::spawn(move || {
+                let data_enc = unsafe { &*(data_enc as *const Vec<ItemE>) };
+                decrypt_block::<T>(&data_enc[i], tags.as_ref().map(|tags| &tags[i]), pred.as_ref())
+            }));
+            self.next += 1;
+        }
+        self.pending.pop_front().map(|handle| handle.join().unwrap())
+    }
+}
+
+//the items of an input block, none if its stats show the filter above drops
+//them all
+fn decrypt_block<T: Data>(ct: &[u8], expected_tag: Option<&Tag>, pred: Option<&block_stats::BlockPred>) -> Vec<T> {
+    match pred {
+        Some(pred) if !pred.may_match(ct, expected_tag) => Vec::new(),
+        Some(pred) => pred.pick(ct, ser_decrypt_outside_checked::<Vec<T>>(ct, expected_tag)),
+        None => ser_decrypt_outside_checked::<Vec<T>>(ct, expected_tag),
+    }
+}
+
+//the result is written to outside memory once, and the host reads it in place
+pub fn res_enc_to_ptr<T: Clone>(result_enc: T) -> *mut u8 {
+    let _outside = crate::ALLOCATOR.outside();
+    Box::into_raw(Box::new(result_enc.clone())) as *mut u8
 }
 
 //acc stays outside enclave, and v stays inside enclave
 pub fn merge_enc<T: Clone>(acc: &mut Vec<T>, v: &T) {
-    crate::ALLOCATOR.set_switch(true);
+    let _outside = crate::ALLOCATOR.outside();
     let v = v.clone();
     acc.push(v);
-    crate::ALLOCATOR.set_switch(false);
+}
+
+//acc and v both stay outside enclave, v is moved rather than cloned
+pub fn push_enc<T>(acc: &mut Vec<T>, v: T) {
+    let _outside = crate::ALLOCATOR.outside();
+    acc.push(v);
 }
 
 pub fn combine_enc<T: Clone>(acc: &mut Vec<T>, mut other: Vec<T>) {
-    crate::ALLOCATOR.set_switch(true);
+    let _outside = crate::ALLOCATOR.outside();
     acc.append(&mut other);
     drop(other);
-    crate::ALLOCATOR.set_switch(false);
+}
+
+//moves the block pointers of an outside Vec<ItemE> into ptrs and frees the
+//outer buffer. the switch must be on, and ptrs must have room for all
+//blocks, as growing it here would allocate outside
+fn take_enc_blocks(blocks: Vec<ItemE>, ptrs: &mut Vec<*mut u8>) {
+    for block in blocks {
+        let mut block = std::mem::ManuallyDrop::new(block);
+        if block.capacity() != 0 && !crate::region::contains(block.as_mut_ptr()) {
+            debug_assert!(ptrs.len() < ptrs.capacity());
+            ptrs.push(block.as_mut_ptr());
+        }
+    }
+}
+
+//free an outside Vec<ItemE>, with all blocks returned to tcmalloc in one batch
+pub fn free_enc(res: Vec<ItemE>) {
+    let mut ptrs = Vec::with_capacity(res.len());
+    {
+        let _outside = crate::ALLOCATOR.outside();
+        take_enc_blocks(res, &mut ptrs);
+    }
+    crate::ALLOCATOR.free_batch(&mut ptrs);
+}
+
+//same as free_enc, for the bucketed output of shuffle dependencies
+pub fn free_enc_buckets(res: Vec<Vec<Vec<ItemE>>>) {
+    let num_blocks = res.iter().flatten().map(|bucket| bucket.len()).sum();
+    let mut ptrs = Vec::with_capacity(num_blocks);
+    {
+        let _outside = crate::ALLOCATOR.outside();
+        for buckets in res {
+            for bucket in buckets {
+                take_enc_blocks(bucket, &mut ptrs);
+            }
+        }
+    }
+    crate::ALLOCATOR.free_batch(&mut ptrs);
 }
 
 pub fn create_enc<T: Clone>() -> Vec<T> {
-    crate::ALLOCATOR.set_switch(true);
-    let acc = Vec::new();
-    crate::ALLOCATOR.set_switch(false);
-    acc
+    let _outside = crate::ALLOCATOR.outside();
+    Vec::new()
+}
+
+//same as create_enc, but reserves room for cap items up front so the
+//accumulator is not copied each time it outgrows its buffer
+pub fn create_enc_with_capacity<T: Clone>(cap: usize) -> Vec<T> {
+    let _outside = crate::ALLOCATOR.outside();
+    Vec::with_capacity(cap)
+}
+
+//the blocks of the head, when they reach an op that hands them on unchanged
+//(a union or a coalesce) right above it, as for one that is cached or
+//collected. they are copied out as they are instead of being decrypted and
+//encrypted again, see Op::head_blocks
+pub fn forward_head_blocks<T: Data>(call_seq: &NextOpId, input: &Input) -> Option<*mut u8> {
+    if !call_seq.next_is_head() {
+        return None;
+    }
+    let mut head_seq = call_seq.clone();
+    let opb = head_seq.get_next_op().clone();
+    let op = opb.to_arc_op::<dyn Op<Item = T>>().unwrap();
+    let blocks = op.head_blocks(&head_seq, input)?;
+    let acc = {
+        let _outside = crate::ALLOCATOR.outside();
+        blocks.iter()
+            .map(|block| block_stats::body(block).to_vec())
+            .collect::<Vec<ItemE>>()
+    };
+    Some(to_ptr(acc))
 }
 
 //The result_enc stays outside
 pub fn to_ptr<T: Clone>(result_enc: T) -> *mut u8 {
-    crate::ALLOCATOR.set_switch(true);
-    let result_ptr = Box::into_raw(Box::new(result_enc)) as *mut u8;
-    crate::ALLOCATOR.set_switch(false);
-    result_ptr
+    let _outside = crate::ALLOCATOR.outside();
+    Box::into_raw(Box::new(result_enc)) as *mut u8
 }
 
 #[track_caller]
 fn get_text_loc_id() -> u64 {
     let loc = Location::caller();
-    let file = loc.file().replace("_", "");
-    let line = loc.line();
-    let num = 0;
-    let id = OpId::new(
-        &file,
-        line,
-        num,
-    ).h;
-    id
+    //the file is hashed without its underscores, as named on the host
+    let h = fnv1a_skipping(FNV_OFFSET, loc.file().as_bytes(), Some(b'_'));
+    let loc_hash = fnv1a_skipping(h, &loc.line().to_le_bytes(), None);
+    OpId::at(loc_hash, 0).h
 }
 
 #[repr(C)]
@@ -522,6 +995,22 @@ impl TailCompInfo {
     pub fn clear(&mut self) {
         self.m.clear();
     }
+
+    //the entries of other replace those of the same id, other may be outside
+    pub fn merge(&mut self, other: &TailCompInfo) {
+        for (id, ser) in other.m.iter() {
+            self.m.insert(*id, ser.clone());
+        }
+    }
+}
+
+pub type Tag = [u8; keys::TAG_LEN];
+
+//the GCM tag at the end of a block
+fn block_tag(ct: &[u8]) -> Tag {
+    let mut tag = [0; keys::TAG_LEN];
+    tag.copy_from_slice(&ct[ct.len() - keys::TAG_LEN..]);
+    tag
 }
 
 #[derive(Clone)]
@@ -529,30 +1018,250 @@ pub struct OpCache {
     //temperarily save the point of data, which is ready to sent out
     // <(cached_rdd_id, part_id), data ptr>
     out_map: Arc<RwLock<HashMap<(usize, usize), usize>>>,
+    //tags of the blocks in out_map, in block order
+    out_tags: Arc<RwLock<HashMap<(usize, usize), Vec<Tag>>>>,
+    //tags of the partitions handed to the host. a block is authenticated by its
+    //own tag already, the index makes sure a partition read back has exactly
+    //the blocks it was cached with, in that order, and is checked block by
+    //block as the blocks are decrypted
+    index: Arc<RwLock<HashMap<(usize, usize), Arc<Vec<Tag>>>>>,
+    //blocks to cache that the pool is still encrypting, by partition in the
+    //order they were produced
+    pending: Arc<Mutex<HashMap<(usize, usize), VecDeque<TaskHandle<Vec<ItemE>>>>>>,
+    //entries of the key index of the blocks in out_map, None for a partition
+    //some of whose blocks were not indexed, see key_index.rs
+    staged_keys: Arc<Mutex<HashMap<(usize, usize), Option<Vec<key_index::Entry>>>>>,
+    //key indexes of the partitions handed to the host, next to their tags
+    key_indexes: Arc<RwLock<HashMap<(usize, usize), Arc<key_index::KeyIndex>>>>,
+    //pointers the host handed out for partitions cached outside, so a lookup
+    //that hits makes no ocall. out_map cannot serve, the host may move the
+    //blocks it is handed
+    outside: Arc<RwLock<OutsideMirror>>,
+}
+
+//a pointer handed out at a generation of the host cache stays good until the
+//host logs an invalidation of its partition after that one. the lookups come
+//from ecalls that pinned the cache, an eviction during one keeps the blocks
+//alive, an eviction before it bumped the generation the next lookup reads
+#[derive(Default)]
+struct OutsideMirror {
+    //the invalidations up to it are applied
+    generation: u64,
+    ptrs: HashMap<(usize, usize), usize>,
 }
 
+//words of the invalidations pulled at once, in (rdd_id, part_id) pairs
+const INVALIDATION_BATCH: usize = 2 * 512;
+
 impl OpCache{
     pub fn new() -> Self {
         OpCache {
             out_map: Arc::new(RwLock::new(HashMap::new())),
+            out_tags: Arc::new(RwLock::new(HashMap::new())),
+            index: Arc::new(RwLock::new(HashMap::new())),
+            pending: Arc::new(Mutex::new(HashMap::new())),
+            staged_keys: Arc::new(Mutex::new(HashMap::new())),
+            key_indexes: Arc::new(RwLock::new(HashMap::new())),
+            outside: Arc::new(RwLock::new(OutsideMirror::default())),
         }
     }
 
+    //the mirrored pointer of a partition cached outside, after catching up
+    //with the invalidations of the host if its generation moved
+    pub fn get_outside(&self, key: (usize, usize)) -> Option<usize> {
+        let host = host_cache_generation()?;
+        {
+            let outside = self.outside.read().unwrap();
+            if outside.generation == host {
+                return outside.ptrs.get(&key).copied();
+            }
+        }
+        let mut outside = self.outside.write().unwrap();
+        let mut keys = vec![0usize; INVALIDATION_BATCH];
+        //a batch that filled up covers less than asked, pull again
+        while outside.generation < host {
+            let mut covered = 0;
+            let mut num_keys = 0;
+            crate::ALLOCATOR.count_ocall();
+            let sgx_status = unsafe {
+                ocall_cache_invalidations(&mut covered, outside.generation,
+                    keys.as_mut_ptr(), keys.len(), &mut num_keys)
+            };
+            match sgx_status {
+                sgx_status_t::SGX_SUCCESS => {},
+                _ => {
+                    panic!("[-] OCALL Enclave Failed {}!", sgx_status.as_str());
+                }
+            }
+            if num_keys == usize::MAX {
+                outside.ptrs.clear();
+            } else {
+                for pair in keys[..std::cmp::min(num_keys, keys.len())].chunks_exact(2) {
+                    outside.ptrs.remove(&(pair[0], pair[1]));
+                }
+            }
+            if covered <= outside.generation {
+                //the host went backwards, trust nothing
+                outside.ptrs.clear();
+                outside.generation = host;
+                break;
+            }
+            outside.generation = covered;
+        }
+        outside.ptrs.get(&key).copied()
+    }
+
+    //a pointer the host handed out at generation, unless invalidations after
+    //it were applied already
+    pub fn put_outside(&self, key: (usize, usize), ptr: usize, generation: u64) {
+        if generation == u64::MAX {
+            return;
+        }
+        let mut outside = self.outside.write().unwrap();
+        if generation >= outside.generation {
+            outside.ptrs.insert(key, ptr);
+        }
+    }
+
+    //encrypt a block to cache on the pool. at most PIPELINE_DEPTH blocks of a
+    //partition are in flight, beyond that the oldest one is waited for, which
+    //bounds the plaintext kept alive for them
+    pub fn encrypt_to_outside<F>(&self, key: (usize, usize), job: F)
+    where
+        F: FnOnce() -> Vec<ItemE> + Send + 'static,
+    {
+        let oldest = {
+            let mut pending = self.pending.lock().unwrap();
+            let queue = pending.entry(key).or_insert_with(VecDeque::new);
+            queue.push_back(thread_pool::spawn(job));
+            if queue.len() > PIPELINE_DEPTH {
+                queue.pop_front()
+            } else {
+                None
+            }
+        };
+        //joined without the lock, the joining thread may run other jobs meanwhile
+        if let Some(handle) = oldest {
+            self.append_enc(key, handle.join().unwrap());
+        }
+    }
+
+    //wait for the blocks of key still being encrypted and append them
+    fn drain(&self, key: (usize, usize)) {
+        let queue = self.pending.lock().unwrap().remove(&key);
+        for handle in queue.into_iter().flatten() {
+            self.append_enc(key, handle.join().unwrap());
+        }
+    }
+
+    //ct is outside and already encrypted, it goes after the blocks produced
+    //before it
+    pub fn put_enc(&self, key: (usize, usize), ct: Vec<ItemE>) {
+        self.drain(key);
+        self.staged_keys.lock().unwrap().insert(key, None);
+        self.append_enc(key, ct);
+    }
+
+    fn append_enc(&self, key: (usize, usize), ct: Vec<ItemE>) {
+        let mut out_map = self.out_map.write().unwrap();
+        self.record_tags(key, &ct);
+        let acc = match out_map.remove(&key) {
+            Some(ptr) => {
+                //restored even if combine_enc panics
+                let acc = {
+                    let _outside = crate::ALLOCATOR.outside();
+                    let mut acc = *unsafe { Box::from_raw(ptr as *mut Vec<ItemE>) };
+                    combine_enc(&mut acc, ct);
+                    acc
+                };
+                to_ptr(acc)
+            },
+            None => to_ptr(ct), 
+        } as usize;
+        out_map.insert(key, acc);
+    }
+
+    //the completion barrier of caching, the partition is handed to the host
+    //once all of its blocks are encrypted
     pub fn send(&self, key: (usize, usize)) {
+        self.drain(key);
+        PLAIN_CACHE.commit(key);
         if let Some(ct_ptr) = self.out_map.write().unwrap().remove(&key) {
+            self.commit_tags(key);
             let mut res = 0;
+            crate::ALLOCATOR.count_ocall();
             unsafe { ocall_cache_to_outside(&mut res, key.0, key.1, ct_ptr); }
             //TODO: Handle the case res != 0
         }
     }
 
     pub fn clear(&self) {
+        let keys = self.pending.lock().unwrap().keys().copied().collect::<Vec<_>>();
+        for key in keys {
+            self.drain(key);
+        }
         let out_map = std::mem::take(&mut *self.out_map.write().unwrap());
         //normally the map is empty, and it should not enter the following loop
         for ((rdd_id, part_id), data_ptr) in out_map.into_iter() {
+            self.commit_tags((rdd_id, part_id));
+            PLAIN_CACHE.commit((rdd_id, part_id));
             let mut res = 0;
+            crate::ALLOCATOR.count_ocall();
             unsafe { ocall_cache_to_outside(&mut res, rdd_id, part_id, data_ptr); }
         }
+        PLAIN_CACHE.clear_staged();
+    }
+
+    //drop what is known of the partitions handed out, after clear. the host
+    //frees their blocks
+    pub fn forget(&self) {
+        self.index.write().unwrap().clear();
+        self.out_tags.write().unwrap().clear();
+        self.staged_keys.lock().unwrap().clear();
+        self.key_indexes.write().unwrap().clear();
+        self.outside.write().unwrap().ptrs.clear();
+        PLAIN_CACHE.clear();
+    }
+
+    fn record_tags(&self, key: (usize, usize), ct: &[ItemE]) {
+        let mut out_tags = self.out_tags.write().unwrap();
+        out_tags.entry(key).or_insert_with(Vec::new).extend(ct.iter().map(|x| block_tag(x)));
+    }
+
+    //a partition cached again, e.g. after the host evicted it, replaces the old tags
+    fn commit_tags(&self, key: (usize, usize)) {
+        let tags = self.out_tags.write().unwrap().remove(&key).unwrap_or_default();
+        let staged = self.staged_keys.lock().unwrap().remove(&key).flatten();
+        match staged.and_then(|entries| key_index::KeyIndex::new(entries, &tags)) {
+            Some(key_index) => self.key_indexes.write().unwrap().insert(key, Arc::new(key_index)),
+            None => self.key_indexes.write().unwrap().remove(&key),
+        };
+        self.index.write().unwrap().insert(key, Arc::new(tags));
+    }
+
+    //entries of blocks of key being encrypted, see key_index::batch_encrypt_indexed
+    pub fn stage_keys(&self, key: (usize, usize), entries: Vec<key_index::Entry>) {
+        let mut staged_keys = self.staged_keys.lock().unwrap();
+        if let Some(staged) = staged_keys.entry(key).or_insert_with(|| Some(Vec::new())) {
+            staged.extend(entries);
+        }
+    }
+
+    //None if the partition was cached without a key index
+    pub fn key_index(&self, key: (usize, usize)) -> Option<Arc<key_index::KeyIndex>> {
+        self.key_indexes.read().unwrap().get(&key).cloned()
+    }
+
+    //None if the partition was not cached by this enclave
+    pub fn tags(&self, key: (usize, usize)) -> Option<Arc<Vec<Tag>>> {
+        self.index.read().unwrap().get(&key).cloned()
+    }
+
+    //the tags of a partition this enclave cached before a restart, see
+    //cache_seal.rs
+    pub fn restore_tags(&self, key: (usize, usize), tags: Vec<Tag>) {
+        self.key_indexes.write().unwrap().remove(&key);
+        self.index.write().unwrap().insert(key, Arc::new(tags));
     }
 
 }
@@ -562,15 +1271,101 @@ pub struct OpId {
     h: u64,
 }
 
+const FNV_OFFSET: u64 = 0xcbf29ce484222325;
+const FNV_PRIME: u64 = 0x100000001b3;
+
+//FNV-1a of bytes continued from h, leaving out the bytes equal to skip, the
+//same hash as the op ids of the host (see OpId in framework/src/rdd/rdd.rs)
+const fn fnv1a_skipping(mut h: u64, bytes: &[u8], skip: Option<u8>) -> u64 {
+    let mut i = 0;
+    while i < bytes.len() {
+        let skipped = match skip {
+            Some(skip) => bytes[i] == skip,
+            None => false,
+        };
+        if !skipped {
+            h ^= bytes[i] as u64;
+            h = h.wrapping_mul(FNV_PRIME);
+        }
+        i += 1;
+    }
+    h
+}
+
 impl OpId {
     pub fn new(file: &str, line: u32, num: usize) -> Self {
-        let h = default_hash(&(file.to_string(), line, num));
+        OpId::at(OpId::loc_hash(file, line), num)
+    }
+
+    //hash of a call site, the ops made at it are numbered under
+    pub const fn loc_hash(file: &str, line: u32) -> u64 {
+        let h = fnv1a_skipping(FNV_OFFSET, file.as_bytes(), None);
+        fnv1a_skipping(h, &line.to_le_bytes(), None)
+    }
+
+    pub const fn at(loc_hash: u64, num: usize) -> Self {
         OpId {
-            h,
+            h: fnv1a_skipping(loc_hash, &(num as u64).to_le_bytes(), None),
         }
     }
 }
 
+//captured variable table of secure_execute, laid out by the host (see
+//CapturedVarTable in framework/src/rdd/rdd.rs)
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct CapturedVarEntry {
+    rdd_id: usize,
+    //hash of the serialized vars, changes whenever they do
+    version: u64,
+    vars: *const Vec<Vec<u8>>,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct CapturedVarTable {
+    entries: *const CapturedVarEntry,
+    len: usize,
+}
+
+lazy_static! {
+    //the latest captured vars per rdd, shared by all tasks until the version
+    //changes, so a model captured by kmeans or lr is copied in once per
+    //iteration rather than once per partition
+    static ref CAPTURED_VARS: RwLock<HashMap<usize, (u64, Arc<Vec<Vec<u8>>>)>> = RwLock::new(HashMap::new());
+}
+
+//captured vars come from the host in any case, so trusting its version only
+//decides when they are copied in, the copy being used lives inside
+pub fn load_captured_vars(table: *const u8) -> HashMap<usize, Arc<Vec<Vec<u8>>>> {
+    let table_size = std::mem::size_of::<CapturedVarTable>();
+    assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(table, table_size), "invalid captured var table");
+    let table = unsafe { std::ptr::read(table as *const CapturedVarTable) };
+    if table.len == 0 {
+        return HashMap::new();
+    }
+    let entries_size = table.len.checked_mul(std::mem::size_of::<CapturedVarEntry>()).expect("invalid captured var table");
+    assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(table.entries as *const u8, entries_size), "invalid captured var table");
+    let entries = unsafe { std::slice::from_raw_parts(table.entries, table.len) }.to_vec();
+    let mut captured_vars = HashMap::with_capacity(entries.len());
+    for entry in entries {
+        let cached = CAPTURED_VARS.read().unwrap().get(&entry.rdd_id)
+            .filter(|(version, _)| *version == entry.version)
+            .map(|(_, vars)| vars.clone());
+        let vars = match cached {
+            Some(vars) => vars,
+            None => {
+                assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(entry.vars as *const u8, std::mem::size_of::<Vec<Vec<u8>>>()), "invalid captured var table");
+                let vars = Arc::new(unsafe { &*entry.vars }.clone());
+                CAPTURED_VARS.write().unwrap().insert(entry.rdd_id, (entry.version, vars.clone()));
+                vars
+            }
+        };
+        captured_vars.insert(entry.rdd_id, vars);
+    }
+    captured_vars
+}
+
 #[derive(Clone, Debug)]
 pub struct NextOpId {
     tid: u64,
@@ -579,13 +1374,20 @@ pub struct NextOpId {
     part_ids: Vec<usize>,
     cur_idx: usize,
     cache_meta: CacheMeta,
-    captured_vars: HashMap<usize, Vec<Vec<u8>>>,
+    captured_vars: HashMap<usize, Arc<Vec<Vec<u8>>>>,
     is_shuffle: bool,
     pub para_range: Option<(usize, usize)>,
-    //if the decryption step and the narrow processing parallelizable 
-    pub is_step_para: (bool, bool, bool),
-    //used to decide is_step_para
+    //worker threads of the decryption step and the narrow processing, 0 if sequential
+    pub para_threads: (usize, usize, usize),
+    //used to decide para_threads
     pub sample_len: usize,
+    pub probe: Option<planner::Probe>,
+    //tags of the cached partition parallel_control is about to decrypt, see OpCache
+    pub cached_tags: Option<Arc<Vec<Tag>>>,
+    //set by a filter right above the head, see block_stats
+    pub block_pred: Option<block_stats::BlockPred>,
+    //whether parallel_control decrypted the blocks through block_pred
+    pub block_pred_applied: bool,
 }
 
 impl<'a> NextOpId {
@@ -594,7 +1396,7 @@ impl<'a> NextOpId {
         op_ids: Vec<OpId>, 
         part_ids: Vec<usize>, 
         cache_meta: CacheMeta, 
-        captured_vars: HashMap<usize, Vec<Vec<u8>>>, 
+        captured_vars: HashMap<usize, Arc<Vec<Vec<u8>>>>, 
         dep_info: &DepInfo,
     ) -> Self {
         let is_shuffle = dep_info.is_shuffle == 1;
@@ -608,8 +1410,12 @@ impl<'a> NextOpId {
             captured_vars,
             is_shuffle,
             para_range: None,
-            is_step_para: (true, true, true),
+            para_threads: (max_thread(), max_thread(), max_thread()),
             sample_len: 0,
+            probe: None,
+            cached_tags: None,
+            block_pred: None,
+            block_pred_applied: false,
         }
     }
 
@@ -638,7 +1444,7 @@ impl<'a> NextOpId {
 
     pub fn get_ser_captured_var(&self) -> Option<&Vec<Vec<u8>>> {
         let cur_rdd_id = self.get_cur_rdd_id();
-        self.captured_vars.get(&cur_rdd_id)
+        self.captured_vars.get(&cur_rdd_id).map(|vars| &**vars)
     }
 
     pub fn get_caching_doublet(&self) -> (usize, usize) {
@@ -674,12 +1480,16 @@ impl<'a> NextOpId {
     pub fn is_head(&self) -> bool {
         self.cur_idx == self.rdd_ids.len() - 1
     }
+
+    pub fn next_is_head(&self) -> bool {
+        self.cur_idx + 2 == self.rdd_ids.len()
+    }
 }
 
 #[derive(Default)]
 pub struct Context {
-    last_loc_file: RwLock<&'static str>,
-    last_loc_line: AtomicU32,
+    //OpId::loc_hash of the call site of the last op id
+    last_loc: AtomicU64,
     num: AtomicUsize,
     in_loop: AtomicBool,
     is_tail_comp: AtomicBool,
@@ -688,8 +1498,7 @@ pub struct Context {
 impl Context {
     pub fn new() -> Result<Arc<Self>> {
         Ok(Arc::new(Context {
-            last_loc_file: RwLock::new("null"),
-            last_loc_line: AtomicU32::new(0), 
+            last_loc: AtomicU64::new(0),
             num: AtomicUsize::new(0),
             in_loop: AtomicBool::new(false),
             is_tail_comp: AtomicBool::new(false),
@@ -720,28 +1529,22 @@ impl Context {
         self.is_tail_comp.load(atomic::Ordering::SeqCst)
     }
 
+    //the host numbers the broadcasts, so this handle is a placeholder until
+    //the one the host captured replaces it with the captured vars
+    pub fn broadcast<T: Data>(self: &Arc<Self>, _value: &Text<T, ItemE>) -> BroadcastVar<T> {
+        BroadcastVar::default()
+    }
+
     pub fn new_op_id(self: &Arc<Self>, loc: &'static Location<'static>) -> OpId {
         use atomic::Ordering::SeqCst;
-        let file = loc.file();
-        let line = loc.line();
-        
-        let num = if *self.last_loc_file.read().unwrap() != file || self.last_loc_line.load(SeqCst) != line {
-            *self.last_loc_file.write().unwrap() = file;
-            self.last_loc_line.store(line, SeqCst);
+        let loc_hash = OpId::loc_hash(loc.file(), loc.line());
+        let num = if self.last_loc.swap(loc_hash, SeqCst) != loc_hash {
             self.num.store(0, SeqCst);
             0
         } else {
             self.num.load(SeqCst)
         };
-        
-        let op_id = 
-        OpId::new(
-            file,
-            line,
-            num,
-        );
-        //println!("op, file = {:?}, line = {:?}, num = {:?}, op_id = {:?}", file, line, num, op_id);
-        op_id
+        OpId::at(loc_hash, num)
     }
 
     #[track_caller]
@@ -800,8 +1603,6 @@ impl OpVals {
 }
 
 pub trait OpBase: Send + Sync {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo);
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo);
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo);
     fn fix_split_num(&self, split_num: usize) {
         unreachable!()
@@ -829,8 +1630,9 @@ pub trait OpBase: Send + Sync {
     //supplement
     fn sup_next_shuf_dep(&self, dep_info: &DepInfo, reduce_num: usize) {
         let cur_key = dep_info.get_op_key();
-        let next_deps = self.get_next_deps().read().unwrap().clone();
-        match next_deps.get(&cur_key) {
+        //only the entry is cloned, a loop supplements the same deps every iteration
+        let next_dep = self.get_next_deps().read().unwrap().get(&cur_key).cloned();
+        match next_dep {
             None => {  //not exist, add the dependency
                 let child = load_opmap().get(&cur_key.1).unwrap();
                 for value in child.get_deps() {
@@ -859,9 +1661,8 @@ pub trait OpBase: Send + Sync {
         }
     }
     fn sup_next_nar_dep(&self, child: OpId) {
-        let next_deps = self.get_next_deps().read().unwrap().clone();
         let parent = self.get_op_id();
-        let next_dep = next_deps.get(&(parent, child));
+        let next_dep = self.get_next_deps().read().unwrap().get(&(parent, child)).cloned();
         match next_dep {
             None => {
                 self.get_next_deps().write().unwrap().insert(
@@ -934,14 +1735,6 @@ impl Ord for dyn OpBase {
 }
 
 impl<I: Op + ?Sized> OpBase for SerArc<I> {
-    //need to avoid freeing the encrypted data for subsequent "clone_enc_data_out"
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        (**self).build_enc_data_sketch(p_buf, p_data_enc, dep_info);
-    }
-    //need to free the encrypted data. But how to deal with task failure?
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        (**self).clone_enc_data_out(p_out, p_data_enc, dep_info);
-    }
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         (**self).call_free_res_enc(res_ptr, is_enc, dep_info);
     }
@@ -1000,9 +1793,15 @@ impl<I: Op + ?Sized> Op for SerArc<I> {
     fn compute(&self, call_seq: &mut NextOpId, input: Input) -> ResIter<Self::Item> {
         (**self).compute(call_seq, input)
     }
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        (**self).compute_blocks(call_seq, input)
+    }
     fn cache(&self, data: Vec<Self::Item>) {
         (**self).cache(data);
     }
+    fn head_blocks<'a>(&self, call_seq: &NextOpId, input: &'a Input) -> Option<&'a Vec<ItemE>> {
+        (**self).head_blocks(call_seq, input)
+    }
 }
 
 
@@ -1027,6 +1826,10 @@ pub trait Op: OpBase + 'static {
         }
         
         let data_enc = input.get_enc_data::<Vec<ItemE>>();
+        if need_cache {
+            //the partition cached must hold every item
+            call_seq.block_pred = None;
+        }
         let res_iter = self.parallel_control(call_seq, data_enc);
         
         if need_cache {
@@ -1038,23 +1841,66 @@ pub trait Op: OpBase + 'static {
         }
         res_iter
     }
+    //compute with every block collected. Chained narrow ops (map, flat_map,
+    //map_values) override it to run their function over whole blocks of the
+    //op before them, in one loop monomorphized for the op, so an item costs a
+    //virtual call where the chain starts and where it ends instead of one per
+    //op in between
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        Box::new(self.compute(call_seq, input).map(|block| block.collect::<Vec<_>>()))
+    }
     fn cache(&self, data: Vec<Self::Item>) {
         ()
     }
-    fn cache_from_outside(&self, key: (usize, usize)) -> Option<&'static Vec<ItemE>> {
-        let mut ptr: usize = 0;
-        let sgx_status = unsafe { 
-            ocall_cache_from_outside(&mut ptr, key.0, key.1)
-        };
-        match sgx_status {
-            sgx_status_t::SGX_SUCCESS => {},
-            _ => {
-                panic!("[-] OCALL Enclave Failed {}!", sgx_status.as_str());
-            }
+    //the encrypted blocks this op, at the head, would hand on without changing
+    //an item, none if it computes its items. a union right above forwards them
+    //as they are, see forward_head_blocks
+    fn head_blocks<'a>(&self, call_seq: &NextOpId, input: &'a Input) -> Option<&'a Vec<ItemE>> {
+        self.cached_blocks(call_seq)
+    }
+    //the partition cached outside, if this op reads it. the tags are checked
+    //here as the blocks are not decrypted
+    fn cached_blocks(&self, call_seq: &NextOpId) -> Option<&'static Vec<ItemE>> {
+        if !call_seq.have_cache() {
+            return None;
         }
-        if ptr == 0 {
+        let key = call_seq.get_cached_doublet();
+        //staged inside for parallel processing, there is no ciphertext to forward
+        if self.get_cache_space().lock().unwrap().contains_key(&key) {
             return None;
         }
+        let blocks = self.cache_from_outside(key)?;
+        if let Some(tags) = CACHE.tags(key) {
+            assert!(tags.len() == blocks.len()
+                && blocks.iter().zip(tags.iter()).all(|(block, tag)| block_tag(block_stats::body(block)) == *tag),
+                "cached partition was tampered with");
+        }
+        Some(blocks)
+    }
+    fn cache_from_outside(&self, key: (usize, usize)) -> Option<&'static Vec<ItemE>> {
+        let ptr = match CACHE.get_outside(key) {
+            Some(ptr) => ptr,
+            None => {
+                let mut ptr: usize = 0;
+                let mut generation = u64::MAX;
+                crate::ALLOCATOR.count_ocall();
+                let sgx_status = unsafe { 
+                    ocall_cache_from_outside(&mut ptr, key.0, key.1, &mut generation)
+                };
+                match sgx_status {
+                    sgx_status_t::SGX_SUCCESS => {},
+                    _ => {
+                        panic!("[-] OCALL Enclave Failed {}!", sgx_status.as_str());
+                    }
+                }
+                if ptr == 0 {
+                    return None;
+                }
+                assert!(sgx_trts::trts::rsgx_raw_is_outside_enclave(ptr as *const u8, std::mem::size_of::<Vec<ItemE>>()), "invalid cached partition");
+                CACHE.put_outside(key, ptr, generation);
+                ptr
+            },
+        };
         /*
         let ct_ = unsafe {
             Box::from_raw(ptr as *mut u8 as *mut Vec<ItemE>)
@@ -1068,28 +1914,20 @@ pub trait Op: OpBase + 'static {
         }.unwrap())
     }
 
-    fn cache_to_outside(&self, key: (usize, usize), value: &Vec<Self::Item>) -> Option<PThread> {
-        //let handle = unsafe {
-        //    PThread::new(Box::new(move || {
-        let ct = batch_encrypt(value, true);
-        //println!("finish encryption, memory usage {:?} B", crate::ALLOCATOR.get_memory_usage());
-        let mut out_map = CACHE.out_map.write().unwrap();
-        let acc = match out_map.remove(&key) {
-            Some(ptr) => {
-                crate::ALLOCATOR.set_switch(true);
-                let mut acc = *unsafe { Box::from_raw(ptr as *mut Vec<ItemE>) };
-                combine_enc(&mut acc, ct);
-                crate::ALLOCATOR.set_switch(false);
-                to_ptr(acc)
-            },
-            None => to_ptr(ct), 
-        } as usize;
-        out_map.insert(key, acc);
-        //println!("finish copy out, memory usage {:?} B", crate::ALLOCATOR.get_memory_usage());
-        //    }))
-        //}.unwrap();
-        //Some(handle)
-        None
+    //the block is encrypted on the pool while the compute iterator goes on,
+    //CACHE.send waits for it. the keys of a partitioned op are indexed for
+    //lookup, see key_index.rs
+    fn cache_to_outside(&self, key: (usize, usize), value: Arc<Vec<Self::Item>>) {
+        if self.partitioner().is_some() {
+            CACHE.encrypt_to_outside(key, move || key_index::batch_encrypt_indexed(key, &value));
+        } else {
+            CACHE.encrypt_to_outside(key, move || batch_encrypt(&value, true));
+        }
+    }
+
+    //ct is outside and already encrypted, e.g. copied from the input blocks
+    fn cache_enc_to_outside(&self, key: (usize, usize), ct: Vec<ItemE>) {
+        CACHE.put_enc(key, ct);
     }
 
     fn get_and_remove_cached_data(&self, call_seq: &mut NextOpId) -> ResIter<Self::Item> {
@@ -1117,7 +1955,6 @@ pub trait Op: OpBase + 'static {
                             (data, v.is_empty())
                         };
                         if is_empty {
-                            println!("remove cache key");
                             l.remove(&key).unwrap();
                         }
                         Box::new(data.into_iter().map(|item| Box::new(item.into_iter()) as Box<dyn Iterator<Item = _>>))
@@ -1133,14 +1970,23 @@ pub trait Op: OpBase + 'static {
                     };
                     call_seq.sample_len = sample_data.len();
                     //profile begin
-                    crate::ALLOCATOR.reset_alloc_cnt();
+                    call_seq.probe = Some(planner::Probe::start());
                     Box::new(vec![sample_data].into_iter().map(move |data| {
                         Box::new(data.into_iter()) as Box<dyn Iterator<Item = _>>
                     }))
                 }
             }
+        } else if let Some(blocks) = PLAIN_CACHE.get::<Self::Item>(key).filter(|_| {
+            //the input blocks are cached again under a new key, from their ciphertext
+            (call_seq.get_cur_rdd_id(), call_seq.get_part_id()) != call_seq.get_caching_doublet()
+        }) {
+            self.plain_control(call_seq, blocks)
         } else {
             let data_enc = self.cache_from_outside(key).unwrap();
+            call_seq.cached_tags = CACHE.tags(key);
+            if let Some(tags) = &call_seq.cached_tags {
+                assert!(tags.len() == data_enc.len(), "cached partition was tampered with");
+            }
             self.parallel_control(call_seq, data_enc)
         }
     }
@@ -1149,102 +1995,100 @@ pub trait Op: OpBase + 'static {
         let ope = self.get_op();
         let op_id = self.get_op_id();
         let key = call_seq.get_caching_doublet();
-        let cache_space = self.get_cache_space();
+        if cache_inside() && !is_caching_final_rdd {
+            PLAIN_CACHE.invalidate(key);
+        }
 
         Box::new(res_iter.map(move |iter| {
             //cache outside enclave
             if is_caching_final_rdd {
                 iter
             } else {
-                let res = iter.collect::<Vec<_>>();
-                //cache inside enclave
-                if ENABLE_CACHE_INSIDE {
-                    let mut cache_space = cache_space.lock().unwrap();
-                    let data = cache_space.entry(key).or_insert(Vec::new());
-                    data.push(res.clone());
-                } 
-                //it should be always cached outside for inter-machine communcation
-                let _handle = ope.cache_to_outside(key, &res);
-                Box::new(res.into_iter()) as Box<dyn Iterator<Item = _>>
+                let res = Arc::new(iter.collect::<Vec<_>>());
+                //cache inside enclave, bounded, see plain_cache.rs
+                if cache_inside() {
+                    PLAIN_CACHE.stage(key, &res);
+                }
+                //it should be always cached outside for inter-machine communcation.
+                //the block is shared with the encryption job, so the items are
+                //handed on as clones
+                ope.cache_to_outside(key, res.clone());
+                Box::new((0..res.len()).map(move |i| res[i].clone())) as Box<dyn Iterator<Item = _>>
             }
         }))
     }
 
-    fn step0_of_clone(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        let mut buf = unsafe{ Box::from_raw(p_buf as *mut SizeBuf) };
-        match dep_info.dep_type() {
-            0 | 2 => {
-                let mut idx = Idx::new();
-                let data_enc = unsafe{ Box::from_raw(p_data_enc as *mut Vec<ItemE>) };
-                data_enc.send(&mut buf, &mut idx);
-                forget(data_enc);
-            }, 
-            1 => {
-                let shuf_dep = self.get_next_shuf_dep(dep_info).unwrap();
-                shuf_dep.send_sketch(&mut buf, p_data_enc);
-            },
-            3 | 4 => {
-                let mut idx = Idx::new();
-                let data_enc = unsafe{ Box::from_raw(p_data_enc as *mut Vec<ItemE>) };
-                data_enc.send(&mut buf, &mut idx);
-                forget(data_enc);
-            }
-            _ => panic!("invalid is_shuffle"),
-        };
-        forget(buf);
-    }
-
-    fn step1_of_clone(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 2 => {
-                let mut v_out = unsafe { Box::from_raw(p_out as *mut u8 as *mut Vec<ItemE>) };
-                let data_enc = unsafe{ Box::from_raw(p_data_enc as *mut Vec<ItemE>) };
-                v_out.clone_in_place(&data_enc);
-                forget(v_out);
-            }, 
-            1 => {
-                let shuf_dep = self.get_next_shuf_dep(dep_info).unwrap();
-                shuf_dep.send_enc_data(p_out, p_data_enc);
-            },
-            3 | 4 => {
-                let mut v_out = unsafe { Box::from_raw(p_out as *mut u8 as *mut Vec<ItemE>) };
-                let data_enc = unsafe{ Box::from_raw(p_data_enc as *mut Vec<ItemE>) };
-                v_out.clone_in_place(&data_enc);
-                forget(v_out);
-            }
-            _ => panic!("invalid is_shuffle"),
-        }  
-    }
-
     fn free_res_enc(&self, res_ptr: *mut u8, is_enc: bool) {
         if is_enc {
-            crate::ALLOCATOR.set_switch(true);
-            let res = unsafe { Box::from_raw(res_ptr as *mut Vec<ItemE>) };
-            drop(res);
-            crate::ALLOCATOR.set_switch(false);
+            //the box is freed before the guard is dropped
+            let res = {
+                let _outside = crate::ALLOCATOR.outside();
+                let res = unsafe { Box::from_raw(res_ptr as *mut Vec<ItemE>) };
+                *res
+            };
+            free_enc(res);
         } else {
             let _res = unsafe { Box::from_raw(res_ptr as *mut Vec<Self::Item>) };
         }
     }
 
+    //parallel_control for a partition in the plaintext tier, the blocks are
+    //handed out the same way without being decrypted
+    fn plain_control(&self, call_seq: &mut NextOpId, blocks: Arc<Vec<Vec<Self::Item>>>) -> ResIter<Self::Item> {
+        match std::mem::take(&mut call_seq.para_range) {
+            Some((b, e)) => {
+                let data = blocks.get(b..e).unwrap_or(&[]).to_vec();
+                if (call_seq.para_threads.0 > 0) ^ (call_seq.para_threads.1 > 0) {
+                    let key = (call_seq.get_cur_rdd_id(), call_seq.get_part_id());
+                    //cache the data inside enclave for parallel processing
+                    let cache_space = self.get_cache_space();
+                    let mut cache_space = cache_space.lock().unwrap();
+                    cache_space.entry(key).or_insert(Vec::new()).extend(data);
+                    Box::new(Vec::new().into_iter())
+                } else {
+                    Box::new(data.into_iter().map(|item| Box::new(item.into_iter()) as Box<dyn Iterator<Item = _>>))
+                }
+            },
+            None => {
+                let data = blocks.first().cloned().unwrap_or_default();
+                call_seq.sample_len = data.len();
+                call_seq.para_range = Some((1, blocks.len()));
+                //profile begin
+                call_seq.probe = Some(planner::Probe::start());
+                Box::new(vec![data].into_iter().map(move |data| {
+                    Box::new(data.into_iter()) as Box<dyn Iterator<Item = _>>
+                }))
+            }
+        }
+    }
+
     //note that data_enc is outside enclave
     fn parallel_control(&self, call_seq: &mut NextOpId, data_enc: &Vec<ItemE>) -> ResIter<Self::Item> {
+        let tags = call_seq.cached_tags.take();
+        let tag_of = |i: usize| tags.as_ref().map(|tags| &tags[i]);
+        let pred = call_seq.block_pred.take();
         match std::mem::take(&mut call_seq.para_range) {
             Some((b, e)) => {
-                let mut data = if let Some(data_enc) = data_enc.get(b..e) {
-                    data_enc.iter().map(|x| ser_decrypt::<Vec<Self::Item>>(&x.clone())).collect::<Vec<_>>()
-                } else {
-                    Vec::new()
-                };
-                if call_seq.is_step_para.0 ^ call_seq.is_step_para.1 {
-                    
+                if (call_seq.para_threads.0 > 0) ^ (call_seq.para_threads.1 > 0) {
+                    //the staged blocks are read again from the cache, where a sampler
+                    //would not know they were sampled already
+                    let pred = pred.filter(|pred| !pred.is_sampled());
+                    let blocks_enc = data_enc.get(b..e).unwrap_or(&[]);
+                    let mut data = blocks_enc.iter()
+                        .enumerate()
+                        .map(|(i, x)| decrypt_block::<Self::Item>(x, tag_of(b + i), pred.as_ref()))
+                        .collect::<Vec<_>>();
                     let key = (call_seq.get_cur_rdd_id(), call_seq.get_part_id());
                     //originally it cannot happen that call_seq.get_caching_doublet() == call_seq.get_cached_doublet()
                     //however, in parallel processing, since we manually set cached key for special use, the situation can occur 
-                    if key == call_seq.get_caching_doublet() {
-                        for block in &data {
-                            let _handle = self.cache_to_outside(key, &block);
-                        }
+                    //the blocks to cache are the input blocks themselves, so copy their
+                    //ciphertext out instead of encrypting the decrypted data again
+                    if key == call_seq.get_caching_doublet() && !blocks_enc.is_empty() {
+                        let ct = {
+                            let _outside = crate::ALLOCATOR.outside();
+                            blocks_enc.to_vec()
+                        };
+                        self.cache_enc_to_outside(key, ct);
                     }
                     //cache the data inside enclave for parallel processing
                     let cache_space = self.get_cache_space();
@@ -1253,26 +2097,32 @@ pub trait Op: OpBase + 'static {
                     entry.append(&mut data);
                     Box::new(Vec::new().into_iter())
                 } else {
-                    Box::new(data.into_iter().map(|item| Box::new(item.into_iter()) as Box<dyn Iterator<Item = _>>))
+                    call_seq.block_pred_applied = pred.is_some();
+                    let data = DecryptAhead::<Self::Item>::new(data_enc, b, e, tags.clone(), pred);
+                    Box::new(data.map(|item| Box::new(item.into_iter()) as Box<dyn Iterator<Item = _>>))
                 }
             },
             None => {
                 //for profile
-                crate::ALLOCATOR.reset_alloc_cnt();
+                let probe = planner::Probe::start();
+                call_seq.block_pred_applied = pred.is_some();
                 let data = if data_enc.is_empty() {
                     Vec::new()
                 } else {
-                    ser_decrypt::<Vec<Self::Item>>(&data_enc[0].clone())
+                    decrypt_block::<Self::Item>(&data_enc[0], tag_of(0), pred.as_ref())
                 };
-                let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
                 call_seq.sample_len = data.len();
-                let alloc_cnt_ratio = alloc_cnt as f64/(call_seq.sample_len as f64);
-                println!("for decryption, alloc_cnt per len = {:?}", alloc_cnt_ratio);
-                call_seq.is_step_para.0 = alloc_cnt_ratio < PARA_THRESHOLD;
+                let sample_bytes = data_enc.first().map_or(0, |x| x.len());
+                let sample = probe.stop(call_seq.sample_len, sample_bytes);
+                let remaining = sample.remaining(
+                    data_enc.len().saturating_sub(1),
+                    data_enc.iter().skip(1).map(|x| x.len()).sum(),
+                );
+                call_seq.para_threads.0 = planner::plan(self.get_op_id(), planner::ParaStep::Decrypt, &sample, remaining);
                 call_seq.para_range = Some((1, data_enc.len()));
 
                 //profile begin
-                crate::ALLOCATOR.reset_alloc_cnt();
+                call_seq.probe = Some(planner::Probe::start());
                 Box::new(vec![data].into_iter().map(move |data| {
                     Box::new(data.into_iter()) as Box<dyn Iterator<Item = _>>
                 }))
@@ -1280,74 +2130,74 @@ pub trait Op: OpBase + 'static {
         }
     }
 
-    fn spawn_enc_thread(&self, mut results: Vec<Vec<Self::Item>>, handlers: &mut Vec<JoinHandle<Vec<ItemE>>>) {
-        let mut remaining = results.len();
-        let r = remaining.saturating_sub(1) / MAX_THREAD + 1;
-        for _ in 0..MAX_THREAD {
-            let data = results.split_off(results.len() - std::cmp::min(r, remaining));
-            remaining = remaining.saturating_sub(r);
-            let handler = thread::Builder::new()
-                .spawn(move || {
-                    let mut acc = create_enc();
-                    for block in data {
-                        combine_enc(&mut acc, batch_encrypt(&block, true));
-                    }
-                    acc
-                }).unwrap();
-            handlers.push(handler);
+    //compute on the current thread while the finished blocks are encrypted on the
+    //pool, at most PIPELINE_DEPTH of them wait for encryption
+    fn compute_enc_pipelined(&self, call_seq: &mut NextOpId, input: Input, acc: &mut Vec<ItemE>) {
+        let tag = self.get_op_id().get_hash();
+        let mut pending: VecDeque<TaskHandle<Vec<ItemE>>> = VecDeque::with_capacity(PIPELINE_DEPTH);
+        for block in self.compute_blocks(call_seq, input) {
+            if pending.len() == PIPELINE_DEPTH {
+                combine_enc(acc, pending.pop_front().unwrap().join().unwrap());
+            }
+            pending.push_back(thread_pool::spawn(move || {
+                crate::ALLOCATOR.set_profile_tag(tag);
+                batch_encrypt(&block, true)
+            }));
+        }
+        for handle in pending {
+            combine_enc(acc, handle.join().unwrap());
         }
     }
 
-    fn spawn_dec_nar_thread(&self, call_seq: &NextOpId, input: Input, handlers: &mut Vec<JoinHandle<Vec<Vec<Self::Item>>>>, only_dec: bool) {
+    fn spawn_dec_nar_thread(&self, call_seq: &NextOpId, input: Input, handlers: &mut Vec<TaskHandle<Vec<Vec<Self::Item>>>>, only_dec: bool, num_threads: usize) {
         let (s, len) = call_seq.para_range.as_ref().unwrap();
-        let r = (len.saturating_sub(*s)).saturating_sub(1) / MAX_THREAD + 1;
+        let r = (len.saturating_sub(*s)).saturating_sub(1) / num_threads + 1;
         let mut b = *s;
         let mut e = std::cmp::min(b + r, *len);
-        for _ in 0..MAX_THREAD {
+        for _ in 0..num_threads {
             let op = self.get_op();
+            let tag = self.get_op_id().get_hash();
             let mut call_seq = call_seq.clone();
             call_seq.para_range = Some((b, e));
             b = e;
             e = std::cmp::min(b + r, *len);
-            let handler = thread::Builder::new()
-                .spawn(move || {
-                    let results = op.compute(&mut call_seq, input).map(|result| result.collect::<Vec<_>>()).collect::<Vec<_>>();
-                    if only_dec {
-                        assert!(results.into_iter().flatten().collect::<Vec<_>>().is_empty());
-                        Vec::new()
-                    } else {
-                        results
-                    }
-                }).unwrap();
+            let handler = thread_pool::spawn(move || {
+                crate::ALLOCATOR.set_profile_tag(tag);
+                let results = op.compute_blocks(&mut call_seq, input).collect::<Vec<_>>();
+                if only_dec {
+                    assert!(results.into_iter().flatten().collect::<Vec<_>>().is_empty());
+                    Vec::new()
+                } else {
+                    results
+                }
+            });
             handlers.push(handler);
         }
     }
 
-    fn spawn_dec_nar_enc_thread(&self, call_seq: &NextOpId, input: Input, handlers: &mut Vec<JoinHandle<Vec<ItemE>>>, only_dec: bool) {
+    fn spawn_dec_nar_enc_thread(&self, call_seq: &NextOpId, input: Input, handlers: &mut Vec<TaskHandle<Vec<ItemE>>>, only_dec: bool, num_threads: usize) {
         let (s, len) = call_seq.para_range.as_ref().unwrap();
-        let r = (len.saturating_sub(*s)).saturating_sub(1) / MAX_THREAD + 1;
+        let r = (len.saturating_sub(*s)).saturating_sub(1) / num_threads + 1;
         let mut b = *s;
         let mut e = std::cmp::min(b + r, *len);
-        for _ in 0..MAX_THREAD {
+        for _ in 0..num_threads {
             let op = self.get_op();
+            let tag = self.get_op_id().get_hash();
             let mut call_seq = call_seq.clone();
             call_seq.para_range = Some((b, e));
             b = e;
             e = std::cmp::min(b + r, *len);
-            let handler = thread::Builder::new()
-                .spawn(move || {
-                    let results = op.compute(&mut call_seq, input).map(|result| result.collect::<Vec<_>>()).collect::<Vec<_>>();
-                    if only_dec {
-                        assert!(results.into_iter().flatten().collect::<Vec<_>>().is_empty());
-                        Vec::new()
-                    } else {
-                        let mut acc = create_enc();
-                        for result in results {
-                            combine_enc(&mut acc, batch_encrypt(&result, true));
-                        }
-                        acc
-                    }
-                }).unwrap();
+            let handler = thread_pool::spawn(move || {
+                crate::ALLOCATOR.set_profile_tag(tag);
+                if only_dec {
+                    assert!(op.compute(&mut call_seq, input).flatten().collect::<Vec<_>>().is_empty());
+                    Vec::new()
+                } else {
+                    let mut acc = create_enc();
+                    op.compute_enc_pipelined(&mut call_seq, input, &mut acc);
+                    acc
+                }
+            });
             handlers.push(handler);
         }
     }
@@ -1359,13 +2209,29 @@ pub trait Op: OpBase + 'static {
         {
             let mut call_seq_sample = call_seq.clone();
             assert!(call_seq_sample.para_range.is_none());
-            let sample_data = self.compute(&mut call_seq_sample, input).collect::<Vec<_>>().remove(0).collect::<Vec<_>>();
-            let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
-            let alloc_cnt_ratio = alloc_cnt as f64/(call_seq_sample.sample_len as f64);
-            println!("for narrow processing, alloc_cnt per len = {:?}", alloc_cnt_ratio);
+            //the first block may come out as several, as from a flat_map, so
+            //each is encrypted when it is done instead of once all are
+            let mut sample_iter = self.compute(&mut call_seq_sample, input);
+            let mut sample_data = sample_iter.next().map_or(Vec::new(), |block| block.collect::<Vec<_>>());
+            for block in sample_iter {
+                if need_enc {
+                    combine_enc(&mut acc, batch_encrypt(&sample_data, true));
+                    sample_data = block.collect::<Vec<_>>();
+                } else {
+                    results.push(std::mem::replace(&mut sample_data, block.collect::<Vec<_>>()));
+                }
+            }
             call_seq.para_range = call_seq_sample.para_range;
-            call_seq.is_step_para.0 = call_seq_sample.is_step_para.0;
-            call_seq.is_step_para.1 = alloc_cnt_ratio < PARA_THRESHOLD;
+            match (call_seq.para_range, call_seq_sample.probe.take()) {
+                (Some((b, e)), Some(probe)) => {
+                    let sample = probe.stop(call_seq_sample.sample_len, 0);
+                    let remaining = e.saturating_sub(b) as f64;
+                    call_seq.para_threads.0 = call_seq_sample.para_threads.0;
+                    call_seq.para_threads.1 = planner::plan(self.get_op_id(), planner::ParaStep::Narrow, &sample, remaining);
+                },
+                //the source did not split its input into blocks, nothing to hand out
+                _ => call_seq.para_threads = (0, 0, 0),
+            }
             //narrow specific
             if need_enc {
                 let block_enc = batch_encrypt(&sample_data, true);
@@ -1375,27 +2241,28 @@ pub trait Op: OpBase + 'static {
             }
         };
 
-        let mut handlers_pt =  Vec::with_capacity(MAX_THREAD);
-        let mut handlers_ct = Vec::with_capacity(MAX_THREAD);
-        if !call_seq.is_step_para.0 && !call_seq.is_step_para.1 {
-            results.append(&mut self.compute(&mut call_seq, input).map(|result| result.collect::<Vec<_>>()).collect::<Vec<_>>());
+        let mut handlers_pt =  Vec::with_capacity(max_thread());
+        let mut handlers_ct = Vec::with_capacity(max_thread());
+        let (dec_threads, nar_threads, _) = call_seq.para_threads;
+        if dec_threads == 0 && nar_threads == 0 {
             if need_enc {
-                self.spawn_enc_thread(results, &mut handlers_ct);
-                results = Vec::new();
+                self.compute_enc_pipelined(&mut call_seq, input, &mut acc);
+            } else {
+                results.extend(self.compute_blocks(&mut call_seq, input));
             }
-        } else if call_seq.is_step_para.0 ^ call_seq.is_step_para.1 {
+        } else if (dec_threads > 0) ^ (nar_threads > 0) {
             //for cache inside, range begin = 0, and for cache outside or no cache, range begin = 1;
             let (s, len) = call_seq.para_range.as_ref().unwrap();
             if *s == 1 {
                 //decryption needed
-                if !call_seq.is_step_para.0 {
+                if dec_threads == 0 {
                     let mut call_seq = call_seq.clone();
                     assert!(self.compute(&mut call_seq, input).flatten().collect::<Vec<_>>().is_empty());
                 } else {
                     if need_enc {
-                        self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, true); 
+                        self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, true, dec_threads); 
                     } else {
-                        self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, true); 
+                        self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, true, dec_threads); 
                     }
                 }
                 //set cached key
@@ -1405,34 +2272,35 @@ pub trait Op: OpBase + 'static {
             } 
             {
                 //narrow
-                if !call_seq.is_step_para.1 {
+                if nar_threads == 0 {
                     for handler in handlers_ct {
                         assert!(handler.join().unwrap().is_empty());
                     }
                     for handler in handlers_pt {
                         handler.join().unwrap();
                     }
-                    handlers_ct = Vec::with_capacity(MAX_THREAD);
-                    handlers_pt = Vec::with_capacity(MAX_THREAD);
+                    handlers_ct = Vec::with_capacity(max_thread());
+                    handlers_pt = Vec::with_capacity(max_thread());
                     let mut call_seq = call_seq.clone();
-                    results.append(&mut self.compute(&mut call_seq, input).map(|result| result.collect::<Vec<_>>()).collect::<Vec<_>>());
                     if need_enc {
-                        self.spawn_enc_thread(results, &mut handlers_ct);
-                        results = Vec::new();
+                        self.compute_enc_pipelined(&mut call_seq, input, &mut acc);
+                    } else {
+                        results.extend(self.compute_blocks(&mut call_seq, input));
                     }
                 } else {
                     if need_enc {
-                        self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, false);
+                        self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, false, nar_threads);
                     } else {
-                        self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, false);
+                        self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, false, nar_threads);
                     }
                 }
             }
         } else {
+            let num_threads = std::cmp::max(dec_threads, nar_threads);
             if need_enc {
-                self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, false);
+                self.spawn_dec_nar_enc_thread(&call_seq, input, &mut handlers_ct, false, num_threads);
             } else {
-                self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, false);
+                self.spawn_dec_nar_thread(&call_seq, input, &mut handlers_pt, false, num_threads);
             }
         }
         for handler in handlers_ct {
@@ -1448,9 +2316,10 @@ pub trait Op: OpBase + 'static {
             to_ptr(acc)
         } else {
             acc.is_empty();
-            crate::ALLOCATOR.set_switch(true);
-            drop(acc);
-            crate::ALLOCATOR.set_switch(false);
+            {
+                let _outside = crate::ALLOCATOR.outside();
+                drop(acc);
+            }
             Box::into_raw(Box::new(results)) as *mut u8
         }
     } 
@@ -1463,8 +2332,7 @@ pub trait Op: OpBase + 'static {
         let opb = self.get_op_base();
         let result_ptr = shuf_dep.do_shuffle_task(tid, opb, call_seq, input);
 
-        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-        println!("tid: {:?}, shuffle write: {:?}s", tid, dur);
+        crate::metrics::record_shuffle_write(now.elapsed().as_nanos() as u64);
         result_ptr
     }
 
@@ -1504,7 +2372,42 @@ pub trait Op: OpBase + 'static {
               -> Box<dyn Iterator<Item = _>> {
             Box::new(items.filter(predicate))
         });
-        let new_op = SerArc::new(MapPartitions::new(self.get_op(), filter_fn));
+        //the same filter over a whole block, in place
+        let filter_block = move |mut block: Vec<Self::Item>| {
+            block.retain(|item| predicate(item));
+            block
+        };
+        let new_op = SerArc::new(MapPartitions::new(self.get_op(), filter_fn).with_block_fn(Arc::new(filter_block)));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    /// Same as filter, and when the input blocks come with stats of type S (see
+    /// block_stats), a block for which may_match is false is never decrypted:
+    /// may_match must be false only if predicate is false for every item the
+    /// stats describe. The host builds a plain filter at the same call site.
+    #[track_caller]
+    fn filter_by_stats<F, S, P>(&self, predicate: F, may_match: P) -> SerArc<dyn Op<Item = Self::Item>>
+    where
+        F: Fn(&Self::Item) -> bool + Send + Sync + Clone + Copy + 'static,
+        S: Data,
+        P: Fn(&S) -> bool + Send + Sync + 'static,
+        Self: Sized,
+    {
+        let filter_fn = Fn!(move |_index: usize, 
+                                  items: Box<dyn Iterator<Item = Self::Item>>|
+              -> Box<dyn Iterator<Item = _>> {
+            Box::new(items.filter(predicate))
+        });
+        let filter_block = move |mut block: Vec<Self::Item>| {
+            block.retain(|item| predicate(item));
+            block
+        };
+        let new_op = SerArc::new(MapPartitions::new(self.get_op(), filter_fn)
+            .with_block_fn(Arc::new(filter_block))
+            .with_block_pred(block_stats::BlockPred::new(may_match)));
         if !self.get_context().get_is_tail_comp() {
             insert_opmap(new_op.get_op_id(), new_op.get_op_base());
         }
@@ -1539,6 +2442,77 @@ pub trait Op: OpBase + 'static {
         new_op
     }
 
+    #[track_caller]
+    fn map_partitions<U, F>(&self, func: F) -> SerArc<dyn Op<Item = U>>
+    where
+        Self: Sized,
+        U: Data,
+        F: SerFunc(Box<dyn Iterator<Item = Self::Item>>) -> Box<dyn Iterator<Item = U>>,
+    {
+        let ignore_idx = Fn!(move |_index: usize, 
+                                   items: Box<dyn Iterator<Item = Self::Item>>|
+              -> Box<dyn Iterator<Item = _>> { (func)(items) });
+        let new_op = SerArc::new(MapPartitions::new(self.get_op(), ignore_idx));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    /// Return a new RDD by applying a function to whole decrypted blocks of
+    /// this RDD, for batched code. The blocks are cut by size, so f must not
+    /// depend on where they begin or end. The host builds the same map_blocks
+    /// at the same call site.
+    #[track_caller]
+    fn map_blocks<U, F>(&self, f: F) -> SerArc<dyn Op<Item = U>>
+    where
+        Self: Sized,
+        U: Data,
+        F: Fn(&[Self::Item]) -> Vec<U> + Send + Sync + Clone + Copy + 'static,
+    {
+        let items_fn = Fn!(move |_index: usize,
+                                 items: Box<dyn Iterator<Item = Self::Item>>|
+              -> Box<dyn Iterator<Item = _>> {
+            Box::new(f(&items.collect::<Vec<_>>()).into_iter())
+        });
+        let block_fn = move |block: Vec<Self::Item>| f(&block);
+        let new_op = SerArc::new(MapPartitions::new(self.get_op(), items_fn).with_block_fn(Arc::new(block_fn)));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    //the host coalesce without a shuffle, which takes as many op ids as the
+    //shuffling one. the enclave has no partition_by_key to mirror the latter
+    #[track_caller]
+    fn coalesce(&self, num_partitions: usize, shuffle: bool) -> SerArc<dyn Op<Item = Self::Item>>
+    where
+        Self: Sized,
+    {
+        assert!(!shuffle, "coalesce with a shuffle is not supported in the enclave");
+        self.get_context().add_num(4);
+        let new_op = SerArc::new(Coalesced::new(self.get_op(), num_partitions));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    //the host saves the blocks of this op and reads them back, see checkpoint
+    //in framework/src/rdd/rdd.rs. the reader made here gets the ids of the
+    //host's at the same call site, and the ops after it no longer reach this one
+    #[track_caller]
+    fn checkpoint(&self) -> Result<SerArc<dyn Op<Item = Self::Item>>>
+    where
+        Self: Sized,
+    {
+        let deserializer = Box::new(Fn!(|file: Vec<u8>| {
+            bincode::deserialize::<Vec<ItemE>>(&file).unwrap()
+        }));
+        Ok(self.get_context().read_source(LocalFsReaderConfig::new(""), None, Some(deserializer)))
+    }
+
     #[track_caller]
     fn reduce<F>(&self, f: F) -> Result<Text<Self::Item, ItemE>>
     where
@@ -1633,6 +2607,60 @@ pub trait Op: OpBase + 'static {
         Ok(Text::<U, ItemE>::rec(tail_info))
     }
 
+    //builds the same tree of ops as secure_tree_aggregate of the host
+    #[track_caller]
+    fn tree_aggregate<U, SF, CF>(&self, init: U, seq_fn: SF, comb_fn: CF, depth: usize) -> Result<Text<U, ItemE>>
+    where
+        Self: Sized,
+        U: Data,
+        SF: SerFunc(U, Self::Item) -> U,
+        CF: SerFunc(U, U) -> U,
+    {
+        let mut num_partitions = self.number_of_splits();
+        let scale = ((num_partitions as f64).powf(1.0 / depth.max(2) as f64).ceil() as usize).max(2);
+        let zero = init.clone();
+        let aggregate_partition = Fn!(move |_index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+            -> Box<dyn Iterator<Item = U>> {
+                Box::new(std::iter::once(partition.fold(zero.clone(), &seq_fn)))
+        });
+        let mut partials: SerArc<dyn Op<Item = U>> = SerArc::new(MapPartitions::new(self.get_op(), aggregate_partition));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(partials.get_op_id(), partials.get_op_base());
+        }
+        while num_partitions > scale + (num_partitions + scale - 1) / scale {
+            num_partitions /= scale;
+            let width = num_partitions;
+            let comb = comb_fn.clone();
+            self.get_context().add_num(1);
+            let keyed = SerArc::new(MapPartitions::new(partials.get_op(), Fn!(
+                move |index: usize, partition: Box<dyn Iterator<Item = U>>|
+                    -> Box<dyn Iterator<Item = (usize, U)>> {
+                        Box::new(partition.map(move |partial| (index % width, partial)))
+                }
+            )));
+            if !self.get_context().get_is_tail_comp() {
+                insert_opmap(keyed.get_op_id(), keyed.get_op_base());
+            }
+            self.get_context().add_num(1);
+            let combined = keyed.reduce_by_key(Fn!(move |(a, b): (U, U)| (comb)(a, b)), width);
+            self.get_context().add_num(1);
+            partials = combined.values();
+        }
+        self.get_context().add_num(1);
+        partials.reduce(comb_fn)
+    }
+
+    #[track_caller]
+    fn secure_tree_aggregate<U, SF, CF>(&self, init: U, seq_fn: SF, comb_fn: CF, depth: usize, tail_info: &TailCompInfo) -> Result<Text<U, ItemE>>
+    where
+        Self: Sized,
+        U: Data,
+        SF: SerFunc(U, Self::Item) -> U,
+        CF: SerFunc(U, U) -> U,
+    {
+        Ok(Text::<U, ItemE>::rec(tail_info))
+    }
+
     #[track_caller]
     fn collect(&self) -> Result<Text<Vec<Self::Item>, Vec<ItemE>>> 
     where
@@ -1661,6 +2689,15 @@ pub trait Op: OpBase + 'static {
         Ok(0)
     } 
 
+    //the ops of secure_count_approx of the host, the same as of count
+    #[track_caller]
+    fn count_approx(&self) -> Result<u64>
+    where
+        Self: Sized,
+    {
+        self.count()
+    }
+
     /// Return a new RDD containing the distinct elements in this RDD.
     #[track_caller]
     fn distinct_with_num_partitions(
@@ -1671,21 +2708,13 @@ pub trait Op: OpBase + 'static {
         Self: Sized,
         Self::Item: Data + Eq + Hash + Ord,
     {
-        let mapped = self.map(Box::new(Fn!(|x| (Some(x), None)))
-            as Box<
-                dyn Func(Self::Item) -> (Option<Self::Item>, Option<Self::Item>),
-            >);
+        //the items are the keys, a duplicate is dropped on the map side
+        let mapped = self.map(Box::new(Fn!(|x| (x, ())))
+            as Box<dyn Func(Self::Item) -> (Self::Item, ())>);
         self.get_context().add_num(1);
-        let reduced_by_key = mapped.reduce_by_key(Box::new(Fn!(|(_x, y)| y)),
-            num_partitions);
+        let deduped = mapped.dedup_by_key(num_partitions);
         self.get_context().add_num(1);
-        reduced_by_key.map(Box::new(Fn!(|x: (
-            Option<Self::Item>,
-            Option<Self::Item>
-        )| {
-            let (x, _y) = x;
-            x.unwrap()
-        })))
+        deduped.map(Box::new(Fn!(|x: (Self::Item, ())| x.0)))
     }
 
     /// Return a new RDD containing the distinct elements in this RDD.
@@ -1749,6 +2778,56 @@ pub trait Op: OpBase + 'static {
         r
     }
 
+    #[track_caller]
+    fn reservoir_sample(&self, num: usize, seed: Option<u64>) -> SerArc<dyn Op<Item = Self::Item>>
+    where
+        Self: Sized,
+    {
+        let reservoir = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+            -> Box<dyn Iterator<Item = (usize, Vec<Keyed<Self::Item>>)>> {
+                let mut rng = get_partition_rng(seed, index);
+                Box::new(std::iter::once((0, bottom_k(partition, num, &mut rng))))
+        });
+        let reservoirs = SerArc::new(MapPartitions::new(self.get_op(), reservoir));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(reservoirs.get_op_id(), reservoirs.get_op_base());
+        }
+        self.get_context().add_num(1);
+        let merged = reservoirs.reduce_by_key(
+            Fn!(move |(a, b): (Vec<Keyed<Self::Item>>, Vec<Keyed<Self::Item>>)| merge_smallest(a, b, num)),
+            1,
+        );
+        self.get_context().add_num(1);
+        merged.flat_map(Fn!(|(_, sample): (usize, Vec<Keyed<Self::Item>>)| {
+            Box::new(sample.into_iter().map(|keyed| keyed.item)) as Box<dyn Iterator<Item = Self::Item>>
+        }))
+    }
+
+    #[track_caller]
+    fn take_reservoir_sample(&self, num: usize, seed: Option<u64>) -> Result<Text<Vec<Self::Item>, Vec<ItemE>>>
+    where
+        Self: Sized,
+    {
+        let op = self.reservoir_sample(num, seed);
+        self.get_context().add_num(1);
+        op.collect()
+    }
+
+    #[track_caller]
+    fn secure_take_reservoir_sample(
+        &self,
+        num: usize,
+        seed: Option<u64>,
+        tail_info: &TailCompInfo,
+    ) -> Result<Text<Vec<Self::Item>, Vec<ItemE>>>
+    where
+        Self: Sized,
+    {
+        let op = self.reservoir_sample(num, seed);
+        self.get_context().add_num(1);
+        op.secure_collect(tail_info)
+    }
+
     #[track_caller]
     fn take(&self, num: usize) -> Result<Text<Vec<Self::Item>, Vec<ItemE>>> 
     where
@@ -1765,6 +2844,45 @@ pub trait Op: OpBase + 'static {
         Ok(Text::<Vec<Self::Item>, Vec<ItemE>>::rec(tail_info))
     }
 
+    //each partition keeps its num smallest in a bounded heap, the runs are merged
+    //by a shuffle into about sqrt(partitions) and then by reduce, as the host does
+    #[track_caller]
+    fn take_ordered(&self, num: usize) -> Result<Text<Vec<Self::Item>, ItemE>>
+    where
+        Self: Sized,
+        Self::Item: Ord,
+    {
+        let width = (self.number_of_splits() as f64).sqrt().ceil().max(1.0) as usize;
+        let first_k = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+            -> Box<dyn Iterator<Item = (usize, Vec<Self::Item>)>> {
+                let mut queue = BoundedPriorityQueue::new(num);
+                partition.for_each(|item: Self::Item| queue.append(item));
+                Box::new(std::iter::once((index % width, queue.into())))
+        });
+        let runs = SerArc::new(MapPartitions::new(self.get_op(), first_k));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(runs.get_op_id(), runs.get_op_base());
+        }
+        self.get_context().add_num(1);
+        let merged = runs.reduce_by_key(
+            Fn!(move |(a, b): (Vec<Self::Item>, Vec<Self::Item>)| merge_smallest(a, b, num)),
+            width,
+        );
+        self.get_context().add_num(1);
+        let merged = merged.values();
+        self.get_context().add_num(1);
+        merged.reduce(Fn!(move |a: Vec<Self::Item>, b: Vec<Self::Item>| merge_smallest(a, b, num)))
+    }
+
+    #[track_caller]
+    fn secure_take_ordered(&self, num: usize, tail_info: &TailCompInfo) -> Result<Text<Vec<Self::Item>, ItemE>>
+    where
+        Self: Sized,
+        Self::Item: Ord,
+    {
+        Ok(Text::<Vec<Self::Item>, ItemE>::rec(tail_info))
+    }
+
     #[track_caller]
     fn union(
         &self,
@@ -1802,6 +2920,23 @@ pub trait Op: OpBase + 'static {
         new_op
     }
 
+    //all pairs of the items of self and other, see Cartesian
+    #[track_caller]
+    fn cartesian<U>(
+        &self,
+        other: SerArc<dyn Op<Item = U>>,
+    ) -> SerArc<dyn Op<Item = (Self::Item, U)>>
+    where
+        Self: Sized,
+        U: Data,
+    {
+        let new_op = SerArc::new(Cartesian::new(self.get_op(), other.get_op()));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
     #[track_caller]
     fn key_by<T, F>(&self, func: F) -> SerArc<dyn Op<Item = (T, Self::Item)>>
     where
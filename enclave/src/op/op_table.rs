@@ -0,0 +1,129 @@
+//! Table of the ops of the enclave, looked up by every ECALL.
+//!
+//! The table is open addressed on OpId.h, which is already a hash, with a slot
+//! claimed by a CAS on its key and the op published behind it, so lookups take
+//! no lock and concurrent ECALLs never contend on it. It is filled lazily: the
+//! job graphs are built, in order, only once an op of theirs is looked up, so
+//! the enclave does not pay for the jobs it never runs.
+use std::boxed::Box;
+use std::cell::Cell;
+use std::sync::{
+    atomic::{self, AtomicPtr, AtomicU64},
+    Arc, SgxMutex as Mutex,
+};
+use std::vec::Vec;
+
+use crate::op::{OpBase, OpId, Result};
+
+//a power of two, far more than the ops of all jobs
+const OP_TABLE_SLOTS: usize = 1 << 12;
+
+thread_local! {
+    //set while this thread builds a job graph, whose ops look each other up
+    static BUILDING: Cell<bool> = Cell::new(false);
+}
+
+struct Slot {
+    //0 for a free slot
+    key: AtomicU64,
+    op: AtomicPtr<Arc<dyn OpBase>>,
+}
+
+pub struct OpTable {
+    slots: Vec<Slot>,
+    jobs: &'static [fn() -> Result<()>],
+    //index of the next job to build
+    next_job: Mutex<usize>,
+}
+
+//0 marks a free slot, an op hashed to it takes 1 instead
+fn key_of(op_id: &OpId) -> u64 {
+    op_id.h.max(1)
+}
+
+impl OpTable {
+    pub fn new(jobs: &'static [fn() -> Result<()>]) -> Self {
+        OpTable {
+            slots: (0..OP_TABLE_SLOTS)
+                .map(|_| Slot {
+                    key: AtomicU64::new(0),
+                    op: AtomicPtr::new(std::ptr::null_mut()),
+                })
+                .collect(),
+            jobs,
+            next_job: Mutex::new(0),
+        }
+    }
+
+    pub fn insert(&self, op_id: OpId, op: Arc<dyn OpBase>) {
+        let key = key_of(&op_id);
+        let mut idx = key as usize & (OP_TABLE_SLOTS - 1);
+        for _ in 0..OP_TABLE_SLOTS {
+            let slot = &self.slots[idx];
+            let claimed = slot.key.compare_exchange(
+                0,
+                key,
+                atomic::Ordering::AcqRel,
+                atomic::Ordering::Acquire,
+            );
+            let cur = match claimed {
+                Ok(_) => key,
+                Err(cur) => cur,
+            };
+            if cur == key {
+                //an op registered again replaces the old one, which is leaked
+                //as a lookup may still hold it
+                slot.op.store(Box::into_raw(Box::new(op)), atomic::Ordering::Release);
+                return;
+            }
+            idx = (idx + 1) & (OP_TABLE_SLOTS - 1);
+        }
+        panic!("op table full");
+    }
+
+    pub fn get(&self, op_id: &OpId) -> Option<&Arc<dyn OpBase>> {
+        self.find(op_id).or_else(|| {
+            self.build_jobs_until(op_id);
+            self.find(op_id)
+        })
+    }
+
+    fn find(&self, op_id: &OpId) -> Option<&Arc<dyn OpBase>> {
+        let key = key_of(op_id);
+        let mut idx = key as usize & (OP_TABLE_SLOTS - 1);
+        for _ in 0..OP_TABLE_SLOTS {
+            let slot = &self.slots[idx];
+            match slot.key.load(atomic::Ordering::Acquire) {
+                0 => return None,
+                cur if cur == key => loop {
+                    //the key is claimed before the op is stored
+                    let op = slot.op.load(atomic::Ordering::Acquire);
+                    if let Some(op) = unsafe { op.as_ref() } {
+                        return Some(op);
+                    }
+                    atomic::spin_loop_hint();
+                },
+                _ => idx = (idx + 1) & (OP_TABLE_SLOTS - 1),
+            }
+        }
+        None
+    }
+
+    //build the jobs not built yet until one of them registers op_id, the
+    //lookups of other threads wait for the job being built
+    fn build_jobs_until(&self, op_id: &OpId) {
+        if BUILDING.with(|building| building.get()) {
+            return;
+        }
+        let mut next_job = self.next_job.lock().unwrap();
+        BUILDING.with(|building| building.set(true));
+        while *next_job < self.jobs.len() && self.find(op_id).is_none() {
+            let job = self.jobs[*next_job];
+            *next_job += 1;
+            if let Err(e) = job() {
+                println!("failed building job {}: {}", *next_job - 1, e);
+            }
+        }
+        BUILDING.with(|building| building.set(false));
+    }
+}
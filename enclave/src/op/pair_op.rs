@@ -1,7 +1,8 @@
 use std::hash::Hash;
 use crate::aggregator::Aggregator;
-use crate::partitioner::HashPartitioner;
+use crate::partitioner::{HashPartitioner, RangePartitioner};
 use crate::op::*;
+use crate::utils::random::{get_partition_rng, sample_times};
 
 pub trait Pair<K, V>: Op<Item = (K, V)> + Send + Sync 
 where 
@@ -79,6 +80,123 @@ where
         self.combine_by_key(aggregator, partitioner)
     }
 
+    //sort by key across partitions, the bounds of the partitions are drawn from
+    //sample, a sample of the keys
+    #[track_caller]
+    fn sort_by_key(&self, sample: Vec<K>, num_splits: usize) -> SerArc<dyn Op<Item = (K, V)>>
+    where
+        Self: Sized + 'static,
+    {
+        self.sort_by_key_using_partitioner(
+            Box::new(RangePartitioner::<K>::from_sample(num_splits, sample)) as Box<dyn Partitioner>
+        )
+    }
+
+    #[track_caller]
+    fn sort_by_key_using_partitioner(
+        &self,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Op<Item = (K, V)>>
+    where
+        Self: Sized + 'static,
+    {
+        let grouped = self.group_by_key_using_partitioner(partitioner);
+        self.get_context().add_num(1);
+        //the shuffle merges the sorted runs of the map side and hands the groups
+        //over in key order (see Shuffled::compute_inner), so they are streamed
+        //out without being collected
+        let sort_fn = Fn!(|_index: usize, 
+                           items: Box<dyn Iterator<Item = (K, Vec<V>)>>|
+              -> Box<dyn Iterator<Item = (K, V)>> {
+            Box::new(items.flat_map(|(k, vs)| vs.into_iter().map(move |v| (k.clone(), v))))
+        });
+        let new_op = SerArc::new(MapPartitions::new(grouped.get_op(), sort_fn));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    //reduce_by_key for pairs of which only the keys matter, one pair is kept
+    //per key. the keys of a map task are deduplicated in a hash set before
+    //they are bucketed, see ShuffleDependency::dedup_keys
+    #[track_caller]
+    fn dedup_by_key(&self, num_splits: usize) -> SerArc<dyn Op<Item = (K, V)>>
+    where
+        Self: Sized + 'static,
+    {
+        let partitioner = Box::new(HashPartitioner::<K>::new(num_splits)) as Box<dyn Partitioner>;
+        let create_combiner = Box::new(|v: V| v);
+        let merge_value = Box::new(|(buf, _v): (V, V)| buf);
+        let merge_combiners = Box::new(|(b1, _b2): (V, V)| b1);
+        let aggregator = Aggregator::new(create_combiner, merge_value, merge_combiners);
+        let new_op = SerArc::new(Shuffled::new_deduped(
+            self.get_op(),
+            Arc::new(aggregator),
+            partitioner,
+        ));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    //reduce_by_key for keys too hot for one reducer. hot keys are found in the
+    //sample of the shuffle write and spread over all reducers, then a second
+    //reduce_by_key merges their partial results
+    #[track_caller]
+    fn reduce_by_key_skewed<F>(&self, func: F, num_splits: usize) -> SerArc<dyn Op<Item = (K, V)>>
+    where
+        Self: Sized + 'static,
+        F: SerFunc((V, V)) -> V,
+    {
+        let partitioner = Box::new(HashPartitioner::<K>::new(num_splits)) as Box<dyn Partitioner>;
+        let create_combiner = Box::new(|v: V| v);
+        let f_clone = func.clone();
+        let merge_value = Box::new(move |(buf, v)| { (f_clone)((buf, v)) });
+        let f_clone = func.clone();
+        let merge_combiners = Box::new(move |(b1, b2)| { (f_clone)((b1, b2)) });
+        let aggregator = Aggregator::new(create_combiner, merge_value, merge_combiners);
+        let salted = SerArc::new(Shuffled::new_with_salting(
+            self.get_op(),
+            Arc::new(aggregator),
+            partitioner.clone(),
+            true,
+        ));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(salted.get_op_id(), salted.get_op_base());
+        }
+        self.get_context().add_num(1);
+        salted.reduce_by_key_using_partitioner(func, partitioner)
+    }
+
+    #[track_caller]
+    fn sample_by_key(
+        &self,
+        with_replacement: bool,
+        fractions: HashMap<K, f64>,
+        seed: Option<u64>,
+    ) -> SerArc<dyn Op<Item = (K, V)>>
+    where
+        Self: Sized,
+    {
+        let sample = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = (K, V)>>|
+            -> Box<dyn Iterator<Item = (K, V)>> {
+                let mut rng = get_partition_rng(seed, index);
+                let fractions = fractions.clone();
+                Box::new(partition.flat_map(move |(k, v)| {
+                    let fraction = fractions.get(&k).copied().unwrap_or(0.0);
+                    let times = sample_times(with_replacement, fraction, &mut rng);
+                    std::iter::repeat((k, v)).take(times)
+                }))
+        });
+        let new_op = SerArc::new(MapPartitions::new(self.get_op(), sample));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
     #[track_caller]
     fn values(
         &self,
@@ -152,6 +270,103 @@ where
         cogrouped.flat_map_values(Box::new(f))
     }
 
+    //join on key ranges drawn from sample, a sample of the keys. both sides
+    //are shuffled as sorted runs and merged block by block in the enclave, and
+    //the joined pairs come out sorted by key across partitions
+    #[track_caller]
+    fn sort_merge_join<W>(
+        &self,
+        other: SerArc<dyn Op<Item = (K, W)>>,
+        sample: Vec<K>,
+        num_splits: usize,
+    ) -> SerArc<dyn Op<Item = (K, (V, W))>> 
+    where
+        W: Data,
+    {
+        self.merge_join(
+            other,
+            Box::new(RangePartitioner::<K>::from_sample(num_splits, sample)) as Box<dyn Partitioner>,
+        )
+    }
+
+    //join that merges the sorted runs of both sides into pairs directly, see
+    //MergeJoined. unlike join, no group is materialized for the cross product
+    #[track_caller]
+    fn merge_join<W>(
+        &self,
+        other: SerArc<dyn Op<Item = (K, W)>>,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Op<Item = (K, (V, W))>> 
+    where
+        W: Data,
+    {
+        let new_op = SerArc::new(MergeJoined::new(self.get_op(), other.get_op(), partitioner));
+        if !self.get_context().get_is_tail_comp() {
+            insert_opmap(new_op.get_op_id(), new_op.get_op_base());
+        }
+        new_op
+    }
+
+    //join with a relation small enough to be collected, without a shuffle of
+    //either side. the small side is probed in a hash table by every task
+    #[track_caller]
+    fn broadcast_join<W>(
+        &self,
+        small: &Text<Vec<(K, W)>, Vec<ItemE>>,
+    ) -> SerArc<dyn Op<Item = (K, (V, W))>>
+    where
+        Self: Sized,
+        W: Data,
+    {
+        let small = Broadcast::new(small);
+        let f = Fn!(move |(k, v): (K, V)| {
+            let ws = small.get(&k).to_vec();
+            let joined = ws.into_iter().map(move |w| (k.clone(), (v.clone(), w)));
+            Box::new(joined) as Box<dyn Iterator<Item = (K, (V, W))>>
+        });
+        self.flat_map(f)
+    }
+
+    //bloom filter of the keys, for join_pruned
+    #[track_caller]
+    fn key_filter(&self, expected_keys: usize, fpp: f64) -> Result<Text<KeyFilter<K>, ItemE>>
+    where
+        Self: Sized,
+    {
+        self.aggregate(
+            KeyFilter::new(expected_keys, fpp),
+            Fn!(|mut filter: KeyFilter<K>, (k, _): (K, V)| {
+                filter.insert(&k);
+                filter
+            }),
+            Fn!(|a: KeyFilter<K>, b: KeyFilter<K>| a.union(b)),
+        )
+    }
+
+    //join after dropping the items whose keys are not in filter, the key
+    //filter of other. the pruning op is narrow, so it runs in the map task of
+    //the shuffle before the items are bucketed
+    #[track_caller]
+    fn join_pruned<W>(
+        &self,
+        other: SerArc<dyn Op<Item = (K, W)>>,
+        filter: &Text<KeyFilter<K>, ItemE>,
+        num_splits: usize,
+    ) -> SerArc<dyn Op<Item = (K, (V, W))>>
+    where
+        Self: Sized,
+        W: Data,
+    {
+        let filter = SemiJoinFilter::new(filter);
+        let prune = Fn!(move |items: Box<dyn Iterator<Item = (K, V)>>| {
+            let filter = filter.clone();
+            Box::new(items.filter(move |(k, _)| filter.may_contain(k))) as Box<dyn Iterator<Item = (K, V)>>
+        });
+        let pruned = self.map_partitions(prune);
+        self.get_context().add_num(1);
+        pruned.join(other, num_splits)
+    }
+
     #[track_caller]
     fn cogroup<W>(
         &self,
@@ -170,6 +385,17 @@ where
         new_op
     }
 
+    //the op id of secure_lookup of the host, its ecall finds by it how to read
+    //the key and the items, see key_index.rs
+    #[track_caller]
+    fn lookup(&self, key: K) -> Result<Text<Vec<V>, Vec<ItemE>>> {
+        let op_id = self.get_context().new_op_id(core::panic::Location::caller());
+        if !self.get_context().get_is_tail_comp() {
+            key_index::register::<K, V>(op_id);
+        }
+        Ok(Text::<Vec<V>, Vec<ItemE>>::new(None, None))
+    }
+
 }
 
 // Implementing the Pair trait for all types which implements Op
@@ -248,20 +474,6 @@ where
     K: Data,
     V: Data,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -471,20 +683,6 @@ where
     U: Data,
     F: SerFunc(V) -> U + Clone,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -523,6 +721,11 @@ where
     fn number_of_splits(&self) -> usize {
         self.vals.split_num.load(atomic::Ordering::SeqCst)
     }
+
+    //the keys are left as they are, so are the partitions
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.prev.partitioner()
+    }
     
     fn etake(&self, input: *const u8, should_take: usize, have_take: &mut usize) -> *mut u8 {
         self.take_(input ,should_take, have_take)
@@ -599,6 +802,9 @@ where
             assert_eq!(data_ptr as usize, 0 as usize);
             return self.get_and_remove_cached_data(call_seq);
         }
+        if !need_cache {
+            return into_res_iter(self.map_blocks(call_seq, input));
+        }
         
         let mut f = self.f.clone();
         match call_seq.get_ser_captured_var() {
@@ -627,6 +833,31 @@ where
         }
         res_iter
     }
+
+    fn compute_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<Self::Item> {
+        if call_seq.have_cache() || call_seq.need_cache() {
+            return Box::new(self.compute(call_seq, input).map(|block| block.collect::<Vec<_>>()));
+        }
+        self.map_blocks(call_seq, input)
+    }
+}
+
+impl<K, V, U, F> MappedValues<K, V, U, F>
+where
+    K: Data,
+    V: Data,
+    U: Data,
+    F: SerFunc(V) -> U + Clone,
+{
+    fn map_blocks(&self, call_seq: &mut NextOpId, input: Input) -> BlockIter<(K, U)> {
+        let mut f = self.f.clone();
+        if let Some(ser) = call_seq.get_ser_captured_var() {
+            f.deser_captured_var(ser);
+        }
+        Box::new(prev_blocks(&self.prev, call_seq, input).map(move |block| {
+            block.into_iter().map(|(k, v)| (k, f(v))).collect::<Vec<_>>()
+        }))
+    }
 }
 
 pub struct FlatMappedValues<K, V, U, F>
@@ -701,20 +932,6 @@ where
     U: Data,
     F: SerFunc(V) -> Box<dyn Iterator<Item = U>>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -754,6 +971,11 @@ where
         self.vals.split_num.load(atomic::Ordering::SeqCst)
     }
 
+    //the keys are left as they are, so are the partitions
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.prev.partitioner()
+    }
+
     fn iterator_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
         
 		self.compute_start(call_seq, input, dep_info)
@@ -45,20 +45,6 @@ impl<T> OpBase for ParallelCollection<T>
 where 
     T: Data,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -146,6 +132,17 @@ where
         self.cache_space.clone()
     }
 
+    //the input blocks are the items, unless the partition is cached here
+    fn head_blocks<'a>(&self, call_seq: &NextOpId, input: &'a Input) -> Option<&'a Vec<ItemE>> {
+        if call_seq.have_cache() {
+            self.cached_blocks(call_seq)
+        } else if call_seq.need_cache() || input.data == 0 {
+            None
+        } else {
+            Some(input.get_enc_data::<Vec<ItemE>>())
+        }
+    }
+
     fn compute_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
         match dep_info.dep_type() {
             0 => { 
@@ -70,20 +70,6 @@ impl<T> OpBase for PartitionwiseSampled<T>
 where
     T: Data, 
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        } 
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -212,6 +198,15 @@ where
             return self.get_and_remove_cached_data(call_seq);
         }
         
+        let sampler = self.sampler.read().unwrap().clone();
+        //right above the decryption, the blocks are sampled as they are
+        //decrypted and the counted ones nothing is kept of are skipped
+        let block_fraction = sampler.bernoulli_fraction()
+            .filter(|fraction| *fraction > 0.0 && *fraction < 1.0 && call_seq.next_is_head());
+        if let Some(fraction) = block_fraction {
+            call_seq.block_pred = Some(block_stats::BlockPred::sampled(fraction));
+            call_seq.block_pred_applied = false;
+        }
         let opb = call_seq.get_next_op().clone();
         let res_iter = if opb.get_op_id() == self.prev.get_op_id() {
             self.prev.compute(call_seq, input)
@@ -219,12 +214,21 @@ where
             let op = opb.to_arc_op::<dyn Op<Item = T>>().unwrap();
             op.compute(call_seq, input)
         };
+        //the head may have read the partition from a cache, or cached all of it,
+        //instead of sampling it
+        let sampled = block_fraction.is_some() && call_seq.block_pred_applied;
+        if block_fraction.is_some() {
+            call_seq.block_pred = None;
+        }
 
-        let sampler = self.sampler.read().unwrap().clone();
-        let res_iter = Box::new(res_iter.map(move |res_iter| {
-            let sampler_func = sampler.get_sampler(None);
-            Box::new(sampler_func(res_iter).into_iter()) as Box<dyn Iterator<Item = _>>
-        }));
+        let res_iter = if sampled {
+            res_iter
+        } else {
+            Box::new(res_iter.map(move |res_iter| {
+                let sampler_func = sampler.get_sampler(None);
+                Box::new(sampler_func(res_iter).into_iter()) as Box<dyn Iterator<Item = _>>
+            }))
+        };
         
         let key = call_seq.get_caching_doublet();
         if need_cache {
@@ -0,0 +1,138 @@
+//! Bounded tier of plaintext cached partitions inside the enclave.
+//!
+//! A cached partition always goes outside, encrypted, for the host to keep and
+//! to ship to other machines. Small hot ones (centroids, ranks) are also kept
+//! here as their plaintext blocks, so reading them back costs neither the
+//! ocall_cache_from_outside nor the decryption. The tier holds at most
+//! PLAIN_CACHE_BYTES of EPC by deep size; past it the least recently used
+//! partitions are dropped, which leaves them in the encrypted tier outside.
+//!
+//! The blocks of a partition are staged while it is being cached and only
+//! become visible with commit, at the completion barrier of OpCache::send, so
+//! a partially cached partition is never served.
+use std::any::Any;
+use std::boxed::Box;
+use std::collections::{BTreeMap, HashMap};
+use std::sync::{Arc, SgxMutex as Mutex};
+use std::vec::Vec;
+
+use crate::basic::Data;
+
+pub const PLAIN_CACHE_BYTES: usize = 16 << 20;
+//a partition that takes more than this share of the budget is not kept
+const MAX_ENTRY_SHARE: usize = 4;
+
+type Key = (usize, usize); //(cached_rdd_id, part_id)
+
+struct Entry {
+    //Vec<Vec<T>> of the item type of the rdd
+    blocks: Arc<dyn Any + Send + Sync>,
+    bytes: usize,
+    last_used: u64,
+}
+
+struct Staged {
+    //None once the partition has grown too big to be kept
+    blocks: Option<Box<dyn Any + Send + Sync>>,
+    bytes: usize,
+}
+
+#[derive(Default)]
+struct Inner {
+    clock: u64,
+    bytes: usize,
+    entries: HashMap<Key, Entry>,
+    order: BTreeMap<u64, Key>,
+    staged: HashMap<Key, Staged>,
+}
+
+pub struct PlainCache {
+    inner: Mutex<Inner>,
+}
+
+impl PlainCache {
+    pub fn new() -> Self {
+        PlainCache {
+            inner: Mutex::new(Inner::default()),
+        }
+    }
+
+    //the partition is cached again, the blocks kept from before are stale
+    pub fn invalidate(&self, key: Key) {
+        let mut inner = self.inner.lock().unwrap();
+        inner.remove(key);
+    }
+
+    pub fn stage<T: Data>(&self, key: Key, block: &[T]) {
+        let bytes = block.iter().map(|x| x.deep_size_of()).sum::<usize>();
+        let mut inner = self.inner.lock().unwrap();
+        let staged = inner.staged.entry(key).or_insert_with(|| Staged {
+            blocks: Some(Box::new(Vec::<Vec<T>>::new())),
+            bytes: 0,
+        });
+        staged.bytes += bytes;
+        if staged.bytes > PLAIN_CACHE_BYTES / MAX_ENTRY_SHARE {
+            staged.blocks = None;
+        }
+        if let Some(blocks) = staged.blocks.as_mut() {
+            blocks.downcast_mut::<Vec<Vec<T>>>().unwrap().push(block.to_vec());
+        }
+    }
+
+    //make the staged blocks of key visible, evicting the least recently used
+    //partitions to fit them
+    pub fn commit(&self, key: Key) {
+        let mut inner = self.inner.lock().unwrap();
+        let (blocks, bytes) = match inner.staged.remove(&key) {
+            Some(Staged { blocks: Some(blocks), bytes }) => (blocks, bytes),
+            _ => return,
+        };
+        inner.remove(key);
+        while inner.bytes + bytes > PLAIN_CACHE_BYTES {
+            let oldest = match inner.order.values().next() {
+                Some(oldest) => *oldest,
+                None => break,
+            };
+            inner.remove(oldest);
+        }
+        inner.clock += 1;
+        let last_used = inner.clock;
+        inner.bytes += bytes;
+        inner.order.insert(last_used, key);
+        inner.entries.insert(key, Entry {
+            blocks: Arc::from(blocks),
+            bytes,
+            last_used,
+        });
+    }
+
+    //drop the blocks of partitions whose caching never finished
+    pub fn clear_staged(&self) {
+        self.inner.lock().unwrap().staged.clear();
+    }
+
+    pub fn clear(&self) {
+        *self.inner.lock().unwrap() = Inner::default();
+    }
+
+    pub fn get<T: Data>(&self, key: Key) -> Option<Arc<Vec<Vec<T>>>> {
+        let mut inner = self.inner.lock().unwrap();
+        inner.clock += 1;
+        let clock = inner.clock;
+        let entry = inner.entries.get_mut(&key)?;
+        let blocks = entry.blocks.clone().downcast::<Vec<Vec<T>>>().ok()?;
+        let last_used = std::mem::replace(&mut entry.last_used, clock);
+        inner.order.remove(&last_used);
+        inner.order.insert(clock, key);
+        Some(blocks)
+    }
+}
+
+impl Inner {
+    fn remove(&mut self, key: Key) {
+        if let Some(entry) = self.entries.remove(&key) {
+            self.order.remove(&entry.last_used);
+            self.bytes -= entry.bytes;
+        }
+    }
+}
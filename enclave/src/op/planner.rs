@@ -0,0 +1,133 @@
+//! Decides how many worker threads a step of a task (decryption, narrow
+//! processing, merge, shuffle, aggregation) should get.
+//!
+//! The first block of every step runs on the current thread as a sample. Its
+//! wall time, the bytes it decrypted and the number of trusted heap
+//! allocations it made are fed to a small cost model: the allocations are
+//! serialized on the trusted heap lock, the rest of the work scales with the
+//! number of threads, and every job handed to the thread pool costs a worker
+//! wakeup. The thread count with the lowest estimated time wins.
+//!
+//! The inside heap counts allocations only while a probe is alive, see
+//! Allocator::begin_sampling, the blocks after the sample are not counted.
+//!
+//! Decisions are kept per (OpId, ParaStep), so iterative jobs that run the
+//! same operators again (kmeans, pagerank) profile only the first iteration.
+use std::collections::HashMap;
+use std::sync::SgxRwLock as RwLock;
+use std::time::Instant;
+use std::untrusted::time::InstantEx;
+
+use crate::op::OpId;
+use crate::thread_pool;
+
+//waking an idle pool worker, it sleeps on an untrusted event
+const SPAWN_COST_NS: f64 = 20_000.0;
+//time one trusted heap allocation holds the dlmalloc lock
+const HEAP_LOCK_NS: f64 = 60.0;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum ParaStep {
+    Decrypt,
+    Narrow,
+    Merge,
+    Shuffle,
+    Aggregate,
+}
+
+lazy_static! {
+    static ref PLANS: RwLock<HashMap<(OpId, ParaStep), usize>> = RwLock::new(HashMap::new());
+}
+
+//measures the sample block of a step, counting from start() to stop()
+#[derive(Debug)]
+pub struct Probe {
+    start: Instant,
+    allocs: usize,
+}
+
+impl Probe {
+    pub fn start() -> Self {
+        crate::ALLOCATOR.begin_sampling();
+        Probe {
+            start: Instant::now(),
+            allocs: crate::ALLOCATOR.get_alloc_cnt(),
+        }
+    }
+
+    //items and bytes the sample block covered, bytes is 0 if nothing was decrypted
+    pub fn stop(self, items: usize, bytes: usize) -> Sample {
+        Sample {
+            nanos: self.start.elapsed().as_nanos() as f64,
+            allocs: crate::ALLOCATOR.get_alloc_cnt().wrapping_sub(self.allocs),
+            items,
+            bytes,
+        }
+    }
+}
+
+//a NextOpId cloned in the sample block carries a probe of its own
+impl Clone for Probe {
+    fn clone(&self) -> Self {
+        crate::ALLOCATOR.begin_sampling();
+        Probe {
+            start: self.start,
+            allocs: self.allocs,
+        }
+    }
+}
+
+//also ends the sampling of a probe that is never stopped, when the source
+//did not split its input
+impl Drop for Probe {
+    fn drop(&mut self) {
+        crate::ALLOCATOR.end_sampling();
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+pub struct Sample {
+    nanos: f64,
+    allocs: usize,
+    items: usize,
+    bytes: usize,
+}
+
+impl Sample {
+    //how many times the sample is left, in bytes if the sample decrypted any
+    pub fn remaining(&self, blocks: usize, bytes: usize) -> f64 {
+        if self.bytes > 0 {
+            bytes as f64 / self.bytes as f64
+        } else {
+            blocks as f64
+        }
+    }
+}
+
+fn estimate(sample: &Sample, remaining: f64) -> usize {
+    if sample.items == 0 || sample.nanos <= 0.0 || remaining <= 0.0 {
+        return 0;
+    }
+    let work = sample.nanos * remaining;
+    //share of the step that is serialized on the trusted heap lock
+    let serial = (sample.allocs as f64 * HEAP_LOCK_NS / sample.nanos).min(1.0);
+    let mut best = (work, 0);
+    for n in 1..=thread_pool::num_workers() {
+        let t = work * (serial + (1.0 - serial) / n as f64) + SPAWN_COST_NS * n as f64;
+        if t < best.0 {
+            best = (t, n);
+        }
+    }
+    best.1
+}
+
+//worker threads for the rest of the step, 0 means to stay on the current thread
+pub fn plan(op_id: OpId, step: ParaStep, sample: &Sample, remaining: f64) -> usize {
+    if let Some(threads) = PLANS.read().unwrap().get(&(op_id, step)) {
+        return *threads;
+    }
+    let threads = estimate(sample, remaining);
+    println!("for {:?}, sample = {:?}, remaining = {:?}, threads = {:?}", step, sample, remaining, threads);
+    PLANS.write().unwrap().insert((op_id, step), threads);
+    threads
+}
@@ -52,20 +52,6 @@ where
     T: Data,
     F: SerFunc(Box<dyn Iterator<Item = T>>) -> Vec<T>,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step0_of_clone(p_buf, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            3 | 4 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => unreachable!(),
-        }
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             3 | 4 => self.free_res_enc(res_ptr, is_enc),
@@ -117,9 +103,13 @@ where
                 .collect::<Vec<_>>();
             res_enc_to_ptr(result_enc) 
         } else if dep_info.dep_type() == 4 {
-            let data_enc = input.get_enc_data::<Vec<ItemE>>();
-            let data = batch_decrypt(data_enc, true);
-            let result = (self.f)(Box::new(data.into_iter()));
+            let (f, g) = (self.f.clone(), self.f.clone());
+            let result = fold_blocks(
+                self.get_op_id(),
+                input,
+                move |block: Vec<T>| (f)(Box::new(block.into_iter())),
+                move |partials: Vec<Vec<T>>| (g)(Box::new(partials.into_iter().flatten())),
+            );
             let result_enc = result.into_iter()
                 .map(|x| ser_encrypt(&x))
                 .collect::<Vec<_>>();
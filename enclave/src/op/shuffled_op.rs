@@ -52,20 +52,57 @@ where
         aggregator: Arc<Aggregator<K, V, C>>,
         part: Box<dyn Partitioner>,
     ) -> Self {
+        Shuffled::new_with_dep(parent, aggregator, part, |shuf_dep| shuf_dep)
+    }
+
+    //salt_hot_keys spreads the hot keys of the shuffle over all reducers, see
+    //ShuffleDependency::salted
+    #[track_caller]
+    pub(crate) fn new_with_salting(
+        parent: Arc<dyn Op<Item = (K, V)>>,
+        aggregator: Arc<Aggregator<K, V, C>>,
+        part: Box<dyn Partitioner>,
+        salt_hot_keys: bool,
+    ) -> Self {
+        Shuffled::new_with_dep(parent, aggregator, part, |shuf_dep| match salt_hot_keys {
+            true => shuf_dep.salted(),
+            false => shuf_dep,
+        })
+    }
+
+    //only the keys of the shuffle matter, see ShuffleDependency::dedup_keys
+    #[track_caller]
+    pub(crate) fn new_deduped(
+        parent: Arc<dyn Op<Item = (K, V)>>,
+        aggregator: Arc<Aggregator<K, V, C>>,
+        part: Box<dyn Partitioner>,
+    ) -> Self {
+        Shuffled::new_with_dep(parent, aggregator, part, |shuf_dep| shuf_dep.dedup_keys())
+    }
+
+    #[track_caller]
+    fn new_with_dep<D>(
+        parent: Arc<dyn Op<Item = (K, V)>>,
+        aggregator: Arc<Aggregator<K, V, C>>,
+        part: Box<dyn Partitioner>,
+        with_dep: D,
+    ) -> Self
+    where
+        D: FnOnce(ShuffleDependency<K, V, C>) -> ShuffleDependency<K, V, C>,
+    {
         let ctx = parent.get_context();
         let mut vals = OpVals::new(ctx, part.get_num_of_partitions());
         let cur_id = vals.id;
         let prev_id = parent.get_op_id();
-        let dep = Dependency::ShuffleDependency(Arc::new(
-            ShuffleDependency::new(
-                false,
-                aggregator.clone(),
-                part.clone(),
-                0,
-                prev_id,
-                cur_id,
-            ),
+        let shuf_dep = with_dep(ShuffleDependency::new(
+            false,
+            aggregator.clone(),
+            part.clone(),
+            0,
+            prev_id,
+            cur_id,
         ));
+        let dep = Dependency::ShuffleDependency(Arc::new(shuf_dep));
 
         vals.deps.push(dep.clone());
         let vals = Arc::new(vals);
@@ -80,6 +117,8 @@ where
         }
     }
 
+    //the combiners of every sub-bucket come out in the order of the sub-buckets,
+    //so under a range partitioner the whole partition is in key order
     pub fn compute_inner(&self, tid: u64, input: Input) -> Vec<ItemE> {
         fn merge_core<K: Ord + Data, V: Data, C: Data>(buckets: Vec<Vec<(K, C)>>, aggregator: &Arc<Aggregator<K, V, C>>) -> Vec<(K, C)> {
             let mut iter = buckets.into_iter().kmerge_by(|a, b| a.0 < b.0);
@@ -99,95 +138,135 @@ where
             combiners
         }
         
-        let mut acc = create_enc();
         let data_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
-        assert_eq!(data_enc.len(), MAX_THREAD + 1);
+        assert_eq!(data_enc.len(), max_thread() + 1);
+        let tag = self.get_op_id().get_hash();
+        let total_bytes = data_enc.iter().flatten().flatten().map(|block| block.len()).sum::<usize>();
+        if total_bytes > ext_merge::EXT_MERGE_BYTES {
+            //too big to decrypt at once, stream the runs instead
+            let mut handlers = Vec::with_capacity(max_thread());
+            for i in 1..max_thread() + 1 {
+                let aggregator = self.aggregator.clone();
+                let handler = thread_pool::spawn(move || {
+                    crate::ALLOCATOR.set_profile_tag(tag);
+                    let buckets_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
+                    ext_merge::merge_runs(&buckets_enc[i], &aggregator)
+                });
+                handlers.push(handler);
+            }
+            let mut acc = ext_merge::merge_runs(&data_enc[0], &self.aggregator);
+            for handler in handlers {
+                combine_enc(&mut acc, handler.join().unwrap());
+            }
+            return acc;
+        }
+
+        //a sub-bucket only one mapper wrote to is handed on as its blocks.
+        //the sample is merged anyway unless all of them are, as the planner
+        //times it
+        let forwarded = data_enc[1..].iter()
+            .map(|buckets_enc| ext_merge::only_run(buckets_enc).map(|run| ext_merge::forward_run(run)))
+            .collect::<Vec<_>>();
+        if forwarded.iter().all(|run| run.is_some()) {
+            if let Some(run) = ext_merge::only_run(&data_enc[0]) {
+                let mut acc = ext_merge::forward_run(run);
+                for run in forwarded {
+                    combine_enc(&mut acc, run.unwrap());
+                }
+                return acc;
+            }
+        }
+        let merged = (1..max_thread() + 1).filter(|&i| forwarded[i - 1].is_none()).collect::<Vec<_>>();
+
+        let mut acc = create_enc();
         let (is_para_enc, is_para_mer) = {
-            crate::ALLOCATOR.reset_alloc_cnt();
+            let op_id = self.get_op_id();
+            let enc_bytes = |buckets_enc: &Vec<Vec<ItemE>>| {
+                buckets_enc.iter().flatten().map(|block| block.len()).sum::<usize>()
+            };
+            let probe = planner::Probe::start();
             let sample_data = data_enc[0].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>();
             let sample_len = sample_data.iter().map(|v| v.len()).sum::<usize>();
-            let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
-            let alloc_cnt_ratio = (alloc_cnt as f64)/(sample_len as f64);
-            let is_para_enc = alloc_cnt_ratio < PARA_THRESHOLD;
-            println!("for decryption, alloc_cnt per len = {:?}", alloc_cnt_ratio);
+            let sample = probe.stop(sample_len, enc_bytes(&data_enc[0]));
+            let remaining = sample.remaining(max_thread(), merged.iter().map(|&i| enc_bytes(&data_enc[i])).sum());
+            let is_para_enc = planner::plan(op_id, planner::ParaStep::Decrypt, &sample, remaining) > 0;
 
-            crate::ALLOCATOR.reset_alloc_cnt();
+            let probe = planner::Probe::start();
             let combiners = merge_core(sample_data, &self.aggregator);
-            let alloc_cnt = crate::ALLOCATOR.get_alloc_cnt();
-            let alloc_cnt_ratio = (alloc_cnt as f64)/(sample_len as f64);
-            let is_para_merge = alloc_cnt_ratio < PARA_THRESHOLD;
-            println!("for merge, alloc_cnt per len = {:?}", alloc_cnt_ratio);
+            let sample = probe.stop(sample_len, 0);
+            let is_para_merge = planner::plan(op_id, planner::ParaStep::Merge, &sample, max_thread() as f64) > 0;
             combine_enc(&mut acc, batch_encrypt(&combiners, true));
             (is_para_enc, is_para_merge)
         };
 
-        let mut handlers = Vec::with_capacity(MAX_THREAD);
+        let mut handlers = Vec::with_capacity(max_thread());
         if !is_para_enc {
-            let mut data = data_enc[1..MAX_THREAD+1].iter().map(|buckets_enc| {
-                buckets_enc.iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>()
+            let data = merged.iter().map(|&i| {
+                data_enc[i].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>()
             }).collect::<Vec<_>>();
             if !is_para_mer {
-                let mut combiners = data.into_iter().map(|buckets| merge_core(buckets, &self.aggregator)).collect::<Vec<_>>();
-                for i in 0..MAX_THREAD {
-                    let combiners = combiners.pop().unwrap();
-                    let builder = thread::Builder::new();
-                    let handler = builder
-                        .spawn(move || {
-                            batch_encrypt(&combiners, true)
-                        }).unwrap();
+                let combiners = data.into_iter().map(|buckets| merge_core(buckets, &self.aggregator)).collect::<Vec<_>>();
+                for combiners in combiners {
+                    let handler = thread_pool::spawn(move || {
+                        crate::ALLOCATOR.set_profile_tag(tag);
+                        batch_encrypt(&combiners, true)
+                    });
                     handlers.push(handler);
                 }
             } else {
-                for i in 0..MAX_THREAD {
+                for buckets in data {
                     let aggregator = self.aggregator.clone();
-                    let buckets = data.pop().unwrap();
-                    let builder = thread::Builder::new();
-                    let handler = builder
-                        .spawn(move || {
-                            let combiners = merge_core(buckets, &aggregator);
-                            batch_encrypt(&combiners, true)
-                        }).unwrap();
+                    let handler = thread_pool::spawn(move || {
+                        crate::ALLOCATOR.set_profile_tag(tag);
+                        let combiners = merge_core(buckets, &aggregator);
+                        batch_encrypt(&combiners, true)
+                    });
                     handlers.push(handler);
                 }
             }
         } else {
             if !is_para_mer {
-                let mut handlers_pt = Vec::with_capacity(MAX_THREAD);
-                for i in 1..MAX_THREAD + 1 {
-                    let handler = thread::Builder::new()
-                        .spawn(move || {
-                            let buckets_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
-                            buckets_enc[i].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>()
-                        }).unwrap();
+                let mut handlers_pt = Vec::with_capacity(max_thread());
+                for &i in &merged {
+                    let handler = thread_pool::spawn(move || {
+                        crate::ALLOCATOR.set_profile_tag(tag);
+                        let buckets_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
+                        buckets_enc[i].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>()
+                    });
                     handlers_pt.push(handler);
                 }
                 for handler in handlers_pt {
                     let aggregator = self.aggregator.clone();
                     let buckets = handler.join().unwrap();
                     let combiners = merge_core(buckets, &aggregator);
-                    let handler = thread::Builder::new()
-                        .spawn(move || {
-                            batch_encrypt(&combiners, true)
-                        }).unwrap();
+                    let handler = thread_pool::spawn(move || {
+                        crate::ALLOCATOR.set_profile_tag(tag);
+                        batch_encrypt(&combiners, true)
+                    });
                     handlers.push(handler);
                 }
             } else {
-                for i in 1..MAX_THREAD + 1 {
+                for &i in &merged {
                     let aggregator = self.aggregator.clone();
-                    let handler = thread::Builder::new()
-                        .spawn(move || {
-                            let buckets_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
-                            let buckets = buckets_enc[i].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>();
-                            let combiners = merge_core(buckets, &aggregator);
-                            batch_encrypt(&combiners, true)
-                        }).unwrap();
+                    let handler = thread_pool::spawn(move || {
+                        crate::ALLOCATOR.set_profile_tag(tag);
+                        let buckets_enc = input.get_enc_data::<Vec<Vec<Vec<ItemE>>>>();
+                        let buckets = buckets_enc[i].iter().map(|bucket_enc| batch_decrypt::<(K, C)>(bucket_enc, true)).collect::<Vec<_>>();
+                        let combiners = merge_core(buckets, &aggregator);
+                        batch_encrypt(&combiners, true)
+                    });
                     handlers.push(handler);
                 }
             }
         }
 
-        for handler in handlers {
-            combine_enc(&mut acc, handler.join().unwrap());
+        let mut handlers = handlers.into_iter();
+        for run in forwarded {
+            let blocks = match run {
+                Some(blocks) => blocks,
+                None => handlers.next().unwrap().join().unwrap(),
+            };
+            combine_enc(&mut acc, blocks);
         }
 
         acc
@@ -200,20 +279,6 @@ where
     V: Data, 
     C: Data,
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 | 2 => self.free_res_enc(res_ptr, is_enc),
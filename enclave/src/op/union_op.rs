@@ -106,25 +106,10 @@ impl<T: Data> Union<T>
             })
             .is_ok()
     }
-
 }
 
 impl<T: Data> OpBase for Union<T>
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 => self.step1_of_clone(p_out, p_data_enc, dep_info), 
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 => self.free_res_enc(res_ptr, is_enc),
@@ -214,7 +199,10 @@ impl<T: Data> Op for Union<T>
     fn compute_start(&self, mut call_seq: NextOpId, input: Input, dep_info: &DepInfo) -> *mut u8 {
         match dep_info.dep_type() {
             0 => {    
-                self.narrow(call_seq, input, true)
+                match forward_head_blocks::<T>(&call_seq, &input) {
+                    Some(res_ptr) => res_ptr,
+                    None => self.narrow(call_seq, input, true),
+                }
             },
             1 => { 
                 self.shuffle(call_seq, input, dep_info)
@@ -63,6 +63,31 @@ where
             cache_space: Arc::new(Mutex::new(HashMap::new()))
         }
     }
+
+    //whether the blocks of both sides hold the same numbers of items, read from
+    //the counts of counted blocks without decrypting them. a count is the
+    //associated data of its block, so it is checked when the block is decrypted
+    fn aligned(first: &[ItemE], second: &[ItemE]) -> bool {
+        first.len() == second.len()
+            && first.iter().zip(second.iter()).all(|(f, s)| {
+                let count = split_count(block_stats::body(f)).0;
+                count.is_some() && count == split_count(block_stats::body(s)).0
+            })
+    }
+
+    //pairs the aligned blocks one by one, a single plaintext block per side
+    //is resident at a time
+    fn zip_aligned(first: &[ItemE], second: &[ItemE]) -> Vec<ItemE> {
+        let mut acc = create_enc();
+        for (f, s) in first.iter().zip(second.iter()) {
+            let f = ser_decrypt_outside::<Vec<T>>(f);
+            let s = ser_decrypt_outside::<Vec<U>>(s);
+            assert!(f.len() == s.len(), "zipped blocks differ in length");
+            let block = f.into_iter().zip(s.into_iter()).collect::<Vec<_>>();
+            push_enc(&mut acc, ser_encrypt_outside_counted(&block));
+        }
+        acc
+    }
 }
 
 impl<T, U> OpBase for Zipped<T, U> 
@@ -70,20 +95,6 @@ where
     T: Data, 
     U: Data, 
 {
-    fn build_enc_data_sketch(&self, p_buf: *mut u8, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step0_of_clone(p_buf, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }
-    }
-
-    fn clone_enc_data_out(&self, p_out: usize, p_data_enc: *mut u8, dep_info: &DepInfo) {
-        match dep_info.dep_type() {
-            0 | 1 | 2 => self.step1_of_clone(p_out, p_data_enc, dep_info),
-            _ => panic!("invalid is_shuffle"),
-        }   
-    }
-
     fn call_free_res_enc(&self, res_ptr: *mut u8, is_enc: bool, dep_info: &DepInfo) {
         match dep_info.dep_type() {
             0 | 2 => self.free_res_enc(res_ptr, is_enc),
@@ -182,8 +193,12 @@ where
                 self.shuffle(call_seq, input, dep_info)
             },
             2 => {       //zip
-                println!("secure_zip ");
                 let (first, second) = input.get_enc_data::<(Vec<ItemE>, Vec<ItemE>)>();
+                if Self::aligned(first, second) {
+                    return to_ptr(Self::zip_aligned(first, second));
+                }
+                //the blocks are cut differently, the items left over from one
+                //block of a side wait for the next block of the other
                 let mut cur_f = 0; 
                 let mut cur_s = 0;
 
@@ -195,17 +210,21 @@ where
                     let mut s = Vec::new();
                     std::mem::swap(&mut f, &mut r_f);
                     std::mem::swap(&mut s, &mut r_s);
-                    f.append(&mut ser_decrypt::<Vec<T>>(&first[cur_f].clone()));
-                    s.append(&mut ser_decrypt::<Vec<U>>(&second[cur_s].clone()));
+                    if cur_f < first.len() {
+                        f.append(&mut ser_decrypt_outside::<Vec<T>>(&first[cur_f]));
+                        cur_f += 1;
+                    }
+                    if cur_s < second.len() {
+                        s.append(&mut ser_decrypt_outside::<Vec<U>>(&second[cur_s]));
+                        cur_s += 1;
+                    }
                     if f.len() > s.len() {
                         r_f = f.split_off(s.len());
                     } else {
                         r_s = s.split_off(f.len());
                     }
                     let block = f.into_iter().zip(s.into_iter()).collect::<Vec<_>>();
-                    merge_enc(&mut acc, &ser_encrypt(&block));
-                    cur_f += 1;
-                    cur_s += 1;
+                    push_enc(&mut acc, ser_encrypt_outside_counted(&block));
                 }
                 to_ptr(acc)
             }
@@ -1,8 +1,10 @@
-use std::collections::hash_map::DefaultHasher;
+use std::convert::TryInto;
 use std::hash::{Hash, Hasher};
 use std::any::Any;
 use std::marker::PhantomData;
+use std::vec::Vec;
 use crate::basic::Data;
+use crate::op::max_thread;
 use downcast_rs::Downcast;
 
 pub trait Partitioner: Downcast + dyn_clone::DynClone + Send + Sync {
@@ -14,12 +16,92 @@ pub trait Partitioner: Downcast + dyn_clone::DynClone + Send + Sync {
 
 dyn_clone::clone_trait_object!(Partitioner);
 
+//a partitioner of a known key type, so the bucketing loop of a shuffle goes
+//without a downcast and a virtual call per record
+pub trait TypedPartitioner<K> {
+    fn partition_of(&self, key: &K) -> usize;
+
+    fn partition_many(&self, keys: &[K]) -> Vec<u32> {
+        keys.iter().map(|key| self.partition_of(key) as u32).collect()
+    }
+}
+
+//any other partitioner still works, through get_partition
+impl<K: Any> TypedPartitioner<K> for dyn Partitioner {
+    fn partition_of(&self, key: &K) -> usize {
+        self.get_partition(key)
+    }
+}
+
+const FX_SEED: u64 = 0x51_7c_c1_b7_27_22_0a_95;
+
+//FxHash, a rotate and a multiply per word. the hash only routes records to
+//buckets and never leaves the enclave, so it need not resist collisions. the
+//host hashes keys the same way (framework/src/partitioner.rs)
+#[derive(Default)]
+struct FxHasher {
+    hash: u64,
+}
+
+impl FxHasher {
+    #[inline(always)]
+    fn add(&mut self, word: u64) {
+        self.hash = (self.hash.rotate_left(5) ^ word).wrapping_mul(FX_SEED);
+    }
+}
+
+impl Hasher for FxHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        let mut words = bytes.chunks_exact(8);
+        for word in &mut words {
+            self.add(u64::from_le_bytes(word.try_into().unwrap()));
+        }
+        let rest = words.remainder();
+        if !rest.is_empty() {
+            let mut word = [0; 8];
+            word[..rest.len()].copy_from_slice(rest);
+            self.add(u64::from_le_bytes(word));
+        }
+    }
+
+    fn write_u8(&mut self, i: u8) {
+        self.add(i as u64);
+    }
+
+    fn write_u16(&mut self, i: u16) {
+        self.add(i as u64);
+    }
+
+    fn write_u32(&mut self, i: u32) {
+        self.add(i as u64);
+    }
+
+    fn write_u64(&mut self, i: u64) {
+        self.add(i);
+    }
+
+    fn write_usize(&mut self, i: usize) {
+        self.add(i as u64);
+    }
+
+    fn finish(&self) -> u64 {
+        self.hash
+    }
+}
+
 fn hash<T: Hash>(t: &T) -> u64 {
-    let mut s = DefaultHasher::new();
+    let mut s = FxHasher::default();
     t.hash(&mut s);
     s.finish()
 }
 
+//maps the hash onto 0..partitions by its high bits, which is where the
+//multiply leaves the entropy, and without a division
+#[inline(always)]
+fn reduce(hash: u64, partitions: usize) -> usize {
+    ((hash as u128 * partitions as u128) >> 64) as usize
+}
+
 #[derive(Clone)]
 pub struct HashPartitioner<K: Data + Hash + Eq> {
     partitions: usize,
@@ -49,9 +131,84 @@ impl<K: Data + Hash + Eq> Partitioner for HashPartitioner<K> {
     }
     fn get_partition(&self, key: &dyn Any) -> usize {
         let key = key.downcast_ref::<K>().unwrap();
-        hash(key) as usize % self.partitions
+        self.partition_of(key)
+    }
+    fn set_num_of_partitions(&mut self, partitions: usize) {
+        self.partitions = partitions;
+    }
+}
+
+impl<K: Data + Hash + Eq> TypedPartitioner<K> for HashPartitioner<K> {
+    #[inline(always)]
+    fn partition_of(&self, key: &K) -> usize {
+        reduce(hash(key), self.partitions)
+    }
+
+    fn partition_many(&self, keys: &[K]) -> Vec<u32> {
+        let partitions = self.partitions;
+        keys.iter().map(|key| reduce(hash(key), partitions) as u32).collect()
+    }
+}
+
+//routes keys by sorted bounds, so every key of a partition is below those of
+//the next and the reduce side comes out in key order. the shuffle asks for
+//partitions * (max_thread + 1) buckets and gives each reduce partition a run
+//of consecutive ones, so from_sample cuts the key space into that many ranges
+//and get_partition spreads them evenly and in order over however many
+//partitions are set
+#[derive(Clone)]
+pub struct RangePartitioner<K: Data + Ord> {
+    partitions: usize,
+    //sorted, range i holds the keys up to and including bounds[i]
+    bounds: Vec<K>,
+}
+
+impl<K: Data + Ord> RangePartitioner<K> {
+    pub fn new(partitions: usize, bounds: Vec<K>) -> Self {
+        assert!(bounds.windows(2).all(|w| w[0] <= w[1]), "range bounds are not sorted");
+        RangePartitioner {
+            partitions,
+            bounds,
+        }
+    }
+
+    //bounds at the quantiles of a sample of the keys, e.g. collected from
+    //keys.sample(..), which is drawn inside the enclave
+    pub fn from_sample(partitions: usize, mut sample: Vec<K>) -> Self {
+        sample.sort_unstable();
+        let ranges = partitions * (max_thread() + 1);
+        let bounds = if sample.is_empty() {
+            Vec::new()
+        } else {
+            (1..ranges).map(|i| sample[i * sample.len() / ranges].clone()).collect()
+        };
+        RangePartitioner::new(partitions, bounds)
+    }
+}
+
+impl<K: Data + Ord> Partitioner for RangePartitioner<K> {
+    fn equals(&self, other: &dyn Any) -> bool {
+        if let Some(rp) = other.downcast_ref::<RangePartitioner<K>>() {
+            self.partitions == rp.partitions && self.bounds == rp.bounds
+        } else {
+            false
+        }
+    }
+    fn get_num_of_partitions(&self) -> usize {
+        self.partitions
+    }
+    fn get_partition(&self, key: &dyn Any) -> usize {
+        let key = key.downcast_ref::<K>().unwrap();
+        self.partition_of(key)
     }
     fn set_num_of_partitions(&mut self, partitions: usize) {
         self.partitions = partitions;
     }
 }
+
+impl<K: Data + Ord> TypedPartitioner<K> for RangePartitioner<K> {
+    fn partition_of(&self, key: &K) -> usize {
+        let range = self.bounds.partition_point(|bound| bound < key);
+        range * self.partitions / (self.bounds.len() + 1)
+    }
+}
@@ -0,0 +1,140 @@
+//! Provisioning of the master key, attested once per measurement per host.
+//!
+//! A deployment with a key service (VEGA_KEY_SERVICE) does not run on the
+//! development key of op/keys.rs. The enclave makes an ephemeral P-256 key
+//! pair and a report for the quoting enclave that carries the hash of its
+//! public half, the host turns it into a quote, and the key service verifies
+//! the quote and answers with its own public key and the master key wrapped
+//! under the ECDH secret of the two. Wrapped keys only open in the enclave
+//! that made the pair.
+//!
+//! Attesting takes seconds, so the enclave seals the master key it got to
+//! MRENCLAVE and the host keeps it per enclave build. The enclaves started
+//! later on that host unseal it instead of attesting again, unless the TCB
+//! the key was sealed under is not the current one: a key sealed before a
+//! microcode or enclave SVN update is refused, so the key service sees the
+//! new TCB before it hands the key out again.
+use std::sync::SgxMutex as Mutex;
+use std::vec::Vec;
+
+use sgx_tcrypto::{rsgx_rijndael128GCM_decrypt, rsgx_rijndael128_cmac_slice, rsgx_sha256_slice, SgxEccHandle};
+use sgx_tse::{rsgx_create_report, rsgx_self_report};
+use sgx_tseal::SgxSealedData;
+use sgx_types::*;
+
+use crate::op::keys::{self, KEY_LEN, NONCE_LEN, TAG_LEN};
+
+//the associated data of a sealed or a wrapped master key
+const MASTER_AAD: &[u8] = b"master key\0";
+
+pub const UNSEALED: i32 = 0;
+pub const TCB_CHANGED: i32 = 1;
+pub const NOT_SEALED: i32 = 2;
+
+lazy_static! {
+    //the private half of the pair of the attestation under way
+    static ref PENDING: Mutex<Option<sgx_ec256_private_t>> = Mutex::new(None);
+}
+
+//a report for the quoting enclave of target_info, with the hash of the new
+//public key as its report data
+pub fn begin(target_info: &sgx_target_info_t) -> Option<(sgx_report_t, sgx_ec256_public_t)> {
+    let ecc = SgxEccHandle::new();
+    ecc.open().ok()?;
+    let (private, public) = ecc.create_key_pair().ok()?;
+    let mut key = public.gx.to_vec();
+    key.extend_from_slice(&public.gy);
+    //sha256(gx || gy), zero padded
+    let mut report_data = sgx_report_data_t::default();
+    report_data.d[..32].copy_from_slice(&rsgx_sha256_slice(&key).ok()?);
+    let report = rsgx_create_report(target_info, &report_data).ok()?;
+    *PENDING.lock().unwrap() = Some(private);
+    Some((report, public))
+}
+
+//the key the master key is wrapped under, the same derivation as the KDK of
+//the sgx key exchange
+fn wrapping_key(private: &sgx_ec256_private_t, peer: &sgx_ec256_public_t) -> Option<[u8; KEY_LEN]> {
+    let ecc = SgxEccHandle::new();
+    ecc.open().ok()?;
+    let shared = ecc.compute_shared_dhkey(private, peer).ok()?;
+    let kdk = rsgx_rijndael128_cmac_slice(&[0; KEY_LEN], &shared.s).ok()?;
+    rsgx_rijndael128_cmac_slice(&kdk, MASTER_AAD).ok()
+}
+
+//install the master key the key service wrapped, nonce || ciphertext || tag,
+//false if it does not open under the pending pair
+pub fn finish(peer: &sgx_ec256_public_t, wrapped: &[u8]) -> bool {
+    //a pair is used for one key only
+    let private = match PENDING.lock().unwrap().take() {
+        Some(private) => private,
+        None => return false,
+    };
+    if wrapped.len() != NONCE_LEN + KEY_LEN + TAG_LEN {
+        return false;
+    }
+    let key = match wrapping_key(&private, peer) {
+        Some(key) => key,
+        None => return false,
+    };
+    let (nonce, rest) = wrapped.split_at(NONCE_LEN);
+    let (ct, tag) = rest.split_at(KEY_LEN);
+    let mut mac = [0; TAG_LEN];
+    mac.copy_from_slice(tag);
+    let mut master = [0; KEY_LEN];
+    if rsgx_rijndael128GCM_decrypt(&key, ct, nonce, MASTER_AAD, &mac, &mut master).is_err() {
+        return false;
+    }
+    keys::set_master_key(master);
+    true
+}
+
+//the master key sealed to this enclave under the current TCB
+pub fn seal() -> Option<Vec<u8>> {
+    let payload = keys::master_key();
+    let attribute_mask = sgx_attributes_t {
+        flags: TSEAL_DEFAULT_FLAGSMASK,
+        xfrm: 0,
+    };
+    let sealed = SgxSealedData::<[u8]>::seal_data_ex(
+        SGX_KEYPOLICY_MRENCLAVE,
+        attribute_mask,
+        TSEAL_DEFAULT_MISCMASK,
+        MASTER_AAD,
+        &payload,
+    )
+    .ok()?;
+    let len = SgxSealedData::<[u8]>::calc_raw_sealed_data_size(MASTER_AAD.len() as u32, payload.len() as u32);
+    let mut raw = vec![0u8; len as usize];
+    unsafe { sealed.to_raw_sealed_data_t(raw.as_mut_ptr() as *mut sgx_sealed_data_t, len) }?;
+    Some(raw)
+}
+
+//install a master key sealed by an enclave of this build on this host.
+//TCB_CHANGED if it was sealed under another cpu or enclave svn, the host
+//attests again then
+pub fn unseal(raw: &mut [u8]) -> i32 {
+    let sealed = unsafe {
+        SgxSealedData::<[u8]>::from_raw_sealed_data_t(raw.as_mut_ptr() as *mut sgx_sealed_data_t, raw.len() as u32)
+    };
+    let sealed = match sealed {
+        Some(sealed) => sealed,
+        None => return NOT_SEALED,
+    };
+    let current = rsgx_self_report().body;
+    let request = sealed.get_key_request();
+    if request.cpu_svn.svn != current.cpu_svn.svn || request.isv_svn != current.isv_svn {
+        return TCB_CHANGED;
+    }
+    let unsealed = match sealed.unseal_data() {
+        Ok(unsealed) => unsealed,
+        Err(_) => return NOT_SEALED,
+    };
+    if unsealed.get_additional_txt() != MASTER_AAD || unsealed.get_decrypt_txt().len() != KEY_LEN {
+        return NOT_SEALED;
+    }
+    let mut master = [0; KEY_LEN];
+    master.copy_from_slice(unsealed.get_decrypt_txt());
+    keys::set_master_key(master);
+    UNSEALED
+}
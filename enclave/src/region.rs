@@ -0,0 +1,268 @@
+//! Bump-pointer regions in outside memory for task outputs that die together.
+//!
+//! The ciphertext a shuffle writer produces is consumed by the host as a whole
+//! (get_encrypted_data) and then released with one free_res_enc. Instead of going
+//! through tcmalloc block by block, a task can enter an `OutsideRegion`: while a
+//! thread holds a guard from `enter()` its outside allocations are bumped out of
+//! 2MB chunks that belong to the region, frees of region memory are no-ops, and
+//! releasing the region hands all chunks back at once.
+//!
+//! Chunks are carved from one pool reserved with mmap_o, so telling region
+//! memory apart from tcmalloc memory is a range check.
+use core::alloc::Layout;
+use core::cell::Cell;
+use core::ptr;
+use std::collections::HashMap;
+use std::sync::{
+    atomic::{AtomicI32, AtomicUsize, Ordering},
+    Arc, SgxMutex as Mutex,
+};
+use std::vec::Vec;
+
+use sgx_types::*;
+
+extern "C" {
+    fn mmap_o(retval: *mut *mut c_void, size: usize, alignment: usize, huge_page: u8, node: i32) -> sgx_status_t;
+    fn madvise_o(retval: *mut i32, addr: *mut c_void, size: usize) -> sgx_status_t;
+}
+
+pub const REGION_CHUNK_SIZE: usize = 2 << 20;
+//virtual only, the host maps it with MAP_NORESERVE
+const REGION_POOL_SIZE: usize = 64 << 30;
+//released chunks beyond this are given back to the OS with madvise
+const REGION_CACHE_LIMIT: usize = 256 << 20;
+//objects above this get a chunk run of their own instead of wasting the rest of a chunk
+const REGION_LARGE_SIZE: usize = REGION_CHUNK_SIZE / 4;
+
+static POOL_BASE: AtomicUsize = AtomicUsize::new(0);
+static POOL_END: AtomicUsize = AtomicUsize::new(0);
+//the numa node of the pool, -1 leaves its pages to first touch
+static POOL_NODE: AtomicI32 = AtomicI32::new(-1);
+
+struct Pool {
+    next: usize,
+    //chunk count -> bases of released runs of that many chunks
+    free: HashMap<usize, Vec<usize>>,
+    cached_bytes: usize,
+}
+
+lazy_static! {
+    static ref POOL: Mutex<Pool> = Mutex::new(Pool {
+        next: 0,
+        free: HashMap::new(),
+        cached_bytes: 0,
+    });
+    //result pointer -> region holding it, see seal/release
+    static ref SEALED: Mutex<HashMap<usize, OutsideRegion>> = Mutex::new(HashMap::new());
+}
+
+#[thread_local]
+static ACTIVE: Cell<*const RegionInner> = Cell::new(ptr::null());
+#[thread_local]
+static CUR: Cell<usize> = Cell::new(0);
+#[thread_local]
+static END: Cell<usize> = Cell::new(0);
+
+//region bookkeeping lives inside the enclave, so turn the switch off around it
+fn with_switch_off<R>(f: impl FnOnce() -> R) -> R {
+    let prev = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    let res = f();
+    crate::ALLOCATOR.set_switch(prev);
+    res
+}
+
+//the node the tcmalloc of this enclave places its outside memory on, before
+//the pool is reserved
+pub fn set_node(node: i32) {
+    POOL_NODE.store(node, Ordering::Relaxed);
+}
+
+fn reserve_pool(pool: &mut Pool) -> bool {
+    if POOL_END.load(Ordering::Acquire) != 0 {
+        return true;
+    }
+    let mut base: *mut c_void = ptr::null_mut();
+    let node = POOL_NODE.load(Ordering::Relaxed);
+    let sgx_status = unsafe { mmap_o(&mut base, REGION_POOL_SIZE, REGION_CHUNK_SIZE, 0, node) };
+    if sgx_status != sgx_status_t::SGX_SUCCESS || base.is_null() || base as isize == -1 {
+        return false;
+    }
+    pool.next = base as usize;
+    POOL_BASE.store(base as usize, Ordering::Release);
+    POOL_END.store(base as usize + REGION_POOL_SIZE, Ordering::Release);
+    true
+}
+
+fn take_run(chunks: usize) -> Option<usize> {
+    let mut pool = POOL.lock().unwrap();
+    if let Some(base) = pool.free.get_mut(&chunks).and_then(|runs| runs.pop()) {
+        pool.cached_bytes = pool.cached_bytes.saturating_sub(chunks * REGION_CHUNK_SIZE);
+        return Some(base);
+    }
+    if !reserve_pool(&mut pool) {
+        return None;
+    }
+    let size = chunks * REGION_CHUNK_SIZE;
+    if pool.next + size > POOL_END.load(Ordering::Relaxed) {
+        return None;
+    }
+    let base = pool.next;
+    pool.next += size;
+    Some(base)
+}
+
+fn give_back_runs(runs: Vec<(usize, usize)>) {
+    let mut pool = POOL.lock().unwrap();
+    for (base, chunks) in runs {
+        let size = chunks * REGION_CHUNK_SIZE;
+        if pool.cached_bytes + size > REGION_CACHE_LIMIT {
+            let mut res = 0;
+            unsafe { madvise_o(&mut res, base as *mut c_void, size) };
+        } else {
+            pool.cached_bytes += size;
+        }
+        pool.free.entry(chunks).or_insert_with(Vec::new).push(base);
+    }
+}
+
+//whether p was handed out by a region
+#[inline]
+pub fn contains(p: *mut u8) -> bool {
+    let p = p as usize;
+    p >= POOL_BASE.load(Ordering::Relaxed) && p < POOL_END.load(Ordering::Relaxed)
+}
+
+//bump allocate from the region the current thread entered, None if there is none
+#[inline]
+pub fn alloc(layout: &Layout) -> Option<*mut u8> {
+    let region = ACTIVE.get();
+    if region.is_null() {
+        return None;
+    }
+    let start = (CUR.get() + layout.align() - 1) & !(layout.align() - 1);
+    if start + layout.size() <= END.get() {
+        CUR.set(start + layout.size());
+        return Some(start as *mut u8);
+    }
+    Some(with_switch_off(|| unsafe { (*region).alloc_slow(layout) }))
+}
+
+struct RegionInner {
+    //(base, chunk count)
+    runs: Mutex<Vec<(usize, usize)>>,
+}
+
+impl RegionInner {
+    fn alloc_slow(&self, layout: &Layout) -> *mut u8 {
+        assert!(layout.align() <= REGION_CHUNK_SIZE);
+        if layout.size() > REGION_LARGE_SIZE {
+            let chunks = (layout.size() + REGION_CHUNK_SIZE - 1) / REGION_CHUNK_SIZE;
+            return match take_run(chunks) {
+                Some(base) => {
+                    self.runs.lock().unwrap().push((base, chunks));
+                    base as *mut u8
+                }
+                None => ptr::null_mut(),
+            };
+        }
+        match take_run(1) {
+            Some(base) => {
+                self.runs.lock().unwrap().push((base, 1));
+                CUR.set(base + layout.size());
+                END.set(base + REGION_CHUNK_SIZE);
+                base as *mut u8
+            }
+            None => ptr::null_mut(),
+        }
+    }
+}
+
+impl Drop for RegionInner {
+    fn drop(&mut self) {
+        let runs = std::mem::take(&mut *self.runs.lock().unwrap());
+        give_back_runs(runs);
+    }
+}
+
+#[derive(Clone)]
+pub struct OutsideRegion {
+    inner: Arc<RegionInner>,
+}
+
+pub struct RegionGuard<'a> {
+    prev: (*const RegionInner, usize, usize),
+    _region: &'a OutsideRegion,
+}
+
+impl<'a> Drop for RegionGuard<'a> {
+    fn drop(&mut self) {
+        let (active, cur, end) = self.prev;
+        ACTIVE.set(active);
+        CUR.set(cur);
+        END.set(end);
+    }
+}
+
+//leaves the region of the current thread until dropped, for running work
+//that does not belong to the task output on a thread that entered one
+pub struct DetachGuard {
+    prev: (*const RegionInner, usize, usize),
+}
+
+impl Drop for DetachGuard {
+    fn drop(&mut self) {
+        let (active, cur, end) = self.prev;
+        ACTIVE.set(active);
+        CUR.set(cur);
+        END.set(end);
+    }
+}
+
+pub fn detach() -> DetachGuard {
+    let prev = (ACTIVE.replace(ptr::null()), CUR.replace(0), END.replace(0));
+    DetachGuard { prev }
+}
+
+impl OutsideRegion {
+    pub fn new() -> Self {
+        OutsideRegion {
+            inner: Arc::new(RegionInner {
+                runs: Mutex::new(Vec::new()),
+            }),
+        }
+    }
+
+    //outside allocations of the current thread come from this region until the
+    //guard is dropped. every thread that touches the task output must enter
+    pub fn enter(&self) -> RegionGuard<'_> {
+        let prev = (ACTIVE.get(), CUR.get(), END.get());
+        ACTIVE.set(Arc::as_ptr(&self.inner));
+        CUR.set(0);
+        END.set(0);
+        RegionGuard {
+            prev,
+            _region: self,
+        }
+    }
+
+    //keep the region alive until release(res_ptr) is called for the task result
+    pub fn seal(self, res_ptr: *mut u8) {
+        with_switch_off(|| {
+            SEALED.lock().unwrap().insert(res_ptr as usize, self);
+        });
+    }
+}
+
+//drop the region holding res_ptr, if any. returns false if res_ptr was not
+//produced under a region and has to be freed the usual way
+pub fn release(res_ptr: *mut u8) -> bool {
+    let region = with_switch_off(|| SEALED.lock().unwrap().remove(&(res_ptr as usize)));
+    match region {
+        Some(region) => {
+            with_switch_off(|| drop(region));
+            true
+        }
+        None => false,
+    }
+}
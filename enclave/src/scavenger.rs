@@ -0,0 +1,94 @@
+//! Background release of the outside memory the page heap keeps free.
+//!
+//! tcmalloc returns free spans to the host only from the free path, at
+//! tcmalloc_release_rate, so a free that crosses the threshold pays the
+//! madvise_o of the release. The scavenger thread instead calls
+//! ocall_tc_scavenge_idle every interval, which releases the pages that
+//! stayed free since the previous pass, so memory the next stage reuses is
+//! kept and the rest does not add to the RSS of the host. The end of a task,
+//! its free_res_enc, brings a pass forward: one right away for what stayed
+//! free during the stage, and one a short grace later for what the tail of
+//! the stage freed and nothing took since.
+//!
+//! The thread holds a TCS for as long as the enclave runs, sleeping outside
+//! between passes.
+use std::boxed::Box;
+use std::cmp;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::SgxMutex as Mutex;
+use std::time::{Duration, Instant};
+use std::untrusted::time::InstantEx;
+
+use crate::custom_thread::PThread;
+
+extern "C" {
+    fn ocall_tc_scavenge_idle() -> usize;
+}
+
+//how often the thread checks for the end of a stage and for stop
+const TICK: Duration = Duration::from_millis(50);
+//between the pass at the end of a stage and the one for its tail
+const GRACE: Duration = Duration::from_millis(200);
+
+static STOP: AtomicBool = AtomicBool::new(false);
+static STAGE_ENDED: AtomicBool = AtomicBool::new(false);
+static RELEASED: AtomicU64 = AtomicU64::new(0);
+
+lazy_static! {
+    static ref THREAD: Mutex<Option<PThread>> = Mutex::new(None);
+}
+
+//start the thread with a pass every interval, later calls are ignored
+pub fn start(interval: Duration) {
+    let mut thread = THREAD.lock().unwrap();
+    if thread.is_some() || interval == Duration::from_secs(0) {
+        return;
+    }
+    STOP.store(false, Ordering::Release);
+    match unsafe { PThread::new(Box::new(move || run(interval))) } {
+        Ok(handle) => *thread = Some(handle),
+        //no TCS left, the free path still releases at tcmalloc_release_rate
+        Err(err) => println!("outside memory scavenger not started: {:?}", err),
+    }
+}
+
+//before the enclave is destroyed, the thread must not be inside by then
+pub fn stop() {
+    if let Some(handle) = THREAD.lock().unwrap().take() {
+        STOP.store(true, Ordering::Release);
+        handle.join();
+        println!("outside memory scavenger released {} bytes", RELEASED.load(Ordering::Relaxed));
+    }
+}
+
+//called when a task freed its results, at the tail of its stage
+pub fn stage_ended() {
+    STAGE_ENDED.store(true, Ordering::Release);
+}
+
+fn pass() {
+    let released = unsafe { ocall_tc_scavenge_idle() };
+    RELEASED.fetch_add(released as u64, Ordering::Relaxed);
+}
+
+fn run(interval: Duration) {
+    let mut last = Instant::now();
+    let mut next = last + interval;
+    //the pass after the one at the end of a stage comes after the grace
+    let mut tail = false;
+    while !STOP.load(Ordering::Acquire) {
+        PThread::sleep(TICK);
+        //stages that end in quick succession get a pass every grace at most
+        if STAGE_ENDED.swap(false, Ordering::AcqRel) {
+            next = cmp::min(next, last + GRACE);
+            tail = true;
+        }
+        let now = Instant::now();
+        if now >= next {
+            pass();
+            last = now;
+            next = now + if tail { GRACE } else { interval };
+            tail = false;
+        }
+    }
+}
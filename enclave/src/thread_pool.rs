@@ -0,0 +1,233 @@
+//! Persistent pool of enclave worker threads.
+//!
+//! Creating a thread inside the enclave costs a pthread_create ocall, a TCS
+//! bind and TLS initialization of the new thread, and the ops used to pay it
+//! for every batch of blocks they handed out. The pool is started once with
+//! the init_thread_pool ECALL, sized from the host configuration, and ops
+//! submit their decrypt/compute/encrypt closures to it with spawn().
+//!
+//! Every worker owns a deque. Jobs submitted by a worker go to the back of its
+//! own deque and are taken LIFO, jobs from other threads go to a shared
+//! injector, and an idle worker takes from the injector and then steals from
+//! the front of the other deques. A thread that joins a job runs queued jobs
+//! while it waits, so jobs may join jobs they submitted without running the
+//! pool dry.
+use core::cell::Cell;
+use std::boxed::Box;
+use std::collections::VecDeque;
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
+use std::sync::{
+    atomic::{AtomicBool, AtomicPtr, Ordering},
+    Arc, SgxCondvar as Condvar, SgxMutex as Mutex,
+};
+use std::thread;
+use std::vec::Vec;
+
+use crate::metrics;
+
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+const NOT_A_WORKER: usize = usize::MAX;
+
+static POOL: AtomicPtr<Pool> = AtomicPtr::new(ptr::null_mut());
+
+#[thread_local]
+static WORKER: Cell<usize> = Cell::new(NOT_A_WORKER);
+
+struct Pool {
+    injector: Mutex<VecDeque<Job>>,
+    locals: Vec<Mutex<VecDeque<Job>>>,
+    //jobs pushed and not yet taken, idle workers sleep on it
+    queued: Mutex<usize>,
+    wakeup: Condvar,
+    stop: AtomicBool,
+    threads: Mutex<Vec<thread::JoinHandle<()>>>,
+}
+
+impl Pool {
+    fn push(&self, job: Job) {
+        //count first, so that take() never sees a job that is not counted yet
+        *self.queued.lock().unwrap() += 1;
+        match WORKER.get() {
+            NOT_A_WORKER => self.injector.lock().unwrap().push_back(job),
+            idx => self.locals[idx].lock().unwrap().push_back(job),
+        }
+        self.wakeup.notify_one();
+    }
+
+    fn take(&self) -> Option<Job> {
+        let me = WORKER.get();
+        let job = if me != NOT_A_WORKER {
+            self.locals[me].lock().unwrap().pop_back()
+        } else {
+            None
+        }
+        .or_else(|| self.injector.lock().unwrap().pop_front())
+        .or_else(|| {
+            (0..self.locals.len())
+                .filter(|idx| *idx != me)
+                .find_map(|idx| self.locals[idx].lock().unwrap().pop_front())
+        });
+        if job.is_some() {
+            *self.queued.lock().unwrap() -= 1;
+        }
+        job
+    }
+
+    fn work(&self, idx: usize) {
+        WORKER.set(idx);
+        while !self.stop.load(Ordering::Acquire) {
+            match self.take() {
+                Some(job) => run(job),
+                None => {
+                    let queued = self.queued.lock().unwrap();
+                    if *queued == 0 && !self.stop.load(Ordering::Acquire) {
+                        drop(self.wakeup.wait(queued).unwrap());
+                    }
+                }
+            }
+        }
+    }
+}
+
+fn pool() -> Option<&'static Pool> {
+    unsafe { POOL.load(Ordering::Acquire).as_ref() }
+}
+
+//jobs expect the state of a fresh thread, even when a joining thread runs them
+fn run(job: Job) {
+    let switch = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    let tag = crate::ALLOCATOR.get_profile_tag();
+    {
+        let _detached = crate::region::detach();
+        let _profiled = crate::cpu_profiler::enter();
+        job();
+    }
+    crate::ALLOCATOR.set_profile_tag(tag);
+    crate::ALLOCATOR.set_switch(switch);
+}
+
+//start num_workers threads, later calls are ignored
+pub fn init(num_workers: usize) {
+    if num_workers == 0 || pool().is_some() {
+        return;
+    }
+    let pool = Box::into_raw(Box::new(Pool {
+        injector: Mutex::new(VecDeque::new()),
+        locals: (0..num_workers).map(|_| Mutex::new(VecDeque::new())).collect(),
+        queued: Mutex::new(0),
+        wakeup: Condvar::new(),
+        stop: AtomicBool::new(false),
+        threads: Mutex::new(Vec::new()),
+    }));
+    if POOL.compare_exchange(ptr::null_mut(), pool, Ordering::AcqRel, Ordering::Acquire).is_err() {
+        drop(unsafe { Box::from_raw(pool) });
+        return;
+    }
+    let pool = unsafe { &*pool };
+    let mut threads = pool.threads.lock().unwrap();
+    for idx in 0..num_workers {
+        let handle = thread::Builder::new()
+            .spawn(move || pool.work(idx))
+            .unwrap();
+        threads.push(handle);
+    }
+    println!("enclave thread pool started with {:?} workers", num_workers);
+}
+
+//let the workers leave the enclave before it is destroyed, the pool is kept
+//so that handles still joined run their jobs on the joining thread
+pub fn stop() {
+    if let Some(pool) = pool() {
+        pool.stop.store(true, Ordering::Release);
+        {
+            let _queued = pool.queued.lock().unwrap();
+            pool.wakeup.notify_all();
+        }
+        let threads = std::mem::take(&mut *pool.threads.lock().unwrap());
+        for handle in threads {
+            let _ = handle.join();
+        }
+    }
+}
+
+pub fn num_workers() -> usize {
+    pool().map_or(0, |pool| pool.locals.len())
+}
+
+//how many pieces to cut work handed to the pool into, at least 1
+pub fn width() -> usize {
+    std::cmp::max(num_workers(), 1)
+}
+
+struct Slot<T> {
+    res: Mutex<Option<thread::Result<T>>>,
+    //what the job counted, set before res
+    metrics: Mutex<metrics::Table>,
+    done: Condvar,
+}
+
+pub struct TaskHandle<T> {
+    slot: Arc<Slot<T>>,
+}
+
+impl<T> TaskHandle<T> {
+    //same contract as JoinHandle::join, Err if the job panicked
+    pub fn join(self) -> thread::Result<T> {
+        let res = self.wait();
+        metrics::merge(std::mem::take(&mut *self.slot.metrics.lock().unwrap()));
+        res
+    }
+
+    fn wait(&self) -> thread::Result<T> {
+        loop {
+            if let Some(res) = self.slot.res.lock().unwrap().take() {
+                return res;
+            }
+            match pool().and_then(|pool| pool.take()) {
+                Some(job) => run(job),
+                None => {
+                    //nothing is queued, so the job is running somewhere
+                    let mut res = self.slot.res.lock().unwrap();
+                    while res.is_none() {
+                        res = self.slot.done.wait(res).unwrap();
+                    }
+                    return res.take().unwrap();
+                }
+            }
+        }
+    }
+}
+
+//run f on a pool worker, or right away if there is no pool
+pub fn spawn<F, T>(f: F) -> TaskHandle<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    //the job and its slot are freed by whichever thread runs it
+    let switch = crate::ALLOCATOR.get_switch();
+    crate::ALLOCATOR.set_switch(false);
+    let slot = Arc::new(Slot {
+        res: Mutex::new(None),
+        metrics: Mutex::new(Vec::new()),
+        done: Condvar::new(),
+    });
+    let job_slot = slot.clone();
+    let op = metrics::cur_op();
+    let job: Job = Box::new(move || {
+        let scope = metrics::enter(op);
+        let res = panic::catch_unwind(AssertUnwindSafe(f));
+        *job_slot.metrics.lock().unwrap() = metrics::leave(scope);
+        *job_slot.res.lock().unwrap() = Some(res);
+        job_slot.done.notify_all();
+    });
+    match pool() {
+        Some(pool) if !pool.stop.load(Ordering::Acquire) => pool.push(job),
+        _ => run(job),
+    }
+    crate::ALLOCATOR.set_switch(switch);
+    TaskHandle { slot }
+}
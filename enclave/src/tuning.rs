@@ -0,0 +1,103 @@
+//! Knobs of the ops the host sets once, at init.
+//!
+//! The block sizes, the cache limit and the thread counts of the ops used to
+//! be constants, so changing one meant signing the enclave again. The host
+//! now sends them from its Configuration (VEGA_MAX_ENC_BL, VEGA_CACHE_LIMIT,
+//! VEGA_MAX_THREAD, VEGA_CACHE_INSIDE, VEGA_NUM_PARTS, VEGA_NODE_COMBINE)
+//! with set_tuning, sealed under the job key with TUNING_AAD as the
+//! associated data. Only a holder of the key can tune the enclave, and no
+//! block of a job passes for a tuning. An enclave that gets none, or one that
+//! does not open, keeps the defaults.
+//!
+//! max_thread is the number of sub-buckets a shuffle splits every partition
+//! into, less one, so the host and all the enclaves of a job must agree on
+//! it. The host sends it before the first task.
+use std::cmp;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use crate::op;
+
+//the associated data of a sealed tuning, no block is sealed with it
+const TUNING_AAD: &[u8] = b"tuning\0\0";
+
+pub const DEFAULT_MAX_ENC_BL: usize = 1024;
+pub const DEFAULT_CACHE_LIMIT: usize = 4_000_000;
+pub const DEFAULT_MAX_THREAD: usize = 1;
+pub const DEFAULT_NUM_PARTS: usize = 1;
+
+//the host mirrors it field by field, see framework/src/env.rs
+#[derive(Clone, Copy, Debug, Deserialize)]
+struct Tuning {
+    max_enc_bl: u64,
+    cache_limit: u64,
+    max_thread: u64,
+    cache_inside: bool,
+    num_parts: u64,
+    node_combine: bool,
+}
+
+static MAX_ENC_BL: AtomicUsize = AtomicUsize::new(DEFAULT_MAX_ENC_BL);
+static CACHE_LIMIT: AtomicUsize = AtomicUsize::new(DEFAULT_CACHE_LIMIT);
+static MAX_THREAD: AtomicUsize = AtomicUsize::new(DEFAULT_MAX_THREAD);
+static CACHE_INSIDE: AtomicBool = AtomicBool::new(true);
+static NUM_PARTS: AtomicUsize = AtomicUsize::new(DEFAULT_NUM_PARTS);
+static NODE_COMBINE: AtomicBool = AtomicBool::new(false);
+
+//open and apply a tuning sealed by the host, false if it does not open
+pub fn set(sealed: &[u8]) -> bool {
+    let tuning = op::open_bound(sealed, TUNING_AAD)
+        .and_then(|pt| bincode::deserialize::<Tuning>(&pt).ok());
+    let tuning = match tuning {
+        Some(tuning) => tuning,
+        None => {
+            println!("tuning rejected, keeping the defaults");
+            return false;
+        }
+    };
+    MAX_ENC_BL.store(cmp::max(tuning.max_enc_bl as usize, 1), Ordering::Relaxed);
+    CACHE_LIMIT.store(cmp::max(tuning.cache_limit as usize, 1), Ordering::Relaxed);
+    MAX_THREAD.store(cmp::max(tuning.max_thread as usize, 1), Ordering::Relaxed);
+    CACHE_INSIDE.store(tuning.cache_inside, Ordering::Relaxed);
+    NUM_PARTS.store(cmp::max(tuning.num_parts as usize, 1), Ordering::Relaxed);
+    NODE_COMBINE.store(tuning.node_combine, Ordering::Relaxed);
+    println!("tuned with {:?}", tuning);
+    true
+}
+
+//what a block of a cogroup or a join aims for, see GroupWriter of
+//co_grouped_op.rs
+#[inline(always)]
+pub fn max_enc_bl() -> usize {
+    MAX_ENC_BL.load(Ordering::Relaxed)
+}
+
+//deep size of the sub-partitions of a shuffle task, split over its threads
+//and the tasks running next to it
+#[inline(always)]
+pub fn cache_limit() -> usize {
+    CACHE_LIMIT.load(Ordering::Relaxed)
+}
+
+#[inline(always)]
+pub fn max_thread() -> usize {
+    MAX_THREAD.load(Ordering::Relaxed)
+}
+
+//keep cached partitions in the plaintext tier as well, see plain_cache.rs
+#[inline(always)]
+pub fn cache_inside() -> bool {
+    CACHE_INSIDE.load(Ordering::Relaxed)
+}
+
+//partitions of the shuffles of the jobs in benchmarks/
+#[inline(always)]
+pub fn num_parts() -> usize {
+    NUM_PARTS.load(Ordering::Relaxed)
+}
+
+//map tasks leave their last combiners to the dep of their shuffle, see
+//ShuffleDependency::deposit
+#[inline(always)]
+pub fn node_combine() -> bool {
+    NODE_COMBINE.load(Ordering::Relaxed)
+}
@@ -57,3 +57,22 @@ impl<T: Data + Ord> BoundedPriorityQueue<T> {
         }
     }
 }
+
+/// Merges two ascending runs into the `num` smallest items of both, ascending. The runs are
+/// what `take_ordered` keeps of each partition, the `Into<Vec<T>>` of a queue.
+pub(crate) fn merge_smallest<T: Ord>(a: Vec<T>, b: Vec<T>, num: usize) -> Vec<T> {
+    let mut merged = Vec::with_capacity(num.min(a.len() + b.len()));
+    let (mut a, mut b) = (a.into_iter().peekable(), b.into_iter().peekable());
+    while merged.len() < num {
+        let next = match (a.peek(), b.peek()) {
+            (Some(x), Some(y)) if y < x => b.next(),
+            (Some(_), _) => a.next(),
+            (None, _) => b.next(),
+        };
+        match next {
+            Some(item) => merged.push(item),
+            None => break,
+        }
+    }
+    merged
+}
@@ -0,0 +1,155 @@
+//! Vectorized f64 kernels for the numeric benchmarks (kmeans and the like).
+//!
+//! The enclave cannot ask CPUID at run time, so the instruction set is chosen
+//! when it is built: .cargo/config targets sandybridge, which gives the 256-bit
+//! AVX path, and building with `-Ctarget-feature=+avx2,+fma` turns the
+//! multiply-adds into FMAs. Without AVX the loops keep four independent
+//! accumulators, which LLVM vectorizes with SSE2.
+#[cfg(target_feature = "avx")]
+use core::arch::x86_64::*;
+use std::cmp::min;
+use std::vec::Vec;
+
+const LANES: usize = 4;
+
+#[cfg(target_feature = "avx")]
+#[inline(always)]
+unsafe fn madd(a: __m256d, b: __m256d, acc: __m256d) -> __m256d {
+    #[cfg(target_feature = "fma")]
+    {
+        _mm256_fmadd_pd(a, b, acc)
+    }
+    #[cfg(not(target_feature = "fma"))]
+    {
+        _mm256_add_pd(_mm256_mul_pd(a, b), acc)
+    }
+}
+
+#[cfg(target_feature = "avx")]
+#[inline(always)]
+unsafe fn hsum(v: __m256d) -> f64 {
+    let s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)))
+}
+
+//sum of a[i] * b[i], or of (a[i] - b[i])^2 if diff
+#[cfg(target_feature = "avx")]
+#[inline(always)]
+fn reduce(a: &[f64], b: &[f64], diff: bool) -> f64 {
+    assert_eq!(a.len(), b.len());
+    let n = a.len() / LANES * LANES;
+    let mut sum = unsafe {
+        let mut acc = _mm256_setzero_pd();
+        for i in (0..n).step_by(LANES) {
+            let x = _mm256_loadu_pd(a.as_ptr().add(i));
+            let y = _mm256_loadu_pd(b.as_ptr().add(i));
+            acc = if diff {
+                let d = _mm256_sub_pd(x, y);
+                madd(d, d, acc)
+            } else {
+                madd(x, y, acc)
+            };
+        }
+        hsum(acc)
+    };
+    for i in n..a.len() {
+        sum += if diff {
+            (a[i] - b[i]) * (a[i] - b[i])
+        } else {
+            a[i] * b[i]
+        };
+    }
+    sum
+}
+
+#[cfg(not(target_feature = "avx"))]
+#[inline(always)]
+fn reduce(a: &[f64], b: &[f64], diff: bool) -> f64 {
+    assert_eq!(a.len(), b.len());
+    let mut acc = [0.0; LANES];
+    let (ca, cb) = (a.chunks_exact(LANES), b.chunks_exact(LANES));
+    let (ra, rb) = (ca.remainder(), cb.remainder());
+    for (x, y) in ca.zip(cb) {
+        for k in 0..LANES {
+            acc[k] += if diff {
+                (x[k] - y[k]) * (x[k] - y[k])
+            } else {
+                x[k] * y[k]
+            };
+        }
+    }
+    let mut sum = acc.iter().sum::<f64>();
+    for (x, y) in ra.iter().zip(rb) {
+        sum += if diff { (x - y) * (x - y) } else { x * y };
+    }
+    sum
+}
+
+pub fn dot(a: &[f64], b: &[f64]) -> f64 {
+    reduce(a, b, false)
+}
+
+pub fn squared_distance(a: &[f64], b: &[f64]) -> f64 {
+    reduce(a, b, true)
+}
+
+//y += alpha * x
+pub fn axpy(alpha: f64, x: &[f64], y: &mut [f64]) {
+    assert_eq!(x.len(), y.len());
+    let n = x.len() / LANES * LANES;
+    #[cfg(target_feature = "avx")]
+    unsafe {
+        let a = _mm256_set1_pd(alpha);
+        for i in (0..n).step_by(LANES) {
+            let p = y.as_mut_ptr().add(i);
+            _mm256_storeu_pd(p, madd(a, _mm256_loadu_pd(x.as_ptr().add(i)), _mm256_loadu_pd(p)));
+        }
+    }
+    #[cfg(not(target_feature = "avx"))]
+    for i in 0..n {
+        y[i] += alpha * x[i];
+    }
+    for i in n..x.len() {
+        y[i] += alpha * x[i];
+    }
+}
+
+//rows of b, and columns of b and c, a step of gemm covers, so that the block
+//of b and the row of c it updates stay in cache while the rows of a stream by
+const GEMM_BLOCK: usize = 64;
+
+//c += a * b for row-major a (m x k), b (k x n) and c (m x n). the innermost
+//loop is an axpy of a row of b into a row of c, and the zeros of a, which the
+//tiles of a sparse matrix are full of, are skipped
+pub fn gemm(m: usize, k: usize, n: usize, a: &[f64], b: &[f64], c: &mut [f64]) {
+    assert_eq!(a.len(), m * k);
+    assert_eq!(b.len(), k * n);
+    assert_eq!(c.len(), m * n);
+    for j0 in (0..n).step_by(GEMM_BLOCK) {
+        let j1 = min(j0 + GEMM_BLOCK, n);
+        for p0 in (0..k).step_by(GEMM_BLOCK) {
+            let p1 = min(p0 + GEMM_BLOCK, k);
+            for i in 0..m {
+                let c_row = &mut c[i * n + j0..i * n + j1];
+                for p in p0..p1 {
+                    let alpha = a[i * k + p];
+                    if alpha != 0.0 {
+                        axpy(alpha, &b[p * n + j0..p * n + j1], c_row);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//index of the center closest to p, the first one on ties
+pub fn argmin_distance(p: &[f64], centers: &[Vec<f64>]) -> usize {
+    let mut best = (0, f64::MAX);
+    for (index, center) in centers.iter().enumerate() {
+        let dist = squared_distance(p, center);
+        if dist < best.1 {
+            best = (index, dist);
+        }
+    }
+    best.0
+}
@@ -2,6 +2,8 @@ use rand::Rng;
 use std::vec::Vec;
 
 pub(crate) mod bounded_priority_queue;
+pub(crate) mod kernels;
+pub(crate) mod oblivious;
 pub(crate) mod random;
 
 /// Shuffle the elements of a vec into a random order in place, modifying it.
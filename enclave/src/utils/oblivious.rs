@@ -0,0 +1,112 @@
+//! Data-oblivious sort, for the shuffle of the oblivious mode.
+//!
+//! sort_unstable_by reads and moves the items in an order that depends on
+//! their keys, which the host sees through the page faults and the cache. The
+//! bitonic network here compares and exchanges the same positions in the same
+//! order for every input of a given length: each compare-exchange reads and
+//! writes both items whether or not they are swapped, with the swap done by
+//! masking their bytes, 32 at a time under AVX. Only the comparison of the
+//! keys themselves depends on the data, so the keys should be of fixed size.
+//!
+//! The network is the one for any length (not only powers of two), taken
+//! depth first: a half is sorted and merged completely before the other, so
+//! once a range fits in the cache every compare-exchange below it hits there,
+//! and only the top levels of each merge stream the whole array through the
+//! EPC. It does O(n log^2 n) compare-exchanges against the O(n log n) of
+//! sort_unstable_by.
+#[cfg(target_feature = "avx")]
+use core::arch::x86_64::*;
+use std::mem::size_of;
+
+//swap a and b if swap, reading and writing all of both either way
+#[inline(always)]
+fn cswap<T>(swap: bool, a: &mut T, b: &mut T) {
+    let n = size_of::<T>();
+    let a = a as *mut T as *mut u8;
+    let b = b as *mut T as *mut u8;
+    let mask = (swap as u64).wrapping_neg();
+    let mut i = 0;
+    unsafe {
+        //the pd ops are bitwise, they leave NaN patterns as they are
+        #[cfg(target_feature = "avx")]
+        {
+            let m = _mm256_castsi256_pd(_mm256_set1_epi64x(mask as i64));
+            while i + 32 <= n {
+                let x = _mm256_loadu_pd(a.add(i) as *const f64);
+                let y = _mm256_loadu_pd(b.add(i) as *const f64);
+                let t = _mm256_and_pd(_mm256_xor_pd(x, y), m);
+                _mm256_storeu_pd(a.add(i) as *mut f64, _mm256_xor_pd(x, t));
+                _mm256_storeu_pd(b.add(i) as *mut f64, _mm256_xor_pd(y, t));
+                i += 32;
+            }
+        }
+        while i + 8 <= n {
+            let x = (a.add(i) as *const u64).read_unaligned();
+            let y = (b.add(i) as *const u64).read_unaligned();
+            let t = (x ^ y) & mask;
+            (a.add(i) as *mut u64).write_unaligned(x ^ t);
+            (b.add(i) as *mut u64).write_unaligned(y ^ t);
+            i += 8;
+        }
+        while i < n {
+            let t = (*a.add(i) ^ *b.add(i)) & mask as u8;
+            *a.add(i) ^= t;
+            *b.add(i) ^= t;
+            i += 1;
+        }
+    }
+}
+
+//puts v[i] and v[j], i < j, in the order of up
+#[inline(always)]
+fn compare<T, F>(v: &mut [T], i: usize, j: usize, up: bool, less: &F)
+where
+    F: Fn(&T, &T) -> bool,
+{
+    let (lo, hi) = v.split_at_mut(j);
+    let (a, b) = (&mut lo[i], &mut hi[0]);
+    let swap = if up { less(b, a) } else { less(a, b) };
+    cswap(swap, a, b);
+}
+
+//v is bitonic, sorts it in the order of up
+fn merge<T, F>(v: &mut [T], up: bool, less: &F)
+where
+    F: Fn(&T, &T) -> bool,
+{
+    let n = v.len();
+    if n < 2 {
+        return;
+    }
+    //the largest power of two below n
+    let m = n.next_power_of_two() / 2;
+    for i in 0..n - m {
+        compare(v, i, i + m, up, less);
+    }
+    let (lo, hi) = v.split_at_mut(m);
+    merge(lo, up, less);
+    merge(hi, up, less);
+}
+
+fn sort<T, F>(v: &mut [T], up: bool, less: &F)
+where
+    F: Fn(&T, &T) -> bool,
+{
+    let n = v.len();
+    if n < 2 {
+        return;
+    }
+    let (lo, hi) = v.split_at_mut(n / 2);
+    sort(lo, !up, less);
+    sort(hi, up, less);
+    merge(v, up, less);
+}
+
+//sorts v by less, unstable, with the same memory accesses for every v of
+//a length
+pub fn sort_by<T, F>(v: &mut [T], less: F)
+where
+    F: Fn(&T, &T) -> bool,
+{
+    sort(v, true, &less);
+}
@@ -2,6 +2,7 @@ use std::boxed::Box;
 use std::vec::Vec;
 
 use crate::basic::Data;
+use crate::utils::bounded_priority_queue::BoundedPriorityQueue;
 use rand::{Rng, SeedableRng};
 use rand_distr::{Distribution, Poisson};
 use rand_pcg::Pcg64;
@@ -39,6 +40,104 @@ pub(crate) trait RandomSampler<T: Data>: Send + Sync {
     /// Returns a function which returns random samples,
     /// the sampler is thread-safe as the RNG is seeded with random seeds per thread.
     fn get_sampler(&self, seed: Option<u64>) -> RSamplerFunc<T>;
+
+    /// The fraction of a sampler that keeps every item independently with that probability.
+    fn bernoulli_fraction(&self) -> Option<f64> {
+        None
+    }
+}
+
+/// A counter based rng: the n-th number of key k is a hash of (k, n), so the numbers of a block
+/// keyed by its tag are the same on any thread and in any order of the blocks.
+#[derive(Clone, Copy)]
+pub(crate) struct CounterRng {
+    key: u64,
+    counter: u64,
+}
+
+impl CounterRng {
+    pub fn new(key: u64) -> Self {
+        CounterRng { key, counter: 0 }
+    }
+
+    /// SplitMix64 of the key and counter.
+    pub fn next_u64(&mut self) -> u64 {
+        self.counter += 1;
+        let mut z = self
+            .key
+            .wrapping_add(self.counter.wrapping_mul(0x9e37_79b9_7f4a_7c15));
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        z ^ (z >> 31)
+    }
+
+    /// Uniform in (0, 1].
+    fn next_open01(&mut self) -> f64 {
+        ((self.next_u64() >> 11) + 1) as f64 * (1.0 / (1u64 << 53) as f64)
+    }
+}
+
+/// Bernoulli sampling by skip distances: instead of a draw per item, one geometric draw gives
+/// how many items to skip before the next kept one, so a span of items not kept costs one
+/// `nth` of the iterator and no random number each.
+#[derive(Clone, Copy)]
+pub(crate) struct GapSampler {
+    /// ln(1 - fraction)
+    ln_q: f64,
+}
+
+impl GapSampler {
+    pub fn new(fraction: f64) -> Self {
+        assert!(fraction > 0.0 && fraction < 1.0);
+        GapSampler {
+            ln_q: (-fraction).ln_1p(),
+        }
+    }
+
+    /// The number of items skipped before the next kept one.
+    pub fn next_gap(&self, rng: &mut CounterRng) -> usize {
+        let gap = rng.next_open01().ln() / self.ln_q;
+        if gap >= usize::MAX as f64 {
+            usize::MAX
+        } else {
+            gap as usize
+        }
+    }
+
+    pub fn sample<I: Iterator>(&self, items: I, rng: CounterRng) -> GapSample<I> {
+        GapSample {
+            items,
+            gaps: *self,
+            rng,
+        }
+    }
+
+    /// The positions kept of `len` items.
+    pub fn positions(&self, len: usize, mut rng: CounterRng) -> impl Iterator<Item = usize> {
+        let gaps = *self;
+        let mut next = 0usize;
+        std::iter::from_fn(move || {
+            let pos = next.checked_add(gaps.next_gap(&mut rng))?;
+            next = pos.checked_add(1)?;
+            Some(pos)
+        })
+        .take_while(move |pos| *pos < len)
+    }
+}
+
+pub(crate) struct GapSample<I> {
+    items: I,
+    gaps: GapSampler,
+    rng: CounterRng,
+}
+
+impl<I: Iterator> Iterator for GapSample<I> {
+    type Item = I::Item;
+
+    fn next(&mut self) -> Option<I::Item> {
+        let gap = self.gaps.next_gap(&mut self.rng);
+        self.items.nth(gap)
+    }
 }
 
 pub(crate) fn get_default_rng() -> Pcg64 {
@@ -57,6 +156,69 @@ fn get_rng_with_random_seed() -> Pcg64 {
     Pcg64::seed_from_u64(rand::random::<u64>())
 }
 
+/// The rng of partition `index` of a sample, so a seeded sample is the same on every run while
+/// its partitions draw different numbers.
+pub(crate) fn get_partition_rng(seed: Option<u64>, index: usize) -> Pcg64 {
+    match seed {
+        Some(seed) => get_default_rng_from_seed(seed.wrapping_add(index as u64)),
+        None => get_rng_with_random_seed(),
+    }
+}
+
+/// An item of a bottom-k sample, ordered by the random key it drew. The k items with the smallest
+/// keys are a uniform sample without replacement, and the samples of two partitions merge into
+/// one of their union by keeping the k smallest keys of both.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct Keyed<T> {
+    key: u64,
+    pub item: T,
+}
+
+impl<T> PartialEq for Keyed<T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.key == other.key
+    }
+}
+
+impl<T> Eq for Keyed<T> {}
+
+impl<T> PartialOrd for Keyed<T> {
+    fn partial_cmp(&self, other: &Self) -> Option<std::cmp::Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl<T> Ord for Keyed<T> {
+    fn cmp(&self, other: &Self) -> std::cmp::Ordering {
+        self.key.cmp(&other.key)
+    }
+}
+
+/// Reservoir sample of `size` of `items` in one pass, ascending by key and so in random order.
+pub(crate) fn bottom_k<T: Data>(
+    items: impl Iterator<Item = T>,
+    size: usize,
+    rng: &mut Pcg64,
+) -> Vec<Keyed<T>> {
+    let mut queue = BoundedPriorityQueue::new(size);
+    items.for_each(|item| queue.append(Keyed { key: rng.gen(), item }));
+    queue.into()
+}
+
+/// How many times an item of a stratum sampled at `fraction` is drawn: at most once without
+/// replacement, and a Poisson number of times of mean `fraction` with it.
+pub(crate) fn sample_times(with_replacement: bool, fraction: f64, rng: &mut Pcg64) -> usize {
+    if fraction <= 0.0 {
+        0
+    } else if with_replacement {
+        Poisson::new(fraction).unwrap().sample(rng) as usize
+    } else if rng.gen::<f64>() < fraction {
+        1
+    } else {
+        0
+    }
+}
+
 #[derive(Clone, Copy, Serialize, Deserialize)]
 pub(crate) struct PoissonSampler {
     fraction: f64,
@@ -140,7 +302,20 @@ impl BernoulliSampler {
 }
 
 impl<T: Data> RandomSampler<T> for BernoulliSampler {
+    fn bernoulli_fraction(&self) -> Option<f64> {
+        Some(self.fraction)
+    }
+
     fn get_sampler(&self, seed: Option<u64>) -> RSamplerFunc<T> {
+        if self.fraction > 0.0 && self.fraction <= DEFAULT_MAX_GAP_SAMPLING_FRACTION {
+            let gaps = GapSampler::new(self.fraction);
+            let key = seed.unwrap_or_else(rand::random::<u64>);
+            return Box::new(
+                move |items: Box<dyn Iterator<Item = T>>| -> Box<dyn Iterator<Item = T>> {
+                    Box::new(gaps.sample(items, CounterRng::new(key)))
+                },
+            );
+        }
         Box::new(
             move |items: Box<dyn Iterator<Item = T>>| -> Box<dyn Iterator<Item = T>> {
                 let mut gap_sampling = if self.fraction > 0.0 && self.fraction < 1.0 {
@@ -0,0 +1,155 @@
+use std::net::SocketAddr;
+use std::sync::Arc;
+
+use crate::rdd::ItemE;
+use crate::serialized_data_capnp::serialized_data;
+use crate::{Error, NetworkError, Result};
+use capnp::message::ReaderOptions;
+use capnp_futures::serialize as capnp_serialize;
+use dashmap::DashMap;
+use tokio::net::TcpListener;
+use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
+
+const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
+    traversal_limit_in_words: None,
+    nesting_limit: 64,
+};
+
+/// Values of the broadcast variables, encrypted, by broadcast id.
+///
+/// The driver registers them and serves them to the executors, which fetch a value the first time
+/// a task of theirs reads it and keep it for the rest of the job. Tasks only carry the id, see
+/// `BroadcastVar`. Similar to the cache tracker, the server runs in the master node only.
+#[derive(Debug)]
+pub(crate) struct BroadcastTracker {
+    is_master: bool,
+    values: DashMap<u64, Arc<ItemE>>,
+    master_addr: SocketAddr,
+}
+
+impl BroadcastTracker {
+    pub fn new(is_master: bool, master_addr: SocketAddr) -> Arc<Self> {
+        let tracker = Arc::new(BroadcastTracker {
+            is_master,
+            values: DashMap::new(),
+            master_addr: SocketAddr::new(master_addr.ip(), master_addr.port() + 2),
+        });
+        tracker.clone().server();
+        tracker
+    }
+
+    pub fn register(&self, id: u64, value: ItemE) {
+        self.values.insert(id, Arc::new(value));
+    }
+
+    /// Forgets the values of the job, the next one on an executor daemon reuses their ids.
+    pub fn clear(&self) {
+        self.values.clear();
+    }
+
+    /// The encrypted value of broadcast `id`, fetched from the master if this executor has not
+    /// seen it yet. The value stays alive as long as the tracker, so the enclave may read it in
+    /// place.
+    pub fn get(&self, id: u64) -> Option<Arc<ItemE>> {
+        if let Some(value) = self.values.get(&id) {
+            return Some(value.clone());
+        }
+        if self.is_master {
+            return None;
+        }
+        match self.client(id) {
+            Ok(Some(value)) => {
+                let value = self.values.entry(id).or_insert(Arc::new(value)).clone();
+                Some(value)
+            }
+            Ok(None) => None,
+            Err(err) => {
+                log::error!("failed fetching broadcast #{}: {}", id, err);
+                None
+            }
+        }
+    }
+
+    // Called from the OCALL of a task that is inside the enclave, so it blocks instead of going
+    // through the async runtime.
+    fn client(&self, id: u64) -> Result<Option<ItemE>> {
+        use std::net::TcpStream;
+
+        let mut stream = loop {
+            match TcpStream::connect(self.master_addr) {
+                Ok(stream) => break stream,
+                Err(_) => continue,
+            }
+        };
+        let id_bytes = bincode::serialize(&id)?;
+        let mut message = capnp::message::Builder::new_default();
+        let mut id_data = message.init_root::<serialized_data::Builder>();
+        id_data.set_msg(&id_bytes);
+        capnp::serialize::write_message(&mut stream, &message).map_err(Error::OutputWrite)?;
+
+        let message_reader = capnp::serialize::read_message(&mut stream, CAPNP_BUF_READ_OPTS)?;
+        let value_data = message_reader.get_root::<serialized_data::Reader>()?;
+        let value: Option<ItemE> = bincode::deserialize(value_data.get_msg()?)?;
+        Ok(value)
+    }
+
+    fn server(self: Arc<Self>) {
+        if !self.is_master {
+            return;
+        }
+        log::debug!("broadcast tracker server starting");
+        tokio::spawn(async move {
+            let listener = TcpListener::bind(self.master_addr)
+                .await
+                .map_err(NetworkError::TcpListener)?;
+            log::debug!("broadcast tracker server started");
+            while let Ok((mut stream, _)) = listener.accept().await {
+                let selfc = Arc::clone(&self);
+                tokio::spawn(async move {
+                    let (reader, writer) = stream.split();
+                    let reader = reader.compat();
+                    let writer = writer.compat_write();
+
+                    // reading
+                    let id: u64 = {
+                        let message_reader =
+                            capnp_serialize::read_message(reader, CAPNP_BUF_READ_OPTS).await?;
+                        let data = message_reader.get_root::<serialized_data::Reader>()?;
+                        bincode::deserialize(data.get_msg()?)?
+                    };
+
+                    // send reply
+                    let value = selfc.values.get(&id).map(|value| (**value).clone());
+                    if value.is_none() {
+                        log::warn!("broadcast #{} requested but never registered", id);
+                    }
+                    let result = bincode::serialize(&value)?;
+                    let message = {
+                        let mut message = capnp::message::Builder::new_default();
+                        let mut value_data = message.init_root::<serialized_data::Builder>();
+                        value_data.set_msg(&result);
+                        message
+                    };
+                    capnp_serialize::write_message(writer, message)
+                        .await
+                        .map_err(Error::CapnpDeserialization)?;
+                    Ok::<_, Error>(())
+                });
+            }
+            Err::<(), _>(Error::ExecutorShutdown)
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn registered_value_found() {
+        let addr = "127.0.0.1:0".parse().unwrap();
+        let tracker = BroadcastTracker::new(false, addr);
+        tracker.register(1, vec![1, 2, 3]);
+        assert_eq!(*tracker.get(1).unwrap(), vec![1, 2, 3]);
+    }
+}
@@ -1,45 +1,274 @@
-use std::collections::BTreeSet;
-use std::sync::atomic::{AtomicUsize, Ordering};
-use std::sync::Arc;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::fs::{self, File};
+use std::io::{self, BufReader, BufWriter, Write};
+use std::mem::size_of;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
 
 use dashmap::DashMap;
 use serde_derive::{Deserialize, Serialize};
+use sgx_types::*;
 
-use crate::env::RDDB_MAP;
-use crate::rdd::CacheMeta;
+use crate::env::{Env, RDDB_MAP};
+use crate::rdd::ItemE;
+
+extern "C" {
+    fn seal_cache_index(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        rdd_id: usize,
+        part_id: usize,
+        buf: *mut u8,
+        cap: usize,
+    ) -> sgx_status_t;
+    fn unseal_cache_index(
+        eid: sgx_enclave_id_t,
+        retval: *mut i32,
+        rdd_id: usize,
+        part_id: usize,
+        sealed: *mut u8,
+        len: usize,
+    ) -> sgx_status_t;
+}
+
+/// Capacity of the cache of an executor unless `VEGA_CACHE_MBYTES` is set.
+pub(crate) const DEFAULT_CACHE_MBYTES: usize = 2000;
+const MB: usize = 1000 * 1000;
+/// Invalidations kept for the enclaves to catch up with, one that is further behind drops all
+/// the pointers it mirrors.
+const INVALIDATION_LOG_LEN: usize = 4096;
+/// Enough for the sealed tags of a partition of a few hundred blocks, a larger one is sealed
+/// again with the size it needs.
+const SEALED_INDEX_BYTES: usize = 16 * 1024;
+/// Key space of the secure entries an executor daemon keeps for the later jobs, keyed by the
+/// lineage fingerprint of their rdd in place of its id, see `BoundedMemoryCache::clear`.
+const RETAINED_KEY_SPACE: usize = usize::MAX;
 
 #[derive(Debug, Serialize, Deserialize)]
 pub(crate) enum CachePutResponse {
-    CachePutSuccess(usize),
+    /// The partition was cached in `size` bytes, evicting the `dropped` entries to make room.
+    CachePutSuccess {
+        size: usize,
+        dropped: Vec<DroppedEntry>,
+    },
     CachePutFailure,
 }
 
-type CacheMap = Arc<DashMap<((usize, usize), usize), (Vec<u8>, usize)>>;
-type SecureCacheMap = Arc<DashMap<((usize, usize), usize), (usize, usize)>>; //(((key_space_id, cached_rdd_id), part_id), (encrypted_data, size))
+/// An entry evicted from the cache, to be reported to the `CacheTracker` master.
+#[derive(Clone, Debug, PartialEq, Serialize, Deserialize)]
+pub(crate) struct DroppedEntry {
+    pub rdd_id: usize,
+    pub partition: usize,
+    pub size: usize,
+}
+
+type CacheKey = ((usize, usize), usize); //((key_space_id, cached_rdd_id), part_id)
+type CacheMap = Arc<DashMap<CacheKey, (Vec<u8>, usize)>>;
+type SecureCacheMap = Arc<DashMap<CacheKey, (usize, usize)>>; //(encrypted_data, size)
+type SpilledMap = Arc<DashMap<CacheKey, (PathBuf, usize)>>; //(block file, size in memory)
+
+/// Bytes a plain entry takes besides its serialized value.
+const ENTRY_OVERHEAD: usize = size_of::<(CacheKey, (Vec<u8>, usize))>();
+
+/// An entry of either map.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+enum EntryKey {
+    Plain(CacheKey),
+    Secure(CacheKey),
+}
+
+/// Recency of the entries of both maps, the least recently used one is the first of `order`.
+#[derive(Debug, Default)]
+struct Lru {
+    clock: u64,
+    order: BTreeMap<u64, EntryKey>,
+    last_used: HashMap<EntryKey, u64>,
+}
+
+impl Lru {
+    fn touch(&mut self, entry: EntryKey) {
+        self.clock += 1;
+        if let Some(last) = self.last_used.insert(entry, self.clock) {
+            self.order.remove(&last);
+        }
+        self.order.insert(self.clock, entry);
+    }
+
+    /// Like `touch`, but only for entries that are still cached.
+    fn refresh(&mut self, entry: EntryKey) {
+        if self.last_used.contains_key(&entry) {
+            self.touch(entry);
+        }
+    }
+
+    fn remove(&mut self, entry: EntryKey) {
+        if let Some(last) = self.last_used.remove(&entry) {
+            self.order.remove(&last);
+        }
+    }
+
+    fn least_recent(&self, except: EntryKey) -> Option<EntryKey> {
+        self.order.values().copied().find(|entry| *entry != except)
+    }
+
+    /// The least recently used secure entry of a partition `owned` accepts.
+    fn least_recent_secure<F: Fn(usize) -> bool>(&self, owned: F) -> Option<EntryKey> {
+        self.order.values().copied().find(|entry| match entry {
+            EntryKey::Secure(key) => owned(key.1),
+            EntryKey::Plain(_) => false,
+        })
+    }
+}
+
+/// Secure entries evicted while ecalls that may read them were running.
+///
+/// An ecall that reads cached blocks pins the cache first (see `pin`). An evicted block is
+/// freed once no pin taken before its eviction is left, until then `sget` still finds it.
+#[derive(Debug, Default)]
+struct Graveyard {
+    epoch: u64,
+    /// number of pins by the epoch they were taken in
+    pins: BTreeMap<u64, usize>,
+    /// (epoch of the eviction, key, encrypted_data)
+    dead: Vec<(u64, CacheKey, usize)>,
+}
+
+/// Keeps the secure entries evicted from now on alive until it is dropped.
+pub(crate) struct CachePin<'a> {
+    cache: &'a BoundedMemoryCache,
+    epoch: u64,
+}
+
+impl<'a> Drop for CachePin<'a> {
+    fn drop(&mut self) {
+        self.cache.unpin(self.epoch);
+    }
+}
+
+/// The secure entries that left memory, for the mirrors the enclaves keep of the pointers
+/// `ocall_cache_from_outside` handed them.
+///
+/// Every removal or replacement of a secure entry bumps `generation` after the entry is gone from
+/// the map. An enclave reads the generation in place and, once it changed, pulls the keys logged
+/// since the last one it saw with `ocall_cache_invalidations`, in a batch, rather than asking the
+/// host on every lookup. A pointer handed out at a generation is good until an invalidation of
+/// its key after that one.
+#[derive(Debug, Default)]
+struct Invalidations {
+    generation: AtomicU64,
+    /// (generation, (cached_rdd_id, part_id)), oldest first
+    log: Mutex<VecDeque<(u64, (usize, usize))>>,
+    /// The log holds every invalidation after this generation.
+    complete_after: AtomicU64,
+}
+
+impl Invalidations {
+    fn invalidate(&self, key: CacheKey) {
+        let mut log = self.log.lock().unwrap();
+        let generation = self.generation.fetch_add(1, Ordering::SeqCst) + 1;
+        log.push_back((generation, ((key.0).1, key.1)));
+        if log.len() > INVALIDATION_LOG_LEN {
+            if let Some((trimmed, _)) = log.pop_front() {
+                self.complete_after.store(trimmed, Ordering::SeqCst);
+            }
+        }
+    }
+
+    fn invalidate_all(&self) {
+        let mut log = self.log.lock().unwrap();
+        let generation = self.generation.fetch_add(1, Ordering::SeqCst) + 1;
+        log.clear();
+        self.complete_after.store(generation, Ordering::SeqCst);
+    }
+
+    /// Fills `out` with the keys invalidated after generation `since`, as many as fit, and
+    /// returns the generation they cover up to with their number, which is `None` if the log no
+    /// longer reaches back to `since` and every pointer of before is to be dropped.
+    fn since(&self, since: u64, out: &mut [(usize, usize)]) -> (u64, Option<usize>) {
+        let log = self.log.lock().unwrap();
+        let current = self.generation.load(Ordering::SeqCst);
+        if since < self.complete_after.load(Ordering::SeqCst) {
+            return (current, None);
+        }
+        let mut covered = current;
+        let mut num = 0;
+        for &(generation, key) in log.iter().filter(|(generation, _)| *generation > since) {
+            if num == out.len() {
+                covered = generation - 1;
+                break;
+            }
+            out[num] = key;
+            num += 1;
+        }
+        (covered, Some(num))
+    }
+}
 
-// Despite the name, it is currently unbounded cache. Once done with LRU iterator, have to make this bounded.
-// Since we are storing everything as serialized objects, size estimation is as simple as getting the length of byte vector
+/// Serialized partitions, and pointers to encrypted ones outside the enclave, cached by this
+/// executor. Once they would take more than the capacity, the least recently used entries of
+/// either kind are evicted.
+///
+/// The encrypted partitions are not lost when they are evicted, they need no protection on disk
+/// and are written to a block file in the spill dir instead. `sload` reads them back into memory
+/// when a task asks for them again.
+///
+/// With VEGA_CACHE_PERSIST they outlive the executor as well. `persist` writes every one put to
+/// the persist dir, with the tags of its blocks sealed to the enclave that cached it, and a
+/// restarted executor `restore`s them as spilled entries, see enclave/src/cache_seal.rs.
 #[derive(Debug, Clone)]
 pub(crate) struct BoundedMemoryCache {
-    max_mbytes: usize,
+    max_bytes: usize,
     next_key_space_id: Arc<AtomicUsize>,
-    current_bytes: usize,
+    current_bytes: Arc<AtomicUsize>,
     map: CacheMap,
     smap: SecureCacheMap,
+    spilled: SpilledMap,
+    /// `None` drops the evicted secure entries as well.
+    spill_dir: Arc<Mutex<Option<PathBuf>>>,
+    /// Also serializes the puts, so that the evictions of two of them do not interleave.
+    lru: Arc<Mutex<Lru>>,
+    graveyard: Arc<Mutex<Graveyard>>,
+    invalidations: Arc<Invalidations>,
+    /// `None` keeps the secure entries in this process only.
+    persist_dir: Arc<Mutex<Option<PathBuf>>>,
+    /// Secure entries put since the last `persist`.
+    unpersisted: Arc<Mutex<Vec<CacheKey>>>,
 }
 
-// TODO: remove all hardcoded values
 impl BoundedMemoryCache {
-    pub fn new() -> Self {
+    pub fn new(max_mbytes: usize) -> Self {
+        BoundedMemoryCache::with_max_bytes(max_mbytes * MB)
+    }
+
+    fn with_max_bytes(max_bytes: usize) -> Self {
         BoundedMemoryCache {
-            max_mbytes: 2000, // in MB
+            max_bytes,
             next_key_space_id: Arc::new(AtomicUsize::new(0)),
-            current_bytes: 0,
+            current_bytes: Arc::new(AtomicUsize::new(0)),
             map: Arc::new(DashMap::new()),
             smap: Arc::new(DashMap::new()),
+            spilled: Arc::new(DashMap::new()),
+            spill_dir: Arc::new(Mutex::new(None)),
+            lru: Arc::new(Mutex::new(Lru::default())),
+            graveyard: Arc::new(Mutex::new(Graveyard::default())),
+            invalidations: Arc::new(Invalidations::default()),
+            persist_dir: Arc::new(Mutex::new(None)),
+            unpersisted: Arc::new(Mutex::new(Vec::new())),
         }
     }
 
+    /// Directory the evicted secure entries go to, created on the first eviction.
+    pub fn set_spill_dir(&self, dir: PathBuf) {
+        *self.spill_dir.lock().unwrap() = Some(dir);
+    }
+
+    /// Directory the secure entries are persisted to, for an executor restarted in the same work
+    /// dir, see `persist` and `restore`.
+    pub fn set_persist_dir(&self, dir: PathBuf) {
+        *self.persist_dir.lock().unwrap() = Some(dir);
+    }
+
     fn new_key_space_id(&self) -> usize {
         self.next_key_space_id.fetch_add(1, Ordering::SeqCst)
     }
@@ -48,10 +277,16 @@ impl BoundedMemoryCache {
         KeySpace::new(self, self.new_key_space_id())
     }
 
+    /// Bytes held by the cached entries.
+    pub fn current_bytes(&self) -> usize {
+        self.current_bytes.load(Ordering::SeqCst)
+    }
+
     fn get(&self, dataset_id: (usize, usize), partition: usize) -> Option<Vec<u8>> {
-        self.map
-            .get(&(dataset_id, partition))
-            .map(|entry| entry.0.clone())
+        let key = (dataset_id, partition);
+        let value = self.map.get(&key).map(|entry| entry.0.clone())?;
+        self.lru.lock().unwrap().refresh(EntryKey::Plain(key));
+        Some(value)
     }
 
     fn put(
@@ -61,25 +296,119 @@ impl BoundedMemoryCache {
         value: Vec<u8>,
     ) -> CachePutResponse {
         let key = (dataset_id, partition);
-        // TODO: logging
-        let size = value.len() * 8 + 2 * 8; //this number of MB
-        if size as f64 / (1000.0 * 1000.0) > self.max_mbytes as f64 {
-            CachePutResponse::CachePutFailure
-        } else {
-            // TODO: ensure free space needs to be done and this needs to be modified
-            self.map.insert(key, (value, size));
-            CachePutResponse::CachePutSuccess(size)
+        let size = value.len() + ENTRY_OVERHEAD;
+        if size > self.max_bytes {
+            log::warn!(
+                "partition {} of rdd {} ({} bytes) does not fit in the cache",
+                partition,
+                dataset_id.1,
+                size
+            );
+            return CachePutResponse::CachePutFailure;
+        }
+        let entry = EntryKey::Plain(key);
+        let mut lru = self.lru.lock().unwrap();
+        let dropped = self.ensure_free_space(&mut lru, entry, size);
+        if let Some((_, old_size)) = self.map.insert(key, (value, size)) {
+            self.current_bytes.fetch_sub(old_size, Ordering::SeqCst);
         }
+        self.current_bytes.fetch_add(size, Ordering::SeqCst);
+        lru.touch(entry);
+        CachePutResponse::CachePutSuccess { size, dropped }
     }
 
     pub fn scontain(&self, dataset_id: (usize, usize), part_id: usize) -> bool {
-        self.smap.contains_key(&(dataset_id, part_id))
+        let key = (dataset_id, part_id);
+        self.smap.contains_key(&key) || self.spilled.contains_key(&key)
     }
 
     pub fn sget(&self, dataset_id: (usize, usize), part_id: usize) -> Option<usize> {
-        self.smap
-            .get(&(dataset_id, part_id))
-            .map(|entry| entry.0.clone())
+        self.slookup(dataset_id, part_id).map(|(ptr, _)| ptr)
+    }
+
+    /// Like `sget`, with whether the entry is still in memory rather than only kept alive for
+    /// the pinned ecalls, i.e. whether its pointer may be mirrored.
+    pub fn slookup(&self, dataset_id: (usize, usize), part_id: usize) -> Option<(usize, bool)> {
+        let key = (dataset_id, part_id);
+        match self.smap.get(&key).map(|entry| entry.0) {
+            Some(ptr) => {
+                self.lru.lock().unwrap().refresh(EntryKey::Secure(key));
+                Some((ptr, true))
+            }
+            // Evicted, but a pinned ecall may still read it.
+            None => self
+                .graveyard
+                .lock()
+                .unwrap()
+                .dead
+                .iter()
+                .find(|(_, dead_key, _)| *dead_key == key)
+                .map(|(_, _, ptr)| (*ptr, false)),
+        }
+    }
+
+    /// The generation of the secure entries in memory, which the enclaves read in place.
+    pub fn generation_ptr(&self) -> *const u64 {
+        &self.invalidations.generation as *const AtomicU64 as *const u64
+    }
+
+    pub fn generation(&self) -> u64 {
+        self.invalidations.generation.load(Ordering::SeqCst)
+    }
+
+    /// See `Invalidations::since`, the keys are (cached_rdd_id, part_id).
+    pub fn invalidated_since(
+        &self,
+        since: u64,
+        out: &mut [(usize, usize)],
+    ) -> (u64, Option<usize>) {
+        self.invalidations.since(since, out)
+    }
+
+    /// Reads a spilled secure entry back into memory, evicting others to make room, which are
+    /// returned if they could not be spilled in turn.
+    pub fn sload(
+        &self,
+        dataset_id: (usize, usize),
+        part_id: usize,
+    ) -> (Option<usize>, Vec<DroppedEntry>) {
+        let key = (dataset_id, part_id);
+        let entry = EntryKey::Secure(key);
+        let mut lru = self.lru.lock().unwrap();
+        // Loaded by another task meanwhile.
+        if let Some(value) = self.smap.get(&key) {
+            return (Some(value.0), Vec::new());
+        }
+        let (path, size) = match self.spilled.remove(&key) {
+            Some((_, spilled)) => spilled,
+            None => return (None, Vec::new()),
+        };
+        let blocks = {
+            //allocated in the outside heap of the enclave the partition is bound to, like the
+            //blocks it cached
+            let _bound = Env::bind_partition(part_id);
+            read_blocks(&path).map(|blocks| Box::into_raw(Box::new(blocks)) as usize)
+        };
+        if let Err(err) = fs::remove_file(&path) {
+            log::warn!("could not remove cache block file {:?}: {}", path, err);
+        }
+        let ptr = match blocks {
+            Ok(ptr) => ptr,
+            Err(err) => {
+                log::warn!("could not read cache block file {:?}: {}", path, err);
+                let dropped = DroppedEntry {
+                    rdd_id: dataset_id.1,
+                    partition: part_id,
+                    size,
+                };
+                return (None, vec![dropped]);
+            }
+        };
+        let dropped = self.ensure_free_space(&mut lru, entry, size);
+        self.smap.insert(key, (ptr, size));
+        self.current_bytes.fetch_add(size, Ordering::SeqCst);
+        lru.touch(entry);
+        (Some(ptr), dropped)
     }
 
     pub fn sput(
@@ -100,37 +429,537 @@ impl BoundedMemoryCache {
         };
 
         let key = (dataset_id, part_id);
-        if size as f64 / (1000.0 * 1000.0) > self.max_mbytes as f64 {
-            self.smap.remove(&key);
+        let entry = EntryKey::Secure(key);
+        let mut lru = self.lru.lock().unwrap();
+        if size > self.max_bytes {
+            if let Some((_, (_, old_size))) = self.smap.remove(&key) {
+                self.current_bytes.fetch_sub(old_size, Ordering::SeqCst);
+                self.invalidations.invalidate(key);
+                self.unpersist(key);
+            }
+            lru.remove(entry);
             CachePutResponse::CachePutFailure
         } else {
-            // TODO: ensure free space needs to be done and this needs to be modified
-            self.smap.insert(key, (value as usize, size));
-            CachePutResponse::CachePutSuccess(size)
+            let dropped = self.ensure_free_space(&mut lru, entry, size);
+            if let Some((_, (path, _))) = self.spilled.remove(&key) {
+                let _ = fs::remove_file(path);
+            }
+            // A replaced block is not freed here, the enclave that put it again owns it.
+            if let Some((_, old_size)) = self.smap.insert(key, (value as usize, size)) {
+                self.current_bytes.fetch_sub(old_size, Ordering::SeqCst);
+                self.invalidations.invalidate(key);
+            }
+            self.current_bytes.fetch_add(size, Ordering::SeqCst);
+            lru.touch(entry);
+            if self.persist_dir.lock().unwrap().is_some() {
+                self.unpersisted.lock().unwrap().push(key);
+            }
+            CachePutResponse::CachePutSuccess { size, dropped }
+        }
+    }
+
+    /// Drops the secure entries of the cached rdd `rdd_id` of any key space, in memory or
+    /// spilled, and returns the ones that were in memory.
+    pub fn sremove_rdd(&self, rdd_id: usize) -> Vec<DroppedEntry> {
+        let mut lru = self.lru.lock().unwrap();
+        let keys = self
+            .smap
+            .iter()
+            .map(|entry| *entry.key())
+            .filter(|key| (key.0).1 == rdd_id)
+            .collect::<Vec<_>>();
+        let mut dropped = Vec::new();
+        for key in keys {
+            if let Some((_, (ptr, size))) = self.smap.remove(&key) {
+                lru.remove(EntryKey::Secure(key));
+                self.current_bytes.fetch_sub(size, Ordering::SeqCst);
+                self.invalidations.invalidate(key);
+                self.bury(key, ptr);
+                self.unpersist(key);
+                dropped.push(DroppedEntry {
+                    rdd_id,
+                    partition: key.1,
+                    size,
+                });
+            }
+        }
+        let spilled = self
+            .spilled
+            .iter()
+            .map(|entry| *entry.key())
+            .filter(|key| (key.0).1 == rdd_id)
+            .collect::<Vec<_>>();
+        for key in spilled {
+            if let Some((_, (path, _))) = self.spilled.remove(&key) {
+                let _ = fs::remove_file(path);
+                self.unpersist(key);
+            }
+        }
+        dropped
+    }
+
+    /// Evicts the least recently used secure entries of the partitions `owned` accepts until
+    /// they held `bytes`, for an enclave whose outside heap the host could not grow. Their
+    /// blocks are in that heap, the ones spilled count too.
+    pub fn sevict<F: Fn(usize) -> bool>(&self, bytes: usize, owned: F) -> Vec<DroppedEntry> {
+        let mut lru = self.lru.lock().unwrap();
+        let mut freed = 0;
+        let mut dropped = Vec::new();
+        while freed < bytes {
+            let victim = match lru.least_recent_secure(&owned) {
+                Some(victim) => victim,
+                None => break,
+            };
+            lru.remove(victim);
+            if let EntryKey::Secure(key) = victim {
+                freed += self.smap.get(&key).map_or(0, |value| value.1);
+            }
+            if let Some(entry) = self.drop_entry(victim) {
+                BoundedMemoryCache::report_entry_dropped(&entry);
+                dropped.push(entry);
+            }
+        }
+        dropped
+    }
+
+    /// Pins the secure entries, for an ecall that reads them through `ocall_cache_from_outside`.
+    /// The ones evicted while the pin is held are freed after it is dropped.
+    pub fn pin(&self) -> CachePin<'_> {
+        let mut graveyard = self.graveyard.lock().unwrap();
+        let epoch = graveyard.epoch;
+        *graveyard.pins.entry(epoch).or_default() += 1;
+        CachePin { cache: self, epoch }
+    }
+
+    fn unpin(&self, epoch: u64) {
+        let freed = {
+            let mut graveyard = self.graveyard.lock().unwrap();
+            if let Some(pins) = graveyard.pins.get_mut(&epoch) {
+                *pins -= 1;
+                if *pins == 0 {
+                    graveyard.pins.remove(&epoch);
+                }
+            }
+            // A block may still be read by the pins taken up to the epoch of its eviction.
+            let oldest_pin = graveyard.pins.keys().next().copied().unwrap_or(u64::MAX);
+            let (freed, dead): (Vec<_>, Vec<_>) = std::mem::take(&mut graveyard.dead)
+                .into_iter()
+                .partition(|(evicted, _, _)| *evicted < oldest_pin);
+            graveyard.dead = dead;
+            freed
+        };
+        for (_, key, ptr) in freed {
+            BoundedMemoryCache::free_block(key, ptr);
         }
     }
 
     //should be called in the end of program
     pub fn free_data_enc(&self) {
         for (key, value) in (*self.smap).clone() {
-            let rdd_id = key.0.1;
-            let rdd_base = match RDDB_MAP.get_rddb(rdd_id) {
-                Some(rdd_base) => rdd_base,
-                None => panic!("invalid cached rdd id"),
+            BoundedMemoryCache::free_block(key, value.0);
+        }
+        self.smap.clear();
+        self.invalidations.invalidate_all();
+        let dead = std::mem::take(&mut self.graveyard.lock().unwrap().dead);
+        for (_, key, ptr) in dead {
+            BoundedMemoryCache::free_block(key, ptr);
+        }
+        self.spilled.clear();
+        if let Some(dir) = self.spill_dir.lock().unwrap().clone() {
+            let _ = fs::remove_dir_all(dir);
+        }
+    }
+
+    /// Drops every entry, for the next job on an executor daemon, whose rdds have the ids of the
+    /// ones of this job. The secure entries in memory of the rdds fingerprinted in `lineages`
+    /// stay in the retained key space, under the fingerprint of their lineage, for a later job
+    /// that caches the same lineage to `adopt`. They are evicted like the others, and so are the
+    /// ones of earlier jobs that no job adopted.
+    pub fn clear(&self, lineages: &HashMap<usize, u64>) {
+        let mut lru = self.lru.lock().unwrap();
+        // Least recently used first, they keep the order they are evicted in.
+        let retained = lru
+            .order
+            .values()
+            .filter_map(|entry| match *entry {
+                EntryKey::Secure(key) => Some(key),
+                EntryKey::Plain(_) => None,
+            })
+            .filter_map(|key| {
+                let ((key_space_id, rdd_id), part_id) = key;
+                let lineage = match key_space_id {
+                    RETAINED_KEY_SPACE => rdd_id,
+                    _ => *lineages.get(&rdd_id)? as usize,
+                };
+                let (_, value) = self.smap.remove(&key)?;
+                Some((((RETAINED_KEY_SPACE, lineage), part_id), value))
+            })
+            .collect::<Vec<_>>();
+        self.free_data_enc();
+        self.map.clear();
+        *lru = Lru::default();
+        self.current_bytes.store(0, Ordering::SeqCst);
+        for (key, (ptr, size)) in retained {
+            // Two rdds of the job had the same lineage, one copy is enough.
+            if let Some((old_ptr, old_size)) = self.smap.insert(key, (ptr, size)) {
+                BoundedMemoryCache::free_block(key, old_ptr);
+                self.current_bytes.fetch_sub(old_size, Ordering::SeqCst);
+            }
+            self.current_bytes.fetch_add(size, Ordering::SeqCst);
+            lru.touch(EntryKey::Secure(key));
+        }
+        self.unpersisted.lock().unwrap().clear();
+        if let Some(dir) = self.persist_dir.lock().unwrap().clone() {
+            let _ = fs::remove_dir_all(dir);
+        }
+    }
+
+    /// Moves the retained secure entries of the lineage fingerprinted `lineage`, in memory or
+    /// spilled, to the rdd `dataset_id` of this job, and returns their partitions and sizes.
+    pub fn adopt(&self, lineage: u64, dataset_id: (usize, usize)) -> Vec<(usize, usize)> {
+        let retained = (RETAINED_KEY_SPACE, lineage as usize);
+        let mut lru = self.lru.lock().unwrap();
+        let mut adopted = Vec::new();
+        let keys = self
+            .smap
+            .iter()
+            .map(|entry| *entry.key())
+            .filter(|key| key.0 == retained)
+            .collect::<Vec<_>>();
+        for key in keys {
+            let (ptr, size) = match self.smap.remove(&key) {
+                Some((_, value)) => value,
+                None => continue,
+            };
+            lru.remove(EntryKey::Secure(key));
+            let new_key = (dataset_id, key.1);
+            // Cached by this job meanwhile.
+            if let Some((_, (old_ptr, old_size))) = self.smap.insert(new_key, (ptr, size)) {
+                self.current_bytes.fetch_sub(old_size, Ordering::SeqCst);
+                self.invalidations.invalidate(new_key);
+                self.bury(new_key, old_ptr);
+            }
+            lru.touch(EntryKey::Secure(new_key));
+            adopted.push((key.1, size));
+        }
+        let spilled = self
+            .spilled
+            .iter()
+            .map(|entry| *entry.key())
+            .filter(|key| key.0 == retained)
+            .collect::<Vec<_>>();
+        for key in spilled {
+            if let Some((_, (path, size))) = self.spilled.remove(&key) {
+                self.spilled.insert((dataset_id, key.1), (path, size));
+                adopted.push((key.1, size));
+            }
+        }
+        adopted
+    }
+
+    /// Writes the secure entries put since the last call to the persist dir, each with the tags
+    /// of its blocks sealed by the enclave that cached it. An executor calls it after every task,
+    /// out of the ecalls that put them.
+    pub fn persist(&self) {
+        let dir = match self.persist_dir.lock().unwrap().clone() {
+            Some(dir) => dir,
+            None => return,
+        };
+        let keys = std::mem::take(&mut *self.unpersisted.lock().unwrap());
+        if keys.is_empty() {
+            return;
+        }
+        if let Err(err) = fs::create_dir_all(&dir) {
+            log::warn!("could not create cache persist dir {:?}: {}", dir, err);
+            return;
+        }
+        // An entry evicted meanwhile keeps its blocks until they are written.
+        let _pin = self.pin();
+        for key in keys {
+            let ptr = match self.smap.get(&key) {
+                Some(entry) => entry.0,
+                None => continue,
+            };
+            let sealed = match BoundedMemoryCache::seal_index(key) {
+                Some(sealed) => sealed,
+                None => continue,
+            };
+            let blocks = unsafe { &*(ptr as *const Vec<ItemE>) };
+            let blocks_path = persisted_path(&dir, key, "blocks");
+            let index_path = persisted_path(&dir, key, "index");
+            let tmp = persisted_path(&dir, key, "tmp");
+            // The index goes last, a restart only takes an entry whose blocks are all written.
+            let _ = fs::remove_file(&index_path);
+            let written = write_blocks(&tmp, blocks)
+                .and_then(|()| fs::rename(&tmp, &blocks_path))
+                .and_then(|()| fs::write(&tmp, &sealed))
+                .and_then(|()| fs::rename(&tmp, &index_path));
+            if let Err(err) = written {
+                log::warn!("could not persist {:?}: {}", blocks_path, err);
+                let _ = fs::remove_file(&tmp);
+            }
+        }
+    }
+
+    /// Takes the secure entries an earlier run of this executor persisted as spilled ones, once
+    /// the enclaves that cached them have the tags of their blocks back. Returns their number.
+    pub fn restore(&self) -> usize {
+        let dir = match self.persist_dir.lock().unwrap().clone() {
+            Some(dir) => dir,
+            None => return 0,
+        };
+        let spill_dir = match self.spill_dir.lock().unwrap().clone() {
+            Some(spill_dir) => spill_dir,
+            None => return 0,
+        };
+        let entries = match fs::read_dir(&dir) {
+            Ok(entries) => entries,
+            Err(_) => return 0,
+        };
+        let mut restored = 0;
+        for path in entries.filter_map(|entry| entry.ok().map(|entry| entry.path())) {
+            let key = match persisted_key(&path) {
+                Some(key) => key,
+                None => continue,
+            };
+            let blocks_path = persisted_path(&dir, key, "blocks");
+            let opened = fs::read(&path)
+                .ok()
+                .filter(|_| blocks_path.exists())
+                .map_or(false, |mut sealed| {
+                    BoundedMemoryCache::unseal_index(key, &mut sealed)
+                });
+            if !opened {
+                log::warn!("dropping persisted partition {:?}", path);
+                let _ = fs::remove_file(&path);
+                let _ = fs::remove_file(&blocks_path);
+                continue;
+            }
+            // `sload` removes the block file it reads, the persist dir keeps a link of its own.
+            let spill_path = spill_dir.join(blocks_path.file_name().unwrap());
+            let linked = fs::create_dir_all(&spill_dir)
+                .and_then(|()| fs::hard_link(&blocks_path, &spill_path))
+                .and_then(|()| fs::metadata(&spill_path));
+            match linked {
+                Ok(metadata) => {
+                    let size = metadata.len() as usize;
+                    self.spilled.insert(key, (spill_path, size));
+                    restored += 1;
+                }
+                Err(err) => log::warn!("could not restore {:?}: {}", blocks_path, err),
+            }
+        }
+        restored
+    }
+
+    fn unpersist(&self, key: CacheKey) {
+        if let Some(dir) = self.persist_dir.lock().unwrap().as_ref() {
+            let _ = fs::remove_file(persisted_path(dir, key, "index"));
+            let _ = fs::remove_file(persisted_path(dir, key, "blocks"));
+        }
+    }
+
+    fn seal_index(key: CacheKey) -> Option<Vec<u8>> {
+        let ((_, rdd_id), part_id) = key;
+        let _bound = Env::bind_partition(part_id);
+        let enclave = Env::enter();
+        let mut buf = vec![0u8; SEALED_INDEX_BYTES];
+        loop {
+            let mut len = 0;
+            let sgx_status = unsafe {
+                seal_cache_index(
+                    enclave.eid(),
+                    &mut len,
+                    rdd_id,
+                    part_id,
+                    buf.as_mut_ptr(),
+                    buf.len(),
+                )
+            };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                log::warn!("failed sealing a cache index: {}", sgx_status.as_str());
+                return None;
+            }
+            if len > buf.len() {
+                buf.resize(len, 0);
+                continue;
+            }
+            // Not cached by the enclave, e.g. put again meanwhile.
+            if len == 0 {
+                return None;
+            }
+            buf.truncate(len);
+            return Some(buf);
+        }
+    }
+
+    fn unseal_index(key: CacheKey, sealed: &mut [u8]) -> bool {
+        let ((_, rdd_id), part_id) = key;
+        let _bound = Env::bind_partition(part_id);
+        let enclave = Env::enter();
+        let mut opened = 0;
+        let sgx_status = unsafe {
+            unseal_cache_index(
+                enclave.eid(),
+                &mut opened,
+                rdd_id,
+                part_id,
+                sealed.as_mut_ptr(),
+                sealed.len(),
+            )
+        };
+        sgx_status == sgx_status_t::SGX_SUCCESS && opened != 0
+    }
+
+    fn free_block(key: CacheKey, ptr: usize) {
+        let ((key_space_id, rdd_id), part_id) = key;
+        if key_space_id == RETAINED_KEY_SPACE {
+            // The rdd was of an earlier job, its blocks are the `Vec<ItemE>` of any secure one.
+            let _bound = Env::bind_partition(part_id);
+            let _blocks = unsafe { Box::from_raw(ptr as *mut Vec<ItemE>) };
+            return;
+        }
+        let rdd_base = match RDDB_MAP.get_rddb(rdd_id) {
+            Some(rdd_base) => rdd_base,
+            None => panic!("invalid cached rdd id"),
+        };
+        //the block lives in the outside heap of the enclave that cached it
+        let _bound = Env::bind_partition(part_id);
+        rdd_base.free_data_enc(ptr as *mut u8);
+    }
+
+    /// Evicts the least recently used entries other than `entry` until `space` more bytes fit.
+    /// The bytes `entry` holds now count as free, it is about to be replaced.
+    fn ensure_free_space(&self, lru: &mut Lru, entry: EntryKey, space: usize) -> Vec<DroppedEntry> {
+        let replaced = match entry {
+            EntryKey::Plain(key) => self.map.get(&key).map_or(0, |value| value.1),
+            EntryKey::Secure(key) => self.smap.get(&key).map_or(0, |value| value.1),
+        };
+        let mut dropped = Vec::new();
+        while self.current_bytes() - replaced + space > self.max_bytes {
+            let victim = match lru.least_recent(entry) {
+                Some(victim) => victim,
+                None => break,
             };
-            rdd_base.free_data_enc(value.0 as *mut u8);
+            lru.remove(victim);
+            if let Some(entry) = self.drop_entry(victim) {
+                BoundedMemoryCache::report_entry_dropped(&entry);
+                dropped.push(entry);
+            }
+        }
+        dropped
+    }
+
+    /// Removes `entry` from memory, `None` if it is still kept on the executor, i.e. spilled.
+    fn drop_entry(&self, entry: EntryKey) -> Option<DroppedEntry> {
+        let (key, size, spilled) = match entry {
+            EntryKey::Plain(key) => {
+                let (_, (_, size)) = self.map.remove(&key)?;
+                (key, size, false)
+            }
+            EntryKey::Secure(key) => {
+                let (_, (ptr, size)) = self.smap.remove(&key)?;
+                self.invalidations.invalidate(key);
+                let spilled = self.spill(key, ptr, size);
+                self.bury(key, ptr);
+                (key, size, spilled)
+            }
+        };
+        self.current_bytes.fetch_sub(size, Ordering::SeqCst);
+        // The master of this job does not know of the retained entries.
+        if spilled || (key.0).0 == RETAINED_KEY_SPACE {
+            return None;
         }
+        Some(DroppedEntry {
+            rdd_id: (key.0).1,
+            partition: key.1,
+            size,
+        })
     }
 
-    fn ensure_free_space(&self, _dataset_id: u64, _space: u64) -> bool {
-        // TODO: logging
-        todo!()
+    /// Writes the blocks of an evicted secure entry to the spill dir, false if there is none or
+    /// the write failed.
+    fn spill(&self, key: CacheKey, ptr: usize, size: usize) -> bool {
+        let dir = match self.spill_dir.lock().unwrap().clone() {
+            Some(dir) => dir,
+            None => return false,
+        };
+        let ((key_space_id, rdd_id), part_id) = key;
+        let path = dir.join(format!("{}-{}-{}.blocks", key_space_id, rdd_id, part_id));
+        // Still alive, it is only freed by `bury` after this.
+        let blocks = unsafe { &*(ptr as *const Vec<ItemE>) };
+        match fs::create_dir_all(&dir).and_then(|_| write_blocks(&path, blocks)) {
+            Ok(()) => {
+                log::debug!(
+                    "spilled partition {} of rdd {} ({} bytes) to {:?}",
+                    part_id,
+                    rdd_id,
+                    size,
+                    path
+                );
+                self.spilled.insert(key, (path, size));
+                true
+            }
+            Err(err) => {
+                log::warn!("could not spill partition {} of rdd {}: {}", part_id, rdd_id, err);
+                let _ = fs::remove_file(&path);
+                false
+            }
+        }
     }
 
-    fn report_entry_dropped(_data_set_id: usize, _partition: usize, _entry: (Vec<u8>, usize)) {
-        // TODO: loggging
-        todo!()
+    /// Frees the block of an evicted secure entry, once no pinned ecall may read it any more.
+    fn bury(&self, key: CacheKey, ptr: usize) {
+        let mut graveyard = self.graveyard.lock().unwrap();
+        if graveyard.pins.is_empty() {
+            drop(graveyard);
+            BoundedMemoryCache::free_block(key, ptr);
+        } else {
+            let epoch = graveyard.epoch;
+            graveyard.epoch += 1;
+            graveyard.dead.push((epoch, key, ptr));
+        }
     }
+
+    fn report_entry_dropped(entry: &DroppedEntry) {
+        log::debug!(
+            "evicted partition {} of rdd {} ({} bytes) from the cache",
+            entry.partition,
+            entry.rdd_id,
+            entry.size
+        );
+    }
+}
+
+/// {key_space_id}-{cached_rdd_id}-{part_id}.{ext}
+fn persisted_path(dir: &Path, key: CacheKey, ext: &str) -> PathBuf {
+    let ((key_space_id, rdd_id), part_id) = key;
+    dir.join(format!("{}-{}-{}.{}", key_space_id, rdd_id, part_id, ext))
+}
+
+/// The key of a persisted index.
+fn persisted_key(path: &Path) -> Option<CacheKey> {
+    if path.extension()? != "index" {
+        return None;
+    }
+    let stem = path.file_stem()?.to_str()?;
+    let mut ids = stem.splitn(3, '-').map(|id| id.parse::<usize>().ok());
+    let key_space_id = ids.next()??;
+    let rdd_id = ids.next()??;
+    let part_id = ids.next()??;
+    Some(((key_space_id, rdd_id), part_id))
+}
+
+fn write_blocks(path: &Path, blocks: &Vec<ItemE>) -> io::Result<()> {
+    let mut writer = BufWriter::new(File::create(path)?);
+    bincode::serialize_into(&mut writer, blocks)
+        .map_err(|err| io::Error::new(io::ErrorKind::Other, err))?;
+    writer.flush()
+}
+
+fn read_blocks(path: &Path) -> io::Result<Vec<ItemE>> {
+    let reader = BufReader::new(File::open(path)?);
+    bincode::deserialize_from(reader).map_err(|err| io::Error::new(io::ErrorKind::InvalidData, err))
 }
 
 #[derive(Debug, Clone)]
@@ -160,11 +989,128 @@ impl<'a> KeySpace<'a> {
     pub fn sget(&self, dataset_id: usize, part_id: usize) -> Option<usize> {
         self.cache.sget((self.key_space_id, dataset_id), part_id)
     }
+    pub fn slookup(&self, dataset_id: usize, part_id: usize) -> Option<(usize, bool)> {
+        self.cache.slookup((self.key_space_id, dataset_id), part_id)
+    }
+    pub fn sload(&self, dataset_id: usize, part_id: usize) -> (Option<usize>, Vec<DroppedEntry>) {
+        self.cache.sload((self.key_space_id, dataset_id), part_id)
+    }
     pub fn sput(&self, dataset_id: usize, part_id: usize, value: *mut u8, avoid_moving: usize) -> CachePutResponse {
         self.cache
             .sput((self.key_space_id, dataset_id), part_id, value, avoid_moving)
     }
+    pub fn adopt(&self, lineage: u64, rdd_id: usize) -> Vec<(usize, usize)> {
+        self.cache.adopt(lineage, (self.key_space_id, rdd_id))
+    }
     pub fn get_capacity(&self) -> usize {
-        self.cache.max_mbytes
+        self.cache.max_bytes / MB
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn dropped_parts(response: CachePutResponse) -> Vec<usize> {
+        match response {
+            CachePutResponse::CachePutSuccess { dropped, .. } => {
+                dropped.iter().map(|entry| entry.partition).collect()
+            }
+            CachePutResponse::CachePutFailure => panic!("put failed"),
+        }
+    }
+
+    #[test]
+    fn evict_least_recently_used() {
+        let cache = BoundedMemoryCache::with_max_bytes(3 * (100 + ENTRY_OVERHEAD));
+        let key_space = cache.new_key_space();
+        for part in 0..3 {
+            assert!(dropped_parts(key_space.put(0, part, vec![0; 100])).is_empty());
+        }
+        assert!(key_space.get(0, 0).is_some());
+        assert_eq!(dropped_parts(key_space.put(0, 3, vec![1; 100])), vec![1]);
+        assert!(key_space.get(0, 1).is_none());
+        // Replacing an entry frees its old bytes first.
+        assert!(dropped_parts(key_space.put(0, 3, vec![2; 100])).is_empty());
+        assert_eq!(key_space.get(0, 3), Some(vec![2; 100]));
+        assert_eq!(cache.current_bytes(), 3 * (100 + ENTRY_OVERHEAD));
+        assert!(matches!(
+            key_space.put(0, 4, vec![0; 400]),
+            CachePutResponse::CachePutFailure
+        ));
+        assert_eq!(dropped_parts(key_space.put(0, 4, vec![0; 200])), vec![2, 0]);
+    }
+
+    #[test]
+    fn least_recent_secure_of_an_enclave() {
+        let mut lru = Lru::default();
+        lru.touch(EntryKey::Plain(((0, 1), 0)));
+        lru.touch(EntryKey::Secure(((0, 1), 1)));
+        lru.touch(EntryKey::Secure(((0, 1), 2)));
+        lru.touch(EntryKey::Secure(((0, 2), 4)));
+        let even = |part: usize| part % 2 == 0;
+        assert_eq!(
+            lru.least_recent_secure(even),
+            Some(EntryKey::Secure(((0, 1), 2)))
+        );
+        lru.touch(EntryKey::Secure(((0, 1), 2)));
+        assert_eq!(
+            lru.least_recent_secure(even),
+            Some(EntryKey::Secure(((0, 2), 4)))
+        );
+        lru.remove(EntryKey::Secure(((0, 2), 4)));
+        lru.remove(EntryKey::Secure(((0, 1), 2)));
+        assert_eq!(lru.least_recent_secure(even), None);
+    }
+
+    #[test]
+    fn invalidations_in_batches() {
+        let invalidations = Invalidations::default();
+        for part in 0..3 {
+            invalidations.invalidate(((0, 7), part));
+        }
+        let mut out = [(0, 0); 2];
+        assert_eq!(invalidations.since(0, &mut out), (2, Some(2)));
+        assert_eq!(out, [(7, 0), (7, 1)]);
+        assert_eq!(invalidations.since(2, &mut out), (3, Some(1)));
+        assert_eq!(out[0], (7, 2));
+        assert_eq!(invalidations.since(3, &mut out), (3, Some(0)));
+        for part in 0..=INVALIDATION_LOG_LEN {
+            invalidations.invalidate(((0, 8), part));
+        }
+        // The log no longer reaches back, the enclave drops everything.
+        assert_eq!(invalidations.since(3, &mut out).1, None);
+        invalidations.invalidate_all();
+        let current = invalidations.generation.load(Ordering::SeqCst);
+        assert_eq!(invalidations.since(current - 1, &mut out).1, None);
+        assert_eq!(invalidations.since(current, &mut out), (current, Some(0)));
+    }
+
+    #[test]
+    fn retained_entries_adopted_by_lineage() {
+        let cache = BoundedMemoryCache::with_max_bytes(1 << 20);
+        let key_space = cache.new_key_space();
+        let (rdd_id, lineage) = (3, 0xfeed);
+        // Never read, the entries stay in memory.
+        let key = ((key_space.key_space_id, rdd_id), 1);
+        cache.smap.insert(key, (0x1000, 100));
+        cache.current_bytes.fetch_add(100, Ordering::SeqCst);
+        cache.lru.lock().unwrap().touch(EntryKey::Secure(key));
+        cache.clear(&vec![(rdd_id, lineage)].into_iter().collect());
+        assert!(!key_space.scontain(rdd_id, 1));
+        assert_eq!(cache.current_bytes(), 100);
+        // The next job gives the rdd of the same lineage another id.
+        assert_eq!(key_space.adopt(lineage, 5), vec![(1, 100)]);
+        assert_eq!(key_space.slookup(5, 1), Some((0x1000, true)));
+        assert!(key_space.adopt(lineage, 6).is_empty());
+    }
+
+    #[test]
+    fn block_file_round_trip() -> io::Result<()> {
+        let path = std::env::temp_dir().join(format!("ns-cache-{}.blocks", uuid::Uuid::new_v4()));
+        let blocks: Vec<ItemE> = vec![vec![1, 2, 3], vec![], vec![4; 1000]];
+        write_blocks(&path, &blocks)?;
+        assert_eq!(read_blocks(&path)?, blocks);
+        fs::remove_file(path)
     }
 }
@@ -1,32 +1,42 @@
 use std::collections::{BTreeSet, HashMap};
 use std::collections::LinkedList;
+use std::hash::{Hash, Hasher};
 use std::net::{Ipv4Addr, SocketAddr};
-use std::sync::Arc;
-use std::thread;
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::{self, ThreadId};
 use std::time::Duration;
 
-use crate::cache::{BoundedMemoryCache, CachePutResponse, KeySpace};
+use crate::cache::{BoundedMemoryCache, CachePutResponse, DroppedEntry, KeySpace};
+use crate::dependency::Dependency;
 use crate::env;
-use crate::rdd::Rdd;
+use crate::rdd::{Rdd, RddBase};
 use crate::serializable_traits::Data;
 use crate::serialized_data_capnp::serialized_data;
 use crate::split::Split;
 use crate::{Error, NetworkError, Result};
 use capnp::message::ReaderOptions;
 use capnp_futures::serialize as capnp_serialize;
-use dashmap::{DashMap, DashSet};
+use dashmap::{mapref::entry::Entry, DashMap, DashSet};
+use fasthash::MetroHasher;
 use serde_derive::{Deserialize, Serialize};
 use tokio::net::TcpListener;
+use tokio::sync::Notify;
 use tokio_stream::StreamExt;
 use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
+use uuid::Uuid;
 
 const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
     traversal_limit_in_words: None,
     nesting_limit: 64,
 };
 
+/// Queued cache location updates are sent to the master at most this far apart.
+const UPDATE_FLUSH_INTERVAL: Duration = Duration::from_millis(20);
+/// A batch of this many updates is sent right away.
+const UPDATE_BATCH_LEN: usize = 256;
+
 /// Cache tracker works by creating a server in master node and slave nodes acting as clients.
-#[derive(Serialize, Deserialize)]
+#[derive(Debug, Serialize, Deserialize)]
 pub(crate) enum CacheTrackerMessage {
     AddedToCache {
         rdd_id: usize,
@@ -54,6 +64,8 @@ pub(crate) enum CacheTrackerMessage {
     GetCacheStatus,
     GetCacheLocations,
     StopCacheTracker,
+    /// `AddedToCache` and `DroppedFromCache` updates queued by an executor, in order.
+    UpdateBatch(Vec<CacheTrackerMessage>),
 }
 
 #[derive(Serialize, Deserialize)]
@@ -70,10 +82,60 @@ pub(crate) struct CacheTracker {
     slave_capacity: DashMap<Ipv4Addr, usize>,
     slave_usage: DashMap<Ipv4Addr, usize>,
     registered_rdd_ids: DashSet<usize>,
-    loading: DashSet<(usize, usize)>,   // (rdd, partition)
-    sloading: DashSet<(usize, usize)>,  // (cached_rdd_id, part_id)
+    loading: Arc<Flights>,  // (rdd, partition)
+    sloading: Arc<Flights>, // (cached_rdd_id, part_id)
     cache: KeySpace<'static>,
+    /// Lineage fingerprints of the rdds of the job by id, see `adopt_lineage`.
+    lineages: DashMap<usize, u64>,
     master_addr: SocketAddr,
+    /// Location updates not sent to the master yet, see `update_flusher`.
+    updates: Mutex<Vec<CacheTrackerMessage>>,
+    updates_ready: Notify,
+}
+
+/// Partitions a task computes to cache them, by key. The other tasks that want one of them wait
+/// for its value instead of computing it as well.
+type Flights = DashMap<(usize, usize), Arc<Flight>>;
+
+#[derive(Debug)]
+struct Flight {
+    owner: ThreadId,
+    done: Mutex<bool>,
+    landed: Condvar,
+}
+
+impl Flight {
+    fn land(&self) {
+        *self.done.lock().unwrap() = true;
+        self.landed.notify_all();
+    }
+
+    fn wait(&self) {
+        let mut done = self.done.lock().unwrap();
+        while !*done {
+            done = self.landed.wait(done).unwrap();
+        }
+    }
+}
+
+/// The claim of a task on computing a partition for the cache, see `CacheTracker::claim`. The
+/// waiters look the partition up again when its value is put, or when the claim is dropped
+/// without it.
+#[derive(Debug)]
+pub(crate) struct Loading {
+    flights: Arc<Flights>,
+    key: (usize, usize),
+    flight: Option<Arc<Flight>>,
+}
+
+impl Drop for Loading {
+    fn drop(&mut self) {
+        if let Some(flight) = self.flight.take() {
+            self.flights
+                .remove_if(&self.key, |_, cur| Arc::ptr_eq(cur, &flight));
+            flight.land();
+        }
+    }
 }
 
 impl CacheTracker {
@@ -83,18 +145,28 @@ impl CacheTracker {
         local_ip: Ipv4Addr,
         the_cache: &'static BoundedMemoryCache,
     ) -> Result<Arc<Self>> {
+        // Evicted secure partitions are spilled here.
+        the_cache.set_spill_dir(
+            env::Configuration::get()
+                .local_dir
+                .join(format!("ns-cache-{}", Uuid::new_v4())),
+        );
         let cache = Arc::new(CacheTracker {
             is_master,
             locs: DashMap::new(),
             slave_capacity: DashMap::new(),
             slave_usage: DashMap::new(),
             registered_rdd_ids: DashSet::new(),
-            loading: DashSet::new(),
-            sloading: DashSet::new(),
+            loading: Arc::new(DashMap::new()),
+            sloading: Arc::new(DashMap::new()),
             cache: the_cache.new_key_space(),
+            lineages: DashMap::new(),
             master_addr: SocketAddr::new(master_addr.ip(), master_addr.port() + 1),
+            updates: Mutex::new(Vec::new()),
+            updates_ready: Notify::new(),
         });
         cache.clone().server();
+        cache.clone().update_flusher();
         let cachec = cache.clone();
         let fut = async move {
             let size = cachec.cache.get_capacity();
@@ -182,9 +254,53 @@ impl CacheTracker {
         });
     }
 
+    /// Sends the queued location updates to the master in batches, in the order they were
+    /// queued, so that putting a partition into the cache, e.g. from `ocall_cache_to_outside`,
+    /// never waits on the network.
+    fn update_flusher(self: Arc<Self>) {
+        env::Env::run_in_async_rt(|| {
+            tokio::spawn(async move {
+                loop {
+                    let _ = tokio::time::timeout(UPDATE_FLUSH_INTERVAL, self.updates_ready.notified())
+                        .await;
+                    let batch = std::mem::take(&mut *self.updates.lock().unwrap());
+                    if batch.is_empty() {
+                        continue;
+                    }
+                    let len = batch.len();
+                    let selfc = self.clone();
+                    // The client blocks on a std TcpStream.
+                    let sent = tokio::task::spawn_blocking(move || {
+                        futures::executor::block_on(
+                            selfc.client(CacheTrackerMessage::UpdateBatch(batch)),
+                        )
+                    })
+                    .await;
+                    if !matches!(sent, Ok(Ok(_))) {
+                        log::warn!("lost {} cache location updates for the master", len);
+                    }
+                }
+            });
+        });
+    }
+
+    fn queue_update(&self, update: CacheTrackerMessage) {
+        let mut updates = self.updates.lock().unwrap();
+        updates.push(update);
+        if updates.len() >= UPDATE_BATCH_LEN {
+            self.updates_ready.notify_one();
+        }
+    }
+
     fn process_message(self: Arc<Self>, message: CacheTrackerMessage) -> CacheTrackerMessageReply {
         // TODO: logging
         match message {
+            CacheTrackerMessage::UpdateBatch(updates) => {
+                for update in updates {
+                    self.clone().process_message(update);
+                }
+                CacheTrackerMessageReply::Ok
+            }
             CacheTrackerMessage::SlaveCacheStarted { host, size } => {
                 self.slave_capacity.insert(host, size);
                 self.slave_usage.insert(host, 0);
@@ -226,22 +342,13 @@ impl CacheTracker {
                 size,
             } => {
                 if size > 0 {
-                    let remaining = self.get_cache_usage(host) - size;
+                    let remaining = self.get_cache_usage(host).saturating_sub(size);
                     self.slave_usage.insert(host, remaining);
                 }
-                let remaining_locs = self
-                    .locs
-                    .get(&rdd_id)
-                    .unwrap()
-                    .get(partition)
-                    .unwrap()
-                    .iter()
-                    .filter(|x| *x == &host)
-                    .copied()
-                    .collect();
+                // The partition is no longer cached on host, tasks stop being placed there.
                 if let Some(mut locs_r) = self.locs.get_mut(&rdd_id) {
                     if let Some(locs_p) = locs_r.get_mut(partition) {
-                        *locs_p = remaining_locs;
+                        *locs_p = locs_p.iter().filter(|x| **x != host).copied().collect();
                     }
                 }
                 CacheTrackerMessageReply::Ok
@@ -329,9 +436,17 @@ impl CacheTracker {
         self.cache.scontain(key.0, key.1)
     }
 
-    pub fn get_sdata(&self, key: (usize, usize)) -> Option<usize> {
+    /// The pointer to the blocks of a secure entry, read back from its block file if it was
+    /// spilled, and whether it is in memory and may be mirrored by the enclave, see
+    /// `BoundedMemoryCache::slookup`.
+    pub fn get_sdata(&self, key: (usize, usize)) -> Option<(usize, bool)> {
         let (rdd_id, part_id) = key;
-        self.cache.sget(rdd_id, part_id)
+        if let Some(found) = self.cache.slookup(rdd_id, part_id) {
+            return Some(found);
+        }
+        let (ptr, dropped) = self.cache.sload(rdd_id, part_id);
+        self.report_dropped(dropped);
+        ptr.map(|ptr| (ptr, true))
     }
 
     pub fn put_sdata(
@@ -342,57 +457,201 @@ impl CacheTracker {
     ) {
         let (rdd_id, part_id) = key;
         let put_response = self.cache.sput(rdd_id, part_id, value, avoid_moving);
-        if let CachePutResponse::CachePutSuccess(size) = put_response {
-            futures::executor::block_on(self.client(CacheTrackerMessage::AddedToCache {
-                rdd_id: rdd_id,
-                partition: part_id,
-                host: env::Configuration::get().local_ip,
-                size,
-            }))
-            .unwrap();
+        self.report_put(rdd_id, part_id, put_response);
+        // The tasks waiting for it need not wait for the end of the one that computed it.
+        if let Some((_, flight)) = self.sloading.remove(&key) {
+            flight.land();
         }
     }
 
+    /// Claims computing the secure partition `key` for the cache, None once it is cached.
+    pub fn claim_sdata(&self, key: (usize, usize)) -> Option<Loading> {
+        CacheTracker::claim(&self.sloading, key, || self.scontain(key))
+    }
+
+    /// Waits while another thread computes `key` for the cache. None if it is cached by then,
+    /// else the claim of this thread on computing it. A thread that claimed `key` already, for a
+    /// lineage that reads the partition twice, gets an empty claim and computes it again.
+    fn claim(
+        flights: &Arc<Flights>,
+        key: (usize, usize),
+        mut cached: impl FnMut() -> bool,
+    ) -> Option<Loading> {
+        let me = thread::current().id();
+        loop {
+            if cached() {
+                return None;
+            }
+            let flight = match flights.entry(key) {
+                Entry::Vacant(entry) => {
+                    let flight = Arc::new(Flight {
+                        owner: me,
+                        done: Mutex::new(false),
+                        landed: Condvar::new(),
+                    });
+                    entry.insert(flight.clone());
+                    let loading = Loading {
+                        flights: flights.clone(),
+                        key,
+                        flight: Some(flight),
+                    };
+                    // Put between the look up and the claim.
+                    if cached() {
+                        return None;
+                    }
+                    return Some(loading);
+                }
+                Entry::Occupied(entry) => entry.get().clone(),
+            };
+            if flight.owner == me {
+                return Some(Loading {
+                    flights: flights.clone(),
+                    key,
+                    flight: None,
+                });
+            }
+            flight.wait();
+        }
+    }
+
+    /// Drops the partitions of `rdd_id` this executor cached in the secure tier.
+    pub fn sremove_rdd(&self, rdd_id: usize) {
+        let dropped = self.cache.cache.sremove_rdd(rdd_id);
+        self.report_dropped(dropped);
+    }
+
+    /// Evicts cached partitions of enclave `idx` holding `bytes` of its outside heap, which the
+    /// host could not grow, see `memory_pressure_o`.
+    pub fn relieve_pressure(&self, idx: usize, bytes: usize) {
+        let dropped = self
+            .cache
+            .cache
+            .sevict(bytes, |part| env::Env::enclave_of(part) == idx);
+        log::warn!(
+            "outside heap of enclave {} full, evicted {} cached partitions",
+            idx,
+            dropped.len()
+        );
+        self.report_dropped(dropped);
+    }
+
+    /// Fingerprints the lineages of `rdd` and of the rdds it depends on, once per job. With
+    /// VEGA_LINEAGE_CACHE a cached one takes the secure partitions that an earlier job on this
+    /// executor daemon cached of the same lineage, see `BoundedMemoryCache::clear`, so a repeated
+    /// job, or one that shares a prefix with it, reads them instead of computing them again.
+    pub fn adopt_lineage(&self, rdd: &dyn RddBase) {
+        if env::Configuration::get().lineage_cache {
+            self.lineage_fingerprint(rdd);
+        }
+    }
+
+    /// Hash of the op ids, the contents (see `RddBase::content_hash`) and the partition counts
+    /// of `rdd` and of the rdds it depends on. It stays the same across jobs while the inputs
+    /// do, the executor daemon only runs the jobs of the binaries the op ids refer to.
+    fn lineage_fingerprint(&self, rdd: &dyn RddBase) -> u64 {
+        let rdd_id = rdd.get_rdd_id();
+        if let Some(lineage) = self.lineages.get(&rdd_id) {
+            return *lineage;
+        }
+        let mut hasher = MetroHasher::default();
+        rdd.get_op_id().hash(&mut hasher);
+        rdd.content_hash().hash(&mut hasher);
+        rdd.number_of_splits().hash(&mut hasher);
+        for dep in rdd.get_dependencies() {
+            let parent = match dep {
+                Dependency::NarrowDependency(dep) => dep.get_rdd_base(),
+                Dependency::ShuffleDependency(dep) => dep.get_rdd_base(),
+            };
+            self.lineage_fingerprint(&*parent).hash(&mut hasher);
+        }
+        let lineage = hasher.finish();
+        // Adopted before the fingerprint is recorded, a task that finds it recorded finds them.
+        if rdd.should_cache() && rdd.get_secure() {
+            let host = env::Configuration::get().local_ip;
+            let adopted = self.cache.adopt(lineage, rdd_id);
+            if !adopted.is_empty() {
+                log::info!(
+                    "rdd {} adopted {} partitions cached by an earlier job",
+                    rdd_id,
+                    adopted.len()
+                );
+            }
+            for (partition, size) in adopted {
+                self.queue_update(CacheTrackerMessage::AddedToCache {
+                    rdd_id,
+                    partition,
+                    host,
+                    size,
+                });
+            }
+        }
+        self.lineages.insert(rdd_id, lineage);
+        lineage
+    }
+
+    /// The lineage fingerprints of the rdds of the job that ended, by id, which the next one
+    /// reuses.
+    pub fn take_lineages(&self) -> HashMap<usize, u64> {
+        let lineages = self
+            .lineages
+            .iter()
+            .map(|entry| (*entry.key(), *entry.value()))
+            .collect();
+        self.lineages.clear();
+        lineages
+    }
+
     //support local mode only
     pub fn get_or_compute<T: Data>(
         &self,
         rdd: Arc<dyn Rdd<Item = T>>,
         split: Box<dyn Split>,
     ) -> Box<dyn Iterator<Item = T>> {
-        if let Some(cached_val) = self.cache.get(rdd.get_rdd_id(), split.get_index()) {
+        let key = (rdd.get_rdd_id(), split.get_index());
+        let mut cached_val = self.cache.get(key.0, key.1);
+        let mut loading = None;
+        if cached_val.is_none() {
+            loading = CacheTracker::claim(&self.loading, key, || {
+                cached_val = self.cache.get(key.0, key.1);
+                cached_val.is_some()
+            });
+        }
+        if let Some(cached_val) = cached_val {
             let res: Vec<T> = bincode::deserialize(&cached_val).unwrap();
-            Box::new(res.into_iter())
-        } else {
-            let key = (rdd.get_rdd_id(), split.get_index());
-            while self.loading.contains(&key) {
-                let dur = Duration::from_millis(1);
-                thread::sleep(dur);
-            }
-            if let Some(cached_val) = self.cache.get(rdd.get_rdd_id(), split.get_index()) {
-                let res: Vec<T> = bincode::deserialize(&cached_val).unwrap();
-                return Box::new(res.into_iter());
-            }
-            self.loading.insert(key);
-
-            let res: Vec<_> = rdd.compute(split.clone()).unwrap().collect();
-            let res_bytes = bincode::serialize(&res).unwrap();
-            let put_response = self
-                .cache
-                .put(rdd.get_rdd_id(), split.get_index(), res_bytes);
-            self.loading.remove(&key);
-
-            if let CachePutResponse::CachePutSuccess(size) = put_response {
-                futures::executor::block_on(self.client(CacheTrackerMessage::AddedToCache {
-                    rdd_id: rdd.get_rdd_id(),
-                    partition: split.get_index(),
-                    host: env::Configuration::get().local_ip,
-                    size,
-                }))
-                .unwrap();
-            }
-            Box::new(res.into_iter())
+            return Box::new(res.into_iter());
         }
+
+        let res: Vec<_> = rdd.compute(split.clone()).unwrap().collect();
+        let res_bytes = bincode::serialize(&res).unwrap();
+        let put_response = self.cache.put(key.0, key.1, res_bytes);
+        drop(loading);
+        self.report_put(key.0, key.1, put_response);
+        Box::new(res.into_iter())
     }
 
-    // TODO: drop_entry needs to be implemented
+    /// Queues the update for the master about a partition put into the local cache, and about
+    /// the ones evicted to make room for it.
+    fn report_put(&self, rdd_id: usize, partition: usize, put_response: CachePutResponse) {
+        if let CachePutResponse::CachePutSuccess { size, dropped } = put_response {
+            self.report_dropped(dropped);
+            self.queue_update(CacheTrackerMessage::AddedToCache {
+                rdd_id,
+                partition,
+                host: env::Configuration::get().local_ip,
+                size,
+            });
+        }
+    }
+
+    fn report_dropped(&self, dropped: Vec<DroppedEntry>) {
+        let host = env::Configuration::get().local_ip;
+        for entry in dropped {
+            self.queue_update(CacheTrackerMessage::DroppedFromCache {
+                rdd_id: entry.rdd_id,
+                partition: entry.partition,
+                host,
+                size: entry.size,
+            });
+        }
+    }
 }
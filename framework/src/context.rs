@@ -1,29 +1,44 @@
 use core::panic::Location;
+use std::collections::HashSet;
 use std::fmt::Debug;
 use std::fs;
+use std::hash::{Hash, Hasher};
 use std::io::Write;
 use std::net::{Ipv4Addr, SocketAddrV4, TcpStream};
 use std::ops::Range;
 use std::path::{Path, PathBuf};
-use std::process::Command;
 use std::sync::{
-    atomic::{AtomicU32, AtomicUsize, Ordering},
-    Arc, RwLock,
+    atomic::{AtomicU64, AtomicUsize, Ordering},
+    Arc,
 };
 use std::thread;
 use std::time::{Duration, Instant};
 
-use crate::error::{Error, Result};
+use crate::cpu_profiler;
+use crate::dependency::{Dependency, ShuffleDependencyTrait};
+use crate::deploy::{self, DeployedFile, Deployment, ExecutorDeployment};
+use crate::epc_pressure;
+use crate::error::{Error, NetworkError, Result};
 use crate::executor::{Executor, Signal};
+use crate::heap_profiler;
 use crate::io::ReaderConfiguration;
 use crate::partial::{ApproximateEvaluator, PartialResult};
-use crate::rdd::{ItemE, OpId, ParallelCollection, Rdd, RddBase, UnionRdd};
-use crate::scheduler::{DistributedScheduler, LocalScheduler, NativeScheduler, TaskContext};
+use crate::rdd::{
+    broadcast, BroadcastVar, ItemE, OpId, ParallelCollection, Rdd, RddBase, Text, UnionRdd,
+};
+use crate::scheduler::{
+    fair_pool, DistributedScheduler, JobListener, LocalScheduler, NativeScheduler, TaskContext,
+};
 use crate::serializable_traits::{Data, Func, SerFunc};
 use crate::serialized_data_capnp::serialized_data;
+use crate::trace;
 use crate::{env, hosts, utils, Fn, SerArc};
+use capnp::message::ReaderOptions;
+use fasthash::MetroHasher;
 use log::error;
 use once_cell::sync::OnceCell;
+use parking_lot::Mutex;
+use serde::de::DeserializeOwned;
 use sgx_types::*;
 use simplelog::*;
 use uuid::Uuid;
@@ -31,24 +46,40 @@ use Schedulers::*;
 
 extern "C" {
     fn clear_cache(eid: sgx_enclave_id_t) -> sgx_status_t;
-    fn pre_touching(eid: sgx_enclave_id_t, retval: *mut usize, zero: u8) -> sgx_status_t;
+    fn stop_thread_pool(eid: sgx_enclave_id_t) -> sgx_status_t;
+    fn pre_touching(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        zero: u8,
+        offset: usize,
+        len: usize,
+    ) -> sgx_status_t;
 }
 
 fn wrapper_clear_cache() {
-    let eid = env::Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
-    let sgx_status = unsafe { clear_cache(eid) };
-    match sgx_status {
-        sgx_status_t::SGX_SUCCESS => {}
-        _ => {
-            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
-        }
-    };
+    env::Env::for_each_enclave(|| {
+        let enclave = env::Env::enter();
+        let sgx_status = unsafe { clear_cache(enclave.eid()) };
+        match sgx_status {
+            sgx_status_t::SGX_SUCCESS => {}
+            _ => {
+                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+            }
+        };
+    });
+}
+
+fn wrapper_stop_thread_pool() {
+    env::Env::for_each_enclave(|| {
+        let enclave = env::Env::enter();
+        let sgx_status = unsafe { stop_thread_pool(enclave.eid()) };
+        match sgx_status {
+            sgx_status_t::SGX_SUCCESS => {}
+            _ => {
+                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+            }
+        };
+    });
 }
 
 pub const PRI_KEY_LOC: &str = "/root/.ssh/id_ed25519";
@@ -122,6 +153,42 @@ impl Schedulers {
         }
     }
 
+    fn run_job_with_listener<T: Data, U: Data, F, L>(
+        &self,
+        func: Arc<F>,
+        final_rdd: Arc<dyn Rdd<Item = T>>,
+        action_id: Option<OpId>,
+        partitions: Vec<usize>,
+        listener: L,
+    ) -> Result<Vec<U>>
+    where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+        L: JobListener + 'static,
+    {
+        let op_name = final_rdd.get_op_name();
+        log::info!("starting `{}` job", op_name);
+        let start = Instant::now();
+        let res = match self {
+            Distributed(distributed) => distributed
+                .clone()
+                .run_job_with_listener(func, final_rdd, action_id, partitions, listener),
+            Local(local) => local
+                .clone()
+                .run_job_with_listener(func, final_rdd, action_id, partitions, listener),
+        };
+        log::info!(
+            "`{}` job finished, took {}s",
+            op_name,
+            start.elapsed().as_secs()
+        );
+        res
+    }
+
     fn run_approximate_job<T: Data, U: Data, R, F, E>(
         &self,
         func: Arc<F>,
@@ -164,14 +231,90 @@ impl Schedulers {
 pub struct Context {
     next_rdd_id: Arc<AtomicUsize>,
     next_shuffle_id: Arc<AtomicUsize>,
+    next_broadcast_id: Arc<AtomicU64>,
     scheduler: Schedulers,
     pub(crate) address_map: Vec<SocketAddrV4>,
     distributed_driver: bool,
     /// this context/session temp work dir
     work_dir: PathBuf,
-    last_loc_file: RwLock<&'static str>,
-    last_loc_line: AtomicU32,
+    /// `OpId::loc_hash` of the call site the last op id was made for.
+    last_loc: AtomicU64,
     num: AtomicUsize,
+    /// The loop between `enter_loop` and `leave_loop`, or the last one.
+    loop_scope: Mutex<Option<LoopScope>>,
+}
+
+/// The rdds made in a loop, and the ones made before it that the loop reads.
+///
+/// Every iteration reads the rdds made before the loop again, so they are cached in the secure
+/// tier by the first job that computes a rdd of the loop, and dropped at `leave_loop`. A loop
+/// that runs no job itself is computed by the jobs after it, each of which caches them for its
+/// own run only.
+struct LoopScope {
+    first_rdd_id: usize,
+    /// `None` until `leave_loop`.
+    end_rdd_id: Option<usize>,
+    cached: Vec<Arc<dyn RddBase>>,
+}
+
+impl LoopScope {
+    fn contains(&self, rdd_id: usize) -> bool {
+        rdd_id >= self.first_rdd_id && self.end_rdd_id.map_or(true, |end| rdd_id < end)
+    }
+
+    /// Marks the rdds made before the loop that the rdds of the loop in the lineage of `rdd` read.
+    /// Sources are left out, they hold their data already or are read anew anyway.
+    fn cache_invariants(&mut self, rdd: Arc<dyn RddBase>) {
+        let mut visited = HashSet::new();
+        let mut stack = vec![rdd];
+        while let Some(rdd) = stack.pop() {
+            // The rdds made before the loop are not read through.
+            if !visited.insert(rdd.get_rdd_id()) || rdd.get_rdd_id() < self.first_rdd_id {
+                continue;
+            }
+            let in_loop = self.contains(rdd.get_rdd_id());
+            for dep in rdd.get_dependencies() {
+                let parent = match dep {
+                    Dependency::NarrowDependency(dep) => dep.get_rdd_base(),
+                    Dependency::ShuffleDependency(dep) => dep.get_rdd_base(),
+                };
+                if parent.get_rdd_id() >= self.first_rdd_id {
+                    stack.push(parent);
+                } else if in_loop
+                    && parent.get_secure()
+                    && !parent.should_cache()
+                    && !parent.get_dependencies().is_empty()
+                {
+                    log::debug!("caching rdd {} read by every iteration", parent.get_rdd_id());
+                    parent.cache();
+                    self.cached.push(parent);
+                }
+            }
+        }
+    }
+
+    fn release(&mut self) {
+        let cache_tracker = env::Env::get().cache_tracker.clone();
+        for rdd in self.cached.drain(..) {
+            rdd.uncache();
+            cache_tracker.sremove_rdd(rdd.get_rdd_id());
+        }
+    }
+}
+
+/// Drops the rdds a job after a loop cached for it once the job is done.
+struct LoopInvariants<'a> {
+    context: &'a Context,
+}
+
+impl<'a> Drop for LoopInvariants<'a> {
+    fn drop(&mut self) {
+        if let Some(scope) = &mut *self.context.loop_scope.lock() {
+            if scope.end_rdd_id.is_some() {
+                scope.release();
+            }
+        }
+    }
 }
 
 impl Drop for Context {
@@ -209,19 +352,50 @@ impl Context {
         }
     }
 
+    /// Touches the first `pre_touch_mbytes` of the heap of every enclave, split over
+    /// `pre_touch_threads` threads each, and waits for them.
     pub fn launch_pre_touching() {
-        let eid = env::Env::get()
-            .enclave
-            .lock()
-            .unwrap()
-            .as_ref()
-            .unwrap()
-            .geteid();
-        let child = thread::spawn(move || {
-            let mut retval = 1;
-            let _sgx_status_t = unsafe { pre_touching(eid, &mut retval, 0) };
+        let config = env::Configuration::get();
+        let bytes = config.pre_touch_mbytes << 20;
+        let threads = config.pre_touch_threads;
+        // Whole pages per thread.
+        let chunk = ((bytes + threads - 1) / threads + 4095) / 4096 * 4096;
+        if chunk == 0 {
+            return;
+        }
+        let now = Instant::now();
+        let mut children = Vec::new();
+        env::Env::for_each_enclave(|| {
+            for i in 0..threads {
+                let enclave = env::Env::enter();
+                children.push(thread::spawn(move || {
+                    let mut retval = 0;
+                    let sgx_status = unsafe {
+                        pre_touching(enclave.eid(), &mut retval, 0, i * chunk, chunk)
+                    };
+                    match sgx_status {
+                        sgx_status_t::SGX_SUCCESS => retval,
+                        _ => {
+                            log::warn!("pre touching failed: {:?}", sgx_status);
+                            0
+                        }
+                    }
+                }));
+            }
         });
+        let num_threads = children.len();
+        let touched = children
+            .into_iter()
+            .map(|child| child.join().unwrap_or(0))
+            .sum::<usize>();
+        log::info!(
+            "pre touched {} MB of enclave heap with {} threads in {:?} s",
+            touched >> 20,
+            num_threads,
+            now.elapsed().as_secs_f64()
+        );
     }
+
     /// Sets a handler to receives any external signal to stop the process
     /// and shuts down gracefully any ongoing op
     fn set_cleanup_process(&self) {
@@ -241,7 +415,6 @@ impl Context {
     }
 
     fn init_local_scheduler() -> Result<Arc<Self>> {
-        Context::launch_pre_touching();
         let job_id = Uuid::new_v4().to_string();
         let job_work_dir = env::Configuration::get()
             .local_dir
@@ -249,18 +422,23 @@ impl Context {
         fs::create_dir_all(&job_work_dir).unwrap();
 
         initialize_loggers(job_work_dir.join("ns-driver.log"));
+        trace::set_dir(job_work_dir.clone());
+        Context::launch_pre_touching();
+        cpu_profiler::start_if_enabled();
+        epc_pressure::start_if_enabled();
         let scheduler = Schedulers::Local(Arc::new(LocalScheduler::new(20, true)));
 
         Ok(Arc::new(Context {
             next_rdd_id: Arc::new(AtomicUsize::new(0)),
             next_shuffle_id: Arc::new(AtomicUsize::new(0)),
+            next_broadcast_id: Arc::new(AtomicU64::new(1)),
             scheduler,
             address_map: vec![SocketAddrV4::new(Ipv4Addr::LOCALHOST, 0)],
             distributed_driver: false,
             work_dir: job_work_dir,
-            last_loc_file: RwLock::new("null"),
-            last_loc_line: AtomicU32::new(0),
+            last_loc: AtomicU64::new(0),
             num: AtomicUsize::new(0),
+            loop_scope: Mutex::new(None),
         }))
     }
 
@@ -312,82 +490,49 @@ impl Context {
             .map_err(Error::OsStringToString)?;
 
         fs::create_dir_all(&leader_work_dir).unwrap();
-        let conf_path = leader_work_dir.join("config.toml");
-        let conf_path = conf_path.to_str().unwrap();
         initialize_loggers(leader_work_dir.join("ns-driver.log"));
+        trace::set_dir(leader_work_dir.clone());
 
+        let mut executors = Vec::new();
         for address in &hosts::Hosts::get()?.slaves {
-            log::debug!("deploying executor at address {:?}", address);
             let address_ip: Ipv4Addr = address
                 .split('@')
                 .nth(1)
                 .ok_or_else(|| Error::ParseHostAddress(address.into()))?
                 .parse()
                 .map_err(|x| Error::ParseHostAddress(format!("{}", x)))?;
-            address_map.push(SocketAddrV4::new(address_ip, port));
-
-            log::debug!("creating workdir");
-            // Create work dir:
-            Command::new("ssh")
-                .args(&["-i", PRI_KEY_LOC, address, "mkdir", &worker_work_dir_str])
-                .output()
-                .map_err(|e| Error::CommandOutput {
-                    source: e,
-                    command: "ssh mkdir".into(),
-                })?;
-
-            log::debug!("copy conf file to remote");
-            // Copy conf file to remote:
-            Context::create_workers_config_file(address_ip, port, conf_path)?;
-            let remote_path = format!("{}:{}/config.toml", address, worker_work_dir_str);
-            Command::new("scp")
-                .args(&["-i", PRI_KEY_LOC, conf_path, &remote_path])
-                .output()
-                .map_err(|e| Error::CommandOutput {
-                    source: e,
-                    command: "scp config".into(),
-                })?;
-
-            log::debug!("copy binary");
-            // Copy binary:
-            let remote_path = format!("{}:{}/{}", address, worker_work_dir_str, binary_name);
-            Command::new("scp")
-                .args(&["-i", PRI_KEY_LOC, &binary_path_str, &remote_path])
-                .output()
-                .map_err(|e| Error::CommandOutput {
-                    source: e,
-                    command: "scp executor".into(),
-                })?;
-
-            // Copy enclave
-            let remote_path = format!("{}:{}/{}", address, worker_work_dir_str, enclave_name);
-            log::debug!("copy enclave");
-            Command::new("scp")
-                .args(&["-i", PRI_KEY_LOC, &enclave_path_str, &remote_path])
-                .output()
-                .map_err(|e| Error::CommandOutput {
-                    source: e,
-                    command: "scp executor enclave".into(),
-                })?;
-            // Copy pem??
-
-            log::debug!("deploy a remote slave");
-            // Deploy a remote slave:
-            let path = format!("{}/{}", worker_work_dir_str, binary_name);
-            log::debug!("remote path {}", path);
-            Command::new("ssh")
-                .args(&["-i", PRI_KEY_LOC, address, &path])
-                .spawn()
-                .map_err(|e| Error::CommandOutput {
-                    source: e,
-                    command: "ssh run".into(),
-                })?;
+            let executor = SocketAddrV4::new(address_ip, port);
+            address_map.push(executor);
+            // The executors are deployed at once, each has a config file of its own.
+            let conf_path = leader_work_dir.join(format!("config-{}-{}.toml", address_ip, port));
+            let config =
+                Context::create_workers_config_file(address_ip, port, conf_path.to_str().unwrap())?;
+            executors.push(ExecutorDeployment {
+                address: address.clone(),
+                executor,
+                conf_path,
+                config,
+            });
             port += 5000;
         }
+        let cache_dir = env::Configuration::get().local_dir.join("ns-binaries");
+        let deployment = Deployment {
+            work_dir: worker_work_dir_str.to_owned(),
+            cache_dir: cache_dir
+                .to_str()
+                .ok_or_else(|| Error::PathToString(cache_dir.clone()))?
+                .to_owned(),
+            files: vec![
+                DeployedFile::new(binary_path_str, binary_name)?,
+                DeployedFile::new(enclave_path_str, enclave_name)?,
+            ],
+        };
+        deployment.run(&executors)?;
 
         Ok(Arc::new(Context {
             next_rdd_id: Arc::new(AtomicUsize::new(0)),
             next_shuffle_id: Arc::new(AtomicUsize::new(0)),
+            next_broadcast_id: Arc::new(AtomicU64::new(1)),
             scheduler: Schedulers::Distributed(Arc::new(DistributedScheduler::new(
                 20,
                 true,
@@ -397,14 +542,13 @@ impl Context {
             address_map,
             distributed_driver: true,
             work_dir: leader_work_dir,
-            last_loc_file: RwLock::new("null"),
-            last_loc_line: AtomicU32::new(0),
+            last_loc: AtomicU64::new(0),
             num: AtomicUsize::new(0),
+            loop_scope: Mutex::new(None),
         }))
     }
 
     fn init_distributed_worker() -> Result<!> {
-        Context::launch_pre_touching();
         let mut work_dir = PathBuf::from("");
         match std::env::current_exe().map_err(|_| Error::CurrentBinaryPath) {
             Ok(binary_path) => {
@@ -417,10 +561,19 @@ impl Context {
             Err(err) => Context::worker_clean_up_directives(Err(err), work_dir)?,
         }
 
-        if (*env::Env::get().enclave).lock().unwrap().is_some() {
+        if !(*env::Env::get().enclave).lock().unwrap().is_empty() {
             log::debug!("worker inits enclave successfully");
         }
 
+        // Before the executor takes tasks.
+        Context::launch_pre_touching();
+        if env::Configuration::get().cache_persist {
+            env::BOUNDED_MEM_CACHE.set_persist_dir(work_dir.join("cache"));
+            let restored = env::BOUNDED_MEM_CACHE.restore();
+            log::info!("restored {} cached partitions of an earlier run", restored);
+        }
+        cpu_profiler::start_if_enabled();
+        epc_pressure::start_if_enabled();
         log::debug!("starting worker");
         let port = match env::Configuration::get()
             .slave
@@ -437,13 +590,12 @@ impl Context {
 
     fn worker_clean_up_directives(run_result: Result<Signal>, work_dir: PathBuf) -> Result<!> {
         wrapper_clear_cache();
+        heap_profiler::dump_if_enabled();
+        cpu_profiler::dump_if_enabled();
         env::BOUNDED_MEM_CACHE.free_data_enc();
         env::Env::get().shuffle_manager.clean_up_shuffle_data();
-        if let Some(enclave) =
-            std::mem::replace(&mut *(*env::Env::get().enclave).lock().unwrap(), None)
-        {
-            enclave.destroy();
-        }
+        wrapper_stop_thread_pool();
+        env::Env::get().destroy_enclave();
         utils::clean_up_work_dir(&work_dir);
         match run_result {
             Err(err) => {
@@ -457,22 +609,110 @@ impl Context {
         }
     }
 
+    /// Drops what the job left on an executor daemon, the next job reuses the ids of its rdds,
+    /// shuffles and broadcasts. The enclaves, their heaps and their threads stay, and with
+    /// VEGA_LINEAGE_CACHE the partitions cached of the lineages of the job.
+    pub(crate) fn end_job_on_executor() {
+        let env = env::Env::get();
+        wrapper_clear_cache();
+        env::BOUNDED_MEM_CACHE.clear(&env.cache_tracker.take_lineages());
+        env::SHUFFLE_STORE.clear();
+        env::RDDB_MAP.clear();
+        env.map_output_tracker.clear();
+        env.broadcast_tracker.clear();
+    }
+
+    /// Hash of the binaries of the executor and of its enclave, whose closures and ops the
+    /// tasks of a job refer to, and of the `config` of the executor.
+    pub(crate) fn fingerprint(config: &str) -> Result<u64> {
+        let binary_path = std::env::current_exe().map_err(|_| Error::CurrentBinaryPath)?;
+        let enclave_path = binary_path
+            .parent()
+            .ok_or(Error::CurrentBinaryPath)?
+            .join("enclave.signed.so");
+        let mut hasher = MetroHasher::default();
+        deploy::file_hash(&binary_path)?.hash(&mut hasher);
+        deploy::file_hash(&enclave_path)?.hash(&mut hasher);
+        config.hash(&mut hasher);
+        Ok(hasher.finish())
+    }
+
+    /// The `fingerprint` of this executor, with the config file it was deployed with.
+    pub(crate) fn executor_fingerprint() -> Result<u64> {
+        let binary_path = std::env::current_exe().map_err(|_| Error::CurrentBinaryPath)?;
+        let conf_path = binary_path
+            .parent()
+            .ok_or(Error::CurrentBinaryPath)?
+            .join("config.toml");
+        let config = fs::read_to_string(conf_path).map_err(Error::InputRead)?;
+        Context::fingerprint(&config)
+    }
+
+    /// Whether an executor daemon at `executor` runs the jobs of this driver, which would deploy
+    /// it with the `fingerprint` it must have. One of other binaries or of another configuration
+    /// is shut down, to be deployed again.
+    pub(crate) fn attach_executor(executor: SocketAddrV4, fingerprint: u64) -> bool {
+        match Context::ask_executor::<bool>(executor, &Signal::Attach(fingerprint)) {
+            Ok(true) => true,
+            Err(Error::NetworkError(NetworkError::ConnectionFailure)) => false,
+            _ => {
+                log::info!("replacing the executor daemon at {}", executor);
+                if let Ok(mut stream) = Context::signal_stream(executor) {
+                    let _ = Context::send_signal(&mut stream, &Signal::ShutDownGracefully);
+                }
+                // Its ports are free once it has cleaned up.
+                std::thread::sleep(std::time::Duration::from_millis(1_500));
+                false
+            }
+        }
+    }
+
+    /// Sends `signal` to the executor at `executor` and reads its reply.
+    pub(crate) fn ask_executor<R: DeserializeOwned>(
+        executor: SocketAddrV4,
+        signal: &Signal,
+    ) -> Result<R> {
+        let mut stream = Context::signal_stream(executor)?;
+        Context::send_signal(&mut stream, signal)?;
+        let reply = capnp::serialize::read_message(&mut stream, ReaderOptions::new())?;
+        let msg = reply.get_root::<serialized_data::Reader>()?.get_msg()?;
+        Ok(bincode::deserialize::<R>(msg)?)
+    }
+
+    fn signal_stream(executor: SocketAddrV4) -> Result<TcpStream> {
+        let signal_addr = SocketAddrV4::new(*executor.ip(), executor.port() + 10);
+        TcpStream::connect(signal_addr).map_err(|_| NetworkError::ConnectionFailure.into())
+    }
+
+    fn send_signal(stream: &mut TcpStream, signal: &Signal) -> Result<()> {
+        let signal = bincode::serialize(signal)?;
+        let mut message = capnp::message::Builder::new_default();
+        let mut task_data = message.init_root::<serialized_data::Builder>();
+        task_data.set_msg(&signal);
+        capnp::serialize::write_message(stream, &message).map_err(Error::OutputWrite)
+    }
+
     fn driver_clean_up_directives(work_dir: &Path, executors: &[SocketAddrV4]) {
         Context::drop_executors(executors);
         // Give some time for the executors to shut down and clean up
         std::thread::sleep(std::time::Duration::from_millis(1_500));
         wrapper_clear_cache();
+        heap_profiler::dump_if_enabled();
+        cpu_profiler::dump_if_enabled();
         env::BOUNDED_MEM_CACHE.free_data_enc();
         env::Env::get().shuffle_manager.clean_up_shuffle_data();
-        if let Some(enclave) =
-            std::mem::replace(&mut *(*env::Env::get().enclave).lock().unwrap(), None)
-        {
-            enclave.destroy();
-        }
+        wrapper_stop_thread_pool();
+        env::Env::get().destroy_enclave();
         utils::clean_up_work_dir(work_dir);
     }
 
-    fn create_workers_config_file(local_ip: Ipv4Addr, port: u16, config_path: &str) -> Result<()> {
+    /// Writes the config of the executor at `local_ip` and `port` to `config_path`, and returns
+    /// it.
+    fn create_workers_config_file(
+        local_ip: Ipv4Addr,
+        port: u16,
+        config_path: &str,
+    ) -> Result<String> {
         let mut current_config = env::Configuration::get().clone();
         current_config.local_ip = local_ip;
         current_config.slave = Some(std::convert::From::<(bool, u16)>::from((true, port)));
@@ -481,7 +721,7 @@ impl Context {
         let config_string = toml::to_string_pretty(&current_config).unwrap();
         let mut config_file = fs::File::create(config_path).unwrap();
         config_file.write_all(config_string.as_bytes()).unwrap();
-        Ok(())
+        Ok(config_string)
     }
 
     fn drop_executors(address_map: &[SocketAddrV4]) {
@@ -489,6 +729,11 @@ impl Context {
             return;
         }
 
+        // A daemon only ends the job.
+        let signal = match env::Configuration::get().executor_daemon {
+            true => Signal::EndJob,
+            false => Signal::ShutDownGracefully,
+        };
         for socket_addr in address_map {
             log::debug!(
                 "dropping executor in {:?}:{:?}",
@@ -498,13 +743,7 @@ impl Context {
             if let Ok(mut stream) =
                 TcpStream::connect(format!("{}:{}", socket_addr.ip(), socket_addr.port() + 10))
             {
-                let signal = bincode::serialize(&Signal::ShutDownGracefully).unwrap();
-                let mut message = capnp::message::Builder::new_default();
-                let mut task_data = message.init_root::<serialized_data::Builder>();
-                task_data.set_msg(&signal);
-                capnp::serialize::write_message(&mut stream, &message)
-                    .map_err(Error::OutputWrite)
-                    .unwrap();
+                Context::send_signal(&mut stream, &signal).unwrap();
             } else {
                 error!(
                     "Failed to connect to {}:{} in order to stop its executor",
@@ -529,29 +768,58 @@ impl Context {
 
     pub fn new_op_id(self: &Arc<Self>, loc: &'static Location<'static>) -> OpId {
         use Ordering::SeqCst;
-        let file = loc.file();
-        let line = loc.line();
-
-        let num = if *self.last_loc_file.read().unwrap() != file
-            || self.last_loc_line.load(SeqCst) != line
-        {
-            *self.last_loc_file.write().unwrap() = file;
-            self.last_loc_line.store(line, SeqCst);
+        let loc_hash = OpId::loc_hash(loc.file(), loc.line());
+        let num = if self.last_loc.swap(loc_hash, SeqCst) != loc_hash {
             self.num.store(0, SeqCst);
             0
         } else {
             self.num.load(SeqCst)
         };
+        OpId::at(loc_hash, num)
+    }
 
-        let op_id = OpId::new(file, line, num);
-        //println!("rdd, file = {:?}, line = {:?}, num = {:?}, op_id = {:?}", file, line, num, op_id);
-        op_id
+    /// Starts a loop, the rdds made before it that it reads are cached until `leave_loop`.
+    pub fn enter_loop(self: &Arc<Self>) {
+        let mut loop_scope = self.loop_scope.lock();
+        if let Some(scope) = &mut *loop_scope {
+            scope.release();
+        }
+        *loop_scope = Some(LoopScope {
+            first_rdd_id: self.next_rdd_id.load(Ordering::SeqCst),
+            end_rdd_id: None,
+            cached: Vec::new(),
+        });
+    }
+
+    pub fn leave_loop(self: &Arc<Self>) {
+        if let Some(scope) = &mut *self.loop_scope.lock() {
+            scope.end_rdd_id.get_or_insert(self.next_rdd_id.load(Ordering::SeqCst));
+            scope.release();
+        }
+    }
+
+    fn cache_loop_invariants(&self, rdd: Arc<dyn RddBase>) -> LoopInvariants<'_> {
+        if let Some(scope) = &mut *self.loop_scope.lock() {
+            scope.cache_invariants(rdd);
+        }
+        LoopInvariants { context: self }
     }
 
     pub fn new_shuffle_id(self: &Arc<Self>) -> usize {
         self.next_shuffle_id.fetch_add(1, Ordering::SeqCst)
     }
 
+    /// Makes `value` readable by the tasks through the returned handle, which is what closures
+    /// capture instead of the value. The value is shipped once per executor in its encrypted
+    /// form and decrypted once per enclave, see `BroadcastVar::value`.
+    pub fn broadcast<T: Data>(self: &Arc<Self>, value: &Text<T, ItemE>) -> BroadcastVar<T> {
+        let id = self.next_broadcast_id.fetch_add(1, Ordering::SeqCst);
+        env::Env::get()
+            .broadcast_tracker
+            .register(id, broadcast::encrypted_value(value));
+        BroadcastVar::new(id)
+    }
+
     #[track_caller]
     pub fn make_rdd<T: Data, I, IE>(
         self: &Arc<Self>,
@@ -619,6 +887,14 @@ impl Context {
         }
     }
 
+    /// Runs the jobs this thread submits from now on in scheduler pool `pool`, one of
+    /// VEGA_SCHEDULER_POOLS, or in the default pool of weight 1 with `None`. Jobs submitted from
+    /// several threads at once share the executors by the weights of their pools, see
+    /// `scheduler::fair_pool`.
+    pub fn set_scheduler_pool(self: &Arc<Self>, pool: Option<&str>) {
+        fair_pool::set_pool(pool.map(|pool| pool.to_owned()));
+    }
+
     pub fn run_job<T: Data, U: Data, F>(
         self: &Arc<Self>,
         rdd: Arc<dyn Rdd<Item = T>>,
@@ -630,6 +906,7 @@ impl Context {
     {
         let cl = Fn!(move |(_task_context, (iter_p, iter_e))| (func)((iter_p, iter_e)));
         let func = Arc::new(cl);
+        let _loop_invariants = self.cache_loop_invariants(rdd.get_rdd_base());
         self.scheduler.run_job(
             func,
             rdd.clone(),
@@ -651,6 +928,7 @@ impl Context {
         P: IntoIterator<Item = usize>,
     {
         let cl = Fn!(move |(_task_context, iter)| (func)(iter));
+        let _loop_invariants = self.cache_loop_invariants(rdd.get_rdd_base());
         self.scheduler.run_job(
             Arc::new(cl),
             rdd,
@@ -676,6 +954,7 @@ impl Context {
     {
         log::debug!("inside run job in context");
         let func = Arc::new(func);
+        let _loop_invariants = self.cache_loop_invariants(rdd.get_rdd_base());
         self.scheduler.run_job(
             func,
             rdd.clone(),
@@ -685,6 +964,30 @@ impl Context {
         )
     }
 
+    /// Run a job over all partitions that ends as soon as `listener` is done, with the results
+    /// of the partitions before the first one still running.
+    pub(crate) fn run_job_with_listener<T: Data, U: Data, F, L>(
+        self: &Arc<Self>,
+        rdd: Arc<dyn Rdd<Item = T>>,
+        action_id: Option<OpId>,
+        func: F,
+        listener: L,
+    ) -> Result<Vec<U>>
+    where
+        F: SerFunc((Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>)) -> U,
+        L: JobListener + 'static,
+    {
+        let cl = Fn!(move |(_task_context, iter)| (func)(iter));
+        let _loop_invariants = self.cache_loop_invariants(rdd.get_rdd_base());
+        self.scheduler.run_job_with_listener(
+            Arc::new(cl),
+            rdd.clone(),
+            action_id,
+            (0..rdd.number_of_splits()).collect(),
+            listener,
+        )
+    }
+
     /// Run a job that can return approximate results. Returns a partial result
     /// (how partial depends on whether the job was finished before or after timeout).
     /// TODO need revision
@@ -706,6 +1009,7 @@ impl Context {
         E: ApproximateEvaluator<U, R> + Send + Sync + 'static,
         R: Clone + Debug + Send + Sync + 'static,
     {
+        let _loop_invariants = self.cache_loop_invariants(rdd.get_rdd_base());
         self.scheduler
             .run_approximate_job(Arc::new(func), rdd, action_id, evaluator, timeout)
     }
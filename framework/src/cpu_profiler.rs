@@ -0,0 +1,261 @@
+//! Host side of the CPU profiler of the code running inside the enclave.
+//!
+//! A SIGPROF handler runs outside the enclave and only sees where the thread left it, so the
+//! profiler of gperftools cannot be used. With VEGA_CPU_PROFILE set, a timer thread instead sends
+//! SIGPROF, with a handler that does nothing, to every thread of the process `cpu_profile_hz`
+//! times a second. A thread inside the enclave takes an AEX for it and the AEX-Notify handler of
+//! the enclave records the interrupted stack into a ring buffer of its TCS before the thread
+//! resumes, see enclave/gperftools/cpu-profiler-sgx.h. Threads outside take the signal and go on.
+//! The other AEXes of a sampled thread, host interrupts and EPC page faults, are recorded too, so
+//! paging shows up under the code that faulted.
+//!
+//! Once a second the timer thread drains the rings of every enclave into the samples here. At
+//! exit they are written in the legacy gperftools CPU profile format to `<prefix>.<pid>.prof`,
+//! with frames relative to the enclave base and the enclave image mapped at 0, so
+//! `pprof --text <enclave.so> <profile>` symbolizes them. As in the heap profile, the outermost
+//! frame of a sample is the OpId hash of the stage its thread ran.
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use crate::env::{Configuration, Env};
+use once_cell::sync::Lazy;
+use sgx_types::*;
+
+extern "C" {
+    fn drain_cpu_profile(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        buf: *mut u8,
+        cap: usize,
+    ) -> sgx_status_t;
+}
+
+pub(crate) const DEFAULT_CPU_PROFILE_HZ: u32 = 100;
+
+/// kCpuProfileMaxDepth of cpu-profiler-sgx.h.
+const MAX_DEPTH: usize = 32;
+const DRAIN_BYTES: usize = 1 << 20;
+
+#[derive(Default)]
+struct Profile {
+    /// stack (tag last) -> samples
+    samples: HashMap<Vec<u64>, u64>,
+    /// Samples each enclave dropped because a ring was full.
+    dropped: Vec<u64>,
+}
+
+static PROFILE: Lazy<Mutex<Profile>> = Lazy::new(|| Mutex::new(Profile::default()));
+static STOP: AtomicBool = AtomicBool::new(false);
+static TIMER: Lazy<Mutex<Option<JoinHandle<()>>>> = Lazy::new(|| Mutex::new(None));
+
+extern "C" fn on_sigprof(_: libc::c_int) {}
+
+/// Starts interrupting the threads of the process if VEGA_CPU_PROFILE is set. The enclaves must
+/// have been created with profiling on, and the timer thread holds a TCS of each while it drains.
+pub(crate) fn start_if_enabled() {
+    let conf = Configuration::get();
+    if conf.cpu_profile.is_none() {
+        return;
+    }
+    let mut timer = TIMER.lock().unwrap();
+    if timer.is_some() {
+        return;
+    }
+    unsafe {
+        let mut action: libc::sigaction = std::mem::zeroed();
+        action.sa_sigaction = on_sigprof as usize;
+        action.sa_flags = libc::SA_RESTART;
+        libc::sigaction(libc::SIGPROF, &action, std::ptr::null_mut());
+    }
+    let hz = conf.cpu_profile_hz;
+    log::info!("sampling the enclave threads {} times a second", hz);
+    *timer = Some(thread::spawn(move || interrupt(hz)));
+}
+
+fn threads() -> Vec<libc::pid_t> {
+    std::fs::read_dir("/proc/self/task")
+        .map(|tasks| {
+            tasks
+                .filter_map(|task| task.ok()?.file_name().to_str()?.parse().ok())
+                .collect()
+        })
+        .unwrap_or_default()
+}
+
+fn interrupt(hz: u32) {
+    let period = Duration::from_secs(1) / hz;
+    let pid = std::process::id() as libc::pid_t;
+    let me = unsafe { libc::syscall(libc::SYS_gettid) } as libc::pid_t;
+    let mut tids = vec![];
+    let mut last_drain = Instant::now();
+    let mut ticks = 0u64;
+    while !STOP.load(Ordering::Acquire) {
+        // Threads come and go with the tasks, so list them again every second.
+        if ticks % hz as u64 == 0 {
+            tids = threads();
+            tids.retain(|&tid| tid != me);
+        }
+        for &tid in &tids {
+            unsafe { libc::syscall(libc::SYS_tgkill, pid, tid, libc::SIGPROF) };
+        }
+        ticks += 1;
+        if last_drain.elapsed() >= Duration::from_secs(1) {
+            drain();
+            last_drain = Instant::now();
+        }
+        thread::sleep(period);
+    }
+}
+
+fn to_words(bytes: &[u8]) -> Vec<u64> {
+    bytes
+        .chunks_exact(8)
+        .map(|word| u64::from_ne_bytes(word.try_into().unwrap()))
+        .collect()
+}
+
+/// Adds the samples of a drain, the dropped count first and then [depth, frames..] each.
+fn add_samples(profile: &mut Profile, enclave: usize, words: &[u64]) {
+    if words.is_empty() {
+        return;
+    }
+    if profile.dropped.len() <= enclave {
+        profile.dropped.resize(enclave + 1, 0);
+    }
+    profile.dropped[enclave] = words[0];
+    let mut rest = &words[1..];
+    while let Some((&depth, tail)) = rest.split_first() {
+        let depth = std::cmp::min(depth as usize, tail.len());
+        if depth > 0 {
+            *profile.samples.entry(tail[..depth].to_vec()).or_insert(0) += 1;
+        }
+        rest = &tail[depth..];
+    }
+}
+
+fn drain() {
+    let mut buf = vec![0u8; DRAIN_BYTES];
+    let mut idx = 0;
+    Env::for_each_enclave(|| {
+        // A drain that fills the buffer may have left samples behind.
+        loop {
+            let enclave = Env::enter();
+            let mut written = 0;
+            let sgx_status = unsafe {
+                drain_cpu_profile(enclave.eid(), &mut written, buf.as_mut_ptr(), buf.len())
+            };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                log::warn!("draining the cpu profile failed: {:?}", sgx_status);
+                break;
+            }
+            let words = to_words(&buf[..written.min(buf.len())]);
+            add_samples(&mut PROFILE.lock().unwrap(), idx, &words);
+            if written + (MAX_DEPTH + 1) * 8 <= buf.len() {
+                break;
+            }
+        }
+        idx += 1;
+    });
+}
+
+/// Samples per operator, most first.
+fn samples_by_op(profile: &Profile) -> Vec<(u64, u64)> {
+    let mut by_op: HashMap<u64, u64> = HashMap::new();
+    for (stack, count) in profile.samples.iter() {
+        *by_op.entry(*stack.last().unwrap()).or_insert(0) += count;
+    }
+    let mut by_op = by_op.into_iter().collect::<Vec<_>>();
+    by_op.sort_by(|a, b| b.1.cmp(&a.1));
+    by_op
+}
+
+/// Stops the profiler and writes the profile to `<prefix>.<pid>.prof` if VEGA_CPU_PROFILE is
+/// set. Must be called before the enclave is destroyed.
+pub(crate) fn dump_if_enabled() {
+    let conf = Configuration::get();
+    let prefix = match &conf.cpu_profile {
+        Some(prefix) => prefix,
+        None => return,
+    };
+    STOP.store(true, Ordering::Release);
+    if let Some(timer) = TIMER.lock().unwrap().take() {
+        let _ = timer.join();
+    }
+    drain();
+    let profile = PROFILE.lock().unwrap();
+    for (tag, count) in samples_by_op(&profile).into_iter().take(10) {
+        log::info!("cpu profile: op {} sampled {} times", tag, count);
+    }
+    let dropped = profile.dropped.iter().sum::<u64>();
+    if dropped > 0 {
+        log::warn!("cpu profile: {} samples dropped, the rings filled between drains", dropped);
+    }
+    let path = PathBuf::from(format!("{}.{}.prof", prefix.display(), std::process::id()));
+    let period_us = 1_000_000 / conf.cpu_profile_hz as u64;
+    match write_profile(&path, &profile, period_us, &Env::get().enclave_path) {
+        Ok(()) => log::info!("cpu profile written to {:?}", path),
+        Err(err) => log::error!("failed writing cpu profile to {:?}: {}", path, err),
+    }
+}
+
+/// The binary part of a legacy CPU profile: the header, a record per stack and the trailer.
+fn encode(profile: &Profile, period_us: u64) -> Vec<u64> {
+    let mut words = vec![0, 3, 0, period_us, 0];
+    for (stack, count) in profile.samples.iter() {
+        words.push(*count);
+        words.push(stack.len() as u64);
+        words.extend_from_slice(stack);
+    }
+    words.extend_from_slice(&[0, 1, 0]);
+    words
+}
+
+fn write_profile(
+    path: &Path,
+    profile: &Profile,
+    period_us: u64,
+    enclave_path: &Path,
+) -> std::io::Result<()> {
+    let mut out = BufWriter::new(File::create(path)?);
+    for word in encode(profile, period_us) {
+        out.write_all(&word.to_ne_bytes())?;
+    }
+    // frames are relative to the enclave base, so map the image at 0
+    let image_size = std::fs::metadata(enclave_path).map(|m| m.len()).unwrap_or(0);
+    writeln!(
+        out,
+        "00000000-{:08x} r-xp 00000000 00:00 0 {}",
+        image_size,
+        enclave_path.display()
+    )?;
+    out.flush()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn aggregates_drained_samples() {
+        let mut profile = Profile::default();
+        // 2 dropped, then two samples of the same stack and a truncated one.
+        add_samples(&mut profile, 1, &[2, 3, 0x10, 0x20, 7, 3, 0x10, 0x20, 7, 5, 0x30]);
+        assert_eq!(profile.dropped, vec![0, 2]);
+        assert_eq!(profile.samples[&vec![0x10, 0x20, 7]], 2);
+        assert_eq!(profile.samples[&vec![0x30]], 1);
+        assert_eq!(samples_by_op(&profile)[0], (7, 2));
+
+        let words = encode(&profile, 10_000);
+        assert_eq!(&words[..5], &[0, 3, 0, 10_000, 0]);
+        assert_eq!(&words[words.len() - 3..], &[0, 1, 0]);
+        assert_eq!(words.len(), 5 + (2 + 3) + (2 + 1) + 3);
+    }
+}
@@ -0,0 +1,396 @@
+//! Synthetic inputs for the benchmarks, written as the files `LocalFsReaderConfig` reads.
+//!
+//! A dataset is cut into `files` part files, which `LocalFsReaderConfig` spreads over the
+//! executors. A secure file is an `EncFile` of blocks cut and encrypted as `batch_encrypt` does,
+//! with the key the enclave holds. A plain file is the bincode `Vec` of the items. Either is read
+//! with the deserializer the benchmarks already use.
+//!
+//! Every part file draws from a generator of its own, seeded by the seed and its index. A part is
+//! the same however many threads write it and on whichever node, so a dataset for 64 nodes can
+//! be written by the nodes themselves, each writing its share with `node` and `nodes`.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use crate::error::{Error, Result};
+use crate::io::{EncFileWriter, MinMax};
+use crate::rdd::{enc_block_chunks, ser_encrypt_counted};
+use crate::serializable_traits::Data;
+use rand::Rng;
+use rand_distr::{Distribution, Normal};
+use rand_pcg::Pcg64;
+
+/// What to generate.
+#[derive(Clone, Debug)]
+pub enum Dataset {
+    /// Edges `(u32, u32)` of a graph of `2^scale` vertices drawn by R-MAT: each edge descends
+    /// into one of the four quadrants of the adjacency matrix with probability `a`, `b`, `c` and
+    /// `1 - a - b - c`, once per bit of a vertex. 0.25 each is uniform, a larger `a` skews the
+    /// degrees, Graph500 uses 0.57, 0.19, 0.19. As `"src dst"` lines, as pagerank reads them,
+    /// with `lines`.
+    Rmat {
+        scale: u32,
+        edges: u64,
+        a: f64,
+        b: f64,
+        c: f64,
+        lines: bool,
+    },
+    /// `"x0 x1 ..."` lines of points of `dim` dimensions around `clusters` centers, as kmeans
+    /// reads them. A point is drawn around a center with probability falling as `1 / k^skew` for
+    /// the `k`th one, so 0 sizes the clusters evenly.
+    Points {
+        points: u64,
+        dim: usize,
+        clusters: usize,
+        stddev: f64,
+        skew: f64,
+    },
+    /// The entries `((row, col), value)` of a dense `rows` by `cols` matrix, as mm reads them,
+    /// the rows split evenly among the files.
+    Matrix { rows: u32, cols: u32 },
+    /// Lines of `words` words each, drawn from a vocabulary of `vocabulary` words by Zipf's law
+    /// with exponent `skew`.
+    Text {
+        lines: u64,
+        words: usize,
+        vocabulary: usize,
+        skew: f64,
+    },
+}
+
+#[derive(Clone, Debug)]
+pub struct GenConfig {
+    pub dataset: Dataset,
+    pub dir: PathBuf,
+    pub files: usize,
+    pub encrypted: bool,
+    pub seed: u64,
+    pub threads: usize,
+    /// Only the files `i` with `i % nodes == node` are written.
+    pub node: usize,
+    pub nodes: usize,
+}
+
+impl GenConfig {
+    pub fn new(dataset: Dataset, dir: impl Into<PathBuf>) -> Self {
+        GenConfig {
+            dataset,
+            dir: dir.into(),
+            files: 1,
+            encrypted: true,
+            seed: 0,
+            threads: num_cpus::get(),
+            node: 0,
+            nodes: 1,
+        }
+    }
+}
+
+/// Draws an index in `0..n` with probability falling as `1 / (i + 1)^s`.
+struct Zipf {
+    cdf: Vec<f64>,
+}
+
+impl Zipf {
+    fn new(n: usize, s: f64) -> Self {
+        let mut sum = 0.0;
+        let mut cdf = (1..=n.max(1))
+            .map(|k| {
+                sum += 1.0 / (k as f64).powf(s);
+                sum
+            })
+            .collect::<Vec<_>>();
+        for p in cdf.iter_mut() {
+            *p /= sum;
+        }
+        Zipf { cdf }
+    }
+
+    fn sample<R: Rng>(&self, rng: &mut R) -> usize {
+        let u = rng.gen::<f64>();
+        match self.cdf.binary_search_by(|p| p.partial_cmp(&u).unwrap()) {
+            Ok(i) | Err(i) => i.min(self.cdf.len() - 1),
+        }
+    }
+}
+
+fn rmat_edge<R: Rng>(rng: &mut R, scale: u32, a: f64, b: f64, c: f64) -> (u32, u32) {
+    let (mut src, mut dst) = (0u32, 0u32);
+    for bit in (0..scale).rev() {
+        let u = rng.gen::<f64>();
+        let (s, d) = if u < a {
+            (0, 0)
+        } else if u < a + b {
+            (0, 1)
+        } else if u < a + b + c {
+            (1, 0)
+        } else {
+            (1, 1)
+        };
+        src |= s << bit;
+        dst |= d << bit;
+    }
+    (src, dst)
+}
+
+/// The first item and the number of items of part `file` of `total` items.
+fn part_range(total: u64, files: usize, file: usize) -> (u64, u64) {
+    let (files, file) = (files as u64, file as u64);
+    let (per_file, rest) = (total / files, total % files);
+    let start = file * per_file + file.min(rest);
+    (start, per_file + if file < rest { 1 } else { 0 })
+}
+
+/// The generator of part `file`, on a stream of its own.
+fn part_rng(seed: u64, file: usize) -> Pcg64 {
+    Pcg64::new(seed as u128, file as u128)
+}
+
+fn write_part<T, K, F>(path: &Path, items: &[T], encrypted: bool, key: Option<F>) -> Result<()>
+where
+    T: Data,
+    K: Data + PartialOrd + Clone,
+    F: Fn(&T) -> K,
+{
+    let tmp = path.with_extension("tmp");
+    let write = || -> std::io::Result<()> {
+        if encrypted {
+            let mut writer = EncFileWriter::create(&tmp)?;
+            match key {
+                // The blocks are never empty, so neither are their keys.
+                Some(key) => writer.push_items(items, |block: &[T]| {
+                    let keys = block.iter().map(&key).collect::<Vec<_>>();
+                    MinMax::of(keys.iter()).unwrap()
+                })?,
+                None => {
+                    for chunk in enc_block_chunks(items) {
+                        writer.push_block(&ser_encrypt_counted(chunk), None)?;
+                    }
+                }
+            }
+            writer.finish()?;
+        } else {
+            let bytes = bincode::serialize(items)
+                .map_err(|e| std::io::Error::new(std::io::ErrorKind::InvalidData, e))?;
+            fs::write(&tmp, bytes)?;
+        }
+        // A reader never sees a part half written.
+        fs::rename(&tmp, path)
+    };
+    write().map_err(|source| Error::OutputFile {
+        source,
+        path: path.to_path_buf(),
+    })
+}
+
+type NoKey<T> = fn(&T) -> u32;
+
+fn generate_part(config: &GenConfig, file: usize, path: &Path) -> Result<()> {
+    let mut rng = part_rng(config.seed, file);
+    let encrypted = config.encrypted;
+    match config.dataset {
+        Dataset::Rmat {
+            scale,
+            edges,
+            a,
+            b,
+            c,
+            lines,
+        } => {
+            let (_, len) = part_range(edges, config.files, file);
+            let scale = scale.min(32);
+            let edges = (0..len)
+                .map(|_| rmat_edge(&mut rng, scale, a, b, c))
+                .collect::<Vec<_>>();
+            if lines {
+                let lines = edges
+                    .into_iter()
+                    .map(|(src, dst)| format!("{} {}", src, dst))
+                    .collect::<Vec<_>>();
+                write_part(path, &lines, encrypted, None::<NoKey<String>>)
+            } else {
+                write_part(path, &edges, encrypted, Some(|e: &(u32, u32)| e.0))
+            }
+        }
+        Dataset::Points {
+            points,
+            dim,
+            clusters,
+            stddev,
+            skew,
+        } => {
+            // The centers are those of the whole dataset, not of the part.
+            let mut center_rng = part_rng(config.seed, usize::MAX);
+            let centers = (0..clusters.max(1))
+                .map(|_| {
+                    (0..dim)
+                        .map(|_| center_rng.gen_range(-100.0, 100.0))
+                        .collect::<Vec<f64>>()
+                })
+                .collect::<Vec<_>>();
+            let pick = Zipf::new(centers.len(), skew);
+            let noise = Normal::new(0.0, stddev.max(f64::MIN_POSITIVE)).unwrap();
+            let (_, len) = part_range(points, config.files, file);
+            let lines = (0..len)
+                .map(|_| {
+                    let center = &centers[pick.sample(&mut rng)];
+                    center
+                        .iter()
+                        .map(|x| (x + noise.sample(&mut rng)).to_string())
+                        .collect::<Vec<_>>()
+                        .join(" ")
+                })
+                .collect::<Vec<_>>();
+            write_part(path, &lines, encrypted, None::<NoKey<String>>)
+        }
+        Dataset::Matrix { rows, cols } => {
+            let (start, len) = part_range(rows as u64, config.files, file);
+            let mut entries = Vec::with_capacity(len as usize * cols as usize);
+            for row in start..start + len {
+                for col in 0..cols {
+                    entries.push(((row as u32, col), rng.gen::<f64>()));
+                }
+            }
+            write_part(path, &entries, encrypted, Some(|e: &((u32, u32), f64)| (e.0).0))
+        }
+        Dataset::Text {
+            lines,
+            words,
+            vocabulary,
+            skew,
+        } => {
+            let pick = Zipf::new(vocabulary, skew);
+            let (_, len) = part_range(lines, config.files, file);
+            let lines = (0..len)
+                .map(|_| {
+                    (0..words)
+                        .map(|_| format!("w{}", pick.sample(&mut rng)))
+                        .collect::<Vec<_>>()
+                        .join(" ")
+                })
+                .collect::<Vec<_>>();
+            write_part(path, &lines, encrypted, None::<NoKey<String>>)
+        }
+    }
+}
+
+/// Writes the part files of this node into `config.dir`, on `config.threads` threads, and
+/// returns their paths.
+pub fn generate(config: &GenConfig) -> Result<Vec<PathBuf>> {
+    let files = config.files.max(1);
+    let nodes = config.nodes.max(1);
+    let config = Arc::new(GenConfig {
+        files,
+        nodes,
+        ..config.clone()
+    });
+    fs::create_dir_all(&config.dir).map_err(|source| Error::OutputFile {
+        source,
+        path: config.dir.clone(),
+    })?;
+    let parts = Arc::new(
+        (0..files)
+            .filter(|file| file % nodes == config.node % nodes)
+            .collect::<Vec<_>>(),
+    );
+    let next = Arc::new(AtomicUsize::new(0));
+    let written = Arc::new(Mutex::new(Vec::new()));
+    let workers = (0..config.threads.max(1).min(parts.len().max(1)))
+        .map(|_| {
+            let (config, parts, next, written) =
+                (config.clone(), parts.clone(), next.clone(), written.clone());
+            thread::spawn(move || -> Result<()> {
+                loop {
+                    let file = match parts.get(next.fetch_add(1, Ordering::Relaxed)) {
+                        Some(file) => *file,
+                        None => return Ok(()),
+                    };
+                    let path = config.dir.join(format!("part-{:05}", file));
+                    generate_part(&config, file, &path)?;
+                    written.lock().unwrap().push(path);
+                }
+            })
+        })
+        .collect::<Vec<_>>();
+    for worker in workers {
+        worker.join().unwrap()?;
+    }
+    let mut written = std::mem::take(&mut *written.lock().unwrap());
+    written.sort();
+    Ok(written)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = format!("vega-datagen-{}-{}", name, std::process::id());
+        let dir = std::env::temp_dir().join(dir);
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    #[test]
+    fn parts_cover_the_items() {
+        let parts = (0..3).map(|f| part_range(10, 3, f)).collect::<Vec<_>>();
+        assert_eq!(parts, vec![(0, 4), (4, 3), (7, 3)]);
+    }
+
+    #[test]
+    fn zipf_prefers_the_first() {
+        let zipf = Zipf::new(100, 1.5);
+        let mut rng = part_rng(1, 0);
+        let firsts = (0..1000).filter(|_| zipf.sample(&mut rng) == 0).count();
+        assert!(firsts > 300, "{}", firsts);
+        let uniform = Zipf::new(4, 0.0);
+        assert!((uniform.cdf[1] - 0.5).abs() < 1e-9);
+    }
+
+    #[test]
+    fn rmat_stays_in_the_graph() {
+        let mut rng = part_rng(0, 0);
+        for _ in 0..1000 {
+            let (src, dst) = rmat_edge(&mut rng, 10, 0.57, 0.19, 0.19);
+            assert!(src < 1024 && dst < 1024);
+        }
+    }
+
+    #[test]
+    fn parts_do_not_depend_on_threads() {
+        let read = |dir: &Path, threads: usize| {
+            let mut config = GenConfig::new(
+                Dataset::Rmat {
+                    scale: 8,
+                    edges: 1000,
+                    a: 0.57,
+                    b: 0.19,
+                    c: 0.19,
+                    lines: false,
+                },
+                dir,
+            );
+            config.files = 4;
+            config.encrypted = false;
+            config.seed = 7;
+            config.threads = threads;
+            generate(&config)
+                .unwrap()
+                .iter()
+                .map(|p| bincode::deserialize::<Vec<(u32, u32)>>(&fs::read(p).unwrap()).unwrap())
+                .collect::<Vec<_>>()
+        };
+        let (one, many) = (temp_dir("one"), temp_dir("many"));
+        let a = read(&one, 1);
+        let b = read(&many, 4);
+        assert_eq!(a.len(), 4);
+        assert_eq!(a.iter().map(|p| p.len()).sum::<usize>(), 1000);
+        assert_eq!(a, b);
+        let _ = fs::remove_dir_all(&one);
+        let _ = fs::remove_dir_all(&many);
+    }
+}
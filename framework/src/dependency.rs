@@ -1,11 +1,14 @@
 use crate::aggregator::Aggregator;
 use crate::env;
-use crate::partitioner::Partitioner;
+use crate::map_output_tracker::MapStatus;
+use crate::partitioner::{HashPartitioner, Partitioner, TypedPartitioner};
 use crate::rdd::{
-    default_hash, free_res_enc, get_encrypted_data, AccArg, ItemE, OpId, RddBase, MAX_THREAD,
-    STAGE_LOCK,
+    default_hash, flush_node_combine, free_res_enc, get_encrypted_data, max_thread, AccArg,
+    EnterLock, ItemE, OpId, RddBase, STAGE_LOCK,
 };
 use crate::serializable_traits::Data;
+use crate::shuffle::{encode_buckets, ShufflePusher};
+use crate::transitions::{self, Site};
 use dashmap::mapref::one::RefMut;
 use dashmap::DashMap;
 use serde_derive::{Deserialize, Serialize};
@@ -19,9 +22,12 @@ use std::convert::TryInto;
 use std::hash::Hash;
 use std::marker::PhantomData;
 use std::mem::forget;
-use std::sync::{atomic, mpsc, Arc};
+use std::sync::{mpsc, Arc};
 use std::time::{Duration, Instant};
 
+/// Map outputs of fewer bytes are encoded on the thread of the map task.
+const PAR_ENCODE_BYTES: usize = 8 << 20;
+
 #[repr(C)]
 #[derive(Clone, Copy, Debug, Serialize, Deserialize)]
 pub struct DepInfo {
@@ -148,12 +154,52 @@ impl NarrowDependencyTrait for RangeDependency {
     }
 }
 
+/// Represents the dependency of a cartesian product on one of its parents. Partition `id` of the
+/// product pairs partition `id / num_partitions_in_rdd2` of the first parent with partition
+/// `id % num_partitions_in_rdd2` of the second.
+#[derive(Serialize, Deserialize, Clone)]
+pub(crate) struct CartesianDependency {
+    #[serde(with = "serde_traitobject")]
+    rdd_base: Arc<dyn RddBase>,
+    num_partitions_in_rdd2: usize,
+    is_first: bool,
+}
+
+impl CartesianDependency {
+    pub fn new(rdd_base: Arc<dyn RddBase>, num_partitions_in_rdd2: usize, is_first: bool) -> Self {
+        CartesianDependency {
+            rdd_base,
+            num_partitions_in_rdd2,
+            is_first,
+        }
+    }
+}
+
+impl NarrowDependencyTrait for CartesianDependency {
+    fn get_parents(&self, partition_id: usize) -> Vec<usize> {
+        if self.is_first {
+            vec![partition_id / self.num_partitions_in_rdd2]
+        } else {
+            vec![partition_id % self.num_partitions_in_rdd2]
+        }
+    }
+
+    fn get_rdd_base(&self) -> Arc<dyn RddBase> {
+        self.rdd_base.clone()
+    }
+}
+
 pub trait ShuffleDependencyTrait: Serialize + Deserialize + Send + Sync {
     fn get_dep_info(&self) -> DepInfo;
     fn get_shuffle_id(&self) -> usize;
     fn get_rdd_base(&self) -> Arc<dyn RddBase>;
     fn is_shuffle(&self) -> bool;
-    fn do_shuffle_task(&self, rdd_base: Arc<dyn RddBase>, partition: usize) -> String;
+    fn do_shuffle_task(
+        &self,
+        rdd_base: Arc<dyn RddBase>,
+        partition: usize,
+        task_id: usize,
+    ) -> MapStatus;
 }
 
 impl PartialOrd for dyn ShuffleDependencyTrait {
@@ -231,6 +277,73 @@ where
             child_op_id,
         }
     }
+
+    /// The sets the map tasks of this dependency left in every enclave of the executor, see
+    /// `Configuration::node_combine`.
+    fn flush_node_combine(&self, op_id: OpId, dep_info: DepInfo) -> Vec<Vec<Vec<ItemE>>> {
+        let mut sets = Vec::new();
+        env::Env::for_each_enclave(|| {
+            let mut res_ptr: usize = 0;
+            let enclave = env::Env::enter();
+            let timed = transitions::time(Site::FlushNodeCombine);
+            let sgx_status =
+                unsafe { flush_node_combine(enclave.eid(), &mut res_ptr, op_id, dep_info) };
+            drop(timed);
+            match sgx_status {
+                sgx_status_t::SGX_SUCCESS => {}
+                _ => {
+                    panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+                }
+            }
+            drop(enclave);
+            if res_ptr != 0 {
+                sets.extend(*get_encrypted_data::<Vec<Vec<ItemE>>>(
+                    op_id,
+                    dep_info,
+                    res_ptr as *mut u8,
+                ));
+            }
+        });
+        sets
+    }
+
+    /// Waits for the pushes of map task `partition` and closes its output at every merger. A
+    /// reducer whose part failed to go out is not closed, so it pulls from this map task.
+    fn finish_pushes(
+        &self,
+        partition: usize,
+        pushes: Vec<(usize, tokio::task::JoinHandle<crate::shuffle::Result<()>>)>,
+        num_parts: Vec<usize>,
+    ) {
+        let mut pushed = vec![true; num_parts.len()];
+        for (i, push) in pushes {
+            if !matches!(futures::executor::block_on(push), Ok(Ok(()))) {
+                pushed[i] = false;
+            }
+        }
+        let finishes = num_parts
+            .into_iter()
+            .enumerate()
+            .filter(|(i, _)| pushed[*i])
+            .map(|(i, num_parts)| {
+                let finish = ShufflePusher::finish(self.shuffle_id, partition, i, num_parts);
+                env::Env::run_in_async_rt(|| tokio::spawn(finish))
+            })
+            .collect::<Vec<_>>();
+        let failed = futures::executor::block_on(futures::future::join_all(finishes))
+            .into_iter()
+            .filter(|res| !matches!(res, Ok(Ok(()))))
+            .count()
+            + pushed.iter().filter(|pushed| !**pushed).count();
+        if failed > 0 {
+            log::warn!(
+                "shuffle #{} map task #{} not merged for {} reducers",
+                self.shuffle_id,
+                partition,
+                failed
+            );
+        }
+    }
 }
 
 impl<K, V, C> ShuffleDependencyTrait for ShuffleDependency<K, V, C>
@@ -262,7 +375,12 @@ where
         self.rdd_base.clone()
     }
 
-    fn do_shuffle_task(&self, rdd_base: Arc<dyn RddBase>, partition: usize) -> String {
+    fn do_shuffle_task(
+        &self,
+        rdd_base: Arc<dyn RddBase>,
+        partition: usize,
+        task_id: usize,
+    ) -> MapStatus {
         log::debug!(
             "executing shuffle task #{} for partition #{}",
             self.shuffle_id,
@@ -292,7 +410,7 @@ where
             let mut acc_arg = AccArg::new(
                 dep_info,
                 Some(self.partitioner.get_num_of_partitions()),
-                Arc::new(atomic::AtomicBool::new(false)),
+                Arc::new(EnterLock::new()),
             );
 
             let split = rdd_base.splits()[partition].clone();
@@ -300,9 +418,12 @@ where
             let handles = rdd_base.iterator_raw(split, &mut acc_arg, tx).unwrap();
 
             let num_output_splits = self.partitioner.get_num_of_partitions();
-            let mut buckets: Vec<Vec<Vec<ItemE>>> = (0..num_output_splits * (MAX_THREAD + 1))
+            let mut buckets: Vec<Vec<Vec<ItemE>>> = (0..num_output_splits * (max_thread() + 1))
                 .map(|_| Vec::new())
                 .collect::<Vec<_>>();
+            let push = ShufflePusher::merger_of(0).is_some();
+            let mut pushes = Vec::new();
+            let mut num_parts = vec![0; num_output_splits];
             for block_ptr in rx {
                 let buckets_bls = get_encrypted_data::<Vec<Vec<ItemE>>>(
                     rdd_base.get_op_id(),
@@ -311,25 +432,67 @@ where
                 );
                 acc_arg.free_enclave_lock();
 
+                let mut sub_part: Vec<Vec<Vec<ItemE>>> =
+                    (0..buckets.len()).map(|_| Vec::new()).collect();
                 for buckets_bl in buckets_bls.into_iter() {
                     for (i, bucket) in buckets_bl.into_iter().enumerate() {
-                        buckets[i].push(bucket);
+                        sub_part[i].push(bucket);
                     }
                 }
+                // The runs of a sub-part go out to the mergers while the other sub-parts are
+                // still being computed.
+                if push {
+                    for (i, local_buckets) in sub_part.chunks_exact(max_thread() + 1).enumerate() {
+                        if local_buckets.iter().all(|bucket| bucket.is_empty()) {
+                            continue;
+                        }
+                        let data = encode_buckets(local_buckets);
+                        let push =
+                            ShufflePusher::push(self.shuffle_id, partition, i, num_parts[i], data);
+                        pushes.push((i, env::Env::run_in_async_rt(|| tokio::spawn(push))));
+                        num_parts[i] += 1;
+                    }
+                }
+                for (bucket, mut runs) in buckets.iter_mut().zip(sub_part) {
+                    bucket.append(&mut runs);
+                }
             }
             for handle in handles {
                 handle.join().unwrap();
             }
+            if push {
+                self.finish_pushes(partition, pushes, num_parts);
+            }
+            // The last map task of the stage on this executor adds the combiners the others left
+            // in the enclaves to its own output.
+            let rdd_id_pair = (
+                dep_info.child_rdd_id,
+                dep_info.parent_rdd_id,
+                dep_info.identifier,
+            );
+            if env::Configuration::get().node_combine
+                && STAGE_LOCK.leave_stage(rdd_id_pair, task_id)
+            {
+                for set in self.flush_node_combine(rdd_base.get_op_id(), dep_info) {
+                    for (bucket, run) in buckets.iter_mut().zip(set) {
+                        bucket.push(run);
+                    }
+                }
+            }
             let dur = now.elapsed().as_nanos() as f64 * 1e-9;
             log::info!("in dependency, shuffle write {:?}", dur);
             STAGE_LOCK.free_stage_lock();
 
-            for (i, local_buckets) in buckets.chunks_exact(MAX_THREAD + 1).into_iter().enumerate() {
-                let ser_bytes = bincode::serialize(local_buckets).unwrap();
-                env::SHUFFLE_CACHE.insert((self.shuffle_id, partition, i), ser_bytes);
-            }
+            let outputs = encode_outputs(&buckets);
+            let sizes = MapStatus::sizes_of(&outputs);
+            env::SHUFFLE_STORE
+                .put_map_output(self.shuffle_id, partition, outputs)
+                .unwrap();
 
-            env::Env::get().shuffle_manager.get_server_uri()
+            MapStatus {
+                server_uri: env::Env::get().shuffle_manager.get_server_uri(),
+                sizes,
+            }
         } else {
             let split = rdd_base.splits()[partition].clone();
             log::debug!("split index: {}", split.get_index());
@@ -345,42 +508,35 @@ where
             let num_output_splits = self.partitioner.get_num_of_partitions();
             log::debug!("is cogroup rdd: {}", self.is_cogroup);
             log::debug!("number of output splits: {}", num_output_splits);
-            let partitioner = self.partitioner.clone();
-            let mut buckets: Vec<HashMap<K, C>> = (0..num_output_splits)
-                .map(|_| HashMap::new())
-                .collect::<Vec<_>>();
             log::debug!(
                 "before iterating while executing shuffle map task for partition #{}",
                 partition
             );
-
-            for (count, i) in iter
+            let data = iter
                 .unwrap()
                 .into_any()
                 .downcast::<Vec<(K, V)>>()
-                .unwrap()
-                .into_iter()
-                .enumerate()
+                .unwrap();
+            if let Some((k, v)) = data.first() {
+                log::debug!(
+                    "iterating inside dependency map task after downcasting: key: {:?}, value: {:?}",
+                    k,
+                    v
+                );
+            }
+            // The hash partitioner, which nearly every shuffle uses, is resolved once here
+            // instead of once per record.
+            let buckets = match (*self.partitioner)
+                .as_any()
+                .downcast_ref::<HashPartitioner<K>>()
             {
-                let (k, v) = i;
-                if count == 0 {
-                    log::debug!(
-                        "iterating inside dependency map task after downcasting: key: {:?}, value: {:?}",
-                        k,
-                        v
-                    );
-                }
-                let bucket_id = partitioner.get_partition(&k);
-                let bucket = &mut buckets[bucket_id];
-                if let Some(old_v) = bucket.get_mut(&k) {
-                    let input = ((old_v.clone(), v),);
-                    let output = aggregator.merge_value.call(input);
-                    *old_v = output;
-                } else {
-                    bucket.insert(k, aggregator.create_combiner.call((v,)));
+                Some(partitioner) => {
+                    combine_by_bucket(*data, &aggregator, partitioner, num_output_splits)
                 }
-            }
+                None => combine_by_bucket(*data, &aggregator, &*self.partitioner, num_output_splits),
+            };
 
+            let mut outputs = Vec::with_capacity(num_output_splits);
             for (i, bucket) in buckets.into_iter().enumerate() {
                 let set: Vec<(K, C)> = bucket.into_iter().collect();
                 let ser_bytes = bincode::serialize(&set).unwrap();
@@ -391,15 +547,22 @@ where
                     partition,
                     set.get(0)
                 );
-                env::SHUFFLE_CACHE.insert((self.shuffle_id, partition, i), ser_bytes);
+                outputs.push(ser_bytes);
             }
+            let sizes = MapStatus::sizes_of(&outputs);
+            env::SHUFFLE_STORE
+                .put_map_output(self.shuffle_id, partition, outputs)
+                .unwrap();
             log::debug!(
                 "returning shuffle address for shuffle task #{}",
                 self.shuffle_id
             );
             let dur = now.elapsed().as_nanos() as f64 * 1e-9;
             log::info!("in dependency, shuffle write {:?}", dur);
-            env::Env::get().shuffle_manager.get_server_uri()
+            MapStatus {
+                server_uri: env::Env::get().shuffle_manager.get_server_uri(),
+                sizes,
+            }
         }
     }
 }
@@ -438,19 +601,17 @@ impl SpecShuffleCache {
 
     //should be called in the end of program
     pub fn free_data_enc(&self) {
-        let eid = env::Env::get()
-            .enclave
-            .lock()
-            .unwrap()
-            .as_ref()
-            .unwrap()
-            .geteid();
         let dep_info = DepInfo::padding_new(0);
         for (key, (ps, op_id)) in (*self.inner).clone() {
             println!("free op_id {:?}", op_id);
+            let _bound = env::Env::bind_partition(key.1);
+            let enclave = env::Env::enter();
+            let eid = enclave.eid();
             for p_data_enc in ps {
+                let timed = transitions::time(Site::FreeResEnc);
                 let sgx_status =
                     unsafe { free_res_enc(eid, op_id, dep_info, p_data_enc as *mut u8) };
+                drop(timed);
                 match sgx_status {
                     sgx_status_t::SGX_SUCCESS => {}
                     _ => {
@@ -461,3 +622,67 @@ impl SpecShuffleCache {
         }
     }
 }
+
+/// Encodes the sub-buckets of every reducer into its map output. Past PAR_ENCODE_BYTES the
+/// reducers are split across threads, so a shuffle to many reducers does not end each map task
+/// with a long single threaded copy.
+fn encode_outputs(buckets: &[Vec<Vec<ItemE>>]) -> Vec<Vec<u8>> {
+    let reducers = buckets.chunks_exact(max_thread() + 1).collect::<Vec<_>>();
+    let bytes = buckets
+        .iter()
+        .flatten()
+        .flatten()
+        .map(|block| block.len())
+        .sum::<usize>();
+    let num_threads = std::cmp::min(num_cpus::get(), reducers.len());
+    if bytes < PAR_ENCODE_BYTES || num_threads <= 1 {
+        return reducers.into_iter().map(encode_buckets).collect();
+    }
+    let per_thread = (reducers.len() + num_threads - 1) / num_threads;
+    crossbeam::scope(|scope| {
+        let handles = reducers
+            .chunks(per_thread)
+            .map(|chunk| {
+                scope.spawn(move |_| {
+                    chunk
+                        .iter()
+                        .map(|local| encode_buckets(local))
+                        .collect::<Vec<_>>()
+                })
+            })
+            .collect::<Vec<_>>();
+        handles
+            .into_iter()
+            .flat_map(|handle| handle.join().unwrap())
+            .collect::<Vec<Vec<u8>>>()
+    })
+    .unwrap()
+}
+
+fn combine_by_bucket<K, V, C, P>(
+    data: Vec<(K, V)>,
+    aggregator: &Aggregator<K, V, C>,
+    partitioner: &P,
+    num_output_splits: usize,
+) -> Vec<HashMap<K, C>>
+where
+    K: Data + Eq + Hash,
+    V: Data,
+    C: Data,
+    P: TypedPartitioner<K> + ?Sized,
+{
+    let mut buckets: Vec<HashMap<K, C>> = (0..num_output_splits)
+        .map(|_| HashMap::new())
+        .collect::<Vec<_>>();
+    for (k, v) in data {
+        let bucket = &mut buckets[partitioner.partition_of(&k)];
+        if let Some(old_v) = bucket.get_mut(&k) {
+            let input = ((old_v.clone(), v),);
+            let output = aggregator.merge_value.call(input);
+            *old_v = output;
+        } else {
+            bucket.insert(k, aggregator.create_combiner.call((v,)));
+        }
+    }
+    buckets
+}
@@ -0,0 +1,217 @@
+//! Deployment of the executors of a distributed driver.
+//!
+//! The driver deploys up to VEGA_BOOTSTRAP_FANOUT executors at once, each with a few ssh and scp
+//! round trips. The executor binary and the signed enclave are kept in a binary cache on every
+//! host, under the hash of their content, and are only copied to hosts that do not have that
+//! build yet. The work dir of the session links to them. An executor counts as deployed once it
+//! answers a `Signal::Status`, i.e. its enclaves are up and its shuffle server runs, so the driver
+//! submits no job before all of them are.
+
+use std::collections::HashSet;
+use std::fs;
+use std::hash::{Hash, Hasher};
+use std::net::SocketAddrV4;
+use std::path::{Path, PathBuf};
+use std::process::{Command, Output};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::context::{Context, PRI_KEY_LOC};
+use crate::env;
+use crate::error::{Error, Result};
+use crate::executor::Signal;
+use crossbeam::channel::unbounded;
+use fasthash::MetroHasher;
+
+/// How long the enclaves of an executor may take to come up, with their heaps touched.
+const READY_TIMEOUT: Duration = Duration::from_secs(600);
+const READY_POLL: Duration = Duration::from_millis(200);
+
+/// Hash of the content of the file at `path`.
+pub(crate) fn file_hash(path: &Path) -> Result<u64> {
+    let mut hasher = MetroHasher::default();
+    fs::read(path).map_err(Error::InputRead)?.hash(&mut hasher);
+    Ok(hasher.finish())
+}
+
+/// A file every executor runs from.
+pub(crate) struct DeployedFile {
+    path: String,
+    name: String,
+    /// name in the binary cache of a host
+    cached: String,
+}
+
+impl DeployedFile {
+    pub fn new(path: &str, name: String) -> Result<Self> {
+        let hash = file_hash(Path::new(path))?;
+        Ok(DeployedFile {
+            path: path.to_owned(),
+            cached: format!("{:016x}-{}", hash, name),
+            name,
+        })
+    }
+}
+
+/// One executor to deploy.
+pub(crate) struct ExecutorDeployment {
+    /// user@ip of the host
+    pub address: String,
+    pub executor: SocketAddrV4,
+    /// `config` written for the executor on the driver
+    pub conf_path: PathBuf,
+    pub config: String,
+}
+
+pub(crate) struct Deployment {
+    pub work_dir: String,
+    pub cache_dir: String,
+    /// the executor binary first
+    pub files: Vec<DeployedFile>,
+}
+
+impl Deployment {
+    /// Deploys `executors` and waits until all of them are up.
+    pub fn run(&self, executors: &[ExecutorDeployment]) -> Result<()> {
+        let started = Instant::now();
+        let fanout = env::Configuration::get().bootstrap_fanout;
+        let (queue, pending) = unbounded();
+        for executor in executors {
+            queue.send(executor).unwrap();
+        }
+        drop(queue);
+        let pending = &pending;
+        crossbeam::scope(|scope| {
+            let workers = (0..fanout.min(executors.len()))
+                .map(|_| {
+                    scope.spawn(move |_| -> Result<()> {
+                        for executor in pending.iter() {
+                            self.deploy_executor(executor)?;
+                        }
+                        Ok(())
+                    })
+                })
+                .collect::<Vec<_>>();
+            workers
+                .into_iter()
+                .map(|worker| worker.join().unwrap())
+                .collect::<Result<()>>()
+        })
+        .unwrap()?;
+        log::info!(
+            "deployed {} executors in {:?}",
+            executors.len(),
+            started.elapsed()
+        );
+        Ok(())
+    }
+
+    fn deploy_executor(&self, deployment: &ExecutorDeployment) -> Result<()> {
+        let ExecutorDeployment {
+            address, executor, ..
+        } = deployment;
+        log::debug!("deploying executor at address {:?}", address);
+        if env::Configuration::get().executor_daemon
+            && Context::attach_executor(*executor, Context::fingerprint(&deployment.config)?)
+        {
+            log::info!("reusing the executor daemon at {}", executor);
+            return Ok(());
+        }
+
+        // Create work dir, and list the builds the host has:
+        let create = format!(
+            "mkdir -p {} {} && ls {}",
+            self.work_dir, self.cache_dir, self.cache_dir
+        );
+        let listing = Deployment::ssh(address, &create, "ssh mkdir")?;
+        let cached = String::from_utf8_lossy(&listing.stdout)
+            .lines()
+            .map(str::to_owned)
+            .collect::<HashSet<_>>();
+
+        log::debug!("copy conf file to remote");
+        let conf_path = deployment
+            .conf_path
+            .to_str()
+            .ok_or_else(|| Error::PathToString(deployment.conf_path.clone()))?;
+        let remote_path = format!("{}:{}/config.toml", address, self.work_dir);
+        Deployment::scp(conf_path, &remote_path, "scp config")?;
+
+        let mut launch = Vec::new();
+        for file in &self.files {
+            let cached_path = format!("{}/{}", self.cache_dir, file.cached);
+            if cached.contains(&file.cached) {
+                log::debug!("{} is on {} already", file.name, address);
+            } else {
+                log::debug!("copy {}", file.name);
+                // An interrupted copy is never taken for the file.
+                let part = format!("{}.part", cached_path);
+                let remote_path = format!("{}:{}", address, part);
+                Deployment::scp(&file.path, &remote_path, "scp executor")?;
+                launch.push(format!("mv -f {} {}", part, cached_path));
+            }
+            launch.push(format!(
+                "ln -f {} {}/{}",
+                cached_path, self.work_dir, file.name
+            ));
+            // Older builds, the executors still running them keep their links.
+            launch.push(format!(
+                "find {} -name '*-{}' ! -name '{}' -delete",
+                self.cache_dir, file.name, file.cached
+            ));
+        }
+
+        log::debug!("deploy a remote slave");
+        let path = format!("{}/{}", self.work_dir, self.files[0].name);
+        log::debug!("remote path {}", path);
+        // A daemon is detached from the session, which ends with this driver.
+        launch.push(match env::Configuration::get().executor_daemon {
+            true => format!("nohup {} > {}/ns-executor.out 2>&1 &", path, self.work_dir),
+            false => path,
+        });
+        Command::new("ssh")
+            .args(&["-i", PRI_KEY_LOC, address, &launch.join(" && ")])
+            .spawn()
+            .map_err(|e| Error::CommandOutput {
+                source: e,
+                command: "ssh run".into(),
+            })?;
+        Deployment::wait_ready(*executor)
+    }
+
+    fn wait_ready(executor: SocketAddrV4) -> Result<()> {
+        let started = Instant::now();
+        while started.elapsed() < READY_TIMEOUT {
+            if let Ok(true) = Context::ask_executor(executor, &Signal::Status) {
+                log::debug!(
+                    "executor at {} is up after {:?}",
+                    executor,
+                    started.elapsed()
+                );
+                return Ok(());
+            }
+            thread::sleep(READY_POLL);
+        }
+        Err(Error::ExecutorNotReady(executor))
+    }
+
+    fn ssh(address: &str, command: &str, what: &str) -> Result<Output> {
+        Command::new("ssh")
+            .args(&["-i", PRI_KEY_LOC, address, command])
+            .output()
+            .map_err(|e| Error::CommandOutput {
+                source: e,
+                command: what.into(),
+            })
+    }
+
+    fn scp(local_path: &str, remote_path: &str, what: &str) -> Result<Output> {
+        Command::new("scp")
+            .args(&["-i", PRI_KEY_LOC, local_path, remote_path])
+            .output()
+            .map_err(|e| Error::CommandOutput {
+                source: e,
+                command: what.into(),
+            })
+    }
+}
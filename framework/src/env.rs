@@ -1,21 +1,28 @@
+use std::cell::Cell;
 use std::collections::HashMap;
 use std::fs;
 use std::mem::forget;
 use std::net::Ipv4Addr;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use std::sync::{
     atomic::{AtomicUsize, Ordering},
     Arc, Mutex,
 };
 
-use crate::cache::BoundedMemoryCache;
+use crate::cache::{BoundedMemoryCache, DEFAULT_CACHE_MBYTES};
+use crate::broadcast_tracker::BroadcastTracker;
 use crate::cache_tracker::CacheTracker;
+use crate::cpu_profiler::DEFAULT_CPU_PROFILE_HZ;
 use crate::dependency::SpecShuffleCache;
+use crate::epc_pressure::DEFAULT_EPC_FAULTS_HIGH;
 use crate::error::Error;
+use crate::heap_profiler::DEFAULT_HEAP_PROFILE_PERIOD;
 use crate::hosts::Hosts;
 use crate::map_output_tracker::MapOutputTracker;
-use crate::rdd::RddBase;
-use crate::shuffle::{ShuffleFetcher, ShuffleManager};
+use crate::numa;
+use crate::provision;
+use crate::rdd::{self, RddBase, DEFAULT_ENC_BLOCK_BYTES, MAX_ENC_BL, MAX_STAGE_HOLDERS};
+use crate::shuffle::{ShuffleFetcher, ShuffleManager, ShuffleStore, TransportKind};
 use dashmap::DashMap;
 use log::LevelFilter;
 use once_cell::sync::{Lazy, OnceCell};
@@ -25,17 +32,127 @@ use tokio::runtime::{Handle, Runtime};
 use sgx_types::*;
 use sgx_urts::SgxEnclave;
 
-/// The key is: {shuffle_id}/{input_id}/{reduce_id}
-type ShuffleCache = Arc<DashMap<(usize, usize, usize), Vec<u8>>>;
+extern "C" {
+    fn set_cpu_count(eid: sgx_enclave_id_t, cpu_count: usize) -> sgx_status_t;
+    fn get_tc_stats(eid: sgx_enclave_id_t, stats: *mut TcStats) -> sgx_status_t;
+    fn get_heap_usage(eid: sgx_enclave_id_t, in_use: *mut u64, peak: *mut u64) -> sgx_status_t;
+    fn set_heap_profiler(eid: sgx_enclave_id_t, period: u64) -> sgx_status_t;
+    fn set_cpu_profiler(eid: sgx_enclave_id_t, retval: *mut i32, enabled: i32) -> sgx_status_t;
+    fn init_thread_pool(eid: sgx_enclave_id_t, num_workers: usize) -> sgx_status_t;
+    fn set_enc_block_bytes(eid: sgx_enclave_id_t, bytes: usize) -> sgx_status_t;
+    fn set_key_id(eid: sgx_enclave_id_t, key_id: u64) -> sgx_status_t;
+    fn set_cache_generation(eid: sgx_enclave_id_t, generation: *const u64) -> sgx_status_t;
+    fn start_scavenger(eid: sgx_enclave_id_t, interval_ms: u64) -> sgx_status_t;
+    fn set_numa_node(eid: sgx_enclave_id_t, node: i32) -> sgx_status_t;
+    fn set_oom_reserve(eid: sgx_enclave_id_t, bytes: usize) -> sgx_status_t;
+    fn set_reserve_range(eid: sgx_enclave_id_t, gb: usize) -> sgx_status_t;
+    fn set_tuning(
+        eid: sgx_enclave_id_t,
+        retval: *mut i32,
+        sealed: *const u8,
+        len: usize,
+    ) -> sgx_status_t;
+}
+
+//TCSNum in enclave/Enclave.config.xml, the pool workers hold a TCS each for good
+pub(crate) const ENCLAVE_TCS_NUM: usize = 64;
+
+const TC_STATS_MAX_CLASSES: usize = 128;
+
+/// Snapshot of the tcmalloc that manages the outside memory of the enclave.
+/// Mirrors tc_stats_t in enclave/Enclave.edl.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct TcStats {
+    pub system_bytes: u64,
+    pub pageheap_free_bytes: u64,
+    pub pageheap_unmapped_bytes: u64,
+    pub central_bytes: u64,
+    pub transfer_bytes: u64,
+    pub thread_bytes: u64,
+    pub metadata_bytes: u64,
+    pub central_contentions: u64,
+    pub shard_contentions: u64,
+    pub shard_hits: u64,
+    pub num_classes: u64,
+    pub class_size: [u64; TC_STATS_MAX_CLASSES],
+    pub class_count: [u64; TC_STATS_MAX_CLASSES],
+}
+
+impl TcStats {
+    /// Bytes handed out to the enclave and not freed yet.
+    pub fn in_use_bytes(&self) -> u64 {
+        self.system_bytes
+            - self.pageheap_free_bytes
+            - self.pageheap_unmapped_bytes
+            - self.central_bytes
+            - self.transfer_bytes
+            - self.thread_bytes
+    }
+
+    /// (class size, free bytes) of the size classes holding free objects,
+    /// largest first.
+    pub fn free_bytes_by_class(&self) -> Vec<(u64, u64)> {
+        let n = std::cmp::min(self.num_classes as usize, TC_STATS_MAX_CLASSES);
+        let mut classes = (1..n)
+            .filter(|&cl| self.class_count[cl] > 0)
+            .map(|cl| (self.class_size[cl], self.class_size[cl] * self.class_count[cl]))
+            .collect::<Vec<_>>();
+        classes.sort_by(|a, b| b.1.cmp(&a.1));
+        classes
+    }
+}
+
+impl std::fmt::Display for TcStats {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        const MB: f64 = 1048576.0;
+        write!(
+            f,
+            "in use {:.1} MB, heap {:.1} MB (pageheap free {:.1} MB, unmapped {:.1} MB, \
+            central {:.1} MB, transfer {:.1} MB, thread caches {:.1} MB), metadata {:.1} MB",
+            self.in_use_bytes() as f64 / MB,
+            self.system_bytes as f64 / MB,
+            self.pageheap_free_bytes as f64 / MB,
+            self.pageheap_unmapped_bytes as f64 / MB,
+            self.central_bytes as f64 / MB,
+            self.transfer_bytes as f64 / MB,
+            self.thread_bytes as f64 / MB,
+            self.metadata_bytes as f64 / MB,
+        )
+    }
+}
 
 const ENV_VAR_PREFIX: &str = "VEGA_";
+const DEFAULT_LOCALITY_WAIT_MS: u64 = 3000;
+const DEFAULT_SPECULATION_MULTIPLIER: f64 = 1.5;
+const DEFAULT_SPECULATION_QUANTILE: f64 = 0.75;
+const DEFAULT_MAX_DIRECT_RESULT_BYTES: usize = 1 << 20;
+const DEFAULT_REDUCE_SLOW_START: f64 = 1.0;
+const DEFAULT_PRE_TOUCH_MBYTES: usize = 1024;
+const DEFAULT_SCAVENGE_MS: u64 = 1000;
+const DEFAULT_OOM_RESERVE_MB: usize = 64;
+const DEFAULT_OUTSIDE_RANGE_GB: usize = 64;
+const DEFAULT_CACHE_LIMIT: usize = 4_000_000;
+const DEFAULT_MAX_THREAD: usize = 1;
+const DEFAULT_NUM_PARTS: usize = 1;
+const DEFAULT_SHUFFLE_SECTION_BYTES: usize = 4 << 20;
+const DEFAULT_ECALL_BATCH_BYTES: usize = 64 << 10;
+const DEFAULT_ECALL_BATCH_US: u64 = 200;
+const DEFAULT_BOOTSTRAP_FANOUT: usize = 16;
+const DEFAULT_CONTROL_WORKERS: usize = 2;
+//the associated data the knobs of the ops are sealed with, see enclave/src/tuning.rs
+const TUNING_AAD: &[u8] = b"tuning\0\0";
 pub(crate) const THREAD_PREFIX: &str = "_VEGA";
 static CONF: OnceCell<Configuration> = OnceCell::new();
 static ENV: OnceCell<Env> = OnceCell::new();
 static ASYNC_RT: Lazy<Option<Runtime>> = Lazy::new(Env::build_async_executor);
+static DATA_RT: Lazy<Runtime> =
+    Lazy::new(|| Env::build_runtime("data", Configuration::get().data_workers));
 
-pub(crate) static SHUFFLE_CACHE: Lazy<ShuffleCache> = Lazy::new(|| Arc::new(DashMap::new()));
-pub(crate) static BOUNDED_MEM_CACHE: Lazy<BoundedMemoryCache> = Lazy::new(BoundedMemoryCache::new);
+pub(crate) static SHUFFLE_STORE: Lazy<ShuffleStore> =
+    Lazy::new(|| ShuffleStore::new(Configuration::get().shuffle_mem_budget));
+pub(crate) static BOUNDED_MEM_CACHE: Lazy<BoundedMemoryCache> =
+    Lazy::new(|| BoundedMemoryCache::new(Configuration::get().cache_mbytes));
 pub(crate) static RDDB_MAP: Lazy<RddBMap> = Lazy::new(|| RddBMap::new());
 
 pub(crate) struct RddBMap {
@@ -44,13 +161,6 @@ pub(crate) struct RddBMap {
 
 impl RddBMap {
     pub fn new() -> Self {
-        let eid = Env::get()
-            .enclave
-            .lock()
-            .unwrap()
-            .as_ref()
-            .unwrap()
-            .geteid();
         RddBMap {
             map: Arc::new(DashMap::new()),
         }
@@ -63,6 +173,10 @@ impl RddBMap {
     pub fn insert(&self, rdd_id: usize, rdd_base: Arc<dyn RddBase>) {
         self.map.insert(rdd_id, rdd_base);
     }
+
+    pub fn clear(&self) {
+        self.map.clear();
+    }
 }
 
 pub(crate) struct Env {
@@ -70,15 +184,157 @@ pub(crate) struct Env {
     pub shuffle_manager: ShuffleManager,
     pub shuffle_fetcher: ShuffleFetcher,
     pub cache_tracker: Arc<CacheTracker>,
-    pub enclave: Arc<Mutex<Option<SgxEnclave>>>,
+    pub broadcast_tracker: Arc<BroadcastTracker>,
+    //the enclaves of this node, emptied when they are destroyed at exit
+    pub enclave: Arc<Mutex<Vec<SgxEnclave>>>,
+    //ECALLs enter through them instead of the enclave lock, one per enclave
+    pub enclave_handles: Vec<EnclaveHandle>,
     pub enclave_path: PathBuf,
 }
 
+thread_local! {
+    //index of the enclave the ECALLs of this thread go to, see Env::bind_enclave
+    static BOUND_ENCLAVE: Cell<usize> = Cell::new(0);
+}
+
+/// Binding of the current thread to one enclave, undone on drop.
+pub(crate) struct EnclaveBinding {
+    prev: usize,
+}
+
+impl Drop for EnclaveBinding {
+    fn drop(&mut self) {
+        BOUND_ENCLAVE.with(|bound| bound.set(self.prev));
+    }
+}
+
+//set in EnclaveHandle::state once the enclave is about to be destroyed
+const ENCLAVE_CLOSED: usize = 1 << (usize::BITS - 1);
+
+/// Lock-free access to the id of a live enclave.
+///
+/// Every ECALL holds an `EnclaveGuard` for as long as it may run inside, and
+/// `close` waits for the guards left before the enclave is destroyed, so the
+/// id is never used after `sgx_destroy_enclave`. Entering costs one atomic
+/// add on a counter that is only written, never locked.
+pub(crate) struct EnclaveHandle {
+    eid: sgx_enclave_id_t,
+    //number of guards alive, ENCLAVE_CLOSED once close has been called
+    state: AtomicUsize,
+}
+
+impl EnclaveHandle {
+    fn new(eid: sgx_enclave_id_t) -> Self {
+        EnclaveHandle {
+            eid,
+            state: AtomicUsize::new(0),
+        }
+    }
+
+    /// Panics if the enclave is closed.
+    pub fn enter(&self) -> EnclaveGuard<'_> {
+        let prev = self.state.fetch_add(1, Ordering::Acquire);
+        if prev & ENCLAVE_CLOSED != 0 {
+            self.state.fetch_sub(1, Ordering::Release);
+            panic!("[-] ECALL after enclave {} was destroyed!", self.eid);
+        }
+        EnclaveGuard { handle: self }
+    }
+
+    /// None if the enclave is closed, for the threads that may outlive it.
+    pub fn try_enter(&self) -> Option<EnclaveGuard<'_>> {
+        let prev = self.state.fetch_add(1, Ordering::Acquire);
+        if prev & ENCLAVE_CLOSED != 0 {
+            self.state.fetch_sub(1, Ordering::Release);
+            return None;
+        }
+        Some(EnclaveGuard { handle: self })
+    }
+
+    /// Refuses new guards and blocks until the ones handed out are dropped.
+    fn close(&self) {
+        self.state.fetch_or(ENCLAVE_CLOSED, Ordering::AcqRel);
+        while self.state.load(Ordering::Acquire) & !ENCLAVE_CLOSED != 0 {
+            std::thread::sleep(std::time::Duration::from_millis(1));
+        }
+    }
+}
+
+pub(crate) struct EnclaveGuard<'a> {
+    handle: &'a EnclaveHandle,
+}
+
+impl EnclaveGuard<'_> {
+    pub fn eid(&self) -> sgx_enclave_id_t {
+        self.handle.eid
+    }
+}
+
+impl Drop for EnclaveGuard<'_> {
+    fn drop(&mut self) {
+        self.handle.state.fetch_sub(1, Ordering::Release);
+    }
+}
+
 impl Env {
     pub fn get() -> &'static Env {
         ENV.get_or_init(Self::new)
     }
 
+    /// The Env if it is set up, without setting it up.
+    pub(crate) fn try_get() -> Option<&'static Env> {
+        ENV.get()
+    }
+
+    /// Guard to make ECALLs with on the enclave the current thread is bound to,
+    /// see `EnclaveHandle`.
+    pub fn enter() -> EnclaveGuard<'static> {
+        Env::get().enclave_handles[Env::bound_enclave()].enter()
+    }
+
+    /// Enclave that owns a partition. Every RDD keeps partition p in the same
+    /// enclave, so what a task caches is found by the tasks of later stages.
+    pub fn enclave_of(partition: usize) -> usize {
+        partition % Env::get().enclave_handles.len()
+    }
+
+    pub fn bound_enclave() -> usize {
+        BOUND_ENCLAVE.with(|bound| bound.get())
+    }
+
+    /// Sends the ECALLs of the current thread to enclave idx until the binding
+    /// is dropped. Threads a task spawns must bind themselves to the enclave of
+    /// the task, the binding is not inherited.
+    pub fn bind_enclave(idx: usize) -> EnclaveBinding {
+        assert!(idx < Env::get().enclave_handles.len(), "no enclave {}", idx);
+        EnclaveBinding {
+            prev: BOUND_ENCLAVE.with(|bound| bound.replace(idx)),
+        }
+    }
+
+    pub fn bind_partition(partition: usize) -> EnclaveBinding {
+        Env::bind_enclave(Env::enclave_of(partition))
+    }
+
+    /// Runs f bound to each enclave in turn, for ECALLs that set up or tear down
+    /// state all enclaves must agree on.
+    pub fn for_each_enclave<F: FnMut()>(mut f: F) {
+        for idx in 0..Env::get().enclave_handles.len() {
+            let _bound = Env::bind_enclave(idx);
+            f();
+        }
+    }
+
+    /// Waits for the ECALLs in flight and destroys the enclaves, done once at exit.
+    pub fn destroy_enclave(&self) {
+        for handle in &self.enclave_handles {
+            handle.close();
+        }
+        for enclave in self.enclave.lock().unwrap().drain(..) {
+            enclave.destroy();
+        }
+    }
+
     /// Run a function inside the existing Tokio context.
     pub fn run_in_async_rt<F, R>(func: F) -> R
     where
@@ -95,6 +351,17 @@ impl Env {
         }
     }
 
+    /// Run a function inside the runtime of the data plane, which serves and fetches the map
+    /// outputs of shuffles. The tasks it spawns do not hold up the task channels and the trackers
+    /// of the control plane however large the sections they move.
+    pub fn run_in_data_rt<F, R>(func: F) -> R
+    where
+        F: FnOnce() -> R,
+    {
+        let _guard = DATA_RT.enter();
+        func()
+    }
+
     /// Builds an async executor for executing DAG tasks according to env,
     /// machine properties and schedulling mode.
     /// Is only built in case there is not an existing one, otherwise the existing one will be used
@@ -103,15 +370,40 @@ impl Env {
         if Handle::try_current().is_ok() {
             None
         } else {
-            Some(
-                tokio::runtime::Builder::new_multi_thread()
-                    .enable_all()
-                    .build()
-                    .unwrap(),
-            )
+            Some(Env::build_runtime(
+                "control",
+                Configuration::get().control_workers,
+            ))
         }
     }
 
+    /// A runtime of `workers` threads, pinned to `runtime_cpus` if set. Only its workers are
+    /// pinned, the tasks run on its blocking threads enter the enclave.
+    fn build_runtime(plane: &str, workers: usize) -> Runtime {
+        let cpus = Configuration::get().runtime_cpus.clone();
+        // A blocking thread inherits the affinity of the worker that started it, so it gets the
+        // one of the builder back.
+        let unpinned = numa::affinity();
+        // The workers are the first threads a runtime starts, before it is built.
+        let started = AtomicUsize::new(0);
+        tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(workers)
+            .thread_name(format!("{}-{}", THREAD_PREFIX, plane))
+            .on_thread_start(move || {
+                if cpus.is_empty() {
+                    return;
+                }
+                if started.fetch_add(1, Ordering::Relaxed) < workers {
+                    numa::pin_to(&cpus);
+                } else if let Some(unpinned) = &unpinned {
+                    numa::set_affinity(unpinned);
+                }
+            })
+            .enable_all()
+            .build()
+            .unwrap()
+    }
+
     fn new() -> Self {
         Env::run_in_async_rt(|| -> Self {
             let conf = Configuration::get();
@@ -134,10 +426,41 @@ impl Env {
             let enclave_path_str = enclave_path
                 .to_str()
                 .unwrap_or_else(|| panic!("env::Env enclave PathBuf2str error"));
-            let enclave = Arc::new(Mutex::new(Some(
-                Env::init_enclave(&enclave_path_str)
-                    .unwrap_or_else(|x| panic!("[-] Init Enclave Failed {}!", x.as_str())),
-            )));
+            log::info!("creating {} enclaves", conf.enclaves);
+            let tuning = conf.sealed_tuning();
+            // The threads the enclaves start keep off the cpus of the runtimes.
+            let off_runtime = numa::OffCpus::enter(&conf.runtime_cpus);
+            let enclaves = (0..conf.enclaves)
+                .map(|idx| {
+                    let numa_node = if conf.numa_alloc {
+                        numa::node_of_enclave(idx)
+                    } else {
+                        None
+                    };
+                    Env::init_enclave(
+                        &enclave_path_str,
+                        conf.switchless_workers,
+                        conf.enclave_cpus,
+                        conf.enclave_workers,
+                        conf.enc_block_bytes,
+                        conf.key_id,
+                        conf.heap_profile.as_ref().map(|_| conf.heap_profile_period),
+                        conf.cpu_profile.is_some(),
+                        conf.scavenge_ms,
+                        numa_node,
+                        conf.oom_reserve_mb << 20,
+                        conf.outside_range_gb,
+                        &tuning,
+                    )
+                    .unwrap_or_else(|x| panic!("[-] Init Enclave Failed {}!", x.as_str()))
+                })
+                .collect::<Vec<_>>();
+            drop(off_runtime);
+            let enclave_handles = enclaves
+                .iter()
+                .map(|enclave| EnclaveHandle::new(enclave.geteid()))
+                .collect();
+            let enclave = Arc::new(Mutex::new(enclaves));
             Env {
                 map_output_tracker,
                 shuffle_manager,
@@ -149,14 +472,54 @@ impl Env {
                     &BOUNDED_MEM_CACHE,
                 )
                 .expect("fatal error: failed creating cache tracker"),
+                broadcast_tracker: BroadcastTracker::new(conf.is_driver, master_addr),
                 enclave,
+                enclave_handles,
                 enclave_path,
             }
         })
     }
 
     //whether secure flag is set or not, the enclave should be inited and destroyed in the end.
-    fn init_enclave(enclave_path_str: &str) -> SgxResult<SgxEnclave> {
+    //it is called once for each of the enclaves of the node, with the same arguments.
+    //if switchless_workers is set, the ocalls marked with transition_using_threads are
+    //served by that number of untrusted worker threads instead of exiting the enclave.
+    //enclave_cpus is the number of threads that may enter the enclave, which the
+    //tcmalloc inside sizes its thread caches and transfer caches for.
+    //enclave_workers threads are started once inside the enclave and run the
+    //decryption, computation and encryption jobs the ops hand out.
+    //enc_block_bytes is the plaintext size the enclave cuts encryption blocks to.
+    //key_id selects the job key blocks are encrypted with, all processes of an
+    //application must use the same one. the master key it is derived from is
+    //provisioned first, see provision.rs.
+    //if heap_profile_period is set, outside allocations are sampled once every
+    //that many bytes, see heap_profiler.rs.
+    //if cpu_profile is set, the enclave samples the threads the host interrupts,
+    //see cpu_profiler.rs.
+    //a thread of the enclave releases the outside memory left free every scavenge_ms,
+    //0 leaves that to the free path.
+    //if numa_node is set, the outside memory of the enclave is placed on that node,
+    //see numa.rs. it is set before any other ECALL grows the heap.
+    //oom_reserve_bytes of outside memory are held back for when the host cannot grow the
+    //heap, see memory_pressure_o.
+    //the outside heap is carved from one range of outside_range_gb if it is not 0, which
+    //tcmalloc indexes flat. it is set before any other ECALL grows the heap.
+    //tuning holds the knobs of the ops, sealed under the job key, see Configuration::sealed_tuning.
+    fn init_enclave(
+        enclave_path_str: &str,
+        switchless_workers: Option<u32>,
+        enclave_cpus: usize,
+        enclave_workers: usize,
+        enc_block_bytes: usize,
+        key_id: u64,
+        heap_profile_period: Option<u64>,
+        cpu_profile: bool,
+        scavenge_ms: u64,
+        numa_node: Option<usize>,
+        oom_reserve_bytes: usize,
+        outside_range_gb: usize,
+        tuning: &[u8],
+    ) -> SgxResult<SgxEnclave> {
         let mut launch_token: sgx_launch_token_t = [0; 1024];
         let mut launch_token_updated: i32 = 0;
         // call sgx_create_enclave to initialize an enclave instance
@@ -166,13 +529,161 @@ impl Env {
             secs_attr: sgx_attributes_t { flags: 0, xfrm: 0 },
             misc_select: 0,
         };
-        SgxEnclave::create(
-            enclave_path_str,
-            debug,
-            &mut launch_token,
-            &mut launch_token_updated,
-            &mut misc_attr,
-        )
+        let enclave = match switchless_workers {
+            Some(num_uworkers) if num_uworkers > 0 => {
+                log::info!(
+                    "creating enclave with {} switchless untrusted workers",
+                    num_uworkers
+                );
+                SgxEnclave::create_with_workers(
+                    enclave_path_str,
+                    debug,
+                    &mut launch_token,
+                    &mut launch_token_updated,
+                    &mut misc_attr,
+                    num_uworkers,
+                    0,
+                )
+            }
+            _ => SgxEnclave::create(
+                enclave_path_str,
+                debug,
+                &mut launch_token,
+                &mut launch_token_updated,
+                &mut misc_attr,
+            ),
+        }?;
+        if let Some(node) = numa_node {
+            log::info!(
+                "placing the outside memory of enclave {} on node {}",
+                enclave.geteid(),
+                node
+            );
+            let sgx_status = unsafe { set_numa_node(enclave.geteid(), node as i32) };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                return Err(sgx_status);
+            }
+        }
+        let sgx_status = unsafe { set_reserve_range(enclave.geteid(), outside_range_gb) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        let sgx_status = unsafe { set_cpu_count(enclave.geteid(), enclave_cpus) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        let sgx_status = unsafe { set_oom_reserve(enclave.geteid(), oom_reserve_bytes) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        log::info!("starting {} enclave worker threads", enclave_workers);
+        let sgx_status = unsafe { init_thread_pool(enclave.geteid(), enclave_workers) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        let sgx_status = unsafe { start_scavenger(enclave.geteid(), scavenge_ms) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        let sgx_status = unsafe { set_enc_block_bytes(enclave.geteid(), enc_block_bytes) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        // Job keys are derived from the master key, so before set_key_id.
+        if let Err(e) = provision::provision(enclave.geteid(), Path::new(enclave_path_str)) {
+            log::error!("no master key for enclave {}: {}", enclave.geteid(), e);
+            return Err(sgx_status_t::SGX_ERROR_SERVICE_UNAVAILABLE);
+        }
+        let sgx_status = unsafe { set_key_id(enclave.geteid(), key_id) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        // Opened under the job key, so after set_key_id.
+        let mut applied = 0;
+        let sgx_status = unsafe {
+            set_tuning(
+                enclave.geteid(),
+                &mut applied,
+                tuning.as_ptr(),
+                tuning.len(),
+            )
+        };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        if applied == 0 {
+            log::warn!(
+                "enclave {} rejected the tuning, it runs with its defaults",
+                enclave.geteid()
+            );
+        }
+        // The enclave mirrors the pointers to the cached blocks it was handed until this changes.
+        let generation = BOUNDED_MEM_CACHE.generation_ptr();
+        let sgx_status = unsafe { set_cache_generation(enclave.geteid(), generation) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            return Err(sgx_status);
+        }
+        if let Some(period) = heap_profile_period {
+            log::info!("sampling outside enclave allocations every {} bytes", period);
+            let sgx_status = unsafe { set_heap_profiler(enclave.geteid(), period) };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                return Err(sgx_status);
+            }
+        }
+        if cpu_profile {
+            let mut supported = 0;
+            let sgx_status = unsafe { set_cpu_profiler(enclave.geteid(), &mut supported, 1) };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                return Err(sgx_status);
+            }
+            if supported == 0 {
+                log::warn!("the enclave is built without SGX_AEX_NOTIFY, it cannot be profiled");
+            }
+        }
+        Ok(enclave)
+    }
+
+    //of the enclave the current thread is bound to
+    pub fn get_tc_stats(&self) -> TcStats {
+        let enclave = Env::enter();
+        let mut stats: TcStats = unsafe { std::mem::zeroed() };
+        let sgx_status = unsafe { get_tc_stats(enclave.eid(), &mut stats) };
+        match sgx_status {
+            sgx_status_t::SGX_SUCCESS => {}
+            _ => {
+                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+            }
+        };
+        stats
+    }
+
+    /// `get_tc_stats` of the first enclave, None once it is destroyed. The enclaves of a process
+    /// share the tcmalloc of its outside memory.
+    pub(crate) fn try_tc_stats(&self) -> Option<TcStats> {
+        let enclave = self.enclave_handles.first()?.try_enter()?;
+        let mut stats: TcStats = unsafe { std::mem::zeroed() };
+        let sgx_status = unsafe { get_tc_stats(enclave.eid(), &mut stats) };
+        match sgx_status {
+            sgx_status_t::SGX_SUCCESS => Some(stats),
+            _ => None,
+        }
+    }
+
+    /// Bytes in use and peak bytes of the trusted heaps of all the enclaves, summed. None once
+    /// they are destroyed.
+    pub(crate) fn trusted_heap_usage(&self) -> Option<(u64, u64)> {
+        let mut usage = (0, 0);
+        for handle in &self.enclave_handles {
+            let enclave = handle.try_enter()?;
+            let (mut in_use, mut peak) = (0, 0);
+            let sgx_status = unsafe { get_heap_usage(enclave.eid(), &mut in_use, &mut peak) };
+            if sgx_status != sgx_status_t::SGX_SUCCESS {
+                return None;
+            }
+            usage.0 += in_use;
+            usage.1 += peak;
+        }
+        Some(usage)
     }
 }
 
@@ -217,8 +728,62 @@ struct EnvConfig {
     log_level: Option<LogLevel>,
     log_cleanup: Option<bool>,
     shuffle_service_port: Option<u16>,
+    shuffle_mem_budget: Option<usize>,
+    shuffle_push: Option<bool>,
+    shuffle_transport: Option<TransportKind>,
+    cache_mbytes: Option<usize>,
+    cache_persist: Option<bool>,
+    lineage_cache: Option<bool>,
+    checkpoint_dir: Option<String>,
+    locality_wait_ms: Option<u64>,
+    speculation: Option<bool>,
+    speculation_multiplier: Option<f64>,
+    speculation_quantile: Option<f64>,
+    scheduler_pools: Option<String>,
+    max_direct_result_bytes: Option<usize>,
+    reduce_slow_start: Option<f64>,
     slave_deployment: Option<bool>,
     slave_port: Option<u16>,
+    switchless_workers: Option<u32>,
+    enclaves: Option<usize>,
+    enclave_cpus: Option<usize>,
+    enclave_workers: Option<usize>,
+    enc_block_bytes: Option<usize>,
+    key_id: Option<u64>,
+    key_service: Option<String>,
+    spid: Option<String>,
+    master_key_file: Option<String>,
+    heap_profile: Option<String>,
+    heap_profile_period: Option<u64>,
+    cpu_profile: Option<String>,
+    cpu_profile_hz: Option<u32>,
+    pre_touch_mbytes: Option<usize>,
+    pre_touch_threads: Option<usize>,
+    executor_daemon: Option<bool>,
+    bootstrap_fanout: Option<usize>,
+    trace: Option<bool>,
+    epc_backpressure: Option<bool>,
+    epc_faults_high: Option<u64>,
+    epc_evictions: Option<String>,
+    scavenge_ms: Option<u64>,
+    memfs_path: Option<String>,
+    memfs_limit_mb: Option<usize>,
+    numa_alloc: Option<bool>,
+    oom_reserve_mb: Option<usize>,
+    outside_range_gb: Option<usize>,
+    max_enc_bl: Option<usize>,
+    cache_limit: Option<usize>,
+    max_thread: Option<usize>,
+    cache_inside: Option<bool>,
+    num_parts: Option<usize>,
+    shuffle_section_bytes: Option<usize>,
+    ecall_batch_bytes: Option<usize>,
+    ecall_batch_us: Option<u64>,
+    node_combine: Option<bool>,
+    control_workers: Option<usize>,
+    data_workers: Option<usize>,
+    runtime_cpus: Option<String>,
+    stage_holders: Option<usize>,
 }
 
 #[derive(Clone, Copy, PartialEq, Debug, Serialize, Deserialize)]
@@ -245,8 +810,154 @@ pub(crate) struct Configuration {
     pub local_dir: PathBuf,
     pub deployment_mode: DeploymentMode,
     pub shuffle_svc_port: Option<u16>,
+    /// Bytes of map outputs held in memory before the next ones are spilled to disk, no limit
+    /// if unset.
+    pub shuffle_mem_budget: Option<usize>,
+    /// Map tasks of secure shuffles push their outputs to a merger per reduce partition, see
+    /// `ShufflePusher`.
+    pub shuffle_push: bool,
+    /// How reducers pull the map outputs of secure shuffles, the same on the whole cluster, see
+    /// `crate::shuffle::transport`.
+    pub shuffle_transport: TransportKind,
+    /// Capacity of the cache of partitions, least recently used ones are evicted past it.
+    pub cache_mbytes: usize,
+    /// Cached partitions outlive the executor, one restarted in the same work dir reloads them
+    /// instead of computing them again, see `BoundedMemoryCache::persist`.
+    pub cache_persist: bool,
+    /// An executor daemon keeps the secure partitions a job cached for the later jobs that cache
+    /// the same lineage, see `CacheTracker::adopt_lineage`. Only for jobs whose closures read
+    /// nothing but their captured values and inputs, a broadcast is known by its id only.
+    pub lineage_cache: bool,
+    /// Directory of the checkpoints of secure rdds, on a filesystem the driver and every executor
+    /// share, see `Rdd::checkpoint`.
+    pub checkpoint_dir: PathBuf,
+    /// How long a task waits for a free slot on an executor that has its input cached before it
+    /// goes to any executor.
+    pub locality_wait_ms: u64,
+    /// Tasks running much longer than the finished tasks of their stage get a copy on another
+    /// executor, the first result is taken.
+    pub speculation: bool,
+    /// How many times the median run time of its stage a task runs before it is a straggler.
+    pub speculation_multiplier: f64,
+    /// Share of the tasks of a stage that must have finished before any is speculated.
+    pub speculation_quantile: f64,
+    /// Weights of the scheduler pools of the driver, `name:weight` separated by commas, see
+    /// `Context::set_scheduler_pool`.
+    pub scheduler_pools: String,
+    /// Results of result tasks larger than this are kept on their executor and fetched by the
+    /// driver from its shuffle server, instead of going back over the task channel.
+    pub max_direct_result_bytes: usize,
+    /// Share of the map outputs of its parent stages that must be available before a stage is
+    /// submitted, its tasks wait for the rest when they fetch. 1 waits for the whole map stage.
+    pub reduce_slow_start: f64,
     pub slave: Option<SlaveConfig>,
     pub loggin: LogConfig,
+    pub switchless_workers: Option<u32>,
+    /// Enclaves per node, each with its own heap, EPC share and cache.
+    pub enclaves: usize,
+    pub enclave_cpus: usize,
+    pub enclave_workers: usize,
+    pub enc_block_bytes: usize,
+    pub key_id: u64,
+    /// host:port of the key service the enclaves are attested to for the master key, the
+    /// development key if unset, see `crate::provision`.
+    pub key_service: Option<String>,
+    /// Service provider id the quotes for the key service are made under.
+    pub spid: [u8; 16],
+    /// The master key of the host side of the job key, which the data owner provisions, the
+    /// development key if unset.
+    pub master_key_file: Option<PathBuf>,
+    pub heap_profile: Option<PathBuf>,
+    pub heap_profile_period: u64,
+    /// Prefix of the CPU profile of the enclave code, written at exit, see `crate::cpu_profiler`.
+    pub cpu_profile: Option<PathBuf>,
+    /// Samples per second and thread of the CPU profile.
+    pub cpu_profile_hz: u32,
+    /// Megabytes of the heap of every enclave touched at startup, before the executor is ready,
+    /// so that the first tasks do not fault the pages in.
+    pub pre_touch_mbytes: usize,
+    /// Threads of every enclave the startup touch is split over, each holds a TCS.
+    pub pre_touch_threads: usize,
+    /// Executors outlive the job and keep their enclaves, with the heaps touched, for the next
+    /// driver of the same binaries and configuration, see `Context::attach_executor`.
+    pub executor_daemon: bool,
+    /// Executors the driver deploys at once.
+    pub bootstrap_fanout: usize,
+    /// Record a timeline of every job and write it to the work dir of the driver, see
+    /// `crate::trace`.
+    pub trace: bool,
+    /// Lower the stage holders when the enclave pages, see `crate::epc_pressure`.
+    pub epc_backpressure: bool,
+    /// Page faults, and evictions if counted, per second above which it lowers them.
+    pub epc_faults_high: u64,
+    /// A file holding the count of EPC pages the SGX driver evicted, read as another signal.
+    pub epc_evictions: Option<PathBuf>,
+    /// Interval of the thread of every enclave that releases the outside memory left free, 0 for
+    /// none.
+    pub scavenge_ms: u64,
+    /// Path on a hugetlbfs mount the outside heap of the enclave is mapped from, see
+    /// `crate::memfs`.
+    pub memfs_path: Option<PathBuf>,
+    /// Megabytes of the mount the heap may take, 0 for no limit, beyond it grows with mmap.
+    pub memfs_limit_mb: usize,
+    /// Place the outside memory of every enclave on the NUMA node of its tasks, see
+    /// `crate::numa`.
+    pub numa_alloc: bool,
+    /// Megabytes of outside memory every enclave holds back for when the host cannot grow its
+    /// heap, 0 for none. Once they are used up a task that runs out fails, not the enclave.
+    pub oom_reserve_mb: usize,
+    /// Gigabytes of address space every enclave reserves at once for its outside heap, whose
+    /// pages its tcmalloc then looks up in a flat array, 0 for arenas of their own. It is 0 with
+    /// `memfs_path`, the huge pages of a mount are reserved for all of a mapping.
+    pub outside_range_gb: usize,
+    /// Size a cogroup block of the enclave aims for, in pairs, and a join block in their deep
+    /// size squared.
+    pub max_enc_bl: usize,
+    /// Deep size of the sub-partitions a shuffle task in the enclave splits its output into,
+    /// shared by its threads and the tasks next to it.
+    pub cache_limit: usize,
+    /// Threads a shuffle of the enclave merges with, every partition is split into one more
+    /// sub-bucket than that. The host and all the enclaves of a job must agree on it.
+    pub max_thread: usize,
+    /// Keep the partitions cached in the enclave as plaintext as well.
+    pub cache_inside: bool,
+    /// Partitions of the shuffles of the benchmark jobs, see `num_parts`.
+    pub num_parts: usize,
+    /// Size of the sections a map output is served in, the same on every node of a cluster.
+    pub shuffle_section_bytes: usize,
+    /// Partitions whose input is at most this many bytes share their ECALL with the other small
+    /// partitions of their stage, see `ExecBatcher`.
+    pub ecall_batch_bytes: usize,
+    /// How long the first small partition of a batch waits for the others, 0 for no batches.
+    pub ecall_batch_us: u64,
+    /// The map tasks of a secure shuffle on an executor leave their combiners in the enclave,
+    /// where the last of them encrypts them once for all, see `StageLock::leave_stage`. Off with
+    /// `speculation` or `shuffle_push`, the output of a map task must then be its own.
+    pub node_combine: bool,
+    /// Worker threads of the runtime of the control plane: the task channels, the trackers and
+    /// the schedulers.
+    pub control_workers: usize,
+    /// Worker threads of the runtime of the data plane, the shuffle servers and fetches, see
+    /// `Env::run_in_data_rt`.
+    pub data_workers: usize,
+    /// Cpus the workers of both runtimes are pinned to, a kernel cpu list such as 0-1. The
+    /// threads of the enclaves then run on the others. Nothing is pinned if empty.
+    pub runtime_cpus: Vec<usize>,
+    /// At most this many tasks of a stage in every enclave at once, below what its TCSs allow,
+    /// 0 for no cap. For the sweeps of `app scaling`.
+    pub stage_holders: usize,
+}
+
+/// The knobs of the ops the enclave reads at init instead of constants it is signed with.
+/// Mirrors Tuning in enclave/src/tuning.rs.
+#[derive(Serialize, Debug)]
+struct Tuning {
+    max_enc_bl: u64,
+    cache_limit: u64,
+    max_thread: u64,
+    cache_inside: bool,
+    num_parts: u64,
+    node_combine: bool,
 }
 
 #[derive(Serialize, Deserialize, Clone)]
@@ -336,6 +1047,23 @@ impl Default for Configuration {
             }
         }
 
+        let enclave_cpus = config.enclave_cpus.unwrap_or(MAX_STAGE_HOLDERS);
+        let scavenge_ms = config.scavenge_ms.unwrap_or(DEFAULT_SCAVENGE_MS);
+        let spid = config.spid.as_deref().map_or([0; 16], |spid| {
+            let mut id = [0; 16];
+            for (i, byte) in id.iter_mut().enumerate() {
+                *byte = spid
+                    .get(2 * i..2 * i + 2)
+                    .and_then(|hex| u8::from_str_radix(hex, 16).ok())
+                    .expect("VEGA_SPID must be 32 hex digits");
+            }
+            id
+        });
+        let checkpoint_dir = config
+            .checkpoint_dir
+            .map(PathBuf::from)
+            .unwrap_or_else(|| local_dir.join("ns-checkpoints"));
+
         Configuration {
             is_driver: is_master,
             local_ip,
@@ -346,7 +1074,99 @@ impl Default for Configuration {
                 log_cleanup,
             },
             shuffle_svc_port: config.shuffle_service_port,
+            shuffle_mem_budget: config.shuffle_mem_budget,
+            shuffle_push: config.shuffle_push.unwrap_or(false),
+            shuffle_transport: config.shuffle_transport.unwrap_or(TransportKind::Http),
+            cache_mbytes: config.cache_mbytes.unwrap_or(DEFAULT_CACHE_MBYTES),
+            cache_persist: config.cache_persist.unwrap_or(false),
+            lineage_cache: config.lineage_cache.unwrap_or(false),
+            checkpoint_dir,
+            locality_wait_ms: config.locality_wait_ms.unwrap_or(DEFAULT_LOCALITY_WAIT_MS),
+            speculation: config.speculation.unwrap_or(false),
+            speculation_multiplier: config
+                .speculation_multiplier
+                .unwrap_or(DEFAULT_SPECULATION_MULTIPLIER),
+            speculation_quantile: config
+                .speculation_quantile
+                .unwrap_or(DEFAULT_SPECULATION_QUANTILE),
+            scheduler_pools: config.scheduler_pools.unwrap_or_default(),
+            max_direct_result_bytes: config
+                .max_direct_result_bytes
+                .unwrap_or(DEFAULT_MAX_DIRECT_RESULT_BYTES),
+            reduce_slow_start: config
+                .reduce_slow_start
+                .unwrap_or(DEFAULT_REDUCE_SLOW_START),
             slave,
+            switchless_workers: config.switchless_workers,
+            enclaves: config.enclaves.unwrap_or(1).max(1),
+            enclave_cpus,
+            enclave_workers: config.enclave_workers.unwrap_or_else(|| {
+                //whatever TCS the task threads and the scavenger leave, no more than there
+                //are cores
+                ENCLAVE_TCS_NUM
+                    .saturating_sub(enclave_cpus + (scavenge_ms > 0) as usize)
+                    .min(num_cpus::get())
+            }),
+            enc_block_bytes: config.enc_block_bytes.unwrap_or(DEFAULT_ENC_BLOCK_BYTES),
+            key_id: config.key_id.unwrap_or(0),
+            key_service: config.key_service,
+            spid,
+            master_key_file: config.master_key_file.map(PathBuf::from),
+            heap_profile: config.heap_profile.map(PathBuf::from),
+            heap_profile_period: config.heap_profile_period.unwrap_or(DEFAULT_HEAP_PROFILE_PERIOD),
+            cpu_profile: config.cpu_profile.map(PathBuf::from),
+            cpu_profile_hz: config.cpu_profile_hz.unwrap_or(DEFAULT_CPU_PROFILE_HZ).max(1),
+            pre_touch_mbytes: config.pre_touch_mbytes.unwrap_or(DEFAULT_PRE_TOUCH_MBYTES),
+            pre_touch_threads: config
+                .pre_touch_threads
+                .unwrap_or(enclave_cpus)
+                .min(ENCLAVE_TCS_NUM)
+                .max(1),
+            executor_daemon: config.executor_daemon.unwrap_or(false),
+            bootstrap_fanout: config
+                .bootstrap_fanout
+                .unwrap_or(DEFAULT_BOOTSTRAP_FANOUT)
+                .max(1),
+            trace: config.trace.unwrap_or(false),
+            epc_backpressure: config.epc_backpressure.unwrap_or(false),
+            epc_faults_high: config.epc_faults_high.unwrap_or(DEFAULT_EPC_FAULTS_HIGH),
+            epc_evictions: config.epc_evictions.map(PathBuf::from),
+            scavenge_ms,
+            memfs_path: config.memfs_path.map(PathBuf::from),
+            memfs_limit_mb: config.memfs_limit_mb.unwrap_or(0),
+            numa_alloc: config.numa_alloc.unwrap_or(false),
+            oom_reserve_mb: config.oom_reserve_mb.unwrap_or(DEFAULT_OOM_RESERVE_MB),
+            outside_range_gb: if config.memfs_path.is_some() {
+                0
+            } else {
+                config.outside_range_gb.unwrap_or(DEFAULT_OUTSIDE_RANGE_GB)
+            },
+            max_enc_bl: config.max_enc_bl.unwrap_or(MAX_ENC_BL).max(1),
+            cache_limit: config.cache_limit.unwrap_or(DEFAULT_CACHE_LIMIT).max(1),
+            max_thread: config.max_thread.unwrap_or(DEFAULT_MAX_THREAD).max(1),
+            cache_inside: config.cache_inside.unwrap_or(true),
+            num_parts: config.num_parts.unwrap_or(DEFAULT_NUM_PARTS).max(1),
+            shuffle_section_bytes: config
+                .shuffle_section_bytes
+                .unwrap_or(DEFAULT_SHUFFLE_SECTION_BYTES)
+                .max(1),
+            ecall_batch_bytes: config
+                .ecall_batch_bytes
+                .unwrap_or(DEFAULT_ECALL_BATCH_BYTES),
+            ecall_batch_us: config.ecall_batch_us.unwrap_or(DEFAULT_ECALL_BATCH_US),
+            node_combine: config.node_combine.unwrap_or(false)
+                && !config.speculation.unwrap_or(false)
+                && !config.shuffle_push.unwrap_or(false),
+            control_workers: config
+                .control_workers
+                .unwrap_or(DEFAULT_CONTROL_WORKERS)
+                .max(1),
+            data_workers: config.data_workers.unwrap_or_else(num_cpus::get).max(1),
+            runtime_cpus: config
+                .runtime_cpus
+                .as_deref()
+                .map_or_else(Vec::new, numa::parse_cpu_list),
+            stage_holders: config.stage_holders.unwrap_or(0),
         }
     }
 }
@@ -356,6 +1176,46 @@ impl Configuration {
         CONF.get_or_init(Self::default)
     }
 
+    //tasks of a stage that may be inside the enclave at once: each holds a TCS
+    //next to the threads of the enclave, and tcmalloc is sized for enclave_cpus of them.
+    //the EPC share of a task already shrinks with their number, the enclave
+    //divides its cache limit by parallel_num. every enclave has this budget,
+    //or stage_holders if that is less
+    pub fn max_stage_holders(&self) -> usize {
+        let cap = if self.stage_holders > 0 {
+            self.stage_holders
+        } else {
+            usize::MAX
+        };
+        ENCLAVE_TCS_NUM
+            .saturating_sub(self.enclave_thread_tcs())
+            .min(self.enclave_cpus)
+            .min(cap)
+            .max(1)
+            * self.enclaves
+    }
+
+    //TCSs the threads of the enclave itself hold for as long as it runs, the pool workers and
+    //the scavenger
+    pub fn enclave_thread_tcs(&self) -> usize {
+        self.enclave_workers + (self.scavenge_ms > 0) as usize
+    }
+
+    /// The knobs of the ops of the enclave, sealed under the job key so that the enclave only
+    /// takes them from a holder of the key.
+    fn sealed_tuning(&self) -> Vec<u8> {
+        let tuning = Tuning {
+            max_enc_bl: self.max_enc_bl as u64,
+            cache_limit: self.cache_limit as u64,
+            max_thread: self.max_thread as u64,
+            cache_inside: self.cache_inside,
+            num_parts: self.num_parts as u64,
+            node_combine: self.node_combine,
+        };
+        log::debug!("{:?}", tuning);
+        rdd::seal_bound(&bincode::serialize(&tuning).unwrap(), TUNING_AAD)
+    }
+
     fn get_from_file() -> Option<Configuration> {
         let binary_path = std::env::current_exe()
             .map_err(|_| Error::CurrentBinaryPath)
@@ -372,3 +1232,9 @@ impl Configuration {
         None
     }
 }
+
+/// Partitions of the shuffles of the benchmark jobs, VEGA_NUM_PARTS. The enclave builds its side
+/// of the jobs with the same.
+pub fn num_parts() -> usize {
+    Configuration::get().num_parts
+}
@@ -0,0 +1,90 @@
+//! Backpressure from EPC paging into the admission of tasks into the enclave.
+//!
+//! When the working set of the tasks inside outgrows the EPC, the driver evicts pages and every
+//! task faults them back in, so admitting more tasks only adds to the paging. With
+//! VEGA_EPC_BACKPRESSURE set, a monitor thread reads the page faults of the process every
+//! `INTERVAL`, an EPC page coming back being one of them, plus the evictions of the driver if
+//! VEGA_EPC_EVICTIONS names a file counting them (the out-of-tree driver exports
+//! `/sys/module/isgx/parameters/sgx_nr_evicted`, for one). Above `epc_faults_high` per second
+//! it cuts the holders the `StageLock` admits by a quarter, below a quarter of that it admits one
+//! more, up to `Configuration::max_stage_holders`. Page faults of the untrusted side count too,
+//! a startup that touches the heap, see `pre_touch_mbytes`, keeps them out of the first stages.
+
+use std::path::{Path, PathBuf};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::env::Configuration;
+use crate::overhead;
+use crate::rdd::STAGE_LOCK;
+
+pub(crate) const DEFAULT_EPC_FAULTS_HIGH: u64 = 50_000;
+
+const INTERVAL: Duration = Duration::from_millis(250);
+
+/// The holders to admit next, given the paging `rate` per second over the last interval.
+fn next_limit(limit: usize, max: usize, rate: f64, high: f64) -> usize {
+    if rate > high {
+        (limit - limit / 4).max(1)
+    } else if rate < high / 4.0 {
+        (limit + 1).min(max)
+    } else {
+        limit
+    }
+}
+
+fn read_counter(path: &Path) -> Option<u64> {
+    std::fs::read_to_string(path).ok()?.trim().parse().ok()
+}
+
+pub(crate) fn paging_events(evictions: &Option<PathBuf>) -> u64 {
+    let (minor, major) = overhead::page_faults();
+    minor + major + evictions.as_deref().and_then(read_counter).unwrap_or(0)
+}
+
+/// Starts the monitor if VEGA_EPC_BACKPRESSURE is set.
+pub(crate) fn start_if_enabled() {
+    let conf = Configuration::get();
+    if !conf.epc_backpressure {
+        return;
+    }
+    let max = conf.max_stage_holders();
+    let high = conf.epc_faults_high as f64;
+    let evictions = conf.epc_evictions.clone();
+    log::info!(
+        "adapting the stage holders to EPC paging, at most {}, above {} faults/s fewer",
+        max,
+        high
+    );
+    thread::spawn(move || {
+        let mut before = paging_events(&evictions);
+        let mut last = Instant::now();
+        loop {
+            thread::sleep(INTERVAL);
+            let now = paging_events(&evictions);
+            let rate = now.saturating_sub(before) as f64 / last.elapsed().as_secs_f64();
+            before = now;
+            last = Instant::now();
+            let limit = STAGE_LOCK.max_cur_holders();
+            let next = next_limit(limit, max, rate, high);
+            if next != limit {
+                log::debug!("{:.0} faults/s, stage holders {} -> {}", rate, limit, next);
+                STAGE_LOCK.set_max_cur_holders(next);
+            }
+        }
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn backs_off_and_recovers() {
+        assert_eq!(next_limit(48, 48, 1e6, 5e4), 36);
+        assert_eq!(next_limit(1, 48, 1e6, 5e4), 1);
+        assert_eq!(next_limit(36, 48, 3e4, 5e4), 36);
+        assert_eq!(next_limit(36, 48, 100.0, 5e4), 37);
+        assert_eq!(next_limit(48, 48, 0.0, 5e4), 48);
+    }
+}
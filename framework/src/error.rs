@@ -11,6 +11,9 @@ pub enum Error {
     #[error(transparent)]
     AsyncJoinError(#[from] tokio::task::JoinError),
 
+    #[error("enclave attestation failed: {0}")]
+    Attestation(String),
+
     #[error("failed to run {command}")]
     CommandOutput {
         source: std::io::Error,
@@ -50,6 +53,9 @@ pub enum Error {
     #[error("executor shutdown signal")]
     ExecutorShutdown,
 
+    #[error("executor at {0} did not come up")]
+    ExecutorNotReady(std::net::SocketAddrV4),
+
     #[error("configuration failure: {0}")]
     GetOrCreateConfig(&'static str),
 
@@ -80,6 +86,12 @@ pub enum Error {
     #[error("failed writing to output destination")]
     OutputWrite(#[source] capnp::Error),
 
+    #[error("failed writing {}", path.display())]
+    OutputFile {
+        source: std::io::Error,
+        path: PathBuf,
+    },
+
     #[error("failed to parse hosts file at {}", path.display())]
     ParseHosts {
         source: toml::de::Error,
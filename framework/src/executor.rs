@@ -2,23 +2,31 @@ use std::net::SocketAddr;
 use std::sync::Arc;
 use std::time::{Duration, Instant};
 
+use crate::context::Context;
 use crate::env;
 use crate::error::{Error, NetworkError, Result};
-use crate::scheduler::TaskOption;
-use crate::serialized_data_capnp::serialized_data;
-use capnp::{
-    message::{Builder as MsgBuilder, HeapAllocator, Reader as CpnpReader, ReaderOptions},
-    serialize::OwnedSegments,
+use crate::rdd::EcallPool;
+use crate::scheduler::{
+    read_frame, result_message, with_binary, write_frame, BinaryMirror, EncodedBinary, TaskOption,
+    TaskResult, CREDITS_PER_SLOT,
 };
+use crate::serialized_data_capnp::serialized_data;
+use crate::trace;
+use crate::transitions;
+use capnp::message::{Builder as MsgBuilder, HeapAllocator, ReaderOptions};
 use capnp_futures::serialize as capnp_serialize;
 use crossbeam::{channel::bounded, Receiver, Sender};
+use futures::io::{AsyncWrite, AsyncWriteExt, BufWriter};
+use hyper::StatusCode;
+use once_cell::sync::Lazy;
 use serde::{Deserialize, Serialize};
 use tokio::{
-    net::TcpListener,
+    net::{TcpListener, TcpStream},
+    runtime::Handle,
+    sync::mpsc,
     task::{spawn, spawn_blocking},
     time::sleep,
 };
-use tokio_stream::StreamExt;
 use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
 
 const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
@@ -26,6 +34,14 @@ const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
     nesting_limit: 64,
 };
 
+/// Host threads the tasks of the executor run on, instead of the blocking pool of the runtime,
+/// which starts a thread for every task of a burst. There are as many as the driver keeps tasks
+/// in flight on a channel, the credit of the stage holders: the tasks past the holders wait for
+/// the stage lock on a thread, a reduce task may wait there for a map task of the same executor,
+/// and the tasks of another channel wait in the queue.
+static TASK_POOL: Lazy<EcallPool> =
+    Lazy::new(|| EcallPool::new(env::Configuration::get().max_stage_holders() * CREDITS_PER_SLOT));
+
 pub(crate) struct Executor {
     port: u16,
 }
@@ -60,116 +76,231 @@ impl Executor {
         let mut listener = TcpListener::bind(addr)
             .await
             .map_err(NetworkError::TcpListener)?;
-        while let Ok((mut stream, _)) = listener.accept().await {
-            let rcv_main = rcv_main.clone();
-            let selfc = Arc::clone(&self);
-            let res: Result<Signal> = spawn(async move {
-                let (reader, writer) = stream.into_split();
-                let mut reader = reader.compat();
-                let mut writer = writer.compat_write();
-                match rcv_main.try_recv() {
-                    Ok(Signal::ShutDownError) => {
-                        log::info!("shutting down executor @{} due to error", selfc.port);
-                        return Err(Error::ExecutorShutdown);
-                    }
-                    Ok(Signal::ShutDownGracefully) => {
-                        log::info!("shutting down executor @{} gracefully", selfc.port);
-                        return Ok(Signal::ShutDownGracefully);
-                    }
-                    _ => {}
+        let (channel_done, mut channels_done) = mpsc::unbounded_channel::<Result<Signal>>();
+        loop {
+            tokio::select! {
+                accepted = listener.accept() => {
+                    let (stream, _) = match accepted {
+                        Ok(accepted) => accepted,
+                        Err(_) => break,
+                    };
+                    log::debug!("new task channel @{} executor", self.port);
+                    let selfc = Arc::clone(&self);
+                    let rcv_main = rcv_main.clone();
+                    let channel_done = channel_done.clone();
+                    spawn(async move {
+                        let _ = channel_done.send(selfc.serve_channel(stream, rcv_main).await);
+                    });
                 }
-                let port = selfc.port;
-                log::debug!("received new task @{} executor", port);
-                let message = {
-                    let message_reader = capnp_serialize::read_message(&mut reader, CAPNP_BUF_READ_OPTS).await?;
-                    spawn_blocking(move || -> Result<_> {
-                        let des_task = selfc.deserialize_task(message_reader)?;
-                        selfc.run_task(des_task)
-                    })
-                    .await??
-                };
-                capnp_serialize::write_message(&mut writer, message).await
-                    .map_err(Error::CapnpDeserialization)
-                    .unwrap();
-                log::debug!("sent result data to driver");
-                Ok(Signal::Continue)
-            })
-            .await?;
-            match res {
-                Ok(Signal::Continue) => continue,
-                Ok(s) => return Ok(s),
-                Err(s) => return Err(s),
+                Some(res) = channels_done.recv() => match res {
+                    Ok(Signal::Continue) => continue,
+                    Ok(s) => return Ok(s),
+                    Err(s) => return Err(s),
+                },
             }
         }
         Err(Error::ExecutorShutdown)
     }
 
-    #[allow(clippy::drop_copy)]
+    /// Serves one task channel of the driver: every task of a launch frame runs as soon as it
+    /// arrives, and the results go back batched, as many per frame as have finished meanwhile.
+    /// The driver bounds the tasks in flight with its credit.
+    async fn serve_channel(
+        self: Arc<Self>,
+        stream: TcpStream,
+        rcv_main: Receiver<Signal>,
+    ) -> Result<Signal> {
+        stream.set_nodelay(true).map_err(NetworkError::TcpListener)?;
+        let (reader, writer) = stream.into_split();
+        let reader = reader.compat();
+        // The results of a batch go out in one write.
+        let mut writer = BufWriter::new(writer.compat_write());
+        let (finished, mut results) =
+            mpsc::unbounded_channel::<Result<MsgBuilder<HeapAllocator>>>();
+        let receiving = spawn(Arc::clone(&self).receive_launches(reader, finished, rcv_main));
+        while let Some(first) = results.recv().await {
+            write_frame(&mut writer, first?).await?;
+            let mut num_results = 1;
+            while let Ok(result) = results.try_recv() {
+                write_frame(&mut writer, result?).await?;
+                num_results += 1;
+            }
+            writer.flush().await.map_err(NetworkError::TcpListener)?;
+            log::debug!("sent {} results to driver", num_results);
+        }
+        receiving.await?
+    }
+
+    /// Runs the tasks of the launch frames on `reader` until the driver hangs up. The binaries
+    /// of the stages are kept for the later tasks of the stages as the driver does, see
+    /// `StageBinary`.
+    async fn receive_launches<R>(
+        self: Arc<Self>,
+        mut reader: R,
+        finished: mpsc::UnboundedSender<Result<MsgBuilder<HeapAllocator>>>,
+        rcv_main: Receiver<Signal>,
+    ) -> Result<Signal>
+    where
+        R: futures::io::AsyncRead + Unpin,
+    {
+        let mut held = BinaryMirror::new();
+        loop {
+            let frame = match read_frame(&mut reader).await {
+                Ok(frame) => frame,
+                Err(_) => return Ok(Signal::Continue),
+            };
+            match rcv_main.try_recv() {
+                Ok(Signal::ShutDownError) => {
+                    log::info!("shutting down executor @{} due to error", self.port);
+                    return Err(Error::ExecutorShutdown);
+                }
+                Ok(Signal::ShutDownGracefully) => {
+                    log::info!("shutting down executor @{} gracefully", self.port);
+                    return Ok(Signal::ShutDownGracefully);
+                }
+                _ => {}
+            }
+            if !frame.is_launch()? {
+                log::warn!("driver sent a result frame to executor @{}", self.port);
+                continue;
+            }
+            let frame = Arc::new(frame);
+            let num_tasks = frame.len()?;
+            log::debug!("received {} new tasks @{} executor", num_tasks, self.port);
+            for index in 0..num_tasks {
+                // In frame order, the bytes of a binary come before the tasks that only refer to
+                // it.
+                let binary = match frame.binary(index)? {
+                    Some((key, Some(bytes))) => {
+                        let bytes = Arc::new(bytes.to_vec());
+                        held.insert(key, bytes.clone());
+                        Some(EncodedBinary { key, bytes })
+                    }
+                    Some((key, None)) => held.get(&key).map(|bytes| EncodedBinary {
+                        key,
+                        bytes: bytes.clone(),
+                    }),
+                    None => None,
+                };
+                let selfc = Arc::clone(&self);
+                let frame = Arc::clone(&frame);
+                let finished = finished.clone();
+                // The workers are not runtime threads, the fetches of a task block on this runtime.
+                let runtime = Handle::current();
+                TASK_POOL.spawn(move || {
+                    let _runtime = runtime.enter();
+                    // The task is deserialized straight from the segments of the frame.
+                    let result = frame.payload(index).and_then(|(seq, task_bytes)| {
+                        let des_task = selfc.deserialize_task(task_bytes, binary)?;
+                        selfc.run_task(seq, des_task)
+                    });
+                    let _ = finished.send(result);
+                });
+            }
+        }
+    }
+
+    /// A task whose binary did not come fails to deserialize, the driver then sends it again
+    /// over a new channel.
     fn deserialize_task(
         self: &Arc<Self>,
-        message_reader: CpnpReader<OwnedSegments>,
+        msg: &[u8],
+        binary: Option<EncodedBinary>,
     ) -> Result<TaskOption> {
         let start = Instant::now();
-        let task_data = message_reader.get_root::<serialized_data::Reader>()?;
-        let msg = match task_data.get_msg() {
-            Ok(s) => {
-                log::debug!("got the task message in executor {}", self.port);
-                s
-            }
-            Err(e) => {
-                log::debug!("problem while getting the task in executor: {:?}", e);
-                return Err(Error::CapnpDeserialization(e));
-            }
-        };
+        let des_task = with_binary(binary, || bincode::deserialize::<TaskOption>(msg))?;
         log::debug!(
-            "deserialized data task @{} executor with {} bytes, took {}ms",
+            "deserialized task at executor @{} with id #{} of {} bytes, took {}ms",
             self.port,
+            des_task.get_task_id(),
             msg.len(),
-            start.elapsed().as_millis()
+            start.elapsed().as_millis(),
+        );
+        Ok(des_task)
+    }
+
+    fn run_task(
+        self: &Arc<Self>,
+        seq: u64,
+        des_task: TaskOption,
+    ) -> Result<MsgBuilder<HeapAllocator>> {
+        // Run execution + serialization in parallel in the executor threadpool
+        let start = Instant::now();
+        let received = trace::now_us();
+        log::debug!("executing the task from server port {}", self.port);
+        let tc_stats_before = env::Env::get().get_tc_stats();
+        let transitions_before = transitions::snapshot();
+        // Map outputs lost since the locations were cached are only known from the generation
+        // the driver sent the task with.
+        if let Some(generation) = des_task.generation() {
+            env::Env::get().map_output_tracker.update_generation(generation);
+        }
+        // TODO: change attempt id from 0 to proper value
+        let task_span = trace::span(format!("task #{}", des_task.get_task_id()), "task");
+        let result = des_task.run(0);
+        drop(task_span);
+        // Before the result goes out, the partitions the task cached outlive a restart already.
+        env::BOUNDED_MEM_CACHE.persist();
+        log::debug!(
+            "time taken @{} executor running task #{}: {}ms",
+            self.port,
+            des_task.get_task_id(),
+            start.elapsed().as_millis(),
+        );
+        let tc_stats = env::Env::get().get_tc_stats();
+        log::info!(
+            "outside memory @{} executor after task #{}: {}, heap grew by {:.1} MB",
+            self.port,
+            des_task.get_task_id(),
+            tc_stats,
+            (tc_stats.system_bytes as f64 - tc_stats_before.system_bytes as f64) / 1048576.0,
+        );
+        log::debug!(
+            "free bytes by size class @{} executor after task #{}: {:?}",
+            self.port,
+            des_task.get_task_id(),
+            tc_stats.free_bytes_by_class(),
+        );
+        log::info!(
+            "enclave transitions @{} executor during task #{}: {}",
+            self.port,
+            des_task.get_task_id(),
+            transitions::snapshot().since(&transitions_before),
         );
-        std::mem::drop(task_data);
         let start = Instant::now();
-        let des_task: TaskOption = bincode::deserialize(&msg)?;
+        let result = self
+            .stash_large_result(des_task.get_task_id(), result)?
+            .with_extras(
+                crate::metrics::take_pending(),
+                trace::task_trace(self.port as u32, received),
+            );
+        let message = result_message(seq, &result)?;
+        let dur = start.elapsed().as_nanos() as f64 * 1e-9;
+        println!("executore serialize task result time: {:?} s", dur);
         log::debug!(
-            "deserialized task at executor @{} with id #{}, deserialization, took {}ms",
+            "time taken @{} executor serializing task #{} result: {}ms",
             self.port,
             des_task.get_task_id(),
             start.elapsed().as_millis(),
         );
-        Ok(des_task)
+        Ok(message)
     }
 
-    fn run_task(self: &Arc<Self>, des_task: TaskOption) -> Result<MsgBuilder<HeapAllocator>> {
-        // Run execution + serialization in parallel in the executor threadpool
-        let result: Result<Vec<u8>> = {
-            let start = Instant::now();
-            log::debug!("executing the task from server port {}", self.port);
-            // TODO: change attempt id from 0 to proper value
-            let result = des_task.run(0);
-            log::debug!(
-                "time taken @{} executor running task #{}: {}ms",
-                self.port,
-                des_task.get_task_id(),
-                start.elapsed().as_millis(),
-            );
-            let start = Instant::now();
-            let result = bincode::serialize(&result)?;
-            let dur = start.elapsed().as_nanos() as f64 * 1e-9;
-            println!("executore serialize task result time: {:?} s", dur);
-            log::debug!(
-                "time taken @{} executor serializing task #{} result of size {} bytes: {}ms",
-                self.port,
-                des_task.get_task_id(),
-                result.len(),
-                start.elapsed().as_millis(),
-            );
-            Ok(result)
-        };
-
-        let mut message = capnp::message::Builder::new_default();
-        let mut task_data = message.init_root::<serialized_data::Builder>();
-        task_data.set_msg(&(result?));
-        Ok(message)
+    /// Leaves a result of a result task larger than `max_direct_result_bytes` with the shuffle
+    /// server, and returns the handle the driver fetches it with in its place.
+    fn stash_large_result(&self, task_id: usize, result: TaskResult) -> Result<TaskResult> {
+        if let TaskResult::ResultTask(_) = result {
+            let len = bincode::serialized_size(&result)? as usize;
+            if len > env::Configuration::get().max_direct_result_bytes {
+                env::SHUFFLE_STORE.put_task_result(task_id, bincode::serialize(&result)?.into());
+                return Ok(TaskResult::Indirect {
+                    server_uri: env::Env::get().shuffle_manager.get_server_uri(),
+                    task_id,
+                    len,
+                });
+            }
+        }
+        Ok(result)
     }
 
     /// A listener for exit signal from master to end the whole slave process.
@@ -181,8 +312,9 @@ impl Executor {
             .map_err(NetworkError::TcpListener)?;
         let mut signal: Result<Signal> = Err(Error::ExecutorShutdown);
         while let Ok((mut stream, _)) = listener.accept().await {
-            let stream = stream.compat();
-            let signal_data = capnp_serialize::read_message(stream, CAPNP_BUF_READ_OPTS).await?;
+            let mut stream = stream.compat();
+            let signal_data =
+                capnp_serialize::read_message(&mut stream, CAPNP_BUF_READ_OPTS).await?;
             let data = bincode::deserialize::<Signal>(
                 signal_data
                     .get_root::<serialized_data::Reader>()?
@@ -206,6 +338,22 @@ impl Executor {
                     signal = Ok(Signal::ShutDownGracefully);
                     break;
                 }
+                Signal::Attach(fingerprint) => {
+                    let attached = spawn_blocking(Context::executor_fingerprint).await??;
+                    let attached = attached == fingerprint;
+                    log::info!("attach of a driver @ {}: {}", self.port, attached);
+                    Executor::reply(&mut stream, &attached).await?;
+                }
+                Signal::Status => {
+                    let ready = spawn_blocking(|| env::Env::get().shuffle_manager.check_status())
+                        .await?
+                        .map_or(false, |status| status == StatusCode::OK);
+                    Executor::reply(&mut stream, &ready).await?;
+                }
+                Signal::EndJob => {
+                    log::info!("received end of job signal @ {}", self.port);
+                    spawn_blocking(Context::end_job_on_executor).await?;
+                }
                 _ => {}
             }
         }
@@ -213,6 +361,20 @@ impl Executor {
         sleep(Duration::from_millis(1_000)).await;
         signal
     }
+
+    /// Answers a signal that expects a reply, see `Context::ask_executor`.
+    async fn reply<W, R>(stream: &mut W, reply: &R) -> Result<()>
+    where
+        W: AsyncWrite + Unpin,
+        R: Serialize,
+    {
+        let mut message = MsgBuilder::new_default();
+        let mut data = message.init_root::<serialized_data::Builder>();
+        data.set_msg(&bincode::serialize(reply)?);
+        write_frame(stream, message).await?;
+        stream.flush().await.map_err(NetworkError::TcpListener)?;
+        Ok(())
+    }
 }
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -220,6 +382,13 @@ pub(crate) enum Signal {
     ShutDownError,
     ShutDownGracefully,
     Continue,
+    /// A driver that would deploy the executor with this fingerprint runs its job on it, see
+    /// `Context::attach_executor`.
+    Attach(u64),
+    /// The job ended, an executor daemon waits for the next one.
+    EndJob,
+    /// Whether the executor is up, i.e. its shuffle server answers.
+    Status,
 }
 
 #[cfg(test)]
@@ -227,7 +396,7 @@ mod tests {
     #![allow(unused_must_use)]
 
     use super::*;
-    use crate::scheduler::{TaskContext, TaskResult};
+    use crate::scheduler::{launch_message, Launch, ReceivedFrame, TaskContext};
     use crate::utils::{get_dynamic_port, test_utils::create_test_task};
     use crate::Fn;
     use crossbeam::channel::{unbounded, Receiver, Sender};
@@ -341,9 +510,13 @@ mod tests {
             });
             let mock_task: TaskOption = create_test_task(func).into();
             let ser_task = bincode::serialize(&mock_task)?;
-            let mut message = capnp::message::Builder::new_default();
-            let mut msg_data = message.init_root::<serialized_data::Builder>();
-            msg_data.set_msg(&ser_task);
+            let binary = mock_task.binary().unwrap();
+            let message = launch_message(&[Launch {
+                seq: 7,
+                task_bytes: Arc::new(ser_task),
+                binary: Some(binary.key),
+                binary_bytes: Some(binary.bytes),
+            }]);
             let mut buf = Vec::new();
             capnp::serialize::write_message(&mut buf, &message).map_err(Error::OutputWrite)?;
 
@@ -365,9 +538,15 @@ mod tests {
                     if let Ok(res) =
                         capnp::serialize::read_message(&mut stream, CAPNP_BUF_READ_OPTS)
                     {
-                        let task_data = res.get_root::<serialized_data::Reader>().unwrap();
+                        let frame = ReceivedFrame::from(res);
                         let now = Instant::now();
-                        match bincode::deserialize::<TaskResult>(&*task_data.get_msg().unwrap())? {
+                        if frame.is_launch()? {
+                            return Err(Error::DowncastFailure("incorrect task frame"));
+                        }
+                        assert_eq!(frame.len()?, 1);
+                        let (seq, result) = frame.payload(0)?;
+                        assert_eq!(seq, 7);
+                        match bincode::deserialize::<TaskResult>(result)?.split_extras().0 {
                             TaskResult::ResultTask(_) => {}
                             _ => return Err(Error::DowncastFailure("incorrect task result")),
                         }
@@ -0,0 +1,105 @@
+//! Host side of the enclave heap profiler.
+//!
+//! The tcmalloc that manages the enclave's outside memory samples roughly one
+//! allocation every `period` bytes and ships the enclave stack of each sample
+//! out through `ocall_heap_profile_sample`. Frames are offsets from the enclave
+//! base; the outermost frame is the OpId hash of the operator that allocated.
+//! Samples are aggregated here and written in the legacy gperftools heap format
+//! on shutdown, so the result can be read with
+//! `pprof --alloc_space <enclave.so> <profile>`.
+//!
+//! Frees are not tracked, so the profile holds cumulative allocations rather
+//! than live memory.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+
+use crate::env::{Configuration, Env};
+use crate::transitions::{self, Site};
+use once_cell::sync::Lazy;
+
+pub(crate) const DEFAULT_HEAP_PROFILE_PERIOD: u64 = 512 * 1024;
+
+/// stack (tag last) -> (sampled allocations, sampled bytes)
+static SAMPLES: Lazy<Mutex<HashMap<Vec<u64>, (u64, u64)>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+#[no_mangle]
+pub unsafe extern "C" fn ocall_heap_profile_sample(frames: *const u64, depth: usize, size: usize) {
+    let _timed = transitions::time(Site::OcallHeapProfileSample);
+    if frames.is_null() || depth == 0 {
+        return;
+    }
+    let stack = std::slice::from_raw_parts(frames, depth).to_vec();
+    let mut samples = SAMPLES.lock().unwrap();
+    let entry = samples.entry(stack).or_insert((0, 0));
+    entry.0 += 1;
+    entry.1 += size as u64;
+}
+
+/// Sampled bytes per operator, largest first.
+pub(crate) fn bytes_by_op() -> Vec<(u64, u64, u64)> {
+    let mut by_op: HashMap<u64, (u64, u64)> = HashMap::new();
+    for (stack, (count, bytes)) in SAMPLES.lock().unwrap().iter() {
+        let entry = by_op.entry(*stack.last().unwrap()).or_insert((0, 0));
+        entry.0 += count;
+        entry.1 += bytes;
+    }
+    let mut by_op = by_op
+        .into_iter()
+        .map(|(tag, (count, bytes))| (tag, count, bytes))
+        .collect::<Vec<_>>();
+    by_op.sort_by(|a, b| b.2.cmp(&a.2));
+    by_op
+}
+
+/// Writes the profile to `<prefix>.<pid>.heap` if VEGA_HEAP_PROFILE is set.
+/// Must be called before the enclave is destroyed.
+pub(crate) fn dump_if_enabled() {
+    let conf = Configuration::get();
+    let prefix = match &conf.heap_profile {
+        Some(prefix) => prefix,
+        None => return,
+    };
+    let path = PathBuf::from(format!("{}.{}.heap", prefix.display(), std::process::id()));
+    for (tag, count, bytes) in bytes_by_op().into_iter().take(10) {
+        log::info!("heap profile: op {} sampled {} allocations, {} bytes", tag, count, bytes);
+    }
+    match write_profile(&path, conf.heap_profile_period, &Env::get().enclave_path) {
+        Ok(()) => log::info!("heap profile written to {:?}", path),
+        Err(err) => log::error!("failed writing heap profile to {:?}: {}", path, err),
+    }
+}
+
+fn write_profile(path: &Path, period: u64, enclave_path: &Path) -> std::io::Result<()> {
+    let samples = SAMPLES.lock().unwrap();
+    let (total_count, total_bytes) = samples
+        .values()
+        .fold((0, 0), |acc, v| (acc.0 + v.0, acc.1 + v.1));
+    let mut out = BufWriter::new(File::create(path)?);
+    writeln!(
+        out,
+        "heap profile: {:6}: {:8} [{:6}: {:8}] @ heap_v2/{}",
+        total_count, total_bytes, total_count, total_bytes, period
+    )?;
+    for (stack, (count, bytes)) in samples.iter() {
+        write!(out, "{:6}: {:8} [{:6}: {:8}] @", count, bytes, count, bytes)?;
+        for frame in stack {
+            write!(out, " {:#018x}", frame)?;
+        }
+        writeln!(out)?;
+    }
+    // frames are relative to the enclave base, so map the image at 0
+    let image_size = std::fs::metadata(enclave_path).map(|m| m.len()).unwrap_or(0);
+    writeln!(out, "\nMAPPED_LIBRARIES:")?;
+    writeln!(
+        out,
+        "00000000-{:08x} r-xp 00000000 00:00 0 {}",
+        image_size,
+        enclave_path.display()
+    )?;
+    out.flush()
+}
@@ -0,0 +1,93 @@
+use std::fs::File;
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::sync::Arc;
+use std::thread;
+
+use crossbeam::channel::{unbounded, Sender};
+use once_cell::sync::Lazy;
+use tokio::sync::oneshot;
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// Positioned reads of local files for the async executor.
+pub(crate) static DISK_IO: Lazy<DiskIo> =
+    Lazy::new(|| DiskIo::new(num_cpus::get().max(2).min(8)));
+
+/// Threads the disk reads of the async executor complete on.
+///
+/// A read goes to the device as soon as it is submitted, as a readahead of its range the kernel
+/// starts in the background, and is then copied out of the page cache by one of a few threads.
+/// So many reads are in flight at the disk at once, and none of them holds a blocking thread of
+/// the runtime while it waits for it.
+pub(crate) struct DiskIo {
+    jobs: Sender<Job>,
+}
+
+/// Asks the kernel to start reading `len` bytes at `offset` of `file` into the page cache.
+pub(crate) fn advise_will_need(file: &File, offset: u64, len: usize) {
+    unsafe {
+        libc::posix_fadvise(
+            file.as_raw_fd(),
+            offset as libc::off_t,
+            len as libc::off_t,
+            libc::POSIX_FADV_WILLNEED,
+        );
+    }
+}
+
+impl DiskIo {
+    pub fn new(num_threads: usize) -> Self {
+        let (jobs, queue) = unbounded::<Job>();
+        for i in 0..num_threads.max(1) {
+            let queue = queue.clone();
+            thread::Builder::new()
+                .name(format!("disk-io-{}", i))
+                .spawn(move || {
+                    for job in queue {
+                        job();
+                    }
+                })
+                .unwrap();
+        }
+        DiskIo { jobs }
+    }
+
+    /// Reads `len` bytes at `offset` of `file`.
+    pub async fn read_at(&self, file: Arc<File>, offset: u64, len: usize) -> io::Result<Vec<u8>> {
+        advise_will_need(&file, offset, len);
+        let (done, read) = oneshot::channel();
+        let job: Job = Box::new(move || {
+            let mut buf = vec![0; len];
+            let res = file.read_exact_at(&mut buf, offset).map(|_| buf);
+            let _ = done.send(res);
+        });
+        self.jobs
+            .send(job)
+            .map_err(|_| io::Error::new(io::ErrorKind::Other, "disk io threads exited"))?;
+        read.await
+            .unwrap_or_else(|_| Err(io::Error::new(io::ErrorKind::Other, "disk read dropped")))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn reads_at_offsets() -> io::Result<()> {
+        let path = std::env::temp_dir().join(format!("disk_io_test_{}", std::process::id()));
+        std::fs::write(&path, (0..=255u8).collect::<Vec<_>>())?;
+        let file = Arc::new(File::open(&path)?);
+        let disk_io = DiskIo::new(2);
+        let (a, b) = tokio::join!(
+            disk_io.read_at(file.clone(), 10, 3),
+            disk_io.read_at(file.clone(), 250, 6)
+        );
+        assert_eq!(a?, vec![10, 11, 12]);
+        assert_eq!(b?, vec![250, 251, 252, 253, 254, 255]);
+        assert!(disk_io.read_at(file, 250, 7).await.is_err());
+        std::fs::remove_file(&path)
+    }
+}
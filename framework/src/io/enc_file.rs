@@ -0,0 +1,387 @@
+use std::fs::{self, File};
+use std::io::{self, BufWriter, IoSlice, Write};
+use std::ops::Range;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+
+use crate::rdd::{enc_block_chunks, ser_encrypt_counted, ser_encrypt_stats, ItemE};
+use crate::serializable_traits::Data;
+use serde_derive::{Deserialize, Serialize};
+
+const MAGIC: &[u8; 8] = b"VEGAENC1";
+const FOOTER_LEN: u64 = 8 + MAGIC.len() as u64;
+/// Leads a block handed to the enclave with its statistics. It is a nonce no block is sealed under,
+/// the counter of a nonce never reaches `u32::MAX`.
+const STATS_MARK: [u8; 12] = [0xff; 12];
+/// Buffers in one vectored write at most, the IOV_MAX of Linux.
+const MAX_IOVECS: usize = 1024;
+
+/// Where every block of a file is, with its statistics.
+#[derive(Serialize, Deserialize, Default)]
+struct EncIndex {
+    blocks: Vec<BlockMeta>,
+}
+
+#[derive(Serialize, Deserialize)]
+struct BlockMeta {
+    offset: u64,
+    len: u64,
+    stats: Option<ItemE>,
+}
+
+/// Min and max of a key over the items of a block, the statistics `filter_by_stats` of the
+/// enclave reads as its `MinMax`.
+#[derive(Clone, Debug, PartialEq, Serialize, Deserialize)]
+pub struct MinMax<K> {
+    pub min: K,
+    pub max: K,
+}
+
+impl<K: PartialOrd + Clone> MinMax<K> {
+    /// None if there are no keys.
+    pub fn of<'a, I>(keys: I) -> Option<Self>
+    where
+        I: IntoIterator<Item = &'a K>,
+        K: 'a,
+    {
+        let mut keys = keys.into_iter();
+        let first = keys.next()?;
+        let (mut min, mut max) = (first, first);
+        for key in keys {
+            if *key < *min {
+                min = key;
+            }
+            if *key > *max {
+                max = key;
+            }
+        }
+        Some(MinMax {
+            min: min.clone(),
+            max: max.clone(),
+        })
+    }
+}
+
+/// A block with its encrypted statistics in front, as the enclave reads it:
+///
+/// ```text
+/// STATS_MARK | stats_len: u32 | stats | block
+/// ```
+fn frame_with_stats(block: &[u8], stats: &[u8]) -> ItemE {
+    let mut framed = Vec::with_capacity(STATS_MARK.len() + 4 + stats.len() + block.len());
+    framed.extend_from_slice(&STATS_MARK);
+    framed.extend_from_slice(&(stats.len() as u32).to_le_bytes());
+    framed.extend_from_slice(stats);
+    framed.extend_from_slice(block);
+    framed
+}
+
+impl EncIndex {
+    /// The index and the footer after it.
+    fn encode(&self) -> io::Result<(Vec<u8>, [u8; FOOTER_LEN as usize])> {
+        let index = bincode::serialize(self).map_err(|e| invalid(&e.to_string()))?;
+        let mut footer = [0; FOOTER_LEN as usize];
+        footer[..8].copy_from_slice(&(index.len() as u64).to_le_bytes());
+        footer[8..].copy_from_slice(MAGIC);
+        Ok((index, footer))
+    }
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg.to_string())
+}
+
+/// Writes an encrypted block file, the blocks in the order they are pushed.
+pub struct EncFileWriter<W: Write> {
+    out: W,
+    offset: u64,
+    index: EncIndex,
+}
+
+impl EncFileWriter<BufWriter<File>> {
+    pub fn create<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        EncFileWriter::new(BufWriter::new(File::create(path)?))
+    }
+}
+
+impl<W: Write> EncFileWriter<W> {
+    pub fn new(mut out: W) -> io::Result<Self> {
+        out.write_all(MAGIC)?;
+        Ok(EncFileWriter {
+            out,
+            offset: MAGIC.len() as u64,
+            index: EncIndex::default(),
+        })
+    }
+
+    /// Appends a block that is already encrypted, with the statistics of its items if there are
+    /// any, encrypted for the block by `ser_encrypt_stats`.
+    pub fn push_block(&mut self, block: &[u8], stats: Option<ItemE>) -> io::Result<()> {
+        self.out.write_all(block)?;
+        self.index.blocks.push(BlockMeta {
+            offset: self.offset,
+            len: block.len() as u64,
+            stats,
+        });
+        self.offset += block.len() as u64;
+        Ok(())
+    }
+
+    /// Encrypts `items` into blocks cut the way `batch_encrypt` cuts them, each with `stats` of
+    /// its items encrypted under the same key and bound to the block.
+    pub fn push_items<T, S, F>(&mut self, items: &[T], stats: F) -> io::Result<()>
+    where
+        T: Data,
+        S: Data,
+        F: Fn(&[T]) -> S,
+    {
+        for chunk in enc_block_chunks(items) {
+            let block = ser_encrypt_counted(chunk);
+            let stats = ser_encrypt_stats(&stats(chunk), &block);
+            self.push_block(&block, Some(stats))?;
+        }
+        Ok(())
+    }
+
+    pub fn num_blocks(&self) -> usize {
+        self.index.blocks.len()
+    }
+
+    /// Writes the index and returns the writer, flushed.
+    pub fn finish(mut self) -> io::Result<W> {
+        let (index, footer) = self.index.encode()?;
+        self.out.write_all(&index)?;
+        self.out.write_all(&footer)?;
+        self.out.flush()?;
+        Ok(self.out)
+    }
+}
+
+/// An open file of encrypted blocks, each with the encrypted statistics of its items:
+///
+/// ```text
+/// magic | block 0 | ... | block n-1 | index | index_len: u64 | magic
+/// ```
+///
+/// The blocks are the ciphertexts the enclave reads (see `batch_encrypt`), back to back. The
+/// index is bincode, it holds where every block is and its statistics, so a reader seeks to the
+/// blocks it needs instead of walking the file. The statistics are whatever the writer computed
+/// of the items of a block, min and max of its columns say, sealed like the block itself: the
+/// host keeps them next to the block but only the enclave can read them.
+///
+/// The index is loaded when the file is opened. The enclave gets the blocks with their
+/// statistics in front (see `read_framed_blocks`), and the filters that know them skip the blocks
+/// none of whose items pass without decrypting those.
+pub struct EncFile {
+    file: File,
+    index: EncIndex,
+}
+
+impl EncFile {
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        EncFile::from_file(File::open(path)?)?
+            .ok_or_else(|| invalid("not an encrypted block file"))
+    }
+
+    /// None if `file` does not start with the magic of the format.
+    pub fn from_file(file: File) -> io::Result<Option<Self>> {
+        let size = file.metadata()?.len();
+        let mut magic = [0; MAGIC.len()];
+        if size < MAGIC.len() as u64 + FOOTER_LEN {
+            return Ok(None);
+        }
+        file.read_exact_at(&mut magic, 0)?;
+        if &magic != MAGIC {
+            return Ok(None);
+        }
+        let mut footer = [0; FOOTER_LEN as usize];
+        file.read_exact_at(&mut footer, size - FOOTER_LEN)?;
+        if &footer[8..] != MAGIC {
+            return Err(invalid("truncated encrypted block file"));
+        }
+        let mut word = [0; 8];
+        word.copy_from_slice(&footer[..8]);
+        let index_len = u64::from_le_bytes(word);
+        let blocks_end = (size - FOOTER_LEN)
+            .checked_sub(index_len)
+            .filter(|end| *end >= MAGIC.len() as u64)
+            .ok_or_else(|| invalid("bad index length"))?;
+        let mut index = vec![0; index_len as usize];
+        file.read_exact_at(&mut index, blocks_end)?;
+        let index: EncIndex =
+            bincode::deserialize(&index).map_err(|e| invalid(&e.to_string()))?;
+        if index
+            .blocks
+            .iter()
+            .any(|block| block.offset.checked_add(block.len).map_or(true, |end| end > blocks_end))
+        {
+            return Err(invalid("block past the end of the blocks"));
+        }
+        Ok(Some(EncFile { file, index }))
+    }
+
+    pub fn num_blocks(&self) -> usize {
+        self.index.blocks.len()
+    }
+
+    /// The encrypted statistics of block `i`, None if it was written without.
+    pub fn stats(&self, i: usize) -> Option<&ItemE> {
+        self.index.blocks[i].stats.as_ref()
+    }
+
+    /// The blocks that start in the bytes `[start, end)` of the file.
+    pub fn blocks_between(&self, start: u64, end: u64) -> Range<usize> {
+        let blocks = &self.index.blocks;
+        let first = blocks.partition_point(|block| block.offset < start);
+        let last = blocks.partition_point(|block| block.offset < end);
+        first..last.max(first)
+    }
+
+    /// The blocks in `range`, read with one read as they are back to back.
+    pub fn read_blocks(&self, range: Range<usize>) -> io::Result<Vec<ItemE>> {
+        let blocks = &self.index.blocks[range];
+        let (first, last) = match (blocks.first(), blocks.last()) {
+            (Some(first), Some(last)) => (first, last),
+            _ => return Ok(Vec::new()),
+        };
+        let mut bytes = vec![0; (last.offset + last.len - first.offset) as usize];
+        self.file.read_exact_at(&mut bytes, first.offset)?;
+        Ok(blocks
+            .iter()
+            .map(|block| {
+                let start = (block.offset - first.offset) as usize;
+                bytes[start..start + block.len as usize].to_vec()
+            })
+            .collect())
+    }
+
+    /// The blocks in `range` as the enclave reads them, each with its statistics in front if it
+    /// has any.
+    pub fn read_framed_blocks(&self, range: Range<usize>) -> io::Result<Vec<ItemE>> {
+        let start = range.start;
+        let mut blocks = self.read_blocks(range)?;
+        for (i, block) in blocks.iter_mut().enumerate() {
+            if let Some(stats) = self.stats(start + i) {
+                *block = frame_with_stats(block, stats);
+            }
+        }
+        Ok(blocks)
+    }
+}
+
+/// Writes the blocks of a partition as the file `part-{split_id}` of the directory `path`.
+///
+/// The blocks are written from the buffers they came in, many to a vectored write, into a
+/// temporary file renamed into place once it is synced, so a task that fails or runs again
+/// never leaves a partial file behind.
+pub(crate) fn save_partition<I>(path: &str, split_id: usize, blocks: I) -> io::Result<()>
+where
+    I: Iterator<Item = ItemE>,
+{
+    let blocks = blocks.collect::<Vec<_>>();
+    let mut index = EncIndex::default();
+    let mut offset = MAGIC.len() as u64;
+    for block in &blocks {
+        index.blocks.push(BlockMeta {
+            offset,
+            len: block.len() as u64,
+            stats: None,
+        });
+        offset += block.len() as u64;
+    }
+    let (index, footer) = index.encode()?;
+    let mut parts: Vec<&[u8]> = Vec::with_capacity(blocks.len() + 3);
+    parts.push(MAGIC);
+    parts.extend(blocks.iter().map(|block| block.as_slice()));
+    parts.push(&index);
+    parts.push(&footer);
+
+    fs::create_dir_all(path)?;
+    let dir = Path::new(path);
+    let tmp_path = dir.join(format!(".part-{}.{:x}", split_id, rand::random::<u64>()));
+    let written = File::create(&tmp_path).and_then(|mut file| {
+        write_all_vectored(&mut file, &parts)?;
+        file.sync_data()
+    });
+    match written.and_then(|_| fs::rename(&tmp_path, dir.join(format!("part-{}", split_id)))) {
+        Ok(()) => Ok(()),
+        Err(e) => {
+            let _ = fs::remove_file(&tmp_path);
+            Err(e)
+        }
+    }
+}
+
+/// Writes all of `parts` in order, at most `MAX_IOVECS` of them to a write.
+fn write_all_vectored<W: Write>(out: &mut W, parts: &[&[u8]]) -> io::Result<()> {
+    let non_empty = parts
+        .iter()
+        .copied()
+        .filter(|part| !part.is_empty())
+        .collect::<Vec<_>>();
+    let mut parts = &non_empty[..];
+    // Bytes of the first part that are written already.
+    let mut skip = 0;
+    while !parts.is_empty() {
+        let slices = parts
+            .iter()
+            .take(MAX_IOVECS)
+            .enumerate()
+            .map(|(i, part)| IoSlice::new(if i == 0 { &part[skip..] } else { *part }))
+            .collect::<Vec<_>>();
+        let mut written = match out.write_vectored(&slices) {
+            Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+            Ok(written) => written,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+        while !parts.is_empty() && written >= parts[0].len() - skip {
+            written -= parts[0].len() - skip;
+            parts = &parts[1..];
+            skip = 0;
+        }
+        skip += written;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn blocks_and_stats_round_trip() -> io::Result<()> {
+        let path = std::env::temp_dir().join(format!("enc_file_test_{}", std::process::id()));
+        let mut writer = EncFileWriter::create(&path)?;
+        writer.push_block(&[1, 2, 3], Some(vec![7]))?;
+        writer.push_block(&[], None)?;
+        writer.push_block(&[4; 100], Some(vec![8, 9]))?;
+        writer.finish()?;
+
+        let file = EncFile::open(&path)?;
+        assert_eq!(file.num_blocks(), 3);
+        assert_eq!(file.stats(0), Some(&vec![7]));
+        assert_eq!(file.stats(1), None);
+        assert_eq!(file.read_blocks(0..3)?, vec![vec![1, 2, 3], vec![], vec![4; 100]]);
+        assert_eq!(file.read_blocks(2..3)?, vec![vec![4; 100]]);
+        // The blocks start at 8, 11 and 11.
+        assert_eq!(file.blocks_between(0, 11), 0..1);
+        assert_eq!(file.blocks_between(11, 200), 1..3);
+        let mut framed = STATS_MARK.to_vec();
+        framed.extend_from_slice(&[1, 0, 0, 0, 7, 1, 2, 3]);
+        assert_eq!(file.read_framed_blocks(0..2)?, vec![framed, vec![]]);
+        assert_eq!(MinMax::of(&[3, 1, 4, 1, 5][..]), Some(MinMax { min: 1, max: 5 }));
+        assert_eq!(MinMax::<i32>::of(&[][..]), None);
+
+        let dir = std::env::temp_dir().join(format!("enc_file_save_{}", std::process::id()));
+        let blocks = (0..2000).map(|i| vec![i as u8; i % 7]).collect::<Vec<_>>();
+        save_partition(dir.to_str().unwrap(), 3, blocks.clone().into_iter())?;
+        let saved = EncFile::open(dir.join("part-3"))?;
+        assert_eq!(saved.read_blocks(0..saved.num_blocks())?, blocks);
+        fs::remove_dir_all(&dir)?;
+
+        fs::write(&path, b"not an encrypted block file")?;
+        assert!(EncFile::from_file(File::open(&path)?)?.is_none());
+        fs::remove_file(&path)
+    }
+}
@@ -1,13 +1,15 @@
 use core::panic::Location;
 use std::collections::HashMap;
 use std::fs;
-use std::io::{BufReader, Read};
+use std::hash::{Hash, Hasher};
+use std::io::{self, Read};
 use std::marker::PhantomData;
 use std::net::{Ipv4Addr, SocketAddrV4};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
 use std::path::{Path, PathBuf};
-use std::sync::{atomic, mpsc::SyncSender, Arc, Weak};
-use std::thread::{self, JoinHandle};
-use std::time::Instant;
+use std::sync::{atomic, atomic::AtomicUsize, mpsc::SyncSender, Arc, Weak};
+use std::time::{Instant, SystemTime};
 
 use crate::context::Context;
 use crate::dependency::Dependency;
@@ -19,16 +21,25 @@ use crate::serializable_traits::{AnyData, Data, Func, SerFunc};
 use crate::serialization_free::Construct;
 use crate::split::Split;
 use crate::Fn;
+use fasthash::MetroHasher;
 use log::debug;
 use parking_lot::Mutex;
 use rand::prelude::*;
 use serde_derive::{Deserialize, Serialize};
 use sgx_types::*;
+
+/// Decoding threads of a partition at least, so one can read while another decodes.
+const MIN_READ_THREADS: usize = 2;
+/// Directories with fewer files are stat-ed on one thread.
+const STAT_FILES_PER_THREAD: usize = 64;
+
 pub struct LocalFsReaderConfig {
     filter_ext: Option<std::ffi::OsString>,
     expect_dir: bool,
     dir_path: PathBuf,
     executor_partitions: Option<u64>,
+    split_size: Option<u64>,
+    modified: Option<(SystemTime, SystemTime)>,
 }
 
 impl LocalFsReaderConfig {
@@ -40,6 +51,8 @@ impl LocalFsReaderConfig {
             expect_dir: true,
             dir_path: path.into(),
             executor_partitions: None,
+            split_size: None,
+            modified: None,
         }
     }
 
@@ -61,6 +74,24 @@ impl LocalFsReaderConfig {
         self.executor_partitions = Some(num);
         self
     }
+
+    /// Splits files larger than `bytes` into pieces of about that size, each read by a partition
+    /// of its own, so a single huge file is not read by a single task.
+    ///
+    /// Only for secure reads of encrypted block files, the bincode `Vec<Vec<u8>>` of their blocks
+    /// or an `EncFile`: a piece is a run of whole blocks, handed to the decoder framed as the
+    /// former.
+    pub fn split_files_over(mut self, bytes: u64) -> Self {
+        self.split_size = Some(bytes.max(1));
+        self
+    }
+
+    /// Only reads the files of the directory last modified in `[since, until)`, the new files of
+    /// a micro-batch, see `crate::streaming`.
+    pub fn modified_between(mut self, since: SystemTime, until: SystemTime) -> Self {
+        self.modified = Some((since, until));
+        self
+    }
 }
 
 impl ReaderConfiguration<Vec<u8>> for LocalFsReaderConfig {
@@ -112,7 +143,12 @@ impl ReaderConfiguration<PathBuf> for LocalFsReaderConfig {
         F0: SerFunc(PathBuf) -> Vec<ItemE>,
         U: Data,
     {
-        let reader = LocalFsReader::<FileReader, _, _>::new(self, context, sec_decoder.clone());
+        // The decoder gets a path, it cannot be given a piece of the file.
+        let config = LocalFsReaderConfig {
+            split_size: None,
+            ..self
+        };
+        let reader = LocalFsReader::<FileReader, _, _>::new(config, context, sec_decoder.clone());
         let local_num_splits = reader.get_executor_partitions() as usize;
         let read_files = Fn!(
             move |part: usize, readers: Box<dyn Iterator<Item = FileReader>>| {
@@ -153,6 +189,8 @@ where
     filter_ext: Option<std::ffi::OsString>,
     expect_dir: bool,
     executor_partitions: Option<u64>,
+    split_size: Option<u64>,
+    modified: Option<(SystemTime, SystemTime)>,
     #[serde(skip_serializing, skip_deserializing)]
     context: Weak<Context>,
     // explicitly copy the address map as the map under context is not
@@ -173,6 +211,8 @@ where
             expect_dir,
             filter_ext,
             executor_partitions,
+            split_size,
+            modified,
         } = config;
 
         let is_single_file = {
@@ -191,6 +231,8 @@ where
             filter_ext,
             expect_dir,
             executor_partitions,
+            split_size,
+            modified,
             splits: context.address_map.clone(),
             context: Arc::downgrade(&context),
             _marker_reader_data: PhantomData,
@@ -200,15 +242,25 @@ where
 
     /// This function should be called once per host to come with the paralel workload.
     /// Is safe to recompute on failure though.
-    fn load_local_files(&self, part_id: usize) -> Result<Vec<Vec<PathBuf>>> {
+    fn load_local_files(&self, part_id: usize) -> Result<Vec<Vec<InputFile>>> {
         let mut total_size = 0_u64;
         if self.is_single_file {
-            let files = vec![vec![self.path.clone()]];
-            return Ok(files);
+            if self.split_size.is_none() {
+                return Ok(vec![vec![InputFile::whole(self.path.clone())]]);
+            }
+            let size = fs::metadata(&self.path).map_err(Error::InputRead)?.len();
+            let pieces = self.pieces_of(self.path.clone(), size);
+            let num_partitions =
+                std::cmp::min(self.get_executor_partitions() as usize, pieces.len());
+            let mut partitions = vec![Vec::new(); num_partitions];
+            for (i, (_, piece)) in pieces.into_iter().enumerate() {
+                partitions[i % num_partitions].push(piece);
+            }
+            return Ok(partitions);
         }
 
         let mut num_partitions = self.get_executor_partitions();
-        let mut files: Vec<(u64, PathBuf)> = vec![];
+        let mut files: Vec<(u64, InputFile)> = vec![];
         // We compute std deviation incrementally to estimate a good breakpoint
         // of size per partition.
         let mut total_files = 0_u64;
@@ -219,41 +271,47 @@ where
         let mut entries = fs::read_dir(&self.path)
             .map_err(Error::InputRead)?
             .collect::<Vec<_>>();
+        // Every node lists the whole directory, so all of them leave out the same files before it
+        // is split between them.
+        if let Some((since, until)) = self.modified {
+            entries.retain(|entry| {
+                let modified = entry
+                    .as_ref()
+                    .ok()
+                    .and_then(|entry| entry.metadata().ok())
+                    .and_then(|metadata| metadata.modified().ok());
+                matches!(modified, Some(modified) if since <= modified && modified < until)
+            });
+        }
+        if entries.is_empty() {
+            return Ok(Vec::new());
+        }
         entries.sort_by_key(|e| e.as_ref().ok().map(|x| x.file_name()));
         let num_nodes = self.splits.len();
         let files_per_node = entries.len().checked_sub(1).unwrap() / num_nodes + 1;
-        let mut cur = 0;
-        for (i, entry) in entries.into_iter().enumerate() {
-            if cur < part_id * files_per_node || cur >= (part_id + 1) * files_per_node {
-                cur += 1;
-                continue;
-            } else {
-                cur += 1;
-            }
-
-            let path = entry.map_err(Error::InputRead)?.path();
-            if path.is_file() {
-                let is_proper_file = {
-                    self.filter_ext.is_none()
-                        || path.extension() == self.filter_ext.as_ref().map(|s| s.as_ref())
-                };
-                if !is_proper_file {
-                    continue;
-                }
-                let size = fs::metadata(&path).map_err(Error::InputRead)?.len();
-                if i == 0 {
-                    // assign first file size as reference sample
-                    k = size;
-                }
-                // compute the necessary statistics
-                let remain = size as f32 - k as f32;
-                ex += remain;
-                ex2 += remain.powf(2.0);
-                total_size += size;
-                total_files += 1;
-
-                files.push((size, path));
+        let paths = entries
+            .into_iter()
+            .skip(part_id * files_per_node)
+            .take(files_per_node)
+            .map(|entry| entry.map(|entry| entry.path()).map_err(Error::InputRead))
+            .collect::<Result<Vec<_>>>()?;
+        let pieces = self
+            .stat_files(paths)
+            .into_iter()
+            .flat_map(|(path, size)| self.pieces_of(path, size));
+        for (i, (size, file)) in pieces.enumerate() {
+            if i == 0 {
+                // assign first file size as reference sample
+                k = size;
             }
+            // compute the necessary statistics
+            let remain = size as f32 - k as f32;
+            ex += remain;
+            ex2 += remain.powf(2.0);
+            total_size += size;
+            total_files += 1;
+
+            files.push((size, file));
         }
 
         if total_files == 0 {
@@ -287,16 +345,95 @@ where
         Ok(partitions)
     }
 
+    /// The file as a whole, or as the pieces it is split into, each with its size.
+    fn pieces_of(&self, path: PathBuf, size: u64) -> Vec<(u64, InputFile)> {
+        match self.split_size {
+            Some(split_size) if size > split_size => {
+                let count = (size + split_size - 1) / split_size;
+                (0..count)
+                    .map(|index| {
+                        let piece = InputFile {
+                            path: path.clone(),
+                            piece: Some((index, count)),
+                        };
+                        (size / count, piece)
+                    })
+                    .collect()
+            }
+            _ => vec![(size, InputFile::whole(path))],
+        }
+    }
+
+    /// The files among `paths` with the extension asked for, with their sizes. Directories of
+    /// many files are stat-ed from several threads, as each stat is a round trip to the disk on a
+    /// cold cache.
+    fn stat_files(&self, paths: Vec<PathBuf>) -> Vec<(PathBuf, u64)> {
+        let stat = |path: &PathBuf| {
+            let is_proper_file = {
+                self.filter_ext.is_none()
+                    || path.extension() == self.filter_ext.as_ref().map(|s| s.as_ref())
+            };
+            match fs::metadata(path) {
+                Ok(metadata) if is_proper_file && metadata.is_file() => {
+                    Some((path.clone(), metadata.len()))
+                }
+                _ => None,
+            }
+        };
+        let num_threads = std::cmp::min(num_cpus::get(), paths.len() / STAT_FILES_PER_THREAD);
+        if num_threads <= 1 {
+            return paths.iter().filter_map(stat).collect();
+        }
+        let per_thread = (paths.len() + num_threads - 1) / num_threads;
+        let stat = &stat;
+        crossbeam::scope(|scope| {
+            let handles = paths
+                .chunks(per_thread)
+                .map(|chunk| {
+                    scope.spawn(move |_| chunk.iter().filter_map(stat).collect::<Vec<_>>())
+                })
+                .collect::<Vec<_>>();
+            handles
+                .into_iter()
+                .flat_map(|handle| handle.join().unwrap())
+                .collect()
+        })
+        .unwrap()
+    }
+
+    /// Hash of the path, the options and the names, sizes and modification times of the files
+    /// under it, which changes once one of them is written, added or removed.
+    fn input_hash(&self) -> u64 {
+        let mut hasher = MetroHasher::default();
+        (&self.path, &self.filter_ext, self.split_size, self.modified).hash(&mut hasher);
+        let mut paths = match self.is_single_file {
+            true => vec![self.path.clone()],
+            false => fs::read_dir(&self.path).map_or(Vec::new(), |entries| {
+                entries
+                    .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+                    .collect()
+            }),
+        };
+        paths.sort();
+        for path in paths {
+            let stat = fs::metadata(&path)
+                .ok()
+                .map(|metadata| (metadata.len(), metadata.modified().ok()));
+            (path, stat).hash(&mut hasher);
+        }
+        hasher.finish()
+    }
+
     /// Assign files according to total avg partition size and file size.
     /// This should return a fairly balanced total partition size.
     fn assign_files_to_partitions(
         &self,
         num_partitions: u64,
-        files: Vec<(u64, PathBuf)>,
+        files: Vec<(u64, InputFile)>,
         file_size_mean: u64,
         avg_partition_size: u64,
         std_dev: f32,
-    ) -> Vec<Vec<PathBuf>> {
+    ) -> Vec<Vec<InputFile>> {
         // Accept ~ 0.25 std deviations top from the average partition size
         // when assigning a file to a partition.
         let high_part_size_bound = (avg_partition_size + (std_dev * 0.25) as u64) as u64;
@@ -378,7 +515,7 @@ where
         data: Vec<ItemE>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let acc_arg = acc_arg.clone();
         let handle = std::thread::spawn(move || {
             let now = Instant::now();
@@ -386,7 +523,7 @@ where
             let dur = now.elapsed().as_nanos() as f64 * 1e-9 - wait;
             println!("***in local file reader, total {:?}***", dur);
         });
-        Ok(vec![handle])
+        Ok(vec![handle.into()])
     }
 }
 
@@ -396,6 +533,8 @@ macro_rules! impl_common_lfs_rddb_funcs {
             panic!("no cache for LocalFsReader");
         }
 
+        fn uncache(&self) {}
+
         fn should_cache(&self) -> bool {
             false
         }
@@ -428,6 +567,10 @@ macro_rules! impl_common_lfs_rddb_funcs {
             self.sec_decoder.is_some()
         }
 
+        fn content_hash(&self) -> u64 {
+            self.input_hash()
+        }
+
         fn move_allocation(&self, value_ptr: *mut u8) -> (*mut u8, usize) {
             unreachable!()
         }
@@ -441,7 +584,7 @@ macro_rules! impl_common_lfs_rddb_funcs {
             split: Box<dyn Split>,
             acc_arg: &mut AccArg,
             tx: SyncSender<usize>,
-        ) -> Result<Vec<JoinHandle<()>>> {
+        ) -> Result<Vec<EcallHandle>> {
             self.secure_compute(split, acc_arg, tx)
         }
 
@@ -555,7 +698,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let split = split.downcast_ref::<BytesReader>().unwrap();
         let now = Instant::now();
         let idx = split.idx;
@@ -565,12 +708,16 @@ where
             .into_iter()
             .map(move |files| BytesReader { files, host, idx })
             .collect::<Vec<_>>();
+        // The partitions of an executor read at the same time, the cpus left are spread over the
+        // files of each.
+        let num_threads = std::cmp::max(
+            MIN_READ_THREADS,
+            num_cpus::get() / self.get_executor_partitions() as usize,
+        );
         let data = match readers.get(idx % (self.get_executor_partitions() as usize)) {
-            Some(reader) => (*reader)
-                .clone()
-                .into_iter() //Vec<Vec<u8>>, ser_enc_data
-                .flat_map(|ser| self.sec_decoder.as_ref().unwrap()(ser).into_iter())
-                .collect::<Vec<_>>(), //enc_data
+            Some(reader) => reader
+                .read_decoded(num_threads, self.sec_decoder.as_ref().unwrap())
+                .map_err(Error::InputRead)?, //enc_data
             None => Vec::new(),
         };
         if data.is_empty() {
@@ -603,7 +750,7 @@ where
         Ok(Box::new(
             files_by_part
                 .into_iter()
-                .map(move |files| FileReader { files, host, idx }),
+                .map(move |files| FileReader::new(files, host, idx)),
         ) as Box<dyn Iterator<Item = Self::Item>>)
     }
 
@@ -612,14 +759,14 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let split = split.downcast_ref::<FileReader>().unwrap();
         let idx = split.idx;
         let host = split.host;
         let files_by_part = self.load_local_files(idx)?;
         let readers = files_by_part
             .into_iter()
-            .map(move |files| FileReader { files, host, idx })
+            .map(move |files| FileReader::new(files, host, idx))
             .collect::<Vec<_>>();
         let data = match readers.get(idx % (self.get_executor_partitions() as usize)) {
             Some(reader) => (*reader)
@@ -644,7 +791,7 @@ where
 
 #[derive(Clone, Debug, Serialize, Deserialize)]
 pub struct BytesReader {
-    pub files: Vec<PathBuf>,
+    pub files: Vec<InputFile>,
     idx: usize,
     host: Ipv4Addr,
 }
@@ -655,21 +802,191 @@ impl Split for BytesReader {
     }
 }
 
+impl BytesReader {
+    /// Reads the files of the split on `num_threads` threads and decodes each with `decode` as
+    /// soon as it is read, giving the decoded blocks in the order the iterator returns the files.
+    /// The blocks of an `EncFile` are handed on as they are read, as the enclave takes them,
+    /// without framing them for `decode` to take apart again.
+    /// A thread starts reading the file it will likely take next before it reads its current one,
+    /// so the disk stays busy while the threads decode.
+    fn read_decoded<F>(&self, num_threads: usize, decode: &F) -> io::Result<Vec<ItemE>>
+    where
+        F: Fn(Vec<u8>) -> Vec<ItemE> + Sync,
+    {
+        let files = self.files.iter().rev().collect::<Vec<_>>();
+        let num_threads = std::cmp::min(num_threads.max(1), files.len());
+        let next = AtomicUsize::new(0);
+        let (files, next) = (&files, &next);
+        let mut decoded = crossbeam::scope(|scope| {
+            let handles = (0..num_threads)
+                .map(|_| {
+                    scope.spawn(move |_| {
+                        let mut decoded = Vec::new();
+                        loop {
+                            let i = next.fetch_add(1, atomic::Ordering::SeqCst);
+                            if i >= files.len() {
+                                return Ok(decoded);
+                            }
+                            if let Some(file) = files.get(i + num_threads) {
+                                file.prefetch();
+                            }
+                            let blocks = match files[i].read_enc_blocks()? {
+                                Some(blocks) => blocks,
+                                None => decode(files[i].read_plain()?),
+                            };
+                            decoded.push((i, blocks));
+                        }
+                    })
+                })
+                .collect::<Vec<_>>();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().unwrap())
+                .collect::<io::Result<Vec<Vec<_>>>>()
+        })
+        .unwrap()?
+        .into_iter()
+        .flatten()
+        .collect::<Vec<_>>();
+        decoded.sort_by_key(|(i, _)| *i);
+        Ok(decoded.into_iter().flat_map(|(_, blocks)| blocks).collect())
+    }
+}
+
 impl Iterator for BytesReader {
     type Item = Vec<u8>;
     fn next(&mut self) -> Option<Self::Item> {
-        if let Some(path) = self.files.pop() {
-            let file = fs::File::open(path).unwrap();
-            let mut content = vec![];
-            let mut reader = BufReader::new(file);
-            reader.read_to_end(&mut content).unwrap();
-            Some(content)
+        if let Some(file) = self.files.pop() {
+            if let Some(next) = self.files.last() {
+                next.prefetch();
+            }
+            Some(file.read().unwrap())
         } else {
             None
         }
     }
 }
 
+/// A file read by a partition, or piece `index` of the `count` pieces of equal size it is split
+/// into (see `LocalFsReaderConfig::split_files_over`).
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct InputFile {
+    path: PathBuf,
+    piece: Option<(u64, u64)>,
+}
+
+impl InputFile {
+    fn whole(path: PathBuf) -> Self {
+        InputFile { path, piece: None }
+    }
+
+    /// Asks the kernel to start reading the file into the page cache, so it is there once it is
+    /// read.
+    fn prefetch(&self) {
+        if let Ok(file) = fs::File::open(&self.path) {
+            let (offset, len) = match (self.piece, file.metadata()) {
+                (Some((index, count)), Ok(metadata)) => {
+                    let size = metadata.len();
+                    (size / count * index, size / count)
+                }
+                _ => (0, 0),
+            };
+            advise_will_need(&file, offset, len as usize);
+        }
+    }
+
+    /// The blocks of the file or piece as the enclave reads them, None if it is not an
+    /// `EncFile`.
+    fn read_enc_blocks(&self) -> io::Result<Option<Vec<ItemE>>> {
+        let file = fs::File::open(&self.path)?;
+        unsafe {
+            libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_SEQUENTIAL);
+        }
+        let size = file.metadata()?.len();
+        let enc_file = match EncFile::from_file(file)? {
+            Some(enc_file) => enc_file,
+            None => return Ok(None),
+        };
+        let blocks = match self.piece {
+            None => 0..enc_file.num_blocks(),
+            Some((index, count)) => {
+                let end = if index + 1 == count {
+                    size
+                } else {
+                    size / count * (index + 1)
+                };
+                enc_file.blocks_between(size / count * index, end)
+            }
+        };
+        enc_file.read_framed_blocks(blocks).map(Some)
+    }
+
+    /// The content of the file or piece. The blocks of an `EncFile` are framed as a file of
+    /// length prefixed blocks, so one decoder reads both.
+    fn read(&self) -> io::Result<Vec<u8>> {
+        match self.read_enc_blocks()? {
+            Some(blocks) => bincode::serialize(&blocks)
+                .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e)),
+            None => self.read_plain(),
+        }
+    }
+
+    /// The content of a file or piece that is not an `EncFile`.
+    fn read_plain(&self) -> io::Result<Vec<u8>> {
+        let mut file = fs::File::open(&self.path)?;
+        unsafe {
+            libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_SEQUENTIAL);
+        }
+        let size = file.metadata()?.len();
+        match self.piece {
+            None => {
+                let mut content = Vec::with_capacity(size as usize);
+                file.read_to_end(&mut content)?;
+                Ok(content)
+            }
+            Some((index, count)) => {
+                let (start, end) = (size / count * index, size / count * (index + 1));
+                let end = if index + 1 == count { size } else { end };
+                read_blocks(&file, start, end)
+            }
+        }
+    }
+}
+
+/// The blocks of an encrypted block file that start in `[start, end)`, framed as the
+/// `Vec<Vec<u8>>` of a file of their own: their number, then the blocks as they are in the file.
+///
+/// The blocks are found by following their length prefixes from the start of the file, which
+/// reads 8 bytes per block before the piece.
+fn read_blocks(file: &fs::File, start: u64, end: u64) -> io::Result<Vec<u8>> {
+    let mut word = [0; 8];
+    file.read_exact_at(&mut word, 0)?;
+    let num_blocks = u64::from_le_bytes(word);
+    let (mut first, mut last) = (None, 8);
+    let mut num_read = 0u64;
+    let mut offset = 8;
+    for _ in 0..num_blocks {
+        if offset >= end {
+            break;
+        }
+        file.read_exact_at(&mut word, offset)?;
+        let next = offset
+            .checked_add(8 + u64::from_le_bytes(word))
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "bad block length"))?;
+        if offset >= start {
+            first.get_or_insert(offset);
+            last = next;
+            num_read += 1;
+        }
+        offset = next;
+    }
+    let first = first.unwrap_or(last);
+    let mut content = vec![0; 8 + (last - first) as usize];
+    content[..8].copy_from_slice(&num_read.to_le_bytes());
+    file.read_exact_at(&mut content[8..], first)?;
+    Ok(content)
+}
+
 #[derive(Clone, Debug, Serialize, Deserialize)]
 pub struct FileReader {
     files: Vec<PathBuf>,
@@ -677,6 +994,16 @@ pub struct FileReader {
     host: Ipv4Addr,
 }
 
+impl FileReader {
+    fn new(files: Vec<InputFile>, host: Ipv4Addr, idx: usize) -> Self {
+        FileReader {
+            files: files.into_iter().map(|file| file.path).collect(),
+            idx,
+            host,
+        }
+    }
+}
+
 impl Split for FileReader {
     fn get_index(&self) -> usize {
         self.idx
@@ -5,6 +5,11 @@ use crate::rdd::Rdd;
 use crate::serializable_traits::{Data, Func, SerFunc};
 use crate::SerArc;
 
+mod disk_io;
+pub(crate) use disk_io::{advise_will_need, DISK_IO};
+mod enc_file;
+pub(crate) use enc_file::save_partition;
+pub use enc_file::{EncFile, EncFileWriter, MinMax};
 mod local_file_reader;
 pub use local_file_reader::{LocalFsReader, LocalFsReaderConfig};
 
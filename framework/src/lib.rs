@@ -23,16 +23,28 @@ mod serialized_data_capnp {
 }
 
 mod aggregator;
+mod broadcast_tracker;
 mod cache;
 mod cache_tracker;
 mod context;
+mod cpu_profiler;
+pub mod datagen;
 mod dependency;
+mod deploy;
 mod env;
+mod epc_pressure;
 mod executor;
+mod heap_profiler;
 pub mod io;
 mod map_output_tracker;
+mod memfs;
+pub mod memory_watch;
+mod metrics;
+mod numa;
+pub mod overhead;
 mod partial;
 pub mod partitioner;
+mod provision;
 #[path = "rdd/rdd.rs"]
 pub mod rdd;
 mod scheduler;
@@ -40,7 +52,11 @@ mod serializable_traits;
 mod serialization_free;
 mod shuffle;
 mod split;
-pub use env::DeploymentMode;
+pub mod streaming;
+pub mod tcmalloc_bench;
+mod trace;
+mod transitions;
+pub use env::{num_parts, DeploymentMode};
 mod error;
 pub mod fs;
 mod hosts;
@@ -59,8 +75,9 @@ pub use error::*;
 pub use io::LocalFsReaderConfig;
 pub use partial::BoundedDouble;
 pub use rdd::{
-    batch_decrypt, batch_encrypt, decrypt, encrypt, ser_decrypt, ser_encrypt, wrapper_tail_compute,
-    ItemE, OpId, PairRdd, Rdd, TailCompInfo, Text, MAX_ENC_BL,
+    batch_decrypt, batch_encrypt, decrypt, encrypt, Broadcast, BroadcastVar, enter_lock_stats, ser_decrypt, ser_encrypt,
+    wrapper_free_tail_info, wrapper_tail_compute, EnterLockStats, ItemE, KeyFilter, OpId, PairRdd, Rdd, SecureLocalIter,
+    TailCompInfo, Text, MAX_ENC_BL,
 };
 pub use serializable_traits::Data;
 pub use serialization_free::Construct;
@@ -1,5 +1,9 @@
+use std::collections::HashMap;
 use std::net::{IpAddr, Ipv4Addr, SocketAddr};
-use std::sync::Arc;
+use std::sync::{
+    atomic::{AtomicI64, Ordering},
+    Arc,
+};
 use std::time::Duration;
 
 use crate::serialized_data_capnp::serialized_data;
@@ -7,7 +11,7 @@ use crate::{Error, NetworkError, Result};
 use capnp::message::{Builder as MsgBuilder, ReaderOptions};
 use capnp_futures::serialize as capnp_serialize;
 use dashmap::{DashMap, DashSet};
-use parking_lot::Mutex;
+use serde_derive::{Deserialize, Serialize};
 use thiserror::Error;
 use tokio::net::{TcpListener, TcpStream};
 use tokio_stream::StreamExt;
@@ -18,6 +22,23 @@ const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
     nesting_limit: 64,
 };
 
+/// Share of the input of a reduce partition an executor must hold to be preferred for it.
+const REDUCER_PREF_LOCS_FRACTION: f64 = 0.2;
+
+/// What a shuffle map task reports back: the server its output is on and the bytes it wrote for
+/// every reducer.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct MapStatus {
+    pub server_uri: String,
+    pub sizes: Vec<u64>,
+}
+
+impl MapStatus {
+    pub fn sizes_of(outputs: &[Vec<u8>]) -> Vec<u64> {
+        outputs.iter().map(|output| output.len() as u64).collect()
+    }
+}
+
 pub(crate) enum MapOutputTrackerMessage {
     // Contains shuffle_id
     GetMapOutputLocations(i64),
@@ -32,8 +53,11 @@ pub type ServerUris = Arc<DashMap<usize, Vec<Option<String>>>>;
 pub(crate) struct MapOutputTracker {
     is_master: bool,
     pub server_uris: ServerUris,
+    /// Sizes of the map outputs of every shuffle by map id, empty until the map task finished.
+    /// Only the driver has them.
+    map_sizes: Arc<DashMap<usize, Vec<Vec<u64>>>>,
     fetching: Arc<DashSet<usize>>,
-    generation: Arc<Mutex<i64>>,
+    generation: Arc<AtomicI64>,
     master_addr: SocketAddr,
 }
 
@@ -43,6 +67,7 @@ impl Default for MapOutputTracker {
         MapOutputTracker {
             is_master: Default::default(),
             server_uris: Default::default(),
+            map_sizes: Default::default(),
             fetching: Default::default(),
             generation: Default::default(),
             master_addr: SocketAddr::new(IpAddr::V4(Ipv4Addr::new(0, 0, 0, 0)), 0),
@@ -55,15 +80,18 @@ impl MapOutputTracker {
         let output_tracker = MapOutputTracker {
             is_master,
             server_uris: Arc::new(DashMap::new()),
+            map_sizes: Arc::new(DashMap::new()),
             fetching: Arc::new(DashSet::new()),
-            generation: Arc::new(Mutex::new(0)),
+            generation: Arc::new(AtomicI64::new(0)),
             master_addr,
         };
         output_tracker.server();
         output_tracker
     }
 
-    async fn client(&self, shuffle_id: usize) -> Result<Vec<String>> {
+    /// Looks the map outputs of all `shuffle_ids` up on the master at once, with the generation
+    /// they are valid for.
+    async fn client(&self, shuffle_ids: &[usize]) -> Result<(i64, Vec<Vec<String>>)> {
         let mut stream = loop {
             match TcpStream::connect(self.master_addr).await {
                 Ok(stream) => break stream,
@@ -74,17 +102,17 @@ impl MapOutputTracker {
         let reader = reader.compat();
         let mut writer = writer.compat_write();
         log::debug!(
-            "connected to master to fetch shuffle task #{} data hosts",
-            shuffle_id
+            "connected to master to fetch shuffle tasks {:?} data hosts",
+            shuffle_ids
         );
-        let shuffle_id_bytes = bincode::serialize(&shuffle_id)?;
+        let shuffle_ids_bytes = bincode::serialize(shuffle_ids)?;
         let mut message = MsgBuilder::new_default();
         let mut shuffle_data = message.init_root::<serialized_data::Builder>();
-        shuffle_data.set_msg(&shuffle_id_bytes);
+        shuffle_data.set_msg(&shuffle_ids_bytes);
         capnp_serialize::write_message(&mut writer, &message).await?;
         let message_reader = capnp_serialize::read_message(reader, CAPNP_BUF_READ_OPTS).await?;
         let shuffle_data = message_reader.get_root::<serialized_data::Reader>()?;
-        let locs: Vec<String> = bincode::deserialize(&shuffle_data.get_msg()?)?;
+        let locs: (i64, Vec<Vec<String>>) = bincode::deserialize(&shuffle_data.get_msg()?)?;
         Ok(locs)
     }
 
@@ -95,6 +123,7 @@ impl MapOutputTracker {
         log::debug!("map output tracker server starting");
         let master_addr = self.master_addr;
         let server_uris = self.server_uris.clone();
+        let generation = self.generation.clone();
         tokio::spawn(async move {
             let mut listener = TcpListener::bind(master_addr)
                 .await
@@ -102,6 +131,7 @@ impl MapOutputTracker {
             log::debug!("map output tracker server started");
             while let Ok((mut stream, _)) = listener.accept().await {
                 let server_uris_clone = server_uris.clone();
+                let generation = generation.clone();
                 tokio::spawn(async move {
                     let (reader, writer) = stream.split();
                     let reader = reader.compat();
@@ -110,39 +140,43 @@ impl MapOutputTracker {
                     // reading
                     let message_reader =
                         capnp_serialize::read_message(reader, CAPNP_BUF_READ_OPTS).await?;
-                    let shuffle_id = {
+                    let shuffle_ids: Vec<usize> = {
                         let data = message_reader.get_root::<serialized_data::Reader>()?;
                         bincode::deserialize(data.get_msg()?)?
                     };
-                    while server_uris_clone
-                        .get(&shuffle_id)
-                        .ok_or_else(|| MapOutputError::ShuffleIdNotFound(shuffle_id))?
-                        .iter()
-                        .filter(|x| !x.is_none())
-                        .count()
-                        == 0
-                    {
-                        //check whether this will hurt the performance or not
-                        tokio::time::sleep(Duration::from_millis(1)).await;
+                    // Outputs are registered one by one as the map tasks finish, a reduce task
+                    // started before the last of them waits for it here.
+                    for shuffle_id in &shuffle_ids {
+                        while server_uris_clone
+                            .get(shuffle_id)
+                            .ok_or_else(|| MapOutputError::ShuffleIdNotFound(*shuffle_id))?
+                            .iter()
+                            .any(|x| x.is_none())
+                        {
+                            //check whether this will hurt the performance or not
+                            tokio::time::sleep(Duration::from_millis(1)).await;
+                        }
                     }
-                    let locs = server_uris_clone
-                        .get(&shuffle_id)
-                        .map(|kv| {
-                            kv.value()
-                                .iter()
-                                .cloned()
-                                .map(|x| x.unwrap())
-                                .collect::<Vec<_>>()
+                    // Read before the locations: an output lost after them bumps the generation
+                    // past the one the client caches them for.
+                    let current_generation = generation.load(Ordering::SeqCst);
+                    let locs = shuffle_ids
+                        .iter()
+                        .map(|shuffle_id| {
+                            server_uris_clone
+                                .get(shuffle_id)
+                                .map(|kv| kv.value().iter().flatten().cloned().collect::<Vec<_>>())
+                                .unwrap_or_default()
                         })
-                        .unwrap_or_default();
+                        .collect::<Vec<_>>();
                     log::debug!(
-                        "locs inside map output tracker server for shuffle id #{}: {:?}",
-                        shuffle_id,
+                        "locs inside map output tracker server for shuffle ids {:?}: {:?}",
+                        shuffle_ids,
                         locs
                     );
 
                     // writting response
-                    let result = bincode::serialize(&locs)?;
+                    let result = bincode::serialize(&(current_generation, locs))?;
                     let message = {
                         let mut message = MsgBuilder::new_default();
                         let mut locs_data = message.init_root::<serialized_data::Builder>();
@@ -169,17 +203,21 @@ impl MapOutputTracker {
             return;
         }
         self.server_uris.insert(shuffle_id, vec![None; num_maps]);
+        self.map_sizes.insert(shuffle_id, vec![Vec::new(); num_maps]);
         log::debug!("server_uris after register_shuffle {:?}", self.server_uris);
     }
 
-    pub fn register_map_output(&self, shuffle_id: usize, map_id: usize, server_uri: String) {
+    pub fn register_map_output(&self, shuffle_id: usize, map_id: usize, status: MapStatus) {
         log::debug!(
             "registering map output from shuffle task #{} with map id #{} at server: {}",
             shuffle_id,
             map_id,
-            server_uri
+            status.server_uri
         );
-        self.server_uris.get_mut(&shuffle_id).unwrap()[map_id] = Some(server_uri);
+        if let Some(mut sizes) = self.map_sizes.get_mut(&shuffle_id) {
+            sizes[map_id] = status.sizes;
+        }
+        self.server_uris.get_mut(&shuffle_id).unwrap()[map_id] = Some(status.server_uri);
     }
 
     pub fn register_map_outputs(&self, shuffle_id: usize, locs: Vec<Option<String>>) {
@@ -192,13 +230,12 @@ impl MapOutputTracker {
     }
 
     pub fn unregister_map_output(&self, shuffle_id: usize, map_id: usize, server_uri: String) {
-        let array = self.server_uris.get(&shuffle_id);
-        if let Some(arr) = array {
+        if let Some(mut arr) = self.server_uris.get_mut(&shuffle_id) {
             if arr.get(map_id).unwrap() == &Some(server_uri) {
-                self.server_uris
-                    .get_mut(&shuffle_id)
-                    .unwrap()
-                    .insert(map_id, None)
+                arr[map_id] = None;
+                if let Some(mut sizes) = self.map_sizes.get_mut(&shuffle_id) {
+                    sizes[map_id].clear();
+                }
             }
             self.increment_generation();
         } else {
@@ -206,6 +243,103 @@ impl MapOutputTracker {
         }
     }
 
+    /// Map tasks of the shuffle whose output is registered.
+    pub fn num_available_outputs(&self, shuffle_id: usize) -> usize {
+        self.server_uris
+            .get(&shuffle_id)
+            .map_or(0, |locs| locs.iter().filter(|x| x.is_some()).count())
+    }
+
+    /// Bytes registered so far for every reducer of the shuffle.
+    pub fn reducer_sizes(&self, shuffle_id: usize) -> Vec<u64> {
+        let mut totals = Vec::new();
+        if let Some(map_sizes) = self.map_sizes.get(&shuffle_id) {
+            for sizes in map_sizes.iter() {
+                if totals.len() < sizes.len() {
+                    totals.resize(sizes.len(), 0);
+                }
+                for (total, size) in totals.iter_mut().zip(sizes) {
+                    *total += size;
+                }
+            }
+        }
+        totals
+    }
+
+    /// Hosts that hold at least REDUCER_PREF_LOCS_FRACTION of the registered input of reducer
+    /// `reduce_id`, so its task reads most of it locally.
+    pub fn reducer_locs(&self, shuffle_id: usize, reduce_id: usize) -> Vec<Ipv4Addr> {
+        let (uris, map_sizes) = match (
+            self.server_uris.get(&shuffle_id),
+            self.map_sizes.get(&shuffle_id),
+        ) {
+            (Some(uris), Some(map_sizes)) => (uris, map_sizes),
+            _ => return Vec::new(),
+        };
+        let mut by_host = HashMap::new();
+        let mut total = 0;
+        for (uri, sizes) in uris.iter().zip(map_sizes.iter()) {
+            let size = sizes.get(reduce_id).copied().unwrap_or(0);
+            let host = uri
+                .as_ref()
+                .and_then(|uri| uri.parse::<http::Uri>().ok())
+                .and_then(|uri| uri.host().and_then(|host| host.parse::<Ipv4Addr>().ok()));
+            if let Some(host) = host {
+                *by_host.entry(host).or_insert(0) += size;
+                total += size;
+            }
+        }
+        if total == 0 {
+            return Vec::new();
+        }
+        by_host
+            .into_iter()
+            .filter(|(_, size)| *size as f64 >= REDUCER_PREF_LOCS_FRACTION * total as f64)
+            .map(|(host, _)| host)
+            .collect()
+    }
+
+    /// The registered locations of the outputs of the shuffle, None if none of them is known
+    /// here.
+    fn cached_server_uris(&self, shuffle_id: usize) -> Option<Vec<String>> {
+        self.server_uris
+            .get(&shuffle_id)
+            .map(|locs| locs.iter().flatten().cloned().collect::<Vec<_>>())
+            .filter(|locs| !locs.is_empty())
+    }
+
+    /// Fetches the locations of the shuffles not cached yet from the master in one request. They
+    /// stay cached until a task of a newer generation arrives (see `update_generation`), so the
+    /// reduce tasks of a shuffle on one executor ask the master once between them.
+    pub async fn prefetch_server_uris(&self, shuffle_ids: &[usize]) -> Result<()> {
+        if self.is_master {
+            return Ok(());
+        }
+        let shuffle_ids = shuffle_ids
+            .iter()
+            .copied()
+            .filter(|shuffle_id| {
+                self.cached_server_uris(*shuffle_id).is_none() && self.fetching.insert(*shuffle_id)
+            })
+            .collect::<Vec<_>>();
+        if shuffle_ids.is_empty() {
+            return Ok(());
+        }
+        log::debug!("fetching locs of shuffles {:?}", shuffle_ids);
+        let fetched = self.client(&shuffle_ids).await;
+        if let Ok((generation, locs)) = &fetched {
+            log::debug!("fetched locs from client: {:?}", locs);
+            self.update_generation(*generation);
+            for (shuffle_id, locs) in shuffle_ids.iter().zip(locs) {
+                self.server_uris.insert(*shuffle_id, locs.iter().cloned().map(Some).collect());
+            }
+        }
+        for shuffle_id in &shuffle_ids {
+            self.fetching.remove(shuffle_id);
+        }
+        fetched.map(|_| ())
+    }
+
     pub async fn get_server_uris(&self, shuffle_id: usize) -> Result<Vec<String>> {
         log::debug!(
             "trying to get uri for shuffle task #{}, current server uris: {:?}",
@@ -213,67 +347,56 @@ impl MapOutputTracker {
             self.server_uris
         );
 
-        if self
-            .server_uris
-            .get(&shuffle_id)
-            .map(|some| some.iter().filter_map(|x| x.clone()).next())
-            .flatten()
-            .is_none()
-        {
-            if self.fetching.contains(&shuffle_id) {
-                while self.fetching.contains(&shuffle_id) {
-                    // TODO: check whether this will hurt the performance or not
-                    tokio::time::sleep(Duration::from_millis(1)).await;
-                }
-                let servers = self
-                    .server_uris
-                    .get(&shuffle_id)
-                    .ok_or_else(|| MapOutputError::ShuffleIdNotFound(shuffle_id))?
-                    .iter()
-                    .filter(|x| !x.is_none())
-                    .map(|x| x.clone().unwrap())
-                    .collect::<Vec<_>>();
-                log::debug!("returning after fetching done, return: {:?}", servers);
-                return Ok(servers);
-            } else {
-                log::debug!("adding to fetching queue");
-                self.fetching.insert(shuffle_id);
-            }
-            let fetched = self.client(shuffle_id).await?;
-            log::debug!("fetched locs from client: {:?}", fetched);
-            self.server_uris.insert(
-                shuffle_id,
-                fetched.iter().map(|x| Some(x.clone())).collect(),
-            );
-            log::debug!("added locs to server uris after fetching");
-            self.fetching.remove(&shuffle_id);
-            Ok(fetched)
-        } else {
-            Ok(self
+        if self.is_master {
+            // The outputs of a running map stage are registered as they come.
+            while self
                 .server_uris
                 .get(&shuffle_id)
-                .ok_or_else(|| MapOutputError::ShuffleIdNotFound(shuffle_id))?
-                .iter()
-                .filter(|x| !x.is_none())
-                .map(|x| x.clone().unwrap())
-                .collect())
+                .map_or(false, |locs| locs.iter().any(|x| x.is_none()))
+            {
+                tokio::time::sleep(Duration::from_millis(1)).await;
+            }
         }
+
+        self.prefetch_server_uris(&[shuffle_id]).await?;
+        // Another task of the executor may be fetching them.
+        while self.fetching.contains(&shuffle_id) {
+            // TODO: check whether this will hurt the performance or not
+            tokio::time::sleep(Duration::from_millis(1)).await;
+        }
+        Ok(self
+            .cached_server_uris(shuffle_id)
+            .ok_or_else(|| MapOutputError::ShuffleIdNotFound(shuffle_id))?)
     }
 
     pub fn increment_generation(&self) {
-        *self.generation.lock() += 1;
+        self.generation.fetch_add(1, Ordering::SeqCst);
     }
 
     pub fn get_generation(&self) -> i64 {
-        *self.generation.lock()
+        self.generation.load(Ordering::SeqCst)
     }
 
-    pub fn update_generation(&mut self, new_gen: i64) {
-        if new_gen > *self.generation.lock() {
-            self.server_uris = Arc::new(DashMap::new());
-            *self.generation.lock() = new_gen;
+    /// Moves an executor to the generation of the driver, dropping the locations cached for an
+    /// older one.
+    pub fn update_generation(&self, new_gen: i64) {
+        if self.is_master {
+            return;
+        }
+        if new_gen > self.generation.fetch_max(new_gen, Ordering::SeqCst) {
+            log::debug!("map output generation moved to {}, dropping cached locs", new_gen);
+            self.server_uris.clear();
         }
     }
+
+    /// Forgets every shuffle, for the next job on an executor daemon, whose driver numbers its
+    /// shuffles and generations from 0 again.
+    pub fn clear(&self) {
+        self.server_uris.clear();
+        self.map_sizes.clear();
+        self.fetching.clear();
+        self.generation.store(0, Ordering::SeqCst);
+    }
 }
 
 #[derive(Debug, Error)]
@@ -281,3 +404,48 @@ pub enum MapOutputError {
     #[error("Shuffle id output #{0} not found in the map")]
     ShuffleIdNotFound(usize),
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn status(host: &str, sizes: Vec<u64>) -> MapStatus {
+        MapStatus {
+            server_uri: format!("http://{}:5000", host),
+            sizes,
+        }
+    }
+
+    #[test]
+    fn reducer_locs_by_bytes() {
+        let tracker = MapOutputTracker::default();
+        tracker.register_shuffle(0, 3);
+        tracker.register_map_output(0, 0, status("10.0.0.1", vec![90, 0]));
+        tracker.register_map_output(0, 1, status("10.0.0.2", vec![10, 5]));
+        assert_eq!(tracker.reducer_sizes(0), vec![100, 5]);
+        assert_eq!(tracker.num_available_outputs(0), 2);
+        assert_eq!(
+            tracker.reducer_locs(0, 0),
+            vec!["10.0.0.1".parse::<Ipv4Addr>().unwrap()]
+        );
+        assert_eq!(
+            tracker.reducer_locs(0, 1),
+            vec!["10.0.0.2".parse::<Ipv4Addr>().unwrap()]
+        );
+
+        tracker.unregister_map_output(0, 0, "http://10.0.0.1:5000".to_string());
+        assert_eq!(tracker.reducer_sizes(0), vec![10, 5]);
+        assert!(tracker.reducer_locs(3, 0).is_empty());
+    }
+
+    #[test]
+    fn newer_generation_drops_cached_locs() {
+        let tracker = MapOutputTracker::default();
+        tracker.register_map_outputs(0, vec![Some("http://10.0.0.1:5000".to_string())]);
+        tracker.update_generation(0);
+        assert!(tracker.cached_server_uris(0).is_some());
+        tracker.update_generation(1);
+        assert!(tracker.cached_server_uris(0).is_none());
+        assert_eq!(tracker.get_generation(), 1);
+    }
+}
@@ -0,0 +1,241 @@
+//! Host side of the hugetlbfs backend of the outside heap of the enclave tcmalloc.
+//!
+//! The enclave side is the port of enclave/gperftools/memfs_malloc.cc to OCALLs. With
+//! VEGA_MEMFS_PATH set to a path on a hugetlbfs (or tmpfs) mount, the first `memfs_page_size_o`
+//! creates an unlinked file there and returns the page size of the mount, and every
+//! `memfs_mmap_o` grows the file and maps the new range MAP_SHARED, so the heap is backed by the
+//! huge pages reserved for the mount rather than by pages the kernel has to find or compact at
+//! fault time, as with MAP_HUGETLB. When the path is unset or the file cannot be created, the
+//! enclave gets a page size of 0 and keeps growing its heap with `mmap_o`.
+//!
+//! MADV_DONTNEED does not free the pages of a shared file mapping, so `madvise_o` asks `release`
+//! first, which punches the whole pages of the range out of the file instead.
+
+use std::ffi::CString;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+use std::sync::Mutex;
+
+use crate::env::Configuration;
+use libc::c_void;
+use once_cell::sync::Lazy;
+
+/// A range of the file mapped at `start`.
+struct Region {
+    start: usize,
+    len: usize,
+    offset: usize,
+}
+
+struct Memfs {
+    fd: libc::c_int,
+    page_size: usize,
+    /// Bytes of the file mapped so far, the offset of the next region.
+    base: usize,
+    limit: usize,
+    regions: Vec<Region>,
+}
+
+/// None if VEGA_MEMFS_PATH is unset or the file could not be created.
+static MEMFS: Lazy<Option<Mutex<Memfs>>> = Lazy::new(|| {
+    let conf = Configuration::get();
+    let path = conf.memfs_path.as_ref()?;
+    match Memfs::create(path, conf.memfs_limit_mb << 20) {
+        Ok(memfs) => {
+            log::info!(
+                "outside heap on {:?}, {} byte pages, limit {} MB",
+                path,
+                memfs.page_size,
+                conf.memfs_limit_mb
+            );
+            Some(Mutex::new(memfs))
+        }
+        Err(err) => {
+            log::warn!("outside heap not on {:?}, using mmap: {}", path, err);
+            None
+        }
+    }
+});
+
+impl Memfs {
+    fn create(path: &Path, limit: usize) -> std::io::Result<Memfs> {
+        let mut template = path.as_os_str().as_bytes().to_vec();
+        template.extend_from_slice(b".XXXXXX");
+        let template = CString::new(template)?;
+        let template = template.into_raw();
+        unsafe {
+            let fd = libc::mkstemp(template);
+            let template = CString::from_raw(template);
+            if fd == -1 {
+                return Err(std::io::Error::last_os_error());
+            }
+            // Freed by the kernel when the process exits.
+            libc::unlink(template.as_ptr());
+            let mut sfs: libc::statfs = std::mem::zeroed();
+            if libc::fstatfs(fd, &mut sfs) == -1 {
+                let err = std::io::Error::last_os_error();
+                libc::close(fd);
+                return Err(err);
+            }
+            Ok(Memfs {
+                fd,
+                page_size: sfs.f_bsize as usize,
+                base: 0,
+                limit,
+                regions: vec![],
+            })
+        }
+    }
+
+    fn map(&mut self, size: usize, alignment: usize) -> *mut c_void {
+        // The kernel aligns the mappings to the page size of the mount, larger alignments are
+        // made up from the head of the range, which stays in the file.
+        let extra = alignment.saturating_sub(self.page_size);
+        let len = size + extra;
+        if self.limit > 0 && self.base + len > self.limit {
+            return libc::MAP_FAILED;
+        }
+        unsafe {
+            // Not needed for hugetlbfs, which even fails it with EINVAL, but for tmpfs.
+            if libc::ftruncate(self.fd, (self.base + len) as libc::off_t) != 0
+                && *libc::__errno_location() != libc::EINVAL
+            {
+                return libc::MAP_FAILED;
+            }
+            let result = libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                self.fd,
+                self.base as libc::off_t,
+            );
+            if result == libc::MAP_FAILED {
+                return result;
+            }
+            let ptr = result as usize;
+            let adjust = match ptr & (alignment - 1) {
+                0 => 0,
+                r => alignment - r,
+            };
+            self.regions.push(Region {
+                start: ptr,
+                len,
+                offset: self.base,
+            });
+            self.base += len;
+            (ptr + adjust) as *mut c_void
+        }
+    }
+
+    /// The offsets and lengths of the whole pages of `[addr, addr + size)` in the file, a range
+    /// per region it overlaps, None if it overlaps none. Adjacent regions may have been merged
+    /// into one span by tcmalloc.
+    fn holes(&self, addr: usize, size: usize) -> Option<Vec<(usize, usize)>> {
+        let mask = self.page_size - 1;
+        let mut overlaps = false;
+        let mut holes = vec![];
+        for region in self.regions.iter() {
+            let from = std::cmp::max(addr, region.start);
+            let to = std::cmp::min(addr + size, region.start + region.len);
+            if from >= to {
+                continue;
+            }
+            overlaps = true;
+            let from = (from - region.start + mask) & !mask;
+            let to = (to - region.start) & !mask;
+            if from < to {
+                holes.push((region.offset + from, to - from));
+            }
+        }
+        if overlaps {
+            Some(holes)
+        } else {
+            None
+        }
+    }
+}
+
+/// The page size of the mount, 0 if the heap is not on it.
+pub(crate) fn page_size() -> usize {
+    match &*MEMFS {
+        Some(memfs) => memfs.lock().unwrap().page_size,
+        None => 0,
+    }
+}
+
+/// A range of `size` bytes aligned to `alignment`, a power of two, or MAP_FAILED.
+pub(crate) fn map(size: usize, alignment: usize) -> *mut c_void {
+    match &*MEMFS {
+        Some(memfs) => memfs.lock().unwrap().map(size, alignment),
+        None => libc::MAP_FAILED,
+    }
+}
+
+/// The result of releasing `[addr, addr + size)`, None if the range is not on the mount.
+pub(crate) fn release(addr: *mut c_void, size: usize) -> Option<i32> {
+    let memfs = MEMFS.as_ref()?.lock().unwrap();
+    let holes = memfs.holes(addr as usize, size)?;
+    if holes.is_empty() {
+        // Not a whole page, fail so that tcmalloc keeps counting the range as in use.
+        return Some(-1);
+    }
+    for (offset, len) in holes {
+        let res = unsafe {
+            libc::fallocate(
+                memfs.fd,
+                libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE,
+                offset as libc::off_t,
+                len as libc::off_t,
+            )
+        };
+        if res != 0 {
+            return Some(res);
+        }
+    }
+    Some(0)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn punches_whole_pages_of_the_regions() {
+        let page = 2 << 20;
+        let mut memfs = Memfs {
+            fd: -1,
+            page_size: page,
+            base: 16 * page,
+            limit: 0,
+            regions: vec![
+                Region {
+                    start: 0x4000_0000,
+                    len: 4 * page,
+                    offset: 0,
+                },
+                Region {
+                    start: 0x8000_0000,
+                    len: 8 * page,
+                    offset: 4 * page,
+                },
+            ],
+        };
+        let base = 0x8000_0000;
+        assert_eq!(memfs.holes(base + page, 2 * page), Some(vec![(5 * page, 2 * page)]));
+        assert_eq!(memfs.holes(base + 4096, 2 * page), Some(vec![(5 * page, page)]));
+        assert_eq!(memfs.holes(0x4000_0000 + 4096, 8192), Some(vec![]));
+        assert_eq!(memfs.holes(0x1000, 8192), None);
+        // A span tcmalloc merged over two adjacent regions.
+        let adjacent = Region {
+            start: base + 8 * page,
+            len: 4 * page,
+            offset: 12 * page,
+        };
+        memfs.regions.push(adjacent);
+        assert_eq!(
+            memfs.holes(base + 7 * page, 2 * page),
+            Some(vec![(11 * page, page), (12 * page, page)])
+        );
+    }
+}
@@ -0,0 +1,138 @@
+//! Peaks of the memory of a run, for the memory budgets of `app bench`.
+//!
+//! A sampler thread reads, every interval, the trusted heap of the enclaves, the outside heap
+//! their tcmalloc has committed through `sbrk_o` and `mmap_o`, the RSS of the host process, where
+//! the map outputs of `SHUFFLE_STORE` live, and the paging events of `epc_pressure`. The peak of
+//! the trusted heap is kept by the enclave itself, see `allocator::TrustedHeap`, and that of the
+//! RSS by the kernel, so neither depends on the interval. The outside heap is only seen at the
+//! samples. Nothing is read from the enclaves before the Env is set up or after they are
+//! destroyed.
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use crate::env::{Configuration, Env};
+use crate::epc_pressure;
+use once_cell::sync::Lazy;
+use serde_derive::{Deserialize, Serialize};
+
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct Sample {
+    /// Seconds since `start`.
+    pub t_s: f64,
+    pub trusted_heap_bytes: u64,
+    pub outside_heap_bytes: u64,
+    pub host_rss_bytes: u64,
+    /// Paging events since `start`.
+    pub epc_faults: u64,
+}
+
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct MemoryReport {
+    pub peak_trusted_heap_bytes: u64,
+    pub peak_outside_heap_bytes: u64,
+    pub peak_host_rss_bytes: u64,
+    pub epc_faults: u64,
+    pub samples: Vec<Sample>,
+}
+
+struct Watch {
+    stop: Arc<AtomicBool>,
+    sampler: JoinHandle<()>,
+    report: Arc<Mutex<MemoryReport>>,
+}
+
+static WATCH: Lazy<Mutex<Option<Watch>>> = Lazy::new(|| Mutex::new(None));
+
+fn page_size() -> u64 {
+    unsafe { libc::sysconf(libc::_SC_PAGESIZE) as u64 }
+}
+
+/// Resident bytes of the process now.
+fn rss_bytes() -> u64 {
+    std::fs::read_to_string("/proc/self/statm")
+        .ok()
+        .and_then(|statm| statm.split_whitespace().nth(1)?.parse::<u64>().ok())
+        .map_or(0, |pages| pages * page_size())
+}
+
+/// The most resident bytes the process ever had, VmHWM.
+fn peak_rss_bytes() -> u64 {
+    std::fs::read_to_string("/proc/self/status")
+        .ok()
+        .and_then(|status| {
+            let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+            line.split_whitespace().nth(1)?.parse::<u64>().ok()
+        })
+        .map_or(0, |kb| kb * 1024)
+}
+
+fn sample(report: &mut MemoryReport, start: Instant, faults_before: u64) {
+    let conf = Configuration::get();
+    let mut sample = Sample {
+        t_s: start.elapsed().as_secs_f64(),
+        host_rss_bytes: rss_bytes(),
+        epc_faults: epc_pressure::paging_events(&conf.epc_evictions).saturating_sub(faults_before),
+        ..Default::default()
+    };
+    if let Some(env) = Env::try_get() {
+        if let Some((in_use, peak)) = env.trusted_heap_usage() {
+            sample.trusted_heap_bytes = in_use;
+            report.peak_trusted_heap_bytes = report.peak_trusted_heap_bytes.max(peak);
+        }
+        if let Some(stats) = env.try_tc_stats() {
+            sample.outside_heap_bytes = stats
+                .system_bytes
+                .saturating_sub(stats.pageheap_unmapped_bytes);
+        }
+    }
+    report.peak_outside_heap_bytes = report
+        .peak_outside_heap_bytes
+        .max(sample.outside_heap_bytes);
+    report.peak_host_rss_bytes = peak_rss_bytes().max(sample.host_rss_bytes);
+    report.epc_faults = sample.epc_faults;
+    report.samples.push(sample);
+}
+
+/// Starts sampling every `interval`, unless it is already.
+pub fn start(interval: Duration) {
+    let mut watch = WATCH.lock().unwrap();
+    if watch.is_some() {
+        return;
+    }
+    let stop = Arc::new(AtomicBool::new(false));
+    let report = Arc::new(Mutex::new(MemoryReport::default()));
+    let sampler = {
+        let stop = stop.clone();
+        let report = report.clone();
+        let start = Instant::now();
+        let faults_before = epc_pressure::paging_events(&Configuration::get().epc_evictions);
+        thread::spawn(move || loop {
+            sample(&mut report.lock().unwrap(), start, faults_before);
+            if stop.load(Ordering::Acquire) {
+                return;
+            }
+            thread::park_timeout(interval);
+        })
+    };
+    *watch = Some(Watch {
+        stop,
+        sampler,
+        report,
+    });
+}
+
+/// Stops the sampler after a last sample, and returns what it saw. Empty if it never started.
+pub fn report() -> MemoryReport {
+    let watch = match WATCH.lock().unwrap().take() {
+        Some(watch) => watch,
+        None => return MemoryReport::default(),
+    };
+    watch.stop.store(true, Ordering::Release);
+    watch.sampler.thread().unpark();
+    let _ = watch.sampler.join();
+    let mut report = watch.report.lock().unwrap();
+    std::mem::take(&mut *report)
+}
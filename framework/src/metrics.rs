@@ -0,0 +1,310 @@
+//! Host side of the per-op metrics the enclave counts.
+//!
+//! The enclave counts the work of each stage under the OpId hash of its final op, in tables of
+//! the threads that do it, see enclave/src/metrics.rs. After every `secure_execute` the host
+//! drains the table of the thread it called in with `drain_metrics` and adds it to the metrics
+//! pending in this process. A finished task takes them along with its result to the driver,
+//! where they are posted to the `LiveListenerBus` and summed per job.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::sync::Mutex;
+
+use crate::transitions::{self, Site};
+use once_cell::sync::Lazy;
+use serde_derive::{Deserialize, Serialize};
+use sgx_types::*;
+
+extern "C" {
+    fn drain_metrics(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        buf: *mut u8,
+        cap: usize,
+    ) -> sgx_status_t;
+}
+
+pub(crate) const HIST_BUCKETS: usize = 32;
+
+/// Enough for the ops of a few stages, a larger table is drained again with the size it needs.
+const DRAIN_BUF_BYTES: usize = 16 * 1024;
+
+/// Counters of one op. Mirrors OpMetrics in enclave/src/metrics.rs, field by field.
+#[derive(Clone, Copy, Debug, Default, Serialize, Deserialize)]
+pub(crate) struct EnclaveMetrics {
+    pub ecall_ns: u64,
+    pub shuffle_write_ns: u64,
+    /// `decrypt_ns` and `encrypt_ns` sum the sampled blocks only, one in 64.
+    pub decrypt_ns: u64,
+    pub decrypt_timed: u64,
+    pub encrypt_ns: u64,
+    pub encrypt_timed: u64,
+    pub bytes_decrypted: u64,
+    pub blocks_decrypted: u64,
+    pub bytes_encrypted: u64,
+    pub blocks_encrypted: u64,
+    pub ocalls: u64,
+    pub allocs: u64,
+    /// (De)serializations of blocks sealed or opened in the scratch buffer of the enclave,
+    /// `ser_ns` and `de_ns` sum the sampled ones only.
+    pub ser_ns: u64,
+    pub ser_timed: u64,
+    pub serialized: u64,
+    pub de_ns: u64,
+    pub de_timed: u64,
+    pub deserialized: u64,
+    /// Sampled block decryptions, bucket `i` counts those of `[2^i, 2^(i+1))` ns.
+    pub decrypt_hist: [u64; HIST_BUCKETS],
+}
+
+impl EnclaveMetrics {
+    pub fn merge(&mut self, other: &EnclaveMetrics) {
+        self.ecall_ns += other.ecall_ns;
+        self.shuffle_write_ns += other.shuffle_write_ns;
+        self.decrypt_ns += other.decrypt_ns;
+        self.decrypt_timed += other.decrypt_timed;
+        self.encrypt_ns += other.encrypt_ns;
+        self.encrypt_timed += other.encrypt_timed;
+        self.bytes_decrypted += other.bytes_decrypted;
+        self.blocks_decrypted += other.blocks_decrypted;
+        self.bytes_encrypted += other.bytes_encrypted;
+        self.blocks_encrypted += other.blocks_encrypted;
+        self.ocalls += other.ocalls;
+        self.allocs += other.allocs;
+        self.ser_ns += other.ser_ns;
+        self.ser_timed += other.ser_timed;
+        self.serialized += other.serialized;
+        self.de_ns += other.de_ns;
+        self.de_timed += other.de_timed;
+        self.deserialized += other.deserialized;
+        for (a, b) in self.decrypt_hist.iter_mut().zip(other.decrypt_hist.iter()) {
+            *a += *b;
+        }
+    }
+
+    /// The upper bound of the bucket of the `q` quantile of the sampled block decryptions.
+    pub fn decrypt_quantile_ns(&self, q: f64) -> u64 {
+        hist_quantile_ns(&self.decrypt_hist, q)
+    }
+
+    /// The time of all block encryptions and decryptions, extrapolated from the sampled ones.
+    pub fn crypto_ns(&self) -> u64 {
+        extrapolate(self.decrypt_ns, self.decrypt_timed, self.blocks_decrypted)
+            + extrapolate(self.encrypt_ns, self.encrypt_timed, self.blocks_encrypted)
+    }
+
+    /// The same for the serializations and the deserializations.
+    pub fn coding_ns(&self) -> (u64, u64) {
+        (
+            extrapolate(self.ser_ns, self.ser_timed, self.serialized),
+            extrapolate(self.de_ns, self.de_timed, self.deserialized),
+        )
+    }
+}
+
+fn extrapolate(ns: u64, timed: u64, all: u64) -> u64 {
+    if timed == 0 {
+        0
+    } else {
+        (ns as u128 * all as u128 / timed as u128) as u64
+    }
+}
+
+/// The upper bound of the bucket of the `q` quantile of a log2 histogram of nanoseconds, 0 if it
+/// is empty.
+pub(crate) fn hist_quantile_ns(hist: &[u64], q: f64) -> u64 {
+    let total = hist.iter().sum::<u64>();
+    if total == 0 {
+        return 0;
+    }
+    let rank = (total as f64 * q).ceil().max(1.0) as u64;
+    let mut seen = 0;
+    for (i, count) in hist.iter().enumerate() {
+        seen += count;
+        if seen >= rank {
+            return 1u64 << (i + 1).min(63);
+        }
+    }
+    u64::MAX
+}
+
+impl fmt::Display for EnclaveMetrics {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let mean = |ns: u64, n: u64| if n == 0 { 0 } else { ns / n };
+        write!(
+            f,
+            "ecall {:.3} s, shuffle write {:.3} s, decrypted {} blocks / {} MB \
+             (sampled mean {} ns, p50 < {} ns, p99 < {} ns), encrypted {} blocks / {} MB \
+             (sampled mean {} ns), serialized {} / deserialized {} blocks \
+             (sampled mean {} / {} ns), {} ocalls, {} allocations",
+            self.ecall_ns as f64 * 1e-9,
+            self.shuffle_write_ns as f64 * 1e-9,
+            self.blocks_decrypted,
+            self.bytes_decrypted >> 20,
+            mean(self.decrypt_ns, self.decrypt_timed),
+            self.decrypt_quantile_ns(0.5),
+            self.decrypt_quantile_ns(0.99),
+            self.blocks_encrypted,
+            self.bytes_encrypted >> 20,
+            mean(self.encrypt_ns, self.encrypt_timed),
+            self.serialized,
+            self.deserialized,
+            mean(self.ser_ns, self.ser_timed),
+            mean(self.de_ns, self.de_timed),
+            self.ocalls,
+            self.allocs,
+        )
+    }
+}
+
+/// Metrics per OpId hash.
+pub(crate) type OpMetrics = Vec<(u64, EnclaveMetrics)>;
+
+/// Drained from the enclaves and not yet taken by a task.
+static PENDING: Lazy<Mutex<HashMap<u64, EnclaveMetrics>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+pub(crate) fn merge_into(
+    acc: &mut HashMap<u64, EnclaveMetrics>,
+    metrics: &[(u64, EnclaveMetrics)],
+) {
+    for (op, m) in metrics {
+        acc.entry(*op).or_default().merge(m);
+    }
+}
+
+/// Drains what the calling thread counted in enclave `eid`. The thread must be the one that
+/// made the ECALLs, their counts stay with its TCS.
+pub(crate) fn drain(eid: sgx_enclave_id_t) {
+    let mut buf = vec![0u8; DRAIN_BUF_BYTES];
+    loop {
+        let mut len = 0;
+        let sgx_status = {
+            let _timed = transitions::time(Site::DrainMetrics);
+            unsafe { drain_metrics(eid, &mut len, buf.as_mut_ptr(), buf.len()) }
+        };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            log::warn!("failed draining enclave metrics: {}", sgx_status.as_str());
+            return;
+        }
+        if len > buf.len() {
+            buf.resize(len, 0);
+            continue;
+        }
+        match bincode::deserialize::<OpMetrics>(&buf[..len]) {
+            Ok(metrics) if !metrics.is_empty() => {
+                merge_into(&mut PENDING.lock().unwrap(), &metrics);
+            }
+            Ok(_) => {}
+            Err(err) => log::warn!("malformed enclave metrics: {}", err),
+        }
+        return;
+    }
+}
+
+/// All the metrics of the tasks this driver ran, see `overhead::breakdown`.
+static TOTALS: Lazy<Mutex<EnclaveMetrics>> = Lazy::new(|| Mutex::new(EnclaveMetrics::default()));
+
+/// Adds the metrics a task brought back to the totals of the driver.
+pub(crate) fn add_to_totals(metrics: &[(u64, EnclaveMetrics)]) {
+    let mut totals = TOTALS.lock().unwrap();
+    for (_, m) in metrics {
+        totals.merge(m);
+    }
+    drop(totals);
+    add_to_stages(&mut STAGES.lock().unwrap(), metrics);
+}
+
+pub(crate) fn totals() -> EnclaveMetrics {
+    *TOTALS.lock().unwrap()
+}
+
+/// The totals of the driver per stage, by the OpId hash of its final op, with the tasks that
+/// counted in it, see `overhead::stages`.
+static STAGES: Lazy<Mutex<HashMap<u64, (u64, EnclaveMetrics)>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+fn add_to_stages(
+    stages: &mut HashMap<u64, (u64, EnclaveMetrics)>,
+    metrics: &[(u64, EnclaveMetrics)],
+) {
+    for (op, m) in metrics {
+        let stage = stages.entry(*op).or_default();
+        stage.0 += 1;
+        stage.1.merge(m);
+    }
+}
+
+pub(crate) fn stage_totals() -> Vec<(u64, u64, EnclaveMetrics)> {
+    STAGES
+        .lock()
+        .unwrap()
+        .iter()
+        .map(|(op, (tasks, m))| (*op, *tasks, *m))
+        .collect()
+}
+
+/// The metrics drained since the last call, for the task that is finishing. Tasks running at the
+/// same time may take some of each other's, the sums per op are the same.
+pub(crate) fn take_pending() -> OpMetrics {
+    std::mem::take(&mut *PENDING.lock().unwrap()).into_iter().collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn quantiles_of_the_histogram() {
+        let mut m = EnclaveMetrics::default();
+        assert_eq!(m.decrypt_quantile_ns(0.5), 0);
+        // 90 blocks in [1024, 2048) ns, 10 in [2^20, 2^21) ns.
+        m.decrypt_hist[10] = 90;
+        m.decrypt_hist[20] = 10;
+        assert_eq!(m.decrypt_quantile_ns(0.5), 2048);
+        assert_eq!(m.decrypt_quantile_ns(0.9), 2048);
+        assert_eq!(m.decrypt_quantile_ns(0.99), 1 << 21);
+    }
+
+    #[test]
+    fn merges_per_op() {
+        let mut acc = HashMap::new();
+        let a = EnclaveMetrics {
+            blocks_decrypted: 2,
+            ..Default::default()
+        };
+        merge_into(&mut acc, &[(1, a), (2, a)]);
+        merge_into(&mut acc, &[(1, a)]);
+        assert_eq!(acc[&1].blocks_decrypted, 4);
+        assert_eq!(acc[&2].blocks_decrypted, 2);
+    }
+
+    #[test]
+    fn counts_the_tasks_of_a_stage() {
+        let mut stages = HashMap::new();
+        let a = EnclaveMetrics {
+            ecall_ns: 10,
+            ..Default::default()
+        };
+        add_to_stages(&mut stages, &[(1, a), (2, a)]);
+        add_to_stages(&mut stages, &[(1, a)]);
+        assert_eq!(stages[&1].0, 2);
+        assert_eq!(stages[&1].1.ecall_ns, 20);
+        assert_eq!(stages[&2].0, 1);
+    }
+
+    #[test]
+    fn extrapolates_sampled_times() {
+        let m = EnclaveMetrics {
+            decrypt_ns: 2_000,
+            decrypt_timed: 2,
+            blocks_decrypted: 128,
+            ser_ns: 100,
+            ser_timed: 1,
+            serialized: 64,
+            ..Default::default()
+        };
+        assert_eq!(m.crypto_ns(), 128_000);
+        assert_eq!(m.coding_ns(), (6_400, 0));
+    }
+}
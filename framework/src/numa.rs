@@ -0,0 +1,199 @@
+//! Placement of the enclaves of a node of the cluster on its NUMA nodes.
+//!
+//! Enclave i is placed on NUMA node i modulo the nodes the kernel lists. In local mode the
+//! workers of the `LocalPool` group of an enclave only run on the cpus of its node. With
+//! VEGA_NUMA_ALLOC set, every enclave also hands its NUMA node to its tcmalloc, which passes it
+//! with every `mmap_o`, and `bind` makes the host prefer that node for the pages of the region,
+//! so the outside heap an enclave's tasks encrypt into is on their node, not on the one of the
+//! thread that first touched it. A distributed task is moved onto its node with `TaskOnNode`.
+//!
+//! Each enclave has a tcmalloc of its own, so with one enclave per NUMA node its page heap
+//! serves that node alone and its thread caches only hold local memory.
+
+use std::fs;
+
+use crate::env::Configuration;
+use once_cell::sync::Lazy;
+
+static NODES: Lazy<Vec<Vec<usize>>> = Lazy::new(numa_nodes);
+
+/// Cpus of every NUMA node, empty where the kernel does not list them.
+pub(crate) fn nodes() -> &'static [Vec<usize>] {
+    &NODES
+}
+
+/// The NUMA node of enclave `idx`, None on a machine with a single one.
+pub(crate) fn node_of_enclave(idx: usize) -> Option<usize> {
+    match NODES.len() {
+        0 | 1 => None,
+        n => Some(idx % n),
+    }
+}
+
+fn numa_nodes() -> Vec<Vec<usize>> {
+    let mut nodes = Vec::new();
+    for node in 0.. {
+        let path = format!("/sys/devices/system/node/node{}/cpulist", node);
+        match fs::read_to_string(path) {
+            Ok(list) => nodes.push(parse_cpu_list(list.trim())),
+            Err(_) => break,
+        }
+    }
+    nodes.retain(|cpus| !cpus.is_empty());
+    nodes
+}
+
+/// A kernel cpu list such as 0-3,8-11.
+pub(crate) fn parse_cpu_list(list: &str) -> Vec<usize> {
+    let mut cpus = Vec::new();
+    for range in list.split(',').filter(|range| !range.is_empty()) {
+        let mut ends = range.splitn(2, '-').map(|end| end.parse::<usize>());
+        match (ends.next(), ends.next()) {
+            (Some(Ok(start)), Some(Ok(end))) => cpus.extend(start..=end),
+            (Some(Ok(cpu)), None) => cpus.push(cpu),
+            _ => log::warn!("unexpected cpu list {}", list),
+        }
+    }
+    cpus
+}
+
+pub(crate) fn set_affinity(set: &libc::cpu_set_t) -> bool {
+    unsafe { libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), set) == 0 }
+}
+
+/// The cpus the current thread may run on.
+pub(crate) fn affinity() -> Option<libc::cpu_set_t> {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        let size = std::mem::size_of::<libc::cpu_set_t>();
+        if libc::sched_getaffinity(0, size, &mut set) != 0 {
+            return None;
+        }
+        Some(set)
+    }
+}
+
+/// Lets the current thread run only on `cpus`.
+pub(crate) fn pin_to(cpus: &[usize]) {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        for cpu in cpus {
+            libc::CPU_SET(*cpu, &mut set);
+        }
+        if !set_affinity(&set) {
+            log::warn!("could not pin thread to cpus {:?}", cpus);
+        }
+    }
+}
+
+/// Makes the kernel prefer `node` for the pages of `[addr, addr + len)`, which must be page
+/// aligned. Pages already touched stay where they are.
+pub(crate) unsafe fn bind(addr: *mut libc::c_void, len: usize, node: usize) {
+    let mut mask = [0 as libc::c_ulong; 4];
+    let bits = 8 * std::mem::size_of::<libc::c_ulong>();
+    if node >= mask.len() * bits {
+        return;
+    }
+    mask[node / bits] |= 1 << (node % bits);
+    // Preferred rather than bound, an enclave whose node is full takes pages of another.
+    let res = libc::syscall(
+        libc::SYS_mbind,
+        addr,
+        len,
+        libc::MPOL_PREFERRED,
+        mask.as_ptr(),
+        mask.len() * bits,
+        0,
+    );
+    if res != 0 {
+        let err = std::io::Error::last_os_error();
+        log::debug!("mbind of {} bytes to node {} failed: {}", len, node, err);
+    }
+}
+
+/// Runs the current thread on the NUMA node of an enclave until dropped, then where it ran
+/// before.
+pub(crate) struct TaskOnNode {
+    prev: libc::cpu_set_t,
+}
+
+impl TaskOnNode {
+    /// Moves a task of enclave `idx` onto its node, if VEGA_NUMA_ALLOC is set. The workers of
+    /// local mode are pinned already.
+    pub fn enter(idx: usize) -> Option<TaskOnNode> {
+        let conf = Configuration::get();
+        if !conf.numa_alloc || conf.deployment_mode.is_local() {
+            return None;
+        }
+        let node = node_of_enclave(idx)?;
+        let prev = affinity()?;
+        pin_to(&NODES[node]);
+        Some(TaskOnNode { prev })
+    }
+}
+
+impl Drop for TaskOnNode {
+    fn drop(&mut self) {
+        set_affinity(&self.prev);
+    }
+}
+
+/// Keeps the current thread, and the threads it starts meanwhile, off some cpus until dropped,
+/// then lets it run where it ran before.
+pub(crate) struct OffCpus {
+    prev: libc::cpu_set_t,
+}
+
+impl OffCpus {
+    /// None if `cpus` is empty or are all the current thread may run on.
+    pub fn enter(cpus: &[usize]) -> Option<OffCpus> {
+        if cpus.is_empty() {
+            return None;
+        }
+        let prev = affinity()?;
+        let mut set = prev;
+        for cpu in cpus {
+            unsafe { libc::CPU_CLR(*cpu, &mut set) };
+        }
+        if unsafe { libc::CPU_COUNT(&set) } == 0 {
+            log::warn!("no cpus left off {:?}", cpus);
+            return None;
+        }
+        set_affinity(&set);
+        Some(OffCpus { prev })
+    }
+}
+
+impl Drop for OffCpus {
+    fn drop(&mut self) {
+        set_affinity(&self.prev);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn cpu_lists() {
+        assert_eq!(parse_cpu_list("0-3,8,10-11"), vec![0, 1, 2, 3, 8, 10, 11]);
+        assert_eq!(parse_cpu_list(""), Vec::<usize>::new());
+    }
+
+    #[test]
+    fn off_cpus_restores() {
+        let prev = affinity().unwrap();
+        let cpu = (0..libc::CPU_SETSIZE as usize)
+            .find(|cpu| unsafe { libc::CPU_ISSET(*cpu, &prev) })
+            .unwrap();
+        match OffCpus::enter(&[cpu]) {
+            Some(off) => {
+                assert!(!unsafe { libc::CPU_ISSET(cpu, &affinity().unwrap()) });
+                drop(off);
+            }
+            // The only cpu of the thread is never taken away.
+            None => assert_eq!(unsafe { libc::CPU_COUNT(&prev) }, 1),
+        }
+        assert!(unsafe { libc::CPU_ISSET(cpu, &affinity().unwrap()) });
+    }
+}
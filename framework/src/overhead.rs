@@ -0,0 +1,115 @@
+//! The raw numbers the secure mode of a run costs, for the overhead breakdown of `app bench`.
+//!
+//! Everything here is summed over the life of the process: the enclave metrics of all the tasks
+//! the driver ran, the enclave transitions this process made and served, and its page faults.
+//! In the local mode that is the whole run. In the distributed mode the transitions and the page
+//! faults of the executors stay with them, only the enclave metrics come back with the tasks.
+
+use crate::metrics;
+use crate::transitions::{self, Site};
+use serde_derive::{Deserialize, Serialize};
+
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct Breakdown {
+    /// ECALLs made, and the time spent in them, enclave work included.
+    pub ecalls: u64,
+    pub ecall_s: f64,
+    /// OCALLs served by the host, and the time the host spent serving them.
+    pub host_ocalls: u64,
+    pub host_ocall_s: f64,
+    /// OCALLs into the tcmalloc that manages the outside memory of the enclave. The host does
+    /// not see them, so they are the OCALLs the enclave counted minus those the host served.
+    pub outside_alloc_ocalls: u64,
+    /// Allocations on the inside heap, counted only while a step samples its first block.
+    pub inside_allocs: u64,
+    /// Block encryption and decryption, extrapolated from the sampled blocks.
+    pub crypto_s: f64,
+    pub bytes_encrypted: u64,
+    pub bytes_decrypted: u64,
+    /// Serialization and deserialization inside the enclave, extrapolated the same way. Those
+    /// streamed straight into outside memory are counted as encryption.
+    pub ser_s: f64,
+    pub de_s: f64,
+    pub shuffle_write_s: f64,
+    /// Page faults of the process, evicted EPC pages coming back among them.
+    pub minor_faults: u64,
+    pub major_faults: u64,
+}
+
+/// The enclave metrics of one stage, summed over its tasks, whose wall time they do not give.
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct StageBreakdown {
+    /// The OpId hash of the final op of the stage, in hex, the same in every run of a job.
+    pub stage: String,
+    pub tasks: u64,
+    pub ecall_s: f64,
+    pub crypto_s: f64,
+    pub ser_s: f64,
+    pub de_s: f64,
+    pub shuffle_write_s: f64,
+    pub bytes_encrypted: u64,
+    pub bytes_decrypted: u64,
+}
+
+/// Minor and major page faults of the process so far.
+pub(crate) fn page_faults() -> (u64, u64) {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return (0, 0);
+    }
+    (usage.ru_minflt as u64, usage.ru_majflt as u64)
+}
+
+/// The numbers of this process so far.
+pub fn breakdown() -> Breakdown {
+    let m = metrics::totals();
+    let snapshot = transitions::snapshot();
+    let (ecalls, ecall_ns) = snapshot.calls(true);
+    let (host_ocalls, host_ocall_ns) = snapshot.calls(false);
+    // The OCALLs of the enclave that the host serves with a handler of its own.
+    let served = snapshot.count(Site::OcallCacheToOutside)
+        + snapshot.count(Site::OcallCacheFromOutside)
+        + snapshot.count(Site::OcallCacheInvalidations)
+        + snapshot.count(Site::OcallGetBroadcast);
+    let (ser_ns, de_ns) = m.coding_ns();
+    let (minor_faults, major_faults) = page_faults();
+    Breakdown {
+        ecalls,
+        ecall_s: ecall_ns as f64 * 1e-9,
+        host_ocalls,
+        host_ocall_s: host_ocall_ns as f64 * 1e-9,
+        outside_alloc_ocalls: m.ocalls.saturating_sub(served),
+        inside_allocs: m.allocs,
+        crypto_s: m.crypto_ns() as f64 * 1e-9,
+        bytes_encrypted: m.bytes_encrypted,
+        bytes_decrypted: m.bytes_decrypted,
+        ser_s: ser_ns as f64 * 1e-9,
+        de_s: de_ns as f64 * 1e-9,
+        shuffle_write_s: m.shuffle_write_ns as f64 * 1e-9,
+        minor_faults,
+        major_faults,
+    }
+}
+
+/// The stages of the tasks the driver ran so far, the longest in the enclave first.
+pub fn stages() -> Vec<StageBreakdown> {
+    let mut stages = metrics::stage_totals()
+        .into_iter()
+        .map(|(op, tasks, m)| {
+            let (ser_ns, de_ns) = m.coding_ns();
+            StageBreakdown {
+                stage: format!("{:016x}", op),
+                tasks,
+                ecall_s: m.ecall_ns as f64 * 1e-9,
+                crypto_s: m.crypto_ns() as f64 * 1e-9,
+                ser_s: ser_ns as f64 * 1e-9,
+                de_s: de_ns as f64 * 1e-9,
+                shuffle_write_s: m.shuffle_write_ns as f64 * 1e-9,
+                bytes_encrypted: m.bytes_encrypted,
+                bytes_decrypted: m.bytes_decrypted,
+            }
+        })
+        .collect::<Vec<_>>();
+    stages.sort_by(|a, b| b.ecall_s.partial_cmp(&a.ecall_s).unwrap());
+    stages
+}
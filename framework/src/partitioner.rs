@@ -1,9 +1,9 @@
 use crate::serializable_traits::Data;
 use downcast_rs::Downcast;
-use fasthash::MetroHasher;
 use serde_derive::{Deserialize, Serialize};
 use serde_traitobject::{Deserialize, Serialize};
 use std::any::Any;
+use std::convert::TryInto;
 use std::hash::{Hash, Hasher};
 use std::marker::PhantomData;
 
@@ -18,12 +18,91 @@ pub trait Partitioner:
 
 dyn_clone::clone_trait_object!(Partitioner);
 
+/// Partitioner of a known key type, so that the bucketing loop of a shuffle goes without a
+/// downcast and a virtual call per record.
+pub trait TypedPartitioner<K> {
+    fn partition_of(&self, key: &K) -> usize;
+
+    fn partition_many(&self, keys: &[K]) -> Vec<u32> {
+        keys.iter().map(|key| self.partition_of(key) as u32).collect()
+    }
+}
+
+/// Any other partitioner still works, through `get_partition`.
+impl<K: Any> TypedPartitioner<K> for dyn Partitioner {
+    fn partition_of(&self, key: &K) -> usize {
+        self.get_partition(key)
+    }
+}
+
+const FX_SEED: u64 = 0x51_7c_c1_b7_27_22_0a_95;
+
+/// FxHash, a rotate and a multiply per word. Partitions only route records, so the hash need
+/// not resist collisions. The enclave hashes keys the same way (enclave/src/partitioner.rs).
+#[derive(Default)]
+struct FxHasher {
+    hash: u64,
+}
+
+impl FxHasher {
+    #[inline(always)]
+    fn add(&mut self, word: u64) {
+        self.hash = (self.hash.rotate_left(5) ^ word).wrapping_mul(FX_SEED);
+    }
+}
+
+impl Hasher for FxHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        let mut words = bytes.chunks_exact(8);
+        for word in &mut words {
+            self.add(u64::from_le_bytes(word.try_into().unwrap()));
+        }
+        let rest = words.remainder();
+        if !rest.is_empty() {
+            let mut word = [0; 8];
+            word[..rest.len()].copy_from_slice(rest);
+            self.add(u64::from_le_bytes(word));
+        }
+    }
+
+    fn write_u8(&mut self, i: u8) {
+        self.add(i as u64);
+    }
+
+    fn write_u16(&mut self, i: u16) {
+        self.add(i as u64);
+    }
+
+    fn write_u32(&mut self, i: u32) {
+        self.add(i as u64);
+    }
+
+    fn write_u64(&mut self, i: u64) {
+        self.add(i);
+    }
+
+    fn write_usize(&mut self, i: usize) {
+        self.add(i as u64);
+    }
+
+    fn finish(&self) -> u64 {
+        self.hash
+    }
+}
+
 fn hash<T: Hash>(t: &T) -> u64 {
-    let mut s: MetroHasher = Default::default();
+    let mut s = FxHasher::default();
     t.hash(&mut s);
     s.finish()
 }
 
+/// Maps the hash onto `0..partitions` by its high bits, where the multiply leaves the
+/// entropy, and without a division.
+#[inline(always)]
+fn reduce(hash: u64, partitions: usize) -> usize {
+    ((hash as u128 * partitions as u128) >> 64) as usize
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct HashPartitioner<K: Data + Hash + Eq> {
     partitions: usize,
@@ -53,7 +132,81 @@ impl<K: Data + Hash + Eq> Partitioner for HashPartitioner<K> {
     }
     fn get_partition(&self, key: &dyn Any) -> usize {
         let key = key.downcast_ref::<K>().unwrap();
-        hash(key) as usize % self.partitions
+        self.partition_of(key)
+    }
+}
+
+impl<K: Data + Hash + Eq> TypedPartitioner<K> for HashPartitioner<K> {
+    #[inline(always)]
+    fn partition_of(&self, key: &K) -> usize {
+        reduce(hash(key), self.partitions)
+    }
+
+    fn partition_many(&self, keys: &[K]) -> Vec<u32> {
+        let partitions = self.partitions;
+        keys.iter()
+            .map(|key| reduce(hash(key), partitions) as u32)
+            .collect()
+    }
+}
+
+/// Routes keys by sorted bounds, so that every key of a partition is below those of the next and
+/// the reduce side comes out in key order.
+///
+/// A shuffle in the enclave splits each partition into `max_thread() + 1` sub-buckets, so the
+/// enclave's `RangePartitioner` (enclave/src/partitioner.rs) cuts its sample into that many more
+/// ranges. Range `i` of `n` goes to partition `i * partitions / n` in both.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct RangePartitioner<K: Data + Ord> {
+    partitions: usize,
+    /// sorted, range `i` holds the keys up to and including `bounds[i]`
+    bounds: Vec<K>,
+}
+
+impl<K: Data + Ord> RangePartitioner<K> {
+    pub fn new(partitions: usize, bounds: Vec<K>) -> Self {
+        assert!(
+            bounds.windows(2).all(|w| w[0] <= w[1]),
+            "range bounds are not sorted"
+        );
+        RangePartitioner { partitions, bounds }
+    }
+
+    /// Bounds at the quantiles of a sample of the keys, such as one drawn with `sample`.
+    pub fn from_sample(partitions: usize, mut sample: Vec<K>) -> Self {
+        sample.sort_unstable();
+        let bounds = if sample.is_empty() {
+            Vec::new()
+        } else {
+            (1..partitions)
+                .map(|i| sample[i * sample.len() / partitions].clone())
+                .collect()
+        };
+        RangePartitioner::new(partitions, bounds)
+    }
+}
+
+impl<K: Data + Ord> Partitioner for RangePartitioner<K> {
+    fn equals(&self, other: &dyn Any) -> bool {
+        if let Some(rp) = other.downcast_ref::<RangePartitioner<K>>() {
+            self.partitions == rp.partitions && self.bounds == rp.bounds
+        } else {
+            false
+        }
+    }
+    fn get_num_of_partitions(&self) -> usize {
+        self.partitions
+    }
+    fn get_partition(&self, key: &dyn Any) -> usize {
+        let key = key.downcast_ref::<K>().unwrap();
+        self.partition_of(key)
+    }
+}
+
+impl<K: Data + Ord> TypedPartitioner<K> for RangePartitioner<K> {
+    fn partition_of(&self, key: &K) -> usize {
+        let range = self.bounds.partition_point(|bound| bound < key);
+        range * self.partitions / (self.bounds.len() + 1)
     }
 }
 
@@ -115,6 +268,26 @@ mod tests {
 
         let p2_1 = Box::new(p2_1) as Box<dyn Partitioner>;
         let p2_2 = Box::new(p2_2) as Box<dyn Partitioner>;
-        assert!(p2_1.equals((&*p2_2).as_any()))
+        assert!(p2_1.equals((&*p2_2).as_any()));
+        // The box itself is not a partitioner.
+        assert!(!p2_1.equals(&p2_2 as &dyn Any));
+    }
+
+    #[test]
+    fn range_partition() {
+        let sample = (0..100).rev().collect::<Vec<i32>>();
+        let range_partitioner = RangePartitioner::from_sample(4, sample);
+        assert_eq!(range_partitioner.get_partition(&-1), 0);
+        assert_eq!(range_partitioner.get_partition(&25), 0);
+        assert_eq!(range_partitioner.get_partition(&26), 1);
+        assert_eq!(range_partitioner.get_partition(&99), 3);
+        assert_eq!(range_partitioner.get_partition(&1000), 3);
+        let partitions = (-10..110)
+            .map(|i| range_partitioner.partition_of(&i))
+            .collect::<Vec<_>>();
+        assert!(partitions.windows(2).all(|w| w[0] <= w[1]));
+
+        let empty = RangePartitioner::<i32>::from_sample(3, vec![]);
+        assert_eq!(empty.get_partition(&7), 0);
     }
 }
@@ -0,0 +1,256 @@
+//! Provisioning of the master key to the enclaves of a host, see enclave/src/provision.rs.
+//!
+//! With VEGA_KEY_SERVICE set, the enclaves do not run on the development key. An enclave is
+//! attested once per build per host: the host turns its report into an EPID quote under
+//! VEGA_SPID, and the key service at that address verifies the quote and wraps the master key for
+//! the public key the report is bound to. The enclave seals the key, which the host keeps under
+//! `local_dir/ns-keys`, named after the hash of the signed enclave. The enclaves started later on
+//! the host, by this executor or the next one, unseal it without a round trip, and attest again
+//! only if it was sealed under another TCB or does not open.
+//!
+//! The key service speaks bincode over TCP, a `KeyRequest` and then a `KeyResponse`, each led by
+//! its length as a little endian u64.
+
+use std::fs;
+use std::io::{Read, Write};
+use std::net::TcpStream;
+use std::path::{Path, PathBuf};
+use std::ptr;
+use std::time::Instant;
+
+use crate::deploy::file_hash;
+use crate::env::Configuration;
+use crate::error::{Error, Result};
+use serde::{Deserialize, Serialize};
+use sgx_types::*;
+
+extern "C" {
+    fn provision_begin(
+        eid: sgx_enclave_id_t,
+        retval: *mut i32,
+        target_info: *const sgx_target_info_t,
+        report: *mut sgx_report_t,
+        pub_key: *mut sgx_ec256_public_t,
+    ) -> sgx_status_t;
+    fn provision_finish(
+        eid: sgx_enclave_id_t,
+        retval: *mut i32,
+        peer: *const sgx_ec256_public_t,
+        wrapped: *const u8,
+        len: usize,
+    ) -> sgx_status_t;
+    fn seal_master_key(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        buf: *mut u8,
+        cap: usize,
+    ) -> sgx_status_t;
+    fn unseal_master_key(
+        eid: sgx_enclave_id_t,
+        retval: *mut i32,
+        sealed: *mut u8,
+        len: usize,
+    ) -> sgx_status_t;
+}
+
+/// What `unseal_master_key` returns, see enclave/src/provision.rs.
+const UNSEALED: i32 = 0;
+const TCB_CHANGED: i32 = 1;
+
+/// A sealed master key is a few hundred bytes.
+const SEALED_KEY_BYTES: usize = 1024;
+/// Larger messages from the key service are refused.
+const MAX_RESPONSE_BYTES: u64 = 1 << 16;
+
+#[derive(Serialize)]
+struct KeyRequest {
+    quote: Vec<u8>,
+    /// gx || gy of the key of the enclave, whose sha256 leads the report data of the quote
+    public: Vec<u8>,
+}
+
+#[derive(Deserialize)]
+struct KeyResponse {
+    /// gx || gy of the key of the service
+    public: Vec<u8>,
+    /// nonce || AES-GCM ciphertext || tag of the master key, see `wrapping_key` of the enclave
+    wrapped: Vec<u8>,
+}
+
+/// Installs the master key in the enclave `eid`, before its job key is derived. Nothing to do
+/// without a key service.
+pub(crate) fn provision(eid: sgx_enclave_id_t, enclave_path: &Path) -> Result<()> {
+    let conf = Configuration::get();
+    let service = match &conf.key_service {
+        Some(service) => service,
+        None => return Ok(()),
+    };
+    let sealed_path = sealed_key_path(&conf.local_dir, enclave_path)?;
+    if let Ok(mut sealed) = fs::read(&sealed_path) {
+        match unseal(eid, &mut sealed)? {
+            UNSEALED => {
+                log::debug!("enclave {} unsealed the master key", eid);
+                return Ok(());
+            }
+            TCB_CHANGED => log::info!("the TCB changed since the master key was sealed"),
+            _ => log::warn!("the master key at {} does not open", sealed_path.display()),
+        }
+    }
+    let started = Instant::now();
+    attest(eid, service, &conf.spid)?;
+    log::info!(
+        "enclave {} attested to {} in {:?}",
+        eid,
+        service,
+        started.elapsed()
+    );
+    let sealed = seal(eid)?;
+    // The other enclaves of the host only take a whole key.
+    let output_err = |source: std::io::Error| Error::OutputFile {
+        source,
+        path: sealed_path.clone(),
+    };
+    fs::create_dir_all(sealed_path.parent().unwrap()).map_err(output_err)?;
+    let tmp = sealed_path.with_extension(format!("tmp-{}", std::process::id()));
+    fs::write(&tmp, &sealed).map_err(output_err)?;
+    fs::rename(&tmp, &sealed_path).map_err(output_err)
+}
+
+fn sealed_key_path(local_dir: &Path, enclave_path: &Path) -> Result<PathBuf> {
+    let hash = file_hash(enclave_path)?;
+    Ok(local_dir
+        .join("ns-keys")
+        .join(format!("{:016x}.sealed", hash)))
+}
+
+fn check(status: sgx_status_t, what: &str) -> Result<()> {
+    match status {
+        sgx_status_t::SGX_SUCCESS => Ok(()),
+        status => Err(Error::Attestation(format!(
+            "{} failed: {}",
+            what,
+            status.as_str()
+        ))),
+    }
+}
+
+fn attest(eid: sgx_enclave_id_t, service: &str, spid: &[u8; 16]) -> Result<()> {
+    let spid = sgx_spid_t { id: *spid };
+    let mut target_info = sgx_target_info_t::default();
+    let mut gid = sgx_epid_group_id_t::default();
+    check(
+        unsafe { sgx_init_quote(&mut target_info, &mut gid) },
+        "sgx_init_quote",
+    )?;
+    let mut report = sgx_report_t::default();
+    let mut public = sgx_ec256_public_t::default();
+    let mut began = 0;
+    check(
+        unsafe { provision_begin(eid, &mut began, &target_info, &mut report, &mut public) },
+        "provision_begin",
+    )?;
+    if began == 0 {
+        return Err(Error::Attestation("the enclave made no report".into()));
+    }
+    let mut quote_size = 0;
+    check(
+        unsafe { sgx_calc_quote_size(ptr::null(), 0, &mut quote_size) },
+        "sgx_calc_quote_size",
+    )?;
+    let mut quote = vec![0u8; quote_size as usize];
+    check(
+        unsafe {
+            sgx_get_quote(
+                &report,
+                sgx_quote_sign_type_t::SGX_UNLINKABLE_SIGNATURE,
+                &spid,
+                ptr::null(),
+                ptr::null(),
+                0,
+                ptr::null_mut(),
+                quote.as_mut_ptr() as *mut sgx_quote_t,
+                quote_size,
+            )
+        },
+        "sgx_get_quote",
+    )?;
+
+    let mut key = public.gx.to_vec();
+    key.extend_from_slice(&public.gy);
+    let response = exchange(service, &KeyRequest { quote, public: key })?;
+    if response.public.len() != SGX_ECP256_KEY_SIZE * 2 {
+        return Err(Error::Attestation(
+            "malformed key of the key service".into(),
+        ));
+    }
+    let mut peer = sgx_ec256_public_t::default();
+    peer.gx
+        .copy_from_slice(&response.public[..SGX_ECP256_KEY_SIZE]);
+    peer.gy
+        .copy_from_slice(&response.public[SGX_ECP256_KEY_SIZE..]);
+    let mut opened = 0;
+    check(
+        unsafe {
+            provision_finish(
+                eid,
+                &mut opened,
+                &peer,
+                response.wrapped.as_ptr(),
+                response.wrapped.len(),
+            )
+        },
+        "provision_finish",
+    )?;
+    if opened == 0 {
+        return Err(Error::Attestation(
+            "the wrapped master key does not open".into(),
+        ));
+    }
+    Ok(())
+}
+
+fn exchange(service: &str, request: &KeyRequest) -> Result<KeyResponse> {
+    let io_err = |e: std::io::Error| Error::Attestation(format!("key service {}: {}", service, e));
+    let mut stream = TcpStream::connect(service).map_err(io_err)?;
+    let bytes = bincode::serialize(request)?;
+    stream
+        .write_all(&(bytes.len() as u64).to_le_bytes())
+        .map_err(io_err)?;
+    stream.write_all(&bytes).map_err(io_err)?;
+    let mut len = [0; 8];
+    stream.read_exact(&mut len).map_err(io_err)?;
+    let len = u64::from_le_bytes(len);
+    if len > MAX_RESPONSE_BYTES {
+        return Err(Error::Attestation(
+            "oversized answer of the key service".into(),
+        ));
+    }
+    let mut bytes = vec![0; len as usize];
+    stream.read_exact(&mut bytes).map_err(io_err)?;
+    Ok(bincode::deserialize(&bytes)?)
+}
+
+fn seal(eid: sgx_enclave_id_t) -> Result<Vec<u8>> {
+    let mut sealed = vec![0u8; SEALED_KEY_BYTES];
+    let mut len = 0;
+    check(
+        unsafe { seal_master_key(eid, &mut len, sealed.as_mut_ptr(), sealed.len()) },
+        "seal_master_key",
+    )?;
+    if len == 0 || len > sealed.len() {
+        return Err(Error::Attestation(
+            "the enclave did not seal the master key".into(),
+        ));
+    }
+    sealed.truncate(len);
+    Ok(sealed)
+}
+
+fn unseal(eid: sgx_enclave_id_t, sealed: &mut [u8]) -> Result<i32> {
+    let mut res = 0;
+    check(
+        unsafe { unseal_master_key(eid, &mut res, sealed.as_mut_ptr(), sealed.len()) },
+        "unseal_master_key",
+    )?;
+    Ok(res)
+}
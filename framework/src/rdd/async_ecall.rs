@@ -0,0 +1,101 @@
+//! ECALLs awaited from async code.
+//!
+//! The wrappers of rdd.rs hold their thread for as long as the enclave runs. On a worker of a
+//! runtime that stalls every future the worker polls, and from `spawn_blocking` it takes a thread
+//! of the blocking pool per call. The functions here queue the same wrappers on `ENTRY_POOL`, host
+//! threads that only enter the enclave, and hand back futures, so a task can fetch, send or read
+//! while its enclave work runs. A call goes to the enclave its caller is bound to.
+
+use std::collections::HashMap;
+
+use crate::dependency::DepInfo;
+use crate::env::{self, Env};
+use crate::rdd::{
+    get_encrypted_data, wrapper_action, wrapper_secure_execute, wrapper_take, CacheMeta,
+    EcallFuture, EcallPool, OpId,
+};
+use crate::serializable_traits::Data;
+use crate::serialization_free::Construct;
+use once_cell::sync::Lazy;
+use serde_traitobject::Serialize;
+
+/// Host threads the async ECALLs enter the enclave from, as many as tasks may hold the stage
+/// lock. Apart from `ECALL_POOL`, so awaited calls never queue behind cached partitions.
+pub static ENTRY_POOL: Lazy<EcallPool> =
+    Lazy::new(|| EcallPool::new(env::Configuration::get().max_stage_holders()));
+
+/// Runs `f`, which makes ECALLs, on `ENTRY_POOL` bound to the enclave of the caller.
+pub fn ecall<F, R>(f: F) -> EcallFuture<R>
+where
+    F: FnOnce() -> R + Send + 'static,
+    R: Send + 'static,
+{
+    let enclave = Env::bound_enclave();
+    ENTRY_POOL.call(move || {
+        let _bound = Env::bind_enclave(enclave);
+        f()
+    })
+}
+
+/// `wrapper_secure_execute` of owned arguments.
+pub fn secure_execute_async<T>(
+    rdd_ids: Vec<usize>,
+    op_ids: Vec<OpId>,
+    part_ids: Vec<usize>,
+    cache_meta: CacheMeta,
+    dep_info: DepInfo,
+    data: T,
+    captured_vars: HashMap<usize, Vec<Vec<u8>>>,
+) -> EcallFuture<usize>
+where
+    T: Construct + Data,
+{
+    ecall(move || {
+        wrapper_secure_execute(
+            &rdd_ids,
+            &op_ids,
+            &part_ids,
+            cache_meta,
+            dep_info,
+            &data,
+            &captured_vars,
+        )
+    })
+}
+
+/// `wrapper_action`.
+pub fn action_async<T: Data>(
+    data: Vec<T>,
+    rdd_id: usize,
+    op_id: OpId,
+    is_local: bool,
+) -> EcallFuture<usize> {
+    ecall(move || wrapper_action(data, rdd_id, op_id, is_local))
+}
+
+/// `get_encrypted_data`, of the result the enclave left at `p_data_enc`.
+pub fn encrypted_data_async<T>(
+    op_id: OpId,
+    dep_info: DepInfo,
+    p_data_enc: usize,
+) -> EcallFuture<Box<Vec<T>>>
+where
+    T: std::fmt::Debug
+        + Clone
+        + Send
+        + Serialize
+        + serde::ser::Serialize
+        + serde::de::DeserializeOwned
+        + 'static,
+{
+    ecall(move || get_encrypted_data::<T>(op_id, dep_info, p_data_enc as *mut u8))
+}
+
+/// `wrapper_take`.
+pub fn take_async<T: Data>(
+    op_id: OpId,
+    input: Vec<T>,
+    should_take: usize,
+) -> EcallFuture<(Vec<T>, usize)> {
+    ecall(move || wrapper_take(op_id, &input, should_take))
+}
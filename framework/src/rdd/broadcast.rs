@@ -0,0 +1,273 @@
+//! Values shared with all tasks, mirroring enclave/src/op/broadcast.rs.
+//!
+//! `Broadcast` is the small side of a broadcast join, see `PairRdd::broadcast_join`. It is
+//! captured by the closure of the `flat_map` that probes it, so it ships to the enclave with the
+//! captured vars of that op. Only the encrypted blocks of the small side and the rows that were
+//! never encrypted are serialized. The host never decrypts the blocks, its table only holds the
+//! plaintext rows.
+//!
+//! `BroadcastVar` is the handle of a value made by `Context::broadcast`. Closures capture only
+//! the handle, the value itself goes to each executor once through the broadcast tracker.
+//!
+//! `SemiJoinFilter` is a `KeyFilter` of the keys of one side of a join, from
+//! `PairRdd::secure_key_filter`, that `PairRdd::join_pruned` captures to drop the items of the
+//! other side whose keys that side cannot have before they are shuffled. Like a `Broadcast` only
+//! its ciphertext travels, the enclave decrypts it once per task. The host cannot, so the host
+//! only prunes with a filter computed in plaintext.
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::marker::PhantomData;
+
+use crate::env::Env;
+use crate::rdd::{ser_decrypt, ser_encrypt, ItemE, Text};
+use crate::serializable_traits::Data;
+use serde::{Deserialize, Deserializer, Serialize, Serializer};
+use serde_derive::{Deserialize as DeserializeDerive, Serialize as SerializeDerive};
+
+#[derive(Clone, Debug, Default)]
+pub struct Broadcast<K, W> {
+    blocks: Vec<ItemE>,
+    rows: Vec<(K, W)>,
+    table: HashMap<K, Vec<W>>,
+}
+
+impl<K: Data + Eq + Hash, W: Data> Broadcast<K, W> {
+    pub fn new(small: &Text<Vec<(K, W)>, Vec<ItemE>>) -> Self {
+        let blocks = small.data_enc.clone().unwrap_or_default();
+        let rows = small.data.clone().unwrap_or_default();
+        Broadcast::from_parts(blocks, rows)
+    }
+
+    fn from_parts(blocks: Vec<ItemE>, rows: Vec<(K, W)>) -> Self {
+        let mut table: HashMap<K, Vec<W>> = HashMap::new();
+        for (k, w) in rows.iter().cloned() {
+            table.entry(k).or_default().push(w);
+        }
+        Broadcast {
+            blocks,
+            rows,
+            table,
+        }
+    }
+
+    /// The values of the small side under `k`, empty if it has none. Only the plaintext rows are
+    /// found on the host.
+    pub fn get(&self, k: &K) -> &[W] {
+        self.table.get(k).map_or(&[], |ws| ws.as_slice())
+    }
+}
+
+impl<K: Serialize, W: Serialize> Serialize for Broadcast<K, W> {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        (&self.blocks, &self.rows).serialize(serializer)
+    }
+}
+
+impl<'de, K: Data + Eq + Hash, W: Data> Deserialize<'de> for Broadcast<K, W> {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Self, D::Error> {
+        let (blocks, rows) = <(Vec<ItemE>, Vec<(K, W)>)>::deserialize(deserializer)?;
+        Ok(Broadcast::from_parts(blocks, rows))
+    }
+}
+
+/// A Bloom filter of keys. `may_contain` is false only for keys never inserted, and true for
+/// about a fraction `fpp`, given at `new`, of the others. The default filter is empty, it rules
+/// nothing out, so it is also the filter of no key at all when aggregating.
+#[derive(Clone, Debug, SerializeDerive, DeserializeDerive)]
+#[serde(bound = "")]
+pub struct KeyFilter<K> {
+    bits: Vec<u64>,
+    hashes: u32,
+    _marker: PhantomData<K>,
+}
+
+impl<K> Default for KeyFilter<K> {
+    fn default() -> Self {
+        KeyFilter {
+            bits: Vec::new(),
+            hashes: 0,
+            _marker: PhantomData,
+        }
+    }
+}
+
+impl<K: Hash> KeyFilter<K> {
+    /// A filter sized for `expected_keys` keys with a false positive rate of `fpp`.
+    pub fn new(expected_keys: usize, fpp: f64) -> Self {
+        let n = expected_keys.max(1) as f64;
+        let ln2 = std::f64::consts::LN_2;
+        let m = (-n * fpp.max(f64::MIN_POSITIVE).min(0.5).ln() / (ln2 * ln2)).ceil() as usize;
+        let words = (m.max(64) + 63) / 64;
+        let hashes = ((words * 64) as f64 / n * ln2).round().max(1.0) as u32;
+        KeyFilter {
+            bits: vec![0; words],
+            hashes,
+            _marker: PhantomData,
+        }
+    }
+
+    /// The bits of `key`, by double hashing the two halves of one hash.
+    fn positions(&self, key: &K) -> impl Iterator<Item = usize> {
+        let mut hasher = DefaultHasher::new();
+        key.hash(&mut hasher);
+        let hash = hasher.finish();
+        let (h1, h2) = (hash as u32 as u64, (hash >> 32) | 1);
+        let m = self.bits.len() as u64 * 64;
+        (0..self.hashes as u64).map(move |i| (h1.wrapping_add(i.wrapping_mul(h2)) % m) as usize)
+    }
+
+    pub fn insert(&mut self, key: &K) {
+        if self.bits.is_empty() {
+            return;
+        }
+        for i in self.positions(key).collect::<Vec<_>>() {
+            self.bits[i / 64] |= 1 << (i % 64);
+        }
+    }
+
+    /// The filter of the keys of both, which must have been made by the same `new`.
+    pub fn union(mut self, other: Self) -> Self {
+        if self.bits.is_empty() {
+            return other;
+        }
+        if !other.bits.is_empty() {
+            assert_eq!(
+                self.bits.len(),
+                other.bits.len(),
+                "filters of different sizes"
+            );
+            for (a, b) in self.bits.iter_mut().zip(other.bits) {
+                *a |= b;
+            }
+        }
+        self
+    }
+
+    pub fn may_contain(&self, key: &K) -> bool {
+        self.bits.is_empty()
+            || self
+                .positions(key)
+                .all(|i| self.bits[i / 64] & (1 << (i % 64)) != 0)
+    }
+}
+
+/// The filter `PairRdd::join_pruned` prunes with, its ciphertext for the enclave and the filter
+/// itself when the host has it in plaintext.
+#[derive(Clone, Debug, Default)]
+pub struct SemiJoinFilter<K> {
+    filter_enc: Option<ItemE>,
+    filter: Option<KeyFilter<K>>,
+}
+
+impl<K: Hash> SemiJoinFilter<K> {
+    pub fn new(filter: &Text<KeyFilter<K>, ItemE>) -> Self {
+        SemiJoinFilter {
+            filter_enc: filter.data_enc.clone(),
+            filter: filter.data.clone(),
+        }
+    }
+
+    /// True unless the keys filtered certainly do not have `key`. Always true on the host for
+    /// an encrypted filter.
+    pub fn may_contain(&self, key: &K) -> bool {
+        self.filter
+            .as_ref()
+            .map_or(true, |filter| filter.may_contain(key))
+    }
+}
+
+impl<K> Serialize for SemiJoinFilter<K> {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        (&self.filter_enc, &self.filter).serialize(serializer)
+    }
+}
+
+impl<'de, K> Deserialize<'de> for SemiJoinFilter<K> {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Self, D::Error> {
+        let (filter_enc, filter) =
+            <(Option<ItemE>, Option<KeyFilter<K>>)>::deserialize(deserializer)?;
+        Ok(SemiJoinFilter { filter_enc, filter })
+    }
+}
+
+#[derive(Debug, SerializeDerive, DeserializeDerive)]
+#[serde(bound = "")]
+pub struct BroadcastVar<T> {
+    id: u64,
+    _marker: PhantomData<T>,
+}
+
+impl<T> Clone for BroadcastVar<T> {
+    fn clone(&self) -> Self {
+        *self
+    }
+}
+
+impl<T> Copy for BroadcastVar<T> {}
+
+impl<T: Data> BroadcastVar<T> {
+    pub(crate) fn new(id: u64) -> Self {
+        BroadcastVar {
+            id,
+            _marker: PhantomData,
+        }
+    }
+
+    pub fn id(&self) -> u64 {
+        self.id
+    }
+
+    /// The value for tasks that run outside the enclave. Secure tasks read it in the enclave,
+    /// which keeps one decrypted copy per broadcast.
+    pub fn value(&self) -> T {
+        let ct = Env::get()
+            .broadcast_tracker
+            .get(self.id)
+            .unwrap_or_else(|| panic!("broadcast #{} not found", self.id));
+        ser_decrypt(&ct)
+    }
+}
+
+/// What the tracker keeps of a broadcast value, its ciphertext, encrypting it first if the driver
+/// only has the plaintext.
+pub(crate) fn encrypted_value<T: Data>(value: &Text<T, ItemE>) -> ItemE {
+    match (&value.data_enc, &value.data) {
+        (Some(ct), _) => ct.clone(),
+        (None, Some(pt)) => ser_encrypt(pt),
+        (None, None) => panic!("empty broadcast value"),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn broadcast_round_trip() {
+        let small = Text::new(
+            Some(vec![(1u32, 'a'), (2, 'b'), (1, 'c')]),
+            None::<Vec<ItemE>>,
+        );
+        let broadcast = Broadcast::new(&small);
+        let bytes = bincode::serialize(&broadcast).unwrap();
+        let broadcast: Broadcast<u32, char> = bincode::deserialize(&bytes).unwrap();
+        assert_eq!(broadcast.get(&1), &['a', 'c']);
+        assert_eq!(broadcast.get(&2), &['b']);
+        assert!(broadcast.get(&3).is_empty());
+    }
+
+    #[test]
+    fn key_filter_union() {
+        let mut evens = KeyFilter::new(100, 0.01);
+        let mut odds = KeyFilter::new(100, 0.01);
+        (0..100u32).step_by(2).for_each(|k| evens.insert(&k));
+        (1..100u32).step_by(2).for_each(|k| odds.insert(&k));
+        assert!((0..100).step_by(2).all(|k| evens.may_contain(&k)));
+        let false_positives = (1000..2000u32).filter(|k| evens.may_contain(k)).count();
+        assert!(false_positives < 50);
+        let all = KeyFilter::default().union(evens).union(odds);
+        assert!((0..100).all(|k| all.may_contain(&k)));
+        assert!(KeyFilter::<u32>::default().may_contain(&7));
+    }
+}
@@ -1,7 +1,7 @@
 use itertools::{iproduct, Itertools};
 
 use crate::context::Context;
-use crate::dependency::Dependency;
+use crate::dependency::{CartesianDependency, Dependency};
 use crate::env::{Env, RDDB_MAP};
 use crate::error::{Error, Result};
 use crate::rdd::*;
@@ -11,7 +11,6 @@ use parking_lot::Mutex;
 use serde_derive::{Deserialize, Serialize};
 use std::marker::PhantomData;
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::JoinHandle;
 
 #[derive(Clone, Serialize, Deserialize)]
 struct CartesianSplit {
@@ -64,6 +63,64 @@ where
             _market_u: PhantomData,
         }
     }
+
+    fn secure_compute_prev(
+        &self,
+        split: Box<dyn Split>,
+        acc_arg: &mut AccArg,
+        tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        let current_split = split
+            .downcast::<CartesianSplit>()
+            .or(Err(Error::DowncastFailure("CartesianSplit")))?;
+
+        let dep_info = DepInfo::padding_new(0);
+        let fst = self
+            .rdd1
+            .secure_iterator(current_split.s1.clone(), dep_info.clone(), None)?
+            .collect::<Vec<_>>();
+        let sec = self
+            .rdd2
+            .secure_iterator(current_split.s2.clone(), dep_info, None)?
+            .collect::<Vec<_>>();
+
+        let data = self.secure_cartesian((fst, sec), acc_arg);
+        let acc_arg = acc_arg.clone();
+        let handle = std::thread::spawn(move || {
+            let now = Instant::now();
+            let wait = start_execute(acc_arg, data, tx);
+            let dur = now.elapsed().as_nanos() as f64 * 1e-9 - wait;
+            println!("***in cartesian rdd, compute, total {:?}***", dur);
+        });
+        Ok(vec![handle.into()])
+    }
+
+    /// Pairs the encrypted blocks of the two partitions in the enclave, which holds a tile of the
+    /// first at a time and streams the blocks of the second against it.
+    fn secure_cartesian(
+        &self,
+        data: (Vec<ItemE>, Vec<ItemE>),
+        acc_arg: &mut AccArg,
+    ) -> Vec<ItemE> {
+        acc_arg.get_enclave_lock();
+        let cur_rdd_ids = vec![self.vals.id];
+        let cur_op_ids = vec![self.vals.op_id];
+        let cur_part_ids = vec![*acc_arg.part_ids.last().unwrap()];
+        let dep_info = DepInfo::padding_new(2);
+
+        let result_ptr = wrapper_secure_execute(
+            &cur_rdd_ids,
+            &cur_op_ids,
+            &cur_part_ids,
+            Default::default(),
+            dep_info,
+            &data,
+            &acc_arg.captured_vars,
+        );
+        let result = get_encrypted_data::<ItemE>(cur_op_ids[0], dep_info, result_ptr as *mut u8);
+        acc_arg.free_enclave_lock();
+        *result
+    }
 }
 
 impl<T, U> Clone for CartesianRdd<T, U>
@@ -93,6 +150,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -106,7 +167,7 @@ where
     }
 
     fn get_op_ids(&self, op_ids: &mut Vec<OpId>) {
-        todo!()
+        op_ids.push(self.get_op_id());
     }
 
     fn get_context(&self) -> Arc<Context> {
@@ -114,7 +175,18 @@ where
     }
 
     fn get_dependencies(&self) -> Vec<Dependency> {
-        todo!()
+        vec![
+            Dependency::NarrowDependency(Arc::new(CartesianDependency::new(
+                self.rdd1.get_rdd_base(),
+                self.num_partitions_in_rdd2,
+                true,
+            ))),
+            Dependency::NarrowDependency(Arc::new(CartesianDependency::new(
+                self.rdd2.get_rdd_base(),
+                self.num_partitions_in_rdd2,
+                false,
+            ))),
+        ]
     }
 
     fn get_secure(&self) -> bool {
@@ -145,7 +217,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -187,8 +259,24 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
-        //TODO
-        Err(Error::UnsupportedOperation("Unsupported secure_compute"))
+    ) -> Result<Vec<EcallHandle>> {
+        let cur_rdd_id = self.get_rdd_id();
+        let cur_op_id = self.get_op_id();
+        let cur_part_id = split.get_index();
+        let cur_split_num = self.number_of_splits();
+        acc_arg.insert_quadruple(cur_rdd_id, cur_op_id, cur_part_id, cur_split_num);
+
+        let should_cache = self.should_cache();
+        if should_cache {
+            let mut handles = secure_compute_cached(acc_arg, cur_rdd_id, cur_part_id, tx.clone());
+
+            if handles.is_empty() {
+                acc_arg.set_caching_rdd_id(cur_rdd_id);
+                handles.append(&mut self.secure_compute_prev(split, acc_arg, tx)?);
+            }
+            Ok(handles)
+        } else {
+            self.secure_compute_prev(split, acc_arg, tx)
+        }
     }
 }
@@ -1,4 +1,3 @@
-use std::any::Any;
 use std::collections::HashMap;
 use std::hash::{Hash, Hasher};
 use std::slice::Chunks;
@@ -6,7 +5,6 @@ use std::sync::{
     mpsc::{self, SyncSender},
     Arc,
 };
-use std::thread::{self, JoinHandle};
 
 use crate::aggregator::Aggregator;
 use crate::context::Context;
@@ -48,6 +46,23 @@ impl CoGroupSplit {
     fn new(index: usize, deps: Vec<CoGroupSplitDep>) -> Self {
         CoGroupSplit { index, deps }
     }
+
+    /// Looks the map outputs of both shuffle deps up in one round trip to the driver.
+    fn prefetch_server_uris(&self) -> Result<()> {
+        let shuffle_ids = self
+            .deps
+            .iter()
+            .filter_map(|dep| match dep {
+                CoGroupSplitDep::ShuffleCoGroupSplitDep { shuffle_id } => Some(*shuffle_id),
+                _ => None,
+            })
+            .collect::<Vec<_>>();
+        futures::executor::block_on(
+            Env::get()
+                .map_output_tracker
+                .prefetch_server_uris(&shuffle_ids),
+        )
+    }
 }
 
 impl Hasher for CoGroupSplit {
@@ -102,14 +117,14 @@ where
 
         if !rdd0
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             vals.shuffle_ids.push(context.new_shuffle_id());
         }
 
         if !rdd1
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             vals.shuffle_ids.push(context.new_shuffle_id());
         }
@@ -128,8 +143,9 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         if let Ok(split) = split.downcast::<CoGroupSplit>() {
+            split.prefetch_server_uris()?;
             let mut deps = split.clone().deps;
             let mut num_sub_part = vec![0, 0]; //kv, kw
             let mut kv = (Vec::new(), Vec::new());
@@ -141,7 +157,7 @@ where
                     let mut acc_arg_cg = AccArg::new(
                         DepInfo::padding_new(0),
                         None,
-                        Arc::new(AtomicBool::new(false)),
+                        Arc::new(EnterLock::new()),
                     );
                     let handles = rdd.iterator_raw(split, &mut acc_arg_cg, tx)?; //TODO need sorted
                     let mut kv_0 = Vec::new();
@@ -201,7 +217,7 @@ where
                     let mut acc_arg_cg = AccArg::new(
                         DepInfo::padding_new(0),
                         None,
-                        Arc::new(AtomicBool::new(false)),
+                        Arc::new(EnterLock::new()),
                     );
                     let handles = rdd.iterator_raw(split, &mut acc_arg_cg, tx)?; //TODO need sorted
                     let mut kw_0 = Vec::new();
@@ -268,7 +284,7 @@ where
                 let dur = now.elapsed().as_nanos() as f64 * 1e-9 - wait;
                 println!("***in co grouped rdd, compute, total {:?}***", dur);
             });
-            Ok(vec![handle])
+            Ok(vec![handle.into()])
         } else {
             Err(Error::DowncastFailure(
                 "Got split object from different concrete type other than CoGroupSplit",
@@ -320,6 +336,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -351,7 +371,7 @@ where
 
         if rdd0
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             let rdd_base = rdd0.get_rdd_base();
             deps.push(Dependency::NarrowDependency(
@@ -378,7 +398,7 @@ where
 
         if rdd1
             .partitioner()
-            .map_or(false, |p| p.equals(&part as &dyn Any))
+            .map_or(false, |p| p.equals((&*part).as_any()))
         {
             let rdd_base = rdd1.get_rdd_base();
             deps.push(Dependency::NarrowDependency(
@@ -450,7 +470,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -485,6 +505,7 @@ where
     fn compute(&self, split: Box<dyn Split>) -> Result<Box<dyn Iterator<Item = Self::Item>>> {
         if let Ok(split) = split.downcast::<CoGroupSplit>() {
             let mut agg: HashMap<K, (Vec<V>, Vec<W>)> = HashMap::new();
+            split.prefetch_server_uris()?;
             let mut deps = split.clone().deps;
 
             match deps.remove(0) {
@@ -566,7 +587,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
@@ -587,3 +608,142 @@ where
         }
     }
 }
+
+/// The join of two pair RDDs computed from their cogroup without materializing it, the
+/// counterpart of the `MergeJoined` op of the enclave. It shares the id, splits and dependencies
+/// of the cogroup, so both sides are shuffled exactly as for `cogroup`, but the enclave merges the
+/// sorted runs of the shuffle into joined pairs directly.
+#[derive(Clone, Serialize, Deserialize)]
+pub struct MergeJoinedRdd<K, V, W>
+where
+    K: Data + Eq + Hash,
+    V: Data,
+    W: Data,
+{
+    pub(crate) cogrouped: CoGroupedRdd<K, V, W>,
+}
+
+impl<K, V, W> MergeJoinedRdd<K, V, W>
+where
+    K: Data + Eq + Hash,
+    V: Data,
+    W: Data,
+{
+    #[track_caller]
+    pub fn new(
+        rdd0: Arc<dyn Rdd<Item = (K, V)>>,
+        rdd1: Arc<dyn Rdd<Item = (K, W)>>,
+        part: Box<dyn Partitioner>,
+    ) -> Self {
+        MergeJoinedRdd {
+            cogrouped: CoGroupedRdd::new(rdd0, rdd1, part),
+        }
+    }
+}
+
+impl<K, V, W> RddBase for MergeJoinedRdd<K, V, W>
+where
+    K: Data + Eq + Hash,
+    V: Data,
+    W: Data,
+{
+    fn cache(&self) {
+        self.cogrouped.vals.cache();
+        RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
+    }
+
+    fn uncache(&self) {
+        self.cogrouped.vals.uncache();
+    }
+
+    fn should_cache(&self) -> bool {
+        self.cogrouped.should_cache()
+    }
+
+    fn get_rdd_id(&self) -> usize {
+        self.cogrouped.get_rdd_id()
+    }
+
+    fn get_op_id(&self) -> OpId {
+        self.cogrouped.get_op_id()
+    }
+
+    fn get_op_ids(&self, op_ids: &mut Vec<OpId>) {
+        op_ids.push(self.get_op_id());
+    }
+
+    fn get_context(&self) -> Arc<Context> {
+        self.cogrouped.get_context()
+    }
+
+    fn get_dependencies(&self) -> Vec<Dependency> {
+        self.cogrouped.get_dependencies()
+    }
+
+    fn get_secure(&self) -> bool {
+        self.cogrouped.get_secure()
+    }
+
+    fn splits(&self) -> Vec<Box<dyn Split>> {
+        self.cogrouped.splits()
+    }
+
+    fn number_of_splits(&self) -> usize {
+        self.cogrouped.number_of_splits()
+    }
+
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.cogrouped.partitioner()
+    }
+
+    fn iterator_raw(
+        &self,
+        split: Box<dyn Split>,
+        acc_arg: &mut AccArg,
+        tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        self.secure_compute(split, acc_arg, tx)
+    }
+
+    fn iterator_any(&self, split: Box<dyn Split>) -> Result<Box<dyn AnyData>> {
+        let res = self.iterator(split)?.collect::<Vec<_>>();
+        Ok(Box::new(res) as Box<dyn AnyData>)
+    }
+}
+
+impl<K, V, W> Rdd for MergeJoinedRdd<K, V, W>
+where
+    K: Data + Eq + Hash,
+    V: Data,
+    W: Data,
+{
+    type Item = (K, (V, W));
+
+    fn get_rdd(&self) -> Arc<dyn Rdd<Item = Self::Item>> {
+        Arc::new(self.clone())
+    }
+
+    fn get_rdd_base(&self) -> Arc<dyn RddBase> {
+        Arc::new(self.clone()) as Arc<dyn RddBase>
+    }
+
+    fn compute(&self, split: Box<dyn Split>) -> Result<Box<dyn Iterator<Item = Self::Item>>> {
+        let joined = self.cogrouped.compute(split)?.flat_map(|(k, (vs, ws))| {
+            vs.into_iter().flat_map(move |v| {
+                let k = k.clone();
+                ws.clone().into_iter().map(move |w| (k.clone(), (v.clone(), w)))
+            })
+        });
+        Ok(Box::new(joined))
+    }
+
+    fn secure_compute(
+        &self,
+        split: Box<dyn Split>,
+        acc_arg: &mut AccArg,
+        tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        // The enclave op of the same id emits the joined pairs.
+        self.cogrouped.secure_compute(split, acc_arg, tx)
+    }
+}
@@ -3,7 +3,6 @@ use std::collections::{HashMap, HashSet};
 use std::net::Ipv4Addr;
 use std::sync::atomic::{AtomicUsize, Ordering as SyncOrd};
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::JoinHandle;
 
 use parking_lot::Mutex;
 use rand::Rng;
@@ -146,6 +145,37 @@ where
     }
 }
 
+impl<T> CoalescedRdd<T>
+where
+    T: Data,
+{
+    /// Runs the ops above once for every parent partition of `split`.
+    ///
+    /// A coalesced partition is its parent partitions back to back, so its encrypted result is the
+    /// block lists of the parents, which reach the receiver of `tx` one after another. A parent at
+    /// the head of the chain has its blocks copied through without being decrypted.
+    fn secure_compute_prev(
+        &self,
+        split: Box<dyn Split>,
+        acc_arg: &mut AccArg,
+        tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        let split = CoalescedRddSplit::downcasting(split);
+        let mut handles = Vec::new();
+        for (_, p) in self
+            .parent
+            .splits()
+            .into_iter()
+            .enumerate()
+            .filter(|(i, _)| split.parent_indices.contains(i))
+        {
+            let mut acc_arg = acc_arg.clone();
+            handles.append(&mut self.parent.secure_compute(p, &mut acc_arg, tx.clone())?);
+        }
+        Ok(handles)
+    }
+}
+
 impl<T> RddBase for CoalescedRdd<T>
 where
     T: Data,
@@ -155,6 +185,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -225,7 +259,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -271,9 +305,25 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
-        //TODO need revision
-        Err(Error::UnsupportedOperation("Unsupported secure_compute"))
+    ) -> Result<Vec<EcallHandle>> {
+        let cur_rdd_id = self.get_rdd_id();
+        let cur_op_id = self.get_op_id();
+        let cur_part_id = split.get_index();
+        let cur_split_num = self.number_of_splits();
+        acc_arg.insert_quadruple(cur_rdd_id, cur_op_id, cur_part_id, cur_split_num);
+
+        let should_cache = self.should_cache();
+        if should_cache {
+            let mut handles = secure_compute_cached(acc_arg, cur_rdd_id, cur_part_id, tx.clone());
+
+            if handles.is_empty() {
+                acc_arg.set_caching_rdd_id(cur_rdd_id);
+                handles.append(&mut self.secure_compute_prev(split, acc_arg, tx)?);
+            }
+            Ok(handles)
+        } else {
+            self.secure_compute_prev(split, acc_arg, tx)
+        }
     }
 }
 
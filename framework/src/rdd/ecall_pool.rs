@@ -0,0 +1,163 @@
+use std::future::Future;
+use std::panic::{self, AssertUnwindSafe};
+use std::pin::Pin;
+use std::sync::mpsc;
+use std::task::{Context, Poll};
+use std::thread::{self, JoinHandle};
+
+use crossbeam::channel::{unbounded, Sender};
+use futures::channel::oneshot;
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// Host threads that make the ecalls of cached partitions.
+///
+/// A task reading a cached partition does not get a thread of its own: the ecall is queued and
+/// runs on one of a fixed number of workers, as many as there are stage holders (see
+/// StageLock), so the host threads waiting to enter the enclave stay bounded however many cached
+/// partitions a stage has. A queued ecall only waits for workers busy with earlier ones, each of
+/// which releases its worker once its result is received.
+pub struct EcallPool {
+    jobs: Sender<Job>,
+}
+
+/// Completion of a sub-partition, joined once its results are collected.
+pub enum EcallHandle {
+    Thread(JoinHandle<()>),
+    Pooled(mpsc::Receiver<thread::Result<()>>),
+}
+
+impl EcallHandle {
+    /// Waits for the sub-partition, with the panic of the ecall if it failed.
+    pub fn join(self) -> thread::Result<()> {
+        match self {
+            EcallHandle::Thread(handle) => handle.join(),
+            EcallHandle::Pooled(done) => done
+                .recv()
+                .unwrap_or_else(|_| Err(Box::new("ecall pool worker exited"))),
+        }
+    }
+}
+
+/// Result of an ecall queued with `EcallPool::call`, awaited instead of joined.
+pub struct EcallFuture<R> {
+    done: oneshot::Receiver<thread::Result<R>>,
+}
+
+impl<R> Future for EcallFuture<R> {
+    type Output = R;
+
+    /// Resumes the panic of the ecall if it failed.
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<R> {
+        match Pin::new(&mut self.done).poll(cx) {
+            Poll::Ready(Ok(Ok(res))) => Poll::Ready(res),
+            Poll::Ready(Ok(Err(payload))) => panic::resume_unwind(payload),
+            Poll::Ready(Err(_)) => panic!("ecall pool worker exited"),
+            Poll::Pending => Poll::Pending,
+        }
+    }
+}
+
+impl From<JoinHandle<()>> for EcallHandle {
+    fn from(handle: JoinHandle<()>) -> Self {
+        EcallHandle::Thread(handle)
+    }
+}
+
+impl EcallPool {
+    pub fn new(num_workers: usize) -> Self {
+        let (jobs, queue) = unbounded::<Job>();
+        for i in 0..num_workers.max(1) {
+            let queue = queue.clone();
+            thread::Builder::new()
+                .name(format!("ecall-{}", i))
+                .spawn(move || {
+                    for job in queue {
+                        job();
+                    }
+                })
+                .unwrap();
+        }
+        EcallPool { jobs }
+    }
+
+    /// Queues `f`, never blocks the caller.
+    pub fn spawn<F>(&self, f: F) -> EcallHandle
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        let (done_tx, done) = mpsc::channel();
+        let job: Job = Box::new(move || {
+            // The worker outlives a failed ecall, the panic goes to whoever joins.
+            let res = panic::catch_unwind(AssertUnwindSafe(f));
+            let _ = done_tx.send(res);
+        });
+        self.jobs.send(job).unwrap();
+        EcallHandle::Pooled(done)
+    }
+
+    /// Queues `f` and returns its result as a future, polled from async code without blocking
+    /// a thread of the runtime while `f` waits for or runs in the enclave.
+    pub fn call<F, R>(&self, f: F) -> EcallFuture<R>
+    where
+        F: FnOnce() -> R + Send + 'static,
+        R: Send + 'static,
+    {
+        let (done_tx, done) = oneshot::channel();
+        let job: Job = Box::new(move || {
+            let res = panic::catch_unwind(AssertUnwindSafe(f));
+            let _ = done_tx.send(res);
+        });
+        self.jobs.send(job).unwrap();
+        EcallFuture { done }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Arc;
+    use std::time::Duration;
+
+    #[test]
+    fn bounded_workers() {
+        let pool = EcallPool::new(2);
+        let running = Arc::new(AtomicUsize::new(0));
+        let max_running = Arc::new(AtomicUsize::new(0));
+        let handles = (0..8)
+            .map(|_| {
+                let running = running.clone();
+                let max_running = max_running.clone();
+                pool.spawn(move || {
+                    let cur = running.fetch_add(1, Ordering::SeqCst) + 1;
+                    max_running.fetch_max(cur, Ordering::SeqCst);
+                    thread::sleep(Duration::from_millis(10));
+                    running.fetch_sub(1, Ordering::SeqCst);
+                })
+            })
+            .collect::<Vec<_>>();
+        for handle in handles {
+            handle.join().unwrap();
+        }
+        assert!(max_running.load(Ordering::SeqCst) <= 2);
+        assert!(pool.spawn(|| panic!("ecall failed")).join().is_err());
+        assert!(pool.spawn(|| {}).join().is_ok());
+    }
+
+    #[test]
+    fn awaited_calls() {
+        let pool = EcallPool::new(1);
+        let worker = futures::executor::block_on(pool.call(|| thread::current().id()));
+        assert_ne!(worker, thread::current().id());
+        let sums = futures::executor::block_on(futures::future::join_all(
+            (0..4).map(|i| pool.call(move || (0..=i).sum::<usize>())),
+        ));
+        assert_eq!(sums, vec![0, 1, 3, 6]);
+        let failed = panic::catch_unwind(AssertUnwindSafe(|| {
+            futures::executor::block_on(pool.call(|| -> usize { panic!("ecall failed") }))
+        }));
+        assert!(failed.is_err());
+        assert_eq!(futures::executor::block_on(pool.call(|| 7)), 7);
+    }
+}
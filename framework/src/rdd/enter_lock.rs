@@ -0,0 +1,80 @@
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+/// Serializes the sub-partition threads of a task that enter the enclave.
+///
+/// It is a ticket lock: waiters sleep on a condvar instead of spinning and
+/// are let in in the order they arrived. The lock is not tied to a thread, the
+/// thread collecting a result releases what a sub-partition thread acquired.
+#[derive(Debug, Default)]
+pub struct EnterLock {
+    tickets: Mutex<Tickets>,
+    turn: Condvar,
+}
+
+#[derive(Debug, Default)]
+struct Tickets {
+    next: u64,
+    serving: u64,
+}
+
+static ACQUISITIONS: AtomicU64 = AtomicU64::new(0);
+static CONTENDED: AtomicU64 = AtomicU64::new(0);
+static WAIT_NANOS: AtomicU64 = AtomicU64::new(0);
+static MAX_WAIT_NANOS: AtomicU64 = AtomicU64::new(0);
+
+/// Queue wait of all enter locks since the process started.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct EnterLockStats {
+    pub acquisitions: u64,
+    /// acquisitions that had to wait for another holder
+    pub contended: u64,
+    pub total_wait: Duration,
+    pub max_wait: Duration,
+}
+
+pub fn enter_lock_stats() -> EnterLockStats {
+    EnterLockStats {
+        acquisitions: ACQUISITIONS.load(Ordering::Relaxed),
+        contended: CONTENDED.load(Ordering::Relaxed),
+        total_wait: Duration::from_nanos(WAIT_NANOS.load(Ordering::Relaxed)),
+        max_wait: Duration::from_nanos(MAX_WAIT_NANOS.load(Ordering::Relaxed)),
+    }
+}
+
+impl EnterLock {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Blocks until every earlier caller has released, returns how long it waited.
+    pub fn lock(&self) -> Duration {
+        let start = Instant::now();
+        let mut tickets = self.tickets.lock().unwrap();
+        let ticket = tickets.next;
+        tickets.next += 1;
+        let contended = tickets.serving != ticket;
+        while tickets.serving != ticket {
+            tickets = self.turn.wait(tickets).unwrap();
+        }
+        drop(tickets);
+        let wait = start.elapsed();
+        ACQUISITIONS.fetch_add(1, Ordering::Relaxed);
+        if contended {
+            CONTENDED.fetch_add(1, Ordering::Relaxed);
+        }
+        let nanos = wait.as_nanos() as u64;
+        WAIT_NANOS.fetch_add(nanos, Ordering::Relaxed);
+        MAX_WAIT_NANOS.fetch_max(nanos, Ordering::Relaxed);
+        wait
+    }
+
+    pub fn unlock(&self) {
+        let mut tickets = self.tickets.lock().unwrap();
+        assert!(tickets.serving < tickets.next, "enter lock released but not held");
+        tickets.serving += 1;
+        drop(tickets);
+        self.turn.notify_all();
+    }
+}
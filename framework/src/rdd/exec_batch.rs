@@ -0,0 +1,206 @@
+use std::collections::HashMap;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use crate::env::{self, Env};
+use crate::rdd::{
+    expect_result, secure_execute_batch, with_captured_var_table, wrapper_secure_execute_with_pre,
+    AccArg, CacheMeta, Input, OpId,
+};
+use crate::serializable_traits::Data;
+use crate::serialization_free::Construct;
+use crate::transitions::{self, Site};
+use once_cell::sync::Lazy;
+use sgx_types::*;
+
+/// Partitions one ECALL of `secure_execute_batch` takes at most.
+const MAX_BATCH: usize = 64;
+
+/// One partition of `secure_execute_batch`, mirroring BatchEntry in enclave/src/lib.rs. The
+/// enclave writes the result in place.
+#[repr(C)]
+struct BatchEntry {
+    part_ids: *const Vec<usize>,
+    cache_meta: CacheMeta,
+    input: Input,
+    result: usize,
+}
+
+/// What the partitions of a batch must share: they run as one stage of one enclave.
+#[derive(Clone, PartialEq, Eq, Hash)]
+struct StageKey {
+    enclave: usize,
+    rdd_ids: Vec<usize>,
+    op_ids: Vec<OpId>,
+    split_nums: Vec<usize>,
+    dep: (u8, usize, usize, usize),
+}
+
+impl StageKey {
+    fn of(acc_arg: &AccArg) -> Self {
+        let dep_info = &acc_arg.dep_info;
+        StageKey {
+            enclave: acc_arg.enclave,
+            rdd_ids: acc_arg.rdd_ids.clone(),
+            op_ids: acc_arg.op_ids.clone(),
+            split_nums: acc_arg.split_nums.clone(),
+            dep: (
+                dep_info.is_shuffle,
+                dep_info.identifier,
+                dep_info.parent_rdd_id,
+                dep_info.child_rdd_id,
+            ),
+        }
+    }
+}
+
+struct Batch {
+    /// the stage as the first partition has it
+    acc_arg: AccArg,
+    state: Mutex<BatchState>,
+    done: Condvar,
+}
+
+#[derive(Default)]
+struct BatchState {
+    parts: Vec<(Vec<usize>, CacheMeta, Input)>,
+    /// no partition joins once the ECALL is being made
+    sealed: bool,
+    results: Option<std::result::Result<Vec<usize>, String>>,
+}
+
+/// Batches the ECALLs of small partitions of the same stage.
+///
+/// A stage whose partitions are tiny, e.g. the tail of a selective `filter`, pays for the
+/// transition, the captured vars and the setup of the stage in the enclave once per partition,
+/// more than its work. A partition below `ecall_batch_bytes` opens a batch, or joins the open one
+/// of its stage, and the first partition makes one `secure_execute_batch` for all of them after
+/// waiting `ecall_batch_us` for the others. The enclave runs them on its worker pool. Every
+/// partition still gets its own result and releases its own enter lock.
+pub(crate) struct ExecBatcher {
+    open: Mutex<HashMap<StageKey, Arc<Batch>>>,
+}
+
+pub(crate) static EXEC_BATCHER: Lazy<ExecBatcher> = Lazy::new(|| ExecBatcher {
+    open: Mutex::new(HashMap::new()),
+});
+
+impl ExecBatcher {
+    /// Whether `start_execute` of `data` goes through the batcher.
+    pub(crate) fn wants<T: Construct + Data>(data: &T) -> bool {
+        let conf = env::Configuration::get();
+        conf.ecall_batch_us > 0 && data.get_size() <= conf.ecall_batch_bytes
+    }
+
+    /// The result `wrapper_secure_execute_with_pre` would return for this partition.
+    pub(crate) fn execute<T: Construct + Data>(
+        &self,
+        acc_arg: &AccArg,
+        cache_meta: CacheMeta,
+        data: &T,
+    ) -> usize {
+        let key = StageKey::of(acc_arg);
+        let part = (acc_arg.part_ids.clone(), cache_meta, Input::new(data));
+        let mut open = self.open.lock().unwrap();
+        if let Some(batch) = open.get(&key).cloned() {
+            if batch.acc_arg.captured_vars == acc_arg.captured_vars {
+                let mut state = batch.state.lock().unwrap();
+                if !state.sealed && state.parts.len() < MAX_BATCH {
+                    let idx = state.parts.len();
+                    state.parts.push(part);
+                    drop(open);
+                    while state.results.is_none() {
+                        state = batch.done.wait(state).unwrap();
+                    }
+                    return match state.results.as_ref().unwrap() {
+                        Ok(results) => expect_result(results[idx]),
+                        Err(msg) => panic!("{}", msg),
+                    };
+                }
+            }
+            // The open batch is of other captured vars or full, this partition goes alone.
+            drop(open);
+            return wrapper_secure_execute_with_pre(acc_arg, cache_meta, data);
+        }
+        let batch = Arc::new(Batch {
+            acc_arg: acc_arg.clone(),
+            state: Mutex::new(BatchState {
+                parts: vec![part],
+                ..Default::default()
+            }),
+            done: Condvar::new(),
+        });
+        open.insert(key.clone(), batch.clone());
+        drop(open);
+
+        thread::sleep(Duration::from_micros(
+            env::Configuration::get().ecall_batch_us,
+        ));
+        let mut open = self.open.lock().unwrap();
+        if open.get(&key).map_or(false, |b| Arc::ptr_eq(b, &batch)) {
+            open.remove(&key);
+        }
+        let mut state = batch.state.lock().unwrap();
+        state.sealed = true;
+        let parts = std::mem::take(&mut state.parts);
+        drop(state);
+        drop(open);
+
+        // Sealed, so no partition waits for this one.
+        if parts.len() == 1 {
+            return wrapper_secure_execute_with_pre(acc_arg, cache_meta, data);
+        }
+        let results = panic::catch_unwind(AssertUnwindSafe(|| batch_ecall(acc_arg, &parts)));
+        let mut state = batch.state.lock().unwrap();
+        state.results = Some(match &results {
+            Ok(results) => Ok(results.clone()),
+            Err(_) => Err(format!("[-] batch of {} partitions failed", parts.len())),
+        });
+        drop(state);
+        batch.done.notify_all();
+        match results {
+            Ok(results) => expect_result(results[0]),
+            Err(payload) => panic::resume_unwind(payload),
+        }
+    }
+}
+
+fn batch_ecall(acc_arg: &AccArg, parts: &[(Vec<usize>, CacheMeta, Input)]) -> Vec<usize> {
+    let mut entries = parts
+        .iter()
+        .map(|(part_ids, cache_meta, input)| BatchEntry {
+            part_ids: part_ids as *const Vec<usize>,
+            cache_meta: *cache_meta,
+            input: *input,
+            result: 0,
+        })
+        .collect::<Vec<_>>();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
+    let tid: u64 = thread::current().id().as_u64().into();
+    let timed = transitions::time(Site::SecureExecuteBatch);
+    let sgx_status = with_captured_var_table(&acc_arg.captured_vars, |captured_vars| unsafe {
+        secure_execute_batch(
+            eid,
+            tid,
+            &acc_arg.rdd_ids as *const Vec<usize> as *const u8,
+            &acc_arg.op_ids as *const Vec<OpId> as *const u8,
+            &acc_arg.split_nums as *const Vec<usize> as *const u8,
+            acc_arg.dep_info,
+            entries.as_mut_ptr() as *mut u8,
+            entries.len(),
+            captured_vars,
+        )
+    });
+    drop(timed);
+    match sgx_status {
+        sgx_status_t::SGX_SUCCESS => {}
+        _ => {
+            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+        }
+    };
+    crate::metrics::drain(eid);
+    entries.iter().map(|entry| entry.result).collect()
+}
@@ -1,5 +1,4 @@
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::JoinHandle;
 
 use crate::context::Context;
 use crate::dependency::{Dependency, OneToOneDependency};
@@ -64,6 +63,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -97,6 +100,10 @@ where
         self.vals.secure
     }
 
+    fn content_hash(&self) -> u64 {
+        captured_hash(&self.f.get_ser_captured_var())
+    }
+
     fn splits(&self) -> Vec<Box<dyn Split>> {
         self.prev.splits()
     }
@@ -109,7 +116,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -157,7 +164,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
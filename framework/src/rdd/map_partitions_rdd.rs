@@ -4,7 +4,6 @@ use std::sync::{
     mpsc::SyncSender,
     Arc,
 };
-use std::thread::JoinHandle;
 
 use crate::context::Context;
 use crate::dependency::{Dependency, OneToOneDependency};
@@ -85,6 +84,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -127,6 +130,10 @@ where
         self.vals.secure
     }
 
+    fn content_hash(&self) -> u64 {
+        captured_hash(&self.f.get_ser_captured_var())
+    }
+
     fn preferred_locations(&self, split: Box<dyn Split>) -> Vec<Ipv4Addr> {
         self.prev.preferred_locations(split)
     }
@@ -144,7 +151,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -193,7 +200,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
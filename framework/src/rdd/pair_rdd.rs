@@ -1,18 +1,20 @@
+use std::collections::HashMap;
 use std::hash::Hash;
+use std::net::Ipv4Addr;
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::JoinHandle;
 
 use crate::aggregator::Aggregator;
 use crate::context::Context;
-use crate::dependency::{Dependency, OneToOneDependency};
-use crate::env::{Env, RDDB_MAP};
-use crate::error::Result;
-use crate::partitioner::{HashPartitioner, Partitioner};
-use crate::rdd::co_grouped_rdd::CoGroupedRdd;
+use crate::dependency::{DepInfo, Dependency, OneToOneDependency};
+use crate::env::{Env, BOUNDED_MEM_CACHE, RDDB_MAP};
+use crate::error::{Error, Result};
+use crate::partitioner::{HashPartitioner, Partitioner, RangePartitioner};
+use crate::rdd::co_grouped_rdd::{CoGroupedRdd, MergeJoinedRdd};
 use crate::rdd::shuffled_rdd::ShuffledRdd;
 use crate::rdd::*;
 use crate::serializable_traits::{AnyData, Data, Func, SerFunc};
 use crate::split::Split;
+use crate::utils::random::{get_partition_rng, sample_times};
 use parking_lot::Mutex;
 use serde_derive::{Deserialize, Serialize};
 use serde_traitobject::{Deserialize, Serialize};
@@ -90,6 +92,87 @@ where
         self.combine_by_key(aggregator, partitioner)
     }
 
+    /// `reduce_by_key` for keys too hot for one reducer. In secure mode the enclave finds hot keys
+    /// in the sample of the shuffle write and spreads them over all reducers, then a second
+    /// `reduce_by_key` merges their partial results. The host builds the same two shuffles.
+    #[track_caller]
+    fn reduce_by_key_skewed<F>(&self, func: F, num_splits: usize) -> SerArc<dyn Rdd<Item = (K, V)>>
+    where
+        F: SerFunc((V, V)) -> V,
+        Self: Sized + Serialize + Deserialize + 'static,
+    {
+        let partitioner = Box::new(HashPartitioner::<K>::new(num_splits)) as Box<dyn Partitioner>;
+        let salted = self.reduce_by_key_using_partitioner(func.clone(), partitioner.clone());
+        self.get_context().add_num(1);
+        salted.reduce_by_key_using_partitioner(func, partitioner)
+    }
+
+    /// Sort by key across partitions. The bounds of the partitions are drawn from `sample`, a
+    /// sample of the keys, and partition `i` holds keys below those of partition `i + 1`.
+    #[track_caller]
+    fn sort_by_key(&self, sample: Vec<K>, num_splits: usize) -> SerArc<dyn Rdd<Item = (K, V)>>
+    where
+        K: Ord,
+        Self: Sized + Serialize + Deserialize + 'static,
+    {
+        self.sort_by_key_using_partitioner(
+            Box::new(RangePartitioner::<K>::from_sample(num_splits, sample)) as Box<dyn Partitioner>
+        )
+    }
+
+    #[track_caller]
+    fn sort_by_key_using_partitioner(
+        &self,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Rdd<Item = (K, V)>>
+    where
+        K: Ord,
+        Self: Sized + Serialize + Deserialize + 'static,
+    {
+        let grouped = self.group_by_key_using_partitioner(partitioner);
+        self.get_context().add_num(1);
+        let sort_fn = Fn!(|_index: usize,
+                           items: Box<dyn Iterator<Item = (K, Vec<V>)>>|
+              -> Box<dyn Iterator<Item = (K, V)>> {
+            let mut groups = items.collect::<Vec<_>>();
+            // A shuffle in the enclave already hands the groups over in order, then the merge
+            // sort is a single pass.
+            groups.sort_by(|a, b| a.0.cmp(&b.0));
+            Box::new(
+                groups
+                    .into_iter()
+                    .flat_map(|(k, vs)| vs.into_iter().map(move |v| (k.clone(), v))),
+            )
+        });
+        SerArc::new(MapPartitionsRdd::new(grouped.get_rdd(), sort_fn))
+    }
+
+    /// Return a sample of this RDD stratified by key: every item of key `k` is kept with probability
+    /// `fractions[k]`, or with replacement drawn a Poisson number of times of that mean. It is
+    /// one pass over every partition, and keys without a fraction are left out.
+    #[track_caller]
+    fn sample_by_key(
+        &self,
+        with_replacement: bool,
+        fractions: HashMap<K, f64>,
+        seed: Option<u64>,
+    ) -> SerArc<dyn Rdd<Item = (K, V)>>
+    where
+        Self: Sized,
+    {
+        let sample = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = (K, V)>>|
+            -> Box<dyn Iterator<Item = (K, V)>> {
+                let mut rng = get_partition_rng(seed, index);
+                let fractions = fractions.clone();
+                Box::new(partition.flat_map(move |(k, v)| {
+                    let fraction = fractions.get(&k).copied().unwrap_or(0.0);
+                    let times = sample_times(with_replacement, fraction, &mut rng);
+                    std::iter::repeat((k, v)).take(times)
+                }))
+        });
+        self.map_partitions_with_index(sample)
+    }
+
     #[track_caller]
     fn values(&self) -> SerArc<dyn Rdd<Item = V>>
     where
@@ -143,6 +226,109 @@ where
         cogrouped.flat_map_values(Box::new(f))
     }
 
+    /// Joins on key ranges drawn from `sample`, a sample of the keys, instead of hashes. In the
+    /// enclave both sides are shuffled as sorted runs and merged block by block, so the joined
+    /// pairs come out sorted by key across partitions.
+    #[track_caller]
+    fn sort_merge_join<W>(
+        &self,
+        other: SerArc<dyn Rdd<Item = (K, W)>>,
+        sample: Vec<K>,
+        num_splits: usize,
+    ) -> SerArc<dyn Rdd<Item = (K, (V, W))>>
+    where
+        K: Ord,
+        W: Data,
+    {
+        self.merge_join(
+            other,
+            Box::new(RangePartitioner::<K>::from_sample(num_splits, sample)) as Box<dyn Partitioner>,
+        )
+    }
+
+    /// Joins without grouping either side: in the enclave the sorted runs of both sides are merged
+    /// into joined pairs directly, holding only the values of `other` for the key at hand. Suits
+    /// many-to-many joins, where `join` materializes every group before its cross product.
+    #[track_caller]
+    fn merge_join<W>(
+        &self,
+        other: SerArc<dyn Rdd<Item = (K, W)>>,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Rdd<Item = (K, (V, W))>>
+    where
+        W: Data,
+    {
+        SerArc::new(MergeJoinedRdd::new(
+            self.get_rdd(),
+            other.get_rdd(),
+            partitioner,
+        ))
+    }
+
+    /// Joins with a relation small enough to be collected, e.g. by `secure_collect`, without a
+    /// shuffle of either side. The small side is captured by the probing `flat_map` as a
+    /// `Broadcast`, so it is encrypted once and every task builds a hash table of it in the
+    /// enclave.
+    #[track_caller]
+    fn broadcast_join<W>(
+        &self,
+        small: &Text<Vec<(K, W)>, Vec<ItemE>>,
+    ) -> SerArc<dyn Rdd<Item = (K, (V, W))>>
+    where
+        Self: Sized,
+        W: Data,
+    {
+        let small = Broadcast::new(small);
+        let f = Fn!(move |(k, v): (K, V)| {
+            let ws = small.get(&k).to_vec();
+            let joined = ws.into_iter().map(move |w| (k.clone(), (v.clone(), w)));
+            Box::new(joined) as Box<dyn Iterator<Item = (K, (V, W))>>
+        });
+        self.flat_map(f)
+    }
+
+    /// A Bloom filter of the keys of this RDD, built in the enclave for up to `expected_keys`
+    /// distinct keys with a false positive rate of `fpp`, for `join_pruned`.
+    #[track_caller]
+    fn secure_key_filter(&self, expected_keys: usize, fpp: f64) -> Result<Text<KeyFilter<K>, ItemE>>
+    where
+        Self: Sized,
+    {
+        self.secure_aggregate(
+            KeyFilter::new(expected_keys, fpp),
+            Fn!(|mut filter: KeyFilter<K>, (k, _): (K, V)| {
+                filter.insert(&k);
+                filter
+            }),
+            Fn!(|a: KeyFilter<K>, b: KeyFilter<K>| a.union(b)),
+        )
+    }
+
+    /// `join` when few keys of this RDD are in `other`: the items whose keys are not in `filter`,
+    /// the `secure_key_filter` of `other`, are dropped by the map side before they are bucketed,
+    /// so they are never encrypted for the shuffle.
+    #[track_caller]
+    fn join_pruned<W>(
+        &self,
+        other: SerArc<dyn Rdd<Item = (K, W)>>,
+        filter: &Text<KeyFilter<K>, ItemE>,
+        num_splits: usize,
+    ) -> SerArc<dyn Rdd<Item = (K, (V, W))>>
+    where
+        Self: Sized,
+        W: Data + Default,
+    {
+        let filter = SemiJoinFilter::new(filter);
+        let prune = Fn!(move |items: Box<dyn Iterator<Item = (K, V)>>| {
+            let filter = filter.clone();
+            Box::new(items.filter(move |(k, _)| filter.may_contain(k)))
+                as Box<dyn Iterator<Item = (K, V)>>
+        });
+        let pruned = self.map_partitions(prune);
+        self.get_context().add_num(1);
+        pruned.join(other, num_splits)
+    }
+
     #[track_caller]
     fn cogroup<W>(
         &self,
@@ -159,6 +345,44 @@ where
         ))
     }
 
+    /// The state of every key once the values of this batch are folded into it, for a stream of
+    /// micro-batches. `f` gets the values of a key in the batch and its state after the batches
+    /// before, None for a new key, and the key is dropped if it returns None. `state` is what this
+    /// returned for the previous batch, None for the first one, see `streaming::KeyedState`.
+    #[track_caller]
+    fn update_state_by_key<S, F>(
+        &self,
+        state: Option<SerArc<dyn Rdd<Item = (K, S)>>>,
+        f: F,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Rdd<Item = (K, S)>>
+    where
+        Self: Sized + Serialize + Deserialize + 'static,
+        S: Data,
+        F: SerFunc((Vec<V>, Option<S>)) -> Option<S> + Clone,
+    {
+        match state {
+            Some(state) => {
+                let update = Fn!(move |(vs, ss): (Vec<V>, Vec<S>)| {
+                    let state = (f)((vs, ss.into_iter().next()));
+                    Box::new(state.into_iter()) as Box<dyn Iterator<Item = S>>
+                });
+                let cogrouped = self.cogroup(state, partitioner);
+                self.get_context().add_num(1);
+                cogrouped.flat_map_values(Box::new(update))
+            }
+            None => {
+                let update = Fn!(move |vs: Vec<V>| {
+                    let state = (f)((vs, None));
+                    Box::new(state.into_iter()) as Box<dyn Iterator<Item = S>>
+                });
+                let grouped = self.group_by_key_using_partitioner(partitioner);
+                self.get_context().add_num(1);
+                grouped.flat_map_values(Box::new(update))
+            }
+        }
+    }
+
     #[track_caller]
     fn partition_by_key(&self, partitioner: Box<dyn Partitioner>) -> SerArc<dyn Rdd<Item = V>> {
         // Guarantee the number of partitions by introducing a shuffle phase
@@ -176,6 +400,33 @@ where
         self.get_context().add_num(1);
         shuffle_steep.flat_map(flattener)
     }
+
+    /// The encrypted values of `key`. With a partitioner only the partition it puts `key` in is
+    /// read, and if that partition is cached by the op with the partitioner, the enclave decrypts
+    /// only the blocks its index lists for `key`, see enclave/src/op/key_index.rs. Otherwise
+    /// every block read is decrypted and scanned.
+    #[track_caller]
+    fn secure_lookup(&self, key: K) -> Result<Text<Vec<V>, Vec<ItemE>>>
+    where
+        Self: Sized,
+    {
+        let partitions = match self.partitioner() {
+            Some(partitioner) => vec![partitioner.get_partition(&key)],
+            None => (0..self.number_of_splits()).collect(),
+        };
+        let lookup = LookupRdd::new(self.get_rdd(), key);
+        let values = Fn!(|(_, iter): (
+            Box<dyn Iterator<Item = V>>,
+            Box<dyn Iterator<Item = ItemE>>
+        )| { iter.collect::<Vec<ItemE>>() });
+        let res = self.get_context().run_job_with_partitions(
+            lookup.get_rdd(),
+            None,
+            values,
+            partitions,
+        )?;
+        Ok(Text::new(None, Some(res.into_iter().flatten().collect())))
+    }
 }
 
 // Implementing the PairRdd trait for all types which implements Rdd
@@ -242,6 +493,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -283,7 +538,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -313,7 +568,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
@@ -391,6 +646,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -420,6 +679,10 @@ where
         self.vals.secure
     }
 
+    fn content_hash(&self) -> u64 {
+        captured_hash(&self.f.get_ser_captured_var())
+    }
+
     fn splits(&self) -> Vec<Box<dyn Split>> {
         self.prev.splits()
     }
@@ -427,12 +690,17 @@ where
         self.prev.number_of_splits()
     }
 
+    // The keys are left as they are, so are the partitions.
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.prev.partitioner()
+    }
+
     fn iterator_raw(
         &self,
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -468,7 +736,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
@@ -550,6 +818,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -578,6 +850,10 @@ where
         self.vals.secure
     }
 
+    fn content_hash(&self) -> u64 {
+        captured_hash(&self.f.get_ser_captured_var())
+    }
+
     fn splits(&self) -> Vec<Box<dyn Split>> {
         self.prev.splits()
     }
@@ -585,12 +861,17 @@ where
         self.prev.number_of_splits()
     }
 
+    // The keys are left as they are, so are the partitions.
+    fn partitioner(&self) -> Option<Box<dyn Partitioner>> {
+        self.prev.partitioner()
+    }
+
     fn iterator_raw(
         &self,
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -628,7 +909,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
@@ -652,3 +933,181 @@ where
         }
     }
 }
+
+/// The values of one key in the partitions of a pair rdd, see `PairRdd::secure_lookup`. In secure
+/// mode a partition is not computed through the enclave ops, its encrypted blocks are handed to
+/// the lookup ECALL as they are, read from the cache when the rdd is cached.
+#[derive(Serialize, Deserialize)]
+pub struct LookupRdd<K, V>
+where
+    K: Data,
+    V: Data,
+{
+    #[serde(with = "serde_traitobject")]
+    prev: Arc<dyn Rdd<Item = (K, V)>>,
+    vals: Arc<RddVals>,
+    key: K,
+}
+
+impl<K, V> Clone for LookupRdd<K, V>
+where
+    K: Data,
+    V: Data,
+{
+    fn clone(&self) -> Self {
+        LookupRdd {
+            prev: self.prev.clone(),
+            vals: self.vals.clone(),
+            key: self.key.clone(),
+        }
+    }
+}
+
+impl<K, V> LookupRdd<K, V>
+where
+    K: Data,
+    V: Data,
+{
+    #[track_caller]
+    fn new(prev: Arc<dyn Rdd<Item = (K, V)>>, key: K) -> Self {
+        let vals = Arc::new(RddVals::new(prev.get_context(), prev.get_secure()));
+        LookupRdd { prev, vals, key }
+    }
+}
+
+impl<K, V> RddBase for LookupRdd<K, V>
+where
+    K: Data + Eq,
+    V: Data,
+{
+    fn cache(&self) {
+        self.vals.cache();
+        RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
+    }
+
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
+    fn should_cache(&self) -> bool {
+        self.vals.should_cache()
+    }
+
+    fn get_rdd_id(&self) -> usize {
+        self.vals.id
+    }
+
+    fn get_op_id(&self) -> OpId {
+        self.vals.op_id
+    }
+
+    fn get_op_ids(&self, op_ids: &mut Vec<OpId>) {
+        op_ids.push(self.get_op_id());
+        self.prev.get_op_ids(op_ids);
+    }
+
+    fn get_context(&self) -> Arc<Context> {
+        self.vals.context.upgrade().unwrap()
+    }
+
+    fn get_dependencies(&self) -> Vec<Dependency> {
+        vec![Dependency::NarrowDependency(Arc::new(
+            OneToOneDependency::new(self.prev.get_rdd_base()),
+        ))]
+    }
+
+    fn get_secure(&self) -> bool {
+        self.vals.secure
+    }
+
+    fn preferred_locations(&self, split: Box<dyn Split>) -> Vec<Ipv4Addr> {
+        self.prev.preferred_locations(split)
+    }
+
+    fn splits(&self) -> Vec<Box<dyn Split>> {
+        self.prev.splits()
+    }
+
+    fn number_of_splits(&self) -> usize {
+        self.prev.number_of_splits()
+    }
+
+    fn iterator_raw(
+        &self,
+        split: Box<dyn Split>,
+        acc_arg: &mut AccArg,
+        tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        self.secure_compute(split, acc_arg, tx)
+    }
+
+    fn iterator_any(&self, split: Box<dyn Split>) -> Result<Box<dyn AnyData>> {
+        Ok(Box::new(self.iterator(split)?.collect::<Vec<_>>()))
+    }
+}
+
+impl<K, V> Rdd for LookupRdd<K, V>
+where
+    K: Data + Eq,
+    V: Data,
+{
+    type Item = V;
+    fn get_rdd_base(&self) -> Arc<dyn RddBase> {
+        Arc::new(self.clone()) as Arc<dyn RddBase>
+    }
+
+    fn get_rdd(&self) -> Arc<dyn Rdd<Item = Self::Item>> {
+        Arc::new(self.clone())
+    }
+
+    fn compute(&self, split: Box<dyn Split>) -> Result<Box<dyn Iterator<Item = Self::Item>>> {
+        let key = self.key.clone();
+        Ok(Box::new(
+            self.prev
+                .iterator(split)?
+                .filter(move |(k, _)| *k == key)
+                .map(|(_, v)| v),
+        ))
+    }
+
+    // The blocks of a partition are only read by secure_iterator.
+    fn secure_compute(
+        &self,
+        _split: Box<dyn Split>,
+        _acc_arg: &mut AccArg,
+        _tx: SyncSender<usize>,
+    ) -> Result<Vec<EcallHandle>> {
+        Err(Error::UnsupportedOperation("secure_compute of a lookup"))
+    }
+
+    fn secure_iterator(
+        &self,
+        split: Box<dyn Split>,
+        dep_info: DepInfo,
+        _action_id: Option<OpId>,
+    ) -> Result<Box<dyn Iterator<Item = ItemE>>> {
+        let key = (self.prev.get_rdd_id(), split.get_index());
+        let key_enc = ser_encrypt(&self.key);
+        // Held by the ecall, the cached blocks it reads are not freed if they are evicted meanwhile.
+        let _pin = BOUNDED_MEM_CACHE.pin();
+        let cached = match self.prev.should_cache() {
+            true => Env::get().cache_tracker.get_sdata(key),
+            false => None,
+        };
+        let (op_id, prev_op_id) = (self.get_op_id(), self.prev.get_op_id());
+        let values = match cached {
+            Some((ptr, _)) => {
+                let blocks = unsafe { &*(ptr as *const Vec<ItemE>) };
+                wrapper_lookup(op_id, prev_op_id, key, blocks, &key_enc)
+            }
+            None => {
+                let blocks = self
+                    .prev
+                    .secure_iterator(split, dep_info, None)?
+                    .collect::<Vec<_>>();
+                wrapper_lookup(op_id, prev_op_id, key, &blocks, &key_enc)
+            }
+        };
+        Ok(Box::new(values.into_iter()))
+    }
+}
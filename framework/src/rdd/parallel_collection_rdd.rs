@@ -235,6 +235,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.rdd_vals.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.rdd_vals.vals.should_cache()
     }
@@ -272,6 +276,11 @@ where
         self.rdd_vals.vals.secure
     }
 
+    /// Encrypted items have a fresh nonce in every driver, so only plaintext ones match.
+    fn content_hash(&self) -> u64 {
+        captured_hash(&[bincode::serialize(&self.rdd_vals.splits_).unwrap()])
+    }
+
     fn splits(&self) -> Vec<Box<dyn Split>> {
         match self.rdd_vals.splits_.clone() {
             DataForm::Plaintext(splits) => (0..self.rdd_vals.num_slices)
@@ -306,7 +315,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -349,7 +358,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         if let Some(s) = split.downcast_ref::<ParallelCollectionSplit<ItemE>>() {
             let cur_rdd_id = self.get_rdd_id();
             let cur_op_id = self.get_op_id();
@@ -364,11 +373,11 @@ where
 
                 if handles.is_empty() {
                     acc_arg.set_caching_rdd_id(cur_rdd_id);
-                    handles.append(&mut vec![s.secure_iterator(acc_arg, tx)]);
+                    handles.append(&mut vec![s.secure_iterator(acc_arg, tx).into()]);
                 }
                 Ok(handles)
             } else {
-                Ok(vec![s.secure_iterator(acc_arg, tx)])
+                Ok(vec![s.secure_iterator(acc_arg, tx).into()])
             }
         } else {
             Err(Error::DowncastFailure("ParallelCollectionSplit<TE>"))
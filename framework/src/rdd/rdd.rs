@@ -1,6 +1,7 @@
 use core::panic::Location;
 use std::any::{Any, TypeId};
 use std::borrow::BorrowMut;
+use std::cell::Cell;
 use std::cmp::{Ordering, Reverse};
 use std::collections::{hash_map::DefaultHasher, BTreeMap, BTreeSet, HashMap};
 use std::convert::TryInto;
@@ -15,26 +16,32 @@ use std::path::Path;
 use std::sync::{
     atomic::{self, AtomicBool, AtomicUsize},
     mpsc::{sync_channel, Receiver, SyncSender},
-    Arc, RwLock, Weak,
+    Arc, Condvar, Mutex, RwLock, Weak,
 };
-use std::thread::{self, JoinHandle};
+use std::thread;
 use std::time::{Duration, Instant};
 
+use crate::cache_tracker::Loading;
 use crate::context::Context;
 use crate::dependency::{DepInfo, Dependency};
 use crate::env::{self, Env, BOUNDED_MEM_CACHE};
 use crate::error::{Error, Result};
+use crate::memfs;
+use crate::numa;
 use crate::partial::{BoundedDouble, CountEvaluator, GroupedCountEvaluator, PartialResult};
 use crate::partitioner::{HashPartitioner, Partitioner};
-use crate::scheduler::TaskContext;
+use crate::scheduler::{fair_pool, TakeListener, TaskContext};
 use crate::serializable_traits::{AnyData, Data, Func, SerFunc};
-use crate::serialization_free::{Construct, Idx, SizeBuf};
+use crate::serialization_free::Construct;
 use crate::split::Split;
-use crate::utils::bounded_priority_queue::BoundedPriorityQueue;
+use crate::transitions::{self, Site};
+use crate::utils::bounded_priority_queue::{merge_smallest, BoundedPriorityQueue};
+use crate::utils::random::{bottom_k, Keyed};
 use crate::utils::random::{BernoulliCellSampler, BernoulliSampler, PoissonSampler, RandomSampler};
 use crate::{utils, Fn, SerArc, SerBox};
 
-use aes_gcm::aead::{generic_array::GenericArray, Aead, NewAead};
+use aes_gcm::aead::{generic_array::GenericArray, AeadInPlace, NewAead};
+use aes_gcm::aes::{Aes128, BlockCipher, NewBlockCipher};
 use aes_gcm::Aes128Gcm;
 use fasthash::MetroHasher;
 use once_cell::sync::Lazy;
@@ -46,6 +53,8 @@ use sgx_types::*;
 
 mod parallel_collection_rdd;
 pub use parallel_collection_rdd::*;
+pub(crate) mod broadcast;
+pub use broadcast::{Broadcast, BroadcastVar, KeyFilter, SemiJoinFilter};
 mod cartesian_rdd;
 pub use cartesian_rdd::*;
 mod co_grouped_rdd;
@@ -68,13 +77,35 @@ mod zip_rdd;
 pub use zip_rdd::*;
 mod union_rdd;
 pub use union_rdd::*;
+mod enter_lock;
+pub use enter_lock::*;
+mod ecall_pool;
+pub use ecall_pool::*;
+mod async_ecall;
+pub use async_ecall::*;
+mod exec_batch;
+use exec_batch::{ExecBatcher, EXEC_BATCHER};
+pub mod columnar;
+pub mod compress;
 
 pub type ItemE = Vec<u8>;
 
-static immediate_cout: bool = true;
 pub static STAGE_LOCK: Lazy<StageLock> = Lazy::new(|| StageLock::new());
+//no more ecalls of cached partitions wait on the host than tasks may hold the stage lock
+pub static ECALL_POOL: Lazy<EcallPool> =
+    Lazy::new(|| EcallPool::new(env::Configuration::get().max_stage_holders()));
+//default of VEGA_MAX_ENC_BL, which the enclave is tuned with at init
 pub const MAX_ENC_BL: usize = 1024;
-pub const MAX_THREAD: usize = 1;
+//plaintext bytes an encryption block aims for, see VEGA_ENC_BLOCK_BYTES
+pub const DEFAULT_ENC_BLOCK_BYTES: usize = 256 * 1024;
+//max number of tasks holding the stage lock, i.e., entering the enclave at the same time
+pub const MAX_STAGE_HOLDERS: usize = 48;
+
+//threads a shuffle of the enclave merges with, VEGA_MAX_THREAD
+#[inline(always)]
+pub fn max_thread() -> usize {
+    env::Configuration::get().max_thread
+}
 
 extern "C" {
     pub fn secure_execute_pre(
@@ -96,31 +127,47 @@ extern "C" {
         input: Input,
         captured_vars: *const u8,
     ) -> sgx_status_t;
-    pub fn free_res_enc(
+    pub fn secure_execute_with_pre(
         eid: sgx_enclave_id_t,
-        op_id: OpId,
+        retval: *mut usize,
+        tid: u64,
+        rdd_ids: *const u8,
+        op_ids: *const u8,
+        part_ids: *const u8,
+        part_nums: *const u8,
+        cache_meta: CacheMeta,
         dep_info: DepInfo,
-        input: *mut u8,
+        input: Input,
+        captured_vars: *const u8,
     ) -> sgx_status_t;
-    pub fn priv_free_res_enc(
+    pub fn secure_execute_batch(
+        eid: sgx_enclave_id_t,
+        tid: u64,
+        rdd_ids: *const u8,
+        op_ids: *const u8,
+        part_nums: *const u8,
+        dep_info: DepInfo,
+        entries: *mut u8,
+        len: usize,
+        captured_vars: *const u8,
+    ) -> sgx_status_t;
+    pub fn free_res_enc(
         eid: sgx_enclave_id_t,
         op_id: OpId,
         dep_info: DepInfo,
         input: *mut u8,
     ) -> sgx_status_t;
-    pub fn get_sketch(
+    pub fn flush_node_combine(
         eid: sgx_enclave_id_t,
+        retval: *mut usize,
         op_id: OpId,
         dep_info: DepInfo,
-        p_buf: *mut u8,
-        p_data_enc: *mut u8,
     ) -> sgx_status_t;
-    pub fn clone_out(
+    pub fn priv_free_res_enc(
         eid: sgx_enclave_id_t,
         op_id: OpId,
         dep_info: DepInfo,
-        p_out: usize,
-        p_data_enc: *mut u8,
+        input: *mut u8,
     ) -> sgx_status_t;
     pub fn randomize_in_place(
         eid: sgx_enclave_id_t,
@@ -145,21 +192,138 @@ extern "C" {
         should_take: usize,
         have_take: *mut usize,
     ) -> sgx_status_t;
+    pub fn elookup(
+        eid: sgx_enclave_id_t,
+        retval: *mut usize,
+        op_id: OpId,
+        rdd_id: usize,
+        part_id: usize,
+        input: *const u8,
+        key: *const u8,
+    ) -> sgx_status_t;
     pub fn tail_compute(eid: sgx_enclave_id_t, retval: *mut usize, input: *mut u8) -> sgx_status_t;
     pub fn free_tail_info(eid: sgx_enclave_id_t, input: *mut u8) -> sgx_status_t;
 }
 
 #[no_mangle]
 pub unsafe extern "C" fn sbrk_o(increment: usize) -> *mut c_void {
+    let _timed = transitions::time(Site::OcallSbrk);
     libc::sbrk(increment as intptr_t)
 }
 
+const HUGE_PAGE_SIZE: usize = 2 << 20;
+
+//reserve an aligned region for the enclave tcmalloc, the unaligned head and tail are trimmed here
+//so that the enclave only needs one ocall per growth. a node of 0 or more is the numa node the
+//pages of the region are placed on, see numa.rs
+#[no_mangle]
+pub unsafe extern "C" fn mmap_o(
+    size: usize,
+    alignment: usize,
+    huge_page: u8,
+    node: i32,
+) -> *mut c_void {
+    let _timed = transitions::time(Site::OcallMmap);
+    let result = mmap_region(size, alignment, huge_page);
+    if result != libc::MAP_FAILED && node >= 0 {
+        numa::bind(result, size, node as usize);
+    }
+    result
+}
+
+unsafe fn mmap_region(size: usize, alignment: usize, huge_page: u8) -> *mut c_void {
+    let page_size = libc::sysconf(libc::_SC_PAGESIZE) as usize;
+    let alignment = std::cmp::max(alignment, page_size);
+    let extra = alignment - page_size;
+    let prot = libc::PROT_READ | libc::PROT_WRITE;
+    let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE;
+    let mut result = libc::MAP_FAILED;
+    if huge_page == 1 && size % HUGE_PAGE_SIZE == 0 && alignment <= HUGE_PAGE_SIZE {
+        //hugetlb mappings are always aligned to the huge page size
+        result = libc::mmap(
+            std::ptr::null_mut(),
+            size,
+            prot,
+            flags | libc::MAP_HUGETLB,
+            -1,
+            0,
+        );
+        if result != libc::MAP_FAILED {
+            return result;
+        }
+    }
+    result = libc::mmap(std::ptr::null_mut(), size + extra, prot, flags, -1, 0);
+    if result == libc::MAP_FAILED {
+        return result;
+    }
+    let ptr = result as usize;
+    let adjust = match ptr & (alignment - 1) {
+        0 => 0,
+        r => alignment - r,
+    };
+    if adjust > 0 {
+        libc::munmap(ptr as *mut c_void, adjust);
+    }
+    if adjust < extra {
+        libc::munmap((ptr + adjust + size) as *mut c_void, extra - adjust);
+    }
+    if huge_page == 1 {
+        //fall back to transparent huge pages
+        libc::madvise((ptr + adjust) as *mut c_void, size, libc::MADV_HUGEPAGE);
+    }
+    (ptr + adjust) as *mut c_void
+}
+
+//the page size of the hugetlbfs mount of VEGA_MEMFS_PATH, 0 if the heap is not on it
+#[no_mangle]
+pub unsafe extern "C" fn memfs_page_size_o() -> usize {
+    memfs::page_size()
+}
+
+//an aligned range of the file on the mount, counted as an mmap_o
+#[no_mangle]
+pub unsafe extern "C" fn memfs_mmap_o(size: usize, alignment: usize, node: i32) -> *mut c_void {
+    let _timed = transitions::time(Site::OcallMmap);
+    let result = memfs::map(size, alignment);
+    if result != libc::MAP_FAILED && node >= 0 {
+        numa::bind(result, size, node as usize);
+    }
+    result
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn madvise_o(addr: *mut c_void, size: usize) -> i32 {
+    let _timed = transitions::time(Site::OcallMadvise);
+    if let Some(res) = memfs::release(addr, size) {
+        return res;
+    }
+    loop {
+        let res = libc::madvise(addr, size, libc::MADV_DONTNEED);
+        if res != -1 || *libc::__errno_location() != libc::EAGAIN {
+            return res;
+        }
+    }
+}
+
+//a growth of the outside heap of the bound enclave failed, `size` bytes of it. not switchless,
+//so that this runs on the thread that is bound. tcmalloc holds its lock across this, which the
+//ecalls that free blocks need, so the cached partitions of the enclave are evicted from a
+//thread of its own, enough for the growth and to take the reserve again
+#[no_mangle]
+pub unsafe extern "C" fn memory_pressure_o(size: usize) {
+    let _timed = transitions::time(Site::OcallMemoryPressure);
+    let idx = Env::bound_enclave();
+    let bytes = size + (env::Configuration::get().oom_reserve_mb << 20);
+    thread::spawn(move || Env::get().cache_tracker.relieve_pressure(idx, bytes));
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn ocall_cache_to_outside(
     rdd_id: usize,
     part_id: usize,
     data_ptr: usize,
 ) -> u8 {
+    let _timed = transitions::time(Site::OcallCacheToOutside);
     //need to clone from memory alloced by ucmalloc to memory alloced by default allocator
     Env::get()
         .cache_tracker
@@ -167,15 +331,67 @@ pub unsafe extern "C" fn ocall_cache_to_outside(
     0 //need to revise
 }
 
+//the encrypted value of a broadcast, or 0 if there is none. the tracker keeps
+//it alive, so the enclave reads it in place
 #[no_mangle]
-pub unsafe extern "C" fn ocall_cache_from_outside(rdd_id: usize, part_id: usize) -> usize {
+pub unsafe extern "C" fn ocall_get_broadcast(id: u64) -> usize {
+    let _timed = transitions::time(Site::OcallGetBroadcast);
+    match Env::get().broadcast_tracker.get(id) {
+        Some(value) => Arc::as_ptr(&value) as usize,
+        None => 0,
+    }
+}
+
+//the pointer to the blocks of a cached partition, 0 if it is not cached. `generation` is the one
+//of the cache the pointer is good from until an invalidation of the partition, u64::MAX if the
+//enclave must not mirror it, the block is only kept alive by the pin of its ecall
+#[no_mangle]
+pub unsafe extern "C" fn ocall_cache_from_outside(
+    rdd_id: usize,
+    part_id: usize,
+    generation: *mut u64,
+) -> usize {
+    let _timed = transitions::time(Site::OcallCacheFromOutside);
+    // Read before the lookup, an entry found in memory is only invalidated after it.
+    let before = BOUNDED_MEM_CACHE.generation();
     let res = Env::get().cache_tracker.get_sdata((rdd_id, part_id));
+    *generation = match res {
+        Some((_, true)) => before,
+        _ => u64::MAX,
+    };
     match res {
-        Some(val) => val,
+        Some((val, _)) => val,
         None => 0,
     }
 }
 
+//the partitions of the cache invalidated after generation `since`, as (rdd_id, part_id) pairs
+//into `keys`, `cap` words of it at most. returns the generation they cover up to, `num_keys`
+//is the words written, usize::MAX if the enclave must drop all the pointers it mirrors
+#[no_mangle]
+pub unsafe extern "C" fn ocall_cache_invalidations(
+    since: u64,
+    keys: *mut usize,
+    cap: usize,
+    num_keys: *mut usize,
+) -> u64 {
+    let _timed = transitions::time(Site::OcallCacheInvalidations);
+    let mut out = vec![(0, 0); cap / 2];
+    let (covered, num) = BOUNDED_MEM_CACHE.invalidated_since(since, &mut out);
+    *num_keys = match num {
+        Some(num) => {
+            let keys = std::slice::from_raw_parts_mut(keys, cap);
+            for (i, &(rdd_id, part_id)) in out[..num].iter().enumerate() {
+                keys[2 * i] = rdd_id;
+                keys[2 * i + 1] = part_id;
+            }
+            2 * num
+        }
+        None => usize::MAX,
+    };
+    covered
+}
+
 pub fn default_hash<T: Hash>(t: &T) -> u64 {
     let mut s = DefaultHasher::new();
     t.hash(&mut s);
@@ -183,14 +399,10 @@ pub fn default_hash<T: Hash>(t: &T) -> u64 {
 }
 
 pub fn wrapper_secure_execute_pre(op_ids: &Vec<OpId>, split_nums: &Vec<usize>, dep_info: DepInfo) {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let tid: u64 = thread::current().id().as_u64().into();
+    let timed = transitions::time(Site::SecureExecutePre);
     let sgx_status = unsafe {
         secure_execute_pre(
             eid,
@@ -200,6 +412,7 @@ pub fn wrapper_secure_execute_pre(op_ids: &Vec<OpId>, split_nums: &Vec<usize>, d
             dep_info,
         )
     };
+    drop(timed);
     match sgx_status {
         sgx_status_t::SGX_SUCCESS => {}
         _ => {
@@ -208,6 +421,57 @@ pub fn wrapper_secure_execute_pre(op_ids: &Vec<OpId>, split_nums: &Vec<usize>, d
     };
 }
 
+//one rdd of the captured variable table secure_execute is given. the enclave
+//keeps its copy of the vars for as long as the version stays the same
+#[repr(C)]
+struct CapturedVarEntry {
+    rdd_id: usize,
+    version: u64,
+    vars: *const Vec<Vec<u8>>,
+}
+
+#[repr(C)]
+struct CapturedVarTable {
+    entries: *const CapturedVarEntry,
+    len: usize,
+}
+
+//f gets the table of captured_vars, which is only valid during the call
+fn with_captured_var_table<R>(
+    captured_vars: &HashMap<usize, Vec<Vec<u8>>>,
+    f: impl FnOnce(*const u8) -> R,
+) -> R {
+    let entries = captured_vars
+        .iter()
+        .map(|(rdd_id, vars)| {
+            let mut hasher = MetroHasher::default();
+            vars.hash(&mut hasher);
+            CapturedVarEntry {
+                rdd_id: *rdd_id,
+                version: hasher.finish(),
+                vars: vars as *const Vec<Vec<u8>>,
+            }
+        })
+        .collect::<Vec<_>>();
+    let table = CapturedVarTable {
+        entries: entries.as_ptr(),
+        len: entries.len(),
+    };
+    f(&table as *const CapturedVarTable as *const u8)
+}
+
+//a stage returns 0 when its enclave ran out of outside memory, which fails the task and leaves
+//the enclave to the others
+fn expect_result(result_ptr: usize) -> usize {
+    if result_ptr == 0 {
+        panic!(
+            "[-] enclave {} ran out of outside memory",
+            Env::bound_enclave()
+        );
+    }
+    result_ptr
+}
+
 pub fn wrapper_secure_execute<T>(
     rdd_ids: &Vec<usize>,
     op_ids: &Vec<OpId>,
@@ -221,17 +485,13 @@ pub fn wrapper_secure_execute<T>(
 where
     T: Construct + Data,
 {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let mut result_bl_ptr: usize = 0;
     let tid: u64 = thread::current().id().as_u64().into();
     let input = Input::new(data);
-    let sgx_status = unsafe {
+    let timed = transitions::time(Site::SecureExecute);
+    let sgx_status = with_captured_var_table(captured_vars, |captured_vars| unsafe {
         secure_execute(
             eid,
             &mut result_bl_ptr,
@@ -242,35 +502,67 @@ where
             cache_meta,
             dep_info,
             input,
-            captured_vars as *const HashMap<usize, Vec<Vec<u8>>> as *const u8,
+            captured_vars,
         )
+    });
+    drop(timed);
+    match sgx_status {
+        sgx_status_t::SGX_SUCCESS => {}
+        _ => {
+            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+        }
     };
+    crate::metrics::drain(eid);
+    expect_result(result_bl_ptr)
+}
+
+//wrapper_secure_execute_pre and wrapper_secure_execute in one ECALL
+pub fn wrapper_secure_execute_with_pre<T>(acc_arg: &AccArg, cache_meta: CacheMeta, data: &T) -> usize
+where
+    T: Construct + Data,
+{
+    let enclave = Env::enter();
+    let eid = enclave.eid();
+    let mut result_bl_ptr: usize = 0;
+    let tid: u64 = thread::current().id().as_u64().into();
+    let input = Input::new(data);
+    let timed = transitions::time(Site::SecureExecuteWithPre);
+    let sgx_status = with_captured_var_table(&acc_arg.captured_vars, |captured_vars| unsafe {
+        secure_execute_with_pre(
+            eid,
+            &mut result_bl_ptr,
+            tid,
+            &acc_arg.rdd_ids as *const Vec<usize> as *const u8,
+            &acc_arg.op_ids as *const Vec<OpId> as *const u8,
+            &acc_arg.part_ids as *const Vec<usize> as *const u8,
+            &acc_arg.split_nums as *const Vec<usize> as *const u8,
+            cache_meta,
+            acc_arg.dep_info,
+            input,
+            captured_vars,
+        )
+    });
+    drop(timed);
     match sgx_status {
         sgx_status_t::SGX_SUCCESS => {}
         _ => {
             panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
         }
     };
-    result_bl_ptr
+    crate::metrics::drain(eid);
+    expect_result(result_bl_ptr)
 }
 
 pub fn start_execute<T: Data>(acc_arg: AccArg, data: Vec<T>, tx: SyncSender<usize>) -> f64 {
-    let mut wait = 0.0;
+    //runs on a sub-partition thread, which is not bound yet
+    let _bound = Env::bind_enclave(acc_arg.enclave);
     let cache_meta = acc_arg.to_cache_meta();
-    wrapper_secure_execute_pre(&acc_arg.op_ids, &acc_arg.split_nums, acc_arg.dep_info);
-    let wait_now = Instant::now();
-    acc_arg.get_enclave_lock();
-    let wait_dur = wait_now.elapsed().as_nanos() as f64 * 1e-9;
-    wait += wait_dur;
-    let result_ptr = wrapper_secure_execute(
-        &acc_arg.rdd_ids,
-        &acc_arg.op_ids,
-        &acc_arg.part_ids,
-        cache_meta,
-        acc_arg.dep_info,
-        &data,
-        &acc_arg.captured_vars,
-    );
+    let wait = acc_arg.get_enclave_lock().as_secs_f64();
+    let result_ptr = if ExecBatcher::wants(&data) {
+        EXEC_BATCHER.execute(&acc_arg, cache_meta, &data)
+    } else {
+        wrapper_secure_execute_with_pre(&acc_arg, cache_meta, &data)
+    };
     tx.send(result_ptr).unwrap();
 
     wait
@@ -288,16 +580,12 @@ pub fn wrapper_action<T: Data>(data: Vec<T>, rdd_id: usize, op_id: OpId, is_loca
     } else {
         DepInfo::padding_new(3)
     };
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let input = Input::new_with(&data, usize::MAX);
     let mut result_ptr: usize = 0;
-    let sgx_status = unsafe {
+    let timed = transitions::time(Site::SecureAction);
+    let sgx_status = with_captured_var_table(&captured_vars, |captured_vars| unsafe {
         secure_execute(
             eid,
             &mut result_ptr,
@@ -308,18 +596,20 @@ pub fn wrapper_action<T: Data>(data: Vec<T>, rdd_id: usize, op_id: OpId, is_loca
             Default::default(), //meaningless
             dep_info,
             input,
-            &captured_vars as *const HashMap<usize, Vec<Vec<u8>>> as *const u8,
+            captured_vars,
         )
-    };
+    });
+    drop(timed);
     match sgx_status {
         sgx_status_t::SGX_SUCCESS => {}
         _ => {
             panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
         }
     };
+    crate::metrics::drain(eid);
     let dur = now.elapsed().as_nanos() as f64 * 1e-9;
     println!("in aggregate, ecall {:?}s", dur);
-    result_ptr
+    expect_result(result_ptr)
 }
 
 //This method should only be used if the resulting array is expected to be small,
@@ -337,13 +627,8 @@ where
         + serde::de::DeserializeOwned
         + 'static,
 {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let (seed, is_some) = match seed {
         Some(seed) => (seed, 1),
         None => (0, 0),
@@ -372,34 +657,26 @@ where
 }
 
 pub fn wrapper_set_sampler(op_id: OpId, with_replacement: bool, fraction: f64) {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
     let with_replacement = match with_replacement {
         true => 1,
         false => 0,
     };
-    let sgx_status = unsafe { set_sampler(eid, op_id, with_replacement, fraction) };
-    let _r = match sgx_status {
-        sgx_status_t::SGX_SUCCESS => {}
-        _ => {
-            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
-        }
-    };
+    //any enclave may run a partition of the op
+    Env::for_each_enclave(|| {
+        let enclave = Env::enter();
+        let sgx_status = unsafe { set_sampler(enclave.eid(), op_id, with_replacement, fraction) };
+        let _r = match sgx_status {
+            sgx_status_t::SGX_SUCCESS => {}
+            _ => {
+                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+            }
+        };
+    });
 }
 
 pub fn wrapper_take<T: Data>(op_id: OpId, input: &Vec<T>, should_take: usize) -> (Vec<T>, usize) {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let mut retval: usize = 0;
     let mut have_take: usize = 0;
     let sgx_status = unsafe {
@@ -422,14 +699,48 @@ pub fn wrapper_take<T: Data>(op_id: OpId, input: &Vec<T>, should_take: usize) ->
     (*res, have_take)
 }
 
+/// The encrypted values of `key_enc` in `blocks`, partition `key` of a pair rdd, found by the
+/// lookup the enclave registered for `op_id`. The result is freed as one of `free_op_id`, the op
+/// of the rdd looked up in.
+pub fn wrapper_lookup(
+    op_id: OpId,
+    free_op_id: OpId,
+    key: (usize, usize),
+    blocks: &Vec<ItemE>,
+    key_enc: &ItemE,
+) -> Vec<ItemE> {
+    let enclave = Env::enter();
+    let eid = enclave.eid();
+    let mut retval: usize = 0;
+    let sgx_status = unsafe {
+        elookup(
+            eid,
+            &mut retval,
+            op_id,
+            key.0,
+            key.1,
+            blocks as *const Vec<ItemE> as *const u8,
+            key_enc as *const ItemE as *const u8,
+        )
+    };
+    let _r = match sgx_status {
+        sgx_status_t::SGX_SUCCESS => {}
+        _ => {
+            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+        }
+    };
+    *get_encrypted_data::<ItemE>(free_op_id, DepInfo::padding_new(0), retval as *mut u8)
+}
+
+/// Runs the tail of a loop iteration in the enclave.
+///
+/// The loop-carried values stay resident in the enclave between calls, so `tail_info` only needs
+/// the values that changed on the driver since the last call. It is replaced by the values the
+/// tail computed. The enclave keeps its copy of them until the next call, so reading them takes
+/// no second ECALL. `wrapper_free_tail_info` ends the loop.
 pub fn wrapper_tail_compute(tail_info: &mut TailCompInfo) {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let mut p_new_tail_info: usize = 0;
     let sgx_status = unsafe {
         tail_compute(
@@ -444,18 +755,20 @@ pub fn wrapper_tail_compute(tail_info: &mut TailCompInfo) {
             panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
         }
     };
-    let new_tail_info_ = unsafe { Box::from_raw(p_new_tail_info as *mut u8 as *mut TailCompInfo) };
-    let new_tail_info = new_tail_info_.clone();
-    forget(new_tail_info_);
+    let new_tail_info = unsafe { (p_new_tail_info as *const TailCompInfo).as_ref() }.unwrap();
+    *tail_info = new_tail_info.clone();
+}
 
-    let sgx_status = unsafe { free_tail_info(eid, p_new_tail_info as *mut u8) };
+/// Drops the loop-carried values the enclave kept for `wrapper_tail_compute`.
+pub fn wrapper_free_tail_info() {
+    let enclave = Env::enter();
+    let sgx_status = unsafe { free_tail_info(enclave.eid(), std::ptr::null_mut()) };
     let _r = match sgx_status {
         sgx_status_t::SGX_SUCCESS => {}
         _ => {
             panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
         }
     };
-    *tail_info = *new_tail_info;
 }
 
 pub fn get_encrypted_data<T>(op_id: OpId, dep_info: DepInfo, p_data_enc: *mut u8) -> Box<Vec<T>>
@@ -467,90 +780,30 @@ where
         + serde::de::DeserializeOwned
         + 'static,
 {
-    let tid: u64 = thread::current().id().as_u64().into();
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
-    if immediate_cout {
-        let res_ = unsafe { Box::from_raw(p_data_enc as *mut Vec<T>) };
-        let res = res_.clone();
-        forget(res_);
-        let sgx_status = unsafe { free_res_enc(eid, op_id, dep_info, p_data_enc) };
-        match sgx_status {
-            sgx_status_t::SGX_SUCCESS => {}
-            _ => {
-                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
-            }
-        }
-        res
-    } else {
-        let now = Instant::now();
-        let size_buf_len = 1 << (7 + 10 + 10); //128M * 8B
-        let size_buf = SizeBuf::new(size_buf_len);
-        let size_buf_ptr = Box::into_raw(Box::new(size_buf));
-        let sgx_status = unsafe {
-            get_sketch(
-                eid,
-                op_id,
-                dep_info,
-                size_buf_ptr as *mut u8,
-                p_data_enc, //shuffle write
-            )
-        };
-        match sgx_status {
-            sgx_status_t::SGX_SUCCESS => (),
-            _ => {
-                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
-            }
-        };
-
-        let size_buf = unsafe { Box::from_raw(size_buf_ptr) };
-        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-        println!("get sketch {:?}s", dur);
-        let now = Instant::now();
-        let mut v: Vec<T> = Vec::new();
-        let mut idx = Idx::new();
-        v.recv(&size_buf, &mut idx);
-        let ptr_out = Box::into_raw(Box::new(v)) as *mut u8 as usize;
-        let sgx_status = unsafe { clone_out(eid, op_id, dep_info, ptr_out, p_data_enc) };
-        let v = unsafe { Box::from_raw(ptr_out as *mut u8 as *mut Vec<T>) };
-        match sgx_status {
-            sgx_status_t::SGX_SUCCESS => {}
-            _ => {
-                panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
-            }
+    //the enclave wrote the result to outside memory, which its own allocator
+    //owns, so it is copied once and handed back
+    let res_ = unsafe { Box::from_raw(p_data_enc as *mut Vec<T>) };
+    let res = res_.clone();
+    forget(res_);
+    let enclave = Env::enter();
+    let timed = transitions::time(Site::FreeResEnc);
+    let sgx_status = unsafe { free_res_enc(enclave.eid(), op_id, dep_info, p_data_enc) };
+    drop(timed);
+    match sgx_status {
+        sgx_status_t::SGX_SUCCESS => {}
+        _ => {
+            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
         }
-        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-        println!("copy out {:?}s", dur);
-        /*
-        let now = Instant::now();
-        let _v = bincode::serialize(&*v).unwrap();
-        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-        println!("serialize {:?}", dur);
-        let now = Instant::now();
-        let _v = v.clone();
-        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-        println!("clone {:?}", dur);
-        */
-        v
     }
+    res
 }
 
 pub fn move_data<T: Clone>(op_id: OpId, data: *mut u8) -> Box<Vec<T>> {
     let res_ = unsafe { Box::from_raw(data as *mut Vec<T>) };
     let res = res_.clone();
     forget(res_);
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
+    let enclave = Env::enter();
+    let eid = enclave.eid();
     let sgx_status = unsafe {
         priv_free_res_enc(
             eid,
@@ -575,12 +828,89 @@ fn read_le_u64(input: &mut &[u8]) -> u64 {
     u64::from_le_bytes(int_bytes.try_into().unwrap())
 }
 
+//blocks are nonce || ciphertext || tag under a job key, the same schedule as
+//enclave/src/op/keys.rs
+const NONCE_LEN: usize = 12;
+const TAG_LEN: usize = 16;
+//leads a block sealed with its item count as associated data, a nonce no block is sealed
+//under, see enclave/src/op/enc_writer.rs
+const COUNT_MARK: [u8; NONCE_LEN] = [b'c', b'o', b'u', b'n', b't', 0, 0, 0, 0xff, 0xff, 0xff, 0xff];
+const COUNT_LEN: usize = 8;
+//the master key of deployments without a key service, see enclave/src/provision.rs
+const DEV_MASTER_KEY: &[u8; 16] = b"abcdefg hijklmn ";
+
+//E_master(b"job key\0" || key_id), see set_key_id in the enclave. the master key is the one
+//the key service provisions the enclaves with, if the data owner gave it to this host
+static JOB_KEY: Lazy<[u8; 16]> = Lazy::new(|| {
+    let master = match &env::Configuration::get().master_key_file {
+        Some(path) => fs::read(path)
+            .ok()
+            .filter(|key| key.len() == 16)
+            .unwrap_or_else(|| panic!("no 16 byte master key at {}", path.display())),
+        None => DEV_MASTER_KEY.to_vec(),
+    };
+    let cipher = Aes128::new(GenericArray::from_slice(&master));
+    let mut block = GenericArray::default();
+    block[..8].copy_from_slice(b"job key\0");
+    block[8..].copy_from_slice(&env::Configuration::get().key_id.to_le_bytes());
+    cipher.encrypt_block(&mut block);
+    let mut key = [0; 16];
+    key.copy_from_slice(&block);
+    key
+});
+
+thread_local! {
+    //the key schedule and the GHASH key are expanded once per thread, not per block
+    static CIPHER: Aes128Gcm = Aes128Gcm::new(GenericArray::from_slice(&*JOB_KEY));
+    //(random stream id, counter of the next block) of the nonces of this thread
+    static STREAM: Cell<Option<(u64, u32)>> = Cell::new(None);
+}
+
+fn next_nonce() -> [u8; NONCE_LEN] {
+    let (id, ctr) = STREAM.with(|stream| {
+        let (id, ctr) = match stream.get() {
+            Some((id, ctr)) if ctr != u32::MAX => (id, ctr),
+            _ => (rand::random(), 0),
+        };
+        stream.set(Some((id, ctr + 1)));
+        (id, ctr)
+    });
+    let mut nonce = [0; NONCE_LEN];
+    nonce[..8].copy_from_slice(&u64::to_le_bytes(id));
+    nonce[8..].copy_from_slice(&u32::to_le_bytes(ctr));
+    nonce
+}
+
+//buf holds nonce || plaintext, seal it in place into nonce || ciphertext || tag
+fn seal_in_place(buf: &mut Vec<u8>) {
+    seal_in_place_bound(buf, 0, b"")
+}
+
+//same for the nonce and plaintext at start of buf, with aad as the associated data
+fn seal_in_place_bound(buf: &mut Vec<u8>, start: usize, aad: &[u8]) {
+    let (nonce, pt) = buf[start..].split_at_mut(NONCE_LEN);
+    let tag = CIPHER
+        .with(|cipher| cipher.encrypt_in_place_detached(GenericArray::from_slice(nonce), aad, pt))
+        .expect("encryption failure");
+    buf.extend_from_slice(&tag);
+}
+
+//pt sealed with aad as the associated data, which decrypt does not open
+pub(crate) fn seal_bound(pt: &[u8], aad: &[u8]) -> Vec<u8> {
+    let mut buf = Vec::with_capacity(pt.len() + NONCE_LEN + TAG_LEN);
+    buf.extend_from_slice(&next_nonce());
+    buf.extend_from_slice(pt);
+    seal_in_place_bound(&mut buf, 0, aad);
+    buf
+}
+
 #[inline(always)]
 pub fn encrypt(pt: &[u8]) -> Vec<u8> {
-    let key = GenericArray::from_slice(b"abcdefg hijklmn ");
-    let cipher = Aes128Gcm::new(key);
-    let nonce = GenericArray::from_slice(b"unique nonce");
-    cipher.encrypt(nonce, pt).expect("encryption failure")
+    let mut ct = Vec::with_capacity(pt.len() + NONCE_LEN + TAG_LEN);
+    ct.extend_from_slice(&next_nonce());
+    ct.extend_from_slice(pt);
+    seal_in_place(&mut ct);
+    ct
 }
 
 #[inline(always)]
@@ -588,15 +918,67 @@ pub fn ser_encrypt<T>(pt: &T) -> Vec<u8>
 where
     T: ?Sized + serde::Serialize,
 {
-    encrypt(bincode::serialize(pt).unwrap().as_ref())
+    //serialize behind the nonce and encrypt in place instead of copying it first
+    let size = compress::encoded_size(pt);
+    let mut buf = Vec::with_capacity(size + NONCE_LEN + TAG_LEN);
+    buf.extend_from_slice(&next_nonce());
+    compress::encode_to(pt, &mut buf);
+    seal_in_place(&mut buf);
+    buf
+}
+
+//the stats of an encrypted block, sealed with the tag of the block as associated
+//data so they are only accepted next to it, see enclave/src/op/block_stats.rs
+pub fn ser_encrypt_stats<T>(stats: &T, block: &[u8]) -> Vec<u8>
+where
+    T: ?Sized + serde::Serialize,
+{
+    assert!(block.len() >= NONCE_LEN + TAG_LEN, "not an encrypted block");
+    let mut buf = Vec::with_capacity(compress::encoded_size(stats) + NONCE_LEN + TAG_LEN);
+    buf.extend_from_slice(&next_nonce());
+    compress::encode_to(stats, &mut buf);
+    seal_in_place_bound(&mut buf, 0, &block[block.len() - TAG_LEN..]);
+    buf
+}
+
+//a block of items with their count in front, sealed as its associated data, so the
+//enclave counts the items without decrypting them
+pub fn ser_encrypt_counted<T: Data>(block: &[T]) -> Vec<u8> {
+    let count = (block.len() as u64).to_le_bytes();
+    let size = compress::encoded_size(block);
+    let mut buf = Vec::with_capacity(NONCE_LEN + COUNT_LEN + size + NONCE_LEN + TAG_LEN);
+    buf.extend_from_slice(&COUNT_MARK);
+    buf.extend_from_slice(&count);
+    let start = buf.len();
+    buf.extend_from_slice(&next_nonce());
+    compress::encode_to(block, &mut buf);
+    seal_in_place_bound(&mut buf, start, &count);
+    buf
 }
 
 #[inline(always)]
 pub fn decrypt(ct: &[u8]) -> Vec<u8> {
-    let key = GenericArray::from_slice(b"abcdefg hijklmn ");
-    let cipher = Aes128Gcm::new(key);
-    let nonce = GenericArray::from_slice(b"unique nonce");
-    cipher.decrypt(nonce, ct).expect("decryption failure")
+    let counted = ct.len() >= NONCE_LEN + COUNT_LEN && ct[..NONCE_LEN] == COUNT_MARK;
+    let (aad, ct) = if counted {
+        ct[NONCE_LEN..].split_at(COUNT_LEN)
+    } else {
+        (&[][..], ct)
+    };
+    assert!(ct.len() >= NONCE_LEN + TAG_LEN, "decryption failure");
+    let (nonce, rest) = ct.split_at(NONCE_LEN);
+    let (body, tag) = rest.split_at(rest.len() - TAG_LEN);
+    let mut pt = body.to_vec();
+    CIPHER
+        .with(|cipher| {
+            cipher.decrypt_in_place_detached(
+                GenericArray::from_slice(nonce),
+                aad,
+                &mut pt,
+                GenericArray::from_slice(tag),
+            )
+        })
+        .expect("decryption failure");
+    pt
 }
 
 #[inline(always)]
@@ -604,13 +986,35 @@ pub fn ser_decrypt<T>(ct: &[u8]) -> T
 where
     T: serde::de::DeserializeOwned,
 {
-    bincode::deserialize(decrypt(ct).as_ref()).unwrap()
+    compress::decode(decrypt(ct).as_ref())
 }
 
+//blocks are cut by serialized size, the same target the enclave cuts its
+//blocks by, so that a block of large items is not megabytes
 pub fn batch_encrypt<T: Data>(data: &[T]) -> Vec<ItemE> {
-    data.chunks(MAX_ENC_BL)
-        .map(|x| ser_encrypt(x))
-        .collect::<Vec<_>>()
+    enc_block_chunks(data)
+        .into_iter()
+        .map(|block| ser_encrypt_counted(block))
+        .collect()
+}
+
+//the items of each block batch_encrypt makes of data
+pub(crate) fn enc_block_chunks<T: Data>(data: &[T]) -> Vec<&[T]> {
+    let target = env::Configuration::get().enc_block_bytes;
+    let mut chunks = Vec::new();
+    let mut rest = data;
+    while !rest.is_empty() {
+        let mut bytes = 0;
+        let mut len = 0;
+        while len < rest.len() && (len == 0 || bytes < target) {
+            bytes += bincode::serialized_size(&rest[len]).unwrap() as usize;
+            len += 1;
+        }
+        let (chunk, tail) = rest.split_at(len);
+        chunks.push(chunk);
+        rest = tail;
+    }
+    chunks
 }
 
 pub fn batch_decrypt<T: Data>(data_enc: &[ItemE]) -> Vec<T> {
@@ -626,16 +1030,21 @@ pub fn secure_compute_cached(
     cur_rdd_id: usize,
     cur_part_id: usize,
     tx: SyncSender<usize>,
-) -> Vec<JoinHandle<()>> {
-    let eid = Env::get()
-        .enclave
-        .lock()
-        .unwrap()
-        .as_ref()
-        .unwrap()
-        .geteid();
-
-    let is_cached = Env::get().cache_tracker.scontain((cur_rdd_id, cur_part_id));
+) -> Vec<EcallHandle> {
+    //held by the ecall, the cached blocks it reads are not freed if they are evicted meanwhile
+    let pin = BOUNDED_MEM_CACHE.pin();
+    let key = (cur_rdd_id, cur_part_id);
+    //a task caching another rdd of the lineage does not cache this one, no use waiting for it
+    let is_cached = match acc_arg.caching_rdd_id == 0 {
+        true => match Env::get().cache_tracker.claim_sdata(key) {
+            Some(loading) => {
+                acc_arg.loading = Some(Arc::new(loading));
+                false
+            }
+            None => true,
+        },
+        false => Env::get().cache_tracker.scontain(key),
+    };
     let mut handles = Vec::new();
     if is_cached {
         acc_arg.set_cached_rdd_id(cur_rdd_id);
@@ -648,34 +1057,40 @@ pub fn secure_compute_cached(
         let dep_info = acc_arg.dep_info;
         let eenter_lock = acc_arg.eenter_lock.clone();
         let captured_vars = acc_arg.captured_vars.clone();
+        //taken before the spawn, so that the enclave is not closed in between,
+        //and on the enclave the task is bound to
+        let enclave = Env::enter();
 
-        let handle = std::thread::spawn(move || {
+        let handle = ECALL_POOL.spawn(move || {
+            let _pin = pin;
+            let eid = enclave.eid();
             let tid: u64 = thread::current().id().as_u64().into();
-            wrapper_secure_execute_pre(&op_ids, &split_nums, dep_info);
             let mut result_ptr: usize = 0;
-            while eenter_lock.compare_and_swap(false, true, atomic::Ordering::SeqCst) {
-                //wait
-            }
-            let sgx_status = unsafe {
-                secure_execute(
+            eenter_lock.lock();
+            let timed = transitions::time(Site::SecureExecuteWithPre);
+            let sgx_status = with_captured_var_table(&captured_vars, |captured_vars| unsafe {
+                secure_execute_with_pre(
                     eid,
                     &mut result_ptr,
                     tid,
                     &rdd_ids as *const Vec<usize> as *const u8,
                     &op_ids as *const Vec<OpId> as *const u8,
                     &part_ids as *const Vec<usize> as *const u8,
+                    &split_nums as *const Vec<usize> as *const u8,
                     cache_meta,
                     dep_info,
                     Input::build_from_ptr(0 as *const u8), //invalid pointer  TODO: send valid pointer
-                    &captured_vars as *const HashMap<usize, Vec<Vec<u8>>> as *const u8,
+                    captured_vars,
                 )
-            };
+            });
+            drop(timed);
             match sgx_status {
                 sgx_status_t::SGX_SUCCESS => {}
                 _ => {
                     panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
                 }
             };
+            crate::metrics::drain(eid);
             tx.send(result_ptr).unwrap();
         });
         handles.push(handle);
@@ -694,12 +1109,17 @@ pub struct AccArg {
     pub dep_info: DepInfo,
     caching_rdd_id: usize,
     cached_rdd_id: usize,
-    pub eenter_lock: Arc<AtomicBool>,
+    pub eenter_lock: Arc<EnterLock>,
     pub captured_vars: HashMap<usize, Vec<Vec<u8>>>,
+    //enclave of the task, see Env::bind_partition
+    pub enclave: usize,
+    //the claim on computing the partition of caching_rdd_id, the other tasks that
+    //want it wait until it is put or the task is over, see CacheTracker::claim
+    loading: Option<Arc<Loading>>,
 }
 
 impl AccArg {
-    pub fn new(dep_info: DepInfo, reduce_num: Option<usize>, eenter_lock: Arc<AtomicBool>) -> Self {
+    pub fn new(dep_info: DepInfo, reduce_num: Option<usize>, eenter_lock: Arc<EnterLock>) -> Self {
         let split_nums = match reduce_num {
             Some(reduce_num) => {
                 assert!(dep_info.is_shuffle == 1);
@@ -717,6 +1137,8 @@ impl AccArg {
             cached_rdd_id: 0,
             eenter_lock,
             captured_vars: HashMap::new(),
+            enclave: Env::bound_enclave(),
+            loading: None,
         }
     }
 
@@ -795,21 +1217,13 @@ impl AccArg {
             && *self.rdd_ids.first().unwrap() == self.caching_rdd_id
     }
 
-    pub fn get_enclave_lock(&self) {
-        while self
-            .eenter_lock
-            .compare_and_swap(false, true, atomic::Ordering::SeqCst)
-        {
-            //wait
-        }
+    //returns how long the caller queued, see enter_lock_stats for the totals
+    pub fn get_enclave_lock(&self) -> Duration {
+        self.eenter_lock.lock()
     }
 
     pub fn free_enclave_lock(&self) {
-        assert_eq!(
-            self.eenter_lock
-                .compare_and_swap(true, false, atomic::Ordering::SeqCst),
-            true
-        );
+        self.eenter_lock.unlock();
     }
 }
 
@@ -877,118 +1291,175 @@ impl Input {
     }
 }
 
+/// Admits the tasks of one stage at a time into the enclave.
+///
+/// Stages are registered with insert_stage, with the weight of the scheduler
+/// pool of their job, see `crate::scheduler::fair_pool`. The registered stage
+/// with the largest weight has priority, and of those the one with the
+/// smallest key. When nobody holds the lock, only a task of that stage may
+/// take it. Later tasks of the holding stage join it until there are
+/// max_cur_holders of them, see Configuration::max_stage_holders, which the
+/// EPC pressure monitor may lower and raise again, see `crate::epc_pressure`,
+/// but not while a stage of a heavier job waits, so that one enters as soon as
+/// the holders drain. Tasks that may not enter sleep until a holder leaves or
+/// a stage is removed.
 #[derive(Debug)]
 pub struct StageLock {
-    slock: AtomicBool,
-    lock_holder_info: RwLock<LockHolderInfo>,
-    //For result task, key.0 == key.1
-    //For shuffle task, key.0 > key.1, key.0 is child rdd id and key.1 is parent rdd id, key.2 is identifier
-    waiting_list: RwLock<BTreeMap<(usize, usize, usize), Vec<usize>>>,
-    num_splits_mapping: RwLock<BTreeMap<(usize, usize, usize), usize>>,
+    state: Mutex<StageState>,
+    admit: Condvar,
 }
 
 #[derive(Debug)]
-pub struct LockHolderInfo {
+struct StageState {
     cur_holder: (usize, usize, usize),
     num_cur_holders: usize,
     max_cur_holders: usize,
+    //For result task, key.0 == key.1
+    //For shuffle task, key.0 > key.1, key.0 is child rdd id and key.1 is parent rdd id, key.2 is identifier
+    waiting_list: BTreeMap<(usize, usize, usize), Vec<usize>>,
+    num_splits_mapping: BTreeMap<(usize, usize, usize), usize>,
+    weights: BTreeMap<(usize, usize, usize), usize>,
+}
+
+impl StageState {
+    fn weight(&self, rdd_id_pair: (usize, usize, usize)) -> usize {
+        *self
+            .weights
+            .get(&rdd_id_pair)
+            .unwrap_or(&fair_pool::DEFAULT_WEIGHT)
+    }
+
+    /// The registered stage with priority, heaviest first.
+    fn first(&self) -> Option<(usize, usize, usize)> {
+        self.waiting_list
+            .keys()
+            .min_by_key(|key| (Reverse(self.weight(**key)), **key))
+            .copied()
+    }
 }
 
 impl StageLock {
     pub fn new() -> Self {
         StageLock {
-            slock: AtomicBool::new(false),
-            lock_holder_info: RwLock::new(LockHolderInfo {
+            state: Mutex::new(StageState {
                 cur_holder: (0, 0, 0),
                 num_cur_holders: 0,
-                max_cur_holders: 48,
+                max_cur_holders: env::Configuration::get().max_stage_holders(),
+                waiting_list: BTreeMap::new(),
+                num_splits_mapping: BTreeMap::new(),
+                weights: BTreeMap::new(),
             }),
-            waiting_list: RwLock::new(BTreeMap::new()),
-            num_splits_mapping: RwLock::new(BTreeMap::new()),
+            admit: Condvar::new(),
         }
     }
 
-    pub fn insert_stage(&self, rdd_id_pair: (usize, usize, usize), task_id: usize) {
-        let mut waiting_list = self.waiting_list.write().unwrap();
-        waiting_list
+    pub fn insert_stage(&self, rdd_id_pair: (usize, usize, usize), task_id: usize, weight: usize) {
+        let mut state = self.state.lock().unwrap();
+        state
+            .waiting_list
             .entry(rdd_id_pair)
             .or_insert(vec![])
             .push(task_id);
+        let stage_weight = state.weights.entry(rdd_id_pair).or_insert(weight);
+        *stage_weight = std::cmp::max(*stage_weight, weight);
     }
 
     pub fn remove_stage(&self, rdd_id_pair: (usize, usize, usize), task_id: usize) {
-        let mut waiting_list = self.waiting_list.write().unwrap();
+        let mut state = self.state.lock().unwrap();
         let mut remaining = 0;
-        if let Some(task_ids) = waiting_list.get_mut(&rdd_id_pair) {
+        if let Some(task_ids) = state.waiting_list.get_mut(&rdd_id_pair) {
             if let Some(pos) = task_ids.iter().position(|x| *x == task_id) {
                 task_ids.remove(pos);
             }
             remaining = task_ids.len();
         }
         if remaining == 0 {
-            waiting_list.remove(&rdd_id_pair);
-            self.num_splits_mapping
-                .write()
-                .unwrap()
-                .remove(&rdd_id_pair);
+            state.waiting_list.remove(&rdd_id_pair);
+            state.num_splits_mapping.remove(&rdd_id_pair);
+            state.weights.remove(&rdd_id_pair);
+            //another stage may have priority now
+            drop(state);
+            self.admit.notify_all();
+        }
+    }
+
+    /// Takes `task_id` off the stage before `remove_stage`, true if no other task of the stage
+    /// is left on this executor. Every task that left before has finished its ECALLs, so the one
+    /// that gets true sees all they left in the enclaves, see `Configuration::node_combine`.
+    pub fn leave_stage(&self, rdd_id_pair: (usize, usize, usize), task_id: usize) -> bool {
+        let mut state = self.state.lock().unwrap();
+        match state.waiting_list.get_mut(&rdd_id_pair) {
+            Some(task_ids) => {
+                if let Some(pos) = task_ids.iter().position(|x| *x == task_id) {
+                    task_ids.remove(pos);
+                }
+                task_ids.is_empty()
+            }
+            None => true,
         }
     }
 
     pub fn set_num_splits(&self, rdd_id_pair: (usize, usize, usize), num_splits: usize) {
-        let mut num_splits_mapping = self.num_splits_mapping.write().unwrap();
-        num_splits_mapping.insert(rdd_id_pair, num_splits);
+        let mut state = self.state.lock().unwrap();
+        state.num_splits_mapping.insert(rdd_id_pair, num_splits);
     }
 
     pub fn get_parall_num(&self) -> usize {
-        let num_splits_mapping = self.num_splits_mapping.read().unwrap();
-        let info = self.lock_holder_info.read().unwrap();
+        let state = self.state.lock().unwrap();
         std::cmp::min(
-            *num_splits_mapping.get(&info.cur_holder).unwrap(),
-            info.max_cur_holders,
+            *state.num_splits_mapping.get(&state.cur_holder).unwrap(),
+            state.max_cur_holders,
         )
     }
 
     pub fn get_stage_lock(&self, cur_rdd_id_pair: (usize, usize, usize)) {
-        use atomic::Ordering::SeqCst;
-        let mut flag = true;
-        while flag {
-            while self.slock.compare_and_swap(false, true, SeqCst) {
-                //wait or bypass
-                let mut info = self.lock_holder_info.write().unwrap();
-                if cur_rdd_id_pair == info.cur_holder  //The case for bypass
-                    && info.num_cur_holders < info.max_cur_holders
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if state.num_cur_holders > 0 {
+                //The case for bypass, unless a heavier stage waits
+                if cur_rdd_id_pair == state.cur_holder
+                    && state.num_cur_holders < state.max_cur_holders
+                    && state.first().map_or(true, |first| {
+                        state.weight(first) <= state.weight(state.cur_holder)
+                    })
                 {
-                    info.num_cur_holders += 1;
+                    state.num_cur_holders += 1;
                     return;
                 }
+            } else if state.first().map_or(true, |first| {
+                let weight = state.weight(cur_rdd_id_pair);
+                (Reverse(state.weight(first)), first) >= (Reverse(weight), cur_rdd_id_pair)
+            }) {
+                state.cur_holder = cur_rdd_id_pair;
+                state.num_cur_holders = 1;
+                return;
             }
-            if *self
-                .waiting_list
-                .read()
-                .unwrap()
-                .first_key_value()
-                .unwrap()
-                .0
-                < cur_rdd_id_pair
-            {
-                self.slock.store(false, SeqCst);
-            } else {
-                let mut info = self.lock_holder_info.write().unwrap();
-                info.cur_holder = cur_rdd_id_pair;
-                info.num_cur_holders += 1;
-                flag = false;
-            }
+            state = self.admit.wait(state).unwrap();
         }
     }
 
-    pub fn free_stage_lock(&self) {
-        use atomic::Ordering::SeqCst;
-        self.lock_holder_info.write().unwrap().num_cur_holders -= 1;
-        let num_cur_holder = self.lock_holder_info.read().unwrap().num_cur_holders;
-        if num_cur_holder == 0 {
-            self.slock.compare_and_swap(true, false, SeqCst);
+    pub fn max_cur_holders(&self) -> usize {
+        self.state.lock().unwrap().max_cur_holders
+    }
+
+    /// Holders beyond a lowered limit are not evicted, they leave when their tasks end.
+    pub fn set_max_cur_holders(&self, max_cur_holders: usize) {
+        let mut state = self.state.lock().unwrap();
+        let raised = max_cur_holders > state.max_cur_holders;
+        state.max_cur_holders = max_cur_holders.max(1);
+        drop(state);
+        if raised {
+            self.admit.notify_all();
         }
     }
+
+    pub fn free_stage_lock(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.num_cur_holders -= 1;
+        drop(state);
+        //a holder slot or the whole lock is free
+        self.admit.notify_all();
+    }
 }
 
 #[derive(Default, Clone, Serialize, Deserialize)]
@@ -1089,6 +1560,30 @@ where
     }
 }
 
+/// The encrypted blocks of a secure rdd one partition at a time, see
+/// `Rdd::secure_to_local_iterator`. The job of the next partition runs while the current one is
+/// consumed, so the driver holds two partitions at most.
+pub struct SecureLocalIter<T> {
+    /// id of the `Text` every partition comes in
+    id: u64,
+    parts: Receiver<Result<Vec<ItemE>>>,
+    _marker: PhantomData<T>,
+}
+
+impl<T: Data> Iterator for SecureLocalIter<T> {
+    type Item = Result<Text<Vec<T>, Vec<ItemE>>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let id = self.id;
+        let part = self.parts.recv().ok()?;
+        Some(part.map(|blocks| Text {
+            data: None,
+            data_enc: Some(blocks),
+            id,
+        }))
+    }
+}
+
 #[repr(C)]
 #[derive(Clone, Debug, Default)]
 pub struct TailCompInfo {
@@ -1132,10 +1627,35 @@ pub struct OpId {
     h: u64,
 }
 
+const FNV_OFFSET: u64 = 0xcbf2_9ce4_8422_2325;
+const FNV_PRIME: u64 = 0x100_0000_01b3;
+
+/// FNV-1a of `bytes` continued from `h`, the hash the enclave derives its op ids with too.
+const fn fnv1a(mut h: u64, bytes: &[u8]) -> u64 {
+    let mut i = 0;
+    while i < bytes.len() {
+        h ^= bytes[i] as u64;
+        h = h.wrapping_mul(FNV_PRIME);
+        i += 1;
+    }
+    h
+}
+
 impl OpId {
     pub fn new(file: &'static str, line: u32, num: usize) -> Self {
-        let h = default_hash(&(file.to_string(), line, num));
-        OpId { h }
+        OpId::at(OpId::loc_hash(file, line), num)
+    }
+
+    /// Hash of a call site, which the ops made at it are numbered under.
+    pub const fn loc_hash(file: &str, line: u32) -> u64 {
+        fnv1a(fnv1a(FNV_OFFSET, file.as_bytes()), &line.to_le_bytes())
+    }
+
+    /// Op `num` of the call site hashed to `loc_hash`.
+    pub const fn at(loc_hash: u64, num: usize) -> Self {
+        OpId {
+            h: fnv1a(loc_hash, &(num as u64).to_le_bytes()),
+        }
     }
 }
 
@@ -1169,6 +1689,10 @@ impl RddVals {
         self.should_cache_.store(true, atomic::Ordering::Relaxed);
     }
 
+    fn uncache(&self) {
+        self.should_cache_.store(false, atomic::Ordering::Relaxed);
+    }
+
     fn should_cache(&self) -> bool {
         self.should_cache_.load(atomic::Ordering::Relaxed)
     }
@@ -1180,6 +1704,8 @@ impl RddVals {
 // Another separate Rdd containing generic methods like map, etc.,
 pub trait RddBase: Send + Sync + Serialize + Deserialize {
     fn cache(&self); //cache once temporarily
+    /// Stops caching the partitions computed from now on, the cached ones stay until evicted.
+    fn uncache(&self);
     fn should_cache(&self) -> bool;
     fn free_data_enc(&self, ptr: *mut u8) {
         let _data_enc = unsafe { Box::from_raw(ptr as *mut Vec<ItemE>) };
@@ -1217,7 +1743,7 @@ pub trait RddBase: Send + Sync + Serialize + Deserialize {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>>;
+    ) -> Result<Vec<EcallHandle>>;
     // Analyse whether this is required or not. It requires downcasting while executing tasks which could hurt performance.
     fn iterator_any(&self, split: Box<dyn Split>) -> Result<Box<dyn AnyData>>;
     fn cogroup_iterator_any(&self, split: Box<dyn Split>) -> Result<Box<dyn AnyData>> {
@@ -1226,6 +1752,19 @@ pub trait RddBase: Send + Sync + Serialize + Deserialize {
     fn is_pinned(&self) -> bool {
         false
     }
+    /// Hash of what the partitions are computed from besides the dependencies and the op: the
+    /// captured values of the closures, or the items or input files read. Part of the
+    /// fingerprint of the lineage, see `CacheTracker::adopt_lineage`.
+    fn content_hash(&self) -> u64 {
+        0
+    }
+}
+
+/// The `content_hash` of the values `vars` a closure captured, see `get_ser_captured_var`.
+pub(crate) fn captured_hash(vars: &[Vec<u8>]) -> u64 {
+    let mut hasher = MetroHasher::default();
+    vars.hash(&mut hasher);
+    hasher.finish()
 }
 
 impl PartialOrd for dyn RddBase {
@@ -1252,6 +1791,9 @@ impl<I: Rdd + ?Sized> RddBase for SerArc<I> {
     fn cache(&self) {
         (**self).get_rdd_base().cache();
     }
+    fn uncache(&self) {
+        (**self).get_rdd_base().uncache();
+    }
     fn should_cache(&self) -> bool {
         (**self).get_rdd_base().should_cache()
     }
@@ -1287,12 +1829,15 @@ impl<I: Rdd + ?Sized> RddBase for SerArc<I> {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         (**self).get_rdd_base().iterator_raw(split, acc_arg, tx)
     }
     fn iterator_any(&self, split: Box<dyn Split>) -> Result<Box<dyn AnyData>> {
         (**self).get_rdd_base().iterator_any(split)
     }
+    fn content_hash(&self) -> u64 {
+        (**self).get_rdd_base().content_hash()
+    }
 }
 
 impl<I: Rdd + ?Sized> Rdd for SerArc<I> {
@@ -1317,7 +1862,7 @@ impl<I: Rdd + ?Sized> Rdd for SerArc<I> {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         (**self).secure_compute(split, acc_arg, tx)
     }
 }
@@ -1352,7 +1897,7 @@ pub trait Rdd: RddBase + 'static {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>>;
+    ) -> Result<Vec<EcallHandle>>;
 
     fn secure_iterator(
         &self,
@@ -1364,7 +1909,7 @@ pub trait Rdd: RddBase + 'static {
         let rdd_id = self.get_rdd_id();
         let op_id = self.get_op_id();
         let part_id = split.get_index();
-        let mut acc_arg = AccArg::new(dep_info, None, Arc::new(AtomicBool::new(false)));
+        let mut acc_arg = AccArg::new(dep_info, None, Arc::new(EnterLock::new()));
         if let Some(action_id) = action_id {
             acc_arg.insert_quadruple(rdd_id, action_id, usize::MAX, usize::MAX);
         }
@@ -1438,6 +1983,23 @@ pub trait Rdd: RddBase + 'static {
         SerArc::new(MapPartitionsRdd::new(self.get_rdd(), ignore_idx))
     }
 
+    /// Return a new RDD by applying a function to the items of this RDD a slice at a time, for
+    /// batched code. In the enclave the slices are the decrypted blocks of the partition, here the
+    /// whole partition, so `f` must not depend on where a slice begins or ends.
+    #[track_caller]
+    fn map_blocks<U: Data, F>(&self, f: F) -> SerArc<dyn Rdd<Item = U>>
+    where
+        F: SerFunc(&[Self::Item]) -> Vec<U> + Copy,
+        Self: Sized,
+    {
+        let items_fn = Fn!(move |_index: usize,
+                                 items: Box<dyn Iterator<Item = Self::Item>>|
+              -> Box<dyn Iterator<Item = _>> {
+            Box::new(f(&items.collect::<Vec<_>>()).into_iter())
+        });
+        SerArc::new(MapPartitionsRdd::new(self.get_rdd(), items_fn))
+    }
+
     /// Return a new RDD by applying a function to each partition of this RDD,
     /// while tracking the index of the original partition.
     #[track_caller]
@@ -1489,6 +2051,65 @@ pub trait Rdd: RddBase + 'static {
             .run_job_with_context(self.get_rdd(), None, cl)
     }
 
+    /// Saves the encrypted blocks of secure partitions as the `EncFile` `part-{id}` of the
+    /// directory `path`, without statistics. They can be read back by a `LocalFsReader`.
+    fn secure_save_as_file(&self, path: String) -> Result<Vec<()>>
+    where
+        Self: Sized,
+    {
+        let cl = Fn!(move |(ctx, (_, iter_e)): (
+            TaskContext,
+            (Box<dyn Iterator<Item = Self::Item>>, Box<dyn Iterator<Item = ItemE>>)
+        )| {
+            crate::io::save_partition(&path, ctx.split_id, iter_e)
+                .expect("error while writing to file")
+        });
+        //TODO action_id
+        self.get_context()
+            .run_job_with_context(self.get_rdd(), None, cl)
+    }
+
+    /// Truncates the lineage of a secure rdd. Its encrypted blocks are saved as `EncFile`s under
+    /// VEGA_CHECKPOINT_DIR, and the rdd returned reads them back with a `LocalFsReader`, so the
+    /// stages after it neither walk nor recompute the lineage of this one. The enclave makes the
+    /// same reader at the same call site, see `checkpoint` of its ops. The partitioner is not
+    /// kept, every file is a partition.
+    #[track_caller]
+    fn checkpoint(&self) -> Result<SerArc<dyn Rdd<Item = Self::Item>>>
+    where
+        Self: Sized,
+        Self::Item: Default,
+    {
+        let context = self.get_context();
+        let dir = env::Configuration::get()
+            .checkpoint_dir
+            .join(format!("rdd-{}", self.get_rdd_id()));
+        // The parts of an earlier driver with more partitions are not read back.
+        match fs::remove_dir_all(&dir) {
+            Err(e) if e.kind() != std::io::ErrorKind::NotFound => {
+                return Err(Error::OutputFile {
+                    source: e,
+                    path: dir,
+                })
+            }
+            _ => {}
+        }
+        let path = dir
+            .to_str()
+            .ok_or_else(|| Error::PathToString(dir.clone()))?
+            .to_owned();
+        self.secure_save_as_file(path)?;
+        // A partition per file, every executor reads a slice of them.
+        let num_nodes = context.address_map.len() as u64;
+        let files_per_node = (self.number_of_splits() as u64 + num_nodes - 1) / num_nodes;
+        let config =
+            crate::io::LocalFsReaderConfig::new(dir).num_partitions_per_executor(files_per_node);
+        let deserializer = Box::new(Fn!(|file: Vec<u8>| {
+            bincode::deserialize::<Vec<ItemE>>(&file).unwrap()
+        }));
+        Ok(context.read_source(config, None, Some(deserializer)))
+    }
+
     fn reduce<F>(&self, f: F) -> Result<Option<Self::Item>>
     where
         Self: Sized,
@@ -1701,6 +2322,56 @@ pub trait Rdd: RddBase + 'static {
         Ok(Text::new(None, Some(temp.pop().unwrap())))
     }
 
+    /// Aggregate the elements of this RDD as `secure_aggregate` does, but combine the partial
+    /// results of the partitions in a tree of `depth` levels (at least 2) inside the enclaves of
+    /// the executors, so the driver combines a few of them instead of one per partition.
+    #[track_caller]
+    fn secure_tree_aggregate<U, SF, CF>(
+        &self,
+        init: U,
+        seq_fn: SF,
+        comb_fn: CF,
+        depth: usize,
+    ) -> Result<Text<U, ItemE>>
+    where
+        Self: Sized,
+        U: Data,
+        SF: SerFunc(U, Self::Item) -> U,
+        CF: SerFunc(U, U) -> U,
+    {
+        let mut num_partitions = self.number_of_splits();
+        let scale = ((num_partitions as f64)
+            .powf(1.0 / depth.max(2) as f64)
+            .ceil() as usize)
+            .max(2);
+        let zero = init.clone();
+        let aggregate_partition =
+            Fn!(move |_index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+                -> Box<dyn Iterator<Item = U>> {
+                    Box::new(std::iter::once(partition.fold(zero.clone(), &seq_fn)))
+            });
+        let mut partials = self.map_partitions_with_index(aggregate_partition);
+        // A level is worth it only while it leaves the next one fewer partials to combine.
+        while num_partitions > scale + (num_partitions + scale - 1) / scale {
+            num_partitions /= scale;
+            let width = num_partitions;
+            let comb = comb_fn.clone();
+            self.get_context().add_num(1);
+            let keyed = partials.map_partitions_with_index(Fn!(
+                move |index: usize, partition: Box<dyn Iterator<Item = U>>|
+                    -> Box<dyn Iterator<Item = (usize, U)>> {
+                        Box::new(partition.map(move |partial| (index % width, partial)))
+                }
+            ));
+            self.get_context().add_num(1);
+            let combined = keyed.reduce_by_key(Fn!(move |(a, b): (U, U)| (comb)(a, b)), width);
+            self.get_context().add_num(1);
+            partials = combined.values();
+        }
+        self.get_context().add_num(1);
+        partials.secure_reduce(comb_fn)
+    }
+
     /// Return the Cartesian product of this RDD and another one, that is, the RDD of all pairs of
     /// elements (a, b) where a is in `this` and b is in `other`.
     #[track_caller]
@@ -1813,6 +2484,49 @@ pub trait Rdd: RddBase + 'static {
         Ok(Text::new(None, Some(result)))
     }
 
+    /// The encrypted blocks of the partitions in order, one `Text` per partition, instead of all
+    /// of them at once as `secure_collect` does. Every partition is a job of its own, run on a
+    /// thread of the driver while the previous one is consumed. The blocks are only decrypted
+    /// when the caller asks, with `Text::get_pt`. The iterator ends after the first error.
+    #[track_caller]
+    fn secure_to_local_iterator(&self) -> SecureLocalIter<Self::Item>
+    where
+        Self: Sized,
+    {
+        let id = Text::<Vec<Self::Item>, Vec<ItemE>>::new(None, None).id;
+        let cl = Fn!(|(_, iter): (
+            Box<dyn Iterator<Item = Self::Item>>,
+            Box<dyn Iterator<Item = ItemE>>
+        )| iter.collect::<Vec<ItemE>>());
+        let context = self.get_context();
+        let rdd = self.get_rdd();
+        let num_splits = self.number_of_splits();
+        // Holds one partition until the last one is taken.
+        let (tx, parts) = sync_channel(0);
+        // The jobs run in the runtime of the caller, if it has one.
+        let runtime = tokio::runtime::Handle::try_current().ok();
+        thread::Builder::new()
+            .name("secure-local-iter".into())
+            .spawn(move || {
+                let _runtime = runtime.as_ref().map(|runtime| runtime.enter());
+                for part in 0..num_splits {
+                    let res = context
+                        .run_job_with_partitions(rdd.clone(), None, cl.clone(), Some(part))
+                        .map(|mut res| res.pop().unwrap_or_default());
+                    let failed = res.is_err();
+                    if tx.send(res).is_err() || failed {
+                        break;
+                    }
+                }
+            })
+            .unwrap();
+        SecureLocalIter {
+            id,
+            parts,
+            _marker: PhantomData,
+        }
+    }
+
     fn count(&self) -> Result<u64>
     where
         Self: Sized,
@@ -1929,14 +2643,12 @@ pub trait Rdd: RddBase + 'static {
         Self: Sized,
         Self::Item: Data + Eq + Hash,
     {
-        let mapped = self.map(Fn!(|x| (Some(x), None)));
+        // The items are the keys, so the values carry nothing.
+        let mapped = self.map(Fn!(|x| (x, ())));
         self.get_context().add_num(1);
-        let reduced_by_key = mapped.reduce_by_key(Fn!(|(_x, y)| y), num_partitions);
+        let reduced_by_key = mapped.reduce_by_key(Fn!(|(x, _y): ((), ())| x), num_partitions);
         self.get_context().add_num(1);
-        reduced_by_key.map(Fn!(|x: (Option<Self::Item>, Option<Self::Item>)| {
-            let (x, _y) = x;
-            x.unwrap()
-        }))
+        reduced_by_key.map(Fn!(|x: (Self::Item, ())| x.0))
     }
 
     /// Return a new RDD containing the distinct elements in this RDD.
@@ -2047,59 +2759,47 @@ pub trait Rdd: RddBase + 'static {
     where
         Self: Sized,
     {
-        const SCALE_UP_FACTOR: f64 = 2.0;
         let op_id = self.get_op_id();
         if num == 0 {
             return Ok(Text::new(None, Some(vec![])));
         }
 
+        // One job over all partitions, which ends as soon as the partitions before the first one
+        // still running hold `num` items, instead of a job per round of partitions tried.
+        let take_from_partition = Fn!(move |(_, iter): (
+            Box<dyn Iterator<Item = Self::Item>>,
+            Box<dyn Iterator<Item = ItemE>>
+        )| {
+            let data = iter.collect::<Vec<ItemE>>();
+            wrapper_take(op_id, &data, num)
+        });
+        let listener = TakeListener::new(
+            num,
+            self.number_of_splits(),
+            |(_, have_take): &(Vec<ItemE>, usize)| *have_take,
+        );
+        let res = self.get_context().run_job_with_listener(
+            self.get_rdd(),
+            None,
+            take_from_partition,
+            listener,
+        )?;
+
         let mut buf = vec![];
         let mut count = 0;
-        let total_parts = self.number_of_splits() as u32;
-        let mut parts_scanned = 0_u32;
-        while count < num && parts_scanned < total_parts {
-            let mut num_parts_to_try = 1u32;
-            let left = num - count;
-            if parts_scanned > 0 {
-                let parts_scanned = f64::from(parts_scanned);
-                num_parts_to_try = if count == 0 {
-                    (parts_scanned * SCALE_UP_FACTOR).ceil() as u32
-                } else {
-                    let num_parts_to_try =
-                        (1.5 * left as f64 * parts_scanned / (count as f64)).ceil();
-                    num_parts_to_try.min(parts_scanned * SCALE_UP_FACTOR) as u32
-                };
+        for (mut partial, have_take) in res {
+            let should_take = num - count;
+            if have_take > should_take {
+                // Only the last partition taken from has more than is left to take.
+                let (mut temp, _) = wrapper_take(op_id, &partial, should_take);
+                buf.append(&mut temp);
+                break;
+            }
+            count += have_take;
+            buf.append(&mut partial);
+            if count == num {
+                break;
             }
-
-            let partitions: Vec<_> = (parts_scanned as usize
-                ..total_parts.min(parts_scanned + num_parts_to_try) as usize)
-                .collect();
-            let num_partitions = partitions.len() as u32;
-            let take_from_partition = Fn!(move |(_, iter): (
-                Box<dyn Iterator<Item = Self::Item>>,
-                Box<dyn Iterator<Item = ItemE>>
-            )| {
-                let data = iter.collect::<Vec<ItemE>>();
-                let (partial, _) = wrapper_take(op_id, &data, left);
-                partial
-            });
-
-            let res = self.get_context().run_job_with_partitions(
-                self.get_rdd(),
-                None,
-                take_from_partition,
-                partitions,
-            )?;
-            res.into_iter().for_each(|r| {
-                let should_take = num - count;
-                if should_take != 0 {
-                    let (mut temp, have_take) = wrapper_take(op_id, &r, should_take);
-                    count += have_take;
-                    buf.append(&mut temp);
-                }
-            });
-
-            parts_scanned += num_partitions;
         }
 
         Ok(Text::new(None, Some(buf)))
@@ -2352,6 +3052,53 @@ pub trait Rdd: RddBase + 'static {
         }
     }
 
+    /// Return an RDD of one partition holding a uniform sample without replacement of `num` items
+    /// of this RDD (all of them if it has fewer), in random order.
+    ///
+    /// Every partition keeps a reservoir of the `num` items with the smallest random keys in one
+    /// pass, and the reservoirs are merged by key into one, so unlike `take_sample` it needs
+    /// neither the count of the RDD nor a retry when the sample falls short.
+    #[track_caller]
+    fn reservoir_sample(&self, num: usize, seed: Option<u64>) -> SerArc<dyn Rdd<Item = Self::Item>>
+    where
+        Self: Sized,
+    {
+        let reservoir = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+            -> Box<dyn Iterator<Item = (usize, Vec<Keyed<Self::Item>>)>> {
+                let mut rng = utils::random::get_partition_rng(seed, index);
+                Box::new(std::iter::once((0, bottom_k(partition, num, &mut rng))))
+        });
+        let reservoirs = self.map_partitions_with_index(reservoir);
+        self.get_context().add_num(1);
+        let merged = reservoirs.reduce_by_key(
+            Fn!(move |(a, b): (Vec<Keyed<Self::Item>>, Vec<Keyed<Self::Item>>)| {
+                merge_smallest(a, b, num)
+            }),
+            1,
+        );
+        self.get_context().add_num(1);
+        merged.flat_map(Fn!(|(_, sample): (usize, Vec<Keyed<Self::Item>>)| {
+            Box::new(sample.into_iter().map(|keyed| keyed.item))
+                as Box<dyn Iterator<Item = Self::Item>>
+        }))
+    }
+
+    /// `secure_take_sample` without replacement from a `reservoir_sample`, in a single job and
+    /// with the sample shuffled inside the enclaves.
+    #[track_caller]
+    fn secure_take_reservoir_sample(
+        &self,
+        num: usize,
+        seed: Option<u64>,
+    ) -> Result<Text<Vec<Self::Item>, Vec<ItemE>>>
+    where
+        Self: Sized,
+    {
+        let sample = self.reservoir_sample(num, seed);
+        self.get_context().add_num(1);
+        sample.secure_collect()
+    }
+
     /// Applies a function f to all elements of this RDD.
     fn for_each<F>(&self, func: F) -> Result<Vec<()>>
     where
@@ -2647,6 +3394,52 @@ pub trait Rdd: RddBase + 'static {
             .run_approximate_job(count_elements, rdd, None, evaluator, timeout)
     }
 
+    /// Approximate version of `secure_count`, as `count_approx` is of `count`.
+    ///
+    /// Every partition is counted inside its enclave as in `secure_count`, and the counts are
+    /// merged as their tasks finish, so a bounded answer is returned by `timeout` even if some
+    /// partitions are still being counted.
+    #[track_caller]
+    fn secure_count_approx(
+        &self,
+        timeout: Duration,
+        confidence: Option<f64>,
+    ) -> Result<PartialResult<BoundedDouble>>
+    where
+        Self: Sized,
+    {
+        let confidence = confidence.unwrap_or(0.95);
+        assert!(0.0 <= confidence && confidence <= 1.0);
+
+        let ctx = self.get_context();
+        let loc = Location::caller();
+        let action_id = ctx.new_op_id(loc);
+        let action_id_c = action_id.clone();
+        let cur_rdd_id = self.get_rdd_id();
+        let count_elements = Fn!(move |(_ctx, (_, iter)): (
+            TaskContext,
+            (
+                Box<dyn Iterator<Item = Self::Item>>,
+                Box<dyn Iterator<Item = ItemE>>,
+            )
+        )|
+         -> usize {
+            let data = iter.collect::<Vec<ItemE>>();
+            let result_ptr = wrapper_action(data, cur_rdd_id, action_id_c, true);
+            let partial_res = get_encrypted_data::<u64>(
+                action_id,
+                DepInfo::padding_new(4),
+                result_ptr as *mut u8,
+            );
+            partial_res.iter().sum::<u64>() as usize
+        });
+
+        let evaluator = CountEvaluator::new(self.number_of_splits(), confidence);
+        let rdd = self.get_rdd();
+        rdd.register_op_name("secure_count_approx");
+        ctx.run_approximate_job(count_elements, rdd, None, evaluator, timeout)
+    }
+
     /// Creates tuples of the elements in this RDD by applying `f`.
     #[track_caller]
     fn key_by<T, F>(&self, func: F) -> SerArc<dyn Rdd<Item = (T, Self::Item)>>
@@ -2743,4 +3536,37 @@ pub trait Rdd: RddBase + 'static {
             Ok(queue.into())
         }
     }
+
+    /// The first k (smallest) elements of this RDD in order, found inside the enclave.
+    ///
+    /// Every partition keeps its k smallest in a bounded heap and emits them as one run. The runs
+    /// are merged by a shuffle into about the square root of the number of partitions, and those
+    /// by `secure_reduce`, so no more than k items of a partition cross the network and the
+    /// driver merges a few runs instead of one per partition.
+    #[track_caller]
+    fn secure_take_ordered(&self, num: usize) -> Result<Text<Vec<Self::Item>, ItemE>>
+    where
+        Self: Sized,
+        Self::Item: Data + Ord,
+    {
+        let width = (self.number_of_splits() as f64).sqrt().ceil().max(1.0) as usize;
+        let first_k = Fn!(move |index: usize, partition: Box<dyn Iterator<Item = Self::Item>>|
+            -> Box<dyn Iterator<Item = (usize, Vec<Self::Item>)>> {
+                let mut queue = BoundedPriorityQueue::new(num);
+                partition.for_each(|item: Self::Item| queue.append(item));
+                Box::new(std::iter::once((index % width, queue.into())))
+        });
+        let runs = self.map_partitions_with_index(first_k);
+        self.get_context().add_num(1);
+        let merged = runs.reduce_by_key(
+            Fn!(move |(a, b): (Vec<Self::Item>, Vec<Self::Item>)| merge_smallest(a, b, num)),
+            width,
+        );
+        self.get_context().add_num(1);
+        let merged = merged.values();
+        self.get_context().add_num(1);
+        merged.secure_reduce(Fn!(move |a: Vec<Self::Item>, b: Vec<Self::Item>| {
+            merge_smallest(a, b, num)
+        }))
+    }
 }
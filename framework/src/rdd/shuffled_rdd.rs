@@ -1,7 +1,7 @@
 use std::collections::HashMap;
 use std::hash::Hash;
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::{self, JoinHandle};
+use std::thread;
 use std::time::Instant;
 
 use crate::aggregator::Aggregator;
@@ -101,7 +101,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let part_id = split.get_index();
         let fut = ShuffleFetcher::secure_fetch(self.shuffle_id, part_id);
         let buckets: Vec<Vec<Vec<ItemE>>> = futures::executor::block_on(fut)?
@@ -126,7 +126,7 @@ where
             let dur = now.elapsed().as_nanos() as f64 * 1e-9 - wait;
             println!("***in shuffled rdd, compute, total {:?}***", dur);
         });
-        Ok(vec![handle])
+        Ok(vec![handle.into()])
     }
 
     fn secure_shuffle_read(
@@ -169,6 +169,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -229,7 +233,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -283,7 +287,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
@@ -3,14 +3,13 @@ use std::sync::{
     mpsc::{sync_channel, SyncSender, TryRecvError},
     Arc,
 };
-use std::thread::JoinHandle;
 
 use itertools::{Itertools, MinMaxResult};
 use serde_derive::{Deserialize, Serialize};
 
 use crate::context::Context;
 use crate::dependency::{Dependency, NarrowDependencyTrait, OneToOneDependency, RangeDependency};
-use crate::env::{Env, BOUNDED_MEM_CACHE, RDDB_MAP};
+use crate::env::{BOUNDED_MEM_CACHE, RDDB_MAP};
 use crate::error::{Error, Result};
 use crate::partitioner::Partitioner;
 use crate::rdd::union_rdd::UnionVariants::{NonUniquePartitioner, PartitionerAware};
@@ -86,14 +85,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
-        let eid = Env::get()
-            .enclave
-            .lock()
-            .unwrap()
-            .as_ref()
-            .unwrap()
-            .geteid();
+    ) -> Result<Vec<EcallHandle>> {
         match &self.0 {
             NonUniquePartitioner { rdds, .. } => {
                 let tx = tx.clone();
@@ -245,6 +237,13 @@ impl<T: Data> RddBase for UnionRdd<T> {
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        match &self.0 {
+            NonUniquePartitioner { vals, .. } => vals.uncache(),
+            PartitionerAware { vals, .. } => vals.uncache(),
+        }
+    }
+
     fn should_cache(&self) -> bool {
         match &self.0 {
             NonUniquePartitioner { vals, .. } => vals.should_cache(),
@@ -415,7 +414,7 @@ impl<T: Data> RddBase for UnionRdd<T> {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -471,7 +470,7 @@ impl<T: Data> Rdd for UnionRdd<T> {
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
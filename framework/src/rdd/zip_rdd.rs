@@ -1,7 +1,6 @@
 use std::cmp::min;
 use std::marker::PhantomData;
 use std::sync::{mpsc::SyncSender, Arc};
-use std::thread::JoinHandle;
 
 use crate::context::Context;
 use crate::dependency::{Dependency, OneToOneDependency};
@@ -80,7 +79,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let current_split = split
             .downcast::<ZippedPartitionsSplit>()
             .or(Err(Error::DowncastFailure("ZippedPartitionsSplit")))?;
@@ -103,7 +102,7 @@ where
             let dur = now.elapsed().as_nanos() as f64 * 1e-9 - wait;
             println!("***in zipped rdd, compute, total {:?}***", dur);
         });
-        Ok(vec![handle])
+        Ok(vec![handle.into()])
     }
 
     fn secure_zip(&self, data: (Vec<ItemE>, Vec<ItemE>), acc_arg: &mut AccArg) -> Vec<ItemE> {
@@ -138,6 +137,10 @@ where
         RDDB_MAP.insert(self.get_rdd_id(), self.get_rdd_base());
     }
 
+    fn uncache(&self) {
+        self.vals.uncache();
+    }
+
     fn should_cache(&self) -> bool {
         self.vals.should_cache()
     }
@@ -203,7 +206,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         self.secure_compute(split, acc_arg, tx)
     }
 
@@ -246,7 +249,7 @@ where
         split: Box<dyn Split>,
         acc_arg: &mut AccArg,
         tx: SyncSender<usize>,
-    ) -> Result<Vec<JoinHandle<()>>> {
+    ) -> Result<Vec<EcallHandle>> {
         let cur_rdd_id = self.get_rdd_id();
         let cur_op_id = self.get_op_id();
         let cur_part_id = split.get_index();
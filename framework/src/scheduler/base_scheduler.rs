@@ -1,4 +1,4 @@
-use std::collections::{BTreeSet, VecDeque};
+use std::collections::{BTreeMap, BTreeSet, VecDeque};
 use std::net::{Ipv4Addr, SocketAddrV4};
 use std::sync::Arc;
 use std::thread;
@@ -7,13 +7,15 @@ use std::time::{Duration, Instant};
 use crate::dependency::{DepInfo, Dependency, ShuffleDependencyTrait};
 use crate::env;
 use crate::error::{Error, Result};
+use crate::map_output_tracker::MapStatus;
 use crate::rdd::{ItemE, RddBase, STAGE_LOCK};
 use crate::scheduler::{
-    CompletionEvent, FetchFailedVals, JobListener, JobTracker, ResultTask, Stage, TaskBase,
-    TaskContext, TaskOption,
+    CompletionEvent, FetchFailedVals, JobListener, JobTracker, ResultBinary, ResultTask, Stage,
+    StageBinary, TaskBase, TaskContext, TaskOption,
 };
 use crate::serializable_traits::{Data, SerFunc};
-use crate::shuffle::ShuffleMapTask;
+use crate::shuffle::{ShuffleBinary, ShuffleMapTask};
+use crate::trace;
 use dashmap::DashMap;
 
 pub(crate) type EventQueue = Arc<DashMap<usize, VecDeque<CompletionEvent>>>;
@@ -36,7 +38,7 @@ pub(crate) trait NativeScheduler: Send + Sync {
     {
         if jt.final_stage.parents.is_empty() && (jt.num_output_parts == 1) {
             let final_rdd_id = jt.final_rdd.get_rdd_id();
-            STAGE_LOCK.insert_stage((final_rdd_id, final_rdd_id, 0), 0);
+            STAGE_LOCK.insert_stage((final_rdd_id, final_rdd_id, 0), 0, jt.weight);
             STAGE_LOCK.set_num_splits(
                 (final_rdd_id, final_rdd_id, 0),
                 jt.final_rdd.number_of_splits(),
@@ -128,6 +130,20 @@ pub(crate) trait NativeScheduler: Send + Sync {
         );
         if !visited.contains(&rdd) {
             visited.insert(rdd.clone());
+            // A lineage walked before whose parent stages are all available, e.g. the part an
+            // iteration shares with the previous ones, has nothing missing.
+            if let Some(shuffles) = self.get_memoized_parent_shuffles(rdd.get_rdd_id()) {
+                let mut all_available = true;
+                for shuf_dep in shuffles {
+                    if !self.get_shuffle_map_stage(shuf_dep).await?.is_available() {
+                        all_available = false;
+                        break;
+                    }
+                }
+                if all_available {
+                    return Ok(());
+                }
+            }
             // TODO: CacheTracker register
             let locs = self.get_cache_locs(rdd.clone());
             log::debug!("cache locs: {:?}", locs);
@@ -172,47 +188,45 @@ pub(crate) trait NativeScheduler: Send + Sync {
         Ok(())
     }
 
-    async fn visit_for_parent_stages<'s, 'a: 's>(
-        &'s self,
-        parents: &'a mut BTreeSet<Stage>,
-        visited: &'a mut BTreeSet<Arc<dyn RddBase>>,
+    /// The shuffle dependencies `rdd` reaches through narrow ones, which are the parent stages of
+    /// a stage ending in it. Memoized by rdd id, the rdds registered with the cache tracker on
+    /// their first walk.
+    async fn get_parent_shuffles(
+        &self,
         rdd: Arc<dyn RddBase>,
-    ) -> Result<()> {
-        log::debug!(
-            "parent stages: {:?}",
-            parents.iter().map(|x| x.id).collect::<Vec<_>>()
-        );
-        log::debug!(
-            "visited stages: {:?}",
-            visited.iter().map(|x| x.get_rdd_id()).collect::<Vec<_>>()
-        );
-        if !visited.contains(&rdd) {
-            visited.insert(rdd.clone());
-            env::Env::get()
-                .cache_tracker
-                .register_rdd(rdd.get_rdd_id(), rdd.number_of_splits())
-                .await?;
-            for dep in rdd.get_dependencies() {
-                match dep {
-                    Dependency::ShuffleDependency(shuf_dep) => {
-                        parents.insert(self.get_shuffle_map_stage(shuf_dep.clone()).await?);
-                    }
-                    Dependency::NarrowDependency(nar_dep) => {
-                        self.visit_for_parent_stages(parents, visited, nar_dep.get_rdd_base())
-                            .await?;
+    ) -> Result<Vec<Arc<dyn ShuffleDependencyTrait>>> {
+        let rdd_id = rdd.get_rdd_id();
+        if let Some(shuffles) = self.get_memoized_parent_shuffles(rdd_id) {
+            return Ok(shuffles);
+        }
+        env::Env::get()
+            .cache_tracker
+            .register_rdd(rdd_id, rdd.number_of_splits())
+            .await?;
+        let mut shuffles: BTreeMap<usize, Arc<dyn ShuffleDependencyTrait>> = BTreeMap::new();
+        for dep in rdd.get_dependencies() {
+            match dep {
+                Dependency::ShuffleDependency(shuf_dep) => {
+                    shuffles.insert(shuf_dep.get_shuffle_id(), shuf_dep.clone());
+                }
+                Dependency::NarrowDependency(nar_dep) => {
+                    for shuf_dep in self.get_parent_shuffles(nar_dep.get_rdd_base()).await? {
+                        shuffles.insert(shuf_dep.get_shuffle_id(), shuf_dep);
                     }
                 }
             }
         }
-        Ok(())
+        let shuffles = shuffles.into_iter().map(|(_, dep)| dep).collect::<Vec<_>>();
+        self.memoize_parent_shuffles(rdd_id, shuffles.clone());
+        Ok(shuffles)
     }
 
     async fn get_parent_stages(&self, rdd: Arc<dyn RddBase>) -> Result<Vec<Stage>> {
         log::debug!("inside get parent stages");
         let mut parents: BTreeSet<Stage> = BTreeSet::new();
-        let mut visited: BTreeSet<Arc<dyn RddBase>> = BTreeSet::new();
-        self.visit_for_parent_stages(&mut parents, &mut visited, rdd.clone())
-            .await?;
+        for shuf_dep in self.get_parent_shuffles(rdd).await? {
+            parents.insert(self.get_shuffle_map_stage(shuf_dep).await?);
+        }
         log::debug!(
             "parent stages: {:?}",
             parents.iter().map(|x| x.id).collect::<Vec<_>>()
@@ -273,6 +287,11 @@ pub(crate) trait NativeScheduler: Send + Sync {
     {
         // TODO: logging
         // TODO: add to Accumulator
+        trace::instant(
+            jt.run_id,
+            format!("task #{} completed", completed_event.task.get_task_id()),
+            "scheduler",
+        );
 
         let result_type = completed_event
             .task
@@ -296,21 +315,28 @@ pub(crate) trait NativeScheduler: Send + Sync {
                 *num_finished += 1;
             }
         } else if let Ok(smt) = completed_event.task.downcast::<ShuffleMapTask>() {
-            let shuffle_server_uri = completed_event
+            let map_status = completed_event
                 .result
                 .take()
                 .ok_or_else(|| Error::Other)?
                 .as_any()
-                .downcast_ref::<String>()
-                .ok_or_else(|| crate::Error::DowncastFailure("String"))?
+                .downcast_ref::<MapStatus>()
+                .ok_or_else(|| crate::Error::DowncastFailure("MapStatus"))?
                 .clone();
             log::debug!(
                 "completed shuffle task server uri: {:?}",
-                shuffle_server_uri
+                map_status.server_uri
+            );
+            self.add_output_loc_to_stage(
+                smt.stage_id,
+                smt.partition,
+                map_status.server_uri.clone(),
             );
-            self.add_output_loc_to_stage(smt.stage_id, smt.partition, shuffle_server_uri);
 
             let stage = self.fetch_from_stage_cache(smt.stage_id);
+            if let Some(dep) = stage.shuffle_dependency.as_ref() {
+                self.register_map_output(dep.get_shuffle_id(), smt.partition, map_status);
+            }
             log::debug!(
                 "pending stages: {:?}",
                 jt.pending_tasks
@@ -395,11 +421,64 @@ pub(crate) trait NativeScheduler: Send + Sync {
                 for stage in newly_runnable {
                     self.submit_missing_tasks(stage, jt.clone()).await?;
                 }
+            } else {
+                self.submit_slow_start_stages(jt.clone()).await?;
             }
         }
         Ok(())
     }
 
+    /// Submits the waiting stages whose parent map stages are all running with at least
+    /// `reduce_slow_start` of their outputs registered, or done. Their tasks get going while the
+    /// last map tasks finish and wait for those outputs in the map output tracker.
+    ///
+    /// Only in distributed mode: the tasks waiting there must not hold the local threads the map
+    /// tasks need.
+    async fn submit_slow_start_stages<T: Data, U: Data, F, L>(
+        &self,
+        jt: Arc<JobTracker<F, U, T, L>>,
+    ) -> Result<()>
+    where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+        L: JobListener,
+    {
+        let config = env::Configuration::get();
+        if config.reduce_slow_start >= 1.0 || config.deployment_mode.is_local() {
+            return Ok(());
+        }
+        let waiting_stages: BTreeSet<_> = jt.waiting.lock().await.iter().cloned().collect();
+        let running_stages: BTreeSet<_> = jt.running.lock().await.iter().cloned().collect();
+        let mut startable = Vec::new();
+        for stage in &waiting_stages {
+            let ready = stage.parents.iter().all(|parent| {
+                let shuffle_id = match parent.shuffle_dependency.as_ref() {
+                    Some(dep) => dep.get_shuffle_id(),
+                    None => return false,
+                };
+                let available = self.num_available_map_outputs(shuffle_id);
+                available == parent.num_partitions
+                    || (running_stages.contains(parent)
+                        && available as f64
+                            >= config.reduce_slow_start * parent.num_partitions as f64)
+            });
+            if ready {
+                startable.push(stage.clone());
+            }
+        }
+        for stage in startable {
+            log::debug!("slow start of stage #{}", stage.id);
+            jt.waiting.lock().await.remove(&stage);
+            jt.running.lock().await.insert(stage.clone());
+            self.submit_missing_tasks(stage, jt.clone()).await?;
+        }
+        Ok(())
+    }
+
     async fn submit_stage<T: Data, U: Data, F, L>(
         &self,
         stage: Stage,
@@ -453,8 +532,17 @@ pub(crate) trait NativeScheduler: Send + Sync {
         let my_pending = pending_tasks
             .entry(stage.clone())
             .or_insert_with(BTreeSet::new);
+        // The lineage and the closures are encoded once for all the tasks of the stage.
         if stage == jt.final_stage {
             log::debug!("final stage #{}", stage.id);
+            let binary = StageBinary::new(
+                jt.final_stage.id,
+                ResultBinary {
+                    rdd: jt.final_rdd.clone(),
+                    action_id: jt.action_id.clone(),
+                    func: jt.func.clone(),
+                },
+            );
             for (id_in_job, (id, part)) in jt
                 .output_parts
                 .iter()
@@ -467,12 +555,11 @@ pub(crate) trait NativeScheduler: Send + Sync {
                     self.get_next_task_id(),
                     jt.run_id,
                     jt.final_stage.id,
-                    jt.final_rdd.clone(),
-                    jt.action_id.clone(),
-                    jt.func.clone(),
+                    binary.clone(),
                     *part,
                     locs,
                     id,
+                    jt.weight,
                 );
                 let task = Box::new(result_task.clone()) as Box<dyn TaskBase>;
                 let executor = self.next_executor_server(&*task);
@@ -484,6 +571,15 @@ pub(crate) trait NativeScheduler: Send + Sync {
                 )
             }
         } else {
+            let binary = StageBinary::new(
+                stage.id,
+                ShuffleBinary {
+                    dep: stage
+                        .shuffle_dependency
+                        .clone()
+                        .ok_or_else(|| Error::Other)?,
+                },
+            );
             for p in 0..stage.num_partitions {
                 log::debug!("shuffle stage #{}", stage.id);
                 if stage.output_locs[p].is_empty() {
@@ -493,18 +589,16 @@ pub(crate) trait NativeScheduler: Send + Sync {
                         self.get_next_task_id(),
                         jt.run_id,
                         stage.id,
-                        stage
-                            .shuffle_dependency
-                            .clone()
-                            .ok_or_else(|| Error::Other)?,
+                        binary.clone(),
                         p,
                         locs,
+                        jt.weight,
                     );
                     log::debug!(
                         "creating task for stage #{}, partition #{} and shuffle id #{}",
                         stage.id,
                         p,
-                        shuffle_map_task.dep.get_shuffle_id()
+                        shuffle_map_task.binary.dep.get_shuffle_id()
                     );
                     let task = Box::new(shuffle_map_task.clone()) as Box<dyn TaskBase>;
                     let executor = self.next_executor_server(&*task);
@@ -551,6 +645,7 @@ pub(crate) trait NativeScheduler: Send + Sync {
     fn insert_into_stage_cache(&self, id: usize, stage: Stage);
     /// refreshes cache locations
     fn register_shuffle(&self, shuffle_id: usize, num_maps: usize);
+    fn register_map_output(&self, shuffle_id: usize, map_id: usize, status: MapStatus);
     fn register_map_outputs(&self, shuffle_id: usize, locs: Vec<Option<String>>);
     fn remove_output_loc_from_stage(&self, shuffle_id: usize, map_id: usize, server_uri: &str);
     async fn update_cache_locs(&self) -> Result<()>;
@@ -560,7 +655,18 @@ pub(crate) trait NativeScheduler: Send + Sync {
     fn fetch_from_stage_cache(&self, id: usize) -> Stage;
     fn fetch_from_shuffle_to_cache(&self, id: usize) -> Stage;
     fn get_cache_locs(&self, rdd: Arc<dyn RddBase>) -> Option<Vec<Vec<Ipv4Addr>>>;
+    fn get_memoized_parent_shuffles(
+        &self,
+        rdd_id: usize,
+    ) -> Option<Vec<Arc<dyn ShuffleDependencyTrait>>>;
+    fn memoize_parent_shuffles(
+        &self,
+        rdd_id: usize,
+        shuffles: Vec<Arc<dyn ShuffleDependencyTrait>>,
+    );
     fn get_event_queue(&self) -> &Arc<DashMap<usize, VecDeque<CompletionEvent>>>;
+    fn num_available_map_outputs(&self, shuffle_id: usize) -> usize;
+    fn get_reducer_locs(&self, shuffle_id: usize, reduce_id: usize) -> Vec<Ipv4Addr>;
     async fn get_missing_parent_stages<'a>(&'a self, stage: Stage) -> Result<Vec<Stage>>;
     fn get_next_job_id(&self) -> usize;
     fn get_next_stage_id(&self) -> usize;
@@ -568,21 +674,30 @@ pub(crate) trait NativeScheduler: Send + Sync {
     fn next_executor_server(&self, rdd: &dyn TaskBase) -> SocketAddrV4;
 
     fn get_preferred_locs(&self, rdd: Arc<dyn RddBase>, partition: usize) -> Vec<Ipv4Addr> {
-        // TODO: have to implement this completely
-        // if let Some(cached) = self.get_cache_locs(rdd.clone()) {
-        //     if let Some(cached) = cached.get(partition) {
-        //         return cached.clone();
-        //     }
-        // }
         let rdd_prefs = rdd.preferred_locations(rdd.splits()[partition].clone());
         if !rdd.is_pinned() {
+            // Where the partition is cached, plain or encrypted, it need not be computed again.
+            if let Some(cached) = self.get_cache_locs(rdd.clone()) {
+                if let Some(cached) = cached.get(partition).filter(|locs| !locs.is_empty()) {
+                    return cached.clone();
+                }
+            }
             if !rdd_prefs.is_empty() {
                 return rdd_prefs;
             }
             for dep in rdd.get_dependencies().iter() {
-                if let Dependency::NarrowDependency(nar_dep) = dep {
-                    for in_part in nar_dep.get_parents(partition) {
-                        let locs = self.get_preferred_locs(nar_dep.get_rdd_base(), in_part);
+                match dep {
+                    Dependency::NarrowDependency(nar_dep) => {
+                        for in_part in nar_dep.get_parents(partition) {
+                            let locs = self.get_preferred_locs(nar_dep.get_rdd_base(), in_part);
+                            if !locs.is_empty() {
+                                return locs;
+                            }
+                        }
+                    }
+                    // A reduce task goes where most of its map outputs are, by their sizes.
+                    Dependency::ShuffleDependency(shuf_dep) => {
+                        let locs = self.get_reducer_locs(shuf_dep.get_shuffle_id(), partition);
                         if !locs.is_empty() {
                             return locs;
                         }
@@ -638,6 +753,12 @@ macro_rules! impl_common_scheduler_funcs {
                 .register_shuffle(shuffle_id, num_maps)
         }
 
+        #[inline]
+        fn register_map_output(&self, shuffle_id: usize, map_id: usize, status: MapStatus) {
+            self.map_output_tracker
+                .register_map_output(shuffle_id, map_id, status)
+        }
+
         #[inline]
         fn register_map_outputs(&self, shuffle_id: usize, locs: Vec<Option<String>>) {
             self.map_output_tracker
@@ -658,11 +779,38 @@ macro_rules! impl_common_scheduler_funcs {
             locs_opt.map(|l| l.clone())
         }
 
+        #[inline]
+        fn get_memoized_parent_shuffles(
+            &self,
+            rdd_id: usize,
+        ) -> Option<Vec<Arc<dyn ShuffleDependencyTrait>>> {
+            self.parent_shuffles.get(&rdd_id).map(|s| s.clone())
+        }
+
+        #[inline]
+        fn memoize_parent_shuffles(
+            &self,
+            rdd_id: usize,
+            shuffles: Vec<Arc<dyn ShuffleDependencyTrait>>,
+        ) {
+            self.parent_shuffles.insert(rdd_id, shuffles);
+        }
+
         #[inline]
         fn get_event_queue(&self) -> &Arc<DashMap<usize, VecDeque<CompletionEvent>>> {
             &self.event_queues
         }
 
+        #[inline]
+        fn num_available_map_outputs(&self, shuffle_id: usize) -> usize {
+            self.map_output_tracker.num_available_outputs(shuffle_id)
+        }
+
+        #[inline]
+        fn get_reducer_locs(&self, shuffle_id: usize, reduce_id: usize) -> Vec<Ipv4Addr> {
+            self.map_output_tracker.reducer_locs(shuffle_id, reduce_id)
+        }
+
         #[inline]
         fn get_next_job_id(&self) -> usize {
             self.next_job_id.fetch_add(1, Ordering::SeqCst)
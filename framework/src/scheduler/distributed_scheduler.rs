@@ -10,29 +10,37 @@ use std::time::{Duration, Instant};
 
 use crate::dependency::ShuffleDependencyTrait;
 use crate::env;
-use crate::error::{Error, NetworkError, Result};
+use crate::error::Result;
 use crate::map_output_tracker::MapOutputTracker;
 use crate::partial::{ApproximateActionListener, ApproximateEvaluator, PartialResult};
 use crate::rdd::{ItemE, OpId, Rdd, RddBase};
 use crate::scheduler::{
-    listener::{JobEndListener, JobStartListener},
-    CompletionEvent, EventQueue, Job, JobListener, JobTracker, LiveListenerBus, NativeScheduler,
-    NoOpListener, ResultTask, Stage, TaskBase, TaskContext, TaskOption, TaskResult, TastEndReason,
+    fair_pool::FairPool,
+    listener::{JobEndListener, JobStartListener, TaskMetricsListener},
+    task_channel::TASK_CHANNELS,
+    with_binary, CompletionEvent, EncodedBinary, EventQueue, Job, JobListener, JobTracker,
+    LiveListenerBus, NativeScheduler, NoOpListener, ResultTask, Stage, TaskBase, TaskContext,
+    TaskOption, TaskResult, TastEndReason,
 };
 use crate::serializable_traits::{AnyData, Data, SerFunc};
-use crate::serialized_data_capnp::serialized_data;
-use crate::shuffle::ShuffleMapTask;
-use capnp::message::ReaderOptions;
-use capnp_futures::serialize as capnp_serialize;
+use crate::shuffle::{ShuffleFetcher, ShuffleMapTask};
+use crate::trace;
 use dashmap::DashMap;
 use parking_lot::Mutex;
-use tokio::net::TcpStream;
-use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
 
-const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
-    traversal_limit_in_words: None,
-    nesting_limit: 64,
-};
+/// Tasks shorter than this are never speculated, a copy would not finish any sooner.
+const MIN_SPECULATION_RUN_TIME: Duration = Duration::from_millis(100);
+
+/// A running task, with what it takes to launch a copy of it.
+struct InFlightTask {
+    stage_id: usize,
+    task_bytes: Arc<Vec<u8>>,
+    binary: Option<EncodedBinary>,
+    executor: SocketAddrV4,
+    launched: Instant,
+    pinned: bool,
+    speculated: bool,
+}
 
 // Just for now, creating an entire scheduler functions without dag scheduler trait.
 // Later change it to extend from dag scheduler.
@@ -49,6 +57,9 @@ pub(crate) struct DistributedScheduler {
     next_stage_id: Arc<AtomicUsize>,
     stage_cache: Arc<DashMap<usize, Stage>>,
     shuffle_to_map_stage: Arc<DashMap<usize, Stage>>,
+    /// Shuffle dependencies an rdd reaches through narrow ones, by rdd id. A lineage never
+    /// changes once built, so the rdds an iteration reuses are walked only once.
+    parent_shuffles: Arc<DashMap<usize, Vec<Arc<dyn ShuffleDependencyTrait>>>>,
     cache_locs: Arc<DashMap<usize, Vec<Vec<Ipv4Addr>>>>,
     master: bool,
     framework_name: String,
@@ -60,10 +71,24 @@ pub(crate) struct DistributedScheduler {
     job_tasks: HashMap<usize, HashSet<String>>,
     slaves_with_executors: HashSet<String>,
     server_uris: Arc<Mutex<VecDeque<SocketAddrV4>>>,
+    /// Tasks sent to each executor that have not returned yet.
+    running_tasks: Arc<DashMap<SocketAddrV4, usize>>,
+    /// Tasks sent to an executor whose result has not arrived yet, by task id. Only kept with
+    /// speculation on.
+    in_flight: Arc<DashMap<usize, InFlightTask>>,
+    /// Run times of the finished tasks of each stage, by stage id.
+    run_times: Arc<DashMap<usize, Vec<Duration>>>,
+    /// Tasks an executor runs at once, past it a task waits for a slot on the executors that
+    /// have its input cached (delay scheduling).
+    executor_slots: usize,
+    /// Task slots of the executors, shared fairly by the jobs running at once.
+    fair_pool: Arc<FairPool>,
     port: u16,
     map_output_tracker: MapOutputTracker,
-    // TODO: fix proper locking mechanism
-    scheduler_lock: Arc<Mutex<bool>>,
+    /// Held while the stages of a job are built or submitted and its events are processed, so
+    /// that concurrent jobs see the stage cache and the cache locations in one piece. The tasks
+    /// of the jobs run side by side.
+    dag_lock: Arc<tokio::sync::Mutex<()>>,
     live_listener_bus: LiveListenerBus,
 }
 
@@ -81,6 +106,8 @@ impl DistributedScheduler {
         );
         let mut live_listener_bus = LiveListenerBus::new();
         live_listener_bus.start().unwrap();
+        let executor_slots = env::Configuration::get().max_stage_holders();
+        let num_servers = servers.as_ref().map_or(1, |servers| servers.len());
         DistributedScheduler {
             max_failures,
             attempt_id: Arc::new(AtomicUsize::new(0)),
@@ -93,6 +120,7 @@ impl DistributedScheduler {
             next_stage_id: Arc::new(AtomicUsize::new(0)),
             stage_cache: Arc::new(DashMap::new()),
             shuffle_to_map_stage: Arc::new(DashMap::new()),
+            parent_shuffles: Arc::new(DashMap::new()),
             cache_locs: Arc::new(DashMap::new()),
             master,
             framework_name: "vega".to_string(),
@@ -108,9 +136,14 @@ impl DistributedScheduler {
             } else {
                 Arc::new(Mutex::new(VecDeque::new()))
             },
+            running_tasks: Arc::new(DashMap::new()),
+            in_flight: Arc::new(DashMap::new()),
+            run_times: Arc::new(DashMap::new()),
+            executor_slots,
+            fair_pool: Arc::new(FairPool::new(num_servers * executor_slots)),
             port,
             map_output_tracker: env::Env::get().map_output_tracker.clone(),
-            scheduler_lock: Arc::new(Mutex::new(true)),
+            dag_lock: Arc::new(tokio::sync::Mutex::new(())),
             live_listener_bus,
         }
     }
@@ -135,24 +168,22 @@ impl DistributedScheduler {
         E: ApproximateEvaluator<U, R> + Send + Sync + 'static,
         R: Clone + Debug + Send + Sync + 'static,
     {
-        // acquiring lock so that only one job can run at same time this lock is just
-        // a temporary patch for preventing multiple jobs to update cache locks which affects
-        // construction of dag task graph. dag task graph construction needs to be altered
-        let selfc = self.clone();
-        let _lock = selfc.scheduler_lock.lock();
         env::Env::run_in_async_rt(|| -> Result<PartialResult<R>> {
             futures::executor::block_on(async move {
                 let partitions: Vec<_> = (0..final_rdd.number_of_splits()).collect();
                 let listener = ApproximateActionListener::new(evaluator, timeout, partitions.len());
-                let jt = JobTracker::from_scheduler(
-                    &*self,
-                    func,
-                    final_rdd.clone(),
-                    action_id,
-                    partitions,
-                    listener,
-                )
-                .await?;
+                let jt = {
+                    let _dag = self.dag_lock.lock().await;
+                    JobTracker::from_scheduler(
+                        &*self,
+                        func,
+                        final_rdd.clone(),
+                        action_id,
+                        partitions,
+                        listener,
+                    )
+                    .await?
+                };
                 if final_rdd.number_of_splits() == 0 {
                     // Return immediately if the job is running 0 tasks
                     let time = Instant::now();
@@ -193,27 +224,63 @@ impl DistributedScheduler {
             ),
         ) -> U,
     {
-        // acquiring lock so that only one job can run at same time this lock is just
-        // a temporary patch for preventing multiple jobs to update cache locks which affects
-        // construction of dag task graph. dag task graph construction needs to be altered
-        let selfc = self.clone();
-        let _lock = selfc.scheduler_lock.lock();
         env::Env::run_in_async_rt(|| -> Result<Vec<U>> {
             futures::executor::block_on(async move {
-                let jt = JobTracker::from_scheduler(
-                    &*self,
-                    func,
-                    final_rdd.clone(),
-                    action_id,
-                    partitions,
-                    NoOpListener,
-                )
-                .await?;
+                let jt = {
+                    let _dag = self.dag_lock.lock().await;
+                    JobTracker::from_scheduler(
+                        &*self,
+                        func,
+                        final_rdd.clone(),
+                        action_id,
+                        partitions,
+                        NoOpListener,
+                    )
+                    .await?
+                };
                 self.event_process_loop(allow_local, jt).await
             })
         })
     }
 
+    /// Runs a job whose `listener` may be done before all of its tasks are: the result is then the
+    /// results before the first missing one, and the tasks not launched yet never run.
+    pub fn run_job_with_listener<T: Data, U: Data, F, L>(
+        self: Arc<Self>,
+        func: Arc<F>,
+        final_rdd: Arc<dyn Rdd<Item = T>>,
+        action_id: Option<OpId>,
+        partitions: Vec<usize>,
+        listener: L,
+    ) -> Result<Vec<U>>
+    where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+        L: JobListener + 'static,
+    {
+        env::Env::run_in_async_rt(|| -> Result<Vec<U>> {
+            futures::executor::block_on(async move {
+                let jt = {
+                    let _dag = self.dag_lock.lock().await;
+                    JobTracker::from_scheduler(
+                        &*self,
+                        func,
+                        final_rdd.clone(),
+                        action_id,
+                        partitions,
+                        listener,
+                    )
+                    .await?
+                };
+                self.event_process_loop(false, jt).await
+            })
+        })
+    }
+
     /// Start the event processing loop for a given job.
     async fn event_process_loop<T: Data, U: Data, F, L>(
         self: Arc<Self>,
@@ -237,12 +304,17 @@ impl DistributedScheduler {
         }
 
         self.event_queues.insert(jt.run_id, VecDeque::new());
+        let _share = self.fair_pool.join(jt.run_id, jt.weight);
+        let job_start = trace::now_us();
 
         let mut results: Vec<Option<U>> = (0..jt.num_output_parts).map(|_| None).collect();
         let mut fetch_failure_duration = Duration::new(0, 0);
 
-        self.submit_stage(jt.final_stage.clone(), jt.clone())
-            .await?;
+        {
+            let _dag = self.dag_lock.lock().await;
+            self.submit_stage(jt.final_stage.clone(), jt.clone())
+                .await?;
+        }
         log::debug!(
             "pending stages and tasks: {:?}",
             jt.pending_tasks
@@ -254,9 +326,16 @@ impl DistributedScheduler {
         );
 
         let mut num_finished = 0;
-        while num_finished != jt.num_output_parts {
+        let mut last_speculation = Instant::now();
+        while num_finished != jt.num_output_parts && !jt.listener.is_done() {
             let event_option = self.wait_for_event(jt.run_id, self.poll_timeout);
             let start = Instant::now();
+            if env::Configuration::get().speculation
+                && last_speculation.elapsed() >= Duration::from_millis(self.poll_timeout)
+            {
+                self.speculate(&jt).await;
+                last_speculation = Instant::now();
+            }
 
             if let Some(evt) = event_option {
                 log::debug!("event starting");
@@ -270,19 +349,29 @@ impl DistributedScheduler {
                     stage.id,
                     evt.task.get_task_id()
                 );
-                jt.pending_tasks
+                let was_pending = jt
+                    .pending_tasks
                     .lock()
                     .await
                     .get_mut(&stage)
                     .unwrap()
                     .remove(&evt.task);
                 use super::dag_scheduler::TastEndReason::*;
+                if !was_pending && matches!(evt.reason, Success) {
+                    log::debug!(
+                        "dropping the result of the slower copy of task #{}",
+                        evt.task.get_task_id()
+                    );
+                    continue;
+                }
                 match evt.reason {
                     Success => {
+                        let _dag = self.dag_lock.lock().await;
                         self.on_event_success(evt, &mut results, &mut num_finished, jt.clone())
                             .await?;
                     }
                     FetchFailed(failed_vals) => {
+                        let _dag = self.dag_lock.lock().await;
                         self.on_event_failure(jt.clone(), failed_vals, evt.task.get_stage_id())
                             .await;
                         fetch_failure_duration = start.elapsed();
@@ -296,6 +385,7 @@ impl DistributedScheduler {
         if !jt.failed.lock().await.is_empty()
             && fetch_failure_duration.as_millis() > self.resubmit_timeout
         {
+            let _dag = self.dag_lock.lock().await;
             self.update_cache_locs().await?;
             for stage in jt.failed.lock().await.iter() {
                 self.submit_stage(stage.clone(), jt.clone()).await?;
@@ -303,7 +393,18 @@ impl DistributedScheduler {
             jt.failed.lock().await.clear();
         }
 
+        // Without its queue the job is over, the tasks of it still waiting are dropped.
         self.event_queues.remove(&jt.run_id);
+        self.live_listener_bus.post(Box::new(JobEndListener {
+            job_id: jt.run_id,
+            time: Instant::now(),
+            job_result: true,
+        }));
+        trace::record(jt.run_id, format!("job #{}", jt.run_id), "scheduler", 0, job_start);
+        trace::finish_job(jt.run_id);
+        if num_finished != jt.num_output_parts {
+            return Ok(results.into_iter().take_while(|s| s.is_some()).flatten().collect());
+        }
         Ok(results
             .into_iter()
             .map(|s| match s {
@@ -313,11 +414,111 @@ impl DistributedScheduler {
             .collect())
     }
 
-    async fn receive_results<T: Data, U: Data, F, R>(
-        event_queues: Arc<DashMap<usize, VecDeque<CompletionEvent>>>,
-        receiver: R,
+    /// Launches a copy of every task of the job that runs `speculation_multiplier` times longer
+    /// than the median of the finished tasks of its stage, once `speculation_quantile` of them
+    /// have finished. The copy goes to the least loaded other executor, whichever copy finishes
+    /// first gives the result and `event_process_loop` drops the other one.
+    async fn speculate<T: Data, U: Data, F, L>(&self, jt: &JobTracker<F, U, T, L>)
+    where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+        L: JobListener,
+    {
+        let conf = env::Configuration::get();
+        let mut pending = HashSet::new();
+        let mut num_pending: HashMap<usize, usize> = HashMap::new();
+        for task in jt.pending_tasks.lock().await.values().flatten() {
+            pending.insert(task.get_task_id());
+            *num_pending.entry(task.get_stage_id()).or_insert(0) += 1;
+        }
+        let mut stragglers = Vec::new();
+        for mut flight in self.in_flight.iter_mut() {
+            if flight.speculated || flight.pinned || !pending.contains(flight.key()) {
+                continue;
+            }
+            let threshold = self.run_times.get(&flight.stage_id).and_then(|run_times| {
+                DistributedScheduler::straggler_threshold(
+                    &run_times,
+                    num_pending.get(&flight.stage_id).copied().unwrap_or(0),
+                    conf.speculation_multiplier,
+                    conf.speculation_quantile,
+                )
+            });
+            if threshold.map_or(false, |threshold| flight.launched.elapsed() > threshold) {
+                flight.speculated = true;
+                let task = (flight.task_bytes.clone(), flight.binary.clone());
+                stragglers.push((*flight.key(), flight.executor, task));
+            }
+        }
+        for (task_id, executor, (task_bytes, binary)) in stragglers {
+            let target = {
+                let servers = self.server_uris.lock();
+                servers
+                    .iter()
+                    .filter(|server| **server != executor)
+                    .min_by_key(|server| {
+                        self.running_tasks.get(*server).map_or(0, |running| *running)
+                    })
+                    .copied()
+            };
+            let target = match target {
+                Some(target) => target,
+                None => continue,
+            };
+            log::info!(
+                "task #{} is a straggler on {}, launching a copy on {}",
+                task_id,
+                executor,
+                target
+            );
+            let task: TaskOption =
+                with_binary(binary, || bincode::deserialize(&task_bytes)).unwrap();
+            tokio::spawn(DistributedScheduler::run_on_executor::<T, U, F>(
+                task,
+                task_bytes,
+                target,
+                self.event_queues.clone(),
+                self.live_listener_bus.clone(),
+                self.running_tasks.clone(),
+                self.in_flight.clone(),
+                self.run_times.clone(),
+            ));
+        }
+    }
+
+    /// The run time past which a task of a stage is a straggler, given the run times of the
+    /// finished tasks of the stage. `None` while fewer than `quantile` of them have finished.
+    fn straggler_threshold(
+        run_times: &[Duration],
+        num_pending: usize,
+        multiplier: f64,
+        quantile: f64,
+    ) -> Option<Duration> {
+        let num_tasks = run_times.len() + num_pending;
+        if run_times.is_empty() || (run_times.len() as f64) < quantile * num_tasks as f64 {
+            return None;
+        }
+        let mut sorted = run_times.to_vec();
+        sorted.sort();
+        let median = sorted[sorted.len() / 2];
+        Some(std::cmp::max(median.mul_f64(multiplier), MIN_SPECULATION_RUN_TIME))
+    }
+
+    /// Sends `task` to `target_executor` and queues the completion event once its result is
+    /// back. The first copy of a task to finish records its run time.
+    async fn run_on_executor<T: Data, U: Data, F>(
         task: TaskOption,
-        target_port: u16,
+        task_bytes: Arc<Vec<u8>>,
+        target_executor: SocketAddrV4,
+        event_queues: EventQueue,
+        live_listener_bus: LiveListenerBus,
+        running_tasks: Arc<DashMap<SocketAddrV4, usize>>,
+        in_flight: Arc<DashMap<usize, InFlightTask>>,
+        run_times: Arc<DashMap<usize, Vec<Duration>>>,
     ) where
         F: SerFunc(
             (
@@ -325,25 +526,101 @@ impl DistributedScheduler {
                 (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
             ),
         ) -> U,
-        R: futures::AsyncRead + std::marker::Unpin,
     {
-        let result: TaskResult = {
-            let message = capnp_futures::serialize::read_message(receiver, CAPNP_BUF_READ_OPTS)
+        let task_id = task.get_task_id();
+        *running_tasks.entry(target_executor).or_insert(0) += 1;
+        log::debug!(
+            "sending task #{} of {} bytes to exec @{},",
+            task_id,
+            task_bytes.len(),
+            target_executor.port(),
+        );
+        let launched = trace::now_us();
+        let result = TASK_CHANNELS
+            .run_task(target_executor, task_bytes.clone(), task.binary())
+            .await;
+        let returned = trace::now_us();
+        let (result, metrics, task_trace) =
+            DistributedScheduler::decode_result(&task, result.bytes().unwrap(), target_executor)
                 .await
-                .unwrap();
-            let task_data = message.get_root::<serialized_data::Reader>().unwrap();
-            log::debug!(
-                "received task #{} result of {} bytes from executor @{}",
-                task.get_task_id(),
-                task_data.get_msg().unwrap().len(),
-                target_port
-            );
-            let now = Instant::now();
-            let res = bincode::deserialize(&task_data.get_msg().unwrap()).unwrap();
-            let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-            println!("distributed_scheduler deserialize task time: {:?} s", dur);
-            res
+                .split_extras();
+        crate::metrics::add_to_totals(&metrics);
+        live_listener_bus.post(Box::new(TaskMetricsListener {
+            job_id: task.get_run_id(),
+            task_id,
+            metrics,
+        }));
+        // One lane per executor in the driver, the executor has the spans of the task itself.
+        let lane = format!("task #{} @{}", task_id, target_executor.port());
+        trace::record(task.get_run_id(), lane, "task", target_executor.port() as u64, launched);
+        if let Some(task_trace) = task_trace {
+            trace::add_task_trace(task.get_run_id(), launched, returned, task_trace);
+        }
+        DistributedScheduler::receive_results::<T, U, F>(event_queues, result, task);
+        if let Some(mut running) = running_tasks.get_mut(&target_executor) {
+            *running = running.saturating_sub(1);
+        }
+        if let Some((_, flight)) = in_flight.remove(&task_id) {
+            run_times
+                .entry(flight.stage_id)
+                .or_insert_with(Vec::new)
+                .push(flight.launched.elapsed());
+        }
+    }
+
+    /// Deserializes the result of `task`, fetching it from the shuffle server of the executor
+    /// first if it was too large to come back with the task.
+    async fn decode_result(
+        task: &TaskOption,
+        task_data: &[u8],
+        target_executor: SocketAddrV4,
+    ) -> TaskResult {
+        log::debug!(
+            "received task #{} result of {} bytes from executor @{}",
+            task.get_task_id(),
+            task_data.len(),
+            target_executor.port()
+        );
+        let now = Instant::now();
+        let (res, metrics, task_trace) = bincode::deserialize::<TaskResult>(task_data)
+            .unwrap()
+            .split_extras();
+        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
+        println!("distributed_scheduler deserialize task time: {:?} s", dur);
+        let res = match res {
+            TaskResult::Indirect {
+                server_uri,
+                task_id,
+                len,
+            } => {
+                log::debug!(
+                    "fetching task #{} result of {} bytes from {}",
+                    task_id,
+                    len,
+                    server_uri
+                );
+                let task_data = ShuffleFetcher::fetch_task_result(&server_uri, task_id)
+                    .await
+                    .unwrap();
+                bincode::deserialize(&task_data).unwrap()
+            }
+            res => res,
         };
+        res.with_extras(metrics, task_trace)
+    }
+
+    fn receive_results<T: Data, U: Data, F>(
+        event_queues: Arc<DashMap<usize, VecDeque<CompletionEvent>>>,
+        result: TaskResult,
+        task: TaskOption,
+    ) where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+    {
 
         match task {
             TaskOption::ResultTask(tsk) => {
@@ -421,86 +698,148 @@ impl NativeScheduler for DistributedScheduler {
             return;
         }
         log::debug!("inside submit task");
-        let event_queues_clone = self.event_queues.clone();
+        let event_queues = self.event_queues.clone();
+        let live_listener_bus = self.live_listener_bus.clone();
+        let server_uris = self.server_uris.clone();
+        let running_tasks = self.running_tasks.clone();
+        let in_flight = self.in_flight.clone();
+        let run_times = self.run_times.clone();
+        let executor_slots = self.executor_slots;
+        let fair_pool = self.fair_pool.clone();
         tokio::spawn(async move {
-            let mut num_retries = 0;
-            loop {
-                log::debug!("target_executor: {:?}", target_executor);
-                match TcpStream::connect(&target_executor).await {
-                    Ok(mut stream) => {
-                        let (reader, writer) = stream.into_split();
-                        let reader = reader.compat();
-                        let writer = writer.compat_write();
-                        let now = Instant::now();
-                        let task_bytes = bincode::serialize(&task).unwrap();
-                        let dur = now.elapsed().as_nanos() as f64 * 1e-9;
-                        println!("distributed_scheduler serialize task time: {:?} s", dur);
-                        log::debug!(
-                            "sending task #{} of {} bytes to exec @{},",
-                            task.get_task_id(),
-                            task_bytes.len(),
-                            target_executor.port(),
-                        );
-
-                        let message = {
-                            let mut message = capnp::message::Builder::new_default();
-                            let mut task_data = message.init_root::<serialized_data::Builder>();
-                            task_data.set_msg(&task_bytes);
-                            message
-                        };
-
-                        capnp_serialize::write_message(writer, message).await
-                            .map_err(Error::CapnpDeserialization)
-                            .unwrap();
-
-                        log::debug!("sent data to exec @{}", target_executor.port());
-
-                        // receive results back
-                        DistributedScheduler::receive_results::<T, U, F, _>(
-                            event_queues_clone,
-                            reader,
-                            task,
-                            target_executor.port(),
-                        )
-                        .await;
-                        break;
-                    }
-                    Err(_) => {
-                        if num_retries > 5000 {
-                            //100s
-                            panic!("executor @{} not initialized", target_executor.port());
-                        }
-                        tokio::time::sleep(Duration::from_millis(20)).await;
-                        num_retries += 1;
-                        continue;
-                    }
-                }
+            let run_id = task.get_run_id();
+            // Dropped if the job ends meanwhile.
+            if !fair_pool.acquire(run_id).await {
+                return;
+            }
+            let target_executor = DistributedScheduler::wait_for_local_slot(
+                &task,
+                target_executor,
+                server_uris,
+                &running_tasks,
+                executor_slots,
+            )
+            .await;
+            // The job may be over by then, see `run_job_with_listener`.
+            if !event_queues.contains_key(&run_id) {
+                fair_pool.release(run_id);
+                return;
+            }
+            let now = Instant::now();
+            let task_bytes = Arc::new(bincode::serialize(&task).unwrap());
+            let dur = now.elapsed().as_nanos() as f64 * 1e-9;
+            println!("distributed_scheduler serialize task time: {:?} s", dur);
+            if env::Configuration::get().speculation {
+                in_flight.insert(
+                    task.get_task_id(),
+                    InFlightTask {
+                        stage_id: task.get_stage_id(),
+                        task_bytes: task_bytes.clone(),
+                        binary: task.binary(),
+                        executor: target_executor,
+                        launched: Instant::now(),
+                        pinned: task.is_pinned(),
+                        speculated: false,
+                    },
+                );
             }
+            DistributedScheduler::run_on_executor::<T, U, F>(
+                task,
+                task_bytes,
+                target_executor,
+                event_queues,
+                live_listener_bus,
+                running_tasks,
+                in_flight,
+                run_times,
+            )
+            .await;
+            fair_pool.release(run_id);
         });
     }
 
     fn next_executor_server(&self, task: &dyn TaskBase) -> SocketAddrV4 {
-        if !task.is_pinned() {
-            // pick the first available server
-            let socket_addrs = self.server_uris.lock().pop_back().unwrap();
-            self.server_uris.lock().push_front(socket_addrs);
-            socket_addrs
-        } else {
-            // seek and pick the selected host
-            let servers = &mut *self.server_uris.lock();
-            let location: Ipv4Addr = task.preferred_locations()[0];
-            if let Some((pos, _)) = servers
-                .iter()
-                .enumerate()
-                .find(|(_, e)| *e.ip() == location)
+        let locations = task.preferred_locations();
+        let servers = &mut *self.server_uris.lock();
+        // The least loaded executor where the input of the task is cached, or where it has to
+        // run if pinned. Whether it has a free slot is left to `wait_for_local_slot`.
+        if let Some(target_host) =
+            DistributedScheduler::least_loaded(servers, &self.running_tasks, &locations)
+        {
+            return target_host;
+        }
+        if task.is_pinned() {
+            log::warn!(
+                "no executor at the pinned location {:?} of task #{}",
+                locations,
+                task.get_task_id()
+            );
+        }
+        // pick the first available server
+        let socket_addrs = servers.pop_back().unwrap();
+        servers.push_front(socket_addrs);
+        socket_addrs
+    }
+
+    /// The executor on one of `locations` with the fewest running tasks.
+    fn least_loaded(
+        servers: &VecDeque<SocketAddrV4>,
+        running_tasks: &DashMap<SocketAddrV4, usize>,
+        locations: &[Ipv4Addr],
+    ) -> Option<SocketAddrV4> {
+        servers
+            .iter()
+            .filter(|server| locations.contains(server.ip()))
+            .min_by_key(|server| running_tasks.get(*server).map_or(0, |running| *running))
+            .copied()
+    }
+
+    /// Delay scheduling: while the executors that have the input of the task cached are all
+    /// busy, waits up to the locality wait for one of them to free a slot, then gives up on
+    /// locality and takes the least loaded executor. Pinned tasks always stay on `target`.
+    async fn wait_for_local_slot(
+        task: &TaskOption,
+        target: SocketAddrV4,
+        server_uris: Arc<Mutex<VecDeque<SocketAddrV4>>>,
+        running_tasks: &DashMap<SocketAddrV4, usize>,
+        executor_slots: usize,
+    ) -> SocketAddrV4 {
+        let locations = task.preferred_locations();
+        if task.is_pinned() || !locations.contains(target.ip()) {
+            return target;
+        }
+        let is_free = |server: &SocketAddrV4| {
+            running_tasks.get(server).map_or(0, |running| *running) < executor_slots
+        };
+        let deadline =
+            Instant::now() + Duration::from_millis(env::Configuration::get().locality_wait_ms);
+        let mut target = target;
+        loop {
+            if is_free(&target) {
+                return target;
+            }
+            if Instant::now() >= deadline {
+                break;
+            }
+            tokio::time::sleep(Duration::from_millis(10)).await;
+            let servers = server_uris.lock();
+            if let Some(local) =
+                DistributedScheduler::least_loaded(&servers, running_tasks, &locations)
             {
-                let target_host = servers.remove(pos).unwrap();
-                servers.push_front(target_host);
-                target_host
-            } else {
-                unreachable!()
+                target = local;
             }
         }
+        let servers = server_uris.lock();
+        let all = servers.iter().map(|server| *server.ip()).collect::<Vec<_>>();
+        let fallback = DistributedScheduler::least_loaded(&servers, running_tasks, &all)
+            .unwrap_or(target);
+        log::debug!(
+            "task #{} waited for its cached input on {:?}, running on {} instead",
+            task.get_task_id(),
+            locations,
+            fallback
+        );
+        fallback
     }
 
     async fn update_cache_locs(&self) -> Result<()> {
@@ -551,3 +890,25 @@ impl Drop for DistributedScheduler {
         self.live_listener_bus.stop().unwrap();
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn straggler_threshold_after_quantile() {
+        let run_times = [200, 300, 1000].iter().map(|ms| Duration::from_millis(*ms));
+        let run_times = run_times.collect::<Vec<_>>();
+        assert!(DistributedScheduler::straggler_threshold(&[], 4, 1.5, 0.75).is_none());
+        assert!(DistributedScheduler::straggler_threshold(&run_times, 2, 1.5, 0.75).is_none());
+        assert_eq!(
+            DistributedScheduler::straggler_threshold(&run_times, 1, 1.5, 0.75),
+            Some(Duration::from_millis(450))
+        );
+        let short = vec![Duration::from_millis(10); 4];
+        assert_eq!(
+            DistributedScheduler::straggler_threshold(&short, 0, 1.5, 0.75),
+            Some(MIN_SPECULATION_RUN_TIME)
+        );
+    }
+}
@@ -0,0 +1,208 @@
+//! Fair sharing of the executors between the jobs a driver runs at once.
+//!
+//! Jobs submitted from several threads of the driver run side by side, each in the scheduler pool
+//! its thread picked with `Context::set_scheduler_pool`. VEGA_SCHEDULER_POOLS gives the weight of
+//! every pool as `name:weight`, and jobs outside of any pool have weight 1. While more than one
+//! job runs, the driver keeps no more tasks out than the executors have slots, and a freed slot
+//! goes to the job with the fewest running tasks per weight among those with tasks waiting, the
+//! oldest one on a tie. An interactive query of a few short tasks next to a batch job of thousands
+//! launches its tasks right away instead of behind all of the batch job's. The weight goes with
+//! the tasks, and the `StageLock` of an executor lets the stages of heavier jobs into the enclave
+//! first.
+
+use std::cell::RefCell;
+use std::collections::BTreeMap;
+
+use crate::env;
+use parking_lot::Mutex;
+use tokio::sync::Notify;
+
+/// Weight of the jobs outside of any pool.
+pub(crate) const DEFAULT_WEIGHT: usize = 1;
+
+thread_local! {
+    static POOL: RefCell<Option<String>> = RefCell::new(None);
+}
+
+pub(crate) fn set_pool(pool: Option<String>) {
+    POOL.with(|cur| *cur.borrow_mut() = pool);
+}
+
+/// Weight of the jobs this thread submits.
+pub(crate) fn current_weight() -> usize {
+    POOL.with(|pool| match &*pool.borrow() {
+        Some(pool) => pool_weight(&env::Configuration::get().scheduler_pools, pool),
+        None => DEFAULT_WEIGHT,
+    })
+}
+
+fn pool_weight(pools: &str, pool: &str) -> usize {
+    let weight = pools.split(',').find_map(|entry| {
+        let mut fields = entry.trim().splitn(2, ':');
+        match (fields.next(), fields.next()) {
+            (Some(name), Some(weight)) if name == pool => weight.trim().parse::<usize>().ok(),
+            _ => None,
+        }
+    });
+    match weight {
+        Some(weight) => weight.max(1),
+        None => {
+            log::warn!(
+                "no scheduler pool {}, running with weight {}",
+                pool,
+                DEFAULT_WEIGHT
+            );
+            DEFAULT_WEIGHT
+        }
+    }
+}
+
+#[derive(Debug)]
+struct Share {
+    weight: usize,
+    running: usize,
+    waiting: usize,
+}
+
+/// Task slots of the executors, shared by the running jobs.
+#[derive(Debug)]
+pub(crate) struct FairPool {
+    slots: usize,
+    /// By run id, so the oldest job comes first.
+    jobs: Mutex<BTreeMap<usize, Share>>,
+    freed: Notify,
+}
+
+impl Default for FairPool {
+    fn default() -> Self {
+        FairPool::new(1)
+    }
+}
+
+impl FairPool {
+    pub fn new(slots: usize) -> Self {
+        FairPool {
+            slots: slots.max(1),
+            jobs: Mutex::new(BTreeMap::new()),
+            freed: Notify::new(),
+        }
+    }
+
+    /// Adds job `run_id` until the returned share is dropped.
+    pub fn join(&self, run_id: usize, weight: usize) -> JobShare<'_> {
+        self.jobs.lock().insert(
+            run_id,
+            Share {
+                weight,
+                running: 0,
+                waiting: 0,
+            },
+        );
+        JobShare { pool: self, run_id }
+    }
+
+    /// Waits for a slot for a task of job `run_id`, false if the job is over.
+    pub async fn acquire(&self, run_id: usize) -> bool {
+        match self.jobs.lock().get_mut(&run_id) {
+            Some(share) => share.waiting += 1,
+            None => return false,
+        }
+        loop {
+            // Registered before looking, so a slot freed in between is not missed.
+            let freed = self.freed.notified();
+            {
+                let mut jobs = self.jobs.lock();
+                if !jobs.contains_key(&run_id) {
+                    return false;
+                }
+                let running = jobs.values().map(|share| share.running).sum::<usize>();
+                if jobs.len() == 1 || (running < self.slots && Self::next(&jobs) == Some(run_id)) {
+                    let share = jobs.get_mut(&run_id).unwrap();
+                    share.waiting -= 1;
+                    share.running += 1;
+                    if running + 1 < self.slots {
+                        // The slots left may be another job's turn now.
+                        drop(jobs);
+                        self.freed.notify_waiters();
+                    }
+                    return true;
+                }
+            }
+            freed.await;
+        }
+    }
+
+    /// Gives back a slot `acquire` took for job `run_id`.
+    pub fn release(&self, run_id: usize) {
+        if let Some(share) = self.jobs.lock().get_mut(&run_id) {
+            share.running = share.running.saturating_sub(1);
+        }
+        self.freed.notify_waiters();
+    }
+
+    /// The job whose turn the next free slot is: of those with tasks waiting, the one with the
+    /// fewest running tasks per weight.
+    fn next(jobs: &BTreeMap<usize, Share>) -> Option<usize> {
+        jobs.iter()
+            .filter(|(_, share)| share.waiting > 0)
+            .min_by(|(a_id, a), (b_id, b)| {
+                (a.running * b.weight)
+                    .cmp(&(b.running * a.weight))
+                    .then(a_id.cmp(b_id))
+            })
+            .map(|(run_id, _)| *run_id)
+    }
+}
+
+/// A job in the pool, see `FairPool::join`.
+pub(crate) struct JobShare<'a> {
+    pool: &'a FairPool,
+    run_id: usize,
+}
+
+impl Drop for JobShare<'_> {
+    fn drop(&mut self) {
+        self.pool.jobs.lock().remove(&self.run_id);
+        // Its waiting tasks are dropped, and its slots free.
+        self.pool.freed.notify_waiters();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn share(weight: usize, running: usize, waiting: usize) -> Share {
+        Share {
+            weight,
+            running,
+            waiting,
+        }
+    }
+
+    #[test]
+    fn next_by_running_per_weight() {
+        let mut jobs = BTreeMap::new();
+        jobs.insert(0, share(1, 6, 100));
+        jobs.insert(1, share(4, 8, 2));
+        assert_eq!(FairPool::next(&jobs), Some(1));
+        jobs.insert(1, share(4, 24, 2));
+        assert_eq!(FairPool::next(&jobs), Some(0));
+        // Nothing waiting, no turn.
+        jobs.insert(0, share(1, 6, 0));
+        jobs.insert(1, share(4, 24, 0));
+        assert_eq!(FairPool::next(&jobs), None);
+        // The oldest job on a tie.
+        jobs.insert(0, share(1, 2, 1));
+        jobs.insert(1, share(2, 4, 1));
+        assert_eq!(FairPool::next(&jobs), Some(0));
+    }
+
+    #[test]
+    fn weight_of_pool() {
+        assert_eq!(pool_weight("interactive:4, batch:1", "interactive"), 4);
+        assert_eq!(pool_weight("interactive:4, batch:1", "batch"), 1);
+        assert_eq!(pool_weight("interactive:0", "interactive"), 1);
+        assert_eq!(pool_weight("", "interactive"), DEFAULT_WEIGHT);
+    }
+}
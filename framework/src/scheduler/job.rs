@@ -5,7 +5,7 @@ use std::marker::PhantomData;
 use std::option::Option;
 use std::sync::Arc;
 
-use crate::scheduler::{JobListener, NativeScheduler, Stage, TaskBase, TaskContext};
+use crate::scheduler::{fair_pool, JobListener, NativeScheduler, Stage, TaskBase, TaskContext};
 use crate::serializable_traits::{Data, SerFunc};
 use crate::{ItemE, OpId, Rdd, Result};
 use tokio::sync::Mutex;
@@ -63,6 +63,8 @@ where
     pub final_rdd: Arc<dyn Rdd<Item = T>>,
     pub action_id: Option<OpId>,
     pub run_id: usize,
+    /// Weight of the scheduler pool the job was submitted to, see `fair_pool`.
+    pub weight: usize,
     pub waiting: Mutex<BTreeSet<Stage>>,
     pub running: Mutex<BTreeSet<Stage>>,
     pub failed: Mutex<BTreeSet<Stage>>,
@@ -95,11 +97,14 @@ where
         S: NativeScheduler,
     {
         let run_id = scheduler.get_next_job_id();
+        // Still on the thread that submitted the job, see `Env::run_in_async_rt`.
+        let weight = fair_pool::current_weight();
         let final_stage = scheduler
             .new_stage(final_rdd.clone().get_rdd_base(), None)
             .await?;
         Ok(JobTracker::new(
             run_id,
+            weight,
             final_stage,
             func,
             final_rdd,
@@ -111,6 +116,7 @@ where
 
     fn new(
         run_id: usize,
+        weight: usize,
         final_stage: Stage,
         func: Arc<F>,
         final_rdd: Arc<dyn Rdd<Item = T>>,
@@ -128,6 +134,7 @@ where
             final_rdd,
             action_id,
             run_id,
+            weight,
             waiting: Mutex::new(BTreeSet::new()),
             running: Mutex::new(BTreeSet::new()),
             failed: Mutex::new(BTreeSet::new()),
@@ -1,3 +1,7 @@
+use std::marker::PhantomData;
+
+use parking_lot::Mutex;
+
 use crate::serializable_traits::AnyData;
 use crate::{Error, Result};
 
@@ -12,8 +16,73 @@ pub(crate) trait JobListener: Send + Sync {
     async fn job_failed(&self, err: Error) {
         log::debug!("job failed with error: {}", err);
     }
+    /// Whether the results of the tasks before the first one still running are all the job needs,
+    /// so the rest of them need not run.
+    fn is_done(&self) -> bool {
+        false
+    }
 }
 
 /// A listener which produces no action whatsoever.
 pub(super) struct NoOpListener;
 impl JobListener for NoOpListener {}
+
+/// Listener of a take, which is done once the tasks before the first one still running have
+/// produced `num` items, as counted by `count` on their results.
+pub(crate) struct TakeListener<U> {
+    num: usize,
+    count: fn(&U) -> usize,
+    counts: Mutex<Vec<Option<usize>>>,
+    _marker: PhantomData<U>,
+}
+
+impl<U> TakeListener<U> {
+    pub fn new(num: usize, num_partitions: usize, count: fn(&U) -> usize) -> Self {
+        TakeListener {
+            num,
+            count,
+            counts: Mutex::new(vec![None; num_partitions]),
+            _marker: PhantomData,
+        }
+    }
+}
+
+#[async_trait::async_trait]
+impl<U: Send + Sync + 'static> JobListener for TakeListener<U> {
+    async fn task_succeeded(&self, index: usize, result: &dyn AnyData) -> Result<()> {
+        let result = result.as_any().downcast_ref::<U>().ok_or_else(|| {
+            Error::DowncastFailure("failed converting to generic type param @ TakeListener")
+        })?;
+        self.counts.lock()[index] = Some((self.count)(result));
+        Ok(())
+    }
+
+    fn is_done(&self) -> bool {
+        let mut taken = 0;
+        for count in self.counts.lock().iter() {
+            match count {
+                Some(count) => taken += count,
+                None => return false,
+            }
+            if taken >= self.num {
+                return true;
+            }
+        }
+        false
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn take_listener_waits_for_prefix() -> Result<()> {
+        let listener = TakeListener::<Vec<u8>>::new(4, 3, |items| items.len());
+        listener.task_succeeded(1, &vec![0u8; 10]).await?;
+        assert!(!listener.is_done());
+        listener.task_succeeded(0, &vec![0u8; 2]).await?;
+        assert!(listener.is_done());
+        Ok(())
+    }
+}
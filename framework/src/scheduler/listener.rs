@@ -1,11 +1,20 @@
 use std::time::Instant;
 
-pub(super) trait ListenerEvent: Send + Sync {
+use crate::metrics::OpMetrics;
+use downcast_rs::{impl_downcast, DowncastSync};
+
+pub(super) trait ListenerEvent: DowncastSync {
     ///Whether output this event to the event log.
     fn log_event(&self) -> bool {
         true
     }
+
+    /// Whether the bus may drop this event when it cannot keep up, see `LiveListenerBus::post`.
+    fn droppable(&self) -> bool {
+        false
+    }
 }
+impl_downcast!(ListenerEvent);
 
 #[derive(Clone, Copy)]
 pub(super) struct StageInfo {}
@@ -23,3 +32,19 @@ pub(super) struct JobEndListener {
     pub job_result: bool,
 }
 impl ListenerEvent for JobEndListener {}
+
+/// The enclave metrics a finished task brought back, per OpId hash.
+pub(super) struct TaskMetricsListener {
+    pub job_id: usize,
+    pub task_id: usize,
+    pub metrics: OpMetrics,
+}
+impl ListenerEvent for TaskMetricsListener {
+    fn log_event(&self) -> bool {
+        false
+    }
+
+    fn droppable(&self) -> bool {
+        true
+    }
+}
@@ -1,11 +1,24 @@
 use std::sync::{
-    atomic::{AtomicBool, Ordering},
+    atomic::{AtomicBool, AtomicUsize, Ordering},
     Arc,
 };
+use std::thread;
 
-use crate::scheduler::listener::ListenerEvent;
+use std::collections::HashMap;
+
+use crate::metrics::{self, EnclaveMetrics};
+use crate::scheduler::listener::{JobEndListener, ListenerEvent, TaskMetricsListener};
 use crate::{Error, Result};
-use parking_lot::{Mutex, RwLock};
+use crossbeam::channel::{bounded, Receiver, Sender};
+use parking_lot::RwLock;
+
+/// Events the bus holds before the dispatcher takes them.
+const RING_CAPACITY: usize = 8192;
+/// Past this many events in the ring, the droppable ones are dropped, which leaves room for the
+/// job and stage events.
+const DROP_WATERMARK: usize = RING_CAPACITY * 3 / 4;
+/// Events the dispatcher hands to the queues at once.
+const MAX_BATCH: usize = 256;
 
 trait AsyncEventQueue: Send + Sync {
     fn post(&mut self, event: Arc<dyn ListenerEvent>);
@@ -13,20 +26,71 @@ trait AsyncEventQueue: Send + Sync {
     fn stop(&mut self);
 }
 
-type QueueBuffer = Option<Arc<Mutex<Vec<Arc<dyn ListenerEvent>>>>>;
+enum BusMessage {
+    Event(Arc<dyn ListenerEvent>),
+    /// Sent by `stop`, acknowledged once the events before it are delivered.
+    Stop(Sender<()>),
+}
+
+/// Sums the enclave metrics of the tasks of each job per op, and logs them when the job ends.
+#[derive(Default)]
+struct MetricsQueue {
+    jobs: HashMap<usize, (usize, HashMap<u64, EnclaveMetrics>)>,
+}
+
+impl MetricsQueue {
+    fn job_ended(&mut self, job_id: usize) {
+        let (num_tasks, by_op) = match self.jobs.remove(&job_id) {
+            Some(job) => job,
+            None => return,
+        };
+        let mut by_op = by_op.into_iter().collect::<Vec<_>>();
+        by_op.sort_by(|a, b| b.1.ecall_ns.cmp(&a.1.ecall_ns));
+        log::info!("enclave metrics of job {} from {} tasks:", job_id, num_tasks);
+        for (op, m) in by_op {
+            log::info!("  op {}: {}", op, m);
+        }
+    }
+}
+
+impl AsyncEventQueue for MetricsQueue {
+    fn post(&mut self, event: Arc<dyn ListenerEvent>) {
+        if let Some(task) = event.downcast_ref::<TaskMetricsListener>() {
+            let job = self.jobs.entry(task.job_id).or_default();
+            job.0 += 1;
+            metrics::merge_into(&mut job.1, &task.metrics);
+        } else if let Some(job) = event.downcast_ref::<JobEndListener>() {
+            self.job_ended(job.job_id);
+        }
+    }
+
+    fn start(&mut self) {}
+
+    fn stop(&mut self) {
+        let job_ids = self.jobs.keys().copied().collect::<Vec<_>>();
+        for job_id in job_ids {
+            self.job_ended(job_id);
+        }
+    }
+}
 
 /// Asynchronously passes SparkListenerEvents to registered SparkListeners.
 ///
-/// Until `start()` is called, all posted events are only buffered. Only after this listener bus
-/// has started will events be actually propagated to all attached listeners. This listener bus
-/// is stopped when `stop()` is called, and it will drop further events after stopping.
+/// Posted events go into a bounded ring that a dispatcher thread drains in batches, so a post
+/// never runs a listener nor waits for one. Until `start()` is called, the ring only buffers
+/// them. Droppable events, the metrics of every task, are dropped while the ring is nearly full,
+/// the others wait for room. This listener bus is stopped when `stop()` is called, and it will
+/// drop further events after stopping.
 #[derive(Clone)]
 pub(in crate::scheduler) struct LiveListenerBus {
     /// Indicate if `start()` is called
     started: Arc<AtomicBool>,
     /// Indicate if `stop()` is called
     stopped: Arc<AtomicBool>,
-    queued_events: QueueBuffer,
+    sender: Sender<BusMessage>,
+    receiver: Receiver<BusMessage>,
+    /// Droppable events dropped because the ring was nearly full.
+    dropped: Arc<AtomicUsize>,
     queues: Arc<RwLock<Vec<Box<dyn AsyncEventQueue>>>>,
 }
 
@@ -38,11 +102,14 @@ impl Default for LiveListenerBus {
 
 impl LiveListenerBus {
     pub fn new() -> Self {
+        let (sender, receiver) = bounded(RING_CAPACITY);
         LiveListenerBus {
             started: Arc::new(AtomicBool::new(false)),
             stopped: Arc::new(AtomicBool::new(false)),
-            queued_events: Some(Arc::new(Mutex::new(vec![]))),
-            queues: Arc::new(RwLock::new(vec![])),
+            sender,
+            receiver,
+            dropped: Arc::new(AtomicUsize::new(0)),
+            queues: Arc::new(RwLock::new(vec![Box::new(MetricsQueue::default())])),
         }
     }
 
@@ -54,30 +121,52 @@ impl LiveListenerBus {
 
         //TODO: self.metrics.num_events_posted.inc()
 
-        match self.queued_events {
-            None => {
-                // If the event buffer is null, it means the bus has been started and we can avoid
-                // synchronization and post events directly to the queues. This should be the most
-                // common case during the life of the bus.
-                self.post_to_queues(event);
-            }
-            Some(ref queue) => {
-                // Otherwise, need to synchronize to check whether the bus is started, to make sure the thread
-                // calling start() picks up the new event.
-                if !self.started.load(Ordering::SeqCst) {
-                    queue.lock().push(Arc::from(event));
-                } else {
-                    // If the bus was already started when the check above was made, just post directly to the queues.
-                    self.post_to_queues(event);
-                }
-            }
+        if event.droppable() && self.sender.len() >= DROP_WATERMARK {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
         }
+        // Only fails once the dispatcher is gone.
+        let _ = self.sender.send(BusMessage::Event(Arc::from(event)));
     }
 
-    fn post_to_queues(&self, event: Box<dyn ListenerEvent>) {
-        let event: Arc<dyn ListenerEvent> = Arc::from(event);
-        for queue in &mut *self.queues.write() {
-            queue.post(event.clone());
+    /// Delivers the events of the ring to `queues` until a `Stop`, a batch at a time.
+    fn dispatch(
+        receiver: Receiver<BusMessage>,
+        queues: Arc<RwLock<Vec<Box<dyn AsyncEventQueue>>>>,
+    ) {
+        let mut batch = Vec::with_capacity(MAX_BATCH);
+        while let Ok(first) = receiver.recv() {
+            let mut stop = None;
+            let mut next = Some(first);
+            while let Some(message) = next.take() {
+                match message {
+                    BusMessage::Event(event) => batch.push(event),
+                    BusMessage::Stop(ack) => {
+                        stop = Some(ack);
+                        break;
+                    }
+                }
+                if batch.len() < MAX_BATCH {
+                    next = receiver.try_recv().ok();
+                }
+            }
+            {
+                let mut queues = queues.write();
+                for queue in queues.iter_mut() {
+                    for event in &batch {
+                        queue.post(event.clone());
+                    }
+                }
+            }
+            batch.clear();
+            if let Some(ack) = stop {
+                for queue in queues.write().iter_mut() {
+                    queue.stop();
+                }
+                queues.write().clear();
+                let _ = ack.send(());
+                return;
+            }
         }
     }
 
@@ -91,21 +180,15 @@ impl LiveListenerBus {
             return Err(Error::Other);
         }
 
-        let mut queues = self.queues.write();
-        {
-            let queued_events = self
-                .queued_events
-                .as_ref()
-                .ok_or_else(|| /* Cannot be some if it was already started */ Error::Other)?
-                .lock();
-            for queue in queues.iter_mut() {
-                queue.start();
-                queued_events
-                    .iter()
-                    .for_each(|event| queue.post(event.clone()));
-            }
+        for queue in self.queues.write().iter_mut() {
+            queue.start();
         }
-        self.queued_events = None;
+        let receiver = self.receiver.clone();
+        let queues = self.queues.clone();
+        thread::Builder::new()
+            .name("listener-bus".to_owned())
+            .spawn(move || LiveListenerBus::dispatch(receiver, queues))
+            .map_err(|_| Error::Other)?;
         // TODO: metricsSystem.registerSource(metrics)
         Ok(())
     }
@@ -117,15 +200,21 @@ impl LiveListenerBus {
             return Err(Error::Other);
         }
 
-        if !self.stopped.compare_and_swap(false, true, Ordering::SeqCst) {
+        if self.stopped.compare_and_swap(false, true, Ordering::SeqCst) {
             return Ok(());
         }
 
-        let mut queues = self.queues.write();
-        for queue in queues.iter_mut() {
-            queue.stop();
+        let (ack, acked) = bounded(1);
+        if self.sender.send(BusMessage::Stop(ack)).is_ok() {
+            let _ = acked.recv();
+        }
+        let dropped = self.dropped.load(Ordering::Relaxed);
+        if dropped > 0 {
+            log::warn!(
+                "listener bus dropped {} metric events, its ring was nearly full",
+                dropped
+            );
         }
-        queues.clear();
         Ok(())
     }
 }
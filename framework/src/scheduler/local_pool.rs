@@ -0,0 +1,156 @@
+use std::iter;
+use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
+
+use crossbeam::deque::{Injector, Steal, Stealer, Worker};
+use parking_lot::{Condvar, Mutex};
+
+use crate::numa;
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// How long an idle worker sleeps before it looks for tasks to steal again. Tasks queued to a
+/// group wake a worker right away, the ones sitting in the deque of a busy worker do not.
+const IDLE_WAIT: Duration = Duration::from_millis(10);
+
+/// Work-stealing threads the tasks of local mode run on.
+///
+/// The workers are split into one group per enclave and a task is queued to the group of the
+/// enclave its partition is bound to. On a NUMA machine the groups are spread over the nodes,
+/// each allowed to run only on the cpus of its node, so a task runs next to the host buffers the
+/// earlier tasks of its enclave left. An idle worker takes a batch of the tasks queued to its
+/// group into its own deque, then steals from the workers of its group and only then from the
+/// other groups.
+///
+/// There are as many workers as tasks may hold the stage lock at once (see StageLock): the tasks
+/// past them wait in a queue instead of on threads blocked at the enclave.
+pub(crate) struct LocalPool {
+    shared: Arc<Shared>,
+}
+
+struct Shared {
+    /// Tasks queued to each group.
+    queues: Vec<Injector<Job>>,
+    /// The deques of all workers, with the group of each.
+    stealers: Vec<(usize, Stealer<Job>)>,
+    idle: Mutex<()>,
+    wake: Condvar,
+}
+
+impl LocalPool {
+    pub fn new(num_workers: usize, num_groups: usize) -> Self {
+        let num_groups = num_groups.max(1);
+        let num_workers = num_workers.max(num_groups);
+        let deques = (0..num_workers)
+            .map(|_| Worker::new_fifo())
+            .collect::<Vec<_>>();
+        let shared = Arc::new(Shared {
+            queues: (0..num_groups).map(|_| Injector::new()).collect(),
+            stealers: deques
+                .iter()
+                .enumerate()
+                .map(|(i, deque)| (i % num_groups, deque.stealer()))
+                .collect(),
+            idle: Mutex::new(()),
+            wake: Condvar::new(),
+        });
+        for (i, deque) in deques.into_iter().enumerate() {
+            let group = i % num_groups;
+            let shared = shared.clone();
+            let cpus = numa::node_of_enclave(group).map(|node| numa::nodes()[node].to_vec());
+            thread::Builder::new()
+                .name(format!("local-task-{}", i))
+                .spawn(move || {
+                    if let Some(cpus) = cpus {
+                        numa::pin_to(&cpus);
+                    }
+                    shared.work(group, deque)
+                })
+                .unwrap();
+        }
+        LocalPool { shared }
+    }
+
+    /// Queues `f` to the workers of `group`, never blocks the caller.
+    pub fn spawn<F>(&self, group: usize, f: F)
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        let shared = &self.shared;
+        shared.queues[group % shared.queues.len()].push(Box::new(f));
+        let _idle = shared.idle.lock();
+        shared.wake.notify_one();
+    }
+}
+
+impl Shared {
+    fn work(&self, group: usize, deque: Worker<Job>) {
+        loop {
+            match self.find_job(group, &deque) {
+                Some(job) => job(),
+                None => {
+                    let mut idle = self.idle.lock();
+                    if self.queues.iter().all(|queue| queue.is_empty()) {
+                        self.wake.wait_for(&mut idle, IDLE_WAIT);
+                    }
+                }
+            }
+        }
+    }
+
+    fn find_job(&self, group: usize, deque: &Worker<Job>) -> Option<Job> {
+        deque.pop().or_else(|| {
+            iter::repeat_with(|| {
+                self.queues[group]
+                    .steal_batch_and_pop(deque)
+                    .or_else(|| self.steal_from(|g| g == group))
+                    .or_else(|| {
+                        self.queues
+                            .iter()
+                            .enumerate()
+                            .filter(|(g, _)| *g != group)
+                            .map(|(_, queue)| queue.steal_batch_and_pop(deque))
+                            .collect()
+                    })
+                    .or_else(|| self.steal_from(|g| g != group))
+            })
+            .find(|steal| !steal.is_retry())
+            .and_then(Steal::success)
+        })
+    }
+
+    fn steal_from<P: Fn(usize) -> bool>(&self, in_groups: P) -> Steal<Job> {
+        self.stealers
+            .iter()
+            .filter(|(group, _)| in_groups(*group))
+            .map(|(_, stealer)| stealer.steal())
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::mpsc;
+
+    #[test]
+    fn runs_every_group() {
+        let pool = LocalPool::new(4, 2);
+        let count = Arc::new(AtomicUsize::new(0));
+        let (done, finished) = mpsc::channel();
+        for i in 0..64 {
+            let count = count.clone();
+            let done = done.clone();
+            pool.spawn(i, move || {
+                count.fetch_add(1, Ordering::SeqCst);
+                done.send(()).unwrap();
+            });
+        }
+        for _ in 0..64 {
+            finished.recv_timeout(Duration::from_secs(5)).unwrap();
+        }
+        assert_eq!(count.load(Ordering::SeqCst), 64);
+    }
+}
@@ -14,16 +14,27 @@ use crate::map_output_tracker::MapOutputTracker;
 use crate::partial::{ApproximateActionListener, ApproximateEvaluator, PartialResult};
 use crate::rdd::{ItemE, OpId, Rdd, RddBase};
 use crate::scheduler::{
-    listener::{JobEndListener, JobStartListener},
-    CompletionEvent, EventQueue, Job, JobListener, JobTracker, LiveListenerBus, NativeScheduler,
-    NoOpListener, ResultTask, Stage, TaskBase, TaskContext, TaskOption, TaskResult, TastEndReason,
+    listener::{JobEndListener, JobStartListener, TaskMetricsListener},
+    local_pool::LocalPool,
+    with_binary, CompletionEvent, EncodedBinary, EventQueue, Job, JobListener, JobTracker,
+    LiveListenerBus, NativeScheduler, NoOpListener, ResultTask, Stage, TaskBase, TaskContext,
+    TaskOption, TaskResult, TastEndReason,
 };
 use crate::serializable_traits::{AnyData, Data, SerFunc};
 use crate::shuffle::ShuffleMapTask;
+use crate::trace;
+use crate::transitions;
 use crate::{env, Result};
 use dashmap::DashMap;
+use once_cell::sync::Lazy;
 use parking_lot::Mutex;
 
+/// Workers the tasks of local mode run on, one group per enclave.
+static LOCAL_POOL: Lazy<LocalPool> = Lazy::new(|| {
+    let config = env::Configuration::get();
+    LocalPool::new(config.max_stage_holders(), config.enclaves)
+});
+
 #[derive(Clone, Default)]
 pub(crate) struct LocalScheduler {
     max_failures: usize,
@@ -37,6 +48,9 @@ pub(crate) struct LocalScheduler {
     next_stage_id: Arc<AtomicUsize>,
     stage_cache: Arc<DashMap<usize, Stage>>,
     shuffle_to_map_stage: Arc<DashMap<usize, Stage>>,
+    /// Shuffle dependencies an rdd reaches through narrow ones, by rdd id. A lineage never
+    /// changes once built, so the rdds an iteration reuses are walked only once.
+    parent_shuffles: Arc<DashMap<usize, Vec<Arc<dyn ShuffleDependencyTrait>>>>,
     cache_locs: Arc<DashMap<usize, Vec<Vec<Ipv4Addr>>>>,
     master: bool,
     framework_name: String,
@@ -69,6 +83,7 @@ impl LocalScheduler {
             next_stage_id: Arc::new(AtomicUsize::new(0)),
             stage_cache: Arc::new(DashMap::new()),
             shuffle_to_map_stage: Arc::new(DashMap::new()),
+            parent_shuffles: Arc::new(DashMap::new()),
             cache_locs: Arc::new(DashMap::new()),
             master,
             framework_name: "spark".to_string(),
@@ -184,6 +199,43 @@ impl LocalScheduler {
         })
     }
 
+    /// Runs a job whose `listener` may be done before all of its tasks are: the result is then the
+    /// results before the first missing one, and the tasks not launched yet never run.
+    pub fn run_job_with_listener<T: Data, U: Data, F, L>(
+        self: Arc<Self>,
+        func: Arc<F>,
+        final_rdd: Arc<dyn Rdd<Item = T>>,
+        action_id: Option<OpId>,
+        partitions: Vec<usize>,
+        listener: L,
+    ) -> Result<Vec<U>>
+    where
+        F: SerFunc(
+            (
+                TaskContext,
+                (Box<dyn Iterator<Item = T>>, Box<dyn Iterator<Item = ItemE>>),
+            ),
+        ) -> U,
+        L: JobListener + 'static,
+    {
+        let selfc = self.clone();
+        let _lock = selfc.scheduler_lock.lock();
+        env::Env::run_in_async_rt(|| -> Result<Vec<U>> {
+            futures::executor::block_on(async move {
+                let jt = JobTracker::from_scheduler(
+                    &*self,
+                    func,
+                    final_rdd.clone(),
+                    action_id,
+                    partitions,
+                    listener,
+                )
+                .await?;
+                self.event_process_loop(false, jt).await
+            })
+        })
+    }
+
     /// Start the event processing loop for a given job.
     async fn event_process_loop<T: Data, U: Data, F, L>(
         self: Arc<Self>,
@@ -209,6 +261,7 @@ impl LocalScheduler {
         }
 
         self.event_queues.insert(jt.run_id, VecDeque::new());
+        let job_start = trace::now_us();
 
         let mut results: Vec<Option<U>> = (0..jt.num_output_parts).map(|_| None).collect();
         let mut fetch_failure_duration = Duration::new(0, 0);
@@ -226,7 +279,7 @@ impl LocalScheduler {
         );
 
         let mut num_finished = 0;
-        while num_finished != jt.num_output_parts {
+        while num_finished != jt.num_output_parts && !jt.listener.is_done() {
             let event_option = self.wait_for_event(jt.run_id, self.poll_timeout);
             let start = Instant::now();
 
@@ -275,7 +328,18 @@ impl LocalScheduler {
             jt.failed.lock().await.clear();
         }
 
+        // Without its queue the job is over, the tasks of it still waiting are dropped.
         self.event_queues.remove(&jt.run_id);
+        self.live_listener_bus.post(Box::new(JobEndListener {
+            job_id: jt.run_id,
+            time: Instant::now(),
+            job_result: true,
+        }));
+        trace::record(jt.run_id, format!("job #{}", jt.run_id), "scheduler", 0, job_start);
+        trace::finish_job(jt.run_id);
+        if num_finished != jt.num_output_parts {
+            return Ok(results.into_iter().take_while(|s| s.is_some()).flatten().collect());
+        }
         Ok(results
             .into_iter()
             .map(|s| match s {
@@ -287,7 +351,9 @@ impl LocalScheduler {
 
     fn run_task<T: Data, U: Data, F>(
         event_queues: Arc<DashMap<usize, VecDeque<CompletionEvent>>>,
+        live_listener_bus: LiveListenerBus,
         task: Vec<u8>,
+        binary: Option<EncodedBinary>,
         _id_in_job: usize,
         attempt_id: usize,
     ) where
@@ -299,10 +365,26 @@ impl LocalScheduler {
         ) -> U,
     {
         let now = Instant::now();
-        let des_task: TaskOption = bincode::deserialize(&task).unwrap();
+        let des_task: TaskOption = with_binary(binary, || bincode::deserialize(&task)).unwrap();
         let dur = now.elapsed().as_nanos() as f64 * 1e-9;
         println!("local_scheduler deserialize task time: {:?} s", dur);
+        let transitions_before = transitions::snapshot();
+        let task_span = trace::span(format!("task #{}", des_task.get_task_id()), "task");
         let result = des_task.run(attempt_id);
+        drop(task_span);
+        trace::add_local_spans(des_task.get_run_id(), trace::take_pending());
+        log::debug!(
+            "enclave transitions during task #{}: {}",
+            des_task.get_task_id(),
+            transitions::snapshot().since(&transitions_before),
+        );
+        let metrics = crate::metrics::take_pending();
+        crate::metrics::add_to_totals(&metrics);
+        live_listener_bus.post(Box::new(TaskMetricsListener {
+            job_id: des_task.get_run_id(),
+            task_id: des_task.get_task_id(),
+            metrics,
+        }));
         match des_task {
             TaskOption::ResultTask(tsk) => {
                 let result = match result {
@@ -360,7 +442,8 @@ impl LocalScheduler {
 
 #[async_trait::async_trait]
 impl NativeScheduler for LocalScheduler {
-    /// Every single task is run in the local thread pool
+    /// Every single task is run in the local thread pool, by the workers of the enclave of its
+    /// partition.
     fn submit_task<T: Data, U: Data, F>(
         &self,
         task: TaskOption,
@@ -377,13 +460,31 @@ impl NativeScheduler for LocalScheduler {
         log::debug!("inside submit task");
         let my_attempt_id = self.attempt_id.fetch_add(1, Ordering::SeqCst);
         let event_queues = self.event_queues.clone();
+        let live_listener_bus = self.live_listener_bus.clone();
+        let enclave = env::Env::enclave_of(task.get_partition());
+        let run_id = task.get_run_id();
+        let binary = task.binary();
         let now = Instant::now();
         let task = bincode::serialize(&task).unwrap();
         let dur = now.elapsed().as_nanos() as f64 * 1e-9;
         println!("local_scheduler serialize task time: {:?} s", dur);
 
-        tokio::task::spawn_blocking(move || {
-            LocalScheduler::run_task::<T, U, F>(event_queues, task, id_in_job, my_attempt_id)
+        // The workers are not runtime threads, the fetches of a task block on this runtime.
+        let runtime = tokio::runtime::Handle::current();
+        LOCAL_POOL.spawn(enclave, move || {
+            // The job may be over by then, see `run_job_with_listener`.
+            if !event_queues.contains_key(&run_id) {
+                return;
+            }
+            let _runtime = runtime.enter();
+            LocalScheduler::run_task::<T, U, F>(
+                event_queues,
+                live_listener_bus,
+                task,
+                binary,
+                id_in_job,
+                my_attempt_id,
+            )
         });
     }
 
@@ -5,14 +5,18 @@ use crate::serializable_traits::Data;
 mod base_scheduler;
 mod dag_scheduler;
 mod distributed_scheduler;
+pub(crate) mod fair_pool;
 mod job;
 mod job_listener;
 pub(self) mod listener;
 mod live_listener_bus;
+mod local_pool;
 mod local_scheduler;
 mod result_task;
 mod stage;
 mod task;
+mod task_binary;
+mod task_channel;
 
 pub(self) use self::base_scheduler::EventQueue;
 pub(self) use self::dag_scheduler::{CompletionEvent, FetchFailedVals, TastEndReason};
@@ -23,11 +27,16 @@ pub(self) use self::stage::Stage;
 
 pub(crate) use self::base_scheduler::NativeScheduler;
 pub(crate) use self::distributed_scheduler::DistributedScheduler;
-pub(crate) use self::job_listener::JobListener;
+pub(crate) use self::job_listener::{JobListener, TakeListener};
 pub(crate) use self::local_scheduler::LocalScheduler;
-pub(crate) use self::result_task::ResultTask;
+pub(crate) use self::result_task::{ResultBinary, ResultTask};
 pub(crate) use self::task::TaskContext;
 pub(crate) use self::task::{Task, TaskBase, TaskOption, TaskResult};
+pub(crate) use self::task_binary::{with_binary, BinaryMirror, EncodedBinary, StageBinary};
+pub(crate) use self::task_channel::{
+    launch_message, read_frame, result_message, write_frame, Launch, ReceivedFrame,
+    CREDITS_PER_SLOT,
+};
 
 pub trait Scheduler {
     fn start(&self);
@@ -6,13 +6,23 @@ use std::time::Instant;
 
 use crate::dependency::DepInfo;
 use crate::env;
+use crate::numa::TaskOnNode;
 use crate::rdd::{ItemE, OpId, Rdd, STAGE_LOCK};
-use crate::scheduler::{Task, TaskBase, TaskContext};
+use crate::scheduler::{EncodedBinary, StageBinary, Task, TaskBase, TaskContext};
 use crate::serializable_traits::{AnyData, Data};
 use crate::SerBox;
 use serde_derive::{Deserialize, Serialize};
 use serde_traitobject::{Deserialize, Serialize};
 
+/// What the tasks of a result stage have in common, encoded once for all of them.
+#[derive(Serialize, Deserialize)]
+pub(crate) struct ResultBinary<T: Data, F> {
+    #[serde(with = "serde_traitobject")]
+    pub rdd: Arc<dyn Rdd<Item = T>>,
+    pub action_id: Option<OpId>,
+    pub func: Arc<F>,
+}
+
 #[derive(Serialize, Deserialize)]
 pub(crate) struct ResultTask<T: Data, U: Data, F>
 where
@@ -33,13 +43,15 @@ where
     pub run_id: usize,
     pub stage_id: usize,
     pinned: bool,
-    #[serde(with = "serde_traitobject")]
-    pub rdd: Arc<dyn Rdd<Item = T>>,
-    pub action_id: Option<OpId>,
-    pub func: Arc<F>,
+    #[serde(bound(deserialize = "F: serde::de::DeserializeOwned"))]
+    binary: StageBinary<ResultBinary<T, F>>,
     pub partition: usize,
     pub locs: Vec<Ipv4Addr>,
     pub output_id: usize,
+    /// Weight of the scheduler pool of the job, for the `StageLock` of the executor.
+    weight: usize,
+    /// Generation of the map output tracker of the driver when the task was created.
+    generation: i64,
 }
 
 impl<T: Data, U: Data, F> Display for ResultTask<T, U, F>
@@ -82,13 +94,13 @@ where
             task_id: self.task_id,
             run_id: self.run_id,
             stage_id: self.stage_id,
-            pinned: self.rdd.is_pinned(),
-            rdd: self.rdd.clone(),
-            action_id: self.action_id.clone(),
-            func: self.func.clone(),
+            pinned: self.binary.rdd.is_pinned(),
+            binary: self.binary.clone(),
             partition: self.partition,
             locs: self.locs.clone(),
             output_id: self.output_id,
+            weight: self.weight,
+            generation: self.generation,
         }
     }
 }
@@ -112,24 +124,23 @@ where
         task_id: usize,
         run_id: usize,
         stage_id: usize,
-        rdd: Arc<dyn Rdd<Item = T>>,
-        action_id: Option<OpId>,
-        func: Arc<F>,
+        binary: StageBinary<ResultBinary<T, F>>,
         partition: usize,
         locs: Vec<Ipv4Addr>,
         output_id: usize,
+        weight: usize,
     ) -> Self {
         ResultTask {
             task_id,
             run_id,
             stage_id,
-            pinned: rdd.is_pinned(),
-            rdd,
-            action_id,
-            func,
+            pinned: binary.rdd.is_pinned(),
+            binary,
             partition,
             locs,
             output_id,
+            weight,
+            generation: env::Env::get().map_output_tracker.get_generation(),
         }
     }
 }
@@ -157,6 +168,10 @@ where
         self.stage_id
     }
 
+    fn get_partition(&self) -> usize {
+        self.partition
+    }
+
     fn get_task_id(&self) -> usize {
         self.task_id
     }
@@ -170,7 +185,11 @@ where
     }
 
     fn generation(&self) -> Option<i64> {
-        Some(env::Env::get().map_output_tracker.get_generation())
+        Some(self.generation)
+    }
+
+    fn binary(&self) -> Option<EncodedBinary> {
+        Some(self.binary.encoded().clone())
     }
 }
 
@@ -191,33 +210,34 @@ where
 {
     fn run(&self, id: usize) -> SerBox<dyn AnyData> {
         log::debug!("resulttask runs");
-        let rdd_id = self.rdd.get_rdd_id();
-        STAGE_LOCK.insert_stage((rdd_id, rdd_id, 0), self.task_id);
-        STAGE_LOCK.set_num_splits((rdd_id, rdd_id, 0), self.rdd.number_of_splits());
-        let split = self.rdd.splits()[self.partition].clone();
+        let _bound = env::Env::bind_partition(self.partition);
+        let _on_node = TaskOnNode::enter(env::Env::bound_enclave());
+        let rdd = &self.binary.rdd;
+        let rdd_id = rdd.get_rdd_id();
+        env::Env::get().cache_tracker.adopt_lineage(&*rdd.get_rdd_base());
+        STAGE_LOCK.insert_stage((rdd_id, rdd_id, 0), self.task_id, self.weight);
+        STAGE_LOCK.set_num_splits((rdd_id, rdd_id, 0), rdd.number_of_splits());
+        let split = rdd.splits()[self.partition].clone();
         let context = TaskContext::new(self.stage_id, self.partition, id);
 
         let now = Instant::now();
 
-        let res = SerBox::new((self.func)((
+        let res = SerBox::new((self.binary.func)((
             context,
-            match self.rdd.get_secure() {
+            match rdd.get_secure() {
                 true => (Box::new(Vec::new().into_iter()), {
                     STAGE_LOCK.get_stage_lock((rdd_id, rdd_id, 0));
                     let dep_info = DepInfo::padding_new(0);
-                    let res =
-                        match self
-                            .rdd
-                            .secure_iterator(split, dep_info, self.action_id.clone())
-                        {
-                            Ok(r) => r,
-                            Err(_) => Box::new(Vec::new().into_iter()),
-                        };
+                    let action_id = self.binary.action_id.clone();
+                    let res = match rdd.secure_iterator(split, dep_info, action_id) {
+                        Ok(r) => r,
+                        Err(_) => Box::new(Vec::new().into_iter()),
+                    };
                     STAGE_LOCK.free_stage_lock();
                     res
                 }),
                 false => (
-                    match self.rdd.iterator(split.clone()) {
+                    match rdd.iterator(split.clone()) {
                         Ok(r) => r,
                         Err(_) => Box::new(Vec::new().into_iter()),
                     },
@@ -1,10 +1,12 @@
 use std::cmp::Ordering;
 use std::net::Ipv4Addr;
 
+use crate::metrics::OpMetrics;
 use crate::rdd::ItemE;
-use crate::scheduler::ResultTask;
+use crate::scheduler::{EncodedBinary, ResultTask};
 use crate::serializable_traits::{AnyData, Data, SerFunc};
 use crate::shuffle::ShuffleMapTask;
+use crate::trace::TaskTrace;
 use crate::SerBox;
 use downcast_rs::{impl_downcast, Downcast};
 use serde_derive::{Deserialize, Serialize};
@@ -30,6 +32,7 @@ pub trait TaskBase: Downcast + Send + Sync {
     fn get_run_id(&self) -> usize;
     fn get_stage_id(&self) -> usize;
     fn get_task_id(&self) -> usize;
+    fn get_partition(&self) -> usize;
     fn is_pinned(&self) -> bool {
         false
     }
@@ -39,6 +42,11 @@ pub trait TaskBase: Downcast + Send + Sync {
     fn generation(&self) -> Option<i64> {
         None
     }
+    /// The lineage and the closures of the stage of the task, which its serialized form only
+    /// refers to, see `StageBinary`.
+    fn binary(&self) -> Option<EncodedBinary> {
+        None
+    }
 }
 impl_downcast!(TaskBase);
 
@@ -106,6 +114,45 @@ impl From<ShuffleMapTask> for TaskOption {
 pub(crate) enum TaskResult {
     ResultTask(SerBox<dyn AnyData>),
     ShuffleTask(SerBox<dyn AnyData>),
+    /// A result too large to go back over the task channel. The serialized `TaskResult` is held
+    /// by the shuffle server at `server_uri` until the driver fetches it, see
+    /// `ShuffleFetcher::fetch_task_result`.
+    Indirect {
+        server_uri: String,
+        task_id: usize,
+        len: usize,
+    },
+    /// A result with the enclave metrics of its task, see `crate::metrics`, and its spans if
+    /// the job is traced, see `crate::trace`.
+    WithExtras {
+        result: Box<TaskResult>,
+        metrics: OpMetrics,
+        trace: Option<TaskTrace>,
+    },
+}
+
+impl TaskResult {
+    pub fn with_extras(self, metrics: OpMetrics, trace: Option<TaskTrace>) -> Self {
+        if metrics.is_empty() && trace.is_none() {
+            return self;
+        }
+        TaskResult::WithExtras {
+            result: Box::new(self),
+            metrics,
+            trace,
+        }
+    }
+
+    pub fn split_extras(self) -> (Self, OpMetrics, Option<TaskTrace>) {
+        match self {
+            TaskResult::WithExtras {
+                result,
+                metrics,
+                trace,
+            } => (*result, metrics, trace),
+            result => (result, vec![], None),
+        }
+    }
 }
 
 impl TaskOption {
@@ -136,4 +183,39 @@ impl TaskOption {
             TaskOption::ShuffleMapTask(tsk) => tsk.get_stage_id(),
         }
     }
+
+    pub fn get_partition(&self) -> usize {
+        match self {
+            TaskOption::ResultTask(tsk) => tsk.get_partition(),
+            TaskOption::ShuffleMapTask(tsk) => tsk.get_partition(),
+        }
+    }
+
+    pub fn is_pinned(&self) -> bool {
+        match self {
+            TaskOption::ResultTask(tsk) => tsk.is_pinned(),
+            TaskOption::ShuffleMapTask(tsk) => tsk.is_pinned(),
+        }
+    }
+
+    pub fn preferred_locations(&self) -> Vec<Ipv4Addr> {
+        match self {
+            TaskOption::ResultTask(tsk) => tsk.preferred_locations(),
+            TaskOption::ShuffleMapTask(tsk) => tsk.preferred_locations(),
+        }
+    }
+
+    pub fn generation(&self) -> Option<i64> {
+        match self {
+            TaskOption::ResultTask(tsk) => tsk.generation(),
+            TaskOption::ShuffleMapTask(tsk) => tsk.generation(),
+        }
+    }
+
+    pub fn binary(&self) -> Option<EncodedBinary> {
+        match self {
+            TaskOption::ResultTask(tsk) => tsk.binary(),
+            TaskOption::ShuffleMapTask(tsk) => tsk.binary(),
+        }
+    }
 }
@@ -0,0 +1,183 @@
+//! The lineage and the closures of a stage, serialized once for all of its tasks.
+//!
+//! Every task of a stage runs the same rdd graph and the same closures, only its partition and
+//! its attempt differ. A task keeps them in a `StageBinary`, which encodes them once when the
+//! stage is submitted, and a serialized task only carries the key of the binary: the id of the
+//! stage and a hash of the encoded bytes. The bytes go over a task channel with the first task
+//! of the stage only. Both ends of the channel keep the binaries sent over it in a
+//! `BinaryMirror`, which drops the same oldest ones at both ends, so the driver knows which ones
+//! the executor holds. A task is deserialized within `with_binary`, with the bytes of its stage.
+
+use std::cell::RefCell;
+use std::collections::{HashMap, VecDeque};
+use std::hash::{Hash, Hasher};
+use std::ops::Deref;
+use std::sync::Arc;
+
+use fasthash::MetroHasher;
+use serde::de::{DeserializeOwned, Error as _};
+use serde::{Deserialize, Deserializer, Serialize, Serializer};
+
+/// Binaries a task channel holds at most.
+pub(crate) const MAX_STAGE_BINARIES: usize = 64;
+
+/// Id of the stage and hash of the encoded binary.
+pub(crate) type BinaryKey = (usize, u64);
+
+#[derive(Clone, Debug)]
+pub(crate) struct EncodedBinary {
+    pub key: BinaryKey,
+    pub bytes: Arc<Vec<u8>>,
+}
+
+/// The part of the tasks of a stage that is the same for all of them.
+pub(crate) struct StageBinary<B> {
+    value: Arc<B>,
+    encoded: EncodedBinary,
+}
+
+impl<B> Clone for StageBinary<B> {
+    fn clone(&self) -> Self {
+        StageBinary {
+            value: self.value.clone(),
+            encoded: self.encoded.clone(),
+        }
+    }
+}
+
+impl<B: Serialize> StageBinary<B> {
+    pub fn new(stage_id: usize, value: B) -> Self {
+        let bytes = bincode::serialize(&value).unwrap();
+        let mut hasher = MetroHasher::default();
+        bytes.hash(&mut hasher);
+        StageBinary {
+            value: Arc::new(value),
+            encoded: EncodedBinary {
+                key: (stage_id, hasher.finish()),
+                bytes: Arc::new(bytes),
+            },
+        }
+    }
+}
+
+impl<B> StageBinary<B> {
+    pub fn encoded(&self) -> &EncodedBinary {
+        &self.encoded
+    }
+}
+
+impl<B> Deref for StageBinary<B> {
+    type Target = B;
+
+    fn deref(&self) -> &B {
+        &self.value
+    }
+}
+
+thread_local! {
+    //the binary of the task being deserialized on this thread, see with_binary
+    static CURRENT: RefCell<Option<EncodedBinary>> = RefCell::new(None);
+}
+
+/// Runs `f`, which deserializes a task, with the binary of its stage.
+pub(crate) fn with_binary<R>(binary: Option<EncodedBinary>, f: impl FnOnce() -> R) -> R {
+    let prev = CURRENT.with(|current| current.replace(binary));
+    let res = f();
+    CURRENT.with(|current| *current.borrow_mut() = prev);
+    res
+}
+
+impl<B> Serialize for StageBinary<B> {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        self.encoded.key.serialize(serializer)
+    }
+}
+
+impl<'de, B: DeserializeOwned> Deserialize<'de> for StageBinary<B> {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Self, D::Error> {
+        let key = BinaryKey::deserialize(deserializer)?;
+        let encoded = CURRENT
+            .with(|current| current.borrow().clone())
+            .filter(|binary| binary.key == key)
+            .ok_or_else(|| D::Error::custom(format!("no binary of stage #{}", key.0)))?;
+        let value = bincode::deserialize(&encoded.bytes).map_err(D::Error::custom)?;
+        Ok(StageBinary {
+            value: Arc::new(value),
+            encoded,
+        })
+    }
+}
+
+/// The binaries one end of a task channel holds, the last `MAX_STAGE_BINARIES` sent over it.
+pub(crate) struct BinaryMirror<V> {
+    order: VecDeque<BinaryKey>,
+    held: HashMap<BinaryKey, V>,
+}
+
+impl<V> BinaryMirror<V> {
+    pub fn new() -> Self {
+        BinaryMirror {
+            order: VecDeque::new(),
+            held: HashMap::new(),
+        }
+    }
+
+    pub fn get(&self, key: &BinaryKey) -> Option<&V> {
+        self.held.get(key)
+    }
+
+    pub fn insert(&mut self, key: BinaryKey, value: V) {
+        if self.held.insert(key, value).is_some() {
+            return;
+        }
+        self.order.push_back(key);
+        if self.order.len() > MAX_STAGE_BINARIES {
+            let oldest = self.order.pop_front().unwrap();
+            self.held.remove(&oldest);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use serde_derive::{Deserialize, Serialize};
+
+    #[derive(Serialize, Deserialize)]
+    struct Task {
+        partition: usize,
+        binary: StageBinary<Vec<u32>>,
+    }
+
+    #[test]
+    fn tasks_carry_only_the_key() {
+        let binary = StageBinary::new(3, vec![7u32; 1000]);
+        let task = Task {
+            partition: 1,
+            binary: binary.clone(),
+        };
+        let bytes = bincode::serialize(&task).unwrap();
+        assert!(bytes.len() < 32);
+        assert!(bincode::deserialize::<Task>(&bytes).is_err());
+        let task: Task = with_binary(Some(binary.encoded().clone()), || {
+            bincode::deserialize(&bytes).unwrap()
+        });
+        assert_eq!(task.partition, 1);
+        assert_eq!(*task.binary, vec![7u32; 1000]);
+    }
+
+    #[test]
+    fn both_ends_drop_the_oldest() {
+        let mut mirror = BinaryMirror::new();
+        for stage_id in 0..MAX_STAGE_BINARIES {
+            mirror.insert((stage_id, 0), ());
+            // Holding a binary already does not make it any younger.
+            mirror.insert((0, 0), ());
+        }
+        assert!(mirror.get(&(0, 0)).is_some());
+        mirror.insert((MAX_STAGE_BINARIES, 0), ());
+        assert!(mirror.get(&(0, 0)).is_none());
+        assert!(mirror.get(&(1, 0)).is_some());
+        assert!(mirror.get(&(MAX_STAGE_BINARIES, 0)).is_some());
+    }
+}
@@ -0,0 +1,425 @@
+use std::collections::HashMap;
+use std::net::SocketAddrV4;
+use std::sync::{
+    atomic::{AtomicBool, Ordering},
+    Arc,
+};
+use std::time::Duration;
+
+use crate::env;
+use crate::error::{Error, NetworkError, Result};
+use crate::scheduler::task_binary::{BinaryKey, BinaryMirror, EncodedBinary};
+use crate::serialized_data_capnp::{task_frame, task_payload};
+use capnp::message::{Builder as MsgBuilder, HeapAllocator, ReaderOptions};
+use capnp::serialize::OwnedSegments;
+use capnp::struct_list;
+use capnp_futures::serialize as capnp_serialize;
+use dashmap::DashMap;
+use futures::io::{AsyncRead, AsyncWrite, AsyncWriteExt, BufWriter};
+use once_cell::sync::Lazy;
+use parking_lot::Mutex;
+use serde::Serialize;
+use tokio::net::TcpStream;
+use tokio::sync::{mpsc, oneshot, Semaphore};
+use tokio_util::compat::{TokioAsyncReadCompatExt, TokioAsyncWriteCompatExt};
+
+const CAPNP_BUF_READ_OPTS: ReaderOptions = ReaderOptions {
+    traversal_limit_in_words: None,
+    nesting_limit: 64,
+};
+
+/// Tasks in flight on an executor per slot it runs tasks in, the ones past the slots wait on
+/// the executor instead of on a round trip.
+pub(crate) const CREDITS_PER_SLOT: usize = 2;
+/// Tasks in one launch frame at most.
+const MAX_LAUNCH_BATCH: usize = 64;
+/// Broken channels to an executor a task is resent over before the executor is given up on.
+const MAX_RECONNECTS: usize = 3;
+
+/// Task channels of the driver, one per executor.
+pub(crate) static TASK_CHANNELS: Lazy<TaskChannels> = Lazy::new(|| {
+    TaskChannels::new(env::Configuration::get().max_stage_holders() * CREDITS_PER_SLOT)
+});
+
+/// A frame read off a task channel, see `TaskFrame` in serialized_data.capnp.
+///
+/// The payloads stay in the segments of the message, tasks and results are deserialized
+/// straight from them.
+pub(crate) struct ReceivedFrame {
+    message: capnp::message::Reader<OwnedSegments>,
+}
+
+impl From<capnp::message::Reader<OwnedSegments>> for ReceivedFrame {
+    fn from(message: capnp::message::Reader<OwnedSegments>) -> Self {
+        ReceivedFrame { message }
+    }
+}
+
+impl ReceivedFrame {
+    /// Whether it is a launch frame, and its payloads.
+    fn entries(&self) -> Result<(bool, struct_list::Reader<'_, task_payload::Owned>)> {
+        let frame = self.message.get_root::<task_frame::Reader>()?;
+        Ok(match frame.which().map_err(capnp::Error::from)? {
+            task_frame::Launch(entries) => (true, entries?),
+            task_frame::Results(entries) => (false, entries?),
+        })
+    }
+
+    pub fn is_launch(&self) -> Result<bool> {
+        Ok(self.entries()?.0)
+    }
+
+    pub fn len(&self) -> Result<usize> {
+        Ok(self.entries()?.1.len() as usize)
+    }
+
+    /// Sequence number and payload of entry `index`.
+    pub fn payload(&self, index: usize) -> Result<(u64, &[u8])> {
+        let entry = self.entries()?.1.get(index as u32);
+        Ok((entry.get_seq(), entry.get_data()?))
+    }
+
+    /// The key of the binary of the task of entry `index`, and its bytes if they came with it.
+    pub fn binary(&self, index: usize) -> Result<Option<(BinaryKey, Option<&[u8]>)>> {
+        let entry = self.entries()?.1.get(index as u32);
+        if !entry.has_stage_binary() {
+            return Ok(None);
+        }
+        let binary = entry.get_stage_binary()?;
+        let key = (binary.get_stage_id() as usize, binary.get_hash());
+        let bytes = match binary.has_bytes() {
+            true => Some(binary.get_bytes()?),
+            false => None,
+        };
+        Ok(Some((key, bytes)))
+    }
+}
+
+/// One payload of a received frame.
+pub(crate) struct Payload {
+    frame: Arc<ReceivedFrame>,
+    index: usize,
+}
+
+impl Payload {
+    pub fn bytes(&self) -> Result<&[u8]> {
+        Ok(self.frame.payload(self.index)?.1)
+    }
+}
+
+/// A task of a launch frame.
+pub(crate) struct Launch {
+    pub seq: u64,
+    pub task_bytes: Arc<Vec<u8>>,
+    /// The key of the binary of the stage of the task, see `StageBinary`.
+    pub binary: Option<BinaryKey>,
+    /// The bytes of the binary, only if the executor does not hold them yet.
+    pub binary_bytes: Option<Arc<Vec<u8>>>,
+}
+
+/// A launch frame of serialized `TaskOption`s, each copied into the message once.
+pub(crate) fn launch_message(tasks: &[Launch]) -> MsgBuilder<HeapAllocator> {
+    let mut message = MsgBuilder::new_default();
+    let mut entries = message
+        .init_root::<task_frame::Builder>()
+        .init_launch(tasks.len() as u32);
+    for (i, task) in tasks.iter().enumerate() {
+        let mut entry = entries.reborrow().get(i as u32);
+        entry.set_seq(task.seq);
+        entry.set_data(&task.task_bytes);
+        if let Some((stage_id, hash)) = task.binary {
+            let mut binary = entry.init_stage_binary();
+            binary.set_stage_id(stage_id as u64);
+            binary.set_hash(hash);
+            if let Some(bytes) = &task.binary_bytes {
+                binary.set_bytes(bytes);
+            }
+        }
+    }
+    message
+}
+
+/// A results frame of one `TaskResult`, encoded in place in the message.
+pub(crate) fn result_message<T: Serialize>(
+    seq: u64,
+    result: &T,
+) -> Result<MsgBuilder<HeapAllocator>> {
+    let size = bincode::serialized_size(result)?;
+    let mut message = MsgBuilder::new_default();
+    let mut entry = message
+        .init_root::<task_frame::Builder>()
+        .init_results(1)
+        .get(0);
+    entry.set_seq(seq);
+    let mut data: &mut [u8] = entry.init_data(size as u32);
+    bincode::serialize_into(&mut data, result)?;
+    Ok(message)
+}
+
+pub(crate) async fn write_frame<W>(
+    writer: &mut W,
+    message: MsgBuilder<HeapAllocator>,
+) -> Result<()>
+where
+    W: AsyncWrite + Unpin,
+{
+    capnp_serialize::write_message(writer, message)
+        .await
+        .map_err(Error::CapnpDeserialization)
+}
+
+pub(crate) async fn read_frame<R>(reader: &mut R) -> Result<ReceivedFrame>
+where
+    R: AsyncRead + Unpin,
+{
+    let message = capnp_serialize::read_message(reader, CAPNP_BUF_READ_OPTS).await?;
+    Ok(message.into())
+}
+
+pub(crate) struct TaskChannels {
+    channels: DashMap<SocketAddrV4, Arc<TaskChannel>>,
+    credits: usize,
+}
+
+impl TaskChannels {
+    fn new(credits: usize) -> Self {
+        TaskChannels {
+            channels: DashMap::new(),
+            credits,
+        }
+    }
+
+    /// Runs the serialized task on `executor` and returns its serialized result. A broken
+    /// channel is replaced by a new one and the task sent again, with its binary.
+    pub async fn run_task(
+        &self,
+        executor: SocketAddrV4,
+        task_bytes: Arc<Vec<u8>>,
+        binary: Option<EncodedBinary>,
+    ) -> Payload {
+        let mut num_reconnects = 0;
+        loop {
+            let channel = self
+                .channels
+                .entry(executor)
+                .or_insert_with(|| Arc::new(TaskChannel::open(executor, self.credits)))
+                .clone();
+            match channel.submit(task_bytes.clone(), binary.clone()).await {
+                Ok(result) => return result,
+                Err(_) => {
+                    self.channels
+                        .remove_if(&executor, |_, open| Arc::ptr_eq(open, &channel));
+                    num_reconnects += 1;
+                    if num_reconnects > MAX_RECONNECTS {
+                        panic!("lost the task channel to executor @{}", executor.port());
+                    }
+                    tokio::time::sleep(Duration::from_millis(20)).await;
+                }
+            }
+        }
+    }
+}
+
+/// Long-lived connection to an executor that the tasks sent to it are pipelined over.
+///
+/// Queued tasks go out together in one launch frame as long as the executor has credit: it is
+/// granted a fixed number of tasks in flight and each result returns one. The executor sends
+/// results back as tasks finish, in whatever order, matched to their tasks by sequence number.
+/// The binary of a stage goes with the first task of the stage sent over the channel only.
+struct TaskChannel {
+    queue: mpsc::UnboundedSender<QueuedTask>,
+}
+
+/// A task waiting for credit, with the binary of its stage.
+struct QueuedTask {
+    task_bytes: Arc<Vec<u8>>,
+    binary: Option<EncodedBinary>,
+    done: oneshot::Sender<Payload>,
+}
+
+impl TaskChannel {
+    fn open(executor: SocketAddrV4, credits: usize) -> Self {
+        let (queue, queued) = mpsc::unbounded_channel();
+        tokio::spawn(TaskChannel::run(executor, credits, queued));
+        TaskChannel { queue }
+    }
+
+    /// Err if the channel broke before the result came back.
+    async fn submit(
+        &self,
+        task_bytes: Arc<Vec<u8>>,
+        binary: Option<EncodedBinary>,
+    ) -> Result<Payload> {
+        let (done, result) = oneshot::channel();
+        self.queue
+            .send(QueuedTask {
+                task_bytes,
+                binary,
+                done,
+            })
+            .map_err(|_| NetworkError::ConnectionFailure)?;
+        Ok(result.await.map_err(|_| NetworkError::ConnectionFailure)?)
+    }
+
+    async fn connect(executor: SocketAddrV4) -> Option<TcpStream> {
+        let mut num_retries = 0;
+        loop {
+            match TcpStream::connect(&executor).await {
+                Ok(stream) => return Some(stream),
+                Err(_) => {
+                    if num_retries > 5000 {
+                        //100s
+                        log::error!("executor @{} not initialized", executor.port());
+                        return None;
+                    }
+                    tokio::time::sleep(Duration::from_millis(20)).await;
+                    num_retries += 1;
+                }
+            }
+        }
+    }
+
+    /// Sends the queued tasks until the connection breaks. The tasks waiting for a result then,
+    /// and the ones still queued, fail their `submit`.
+    async fn run(
+        executor: SocketAddrV4,
+        credits: usize,
+        mut queued: mpsc::UnboundedReceiver<QueuedTask>,
+    ) {
+        let stream = match TaskChannel::connect(executor).await {
+            Some(stream) => stream,
+            None => return,
+        };
+        // Launch frames are small and latency bound.
+        if let Err(e) = stream.set_nodelay(true) {
+            log::warn!("could not set TCP_NODELAY to executor @{}: {}", executor.port(), e);
+        }
+        let (reader, writer) = stream.into_split();
+        let mut reader = reader.compat();
+        // The segment table and the segments of a launch frame go out in one write.
+        let mut writer = BufWriter::new(writer.compat_write());
+        let pending: Arc<Mutex<HashMap<u64, oneshot::Sender<Payload>>>> =
+            Arc::new(Mutex::new(HashMap::new()));
+        let credit = Arc::new(Semaphore::new(credits));
+        let broken = Arc::new(AtomicBool::new(false));
+
+        let receiving = {
+            let pending = pending.clone();
+            let credit = credit.clone();
+            let broken = broken.clone();
+            tokio::spawn(async move {
+                loop {
+                    let received = read_frame(&mut reader).await.and_then(|frame| {
+                        let frame = Arc::new(frame);
+                        if frame.is_launch()? {
+                            log::warn!("executor @{} sent a launch frame", executor.port());
+                            return Ok(vec![]);
+                        }
+                        (0..frame.len()?)
+                            .map(|index| {
+                                let (seq, _) = frame.payload(index)?;
+                                let frame = frame.clone();
+                                Ok((seq, Payload { frame, index }))
+                            })
+                            .collect::<Result<Vec<_>>>()
+                    });
+                    match received {
+                        Ok(results) => {
+                            log::debug!(
+                                "received {} task results from executor @{}",
+                                results.len(),
+                                executor.port()
+                            );
+                            for (seq, result) in results {
+                                if let Some(done) = pending.lock().remove(&seq) {
+                                    let _ = done.send(result);
+                                }
+                                credit.add_permits(1);
+                            }
+                        }
+                        Err(e) => {
+                            log::warn!(
+                                "task channel to executor @{} broke: {}",
+                                executor.port(),
+                                e
+                            );
+                            break;
+                        }
+                    }
+                }
+                let mut pending = pending.lock();
+                broken.store(true, Ordering::SeqCst);
+                pending.clear();
+                // Wakes the sender up if it waits for credit.
+                credit.close();
+            })
+        };
+
+        let mut next_seq = 0;
+        // The binaries the executor holds, it drops the same ones.
+        let mut sent = BinaryMirror::new();
+        while let Some(first) = queued.recv().await {
+            match credit.acquire().await {
+                Ok(permit) => permit.forget(),
+                Err(_) => break,
+            }
+            let mut batch = vec![first];
+            while batch.len() < MAX_LAUNCH_BATCH {
+                let permit = match credit.try_acquire() {
+                    Ok(permit) => permit,
+                    Err(_) => break,
+                };
+                match queued.try_recv() {
+                    Ok(task) => {
+                        permit.forget();
+                        batch.push(task);
+                    }
+                    Err(_) => break,
+                }
+            }
+            let tasks = {
+                let mut pending = pending.lock();
+                if broken.load(Ordering::SeqCst) {
+                    break;
+                }
+                batch
+                    .into_iter()
+                    .map(|task| {
+                        let QueuedTask {
+                            task_bytes,
+                            binary,
+                            done,
+                        } = task;
+                        let seq = next_seq;
+                        next_seq += 1;
+                        pending.insert(seq, done);
+                        let binary_bytes = binary.as_ref().and_then(|binary| {
+                            if sent.get(&binary.key).is_some() {
+                                return None;
+                            }
+                            sent.insert(binary.key, ());
+                            Some(binary.bytes.clone())
+                        });
+                        Launch {
+                            seq,
+                            task_bytes,
+                            binary: binary.map(|binary| binary.key),
+                            binary_bytes,
+                        }
+                    })
+                    .collect::<Vec<_>>()
+            };
+            log::debug!("launching {} tasks on executor @{}", tasks.len(), executor.port());
+            let written: Result<()> = match write_frame(&mut writer, launch_message(&tasks)).await {
+                Ok(()) => writer.flush().await.map_err(|e| NetworkError::TcpListener(e).into()),
+                Err(e) => Err(e),
+            };
+            if let Err(e) = written {
+                log::warn!("task channel to executor @{} broke: {}", executor.port(), e);
+                break;
+            }
+        }
+        receiving.abort();
+        pending.lock().clear();
+    }
+}
@@ -1,45 +1,14 @@
-use std::any::TypeId;
 use std::mem;
 
-// function clone_in_place is unnecessary in untrusted part
-#[derive(Debug)]
-pub struct SizeBuf {
-    vec_buf: Vec<usize>,  //indicate the length of vector
-    op_buf: Vec<bool>,   //indicate whether Some() or not
-}
-
-impl SizeBuf {
-    pub fn new(len: usize) -> Self {
-        SizeBuf {
-            vec_buf: vec![0; len],
-            op_buf: vec![false; len],
-        }
-    }
-}
-
-#[derive(Debug)]
-pub struct Idx {
-    vec_idx: usize,
-    op_idx: usize,
-}
-
-impl Idx {
-    pub fn new() -> Self {
-        Idx { 
-            vec_idx: 0, 
-            op_idx: 0,
-        }
-    }
-}
-
 pub trait Construct {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx);
-    
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx);
-    //This function should be called at the upper layer
-    fn need_recursive(&self) -> bool;
+    //whether the size of a value is all in mem::size_of::<Self>(), known at compile time,
+    //so a Vec of them is measured with one multiplication and no Default probe
+    const IS_POD: bool;
 
-    fn clone_in_place(&mut self, other: &Self);
+    //This function should be called at the upper layer
+    fn need_recursive(&self) -> bool {
+        !Self::IS_POD
+    }
 
     fn get_size(&self) -> usize;
 
@@ -51,21 +20,7 @@ impl<T> Construct for T
 where
     T: Default + Clone + 'static,
 {
-    default fn send(&self, _buf: &mut SizeBuf, _idx: &mut Idx) {
-        ();
-    }
-    
-    default fn recv(&mut self, _buf: &SizeBuf, _idx: &mut Idx) {
-        ();
-    }
-
-    default fn need_recursive(&self) -> bool {
-        false
-    }
-
-    default fn clone_in_place(&mut self, other: &Self) {
-        self.clone_from(other);
-    }
+    default const IS_POD: bool = true;
 
     default fn get_size(&self) -> usize {
         mem::size_of::<T>()
@@ -81,57 +36,11 @@ impl<T> Construct for Option<T>
 where
     T: Clone + Construct + Default + 'static,
 {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        let probe: T = Default::default();
-        if !probe.need_recursive() {
-            return;
-        }
-        idx.op_idx += 1;
-        match &self {
-            Some(value) => {
-                buf.op_buf[idx.op_idx] = true;
-                value.send(buf, idx);
-            },
-            None => {
-                buf.op_buf[idx.op_idx] = false;
-            },
-        };
-    }
-    
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        if !self.need_recursive() {
-            return;
-        }
-        idx.op_idx += 1;
-        let is_some = buf.op_buf[idx.op_idx];
-        if is_some {
-            let mut value: T = Default::default();
-            value.recv(buf, idx);
-            *self = Some(value);
-        }   
-    }
-
-    fn need_recursive(&self) -> bool {
-        let probe: T = Default::default();
-        return probe.need_recursive() 
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        let probe: T = Default::default();
-        if probe.need_recursive() {
-            match self {
-                Some(value) => value.clone_in_place(other.as_ref().unwrap()),
-                None => (),
-            }
-        } else {
-            self.clone_from(&other);
-        }
-    }
+    const IS_POD: bool = T::IS_POD;
 
     fn get_size(&self) -> usize {
         let size_option = mem::size_of::<Option<T>>();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             match &self {
                 Some(value) => size_option + value.get_size(),
                 None => size_option,
@@ -143,8 +52,7 @@ where
 
     fn get_aprox_size(&self) -> usize {
         let size_option = mem::size_of::<Option<T>>();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             match &self {
                 Some(value) => size_option + value.get_aprox_size(),
                 None => size_option,
@@ -159,34 +67,11 @@ impl<T> Construct for Box<T>
 where 
     T: Clone + Construct + Default + 'static,
 {
-
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        (&**self).send(buf, idx);
-    }
-
-
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        (&mut **self).recv(buf, idx);
-    }
-
-    fn need_recursive(&self) -> bool {
-        let probe: T = Default::default();
-        return probe.need_recursive() 
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        let probe: T = Default::default();
-        if probe.need_recursive() {
-            (**self).clone_in_place(other);
-        } else {
-            self.clone_from(&other);
-        }
-    }
+    const IS_POD: bool = T::IS_POD;
 
     fn get_size(&self) -> usize {
         let size_box = mem::size_of::<Box<T>>();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             size_box + (**self).get_size()
         } else {
             size_box + mem::size_of::<T>()
@@ -195,8 +80,7 @@ where
 
     fn get_aprox_size(&self) -> usize {
         let size_box = mem::size_of::<Box<T>>();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             size_box + (**self).get_aprox_size()
         } else {
             size_box + mem::size_of::<T>()
@@ -210,25 +94,7 @@ where
     K: Clone + Construct + Default + 'static,
     V: Clone + Construct + Default + 'static,
 {
-    
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        self.0.send(buf, idx);
-        self.1.send(buf, idx);
-    }
-    
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        self.0.recv(buf, idx); 
-        self.1.recv(buf, idx);
-    }
-
-    fn need_recursive(&self) -> bool {
-        self.0.need_recursive() || self.1.need_recursive() 
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        self.0.clone_in_place(&other.0);
-        self.1.clone_in_place(&other.1);
-    }
+    const IS_POD: bool = K::IS_POD && V::IS_POD;
 
     fn get_size(&self) -> usize {
         self.0.get_size() + self.1.get_size()
@@ -246,29 +112,7 @@ where
     V: Clone + Construct + Default + 'static,
     W: Clone + Construct + Default + 'static,
 {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        self.0.send(buf, idx);
-        self.1.send(buf, idx);
-        self.2.send(buf, idx);
-    }
-
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        self.0.recv(buf, idx);
-        self.1.recv(buf, idx);
-        self.2.recv(buf, idx);
-    }
-
-    fn need_recursive(&self) -> bool {
-        self.0.need_recursive() || 
-        self.1.need_recursive() ||
-        self.2.need_recursive()
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        self.0.clone_in_place(&other.0);
-        self.1.clone_in_place(&other.1);
-        self.2.clone_in_place(&other.2);
-    }
+    const IS_POD: bool = K::IS_POD && V::IS_POD && W::IS_POD;
 
     fn get_size(&self) -> usize {
         self.0.get_size() + 
@@ -291,33 +135,7 @@ where
     C: Clone + Construct + Default + 'static,
     D: Clone + Construct + Default + 'static,
 {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        self.0.send(buf, idx);
-        self.1.send(buf, idx);
-        self.2.send(buf, idx);
-        self.3.send(buf, idx);
-    }
-
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        self.0.recv(buf, idx);
-        self.1.recv(buf, idx);
-        self.2.recv(buf, idx);
-        self.3.recv(buf, idx);
-    }
-
-    fn need_recursive(&self) -> bool {
-        self.0.need_recursive() || 
-        self.1.need_recursive() ||
-        self.2.need_recursive() ||
-        self.3.need_recursive()
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        self.0.clone_in_place(&other.0);
-        self.1.clone_in_place(&other.1);
-        self.2.clone_in_place(&other.2);
-        self.3.clone_in_place(&other.3);
-    }
+    const IS_POD: bool = A::IS_POD && B::IS_POD && C::IS_POD && D::IS_POD;
 
     fn get_size(&self) -> usize {
         self.0.get_size() + 
@@ -337,48 +155,11 @@ where
 impl<T> Construct for Vec<T> 
 where T: Clone + Construct + Default + 'static
 {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        idx.vec_idx += 1;
-        buf.vec_buf[idx.vec_idx] = self.len();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
-            for i in self.iter() {
-                i.send(buf, idx);
-            }
-        }
-    }
-
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        idx.vec_idx += 1;
-        let len = buf.vec_buf[idx.vec_idx];
-        self.resize_with(len, Default::default);
-        let probe: T = Default::default();
-        if probe.need_recursive() {
-            for i in self.iter_mut() {
-                i.recv(buf, idx);
-            }
-        }
-    }
-
-    fn need_recursive(&self) -> bool {
-        true
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        let probe: T = Default::default();
-        if probe.need_recursive() && TypeId::of::<String>() != TypeId::of::<T>() {
-            for (idx, i) in self.iter_mut().enumerate() {
-                i.clone_in_place(&other[idx]);
-            }
-        } else {
-            self.clone_from(&other);
-        }
-    }
+    const IS_POD: bool = false;
 
     fn get_size(&self) -> usize {
         let size_vec = mem::size_of::<Vec<T>>();
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             let mut acc = 0; 
             for i in self.iter() {
                 acc += i.get_size();
@@ -395,8 +176,7 @@ where T: Clone + Construct + Default + 'static
         if len == 0 {
             return size_vec
         }
-        let probe: T = Default::default();
-        if probe.need_recursive() {
+        if !T::IS_POD {
             size_vec + len * (self[0].get_aprox_size() + self[len-1].get_aprox_size() + self[(len-1)/2].get_aprox_size()) / 3
         } else {
             size_vec + len * mem::size_of::<T>()
@@ -406,24 +186,7 @@ where T: Clone + Construct + Default + 'static
 
 impl Construct for String
 {
-    fn send(&self, buf: &mut SizeBuf, idx: &mut Idx) {
-        idx.vec_idx += 1;
-        buf.vec_buf[idx.vec_idx] = self.len();
-    }
-
-    fn recv(&mut self, buf: &SizeBuf, idx: &mut Idx) {
-        idx.vec_idx += 1;
-        let len = buf.vec_buf[idx.vec_idx];
-        *self = String::with_capacity(len);
-    }
-
-    fn need_recursive(&self) -> bool {
-        true
-    }
-
-    fn clone_in_place(&mut self, other: &Self) {
-        self.clone_from(&other);
-    }
+    const IS_POD: bool = false;
 
     fn get_size(&self) -> usize {
         let size_string = mem::size_of::<String>();
@@ -0,0 +1,247 @@
+use std::slice::ChunksExact;
+
+use crate::rdd::ItemE;
+use crate::shuffle::{Result, ShuffleError};
+
+const WORD: usize = 8;
+
+/// The map output of a secure shuffle, the `Vec<Vec<Vec<ItemE>>>` of its sub-buckets (each a list
+/// of runs, each a list of encrypted blocks), flattened into one buffer:
+///
+/// ```text
+/// header_words: u64 | header: [u64; header_words] | payload
+/// ```
+///
+/// The header lists, depth first, the number of sub-buckets, then for every sub-bucket its number
+/// of runs, for every run its number of blocks and for every block its length. The payload is the
+/// blocks back to back in header order, so a block is a slice of the buffer and reading a frame
+/// allocates nothing. All words are little endian.
+pub(crate) struct EncFrame<'a> {
+    header: &'a [u8],
+    payload: &'a [u8],
+}
+
+/// What the header of a frame lists next: a run of a sub-bucket, or a block of the last run.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub(crate) enum Entry<B> {
+    Run { bucket: usize, num_blocks: usize },
+    Block(B),
+}
+
+/// Walks the words of a header, checking that they describe whole sub-buckets and nothing more.
+pub(crate) struct Layout<'a> {
+    words: ChunksExact<'a, u8>,
+    num_buckets: usize,
+    next_bucket: usize,
+    bucket: usize,
+    runs_left: usize,
+    blocks_left: usize,
+}
+
+fn malformed(msg: &str) -> ShuffleError {
+    ShuffleError::DeserializationError(Box::new(bincode::ErrorKind::Custom(msg.to_string())))
+}
+
+fn put_word(out: &mut Vec<u8>, word: usize) {
+    out.extend_from_slice(&(word as u64).to_le_bytes());
+}
+
+fn read_word(bytes: &[u8]) -> Result<usize> {
+    if bytes.len() < WORD {
+        return Err(malformed("truncated frame"));
+    }
+    let mut word = [0; WORD];
+    word.copy_from_slice(&bytes[..WORD]);
+    Ok(u64::from_le_bytes(word) as usize)
+}
+
+/// Header words and payload bytes of the frame of `buckets`.
+fn frame_sizes(buckets: &[Vec<Vec<ItemE>>]) -> (usize, usize) {
+    let mut words = 1 + buckets.len();
+    let mut payload = 0;
+    for run in buckets.iter().flatten() {
+        words += 1 + run.len();
+        payload += run.iter().map(|block| block.len()).sum::<usize>();
+    }
+    (words, payload)
+}
+
+/// Encodes the sub-buckets of a map output into a frame, allocated once at its exact size.
+pub(crate) fn encode_buckets(buckets: &[Vec<Vec<ItemE>>]) -> Vec<u8> {
+    let (words, payload) = frame_sizes(buckets);
+    let mut out = Vec::with_capacity(WORD * (1 + words) + payload);
+    put_word(&mut out, words);
+    put_word(&mut out, buckets.len());
+    for runs in buckets {
+        put_word(&mut out, runs.len());
+        for run in runs {
+            put_word(&mut out, run.len());
+            for block in run {
+                put_word(&mut out, block.len());
+            }
+        }
+    }
+    for block in buckets.iter().flatten().flatten() {
+        out.extend_from_slice(block);
+    }
+    out
+}
+
+impl<'a> Layout<'a> {
+    pub fn new(header: &'a [u8]) -> Result<Self> {
+        if header.len() % WORD != 0 {
+            return Err(malformed("frame header is not whole words"));
+        }
+        let num_buckets = read_word(header)?;
+        Ok(Layout {
+            words: header[WORD..].chunks_exact(WORD),
+            num_buckets,
+            next_bucket: 0,
+            bucket: 0,
+            runs_left: 0,
+            blocks_left: 0,
+        })
+    }
+
+    pub fn num_buckets(&self) -> usize {
+        self.num_buckets
+    }
+
+    fn next_word(&mut self) -> Result<usize> {
+        match self.words.next() {
+            Some(word) => read_word(word),
+            None => Err(malformed("truncated frame header")),
+        }
+    }
+
+    fn next_entry(&mut self) -> Result<Option<Entry<usize>>> {
+        loop {
+            if self.blocks_left > 0 {
+                self.blocks_left -= 1;
+                return Ok(Some(Entry::Block(self.next_word()?)));
+            }
+            if self.runs_left > 0 {
+                self.runs_left -= 1;
+                self.blocks_left = self.next_word()?;
+                return Ok(Some(Entry::Run {
+                    bucket: self.bucket,
+                    num_blocks: self.blocks_left,
+                }));
+            }
+            if self.next_bucket == self.num_buckets {
+                if self.words.next().is_some() {
+                    return Err(malformed("trailing frame header words"));
+                }
+                return Ok(None);
+            }
+            self.bucket = self.next_bucket;
+            self.next_bucket += 1;
+            self.runs_left = self.next_word()?;
+        }
+    }
+}
+
+impl<'a> Iterator for Layout<'a> {
+    type Item = Result<Entry<usize>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match self.next_entry() {
+            Ok(entry) => entry.map(Ok),
+            Err(e) => {
+                // Nothing past a malformed word is read.
+                self.next_bucket = self.num_buckets;
+                self.runs_left = 0;
+                self.blocks_left = 0;
+                self.words = [].chunks_exact(WORD);
+                Some(Err(e))
+            }
+        }
+    }
+}
+
+impl<'a> EncFrame<'a> {
+    /// Bytes of the header of a frame starting with `prefix`, the first word of the frame.
+    pub fn header_len(prefix: &[u8]) -> Result<usize> {
+        read_word(prefix)?
+            .checked_mul(WORD)
+            .ok_or_else(|| malformed("frame header too long"))
+    }
+
+    /// The frame at the start of `bytes`, and the bytes after it.
+    pub fn parse(bytes: &'a [u8]) -> Result<(Self, &'a [u8])> {
+        let header_len = EncFrame::header_len(bytes)?;
+        let rest = &bytes[WORD..];
+        if rest.len() < header_len {
+            return Err(malformed("truncated frame header"));
+        }
+        let (header, rest) = rest.split_at(header_len);
+        let mut payload_len = 0usize;
+        for entry in Layout::new(header)? {
+            if let Entry::Block(len) = entry? {
+                payload_len = payload_len
+                    .checked_add(len)
+                    .ok_or_else(|| malformed("frame payload too long"))?;
+            }
+        }
+        if rest.len() < payload_len {
+            return Err(malformed("truncated frame payload"));
+        }
+        let (payload, rest) = rest.split_at(payload_len);
+        Ok((EncFrame { header, payload }, rest))
+    }
+
+    pub fn num_buckets(&self) -> usize {
+        read_word(self.header).unwrap_or(0)
+    }
+
+    /// The runs of the frame in order, each followed by views of its blocks.
+    pub fn entries(&self) -> impl Iterator<Item = Entry<&'a [u8]>> + 'a {
+        let mut payload = self.payload;
+        // Checked by parse.
+        Layout::new(self.header)
+            .into_iter()
+            .flatten()
+            .map(|entry| entry.unwrap())
+            .map(move |entry| match entry {
+                Entry::Run { bucket, num_blocks } => Entry::Run { bucket, num_blocks },
+                Entry::Block(len) => {
+                    let (block, rest) = payload.split_at(len);
+                    payload = rest;
+                    Entry::Block(block)
+                }
+            })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn frame_views_blocks() -> Result<()> {
+        let buckets: Vec<Vec<Vec<ItemE>>> =
+            vec![vec![vec![vec![1, 2, 3], vec![]], vec![]], vec![], vec![vec![vec![4; 20]]]];
+        let mut bytes = encode_buckets(&buckets);
+        assert_eq!(bytes.len(), bytes.capacity());
+        bytes.extend_from_slice(&[9, 9]);
+
+        let (frame, rest) = EncFrame::parse(&bytes)?;
+        assert_eq!(rest, &[9, 9]);
+        assert_eq!(frame.num_buckets(), 3);
+        let mut decoded: Vec<Vec<Vec<ItemE>>> = vec![Vec::new(); frame.num_buckets()];
+        let mut last = 0;
+        for entry in frame.entries() {
+            match entry {
+                Entry::Run { bucket, .. } => {
+                    decoded[bucket].push(Vec::new());
+                    last = bucket;
+                }
+                Entry::Block(block) => decoded[last].last_mut().unwrap().push(block.to_vec()),
+            }
+        }
+        assert_eq!(decoded, buckets);
+
+        assert!(EncFrame::parse(&bytes[..bytes.len() - 3]).is_err());
+        Ok(())
+    }
+}
@@ -1,19 +1,34 @@
 use std::result::Result as StdResult;
 
 use crate::SerBox;
+use hyper::client::{Client, HttpConnector};
 use hyper::{Body, Response, StatusCode};
+use once_cell::sync::Lazy;
 use thiserror::Error;
 
+pub(self) mod enc_frame;
 pub(self) mod shuffle_fetcher;
 pub(self) mod shuffle_manager;
 pub(self) mod shuffle_map_task;
+pub(self) mod shuffle_pusher;
+pub(self) mod shuffle_store;
+pub(self) mod transport;
 // re-exports:
+pub(crate) use enc_frame::encode_buckets;
 pub(crate) use shuffle_fetcher::ShuffleFetcher;
 pub(crate) use shuffle_manager::ShuffleManager;
-pub(crate) use shuffle_map_task::ShuffleMapTask;
+pub(crate) use shuffle_map_task::{ShuffleBinary, ShuffleMapTask};
+pub(crate) use shuffle_pusher::ShufflePusher;
+pub(crate) use shuffle_store::{ShuffleEntry, ShuffleStore};
+pub(crate) use transport::TransportKind;
 
 pub(crate) type Result<T> = StdResult<T, ShuffleError>;
 
+/// One HTTP/2 client per executor. Its pool keeps a connection to every shuffle server, which all
+/// fetches and pushes multiplex their requests over.
+static CLIENT: Lazy<Client<HttpConnector, Body>> =
+    Lazy::new(|| Client::builder().http2_only(true).build_http::<Body>());
+
 #[derive(Debug, Error)]
 pub enum ShuffleError {
     #[error("failed to create local shuffle dir after 10 attempts")]
@@ -28,9 +43,15 @@ pub enum ShuffleError {
     #[error("internal server error")]
     InternalError,
 
+    #[error("failed reading or writing spilled shuffle data")]
+    IoError(#[from] std::io::Error),
+
     #[error("shuffle fetcher failed while fetching chunk")]
     FailedFetchOp,
 
+    #[error("shuffle pusher failed while pushing chunk")]
+    FailedPushOp,
+
     #[error("failed to start shuffle server")]
     FailedToStart,
 
@@ -5,11 +5,14 @@ use std::sync::{atomic, atomic::AtomicBool, Arc};
 use crate::env;
 use crate::rdd::ItemE;
 use crate::serializable_traits::Data;
-use crate::shuffle::shuffle_manager::MAX_LEN;
+use crate::shuffle::enc_frame::{EncFrame, Entry, Layout};
+use crate::shuffle::shuffle_manager::{max_len, PARTS_HEADER};
+use crate::shuffle::transport;
 use crate::shuffle::*;
+use crate::trace;
 use futures::future;
-use hyper::body::Bytes;
-use hyper::{client::Client, Uri};
+use hyper::body::{Bytes, HttpBody};
+use hyper::Uri;
 use tokio::sync::Mutex;
 
 /// Parallel shuffle fetcher.
@@ -20,6 +23,10 @@ impl ShuffleFetcher {
         shuffle_id: usize,
         reduce_id: usize,
     ) -> Result<impl Iterator<Item = (K, V)>> {
+        let _span = trace::span(
+            format!("shuffle fetch #{} reduce #{}", shuffle_id, reduce_id),
+            "shuffle",
+        );
         log::debug!("inside fetch function");
         let mut inputs_by_uri = HashMap::new();
         let server_uris = env::Env::get()
@@ -61,9 +68,9 @@ impl ShuffleFetcher {
             let failure = failure.clone();
             // spawn a future for each expected result set
             let task = async move {
-                let client = Client::builder().http2_only(true).build_http::<Body>();
-                let mut lock = server_queue.lock().await;
-                if let Some((server_uri, input_ids)) = lock.pop() {
+                let client = &*CLIENT;
+                let next = server_queue.lock().await.pop();
+                if let Some((server_uri, input_ids)) = next {
                     let server_uri = format!("{}/shuffle/{}", server_uri, shuffle_id);
                     let mut chunk_uri_str = String::with_capacity(server_uri.len() + 12);
                     chunk_uri_str.push_str(&server_uri);
@@ -90,8 +97,8 @@ impl ShuffleFetcher {
                             };
                             if let Ok(bytes) = data_bytes {
                                 let len = bytes.len();
-                                final_bytes.append(&mut bytes.to_vec());
-                                if len < MAX_LEN {
+                                final_bytes.extend_from_slice(&bytes);
+                                if len < max_len() {
                                     break;
                                 }
                             } else {
@@ -110,7 +117,7 @@ impl ShuffleFetcher {
                     Ok::<Box<dyn Iterator<Item = (K, V)> + Send>, _>(Box::new(std::iter::empty()))
                 }
             };
-            tasks.push(tokio::spawn(task));
+            tasks.push(env::Env::run_in_data_rt(|| tokio::spawn(task)));
         }
         log::debug!("total_results fetch results: {}", total_results);
         let task_results = future::join_all(tasks.into_iter()).await;
@@ -150,6 +157,19 @@ impl ShuffleFetcher {
             shuffle_id,
             server_uris
         );
+        if let Some(merger) = ShufflePusher::merger_of(reduce_id) {
+            match ShuffleFetcher::fetch_merged(merger, shuffle_id, reduce_id, server_uris.len())
+                .await
+            {
+                Ok(buckets) => return Ok(buckets.into_iter()),
+                Err(err) => log::warn!(
+                    "merged log of shuffle #{} reduce #{} not available, pulling instead: {}",
+                    shuffle_id,
+                    reduce_id,
+                    err
+                ),
+            }
+        }
         for (index, server_uri) in server_uris.into_iter().enumerate() {
             inputs_by_uri
                 .entry(server_uri)
@@ -177,56 +197,26 @@ impl ShuffleFetcher {
             let failure = failure.clone();
             // spawn a future for each expected result set
             let task = async move {
-                let client = Client::builder().http2_only(true).build_http::<Body>();
-                let mut lock = server_queue.lock().await;
-                if let Some((server_uri, input_ids)) = lock.pop() {
-                    let server_uri = format!("{}/shuffle/{}", server_uri, shuffle_id);
-                    let mut chunk_uri_str = String::with_capacity(server_uri.len() + 12);
-                    chunk_uri_str.push_str(&server_uri);
-                    let mut shuffle_chunks = Vec::new();
-                    for input_id in input_ids.clone() {
-                        if failure.load(atomic::Ordering::Acquire) {
-                            // Abort early since the work failed in an other future
-                            return Err(ShuffleError::Other);
-                        }
-                        log::debug!("inside parallel fetch {}", input_id);
-                        let mut section_id: usize = 0;
-                        let mut final_bytes = Vec::<u8>::new();
-                        while (true) {
-                            let chunk_uri = ShuffleFetcher::make_chunk_uri(
-                                &server_uri,
-                                &mut chunk_uri_str,
-                                input_id,
-                                reduce_id,
-                                section_id,
-                            )?;
-                            let data_bytes = {
-                                let res = client.get(chunk_uri).await?;
-                                hyper::body::to_bytes(res.into_body()).await
-                            };
-                            if let Ok(bytes) = data_bytes {
-                                let len = bytes.len();
-                                final_bytes.append(&mut bytes.to_vec());
-                                if len < MAX_LEN {
-                                    break;
-                                }
-                            } else {
-                                failure.store(true, atomic::Ordering::Release);
-                                return Err(ShuffleError::FailedFetchOp);
-                            }
-                            section_id += 1;
-                        }
-                        let mut deser_data =
-                            bincode::deserialize::<Vec<Vec<Vec<ItemE>>>>(&final_bytes)?;
-                        if shuffle_chunks.is_empty() {
-                            shuffle_chunks = deser_data;
-                        } else {
-                            assert_eq!(shuffle_chunks.len(), deser_data.len());
-                            for (i, chunk) in shuffle_chunks.iter_mut().enumerate() {
-                                chunk.append(&mut deser_data[i]);
-                            }
-                        }
+                let next = server_queue.lock().await.pop();
+                if let Some((server_uri, input_ids)) = next {
+                    if failure.load(atomic::Ordering::Acquire) {
+                        // Abort early since the work failed in an other future
+                        return Err(ShuffleError::Other);
                     }
+                    log::debug!("inside parallel fetch {:?}", input_ids);
+                    // All map outputs of this server come in one batch, one after the other.
+                    // Their blocks are decoded straight out of what the transport reads and
+                    // appended to the sub-buckets as they arrive, so neither the batch nor a
+                    // deserialized copy of it is ever held as a whole.
+                    let mut decoder = BucketsDecoder::new();
+                    let fetched = transport::transport()
+                        .fetch_batch(&server_uri, shuffle_id, reduce_id, &input_ids, &mut decoder)
+                        .await;
+                    if let Err(err) = fetched {
+                        failure.store(true, atomic::Ordering::Release);
+                        return Err(err);
+                    }
+                    let shuffle_chunks = decoder.finish(input_ids.len())?;
                     Ok::<Box<dyn Iterator<Item = Vec<Vec<ItemE>>> + Send>, _>(Box::new(
                         shuffle_chunks.into_iter(),
                     ))
@@ -236,7 +226,7 @@ impl ShuffleFetcher {
                     ))
                 }
             };
-            tasks.push(tokio::spawn(task));
+            tasks.push(env::Env::run_in_data_rt(|| tokio::spawn(task)));
         }
         log::debug!("total_results fetch results: {}", total_results);
         let task_results = future::join_all(tasks.into_iter()).await;
@@ -264,6 +254,48 @@ impl ShuffleFetcher {
         Ok(results.into_iter())
     }
 
+    /// Fetches the log the map tasks pushed for `reduce_id` to its merger, the same sub-buckets
+    /// pulling from all map tasks would give.
+    async fn fetch_merged(
+        merger: &str,
+        shuffle_id: usize,
+        reduce_id: usize,
+        num_inputs: usize,
+    ) -> Result<Vec<Vec<Vec<ItemE>>>> {
+        let uri = format!(
+            "{}/shuffle_merged/{}/{}/{}",
+            merger, shuffle_id, reduce_id, num_inputs
+        );
+        let res = CLIENT.get(Uri::try_from(uri.as_str())?).await?;
+        if res.status() != StatusCode::OK {
+            return Err(ShuffleError::RequestedCacheNotFound);
+        }
+        let num_parts = res
+            .headers()
+            .get(PARTS_HEADER)
+            .and_then(|value| value.to_str().ok())
+            .and_then(|value| value.parse().ok())
+            .ok_or(ShuffleError::FailedFetchOp)?;
+        let mut body = res.into_body();
+        let mut decoder = BucketsDecoder::new();
+        while let Some(frame) = body.data().await {
+            decoder.feed(&frame?)?;
+        }
+        decoder.finish(num_parts)
+    }
+
+    /// Fetches the serialized result task `task_id` left on the shuffle server at `server_uri`.
+    /// Results of the tasks of a job are fetched concurrently, each over the multiplexed
+    /// connection to its executor.
+    pub async fn fetch_task_result(server_uri: &str, task_id: usize) -> Result<Bytes> {
+        let uri = format!("{}/task_result/{}", server_uri, task_id);
+        let res = CLIENT.get(Uri::try_from(uri.as_str())?).await?;
+        if res.status() != StatusCode::OK {
+            return Err(ShuffleError::RequestedCacheNotFound);
+        }
+        Ok(hyper::body::to_bytes(res.into_body()).await?)
+    }
+
     fn make_chunk_uri(
         base: &str,
         chunk: &mut String,
@@ -292,6 +324,160 @@ impl ShuffleFetcher {
     }
 }
 
+/// Decodes map outputs, each an `EncFrame` of its sub-buckets, one after the other and from any
+/// split of the bytes into frames. Runs are appended to the sub-buckets of the outputs decoded
+/// before, so the reduce side gets one list of runs per sub-bucket. With the lengths in the
+/// header, the runs and blocks of an output are allocated up front and its payload is copied
+/// straight into them.
+pub(super) struct BucketsDecoder {
+    buckets: Vec<Vec<Vec<ItemE>>>,
+    /// sub-buckets of the first map output, which the others must match
+    num_buckets: Option<usize>,
+    outputs: usize,
+    state: DecodeState,
+    /// the header of the output being read, after its length prefix
+    header: Vec<u8>,
+    /// sub-bucket, run and length of every block of the output being read, in payload order
+    blocks: Vec<(usize, usize, usize)>,
+    block: ItemE,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum DecodeState {
+    HeaderLen,
+    Header { left: usize },
+    /// the block being read and the bytes left in it
+    Payload { index: usize, left: usize },
+    Done,
+}
+
+/// Length prefixes are not trusted for more than this much of an up front allocation.
+const MAX_PREALLOC: usize = 1 << 20;
+
+impl BucketsDecoder {
+    pub(super) fn new() -> Self {
+        BucketsDecoder {
+            buckets: Vec::new(),
+            num_buckets: None,
+            outputs: 0,
+            state: DecodeState::HeaderLen,
+            header: Vec::new(),
+            blocks: Vec::new(),
+            block: Vec::new(),
+        }
+    }
+
+    fn malformed(msg: &str) -> ShuffleError {
+        ShuffleError::DeserializationError(Box::new(bincode::ErrorKind::Custom(msg.to_string())))
+    }
+
+    pub(super) fn feed(&mut self, mut frame: &[u8]) -> Result<()> {
+        while !frame.is_empty() {
+            match self.state {
+                // the next map output starts
+                DecodeState::Done => {
+                    self.header.clear();
+                    self.state = DecodeState::HeaderLen;
+                }
+                DecodeState::HeaderLen => {
+                    let n = std::cmp::min(8 - self.header.len(), frame.len());
+                    self.header.extend_from_slice(&frame[..n]);
+                    frame = &frame[n..];
+                    if self.header.len() == 8 {
+                        let left = EncFrame::header_len(&self.header)?;
+                        self.header.clear();
+                        self.header.reserve(std::cmp::min(left, MAX_PREALLOC));
+                        self.state = DecodeState::Header { left };
+                    }
+                }
+                DecodeState::Header { left } => {
+                    let n = std::cmp::min(left, frame.len());
+                    self.header.extend_from_slice(&frame[..n]);
+                    frame = &frame[n..];
+                    if n == left {
+                        self.start_payload()?;
+                    } else {
+                        self.state = DecodeState::Header { left: left - n };
+                    }
+                }
+                DecodeState::Payload { index, left } => {
+                    let n = std::cmp::min(left, frame.len());
+                    self.block.extend_from_slice(&frame[..n]);
+                    frame = &frame[n..];
+                    if n == left {
+                        let (bucket, run, _) = self.blocks[index];
+                        self.buckets[bucket][run].push(std::mem::take(&mut self.block));
+                        self.next_block(index + 1);
+                    } else {
+                        self.state = DecodeState::Payload {
+                            index,
+                            left: left - n,
+                        };
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Lays out the runs of the output whose header was just read.
+    fn start_payload(&mut self) -> Result<()> {
+        let layout = Layout::new(&self.header)?;
+        let num_buckets = layout.num_buckets();
+        match self.num_buckets {
+            Some(expected) if expected != num_buckets => {
+                return Err(Self::malformed("map outputs differ in sub-buckets"));
+            }
+            Some(_) => {}
+            None => {
+                self.num_buckets = Some(num_buckets);
+                self.buckets = (0..num_buckets).map(|_| Vec::new()).collect();
+            }
+        }
+        self.blocks.clear();
+        let mut run = (0, 0);
+        for entry in layout {
+            match entry? {
+                Entry::Run { bucket, num_blocks } => {
+                    let runs = &mut self.buckets[bucket];
+                    runs.push(Vec::with_capacity(std::cmp::min(num_blocks, MAX_PREALLOC)));
+                    run = (bucket, runs.len() - 1);
+                }
+                Entry::Block(len) => self.blocks.push((run.0, run.1, len)),
+            }
+        }
+        self.next_block(0);
+        Ok(())
+    }
+
+    /// moves on to block `index` of the output, skipping empty blocks
+    fn next_block(&mut self, mut index: usize) {
+        while let Some(&(bucket, run, len)) = self.blocks.get(index) {
+            if len > 0 {
+                self.block = Vec::with_capacity(std::cmp::min(len, MAX_PREALLOC));
+                self.state = DecodeState::Payload { index, left: len };
+                return;
+            }
+            self.buckets[bucket][run].push(Vec::new());
+            index += 1;
+        }
+        self.outputs += 1;
+        self.state = DecodeState::Done;
+    }
+
+    pub(super) fn finish(self, outputs: usize) -> Result<Vec<Vec<Vec<ItemE>>>> {
+        let complete = match self.state {
+            DecodeState::Done => true,
+            DecodeState::HeaderLen => self.header.is_empty(),
+            _ => false,
+        };
+        if !complete || self.outputs != outputs {
+            return Err(Self::malformed("truncated map outputs"));
+        }
+        Ok(self.buckets)
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -308,7 +494,7 @@ mod tests {
 
             let data = vec![(0i32, "example data".to_string())];
             let serialized_data = bincode::serialize(&data).unwrap();
-            env::SHUFFLE_CACHE.insert((11000, 0, 11001), serialized_data);
+            env::SHUFFLE_STORE.insert((11000, 0, 11001), serialized_data.into());
         }
 
         let result: Vec<(i32, String)> = ShuffleFetcher::fetch(11000, 11001)
@@ -333,7 +519,7 @@ mod tests {
 
             let data = "corrupted data";
             let serialized_data = bincode::serialize(&data).unwrap();
-            env::SHUFFLE_CACHE.insert((10000, 0, 10001), serialized_data);
+            env::SHUFFLE_STORE.insert((10000, 0, 10001), serialized_data.into());
         }
 
         let err = ShuffleFetcher::fetch::<i32, String>(10000, 10001).await;
@@ -357,4 +543,35 @@ mod tests {
 
         Ok(())
     }
+
+    #[test]
+    fn decode_buckets_across_frames() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
+        let first: Vec<Vec<Vec<ItemE>>> = vec![
+            vec![vec![vec![1, 2, 3], vec![]], vec![]],
+            vec![],
+            vec![vec![vec![4; 20]]],
+        ];
+        let second: Vec<Vec<Vec<ItemE>>> =
+            vec![vec![vec![vec![5]]], vec![vec![vec![6], vec![7]]], vec![]];
+        let mut decoder = BucketsDecoder::new();
+        for frame in encode_buckets(&first).chunks(3) {
+            decoder.feed(frame)?;
+        }
+        decoder.feed(&encode_buckets(&second))?;
+        let buckets = decoder.finish(2)?;
+        assert_eq!(
+            buckets,
+            vec![
+                vec![vec![vec![1, 2, 3], vec![]], vec![], vec![vec![5]]],
+                vec![vec![vec![6], vec![7]]],
+                vec![vec![vec![4; 20]]],
+            ]
+        );
+
+        let mut decoder = BucketsDecoder::new();
+        let bytes = encode_buckets(&first);
+        decoder.feed(&bytes[..bytes.len() - 1])?;
+        assert!(decoder.finish(1).is_err());
+        Ok(())
+    }
 }
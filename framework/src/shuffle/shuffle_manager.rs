@@ -10,14 +10,18 @@ use crate::error::StdResult;
 use crate::shuffle::*;
 use crate::utils;
 use crossbeam::channel as cb_channel;
-use futures::future;
+use futures::future::{self, FutureExt};
 use hyper::{
-    client::Client, server::conn::AddrIncoming, service::Service, Body, Request, Response, Server,
-    StatusCode, Uri,
+    body::Bytes, client::Client, server::conn::AddrIncoming, service::Service, Body, Method,
+    Request, Response, Server, StatusCode, Uri,
 };
 use uuid::Uuid;
 
-pub const MAX_LEN: usize = 1 << 30;
+/// Size of the sections a map output is served in, VEGA_SHUFFLE_SECTION_BYTES. Fetchers decode
+/// each section while it streams in, so a few megabytes keep the buffers on both ends small.
+pub fn max_len() -> usize {
+    env::Configuration::get().shuffle_section_bytes
+}
 
 pub(crate) type Result<T> = StdResult<T, ShuffleError>;
 
@@ -36,8 +40,16 @@ impl ShuffleManager {
     pub fn new() -> Result<Self> {
         let shuffle_dir = ShuffleManager::get_shuffle_data_dir()?;
         fs::create_dir_all(&shuffle_dir).map_err(|_| ShuffleError::CouldNotCreateShuffleDir)?;
+        env::SHUFFLE_STORE.set_spill_dir(shuffle_dir.clone());
         let shuffle_port = env::Configuration::get().shuffle_svc_port;
-        let (server_uri, server_port) = ShuffleManager::start_server(shuffle_port)?;
+        // The servers move the map outputs, on the runtime of the data plane.
+        let (server_uri, server_port) = env::Env::run_in_data_rt(|| -> Result<_> {
+            let started = ShuffleManager::start_server(shuffle_port)?;
+            if env::Configuration::get().shuffle_transport == TransportKind::Tcp {
+                transport::start_tcp_server(env::Configuration::get().local_ip)?;
+            }
+            Ok(started)
+        })?;
         let (send_main, rcv_main) = ShuffleManager::init_status_checker(&server_uri)?;
         let manager = ShuffleManager {
             shuffle_dir,
@@ -172,9 +184,16 @@ struct ShuffleService;
 
 enum ShuffleResponse {
     Status(StatusCode),
-    CachedData(Vec<u8>),
+    CachedData(Bytes),
+    /// map outputs served back to back in one response
+    CachedBatch(Vec<ShuffleEntry>),
+    /// the merged log of a reduce partition, in parts pushed by the map tasks
+    Merged(Vec<Bytes>),
 }
 
+/// Header of a merged log response with the number of parts, each one encoded map output.
+pub(super) const PARTS_HEADER: &str = "x-shuffle-parts";
+
 impl ShuffleService {
     fn response_type(&self, uri: &Uri) -> Result<ShuffleResponse> {
         let parts: Vec<_> = uri.path().split('/').collect();
@@ -188,11 +207,78 @@ impl ShuffleService {
                     &[*shuffle_id, *input_id, *reduce_id, *section_id],
                 )?))
             }
+            [_, endpoint, shuffle_id, reduce_id, input_ids] if *endpoint == "shuffle_batch" => Ok(
+                ShuffleResponse::CachedBatch(self.get_cached_batch(
+                    uri,
+                    shuffle_id,
+                    reduce_id,
+                    input_ids,
+                )?),
+            ),
+            [_, endpoint, shuffle_id, reduce_id, num_inputs] if *endpoint == "shuffle_merged" => {
+                // the path is: .../{shuffleid}/{reduceid}/{numinputs}
+                let ids = [shuffle_id, reduce_id, num_inputs]
+                    .iter()
+                    .map(|part| ShuffleService::parse_path_part(part))
+                    .collect::<Result<Vec<_>>>()
+                    .map_err(|_| ShuffleError::UnexpectedUri(format!("{}", uri)))?;
+                env::SHUFFLE_STORE
+                    .merged(ids[0], ids[1], ids[2])
+                    .map(ShuffleResponse::Merged)
+                    .ok_or(ShuffleError::RequestedCacheNotFound)
+            }
+            [_, endpoint] if *endpoint == "shuffle_tcp_port" => transport::tcp_port()
+                .map(|port| ShuffleResponse::CachedData(port.to_string().into()))
+                .ok_or(ShuffleError::RequestedCacheNotFound),
+            [_, endpoint, task_id] if *endpoint == "task_result" => {
+                let task_id = ShuffleService::parse_path_part(task_id)
+                    .map_err(|_| ShuffleError::UnexpectedUri(format!("{}", uri)))?;
+                env::SHUFFLE_STORE
+                    .take_task_result(task_id)
+                    .map(ShuffleResponse::CachedData)
+                    .ok_or(ShuffleError::RequestedCacheNotFound)
+            }
             _ => Err(ShuffleError::UnexpectedUri(uri.path().to_string())),
         }
     }
 
-    fn get_cached_data(&self, uri: &Uri, parts: &[&str]) -> Result<Vec<u8>> {
+    fn get_cached_batch(
+        &self,
+        uri: &Uri,
+        shuffle_id: &str,
+        reduce_id: &str,
+        input_ids: &str,
+    ) -> Result<Vec<ShuffleEntry>> {
+        let (shuffle_id, reduce_id, input_ids) =
+            ShuffleService::parse_batch_path(uri, shuffle_id, reduce_id, input_ids)?;
+        // Every output is looked up before any byte is sent, so a missing one fails the whole
+        // request with a status instead of a cut off body.
+        input_ids
+            .into_iter()
+            .map(|input_id| {
+                env::SHUFFLE_STORE
+                    .get(&(shuffle_id, input_id, reduce_id))
+                    .ok_or(ShuffleError::RequestedCacheNotFound)
+            })
+            .collect()
+    }
+
+    /// the path is: .../{shuffleid}/{reduceid}/{inputid},{inputid},...
+    fn parse_batch_path(
+        uri: &Uri,
+        shuffle_id: &str,
+        reduce_id: &str,
+        input_ids: &str,
+    ) -> Result<(usize, usize, Vec<usize>)> {
+        let parse = |part: &str| {
+            ShuffleService::parse_path_part(part)
+                .map_err(|_| ShuffleError::UnexpectedUri(format!("{}", uri)))
+        };
+        let input_ids = input_ids.split(',').map(parse).collect::<Result<_>>()?;
+        Ok((parse(shuffle_id)?, parse(reduce_id)?, input_ids))
+    }
+
+    fn get_cached_data(&self, uri: &Uri, parts: &[&str]) -> Result<Bytes> {
         // the path is: .../{shuffleid}/{inputid}/{reduceid}/{sectionid}
         let section_id = String::from(parts[3]).parse().unwrap_or(0);
         let parts: Vec<_> = match parts
@@ -206,16 +292,14 @@ impl ShuffleService {
             Ok(parts) => parts,
         };
         let params = &(parts[0], parts[1], parts[2]);
-        if let Some(cached_data) = env::SHUFFLE_CACHE.get(params) {
+        if let Some(cached_data) = env::SHUFFLE_STORE.get(params) {
             log::debug!(
                 "got a request @ `{}`, params: {:?}, returning data",
                 uri,
                 params
             );
-            Ok(Vec::from(
-                &cached_data[MAX_LEN * section_id
-                    ..std::cmp::min(MAX_LEN * section_id + MAX_LEN, cached_data.len())],
-            ))
+            let start = max_len() * section_id;
+            Ok(cached_data.read(start, start + max_len())?)
         } else {
             Err(ShuffleError::RequestedCacheNotFound)
         }
@@ -227,17 +311,94 @@ impl ShuffleService {
     }
 }
 
+impl ShuffleService {
+    /// Sent as `max_len` sections, so flow control paces the transfer. Sections of outputs in
+    /// memory are slices of the cached buffers, spilled ones are read on the disk io threads,
+    /// the whole batch read ahead up front.
+    fn stream_entries(batch: Vec<ShuffleEntry>) -> Body {
+        let (mut sender, body) = Body::channel();
+        tokio::spawn(async move {
+            for cached_data in &batch {
+                cached_data.prefetch();
+            }
+            for cached_data in batch {
+                for start in (0..cached_data.len()).step_by(max_len()) {
+                    let section = cached_data.read_async(start, start + max_len()).await;
+                    let section = match section {
+                        Ok(section) => section,
+                        Err(err) => {
+                            log::error!("failed reading spilled shuffle data: {}", err);
+                            sender.abort();
+                            return;
+                        }
+                    };
+                    if sender.send_data(section).await.is_err() {
+                        // the fetcher went away
+                        return;
+                    }
+                }
+            }
+        });
+        body
+    }
+
+    /// Takes in a part pushed by a map task, or the end of its pushes:
+    /// `/shuffle_push/{shuffleid}/{reduceid}/{inputid}/{seq}` and
+    /// `/shuffle_push_done/{shuffleid}/{reduceid}/{inputid}/{numparts}`.
+    async fn receive_push(req: Request<Body>) -> StdResult<Response<Body>, ShuffleError> {
+        let path = req.uri().path().to_string();
+        let parts: Vec<_> = path.split('/').collect();
+        let ids = match parts.as_slice() {
+            [_, _, ids @ ..] => ids
+                .iter()
+                .map(|id| ShuffleService::parse_path_part(id))
+                .collect::<Result<Vec<_>>>()
+                .map_err(|_| ShuffleError::UnexpectedUri(path.clone())),
+            _ => Err(ShuffleError::UnexpectedUri(path.clone())),
+        };
+        let received = match (parts.get(1), ids.as_deref()) {
+            (Some(&"shuffle_push"), Ok(&[shuffle_id, reduce_id, input_id, seq])) => {
+                match hyper::body::to_bytes(req.into_body()).await {
+                    Ok(part) => {
+                        env::SHUFFLE_STORE.push_part(shuffle_id, input_id, reduce_id, seq, part);
+                        Ok(())
+                    }
+                    Err(err) => Err(err.into()),
+                }
+            }
+            (Some(&"shuffle_push_done"), Ok(&[shuffle_id, reduce_id, input_id, num_parts])) => {
+                if env::SHUFFLE_STORE.finish_pushes(shuffle_id, input_id, reduce_id, num_parts) {
+                    Ok(())
+                } else {
+                    Err(ShuffleError::FailedPushOp)
+                }
+            }
+            _ => Err(ShuffleError::UnexpectedUri(path.clone())),
+        };
+        match received {
+            Ok(()) => Response::builder()
+                .status(200)
+                .body(Body::empty())
+                .map_err(|_| ShuffleError::InternalError),
+            Err(err) => Ok(err.into()),
+        }
+    }
+}
+
 impl Service<Request<Body>> for ShuffleService {
     type Response = Response<Body>;
     type Error = ShuffleError;
-    type Future = future::Ready<StdResult<Self::Response, Self::Error>>;
+    type Future = future::BoxFuture<'static, StdResult<Self::Response, Self::Error>>;
 
     fn poll_ready(&mut self, _cx: &mut Context) -> Poll<StdResult<(), Self::Error>> {
         Ok(()).into()
     }
 
     fn call(&mut self, req: Request<Body>) -> Self::Future {
-        match self.response_type(req.uri()) {
+        if req.method() == Method::POST {
+            return ShuffleService::receive_push(req).boxed();
+        }
+        let rsp = match self.response_type(req.uri()) {
             Ok(response) => match response {
                 ShuffleResponse::Status(code) => {
                     let body = Body::from(&[] as &[u8]);
@@ -247,15 +408,37 @@ impl Service<Request<Body>> for ShuffleService {
                     }
                 }
                 ShuffleResponse::CachedData(cached_data) => {
-                    let body = Body::from(Vec::from(&cached_data[..]));
+                    let body = Body::from(cached_data);
+                    match Response::builder().status(200).body(body) {
+                        Ok(rsp) => future::ok(rsp),
+                        Err(_) => future::err(ShuffleError::InternalError),
+                    }
+                }
+                ShuffleResponse::CachedBatch(batch) => {
+                    let body = ShuffleService::stream_entries(batch);
                     match Response::builder().status(200).body(body) {
                         Ok(rsp) => future::ok(rsp),
                         Err(_) => future::err(ShuffleError::InternalError),
                     }
                 }
+                ShuffleResponse::Merged(parts) => {
+                    let num_parts = parts.len();
+                    let body = ShuffleService::stream_entries(
+                        parts.into_iter().map(ShuffleEntry::Memory).collect(),
+                    );
+                    match Response::builder()
+                        .status(200)
+                        .header(PARTS_HEADER, num_parts)
+                        .body(body)
+                    {
+                        Ok(rsp) => future::ok(rsp),
+                        Err(_) => future::err(ShuffleError::InternalError),
+                    }
+                }
             },
             Err(err) => future::ok(err.into()),
-        }
+        };
+        rsp.boxed()
     }
 }
 
@@ -342,7 +525,7 @@ mod tests {
         let (_, port) = ShuffleManager::start_server(None)?;
         let data = b"some random bytes".iter().copied().collect::<Vec<u8>>();
         {
-            env::SHUFFLE_CACHE.insert((2, 1, 0), data.clone());
+            env::SHUFFLE_STORE.insert((2, 1, 0), data.clone().into());
         }
         let url = format!(
             "http://{}:{}/shuffle/2/1/0",
@@ -356,6 +539,24 @@ mod tests {
         Ok(())
     }
 
+    #[tokio::test]
+    async fn task_result_fetched_once() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
+        let (_, port) = ShuffleManager::start_server(None)?;
+        env::SHUFFLE_STORE.put_task_result(31, b"large result".to_vec().into());
+        let url = format!(
+            "http://{}:{}/task_result/31",
+            env::Configuration::get().local_ip,
+            port
+        );
+        let res = client().get(Uri::try_from(&url)?).await?;
+        assert_eq!(res.status(), StatusCode::OK);
+        let body = hyper::body::to_bytes(res.into_body()).await?;
+        assert_eq!(body.to_vec(), b"large result".to_vec());
+        let res = client().get(Uri::try_from(&url)?).await?;
+        assert_eq!(res.status(), StatusCode::NOT_FOUND);
+        Ok(())
+    }
+
     #[tokio::test]
     async fn cached_data_not_found() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
         let (_, port) = ShuffleManager::start_server(None)?;
@@ -370,6 +571,63 @@ mod tests {
         Ok(())
     }
 
+    #[tokio::test]
+    async fn cached_batch_found() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
+        let (_, port) = ShuffleManager::start_server(None)?;
+        env::SHUFFLE_STORE.insert((3, 0, 1), b"first ".to_vec().into());
+        env::SHUFFLE_STORE.insert((3, 2, 1), b"second".to_vec().into());
+        let url = format!(
+            "http://{}:{}/shuffle_batch/3/1/2,0",
+            env::Configuration::get().local_ip,
+            port
+        );
+        let res = client().get(Uri::try_from(&url)?).await?;
+        assert_eq!(res.status(), StatusCode::OK);
+        let body = hyper::body::to_bytes(res.into_body()).await?;
+        assert_eq!(body.to_vec(), b"secondfirst ".to_vec());
+
+        // one missing output fails the whole batch
+        let url = format!(
+            "http://{}:{}/shuffle_batch/3/1/0,1",
+            env::Configuration::get().local_ip,
+            port
+        );
+        let res = client().get(Uri::try_from(&url)?).await?;
+        assert_eq!(res.status(), StatusCode::NOT_FOUND);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn pushed_parts_merged() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
+        let (_, port) = ShuffleManager::start_server(None)?;
+        let base = format!("http://{}:{}", env::Configuration::get().local_ip, port);
+        let post = |path: String, body: &'static [u8]| {
+            Request::builder()
+                .method(Method::POST)
+                .uri(format!("{}{}", base, path))
+                .body(Body::from(body))
+                .unwrap()
+        };
+        let merged = format!("{}/shuffle_merged/4/0/1", base);
+        let res = client().request(post("/shuffle_push/4/0/0/1".into(), b"second")).await?;
+        assert_eq!(res.status(), StatusCode::OK);
+        let res = client().get(Uri::try_from(&merged)?).await?;
+        assert_eq!(res.status(), StatusCode::NOT_FOUND);
+        // part 0 is missing
+        let res = client().request(post("/shuffle_push_done/4/0/0/2".into(), b"")).await?;
+        assert_eq!(res.status(), StatusCode::INTERNAL_SERVER_ERROR);
+
+        client().request(post("/shuffle_push/4/0/0/0".into(), b"first ")).await?;
+        let res = client().request(post("/shuffle_push_done/4/0/0/2".into(), b"")).await?;
+        assert_eq!(res.status(), StatusCode::OK);
+        let res = client().get(Uri::try_from(&merged)?).await?;
+        assert_eq!(res.status(), StatusCode::OK);
+        assert_eq!(res.headers()[PARTS_HEADER], "2");
+        let body = hyper::body::to_bytes(res.into_body()).await?;
+        assert_eq!(body.to_vec(), b"first second".to_vec());
+        Ok(())
+    }
+
     #[tokio::test]
     async fn not_valid_endpoint() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
         use std::iter::FromIterator;
@@ -4,22 +4,33 @@ use std::sync::Arc;
 
 use crate::dependency::ShuffleDependencyTrait;
 use crate::env;
+use crate::numa::TaskOnNode;
 use crate::rdd::{RddBase, STAGE_LOCK};
-use crate::scheduler::{Task, TaskBase};
+use crate::scheduler::{EncodedBinary, StageBinary, Task, TaskBase};
 use crate::serializable_traits::AnyData;
 use crate::shuffle::*;
 use serde_derive::{Deserialize, Serialize};
 
+/// What the tasks of a shuffle map stage have in common, encoded once for all of them.
+#[derive(Serialize, Deserialize)]
+pub(crate) struct ShuffleBinary {
+    #[serde(with = "serde_traitobject")]
+    pub dep: Arc<dyn ShuffleDependencyTrait>,
+}
+
 #[derive(Serialize, Deserialize, Clone)]
 pub(crate) struct ShuffleMapTask {
     pub task_id: usize,
     pub run_id: usize,
     pub stage_id: usize,
     pinned: bool,
-    #[serde(with = "serde_traitobject")]
-    pub dep: Arc<dyn ShuffleDependencyTrait>,
+    pub binary: StageBinary<ShuffleBinary>,
     pub partition: usize,
     pub locs: Vec<Ipv4Addr>,
+    /// Weight of the scheduler pool of the job, for the `StageLock` of the executor.
+    weight: usize,
+    /// Generation of the map output tracker of the driver when the task was created.
+    generation: i64,
 }
 
 impl ShuffleMapTask {
@@ -27,18 +38,21 @@ impl ShuffleMapTask {
         task_id: usize,
         run_id: usize,
         stage_id: usize,
-        dep: Arc<dyn ShuffleDependencyTrait>,
+        binary: StageBinary<ShuffleBinary>,
         partition: usize,
         locs: Vec<Ipv4Addr>,
+        weight: usize,
     ) -> Self {
         ShuffleMapTask {
             task_id,
             run_id,
             stage_id,
-            pinned: dep.get_rdd_base().is_pinned(),
-            dep,
+            pinned: binary.dep.get_rdd_base().is_pinned(),
+            binary,
             partition,
             locs,
+            weight,
+            generation: env::Env::get().map_output_tracker.get_generation(),
         }
     }
 }
@@ -66,6 +80,10 @@ impl TaskBase for ShuffleMapTask {
         self.task_id
     }
 
+    fn get_partition(&self) -> usize {
+        self.partition
+    }
+
     fn is_pinned(&self) -> bool {
         self.pinned
     }
@@ -75,18 +93,26 @@ impl TaskBase for ShuffleMapTask {
     }
 
     fn generation(&self) -> Option<i64> {
-        Some(env::Env::get().map_output_tracker.get_generation())
+        Some(self.generation)
+    }
+
+    fn binary(&self) -> Option<EncodedBinary> {
+        Some(self.binary.encoded().clone())
     }
 }
 
 impl Task for ShuffleMapTask {
     fn run(&self, _id: usize) -> SerBox<dyn AnyData> {
-        let dep_info = self.dep.get_dep_info();
-        let rdd_base = self.dep.get_rdd_base();
+        let _bound = env::Env::bind_partition(self.partition);
+        let _on_node = TaskOnNode::enter(env::Env::bound_enclave());
+        let dep = &self.binary.dep;
+        let dep_info = dep.get_dep_info();
+        let rdd_base = dep.get_rdd_base();
+        env::Env::get().cache_tracker.adopt_lineage(&*rdd_base);
         let rdd_id_pair = (dep_info.child_rdd_id, dep_info.parent_rdd_id, dep_info.identifier);
-        STAGE_LOCK.insert_stage(rdd_id_pair, self.task_id);
+        STAGE_LOCK.insert_stage(rdd_id_pair, self.task_id, self.weight);
         STAGE_LOCK.set_num_splits(rdd_id_pair, rdd_base.number_of_splits());
-        let res = SerBox::new(self.dep.do_shuffle_task(rdd_base, self.partition))
+        let res = SerBox::new(dep.do_shuffle_task(rdd_base, self.partition, self.task_id))
             as SerBox<dyn AnyData>;
         STAGE_LOCK.remove_stage(rdd_id_pair, self.task_id);
         res
@@ -0,0 +1,103 @@
+use std::convert::TryFrom;
+
+use crate::env;
+use crate::hosts::Hosts;
+use crate::shuffle::*;
+use hyper::{Method, Request, Uri};
+use once_cell::sync::Lazy;
+
+/// Shuffle servers the map tasks push their outputs to, reduce partition i is merged at
+/// `MERGERS[i % MERGERS.len()]`. Empty unless push-based shuffle is enabled.
+///
+/// Map tasks run before any reduce task is placed, so the mergers cannot be the executors that
+/// will reduce. They are the shuffle servers of all executors, which in distributed mode listen on
+/// the configured shuffle port of every slave.
+static MERGERS: Lazy<Vec<String>> = Lazy::new(|| {
+    let conf = env::Configuration::get();
+    if !conf.shuffle_push {
+        return Vec::new();
+    }
+    if conf.deployment_mode.is_local() {
+        return vec![env::Env::get().shuffle_manager.get_server_uri()];
+    }
+    let port = match conf.shuffle_svc_port {
+        Some(port) => port,
+        None => {
+            log::warn!("push-based shuffle needs a fixed shuffle service port, pulling instead");
+            return Vec::new();
+        }
+    };
+    Hosts::get()
+        .map(|hosts| {
+            hosts
+                .slaves
+                .iter()
+                .filter_map(|address| address.split('@').nth(1))
+                .map(|ip| format!("http://{}:{}", ip, port))
+                .collect()
+        })
+        .unwrap_or_default()
+});
+
+/// Streams map outputs to the mergers while the map task is still running.
+///
+/// A merger keeps one append log per reduce partition and only serves the parts of map tasks that
+/// were finished, so a retried map task never shows up twice. The map outputs are still stored
+/// locally as well, a reducer whose merged log is incomplete pulls them as before.
+pub(crate) struct ShufflePusher;
+
+impl ShufflePusher {
+    pub fn merger_of(reduce_id: usize) -> Option<&'static str> {
+        if MERGERS.is_empty() {
+            None
+        } else {
+            Some(MERGERS[reduce_id % MERGERS.len()].as_str())
+        }
+    }
+
+    /// Sends `data`, part `seq` of the output of map task `input_id` for reducer `reduce_id`, to
+    /// the merger of the reducer.
+    pub async fn push(
+        shuffle_id: usize,
+        input_id: usize,
+        reduce_id: usize,
+        seq: usize,
+        data: Vec<u8>,
+    ) -> Result<()> {
+        let merger = ShufflePusher::merger_of(reduce_id).ok_or(ShuffleError::Other)?;
+        let uri = format!(
+            "{}/shuffle_push/{}/{}/{}/{}",
+            merger, shuffle_id, reduce_id, input_id, seq
+        );
+        ShufflePusher::post(&uri, data.into()).await
+    }
+
+    /// Marks the output of map task `input_id` for reducer `reduce_id` as complete after
+    /// `num_parts` parts, which become visible to the reducer.
+    pub async fn finish(
+        shuffle_id: usize,
+        input_id: usize,
+        reduce_id: usize,
+        num_parts: usize,
+    ) -> Result<()> {
+        let merger = ShufflePusher::merger_of(reduce_id).ok_or(ShuffleError::Other)?;
+        let uri = format!(
+            "{}/shuffle_push_done/{}/{}/{}/{}",
+            merger, shuffle_id, reduce_id, input_id, num_parts
+        );
+        ShufflePusher::post(&uri, Body::empty()).await
+    }
+
+    async fn post(uri: &str, body: Body) -> Result<()> {
+        let req = Request::builder()
+            .method(Method::POST)
+            .uri(Uri::try_from(uri)?)
+            .body(body)
+            .map_err(|_| ShuffleError::InternalError)?;
+        let res = CLIENT.request(req).await?;
+        if res.status() != StatusCode::OK {
+            return Err(ShuffleError::FailedPushOp);
+        }
+        Ok(())
+    }
+}
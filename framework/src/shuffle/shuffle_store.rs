@@ -0,0 +1,371 @@
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Write};
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+use std::sync::{
+    atomic::{AtomicUsize, Ordering},
+    Arc, Mutex,
+};
+
+use crate::io::{advise_will_need, DISK_IO};
+use crate::shuffle::*;
+use dashmap::DashMap;
+use hyper::body::Bytes;
+
+/// Map outputs of the shuffles this executor ran, kept in memory while they fit in the budget.
+///
+/// A map task stores the outputs for all reducers at once. Once they would push the memory held
+/// over the budget, they go into one file per map task instead, the outputs back to back in
+/// reducer order, and only the offset table of the file stays in memory. Reducers are served
+/// from either with the same `ShuffleEntry`.
+///
+/// On a merger of push-based shuffle it also holds the merged logs of the reduce partitions.
+pub(crate) struct ShuffleStore {
+    /// {shuffle_id}/{input_id}/{reduce_id}
+    in_memory: DashMap<(usize, usize, usize), Bytes>,
+    /// {shuffle_id}/{input_id}
+    spilled: DashMap<(usize, usize), Arc<SpilledOutput>>,
+    mem_bytes: AtomicUsize,
+    /// `None` never spills.
+    budget: Option<usize>,
+    spill_dir: Mutex<Option<PathBuf>>,
+    /// {shuffle_id}/{reduce_id}
+    merged: DashMap<(usize, usize), MergedLog>,
+    /// Serialized results of result tasks too large to send the driver directly, by task_id.
+    task_results: DashMap<usize, Bytes>,
+}
+
+/// Map output parts pushed for one reduce partition.
+#[derive(Default)]
+struct MergedLog {
+    /// parts of the finished map tasks, in the order they finished
+    parts: Vec<Bytes>,
+    finished: HashSet<usize>,
+    /// parts of the map tasks still running, by input_id and then by their sequence number
+    pending: HashMap<usize, BTreeMap<usize, Bytes>>,
+}
+
+/// The file of a spilled map task, the output for reduce_id is at
+/// `offsets[reduce_id]..offsets[reduce_id + 1]`.
+pub(crate) struct SpilledOutput {
+    file: Arc<File>,
+    offsets: Vec<u64>,
+}
+
+/// One map output for one reducer.
+#[derive(Clone)]
+pub(crate) enum ShuffleEntry {
+    Memory(Bytes),
+    Spilled {
+        output: Arc<SpilledOutput>,
+        reduce_id: usize,
+    },
+}
+
+impl ShuffleEntry {
+    pub fn len(&self) -> usize {
+        match self {
+            ShuffleEntry::Memory(data) => data.len(),
+            ShuffleEntry::Spilled { output, reduce_id } => {
+                (output.offsets[reduce_id + 1] - output.offsets[*reduce_id]) as usize
+            }
+        }
+    }
+
+    /// Whether `read` goes to disk, and so should not run on the async executor.
+    pub fn is_spilled(&self) -> bool {
+        matches!(self, ShuffleEntry::Spilled { .. })
+    }
+
+    /// The spill file of a spilled output and where the output starts in it, for transports that
+    /// send it from the file, see `transport`.
+    pub fn spilled_at(&self) -> Option<(Arc<File>, u64)> {
+        match self {
+            ShuffleEntry::Memory(_) => None,
+            ShuffleEntry::Spilled { output, reduce_id } => {
+                Some((output.file.clone(), output.offsets[*reduce_id]))
+            }
+        }
+    }
+
+    /// Starts reading a spilled output into the page cache, so its later reads find it there.
+    pub fn prefetch(&self) {
+        if let ShuffleEntry::Spilled { output, reduce_id } = self {
+            advise_will_need(&output.file, output.offsets[*reduce_id], self.len());
+        }
+    }
+
+    /// `read` that waits for spilled outputs on the disk io threads rather than blocking.
+    pub async fn read_async(&self, start: usize, end: usize) -> io::Result<Bytes> {
+        let end = std::cmp::min(end, self.len());
+        let start = std::cmp::min(start, end);
+        match self {
+            ShuffleEntry::Memory(data) => Ok(data.slice(start..end)),
+            ShuffleEntry::Spilled { output, reduce_id } => {
+                let offset = output.offsets[*reduce_id] + start as u64;
+                Ok(DISK_IO.read_at(output.file.clone(), offset, end - start).await?.into())
+            }
+        }
+    }
+
+    /// The bytes `start..end` of the output, clamped to its length. Outputs in memory are sliced
+    /// without a copy, spilled ones are read at their offset in the file.
+    pub fn read(&self, start: usize, end: usize) -> io::Result<Bytes> {
+        let end = std::cmp::min(end, self.len());
+        let start = std::cmp::min(start, end);
+        match self {
+            ShuffleEntry::Memory(data) => Ok(data.slice(start..end)),
+            ShuffleEntry::Spilled { output, reduce_id } => {
+                let mut buf = vec![0; end - start];
+                output
+                    .file
+                    .read_exact_at(&mut buf, output.offsets[*reduce_id] + start as u64)?;
+                Ok(buf.into())
+            }
+        }
+    }
+}
+
+impl ShuffleStore {
+    pub fn new(budget: Option<usize>) -> Self {
+        ShuffleStore {
+            in_memory: DashMap::new(),
+            spilled: DashMap::new(),
+            mem_bytes: AtomicUsize::new(0),
+            budget,
+            spill_dir: Mutex::new(None),
+            merged: DashMap::new(),
+            task_results: DashMap::new(),
+        }
+    }
+
+    /// Directory the spill files go to, the shuffle manager sets its own.
+    pub fn set_spill_dir(&self, dir: PathBuf) {
+        *self.spill_dir.lock().unwrap() = Some(dir);
+    }
+
+    /// Bytes of map outputs held in memory.
+    pub fn mem_bytes(&self) -> usize {
+        self.mem_bytes.load(Ordering::Relaxed)
+    }
+
+    /// Stores the outputs of map task `input_id`, the one for reducer i at index i.
+    pub fn put_map_output(
+        &self,
+        shuffle_id: usize,
+        input_id: usize,
+        outputs: Vec<Vec<u8>>,
+    ) -> Result<()> {
+        let size = outputs.iter().map(|output| output.len()).sum::<usize>();
+        let held = self.mem_bytes.fetch_add(size, Ordering::Relaxed);
+        let over_budget = self.budget.map_or(false, |budget| held + size > budget);
+        if over_budget {
+            if let Some(dir) = self.spill_dir.lock().unwrap().clone() {
+                self.mem_bytes.fetch_sub(size, Ordering::Relaxed);
+                let output = SpilledOutput::write(dir, shuffle_id, input_id, &outputs)?;
+                log::info!(
+                    "spilled {} bytes of shuffle #{} map output #{}",
+                    size,
+                    shuffle_id,
+                    input_id
+                );
+                self.spilled.insert((shuffle_id, input_id), Arc::new(output));
+                return Ok(());
+            }
+            log::warn!("shuffle memory budget exceeded but no spill dir is set");
+        }
+        for (reduce_id, output) in outputs.into_iter().enumerate() {
+            self.in_memory
+                .insert((shuffle_id, input_id, reduce_id), output.into());
+        }
+        Ok(())
+    }
+
+    #[cfg(test)]
+    pub fn insert(&self, key: (usize, usize, usize), data: Bytes) {
+        self.mem_bytes.fetch_add(data.len(), Ordering::Relaxed);
+        self.in_memory.insert(key, data);
+    }
+
+    /// Adds part `seq` of the output of map task `input_id` for reducer `reduce_id`. A rerun of
+    /// the map task replaces the parts of the same number.
+    pub fn push_part(
+        &self,
+        shuffle_id: usize,
+        input_id: usize,
+        reduce_id: usize,
+        seq: usize,
+        part: Bytes,
+    ) {
+        let mut log = self.merged.entry((shuffle_id, reduce_id)).or_default();
+        if !log.finished.contains(&input_id) {
+            log.pending.entry(input_id).or_default().insert(seq, part);
+        }
+    }
+
+    /// Appends parts `0..num_parts` of map task `input_id` to the merged log, false if some of
+    /// them never arrived. A map task that finished before, e.g. a speculative copy, is not
+    /// appended again.
+    pub fn finish_pushes(
+        &self,
+        shuffle_id: usize,
+        input_id: usize,
+        reduce_id: usize,
+        num_parts: usize,
+    ) -> bool {
+        let mut log = self.merged.entry((shuffle_id, reduce_id)).or_default();
+        if log.finished.contains(&input_id) {
+            return true;
+        }
+        let arrived = log
+            .pending
+            .get(&input_id)
+            .map_or(0, |parts| parts.range(..num_parts).count());
+        if arrived != num_parts {
+            return false;
+        }
+        let mut parts = log.pending.remove(&input_id).unwrap_or_default();
+        // parts a failed run pushed past the end of this one
+        parts.split_off(&num_parts);
+        log.finished.insert(input_id);
+        log.parts.extend(parts.into_iter().map(|(_, part)| part));
+        true
+    }
+
+    /// The merged parts of reducer `reduce_id`, if map tasks `0..num_inputs` have all finished
+    /// pushing.
+    pub fn merged(
+        &self,
+        shuffle_id: usize,
+        reduce_id: usize,
+        num_inputs: usize,
+    ) -> Option<Vec<Bytes>> {
+        let log = self.merged.get(&(shuffle_id, reduce_id))?;
+        if (0..num_inputs).all(|input_id| log.finished.contains(&input_id)) {
+            Some(log.parts.clone())
+        } else {
+            None
+        }
+    }
+
+    /// Holds the result of task `task_id` until the driver fetches it.
+    pub fn put_task_result(&self, task_id: usize, result: Bytes) {
+        self.task_results.insert(task_id, result);
+    }
+
+    /// The result of task `task_id`, which is only ever fetched once.
+    pub fn take_task_result(&self, task_id: usize) -> Option<Bytes> {
+        self.task_results.remove(&task_id).map(|(_, result)| result)
+    }
+
+    /// Drops the outputs of every shuffle and the results not fetched, for the next job, which
+    /// numbers its shuffles from 0 again.
+    pub fn clear(&self) {
+        let shuffle_ids = self
+            .spilled
+            .iter()
+            .map(|entry| entry.key().0)
+            .collect::<HashSet<_>>();
+        self.in_memory.clear();
+        self.spilled.clear();
+        self.merged.clear();
+        self.task_results.clear();
+        self.mem_bytes.store(0, Ordering::Relaxed);
+        if let Some(dir) = self.spill_dir.lock().unwrap().clone() {
+            for shuffle_id in shuffle_ids {
+                let _ = fs::remove_dir_all(dir.join(format!("{}", shuffle_id)));
+            }
+        }
+    }
+
+    pub fn get(&self, key: &(usize, usize, usize)) -> Option<ShuffleEntry> {
+        if let Some(data) = self.in_memory.get(key) {
+            return Some(ShuffleEntry::Memory(data.clone()));
+        }
+        let (shuffle_id, input_id, reduce_id) = *key;
+        self.spilled
+            .get(&(shuffle_id, input_id))
+            .filter(|output| reduce_id + 1 < output.offsets.len())
+            .map(|output| ShuffleEntry::Spilled {
+                output: output.clone(),
+                reduce_id,
+            })
+    }
+}
+
+impl SpilledOutput {
+    fn write(
+        dir: PathBuf,
+        shuffle_id: usize,
+        input_id: usize,
+        outputs: &[Vec<u8>],
+    ) -> Result<Self> {
+        let dir = dir.join(format!("{}", shuffle_id));
+        fs::create_dir_all(&dir)?;
+        let path = dir.join(format!("{}.data", input_id));
+        let mut writer = BufWriter::new(File::create(&path)?);
+        let mut offsets = Vec::with_capacity(outputs.len() + 1);
+        let mut offset = 0;
+        offsets.push(offset);
+        for output in outputs {
+            writer.write_all(output)?;
+            offset += output.len() as u64;
+            offsets.push(offset);
+        }
+        writer.flush()?;
+        drop(writer);
+        Ok(SpilledOutput {
+            file: Arc::new(File::open(&path)?),
+            offsets,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn spill_over_budget() -> Result<()> {
+        let dir = std::env::temp_dir().join(format!("ns-shuffle-store-{}", uuid::Uuid::new_v4()));
+        let store = ShuffleStore::new(Some(8));
+        store.set_spill_dir(dir.clone());
+        store.put_map_output(0, 0, vec![b"abc".to_vec(), b"de".to_vec()])?;
+        store.put_map_output(0, 1, vec![b"fgh".to_vec(), b"ijklm".to_vec()])?;
+        assert_eq!(store.mem_bytes(), 5);
+
+        let entry = store.get(&(0, 0, 1)).unwrap();
+        assert!(!entry.is_spilled());
+        assert_eq!(entry.read(0, 10)?.to_vec(), b"de".to_vec());
+        let entry = store.get(&(0, 1, 1)).unwrap();
+        assert!(entry.is_spilled());
+        assert_eq!(entry.len(), 5);
+        assert_eq!(entry.read(1, 3)?.to_vec(), b"jk".to_vec());
+        assert_eq!(entry.read(4, 10)?.to_vec(), b"m".to_vec());
+        assert!(store.get(&(0, 1, 2)).is_none());
+        fs::remove_dir_all(dir)?;
+        Ok(())
+    }
+
+    #[test]
+    fn merge_pushed_parts() {
+        let store = ShuffleStore::new(None);
+        // a failed run of map task 1, then the one that finishes
+        store.push_part(0, 1, 0, 2, b"x".to_vec().into());
+        store.push_part(0, 1, 0, 0, b"y".to_vec().into());
+        store.push_part(0, 1, 0, 1, b"c".to_vec().into());
+        store.push_part(0, 0, 0, 0, b"b".to_vec().into());
+        store.push_part(0, 1, 0, 0, b"a".to_vec().into());
+        assert!(store.finish_pushes(0, 1, 0, 2));
+        assert!(store.merged(0, 0, 2).is_none());
+        assert!(!store.finish_pushes(0, 0, 0, 2));
+        assert!(store.finish_pushes(0, 0, 0, 1));
+        // a speculative copy of map task 1 is dropped
+        store.push_part(0, 1, 0, 0, b"d".to_vec().into());
+        assert!(store.finish_pushes(0, 1, 0, 1));
+        let parts = store.merged(0, 0, 2).unwrap();
+        assert_eq!(parts.concat(), b"acb".to_vec());
+        assert!(store.merged(0, 1, 1).is_none());
+    }
+}
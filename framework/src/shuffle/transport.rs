@@ -0,0 +1,327 @@
+//! How reducers pull the map outputs of a secure shuffle from the shuffle servers, see
+//! `ShuffleFetcher::secure_fetch`.
+//!
+//! The outputs are ciphertext framed by `encode_buckets`, so a transport moves them as they are
+//! and never looks inside. VEGA_SHUFFLE_TRANSPORT picks one for the whole cluster:
+//!
+//! - `http`, the default: a batch request over the HTTP/2 connection every executor keeps to
+//!   every shuffle server, served in `max_len` sections.
+//! - `tcp`: a connection of its own per batch to a listener next to the HTTP server. Outputs in
+//!   memory are written from the cached buffers, spilled ones with `sendfile` straight from the
+//!   page cache, so the server never copies them through user space. A fetcher learns the port
+//!   of the listener from the HTTP server once per server.
+//!
+//! Pushed shuffles and task results always go over HTTP.
+
+use std::convert::TryFrom;
+use std::io;
+use std::net::{IpAddr, SocketAddr, TcpListener as StdTcpListener};
+use std::os::unix::io::AsRawFd;
+
+use crate::env;
+use crate::shuffle::shuffle_fetcher::BucketsDecoder;
+use crate::shuffle::shuffle_manager::max_len;
+use crate::shuffle::*;
+use dashmap::DashMap;
+use hyper::body::HttpBody;
+use hyper::Uri;
+use once_cell::sync::{Lazy, OnceCell};
+use serde_derive::{Deserialize, Serialize};
+use tokio::io::{AsyncReadExt, AsyncWriteExt, Interest};
+use tokio::net::{TcpListener, TcpStream};
+
+#[derive(Clone, Copy, PartialEq, Debug, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum TransportKind {
+    Http,
+    Tcp,
+}
+
+#[async_trait::async_trait]
+pub(super) trait ShuffleTransport: Send + Sync {
+    /// Feeds the outputs of the map tasks `input_ids` for `reduce_id`, in that order, from the
+    /// shuffle server at `server_uri` to `decoder`. Fails if any of them is not there.
+    async fn fetch_batch(
+        &self,
+        server_uri: &str,
+        shuffle_id: usize,
+        reduce_id: usize,
+        input_ids: &[usize],
+        decoder: &mut BucketsDecoder,
+    ) -> Result<()>;
+}
+
+/// The transport of this executor, the same on the whole cluster.
+pub(super) fn transport() -> &'static dyn ShuffleTransport {
+    static HTTP: HttpTransport = HttpTransport;
+    static TCP: TcpTransport = TcpTransport;
+    match env::Configuration::get().shuffle_transport {
+        TransportKind::Http => &HTTP,
+        TransportKind::Tcp => &TCP,
+    }
+}
+
+pub(super) struct HttpTransport;
+
+impl HttpTransport {
+    /// `{server}/shuffle_batch/{shuffle_id}/{reduce_id}/{input_id},{input_id},...`
+    fn make_batch_uri(
+        server_uri: &str,
+        shuffle_id: usize,
+        reduce_id: usize,
+        input_ids: &[usize],
+    ) -> Result<Uri> {
+        let input_ids = input_ids
+            .iter()
+            .map(|input_id| input_id.to_string())
+            .collect::<Vec<_>>()
+            .join(",");
+        let uri = format!(
+            "{}/shuffle_batch/{}/{}/{}",
+            server_uri, shuffle_id, reduce_id, input_ids
+        );
+        Ok(Uri::try_from(uri.as_str())?)
+    }
+}
+
+#[async_trait::async_trait]
+impl ShuffleTransport for HttpTransport {
+    async fn fetch_batch(
+        &self,
+        server_uri: &str,
+        shuffle_id: usize,
+        reduce_id: usize,
+        input_ids: &[usize],
+        decoder: &mut BucketsDecoder,
+    ) -> Result<()> {
+        let batch_uri =
+            HttpTransport::make_batch_uri(server_uri, shuffle_id, reduce_id, input_ids)?;
+        let res = CLIENT.get(batch_uri).await?;
+        if res.status() != StatusCode::OK {
+            return Err(ShuffleError::FailedFetchOp);
+        }
+        let mut body = res.into_body();
+        while let Some(frame) = body.data().await {
+            decoder.feed(&frame.map_err(|_| ShuffleError::FailedFetchOp)?)?;
+        }
+        Ok(())
+    }
+}
+
+/// A batch request on the raw listener is `(shuffle_id, reduce_id, input_ids)` in bincode, led
+/// by its length as a little endian u64. The answer is a status byte and, if it is `FOUND`, the
+/// length of the outputs as a little endian u64 and the outputs back to back.
+const FOUND: u8 = 0;
+const NOT_FOUND: u8 = 1;
+/// Larger requests are refused.
+const MAX_REQUEST_BYTES: u64 = 1 << 20;
+
+/// Port of the raw listener of this executor, if it runs one.
+static TCP_PORT: OnceCell<u16> = OnceCell::new();
+/// Raw listener of every shuffle server fetched from, by the URI of its HTTP server.
+static TCP_ADDRS: Lazy<DashMap<String, SocketAddr>> = Lazy::new(DashMap::new);
+
+/// The port the HTTP server of this executor gives out for its raw listener.
+pub(super) fn tcp_port() -> Option<u16> {
+    TCP_PORT.get().copied()
+}
+
+/// Starts the raw listener of the shuffle server on a free port of `ip`.
+pub(super) fn start_tcp_server(ip: std::net::Ipv4Addr) -> Result<u16> {
+    let (conn, port) = crate::utils::get_free_connection(ip)?;
+    serve_tcp(conn)?;
+    TCP_PORT
+        .set(port)
+        .map_err(|_| ShuffleError::FailedToStart)?;
+    log::debug!("started raw shuffle listener on port {}", port);
+    Ok(port)
+}
+
+fn serve_tcp(conn: StdTcpListener) -> Result<()> {
+    conn.set_nonblocking(true)?;
+    let listener = TcpListener::from_std(conn)?;
+    tokio::spawn(async move {
+        loop {
+            match listener.accept().await {
+                Ok((stream, _)) => {
+                    tokio::spawn(async move {
+                        if let Err(err) = serve_batch(stream).await {
+                            log::warn!("raw shuffle request failed: {}", err);
+                        }
+                    });
+                }
+                Err(err) => log::warn!("raw shuffle listener: {}", err),
+            }
+        }
+    });
+    Ok(())
+}
+
+async fn serve_batch(mut stream: TcpStream) -> io::Result<()> {
+    stream.set_nodelay(true)?;
+    let len = stream.read_u64_le().await?;
+    if len > MAX_REQUEST_BYTES {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "oversized request",
+        ));
+    }
+    let mut request = vec![0; len as usize];
+    stream.read_exact(&mut request).await?;
+    let (shuffle_id, reduce_id, input_ids): (usize, usize, Vec<usize>) =
+        bincode::deserialize(&request)
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+    // As over HTTP, every output is looked up before any byte is sent.
+    let batch = input_ids
+        .into_iter()
+        .map(|input_id| env::SHUFFLE_STORE.get(&(shuffle_id, input_id, reduce_id)))
+        .collect::<Option<Vec<_>>>();
+    let batch = match batch {
+        Some(batch) => batch,
+        None => return stream.write_u8(NOT_FOUND).await,
+    };
+    for entry in &batch {
+        entry.prefetch();
+    }
+    let total = batch.iter().map(|entry| entry.len() as u64).sum::<u64>();
+    let mut header = [0; 9];
+    header[0] = FOUND;
+    header[1..].copy_from_slice(&total.to_le_bytes());
+    stream.write_all(&header).await?;
+    for entry in batch {
+        match entry.spilled_at() {
+            Some((file, offset)) => send_file(&stream, &file, offset, entry.len()).await?,
+            None => stream.write_all(&entry.read(0, entry.len())?).await?,
+        }
+    }
+    stream.shutdown().await
+}
+
+/// Sends `len` bytes of `file` from `offset` with `sendfile`, waiting whenever the socket is full.
+async fn send_file(
+    stream: &TcpStream,
+    file: &std::fs::File,
+    offset: u64,
+    len: usize,
+) -> io::Result<()> {
+    let mut offset = offset as libc::off_t;
+    let end = offset + len as libc::off_t;
+    while offset < end {
+        stream.writable().await?;
+        let sent = stream.try_io(Interest::WRITABLE, || {
+            let left = (end - offset) as usize;
+            let sent =
+                unsafe { libc::sendfile(stream.as_raw_fd(), file.as_raw_fd(), &mut offset, left) };
+            if sent < 0 {
+                Err(io::Error::last_os_error())
+            } else {
+                Ok(sent)
+            }
+        });
+        match sent {
+            Ok(0) => return Err(io::ErrorKind::UnexpectedEof.into()),
+            Ok(_) => {}
+            Err(err) if err.kind() == io::ErrorKind::WouldBlock => {}
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(())
+}
+
+pub(super) struct TcpTransport;
+
+impl TcpTransport {
+    /// The raw listener of the shuffle server at `server_uri`, asked of its HTTP server once.
+    async fn addr_of(server_uri: &str) -> Result<SocketAddr> {
+        if let Some(addr) = TCP_ADDRS.get(server_uri) {
+            return Ok(*addr);
+        }
+        let uri = Uri::try_from(format!("{}/shuffle_tcp_port", server_uri).as_str())?;
+        let ip = uri
+            .host()
+            .and_then(|host| host.parse::<IpAddr>().ok())
+            .ok_or_else(|| ShuffleError::UnexpectedUri(server_uri.to_string()))?;
+        let res = CLIENT.get(uri).await?;
+        if res.status() != StatusCode::OK {
+            return Err(ShuffleError::FailedFetchOp);
+        }
+        let body = hyper::body::to_bytes(res.into_body()).await?;
+        let port = std::str::from_utf8(&body)
+            .ok()
+            .and_then(|port| port.parse::<u16>().ok())
+            .ok_or(ShuffleError::FailedFetchOp)?;
+        let addr = SocketAddr::new(ip, port);
+        TCP_ADDRS.insert(server_uri.to_string(), addr);
+        Ok(addr)
+    }
+}
+
+#[async_trait::async_trait]
+impl ShuffleTransport for TcpTransport {
+    async fn fetch_batch(
+        &self,
+        server_uri: &str,
+        shuffle_id: usize,
+        reduce_id: usize,
+        input_ids: &[usize],
+        decoder: &mut BucketsDecoder,
+    ) -> Result<()> {
+        let addr = TcpTransport::addr_of(server_uri).await?;
+        let mut stream = TcpStream::connect(addr).await?;
+        stream.set_nodelay(true)?;
+        let request = bincode::serialize(&(shuffle_id, reduce_id, input_ids))?;
+        stream.write_u64_le(request.len() as u64).await?;
+        stream.write_all(&request).await?;
+        match stream.read_u8().await? {
+            FOUND => {}
+            _ => return Err(ShuffleError::RequestedCacheNotFound),
+        }
+        let mut left = stream.read_u64_le().await?;
+        let mut buf = vec![0; std::cmp::min(max_len() as u64, left) as usize];
+        while left > 0 {
+            let want = std::cmp::min(buf.len() as u64, left) as usize;
+            let n = stream.read(&mut buf[..want]).await?;
+            if n == 0 {
+                return Err(ShuffleError::FailedFetchOp);
+            }
+            decoder.feed(&buf[..n])?;
+            left -= n as u64;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::rdd::ItemE;
+
+    #[tokio::test]
+    async fn batch_over_tcp() -> StdResult<(), Box<dyn std::error::Error + 'static>> {
+        let ip = env::Configuration::get().local_ip;
+        let port = start_tcp_server(ip)?;
+        let first: Vec<Vec<Vec<ItemE>>> = vec![vec![vec![vec![1, 2, 3]]], vec![]];
+        let second: Vec<Vec<Vec<ItemE>>> = vec![vec![], vec![vec![vec![4; 10]]]];
+        env::SHUFFLE_STORE.insert((12000, 0, 1), encode_buckets(&first).into());
+        env::SHUFFLE_STORE.insert((12000, 1, 1), encode_buckets(&second).into());
+        let server_uri = "http://raw-listener";
+        TCP_ADDRS.insert(server_uri.to_string(), SocketAddr::new(ip.into(), port));
+
+        let mut decoder = BucketsDecoder::new();
+        TcpTransport
+            .fetch_batch(server_uri, 12000, 1, &[1, 0], &mut decoder)
+            .await?;
+        assert_eq!(
+            decoder.finish(2)?,
+            vec![vec![vec![vec![1, 2, 3]]], vec![vec![vec![4; 10]]]]
+        );
+
+        // one missing output fails the whole batch
+        let mut decoder = BucketsDecoder::new();
+        assert!(TcpTransport
+            .fetch_batch(server_uri, 12000, 1, &[0, 2], &mut decoder)
+            .await
+            .is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,128 @@
+//! Micro-batches over a directory that encrypted input files keep arriving in.
+//!
+//! A `FileStream` cuts time into intervals and hands out, at the end of each, the reader config
+//! of the files of its directory last modified during it, so the job of a batch reads the new
+//! files only, not the whole history. Files must be moved into the directory once written, as a
+//! file still being written could be read in one batch and again in the next. The times compared
+//! are the modification times of the filesystem, so all nodes must share its clock.
+//!
+//! A job that keeps a running state by key over the batches holds it in a `KeyedState`: the state
+//! after a batch is the cogroup of the batch with the state before, see
+//! `PairRdd::update_state_by_key`, and stays cached as encrypted partitions until the state after
+//! the next batch is computed. The lineage of the state grows with every batch, so a long running
+//! stream checkpoints it now and then, see `Rdd::checkpoint`.
+
+use std::hash::Hash;
+use std::path::PathBuf;
+use std::thread;
+use std::time::{Duration, Instant, SystemTime};
+
+use crate::io::LocalFsReaderConfig;
+use crate::partitioner::Partitioner;
+use crate::rdd::{PairRdd, Rdd};
+use crate::serializable_traits::{Data, SerFunc};
+use crate::SerArc;
+
+/// The files of a directory, one interval at a time.
+pub struct FileStream {
+    dir: PathBuf,
+    interval: Duration,
+    /// the files modified before it were in earlier batches
+    since: SystemTime,
+    /// end of the current interval
+    next: Instant,
+}
+
+impl FileStream {
+    /// Batches of the files of `dir` modified from now on, one per `interval`.
+    pub fn new<T: Into<PathBuf>>(dir: T, interval: Duration) -> Self {
+        FileStream {
+            dir: dir.into(),
+            interval,
+            since: SystemTime::now(),
+            next: Instant::now() + interval,
+        }
+    }
+
+    /// Makes the first batch read the files modified since `since` as well, e.g. the ones left
+    /// from before a restart.
+    pub fn starting_at(mut self, since: SystemTime) -> Self {
+        self.since = since;
+        self
+    }
+
+    /// Waits for the end of the current interval and returns the config of a reader of the files
+    /// modified until then that no batch read before. A batch that took longer than the interval
+    /// is followed by the next one right away.
+    pub fn next_batch(&mut self) -> LocalFsReaderConfig {
+        let now = Instant::now();
+        if now < self.next {
+            thread::sleep(self.next - now);
+        }
+        self.next = Instant::max(self.next + self.interval, Instant::now());
+        let until = SystemTime::now();
+        let config = LocalFsReaderConfig::new(self.dir.clone()).modified_between(self.since, until);
+        self.since = until;
+        config
+    }
+}
+
+/// A state by key carried from a batch to the next one.
+pub struct KeyedState<K: Data, S: Data> {
+    state: Option<SerArc<dyn Rdd<Item = (K, S)>>>,
+    /// the state before, whose partitions the computed state was made from
+    retired: Option<SerArc<dyn Rdd<Item = (K, S)>>>,
+}
+
+impl<K, S> KeyedState<K, S>
+where
+    K: Data + Eq + Hash,
+    S: Data,
+{
+    pub fn new() -> Self {
+        KeyedState {
+            state: None,
+            retired: None,
+        }
+    }
+
+    /// The state after the previous batch, None before the first one.
+    pub fn get(&self) -> Option<SerArc<dyn Rdd<Item = (K, S)>>> {
+        self.state.clone()
+    }
+
+    /// The state once `batch` is folded into it by `f`, see `PairRdd::update_state_by_key`. It is
+    /// cached when the action of the batch computes it, and the state it is made from is only
+    /// released at the next update, once that is done.
+    #[track_caller]
+    pub fn update<V, F>(
+        &mut self,
+        batch: SerArc<dyn Rdd<Item = (K, V)>>,
+        f: F,
+        partitioner: Box<dyn Partitioner>,
+    ) -> SerArc<dyn Rdd<Item = (K, S)>>
+    where
+        V: Data,
+        F: SerFunc((Vec<V>, Option<S>)) -> Option<S> + Clone,
+    {
+        let prev = self.state.take();
+        let next = batch.update_state_by_key(prev.clone(), f, partitioner);
+        next.cache();
+        // The batch computed last read the partitions of this one, the next batch does not.
+        if let Some(done) = std::mem::replace(&mut self.retired, prev) {
+            done.uncache();
+        }
+        self.state = Some(next.clone());
+        next
+    }
+}
+
+impl<K, S> Default for KeyedState<K, S>
+where
+    K: Data + Eq + Hash,
+    S: Data,
+{
+    fn default() -> Self {
+        KeyedState::new()
+    }
+}
@@ -0,0 +1,208 @@
+//! Microbenchmark of the tcmalloc that manages the outside memory of the enclave, for
+//! `app tcbench`.
+//!
+//! Every run enters the enclave from a number of host threads at once and has each of them do
+//! malloc/free pairs on the outside heap in a loop, see enclave/gperftools/tcmalloc_bench.cc.
+//! Those calls stay inside the enclave, only the pages the heap grows by cost a transition, so
+//! next to the throughput a run reports the `sbrk_o` and `mmap_o` OCALLs the host served and how
+//! often the threads found a central freelist or a transfer cache shard locked. The threads all
+//! go to the enclave of the calling thread, whose counters are the ones read.
+
+use std::str::FromStr;
+use std::sync::Barrier;
+use std::time::Instant;
+
+use crate::env::{self, Env};
+use crate::transitions::{self, Site};
+use serde_derive::{Deserialize, Serialize};
+use sgx_types::*;
+
+extern "C" {
+    fn bench_tcmalloc(
+        eid: sgx_enclave_id_t,
+        retval: *mut u64,
+        ops: u64,
+        seed: u64,
+        dist: u32,
+        block_bytes: u64,
+        shared: i32,
+    ) -> sgx_status_t;
+    fn bench_tcmalloc_drain(eid: sgx_enclave_id_t) -> sgx_status_t;
+}
+
+/// The sizes the threads allocate, numbered as in tcmalloc_bench.cc.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum SizeDist {
+    /// Ciphertexts of half to one and a half encryption blocks, one in eight allocations small.
+    Ciphertext = 0,
+    /// 16 bytes to 1 KiB.
+    Small = 1,
+    /// 64 KiB to 1 MiB.
+    Large = 2,
+}
+
+impl FromStr for SizeDist {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "ciphertext" => Ok(SizeDist::Ciphertext),
+            "small" => Ok(SizeDist::Small),
+            "large" => Ok(SizeDist::Large),
+            _ => Err(format!("unknown size distribution {}", s)),
+        }
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct TcBenchConfig {
+    /// A run for each of these thread counts, clamped to `max_threads`.
+    pub threads: Vec<usize>,
+    /// malloc/free pairs per thread.
+    pub ops: u64,
+    pub dist: SizeDist,
+    /// The encryption block the ciphertext sizes are drawn around, by default the configured one.
+    pub block_bytes: usize,
+    /// Whether the threads free each other's objects rather than their own.
+    pub shared: bool,
+    pub seed: u64,
+}
+
+impl TcBenchConfig {
+    pub fn new() -> Self {
+        TcBenchConfig {
+            threads: vec![1, 2, 4, 8, 16, 32, 64],
+            ops: 1_000_000,
+            dist: SizeDist::Ciphertext,
+            block_bytes: env::Configuration::get().enc_block_bytes,
+            shared: false,
+            seed: 0,
+        }
+    }
+}
+
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct TcBenchResult {
+    pub threads: usize,
+    pub seconds: f64,
+    /// Millions of malloc/free pairs per second, over all threads.
+    pub mops: f64,
+    pub sbrk_calls: u64,
+    pub sbrk_per_s: f64,
+    pub mmap_calls: u64,
+    pub madvise_calls: u64,
+    /// Times a thread found a central freelist locked, and a transfer cache shard.
+    pub central_contentions: u64,
+    pub shard_contentions: u64,
+    /// Batches the transfer cache shards served without the central freelist.
+    pub shard_hits: u64,
+    /// What the heap holds from the system after the run.
+    pub system_bytes: u64,
+}
+
+/// The most threads a run can enter the enclave with: its TCSs less those of the threads of the
+/// enclave and of the calling thread.
+pub fn max_threads() -> usize {
+    env::ENCLAVE_TCS_NUM
+        .saturating_sub(env::Configuration::get().enclave_thread_tcs() + 1)
+        .max(1)
+}
+
+fn run_once(config: &TcBenchConfig, threads: usize) -> TcBenchResult {
+    let env = Env::get();
+    let enclave = Env::bound_enclave();
+    let stats_before = env.get_tc_stats();
+    let transitions_before = transitions::snapshot();
+    let barrier = Barrier::new(threads + 1);
+    let start = crossbeam::scope(|scope| {
+        for t in 0..threads {
+            let barrier = &barrier;
+            scope.spawn(move |_| {
+                let _bound = Env::bind_enclave(enclave);
+                let guard = Env::enter();
+                let mut checksum = 0;
+                barrier.wait();
+                let sgx_status = unsafe {
+                    bench_tcmalloc(
+                        guard.eid(),
+                        &mut checksum,
+                        config.ops,
+                        config.seed.wrapping_add(t as u64),
+                        config.dist as u32,
+                        config.block_bytes as u64,
+                        config.shared as i32,
+                    )
+                };
+                if sgx_status != sgx_status_t::SGX_SUCCESS {
+                    panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+                }
+                checksum
+            });
+        }
+        barrier.wait();
+        Instant::now()
+    })
+    .unwrap();
+    let seconds = start.elapsed().as_secs_f64();
+    let transitions = transitions::snapshot().since(&transitions_before);
+    let stats = env.get_tc_stats();
+    if config.shared {
+        let guard = Env::enter();
+        let sgx_status = unsafe { bench_tcmalloc_drain(guard.eid()) };
+        if sgx_status != sgx_status_t::SGX_SUCCESS {
+            panic!("[-] ECALL Enclave Failed {}!", sgx_status.as_str());
+        }
+    }
+    let sbrk_calls = transitions.count(Site::OcallSbrk);
+    TcBenchResult {
+        threads,
+        seconds,
+        mops: (threads as u64 * config.ops) as f64 / seconds * 1e-6,
+        sbrk_calls,
+        sbrk_per_s: sbrk_calls as f64 / seconds,
+        mmap_calls: transitions.count(Site::OcallMmap),
+        madvise_calls: transitions.count(Site::OcallMadvise),
+        central_contentions: stats.central_contentions - stats_before.central_contentions,
+        shard_contentions: stats.shard_contentions - stats_before.shard_contentions,
+        shard_hits: stats.shard_hits - stats_before.shard_hits,
+        system_bytes: stats.system_bytes,
+    }
+}
+
+/// One run per thread count of `config`, in order. A thread count is only run once if clamping
+/// makes it repeat.
+pub fn run(config: &TcBenchConfig) -> Vec<TcBenchResult> {
+    let mut threads = config
+        .threads
+        .iter()
+        .map(|&n| n.max(1).min(max_threads()))
+        .collect::<Vec<_>>();
+    threads.dedup();
+    threads
+        .into_iter()
+        .map(|n| {
+            let result = run_once(config, n);
+            log::info!(
+                "tcbench {} threads: {:.2} Mops/s, {} sbrk_o, {} central contentions",
+                n,
+                result.mops,
+                result.sbrk_calls,
+                result.central_contentions
+            );
+            result
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn parses_size_distributions() {
+        assert_eq!("ciphertext".parse::<SizeDist>(), Ok(SizeDist::Ciphertext));
+        assert_eq!("large".parse::<SizeDist>().map(|d| d as u32), Ok(2));
+        assert!("huge".parse::<SizeDist>().is_err());
+    }
+}
@@ -0,0 +1,301 @@
+//! Timeline of the spans of a job, written in the Chrome trace event format.
+//!
+//! With VEGA_TRACE set, the scheduler, the shuffle fetches and the ECALLs of every process record
+//! spans here. The spans recorded while a task runs are taken along with its result, the same way
+//! as its enclave metrics, and the driver files them under the job of the task. An executor says
+//! when it received the task and when it sent the result by its own clock, and the driver aligns
+//! its spans by the midpoint of the two offsets that gives, as NTP does. When the job ends the
+//! driver writes `trace-job-<id>.json` to its work dir, which chrome://tracing and Perfetto open.
+
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::PathBuf;
+use std::sync::Mutex;
+use std::thread;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use crate::env::Configuration;
+use once_cell::sync::{Lazy, OnceCell};
+use serde_derive::{Deserialize, Serialize};
+
+/// The pid of the spans of the driver, executors use their port.
+pub(crate) const DRIVER_PID: u32 = 0;
+
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct Span {
+    pub name: String,
+    pub cat: String,
+    /// Microseconds since the epoch, by the clock of the process that recorded it.
+    pub ts: u64,
+    /// 0 for an instant.
+    pub dur: u64,
+    pub tid: u64,
+    pub instant: bool,
+}
+
+/// The spans of a task and the times its executor received it and sent its result.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct TaskTrace {
+    pub pid: u32,
+    pub received: u64,
+    pub sent: u64,
+    pub spans: Vec<Span>,
+}
+
+struct Event {
+    pid: u32,
+    span: Span,
+}
+
+static DIR: OnceCell<PathBuf> = OnceCell::new();
+
+/// Recorded and not yet taken by a task.
+static PENDING: Lazy<Mutex<Vec<Span>>> = Lazy::new(|| Mutex::new(Vec::new()));
+
+/// The spans of the jobs the driver runs, by run id, and the names of their processes.
+static JOBS: Lazy<Mutex<HashMap<usize, (Vec<Event>, HashMap<u32, String>)>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+pub(crate) fn enabled() -> bool {
+    Configuration::get().trace
+}
+
+/// Where the driver writes the traces of its jobs.
+pub(crate) fn set_dir(dir: PathBuf) {
+    let _ = DIR.set(dir);
+}
+
+pub(crate) fn now_us() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map_or(0, |d| d.as_micros() as u64)
+}
+
+fn tid() -> u64 {
+    thread::current().id().as_u64().into()
+}
+
+/// Records the time from its creation to its drop as a span of the task that is running.
+pub(crate) struct SpanGuard {
+    span: Option<Span>,
+}
+
+impl Drop for SpanGuard {
+    fn drop(&mut self) {
+        if let Some(mut span) = self.span.take() {
+            span.dur = now_us().saturating_sub(span.ts);
+            PENDING.lock().unwrap().push(span);
+        }
+    }
+}
+
+pub(crate) fn span(name: impl Into<String>, cat: &str) -> SpanGuard {
+    if !enabled() {
+        return SpanGuard { span: None };
+    }
+    SpanGuard {
+        span: Some(Span {
+            name: name.into(),
+            cat: cat.to_string(),
+            ts: now_us(),
+            dur: 0,
+            tid: tid(),
+            instant: false,
+        }),
+    }
+}
+
+/// The spans recorded since the last call, for the task that is finishing. Those of tasks
+/// running at the same time are mixed in, as with `metrics::take_pending`.
+pub(crate) fn take_pending() -> Vec<Span> {
+    std::mem::take(&mut *PENDING.lock().unwrap())
+}
+
+/// The trace an executor sends back with the result of a task received at `received`.
+pub(crate) fn task_trace(pid: u32, received: u64) -> Option<TaskTrace> {
+    if !enabled() {
+        return None;
+    }
+    Some(TaskTrace {
+        pid,
+        received,
+        sent: now_us(),
+        spans: take_pending(),
+    })
+}
+
+fn add(job: usize, pid: u32, spans: impl IntoIterator<Item = Span>) {
+    let mut jobs = JOBS.lock().unwrap();
+    let (events, _) = jobs.entry(job).or_default();
+    events.extend(spans.into_iter().map(|span| Event { pid, span }));
+}
+
+/// Records a span of the driver itself under `job`, from `start` until now.
+pub(crate) fn record(job: usize, name: impl Into<String>, cat: &str, tid: u64, start: u64) {
+    if !enabled() {
+        return;
+    }
+    let span = Span {
+        name: name.into(),
+        cat: cat.to_string(),
+        ts: start,
+        dur: now_us().saturating_sub(start),
+        tid,
+        instant: false,
+    };
+    add(job, DRIVER_PID, Some(span));
+}
+
+pub(crate) fn instant(job: usize, name: impl Into<String>, cat: &str) {
+    if !enabled() {
+        return;
+    }
+    let span = Span {
+        name: name.into(),
+        cat: cat.to_string(),
+        ts: now_us(),
+        dur: 0,
+        tid: tid(),
+        instant: true,
+    };
+    add(job, DRIVER_PID, Some(span));
+}
+
+/// The offset of the clock of an executor from that of the driver, which sent it the task at
+/// `launched` and had the result back at `returned`.
+fn clock_offset(launched: u64, returned: u64, trace: &TaskTrace) -> i64 {
+    let there = trace.received as i64 - launched as i64;
+    let back = trace.sent as i64 - returned as i64;
+    (there + back) / 2
+}
+
+/// Files the trace of a task of `job` an executor sent back, in the clock of the driver.
+pub(crate) fn add_task_trace(job: usize, launched: u64, returned: u64, trace: TaskTrace) {
+    let offset = clock_offset(launched, returned, &trace);
+    let spans = trace.spans.into_iter().map(|mut span| {
+        span.ts = (span.ts as i64 - offset).max(0) as u64;
+        span
+    });
+    add(job, trace.pid, spans);
+    let mut jobs = JOBS.lock().unwrap();
+    let (_, names) = jobs.entry(job).or_default();
+    names
+        .entry(trace.pid)
+        .or_insert_with(|| format!("executor @{}", trace.pid));
+}
+
+/// Files the spans of a task that ran in the driver.
+pub(crate) fn add_local_spans(job: usize, spans: Vec<Span>) {
+    if !spans.is_empty() {
+        add(job, DRIVER_PID, spans);
+    }
+}
+
+fn escape(s: &str) -> String {
+    s.replace('\\', "\\\\").replace('"', "\\\"")
+}
+
+fn to_json(events: &[Event], names: &HashMap<u32, String>) -> String {
+    let mut out = String::from("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    let _ = write!(
+        out,
+        "{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"driver\"}}}}",
+        DRIVER_PID
+    );
+    for (pid, name) in names {
+        let _ = write!(
+            out,
+            ",\n{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+            pid,
+            escape(name)
+        );
+    }
+    for Event { pid, span } in events {
+        let _ = write!(
+            out,
+            ",\n{{\"name\":\"{}\",\"cat\":\"{}\",\"pid\":{},\"tid\":{},\"ts\":{}",
+            escape(&span.name),
+            escape(&span.cat),
+            pid,
+            span.tid,
+            span.ts
+        );
+        if span.instant {
+            out.push_str(",\"ph\":\"i\",\"s\":\"t\"}");
+        } else {
+            let _ = write!(out, ",\"ph\":\"X\",\"dur\":{}}}", span.dur);
+        }
+    }
+    out.push_str("\n]}\n");
+    out
+}
+
+/// Writes the trace of `job` and forgets it.
+pub(crate) fn finish_job(job: usize) {
+    let (events, names) = match JOBS.lock().unwrap().remove(&job) {
+        Some(job) => job,
+        None => return,
+    };
+    let dir = match DIR.get() {
+        Some(dir) => dir,
+        None => return,
+    };
+    let path = dir.join(format!("trace-job-{}.json", job));
+    match fs::write(&path, to_json(&events, &names)) {
+        Ok(()) => log::info!("trace of job {} written to {:?}", job, path),
+        Err(err) => log::error!("failed writing trace of job {} to {:?}: {}", job, path, err),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn span(name: &str, ts: u64, dur: u64) -> Span {
+        Span {
+            name: name.to_string(),
+            cat: "task".to_string(),
+            ts,
+            dur,
+            tid: 1,
+            instant: false,
+        }
+    }
+
+    #[test]
+    fn aligns_executor_clocks() {
+        // The executor clock is 1000 us ahead, and each way takes 10 us.
+        let trace = TaskTrace {
+            pid: 10500,
+            received: 1010 + 1000,
+            sent: 1090 + 1000,
+            spans: vec![],
+        };
+        assert_eq!(clock_offset(1000, 1100, &trace), 1000);
+    }
+
+    #[test]
+    fn writes_chrome_trace_events() {
+        let events = vec![
+            Event {
+                pid: DRIVER_PID,
+                span: span("job \"0\"", 5, 20),
+            },
+            Event {
+                pid: 10500,
+                span: Span {
+                    instant: true,
+                    ..span("done", 7, 0)
+                },
+            },
+        ];
+        let mut names = HashMap::new();
+        names.insert(10500, "executor @10500".to_string());
+        let json = to_json(&events, &names);
+        assert!(json.contains("\"name\":\"job \\\"0\\\"\""));
+        assert!(json.contains("\"ph\":\"X\",\"dur\":20}"));
+        assert!(json.contains("\"pid\":10500,\"tid\":1,\"ts\":7,\"ph\":\"i\""));
+        assert!(json.contains("\"args\":{\"name\":\"executor @10500\"}"));
+    }
+}
@@ -0,0 +1,207 @@
+//! Counts and latencies of the enclave transitions of this process, per call site.
+//!
+//! Every ECALL the host makes on a hot path and every OCALL it serves is timed here, into
+//! lock-free counters with a log2 histogram of latencies per site. An ECALL is timed around the
+//! whole call, so its latency includes the enclave work. An OCALL is timed on the host side of
+//! the bridge, its transitions are not, and those of the tcmalloc that manages the outside memory
+//! of the enclave are only counted inside, see `EnclaveMetrics::ocalls`. The executor logs the
+//! difference of two snapshots for every task.
+
+use std::fmt;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Instant;
+
+use crate::metrics::{hist_quantile_ns, HIST_BUCKETS};
+use crate::trace;
+use once_cell::sync::Lazy;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) enum Site {
+    SecureExecute,
+    SecureExecutePre,
+    SecureExecuteWithPre,
+    SecureExecuteBatch,
+    SecureAction,
+    FreeResEnc,
+    FlushNodeCombine,
+    DrainMetrics,
+    OcallCacheToOutside,
+    OcallCacheFromOutside,
+    OcallCacheInvalidations,
+    OcallGetBroadcast,
+    OcallSbrk,
+    OcallMmap,
+    OcallMadvise,
+    OcallMemoryPressure,
+    OcallHeapProfileSample,
+}
+
+const NUM_SITES: usize = Site::OcallHeapProfileSample as usize + 1;
+
+const SITE_NAMES: [&str; NUM_SITES] = [
+    "secure_execute",
+    "secure_execute_pre",
+    "secure_execute_with_pre",
+    "secure_execute_batch",
+    "secure_action",
+    "free_res_enc",
+    "flush_node_combine",
+    "drain_metrics",
+    "ocall_cache_to_outside",
+    "ocall_cache_from_outside",
+    "ocall_cache_invalidations",
+    "ocall_get_broadcast",
+    "sbrk_o",
+    "mmap_o",
+    "madvise_o",
+    "memory_pressure_o",
+    "ocall_heap_profile_sample",
+];
+
+struct SiteCounters {
+    count: AtomicU64,
+    ns: AtomicU64,
+    hist: [AtomicU64; HIST_BUCKETS],
+}
+
+impl SiteCounters {
+    fn new() -> Self {
+        SiteCounters {
+            count: AtomicU64::new(0),
+            ns: AtomicU64::new(0),
+            hist: Default::default(),
+        }
+    }
+}
+
+static SITES: Lazy<Vec<SiteCounters>> =
+    Lazy::new(|| (0..NUM_SITES).map(|_| SiteCounters::new()).collect());
+
+fn hist_bucket(ns: u64) -> usize {
+    std::cmp::min(63 - ns.max(1).leading_zeros() as usize, HIST_BUCKETS - 1)
+}
+
+pub(crate) fn record(site: Site, ns: u64) {
+    let counters = &SITES[site as usize];
+    counters.count.fetch_add(1, Ordering::Relaxed);
+    counters.ns.fetch_add(ns, Ordering::Relaxed);
+    counters.hist[hist_bucket(ns)].fetch_add(1, Ordering::Relaxed);
+}
+
+/// Records the time from its creation to its drop under `site`, and as a span of the trace.
+pub(crate) struct Timed {
+    site: Site,
+    start: Instant,
+    _span: trace::SpanGuard,
+}
+
+impl Drop for Timed {
+    fn drop(&mut self) {
+        record(self.site, self.start.elapsed().as_nanos() as u64);
+    }
+}
+
+pub(crate) fn time(site: Site) -> Timed {
+    Timed {
+        site,
+        start: Instant::now(),
+        _span: trace::span(SITE_NAMES[site as usize], "enclave"),
+    }
+}
+
+#[derive(Clone, Copy, Default)]
+struct SiteStats {
+    count: u64,
+    ns: u64,
+    hist: [u64; HIST_BUCKETS],
+}
+
+/// The counters of all sites at one point in time.
+#[derive(Clone)]
+pub(crate) struct Snapshot {
+    sites: [SiteStats; NUM_SITES],
+}
+
+pub(crate) fn snapshot() -> Snapshot {
+    let mut sites = [SiteStats::default(); NUM_SITES];
+    for (stats, counters) in sites.iter_mut().zip(SITES.iter()) {
+        stats.count = counters.count.load(Ordering::Relaxed);
+        stats.ns = counters.ns.load(Ordering::Relaxed);
+        for (b, c) in stats.hist.iter_mut().zip(counters.hist.iter()) {
+            *b = c.load(Ordering::Relaxed);
+        }
+    }
+    Snapshot { sites }
+}
+
+impl Snapshot {
+    /// The transitions made between `before` and this snapshot. Those of tasks running at the
+    /// same time are included.
+    pub fn since(&self, before: &Snapshot) -> Snapshot {
+        let mut sites = self.sites;
+        for (stats, before) in sites.iter_mut().zip(before.sites.iter()) {
+            stats.count -= before.count;
+            stats.ns -= before.ns;
+            for (b, c) in stats.hist.iter_mut().zip(before.hist.iter()) {
+                *b -= *c;
+            }
+        }
+        Snapshot { sites }
+    }
+
+    pub fn count(&self, site: Site) -> u64 {
+        self.sites[site as usize].count
+    }
+
+    pub fn total(&self) -> u64 {
+        self.sites.iter().map(|stats| stats.count).sum()
+    }
+
+    /// The count and nanoseconds of the ECALLs, or of the OCALLs served by the host.
+    pub fn calls(&self, ecalls: bool) -> (u64, u64) {
+        let first_ocall = Site::OcallCacheToOutside as usize;
+        self.sites
+            .iter()
+            .enumerate()
+            .filter(|(i, _)| (*i < first_ocall) == ecalls)
+            .fold((0, 0), |(count, ns), (_, stats)| (count + stats.count, ns + stats.ns))
+    }
+}
+
+impl fmt::Display for Snapshot {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{} transitions", self.total())?;
+        for (name, stats) in SITE_NAMES.iter().zip(self.sites.iter()) {
+            if stats.count == 0 {
+                continue;
+            }
+            write!(
+                f,
+                ", {}: {} in {:.3} ms (p50 < {} ns, p99 < {} ns)",
+                name,
+                stats.count,
+                stats.ns as f64 * 1e-6,
+                hist_quantile_ns(&stats.hist, 0.5),
+                hist_quantile_ns(&stats.hist, 0.99),
+            )?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn counts_between_snapshots() {
+        let before = snapshot();
+        record(Site::OcallGetBroadcast, 1500);
+        drop(time(Site::OcallGetBroadcast));
+        let diff = snapshot().since(&before);
+        // Other tests may run ocalls of their own meanwhile, but none of these.
+        assert_eq!(diff.count(Site::OcallGetBroadcast), 2);
+        assert!(diff.to_string().contains("ocall_get_broadcast: 2"));
+        assert!(diff.calls(false).0 >= 2);
+    }
+}
@@ -1,4 +1,5 @@
 use crate::serializable_traits::Data;
+use crate::utils::bounded_priority_queue::BoundedPriorityQueue;
 use rand::{Rng, SeedableRng};
 use rand_distr::{Distribution, Poisson};
 use rand_pcg::Pcg64;
@@ -55,6 +56,69 @@ fn get_rng_with_random_seed() -> Pcg64 {
     Pcg64::seed_from_u64(rand::random::<u64>())
 }
 
+/// The rng of partition `index` of a sample, so a seeded sample is the same on every run while
+/// its partitions draw different numbers.
+pub(crate) fn get_partition_rng(seed: Option<u64>, index: usize) -> Pcg64 {
+    match seed {
+        Some(seed) => get_default_rng_from_seed(seed.wrapping_add(index as u64)),
+        None => get_rng_with_random_seed(),
+    }
+}
+
+/// An item of a bottom-k sample, ordered by the random key it drew. The k items with the smallest
+/// keys are a uniform sample without replacement, and the samples of two partitions merge into
+/// one of their union by keeping the k smallest keys of both.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct Keyed<T> {
+    key: u64,
+    pub item: T,
+}
+
+impl<T> PartialEq for Keyed<T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.key == other.key
+    }
+}
+
+impl<T> Eq for Keyed<T> {}
+
+impl<T> PartialOrd for Keyed<T> {
+    fn partial_cmp(&self, other: &Self) -> Option<std::cmp::Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl<T> Ord for Keyed<T> {
+    fn cmp(&self, other: &Self) -> std::cmp::Ordering {
+        self.key.cmp(&other.key)
+    }
+}
+
+/// Reservoir sample of `size` of `items` in one pass, ascending by key and so in random order.
+pub(crate) fn bottom_k<T: Data>(
+    items: impl Iterator<Item = T>,
+    size: usize,
+    rng: &mut Pcg64,
+) -> Vec<Keyed<T>> {
+    let mut queue = BoundedPriorityQueue::new(size);
+    items.for_each(|item| queue.append(Keyed { key: rng.gen(), item }));
+    queue.into()
+}
+
+/// How many times an item of a stratum sampled at `fraction` is drawn: at most once without
+/// replacement, and a Poisson number of times of mean `fraction` with it.
+pub(crate) fn sample_times(with_replacement: bool, fraction: f64, rng: &mut Pcg64) -> usize {
+    if fraction <= 0.0 {
+        0
+    } else if with_replacement {
+        Poisson::new(fraction).unwrap().sample(rng) as usize
+    } else if rng.gen::<f64>() < fraction {
+        1
+    } else {
+        0
+    }
+}
+
 #[derive(Clone, Copy, Serialize, Deserialize)]
 pub(crate) struct PoissonSampler {
     fraction: f64,
@@ -356,3 +420,24 @@ mod binomial_bounds {
         max.min(1.0)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::utils::bounded_priority_queue::merge_smallest;
+
+    #[test]
+    fn bottom_k_samples_merge() {
+        let mut rng = get_partition_rng(Some(7), 0);
+        let a = bottom_k(0..100u32, 10, &mut rng);
+        let b = bottom_k(100..110u32, 10, &mut rng);
+        assert_eq!(a.len(), 10);
+        let merged = merge_smallest(a, b, 10);
+        assert_eq!(merged.len(), 10);
+        let mut items = merged.into_iter().map(|keyed| keyed.item).collect::<Vec<_>>();
+        items.sort();
+        items.dedup();
+        assert_eq!(items.len(), 10);
+        assert!(bottom_k(0..3u32, 10, &mut rng).len() == 3);
+    }
+}
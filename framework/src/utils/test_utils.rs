@@ -1,6 +1,6 @@
 use std::sync::Arc;
 
-use crate::scheduler::{ResultTask, TaskContext};
+use crate::scheduler::{ResultBinary, ResultTask, StageBinary, TaskContext};
 use crate::serializable_traits::SerFunc;
 use crate::*;
 
@@ -11,5 +11,13 @@ where
     let ctxt = Context::with_mode(DeploymentMode::Local).unwrap();
     let rdd_f = Fn!(move |data: u8| -> u8 { data });
     let rdd = ctxt.parallelize(vec![0, 1, 2], 1).map(rdd_f);
-    ResultTask::new(2, 0, 0, rdd.into(), Arc::new(func), 0, vec![], 0)
+    let binary = StageBinary::new(
+        0,
+        ResultBinary {
+            rdd: rdd.into(),
+            action_id: None,
+            func: Arc::new(func),
+        },
+    );
+    ResultTask::new(2, 0, 0, binary, 0, vec![], 0, 1)
 }